@@ -9,7 +9,9 @@
 
 
 internal int page_size = 0;
-internal int total_page_count = 0;
+internal uint64_t total_page_count = 0;
+internal uint64_t committed_bytes = 0;
+internal uint64_t peak_committed_bytes = 0;
 internal void* page_memory_start = 0;
 internal struct Arena pageblock_storage = {};
 internal struct PageBlock* first_block = 0;
@@ -30,10 +32,10 @@ arena_print_usage(struct Arena* arena, char* caption)
 }
 
 void
-init_memory(int memory_amount)
+init_memory(uint64_t memory_amount)
 {
   page_size = getpagesize();
-  total_page_count = ceil(memory_amount / page_size);
+  total_page_count = (memory_amount + page_size - 1) / page_size;
   page_memory_start = mmap(0, total_page_count * page_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
   if (page_memory_start == MAP_FAILED) {
     perror("mmap");
@@ -47,6 +49,7 @@ init_memory(int memory_amount)
   memset(first_block, 0, sizeof(*first_block));
   first_block->memory_begin = (uint8_t*)page_memory_start;
   first_block->memory_end = first_block->memory_begin + (1 * page_size);
+  committed_bytes = peak_committed_bytes = page_size;
 
   block_freelist_head = first_block + 1;
   memset(block_freelist_head, 0, sizeof(*block_freelist_head));
@@ -59,12 +62,12 @@ init_memory(int memory_amount)
 }
 
 internal struct PageBlock*
-find_block_first_fit(int requested_memory_amount)
+find_block_first_fit(uint64_t requested_memory_amount)
 {
   struct PageBlock* result = 0;
   struct PageBlock* b = block_freelist_head;
   while (b) {
-    if ((b->memory_end - b->memory_begin) >= requested_memory_amount) {
+    if ((uint64_t)(b->memory_end - b->memory_begin) >= requested_memory_amount) {
       result = b;
       break;
     }
@@ -165,51 +168,86 @@ get_new_block_struct()
   return block;
 }
 
+internal struct PageBlock*
+take_rewound_block(struct Arena* arena, uint32_t size)
+{
+  struct PageBlock* b = arena->rewound_pages;
+  while (b) {
+    if ((uint64_t)(b->memory_end - b->memory_begin) >= size) {
+      break;
+    }
+    b = b->next_block;
+  }
+  if (b) {
+    if (b->prev_block) {
+      b->prev_block->next_block = b->next_block;
+    } else {
+      arena->rewound_pages = b->next_block;
+    }
+    if (b->next_block) {
+      b->next_block->prev_block = b->prev_block;
+    }
+    b->next_block = b->prev_block = 0;
+  }
+  return b;
+}
+
 void*
 arena_push(struct Arena* arena, uint32_t size)
 {
   assert (size > 0);
   uint8_t* client_memory = arena->memory_avail;
   if (client_memory + size >= (uint8_t*)arena->memory_limit) {
-    struct PageBlock* free_block = find_block_first_fit(size);
-    if (!free_block) {
-      printf("\nOut of memory.\n");
-      exit(1);
-    }
-    uint8_t* alloc_memory_begin = 0, *alloc_memory_end = 0;
-    int size_in_page_multiples = (size + page_size - 1) & ~(page_size - 1);
-    if (size_in_page_multiples < (free_block->memory_end - free_block->memory_begin)) {
-      alloc_memory_begin = free_block->memory_begin;
-      alloc_memory_end = alloc_memory_begin + size_in_page_multiples;
-      free_block->memory_begin = alloc_memory_end;
-    } else if (size_in_page_multiples == (free_block->memory_end - free_block->memory_begin)) {
-      alloc_memory_begin = free_block->memory_begin;
-      alloc_memory_end = free_block->memory_end;
-      free_block->memory_begin = alloc_memory_end;
-    } else assert (0);
-
-    if (mprotect(alloc_memory_begin, alloc_memory_end - alloc_memory_begin, PROT_READ|PROT_WRITE) != 0) {
-      perror("mprotect");
-      exit(1);
-    }
-    arena->memory_avail = alloc_memory_begin;
-    arena->memory_limit = alloc_memory_end;
+    struct PageBlock* rewound_block = take_rewound_block(arena, size);
+    if (rewound_block) {
+      arena->memory_avail = rewound_block->memory_begin;
+      arena->memory_limit = rewound_block->memory_end;
+      arena->owned_pages = block_insert_and_coalesce(arena->owned_pages, rewound_block);
+      client_memory = arena->memory_avail;
+    } else {
+      struct PageBlock* free_block = find_block_first_fit(size);
+      if (!free_block) {
+        printf("\nOut of memory.\n");
+        exit(1);
+      }
+      uint8_t* alloc_memory_begin = 0, *alloc_memory_end = 0;
+      int size_in_page_multiples = (size + page_size - 1) & ~(page_size - 1);
+      if (size_in_page_multiples < (free_block->memory_end - free_block->memory_begin)) {
+        alloc_memory_begin = free_block->memory_begin;
+        alloc_memory_end = alloc_memory_begin + size_in_page_multiples;
+        free_block->memory_begin = alloc_memory_end;
+      } else if (size_in_page_multiples == (free_block->memory_end - free_block->memory_begin)) {
+        alloc_memory_begin = free_block->memory_begin;
+        alloc_memory_end = free_block->memory_end;
+        free_block->memory_begin = alloc_memory_end;
+      } else assert (0);
+
+      if (mprotect(alloc_memory_begin, alloc_memory_end - alloc_memory_begin, PROT_READ|PROT_WRITE) != 0) {
+        perror("mprotect");
+        exit(1);
+      }
+      committed_bytes += alloc_memory_end - alloc_memory_begin;
+      if (committed_bytes > peak_committed_bytes) {
+        peak_committed_bytes = committed_bytes;
+      }
+      arena->memory_avail = alloc_memory_begin;
+      arena->memory_limit = alloc_memory_end;
 
-    struct PageBlock* alloc_block = get_new_block_struct();
-    alloc_block->memory_begin = alloc_memory_begin;
-    alloc_block->memory_end = alloc_memory_end;
-    arena->owned_pages = block_insert_and_coalesce(arena->owned_pages, alloc_block);
+      struct PageBlock* alloc_block = get_new_block_struct();
+      alloc_block->memory_begin = alloc_memory_begin;
+      alloc_block->memory_end = alloc_memory_end;
+      arena->owned_pages = block_insert_and_coalesce(arena->owned_pages, alloc_block);
 
-    client_memory = arena->memory_avail;
+      client_memory = arena->memory_avail;
+    }
   }
   arena->memory_avail = client_memory + size;
   return client_memory;
 }
 
-void
-arena_delete(struct Arena* arena)
+internal void
+free_page_blocks(struct PageBlock* p)
 {
-  struct PageBlock* p = arena->owned_pages;
   while (p) {
     if (ZERO_MEMORY_ON_FREE) {
       memset(p->memory_begin, 0, p->memory_end - p->memory_begin);
@@ -218,20 +256,73 @@ arena_delete(struct Arena* arena)
       perror("mprotect");
       exit(1);
     }
+    committed_bytes -= p->memory_end - p->memory_begin;
     struct PageBlock* next_block = p->next_block;
+    p->next_block = p->prev_block = 0;
     block_freelist_head = block_insert_and_coalesce(block_freelist_head, p);
     p = next_block;
   }
+}
+
+void
+arena_delete(struct Arena* arena)
+{
+  free_page_blocks(arena->owned_pages);
+  free_page_blocks(arena->rewound_pages);
   memset(arena, 0, sizeof(*arena));
 }
 
+/* Drop everything pushed on `arena`, but keep its pages committed: the next
+   pushes reuse them without going back to the page freelist and mprotect(). */
+void
+arena_rewind(struct Arena* arena)
+{
+  struct PageBlock* p = arena->owned_pages;
+  while (p) {
+    struct PageBlock* next_block = p->next_block;
+    p->next_block = p->prev_block = 0;
+    arena->rewound_pages = block_insert_and_coalesce(arena->rewound_pages, p);
+    p = next_block;
+  }
+  arena->owned_pages = 0;
+  arena->memory_avail = 0;
+  arena->memory_limit = 0;
+}
+
 struct ArenaUsage
 arena_get_usage(struct Arena* arena)
 {
   struct ArenaUsage usage = {};
+  struct PageBlock* p = arena->owned_pages;
+  while (p) {
+    usage.total += p->memory_end - p->memory_begin;
+    p = p->next_block;
+  }
+  usage.free = (uint8_t*)arena->memory_limit - (uint8_t*)arena->memory_avail;
+  for (p = arena->rewound_pages; p; p = p->next_block) {
+    usage.total += p->memory_end - p->memory_begin;
+    usage.free += p->memory_end - p->memory_begin;
+  }
+  usage.in_use = usage.total - usage.free;
+  usage.arena_count = 1;
   return usage;
 }
 
+void
+memory_get_stats(struct MemoryStats* stats)
+{
+  stats->reserved = total_page_count * page_size;
+  stats->committed = committed_bytes;
+  stats->peak_committed = peak_committed_bytes;
+}
+
+/* Start a new high-water mark, so that the peak can be measured per compiler phase. */
+void
+memory_reset_peak()
+{
+  peak_committed_bytes = committed_bytes;
+}
+
 int
 floor_log2(x)
 {
@@ -13,6 +13,7 @@ struct PageBlock {
 
 struct Arena {
   struct PageBlock* owned_pages;
+  struct PageBlock* rewound_pages;  /* still committed, reused before asking for new pages */
   void* memory_avail;
   void* memory_limit;
 };
@@ -24,6 +25,12 @@ struct ArenaUsage {
   int arena_count;
 };
 
+struct MemoryStats {
+  uint64_t reserved;
+  uint64_t committed;
+  uint64_t peak_committed;
+};
+
 struct UnboundedArray {
   void* segment_table[24];
   int elem_size;
@@ -33,12 +40,15 @@ struct UnboundedArray {
 };
 
 
-void init_memory(int memory_amount);
+void init_memory(uint64_t memory_amount);
 void* arena_push(struct Arena* arena, uint32_t size);
 void arena_delete(struct Arena* arena);
+void arena_rewind(struct Arena* arena);
 
 struct ArenaUsage arena_get_usage(struct Arena* arena);
 void arena_print_usage(struct Arena* arena, char* title);
+void memory_get_stats(struct MemoryStats* stats);
+void memory_reset_peak();
 
 void array_init(struct UnboundedArray* array, int elem_size, struct Arena* storage);
 void* array_get(struct UnboundedArray* array, int i);
@@ -1,14 +1,36 @@
-#define DEBUG_ENABLED 1
-
 #include "basic.h"
 #include "arena.h"
 #include "lex.h"
 #include "build_ast.h"
+#include "symtable.h"
+#include "build_symtable.h"
+#include "type_check.h"
+#include "const_eval.h"
+#include "ir.h"
+#include "ebpf.h"
 #include <sys/stat.h>
 #include <memory.h>  // memset
+#include <time.h>
+#include <sys/resource.h>
+
+
+#define MAX_PHASE_COUNT  16
+#define MEMORY_PER_SOURCE_BYTE  256
+#define BATCH_MEMORY_AMOUNT  (1024*(uint64_t)MEGABYTE)
+#define TARGET_MEMORY_AMOUNT  (256*(uint64_t)MEGABYTE)  /* the code a backend emits grows with unrolling, not the source */
 
+struct PhaseStats {
+  char* name;
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+  uint64_t peak_bytes;
+};
 
 internal struct Arena main_storage = {};
+internal struct PhaseStats phase_stats[MAX_PHASE_COUNT];
+internal int phase_count = 0;
+internal int constant_count = 0;
+internal struct IrProgram* ir_program = 0;
 
 
 struct CmdlineArg {
@@ -32,6 +54,110 @@ read_source(char** text_, int* text_size_, struct Arena* text_storage, char* fil
   *text_size_ = text_size;
 }
 
+internal uint64_t
+clock_ns(clockid_t clock_id)
+{
+  struct timespec ts;
+  clock_gettime(clock_id, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+internal struct PhaseStats*
+phase_begin(char* name)
+{
+  assert(phase_count < MAX_PHASE_COUNT);
+  struct PhaseStats* phase = &phase_stats[phase_count++];
+  phase->name = name;
+  phase->wall_ns = clock_ns(CLOCK_MONOTONIC);
+  phase->cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  memory_reset_peak();
+  return phase;
+}
+
+internal void
+phase_end(struct PhaseStats* phase)
+{
+  phase->wall_ns = clock_ns(CLOCK_MONOTONIC) - phase->wall_ns;
+  phase->cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - phase->cpu_ns;
+  struct MemoryStats memory_stats;
+  memory_get_stats(&memory_stats);
+  phase->peak_bytes = memory_stats.peak_committed;
+}
+
+/* `s` as a JSON string: quoted, with `"`, `\` and control characters escaped. */
+internal void
+print_json_string(FILE* f, char* s)
+{
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(f, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    } else {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+}
+
+internal void
+print_stats_json(FILE* f, char* filename, int text_size, int token_count, int ast_node_count)
+{
+  uint64_t total_wall_ns = 0, total_cpu_ns = 0, peak_bytes = 0;
+  struct SymtableStats symtable_stats;
+  symtable_get_stats(&symtable_stats);
+  struct MemoryStats memory_stats;
+  memory_get_stats(&memory_stats);
+  struct rusage rusage = {};
+  getrusage(RUSAGE_SELF, &rusage);
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"source\": ");
+  print_json_string(f, filename);
+  fprintf(f, ",\n");
+  fprintf(f, "  \"source_bytes\": %d,\n", text_size);
+  fprintf(f, "  \"phases\": [\n");
+  int i;
+  for (i = 0; i < phase_count; i++) {
+    fprintf(f, "    {\"name\": \"%s\", \"wall_ns\": %llu, \"cpu_ns\": %llu, \"peak_bytes\": %llu}%s\n",
+            phase_stats[i].name, (unsigned long long)phase_stats[i].wall_ns, (unsigned long long)phase_stats[i].cpu_ns,
+            (unsigned long long)phase_stats[i].peak_bytes, i < phase_count - 1 ? "," : "");
+    total_wall_ns += phase_stats[i].wall_ns;
+    total_cpu_ns += phase_stats[i].cpu_ns;
+    if (phase_stats[i].peak_bytes > peak_bytes) {
+      peak_bytes = phase_stats[i].peak_bytes;
+    }
+  }
+  fprintf(f, "  ],\n");
+  fprintf(f, "  \"total\": {\"wall_ns\": %llu, \"cpu_ns\": %llu},\n",
+          (unsigned long long)total_wall_ns, (unsigned long long)total_cpu_ns);
+  fprintf(f, "  \"memory\": {\"reserved_bytes\": %llu, \"peak_bytes\": %llu, \"maxrss_bytes\": %llu},\n",
+          (unsigned long long)memory_stats.reserved, (unsigned long long)peak_bytes,
+          (unsigned long long)rusage.ru_maxrss * 1024);
+  fprintf(f, "  \"token_count\": %d,\n", token_count);
+  fprintf(f, "  \"ast_node_count\": %d,\n", ast_node_count);
+  fprintf(f, "  \"type_count\": %d,\n", types_count());
+  fprintf(f, "  \"constant_count\": %d,\n", constant_count);
+  fprintf(f, "  \"ir_insn_count\": %d,\n", ir_program ? ir_program->insn_count : 0);
+  fprintf(f, "  \"ir_block_count\": %d,\n", ir_program ? ir_program->block_count : 0);
+  fprintf(f, "  \"symtable\": {\n");
+  fprintf(f, "    \"symbol_count\": %d,\n", symtable_stats.symbol_count);
+  fprintf(f, "    \"entry_count\": %d,\n", symtable_stats.entry_count);
+  fprintf(f, "    \"bucket_count\": %d,\n", symtable_stats.bucket_count);
+  fprintf(f, "    \"used_bucket_count\": %d,\n", symtable_stats.used_bucket_count);
+  fprintf(f, "    \"max_chain_len\": %d,\n", symtable_stats.max_chain_len);
+  fprintf(f, "    \"mean_chain_len\": %.3f,\n", symtable_stats.used_bucket_count > 0 ?
+          symtable_stats.entry_count / (float)symtable_stats.used_bucket_count : 0.f);
+  fprintf(f, "    \"chain_histogram\": [");
+  for (i = 0; i < SYMTABLE_CHAIN_HISTOGRAM_SIZE; i++) {
+    fprintf(f, "%d%s", symtable_stats.chain_histogram[i], i < SYMTABLE_CHAIN_HISTOGRAM_SIZE - 1 ? ", " : "");
+  }
+  fprintf(f, "]\n");
+  fprintf(f, "  }\n");
+  fprintf(f, "}\n");
+}
+
 internal struct CmdlineArg*
 find_unnamed_arg(struct CmdlineArg* args)
 {
@@ -79,6 +205,14 @@ parse_cmdline_args(int arg_count, char* args[])
     if (cstr_start_with(args[i], "--")) {
       char* raw_arg = args[i] + 2;  /* skip the `--` prefix */
       cmdline_arg->name = raw_arg;
+      char* c = raw_arg;
+      while (*c && *c != '=') {
+        c++;
+      }
+      if (*c == '=') {
+        *c = '\0';  /* `--name=value` */
+        cmdline_arg->value = c + 1;
+      }
     } else {
       cmdline_arg->value = args[i];
     }
@@ -90,50 +224,491 @@ parse_cmdline_args(int arg_count, char* args[])
   return arg_list;
 }
 
-int
-main(int arg_count, char* args[])
+internal char*
+output_filename(struct CmdlineArg* args, char* source_filename, char* default_suffix)
 {
-  init_memory(400*KILOBYTE);
+  struct CmdlineArg* output_arg = find_named_arg("output", args);
+  if (output_arg && output_arg->value) {
+    return output_arg->value;
+  }
+  int len = cstr_len(source_filename);
+  char* filename = arena_push(&main_storage, len + cstr_len(default_suffix) + 1);
+  cstr_copy(filename, source_filename);
+  cstr_copy(filename + len, default_suffix);
+  filename[len + cstr_len(default_suffix)] = '\0';
+  return filename;
+}
 
-  struct CmdlineArg* cmdline_args = parse_cmdline_args(arg_count, args);
-  struct CmdlineArg* filename_arg = find_unnamed_arg(cmdline_args);
-  if (!filename_arg) {
-    printf("<filename> is required.\n");
-    exit(1);
+/* Address space to reserve for compiling `filename`.  Only the pages that are
+   actually pushed get committed, so this can be generous. */
+internal uint64_t
+memory_amount_for(char* filename)
+{
+  uint64_t memory_amount = 400*KILOBYTE;
+  struct stat file_stat;
+  if (filename && stat(filename, &file_stat) == 0) {
+    uint64_t needed = (uint64_t)file_stat.st_size * MEMORY_PER_SOURCE_BYTE;
+    if (needed > memory_amount) {
+      memory_amount = needed;
+    }
   }
-  struct Arena text_storage = {};
+  return memory_amount;
+}
+
+/* Storage that lives for the compilation of one source file.  In batch mode
+   it is rewound between files instead of being handed back to the page pool. */
+internal struct Arena text_storage = {};
+internal struct Arena lexeme_storage = {};
+internal struct Arena tokens_storage = {};
+internal struct Arena symtable_storage = {};
+internal struct Arena ast_storage = {};
+internal struct Arena type_storage = {};
+internal struct Arena ir_storage = {};
+internal bool batch_mode = false;
+internal bool symtable_is_warm = false;
+
+internal void
+release_storage(struct Arena* storage)
+{
+  if (batch_mode) {
+    arena_rewind(storage);
+  } else {
+    arena_delete(storage);
+  }
+}
+
+/* The emitters of the eBPF targets, called the same way. */
+typedef void EbpfEmit(struct EbpfProgram* program, int ast_node_count, FILE* f_stream, char* source_filename,
+                      struct Arena* storage);
+
+internal void
+emit_xdp(struct EbpfProgram* program, int ast_node_count, FILE* f_stream, char* source_filename,
+         struct Arena* storage)
+{
+  emit_xdp_program(program, ast_node_count, f_stream, source_filename, storage);
+}
+
+internal void
+emit_bpf(struct EbpfProgram* program, int ast_node_count, FILE* f_stream, char* source_filename,
+         struct Arena* storage)
+{
+  emit_bpf_program(program, f_stream, storage);
+}
+
+internal void
+emit_ubpf(struct EbpfProgram* program, int ast_node_count, FILE* f_stream, char* source_filename,
+          struct Arena* storage)
+{
+  emit_ubpf_program(program, f_stream, storage);
+}
+
+/* Analyzes the program for an eBPF target, writes it with `emit` to the output file named with `suffix`,
+   and stops the compilation if a stage would walk more instructions than --max-insns allows. */
+internal struct EbpfProgram*
+compile_ebpf_target(struct Ast* ast_program, enum EbpfSelectKind select_kind, enum EbpfTableKind ternary_kind,
+                    bool full_checksums, enum EbpfSplitKind split_kind, enum EbpfStackKind stack_kind, int max_insns,
+                    EbpfEmit* emit, char* emit_phase_name, char* suffix, char* file_mode, char* filename,
+                    int ast_node_count, struct CmdlineArg* cmdline_args)
+{
+  struct PhaseStats* phase = phase_begin("ebpf_analyze_program");
+  struct EbpfProgram* ebpf_program = ebpf_analyze_program(ast_program, ir_program, select_kind, ternary_kind,
+                                                          full_checksums, split_kind, stack_kind, max_insns,
+                                                          &ir_storage);
+  phase_end(phase);
+  if (find_named_arg("print-tables", cmdline_args)) {
+    ebpf_print_tables(ebpf_program, stdout);
+  }
+  /* Emitted in memory: the output file is written once every stage has passed the check. */
+  char* code = 0;
+  size_t code_size = 0;
+  FILE* code_stream = open_memstream(&code, &code_size);
+  phase = phase_begin(emit_phase_name);
+  emit(ebpf_program, ast_node_count, code_stream, filename, &ir_storage);
+  phase_end(phase);
+  fclose(code_stream);
+  int stage;
+  for (stage = 0; stage < ebpf_program->stage_count; stage++) {
+    if (ebpf_program->complexities[stage].walked > ebpf_program->max_insns) {
+      free(code);
+    }
+    ebpf_check_complexity(ebpf_program, stage);
+  }
+  char* out_filename = output_filename(cmdline_args, filename, suffix);
+  FILE* f_stream = fopen(out_filename, file_mode);
+  if (!f_stream) {
+    free(code);
+    error("could not open `%s` for writing.", out_filename);
+  }
+  fwrite(code, 1, code_size, f_stream);
+  fclose(f_stream);
+  free(code);
+  if (find_named_arg("print-complexity", cmdline_args)) {
+    ebpf_print_complexity(ebpf_program, stdout);
+  }
+  return ebpf_program;
+}
+
+internal void
+compile_source(char* filename, struct CmdlineArg* cmdline_args)
+{
+  phase_count = 0;
+  arena_rewind(&text_storage);
+  arena_rewind(&lexeme_storage);
+  arena_rewind(&tokens_storage);
+  arena_rewind(&ast_storage);
+  arena_rewind(&type_storage);
+  arena_rewind(&ir_storage);
+  ir_program = 0;
+
+  struct PhaseStats* phase = 0;
   char* text = 0;
   int text_size = 0;
-  read_source(&text, &text_size, &text_storage, filename_arg->value);
+  phase = phase_begin("read_source");
+  read_source(&text, &text_size, &text_storage, filename);
+  phase_end(phase);
 
-  struct Arena tokens_storage = {};
   struct UnboundedArray tokens_array = {};
-  lex_set_storage(&main_storage, &tokens_storage);
+  phase = phase_begin("lex_tokenize");
+  lex_set_storage(&lexeme_storage, &tokens_storage);
   lex_tokenize(text, text_size, &tokens_array);
-  arena_delete(&text_storage);
+  phase_end(phase);
+  int token_count = tokens_array.elem_count;
+  release_storage(&text_storage);
 
-  struct Arena symtable_storage = {};
+  phase = phase_begin("symtable_init");
   symtable_set_storage(&symtable_storage);
-  symtable_init();
+  if (symtable_is_warm) {
+    symtable_flush();
+  } else {
+    symtable_init();
+    symtable_is_warm = batch_mode;
+  }
+  phase_end(phase);
 
-  struct Arena ast_storage = {};
   int ast_node_count = 0;
+  phase = phase_begin("build_ast_program");
   struct Ast* ast_program = build_ast_program(&ast_program, &ast_node_count, &tokens_array, &ast_storage);
+  phase_end(phase);
   assert(ast_program && ast_program->kind == Ast_P4Program);
-  arena_delete(&tokens_storage);
+  release_storage(&tokens_storage);
 
   if (find_named_arg("print-ast", cmdline_args)) {
     print_ast(ast_program);
   }
 
+  struct CmdlineArg* emit_ast_arg = find_named_arg("emit-ast", cmdline_args);
+  if (emit_ast_arg) {
+    if (emit_ast_arg->value && cstr_match(emit_ast_arg->value, "bin")) {
+      char* out_filename = output_filename(cmdline_args, filename, ".astb");
+      FILE* f_stream = fopen(out_filename, "wb");
+      if (!f_stream) {
+        error("could not open `%s` for writing.", out_filename);
+      }
+      phase = phase_begin("write_ast_bin");
+      write_ast_bin(ast_program, f_stream);
+      phase_end(phase);
+      fclose(f_stream);
+    } else error("--emit-ast: unknown format `%s`, expected `bin`.", emit_ast_arg->value ? emit_ast_arg->value : "");
+  }
+
   if (DEBUG_ENABLED) {
     printf("\n-- Build the symbol table --\n");
   }
-  symtable_flush();
+  phase = phase_begin("build_symtable_program");
   build_symtable_program(ast_program);
+  phase_end(phase);
 
-  arena_delete(&ast_storage);
-  arena_delete(&main_storage);
+  phase = phase_begin("type_check_program");
+  type_check_program(ast_program, ast_node_count, &type_storage);
+  phase_end(phase);
+
+  phase = phase_begin("const_eval_program");
+  constant_count = const_eval_program(ast_program);
+  phase_end(phase);
+
+  phase = phase_begin("build_ir_program");
+  ir_program = build_ir_program(ast_program, ast_node_count, &ir_storage);
+  phase_end(phase);
+
+  if (find_named_arg("print-ir", cmdline_args)) {
+    print_ir_program(ir_program);
+  }
+
+  struct CmdlineArg* target_arg = find_named_arg("target", cmdline_args);
+  enum EbpfSelectKind select_kind = EbpfSelect_NONE_;
+  struct CmdlineArg* select_arg = find_named_arg("select", cmdline_args);
+  if (select_arg) {
+    if (select_arg->value && cstr_match(select_arg->value, "linear")) {
+      select_kind = EbpfSelect_Linear;
+    } else if (select_arg->value && cstr_match(select_arg->value, "tree")) {
+      select_kind = EbpfSelect_Tree;
+    } else if (select_arg->value && cstr_match(select_arg->value, "map")) {
+      select_kind = EbpfSelect_Map;
+    } else error("--select: unknown lowering `%s`, expected `linear`, `tree` or `map`.",
+                 select_arg->value ? select_arg->value : "");
+  }
+  enum EbpfTableKind ternary_kind = EbpfTable_Map;
+  struct CmdlineArg* ternary_arg = find_named_arg("ternary", cmdline_args);
+  if (ternary_arg) {
+    if (ternary_arg->value && cstr_match(ternary_arg->value, "inline")) {
+      ternary_kind = EbpfTable_Inline;
+    } else if (ternary_arg->value && cstr_match(ternary_arg->value, "scan")) {
+      ternary_kind = EbpfTable_Scan;
+    } else if (ternary_arg->value && cstr_match(ternary_arg->value, "tuple")) {
+      ternary_kind = EbpfTable_Tuple;
+    } else error("--ternary: unknown table kind `%s`, expected `inline`, `scan` or `tuple`.",
+                 ternary_arg->value ? ternary_arg->value : "");
+  }
+  bool full_checksums = false;
+  struct CmdlineArg* checksum_arg = find_named_arg("checksum", cmdline_args);
+  if (checksum_arg) {
+    if (checksum_arg->value && cstr_match(checksum_arg->value, "full")) {
+      full_checksums = true;
+    } else if (!checksum_arg->value || !cstr_match(checksum_arg->value, "incremental")) {
+      error("--checksum: unknown lowering `%s`, expected `incremental` or `full`.",
+            checksum_arg->value ? checksum_arg->value : "");
+    }
+  }
+  enum EbpfSplitKind split_kind = EbpfSplit_Auto;
+  struct CmdlineArg* split_arg = find_named_arg("split", cmdline_args);
+  if (split_arg) {
+    if (split_arg->value && cstr_match(split_arg->value, "none")) {
+      split_kind = EbpfSplit_None;
+    } else if (split_arg->value && cstr_match(split_arg->value, "blocks")) {
+      split_kind = EbpfSplit_Blocks;
+    } else if (!split_arg->value || !cstr_match(split_arg->value, "auto")) {
+      error("--split: unknown kind `%s`, expected `auto`, `none` or `blocks`.",
+            split_arg->value ? split_arg->value : "");
+    }
+  }
+  enum EbpfStackKind stack_kind = EbpfStack_NONE_;
+  struct CmdlineArg* stacks_arg = find_named_arg("stacks", cmdline_args);
+  if (stacks_arg) {
+    if (stacks_arg->value && cstr_match(stacks_arg->value, "unroll")) {
+      stack_kind = EbpfStack_Unrolled;
+    } else if (stacks_arg->value && cstr_match(stacks_arg->value, "index")) {
+      stack_kind = EbpfStack_Indexed;
+    } else if (!stacks_arg->value || !cstr_match(stacks_arg->value, "auto")) {
+      error("--stacks: unknown lowering `%s`, expected `auto`, `unroll` or `index`.",
+            stacks_arg->value ? stacks_arg->value : "");
+    }
+  }
+  int max_insns = EBPF_MAX_INSNS;
+  struct CmdlineArg* max_insns_arg = find_named_arg("max-insns", cmdline_args);
+  if (max_insns_arg) {
+    char* end = 0;
+    long value = max_insns_arg->value ? strtol(max_insns_arg->value, &end, 10) : 0;
+    if (!end || *end != '\0' || value <= 0 || value > INT32_MAX) {
+      error("--max-insns: expected a positive number of instructions, not `%s`.",
+            max_insns_arg->value ? max_insns_arg->value : "");
+    }
+    max_insns = (int)value;
+  }
+  struct EbpfProgram* ebpf_program = 0;
+  if (target_arg) {
+    if (target_arg->value && cstr_match(target_arg->value, "xdp")) {
+      ebpf_program = compile_ebpf_target(ast_program, select_kind, ternary_kind, full_checksums, split_kind,
+                                         stack_kind, max_insns, emit_xdp, "emit_xdp_program", ".xdp.c", "w",
+                                         filename, ast_node_count, cmdline_args);
+    } else if (target_arg->value && cstr_match(target_arg->value, "bpf")) {
+      ebpf_program = compile_ebpf_target(ast_program, select_kind, ternary_kind, full_checksums, split_kind,
+                                         stack_kind, max_insns, emit_bpf, "emit_bpf_program", ".bpf.o", "wb",
+                                         filename, ast_node_count, cmdline_args);
+    } else if (target_arg->value && cstr_match(target_arg->value, "ubpf")) {
+      ebpf_program = compile_ebpf_target(ast_program, select_kind, ternary_kind, full_checksums, split_kind,
+                                         stack_kind, max_insns, emit_ubpf, "emit_ubpf_program", ".ubpf.o", "wb",
+                                         filename, ast_node_count, cmdline_args);
+    } else error("--target: unknown target `%s`, expected `xdp`, `bpf` or `ubpf`.",
+                 target_arg->value ? target_arg->value : "");
+  }
+
+  struct CmdlineArg* run_arg = find_named_arg("run", cmdline_args);
+  if (run_arg) {
+    if (!run_arg->value) {
+      error("--run: expected a pcap file of packets.");
+    }
+    int batch_size = 64, repeat = 1;
+    struct CmdlineArg* batch_arg = find_named_arg("run-batch", cmdline_args);
+    if (batch_arg) {
+      char* end = 0;
+      long value = batch_arg->value ? strtol(batch_arg->value, &end, 10) : 0;
+      if (!end || *end != '\0' || value <= 0 || value > 1000000) {
+        error("--run-batch: expected a positive number of packets, not `%s`.", batch_arg->value ? batch_arg->value : "");
+      }
+      batch_size = (int)value;
+    }
+    struct CmdlineArg* repeat_arg = find_named_arg("run-repeat", cmdline_args);
+    if (repeat_arg) {
+      char* end = 0;
+      long value = repeat_arg->value ? strtol(repeat_arg->value, &end, 10) : 0;
+      if (!end || *end != '\0' || value <= 0 || value > INT32_MAX) {
+        error("--run-repeat: expected a positive number of runs, not `%s`.", repeat_arg->value ? repeat_arg->value : "");
+      }
+      repeat = (int)value;
+    }
+    if (!ebpf_program) {
+      phase = phase_begin("ebpf_analyze_program");
+      ebpf_program = ebpf_analyze_program(ast_program, ir_program, select_kind, ternary_kind, full_checksums,
+                                          split_kind, stack_kind, max_insns, &ir_storage);
+      phase_end(phase);
+    }
+    struct CmdlineArg* run_output_arg = find_named_arg("run-output", cmdline_args);
+    phase = phase_begin("run_ir_program");
+    run_ir_program(ebpf_program, run_arg->value, run_output_arg ? run_output_arg->value : 0, batch_size, repeat,
+                   &ir_storage);
+    phase_end(phase);
+  }
+
+  struct CmdlineArg* stats_arg = find_named_arg("stats", cmdline_args);
+  if (stats_arg) {
+    if (stats_arg->value) {
+      FILE* f_stream = fopen(stats_arg->value, "w");
+      if (!f_stream) {
+        error("could not open `%s` for writing.", stats_arg->value);
+      }
+      print_stats_json(f_stream, filename, text_size, token_count, ast_node_count);
+      fclose(f_stream);
+    } else {
+      print_stats_json(stdout, filename, text_size, token_count, ast_node_count);
+    }
+  }
+}
+
+/* Next file to compile in batch mode: the unnamed arguments, or one name per line of stdin. */
+internal char*
+next_batch_filename(struct CmdlineArg** arg_at, bool from_stdin)
+{
+  if (!from_stdin) {
+    struct CmdlineArg* arg = *arg_at;
+    while (arg && arg->name) {
+      arg = arg->next_arg;
+    }
+    *arg_at = arg ? arg->next_arg : 0;
+    return arg ? arg->value : 0;
+  }
+  static char line[4096];
+  while (fgets(line, sizeof(line), stdin)) {
+    int len = cstr_len(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ')) {
+      line[--len] = '\0';
+    }
+    if (len > 0) {
+      return line;
+    }
+  }
   return 0;
 }
 
+internal int
+compile_batch(struct CmdlineArg* cmdline_args)
+{
+  if (find_named_arg("output", cmdline_args)) {
+    error("--output names a single file and cannot be used with --batch.");
+  }
+  struct CmdlineArg* stats_arg = find_named_arg("stats", cmdline_args);
+  if (stats_arg && stats_arg->value) {
+    error("--stats=<file> names a single file and cannot be used with --batch, use --stats.");
+  }
+  bool from_stdin = (find_unnamed_arg(cmdline_args) == 0);
+  struct CmdlineArg* arg_at = cmdline_args;
+  int passed_count = 0, failed_count = 0;
+  char* filename = 0;
+  while ((filename = next_batch_filename(&arg_at, from_stdin)) != 0) {
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    jmp_buf recovery;
+    bool passed = false;
+    if (setjmp(recovery) == 0) {
+      error_recovery = &recovery;
+      struct stat file_stat;
+      if (stat(filename, &file_stat) != 0) {
+        error("could not open `%s`.", filename);
+      }
+      compile_source(filename, cmdline_args);
+      passed = true;
+    }
+    error_recovery = 0;
+    printf("%s : %s  %.3f ms\n", filename, passed ? "PASSED" : "FAILED",
+           (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1e6);
+    if (passed) {
+      passed_count += 1;
+    } else {
+      failed_count += 1;
+    }
+  }
+  printf("%d passed, %d failed\n", passed_count, failed_count);
+  return failed_count > 0 ? 1 : 0;
+}
+
+internal void
+print_usage()
+{
+  printf("usage: ashp4c <file.p4> [options]\n"
+         "       ashp4c --batch [options] [<file.p4> ...]   (file names are read from stdin if none is given)\n"
+         "\n"
+         "  --print-ast, --print-ir, --emit-ast=bin   print the AST or IR, write the AST image\n"
+         "  --target=xdp|bpf|ubpf     compile to XDP C, a BPF object for the kernel, or a uBPF object\n"
+         "  --output=<file>           output file of --target and --emit-ast\n"
+         "  --select=linear|tree|map  lowering of parser select\n"
+         "  --ternary=inline|scan|tuple   kind of ternary tables\n"
+         "  --checksum=incremental|full   lowering of checksum updates\n"
+         "  --split=auto|none|blocks  splitting of the program into tail-called stages\n"
+         "  --stacks=auto|unroll|index    lowering of header stacks\n"
+         "  --max-insns=<n>           instructions the verifier may walk in one stage\n"
+         "  --print-tables, --print-complexity\n"
+         "  --run=<in.pcap> [--run-output=<out.pcap>] [--run-batch=<n>] [--run-repeat=<n>]\n"
+         "                            run the program on packets, in the IR interpreter\n"
+         "  --stats[=<file>]          per-phase times and memory, as JSON\n"
+         "\n"
+         "The eBPF targets and --run take header fields of at most 64 bits: IPv6 addresses are not supported.\n");
+}
+
+int
+main(int arg_count, char* args[])
+{
+  /* Size the address space from the biggest source named on the command line;
+     a batch read from stdin gets a fixed reservation. */
+  uint64_t memory_amount = 0;
+  int i;
+  for (i = 1; i < arg_count; i++) {
+    uint64_t amount = 0;
+    if (cstr_match(args[i], "--batch")) {
+      amount = BATCH_MEMORY_AMOUNT;
+    } else if (cstr_start_with(args[i], "--target=") || cstr_start_with(args[i], "--run=")) {
+      amount = TARGET_MEMORY_AMOUNT;
+    } else if (!cstr_start_with(args[i], "--")) {
+      amount = memory_amount_for(args[i]);
+    }
+    if (amount > memory_amount) {
+      memory_amount = amount;
+    }
+  }
+  init_memory(memory_amount_for(0) > memory_amount ? memory_amount_for(0) : memory_amount);
+
+  struct CmdlineArg* cmdline_args = parse_cmdline_args(arg_count, args);
+  if (find_named_arg("help", cmdline_args)) {
+    print_usage();
+    return 0;
+  }
+  int exit_code = 0;
+  if (find_named_arg("batch", cmdline_args)) {
+    batch_mode = true;
+    exit_code = compile_batch(cmdline_args);
+  } else {
+    struct CmdlineArg* filename_arg = find_unnamed_arg(cmdline_args);
+    if (!filename_arg) {
+      printf("<filename> is required.\n");
+      exit(1);
+    }
+    compile_source(filename_arg->value, cmdline_args);
+  }
+
+  arena_delete(&text_storage);
+  arena_delete(&tokens_storage);
+  arena_delete(&symtable_storage);
+  arena_delete(&ast_storage);
+  arena_delete(&type_storage);
+  arena_delete(&ir_storage);
+  arena_delete(&lexeme_storage);
+  arena_delete(&main_storage);
+  return exit_code;
+}
@@ -34,6 +34,18 @@ ast_list_first_link(struct AstList* list)
   return first;
 }
 
+/* The `n`-th element of `list`, from 0, or 0 past its end or if there is no list. */
+struct Ast*
+ast_list_nth(struct AstList* list, int n)
+{
+  struct AstListLink* link = list ? ast_list_first_link(list) : 0;
+  while (link && n > 0) {
+    link = link->next;
+    n -= 1;
+  }
+  return link ? link->ast : 0;
+}
+
 void*
 ast_getattr(struct Ast* ast, char* attr_name)
 {
@@ -179,5 +179,7 @@ struct AstAttribute* ast_attriter_get_next(struct AstAttributeIterator* iter);
 void ast_list_init(struct AstList* list);
 void ast_list_append_link(struct AstList* list, struct AstListLink* link);
 struct AstListLink* ast_list_first_link(struct AstList* list);
+struct Ast* ast_list_nth(struct AstList* list, int n);
 
 void print_ast(struct Ast* ast);
+void write_ast_bin(struct Ast* ast, FILE* f);
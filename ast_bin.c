@@ -0,0 +1,255 @@
+#include "arena.h"
+#include "hash.h"
+#include "ast.h"
+#include "ast_bin.h"
+#include <memory.h>  // memset
+#include <string.h>  // memcpy
+
+
+struct BinString {
+  char* str;
+  uint32_t offset;
+  struct BinString* next_string;
+};
+
+struct BinWriter {
+  struct Arena* storage;
+  int node_count;
+  int attr_count;
+  int child_count;
+  int max_id;
+
+  struct Ast** node_order;
+  uint32_t* index_of_id;  /* node index + 1, 0 if not visited */
+  struct AstBinNode* nodes;
+  struct AstBinAttr* attrs;
+  uint32_t* children;
+
+  struct BinString** string_table;
+  int string_table_log2;
+  struct BinString* first_string;
+  struct BinString* last_string;
+  uint32_t string_size;
+};
+
+
+internal void
+count_nodes(struct BinWriter* w, struct Ast* ast)
+{
+  w->node_count += 1;
+  w->attr_count += ast->attr_count;
+  if (ast->id > w->max_id) {
+    w->max_id = ast->id;
+  }
+  struct AstAttributeIterator attr_iter = {};
+  struct AstAttribute* attr;
+  for (attr = ast_attriter_init(&attr_iter, ast); attr; attr = ast_attriter_get_next(&attr_iter)) {
+    if (attr->type == AstAttr_Ast && attr->value) {
+      w->child_count += 1;
+      count_nodes(w, attr->value);
+    } else if (attr->type == AstAttr_AstList && attr->value) {
+      struct AstListLink* link = ast_list_first_link(attr->value);
+      while (link) {
+        w->child_count += 1;
+        count_nodes(w, link->ast);
+        link = link->next;
+      }
+    }
+  }
+}
+
+internal void
+number_nodes(struct BinWriter* w, struct Ast* ast, uint32_t parent, int* node_at)
+{
+  /* The builder never shares subtrees, so every node is reached exactly once. */
+  assert(w->index_of_id[ast->id] == 0);
+  uint32_t index = (*node_at)++;
+  w->index_of_id[ast->id] = index + 1;
+  w->node_order[index] = ast;
+  struct AstBinNode* node = &w->nodes[index];
+  node->kind = ast->kind;
+  node->id = ast->id;
+  node->line_nr = ast->line_nr;
+  node->parent = parent;
+
+  struct AstAttributeIterator attr_iter = {};
+  struct AstAttribute* attr;
+  for (attr = ast_attriter_init(&attr_iter, ast); attr; attr = ast_attriter_get_next(&attr_iter)) {
+    if (attr->type == AstAttr_Ast && attr->value) {
+      number_nodes(w, attr->value, index, node_at);
+    } else if (attr->type == AstAttr_AstList && attr->value) {
+      struct AstListLink* link = ast_list_first_link(attr->value);
+      while (link) {
+        number_nodes(w, link->ast, index, node_at);
+        link = link->next;
+      }
+    }
+  }
+}
+
+internal uint32_t
+intern_string(struct BinWriter* w, char* str)
+{
+  uint32_t h = hash_string(str, w->string_table_log2);
+  struct BinString* entry = w->string_table[h];
+  while (entry) {
+    if (cstr_match(entry->str, str))
+      break;
+    entry = entry->next_string;
+  }
+  if (!entry) {
+    entry = arena_push(w->storage, sizeof(*entry));
+    memset(entry, 0, sizeof(*entry));
+    entry->str = str;
+    entry->offset = w->string_size;
+    entry->next_string = w->string_table[h];
+    w->string_table[h] = entry;
+    w->string_size += cstr_len(str) + 1;
+    /* Keep a second, insertion-ordered list for writing the string table out. */
+    struct BinString* ordered = arena_push(w->storage, sizeof(*ordered));
+    *ordered = *entry;
+    ordered->next_string = 0;
+    if (w->last_string) {
+      w->last_string->next_string = ordered;
+    } else {
+      w->first_string = ordered;
+    }
+    w->last_string = ordered;
+  }
+  return entry->offset;
+}
+
+internal int64_t
+attr_integer_value(struct Ast* ast, struct AstAttribute* attr)
+{
+  /* Integer literals keep a 64-bit value; every other integer attribute is an int-sized enum or flag. */
+  if (ast->kind == Ast_Int && cstr_match(attr->name, "value")) {
+    return *(int64_t*)attr->value;
+  }
+  return *(int*)attr->value;
+}
+
+internal void
+fill_node_attrs(struct BinWriter* w, uint32_t index, int* attr_at, int* child_at)
+{
+  struct Ast* ast = w->node_order[index];
+  struct AstBinNode* node = &w->nodes[index];
+  node->attr_first = *attr_at;
+  node->child_first = *child_at;
+
+  struct AstAttributeIterator attr_iter = {};
+  struct AstAttribute* attr;
+  for (attr = ast_attriter_init(&attr_iter, ast); attr; attr = ast_attriter_get_next(&attr_iter)) {
+    struct AstBinAttr* bin_attr = &w->attrs[(*attr_at)++];
+    bin_attr->name = intern_string(w, attr->name);
+    if (attr->type == AstAttr_Ast) {
+      bin_attr->type = AstBinAttr_Ast;
+      bin_attr->value = AST_BIN_NULL;
+      if (attr->value) {
+        bin_attr->value = w->index_of_id[((struct Ast*)attr->value)->id] - 1;
+        w->children[(*child_at)++] = bin_attr->value;
+      }
+    } else if (attr->type == AstAttr_AstList) {
+      bin_attr->type = AstBinAttr_AstList;
+      bin_attr->value = *child_at;
+      if (attr->value) {
+        struct AstListLink* link = ast_list_first_link(attr->value);
+        while (link) {
+          w->children[(*child_at)++] = w->index_of_id[link->ast->id] - 1;
+          bin_attr->count += 1;
+          link = link->next;
+        }
+      }
+    } else if (attr->type == AstAttr_Integer) {
+      bin_attr->type = AstBinAttr_Integer;
+      bin_attr->value = attr->value ? attr_integer_value(ast, attr) : 0;
+    } else if (attr->type == AstAttr_String) {
+      bin_attr->type = AstBinAttr_String;
+      bin_attr->value = attr->value ? intern_string(w, attr->value) : AST_BIN_NULL;
+    } else if (attr->type == AstAttr_ExprOperator) {
+      bin_attr->type = AstBinAttr_ExprOperator;
+      bin_attr->value = *(enum AstExprOperator*)attr->value;
+    } else assert(0);
+  }
+  node->attr_count = *attr_at - node->attr_first;
+  node->child_count = *child_at - node->child_first;
+}
+
+internal uint64_t
+align_offset(uint64_t offset)
+{
+  return (offset + 7) & ~(uint64_t)7;
+}
+
+internal void
+write_padding(FILE* f, uint64_t from, uint64_t to)
+{
+  static char zeroes[8] = {};
+  fwrite(zeroes, 1, to - from, f);
+}
+
+void
+write_ast_bin(struct Ast* ast, FILE* f)
+{
+  struct Arena temp_storage = {};
+  struct BinWriter w = {};
+  w.storage = &temp_storage;
+
+  count_nodes(&w, ast);
+  w.node_order = arena_push(w.storage, w.node_count * sizeof(*w.node_order));
+  w.index_of_id = arena_push(w.storage, (w.max_id + 1) * sizeof(*w.index_of_id));
+  memset(w.index_of_id, 0, (w.max_id + 1) * sizeof(*w.index_of_id));
+  w.nodes = arena_push(w.storage, w.node_count * sizeof(*w.nodes));
+  memset(w.nodes, 0, w.node_count * sizeof(*w.nodes));
+  w.attrs = arena_push(w.storage, (w.attr_count + 1) * sizeof(*w.attrs));
+  memset(w.attrs, 0, (w.attr_count + 1) * sizeof(*w.attrs));
+  w.children = arena_push(w.storage, (w.child_count + 1) * sizeof(*w.children));
+
+  w.string_table_log2 = 8;
+  while ((1 << w.string_table_log2) < w.node_count && w.string_table_log2 < 20) {
+    w.string_table_log2 += 1;
+  }
+  int string_table_capacity = (1 << w.string_table_log2) - 1;
+  w.string_table = arena_push(w.storage, string_table_capacity * sizeof(*w.string_table));
+  memset(w.string_table, 0, string_table_capacity * sizeof(*w.string_table));
+
+  int node_at = 0;
+  number_nodes(&w, ast, AST_BIN_NULL, &node_at);
+  assert(node_at == w.node_count);
+  int i, attr_at = 0, child_at = 0;
+  for (i = 0; i < w.node_count; i++) {
+    fill_node_attrs(&w, i, &attr_at, &child_at);
+  }
+  assert(attr_at == w.attr_count && child_at == w.child_count);
+
+  struct AstBinHeader header = {};
+  memcpy(header.magic, AST_BIN_MAGIC, sizeof(header.magic));
+  header.version = AST_BIN_VERSION;
+  header.header_size = sizeof(header);
+  header.node_count = w.node_count;
+  header.attr_count = w.attr_count;
+  header.child_count = w.child_count;
+  header.string_size = w.string_size;
+  header.node_offset = align_offset(sizeof(header));
+  header.attr_offset = align_offset(header.node_offset + w.node_count * sizeof(struct AstBinNode));
+  header.child_offset = align_offset(header.attr_offset + w.attr_count * sizeof(struct AstBinAttr));
+  header.string_offset = align_offset(header.child_offset + w.child_count * sizeof(uint32_t));
+  header.image_size = align_offset(header.string_offset + w.string_size);
+
+  fwrite(&header, sizeof(header), 1, f);
+  write_padding(f, sizeof(header), header.node_offset);
+  fwrite(w.nodes, sizeof(struct AstBinNode), w.node_count, f);
+  write_padding(f, header.node_offset + w.node_count * sizeof(struct AstBinNode), header.attr_offset);
+  fwrite(w.attrs, sizeof(struct AstBinAttr), w.attr_count, f);
+  write_padding(f, header.attr_offset + w.attr_count * sizeof(struct AstBinAttr), header.child_offset);
+  fwrite(w.children, sizeof(uint32_t), w.child_count, f);
+  write_padding(f, header.child_offset + w.child_count * sizeof(uint32_t), header.string_offset);
+  struct BinString* s = w.first_string;
+  while (s) {
+    fwrite(s->str, 1, cstr_len(s->str) + 1, f);
+    s = s->next_string;
+  }
+  write_padding(f, header.string_offset + w.string_size, header.image_size);
+
+  arena_delete(&temp_storage);
+}
@@ -0,0 +1,92 @@
+#pragma once
+/*
+ * Binary AST image written by `ashp4c --emit-ast=bin`.
+ *
+ * The image is a single little-endian blob that can be mmap'ed and used
+ * in place.  All sections start at 8-byte aligned offsets and hold
+ * fixed-size records, so a reader only needs to validate the header once.
+ *
+ *   AstBinHeader
+ *   AstBinNode[node_count]      -- preorder, node 0 is the P4Program
+ *   AstBinAttr[attr_count]      -- each node owns a contiguous run
+ *   uint32_t[child_count]       -- node indices; each node owns a contiguous span
+ *   char[string_size]           -- NUL-terminated strings, deduplicated
+ *
+ * Attribute values:
+ *   AstBinAttr_Ast           value = node index, or AST_BIN_NULL
+ *   AstBinAttr_AstList       value = first child slot, count = list length
+ *   AstBinAttr_Integer       value = the integer
+ *   AstBinAttr_String        value = string table offset, or AST_BIN_NULL
+ *   AstBinAttr_ExprOperator  value = enum AstExprOperator
+ *
+ * Node kinds and operators use the numbering of `ast.h`.  This header has no
+ * dependencies besides libc, so external tools can include it on its own; the
+ * reader functions it declares are in ast_bin_read.c, which needs nothing
+ * else either.
+ */
+#include <stdint.h>
+
+#define AST_BIN_MAGIC    "P4ASTBIN"
+#define AST_BIN_VERSION  1
+#define AST_BIN_NULL     0xffffffffu
+
+enum AstBinAttrType {
+  AstBinAttr_NONE_,
+  AstBinAttr_Ast,
+  AstBinAttr_AstList,
+  AstBinAttr_Integer,
+  AstBinAttr_String,
+  AstBinAttr_ExprOperator,
+};
+
+struct AstBinHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t node_count;
+  uint32_t attr_count;
+  uint32_t child_count;
+  uint32_t string_size;
+  uint64_t node_offset;
+  uint64_t attr_offset;
+  uint64_t child_offset;
+  uint64_t string_offset;
+  uint64_t image_size;
+};
+
+struct AstBinNode {
+  uint32_t kind;
+  uint32_t id;
+  uint32_t line_nr;
+  uint32_t attr_first;
+  uint32_t attr_count;
+  uint32_t child_first;
+  uint32_t child_count;
+  uint32_t parent;
+};
+
+struct AstBinAttr {
+  uint32_t name;
+  uint32_t type;
+  uint32_t count;
+  uint32_t reserved_;
+  int64_t value;
+};
+
+struct AstBinImage {
+  const struct AstBinHeader* header;
+  const struct AstBinNode* nodes;
+  const struct AstBinAttr* attrs;
+  const uint32_t* children;
+  const char* strings;
+};
+
+/* Returns 0 on success, or -1 if `image` is not a well-formed AST image at an 8-byte aligned address. */
+int ast_bin_open(struct AstBinImage* img, const void* image, uint64_t image_size);
+const struct AstBinNode* ast_bin_node(const struct AstBinImage* img, uint32_t i);
+const char* ast_bin_string(const struct AstBinImage* img, uint32_t offset);
+const struct AstBinAttr* ast_bin_getattr(const struct AstBinImage* img, const struct AstBinNode* node,
+                                         const char* name);
+/* The `i`-th element of an AstList attribute, or of a node's child span. */
+const struct AstBinNode* ast_bin_list_elem(const struct AstBinImage* img, const struct AstBinAttr* attr, uint32_t i);
+const struct AstBinNode* ast_bin_child(const struct AstBinImage* img, const struct AstBinNode* node, uint32_t i);
@@ -0,0 +1,116 @@
+/*
+ * Reader of the binary AST image (ast_bin.h).  It needs nothing but libc,
+ * so that a tool can compile this file with the header and link nothing
+ * else of the compiler.
+ */
+#include "ast_bin.h"
+#include <string.h>  // memcmp, memset, strcmp
+
+
+int
+ast_bin_open(struct AstBinImage* img, const void* image, uint64_t image_size)
+{
+  const struct AstBinHeader* h = (const struct AstBinHeader*)image;
+  memset(img, 0, sizeof(*img));
+  if (image_size < sizeof(*h) || ((uintptr_t)image & 7) != 0 || memcmp(h->magic, AST_BIN_MAGIC, 8) != 0) {
+    return -1;
+  }
+  if (h->version != AST_BIN_VERSION || h->header_size != sizeof(*h) || h->image_size > image_size) {
+    return -1;
+  }
+  /* The tables are read in place, through pointers of their record types. */
+  if ((h->node_offset & 7) != 0 || (h->attr_offset & 7) != 0 || (h->child_offset & 7) != 0) {
+    return -1;
+  }
+  /* Offsets are untrusted: compare against what is left past each, so that no sum wraps. */
+  if (h->node_offset > image_size || h->node_count > (image_size - h->node_offset) / sizeof(struct AstBinNode)
+      || h->attr_offset > image_size || h->attr_count > (image_size - h->attr_offset) / sizeof(struct AstBinAttr)
+      || h->child_offset > image_size || h->child_count > (image_size - h->child_offset) / sizeof(uint32_t)
+      || h->string_offset > image_size || h->string_size > image_size - h->string_offset) {
+    return -1;
+  }
+  if (h->node_count == 0 || (h->string_size > 0 && ((const char*)image)[h->string_offset + h->string_size - 1] != '\0')) {
+    return -1;
+  }
+  img->header = h;
+  img->nodes = (const struct AstBinNode*)((const char*)image + h->node_offset);
+  img->attrs = (const struct AstBinAttr*)((const char*)image + h->attr_offset);
+  img->children = (const uint32_t*)((const char*)image + h->child_offset);
+  img->strings = (const char*)image + h->string_offset;
+
+  /* One pass over the tables, so that the accessors below never go out of bounds. */
+  uint32_t i;
+  for (i = 0; i < h->node_count; i++) {
+    const struct AstBinNode* node = &img->nodes[i];
+    if (node->attr_first > h->attr_count || node->attr_count > h->attr_count - node->attr_first
+        || node->child_first > h->child_count || node->child_count > h->child_count - node->child_first) {
+      return -1;
+    }
+  }
+  for (i = 0; i < h->attr_count; i++) {
+    const struct AstBinAttr* attr = &img->attrs[i];
+    if (attr->name >= h->string_size) {
+      return -1;
+    }
+    if (attr->type == AstBinAttr_AstList
+        && (attr->value < 0 || attr->value > h->child_count || attr->count > h->child_count - attr->value)) {
+      return -1;
+    }
+  }
+  for (i = 0; i < h->child_count; i++) {
+    if (img->children[i] >= h->node_count) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+const struct AstBinNode*
+ast_bin_node(const struct AstBinImage* img, uint32_t i)
+{
+  if (i >= img->header->node_count) {
+    return 0;
+  }
+  return &img->nodes[i];
+}
+
+const char*
+ast_bin_string(const struct AstBinImage* img, uint32_t offset)
+{
+  if (offset >= img->header->string_size) {
+    return 0;
+  }
+  return img->strings + offset;
+}
+
+const struct AstBinAttr*
+ast_bin_getattr(const struct AstBinImage* img, const struct AstBinNode* node, const char* name)
+{
+  uint32_t i;
+  for (i = 0; i < node->attr_count; i++) {
+    const struct AstBinAttr* attr = &img->attrs[node->attr_first + i];
+    const char* attr_name = ast_bin_string(img, attr->name);
+    if (attr_name && strcmp(attr_name, name) == 0) {
+      return attr;
+    }
+  }
+  return 0;
+}
+
+const struct AstBinNode*
+ast_bin_list_elem(const struct AstBinImage* img, const struct AstBinAttr* attr, uint32_t i)
+{
+  if (attr->type != AstBinAttr_AstList || i >= attr->count) {
+    return 0;
+  }
+  return ast_bin_node(img, img->children[attr->value + i]);
+}
+
+const struct AstBinNode*
+ast_bin_child(const struct AstBinImage* img, const struct AstBinNode* node, uint32_t i)
+{
+  if (i >= node->child_count) {
+    return 0;
+  }
+  return ast_bin_node(img, img->children[node->child_first + i]);
+}
@@ -0,0 +1,99 @@
+/*
+ * Smoke test of the AST image reader, linked with ast_bin_read.c alone, as
+ * an external tool would be.
+ *
+ *   build/ast_bin_test <image written by --emit-ast=bin>
+ *
+ * Walks every node of the image through the accessors, then checks that
+ * ast_bin_open rejects truncated and misaligned copies of it.
+ */
+#include "ast_bin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+static void
+check(int condition, const char* what)
+{
+  if (!condition) {
+    fprintf(stderr, "ast_bin_test: %s\n", what);
+    failures += 1;
+  }
+}
+
+static void
+walk_image(const struct AstBinImage* img)
+{
+  uint32_t i, k;
+  check(ast_bin_node(img, 0)->parent == AST_BIN_NULL, "node 0 has a parent");
+  check(ast_bin_node(img, img->header->node_count) == 0, "node past the end");
+  for (i = 0; i < img->header->node_count; i++) {
+    const struct AstBinNode* node = ast_bin_node(img, i);
+    for (k = 0; k < node->child_count; k++) {
+      check(ast_bin_child(img, node, k)->parent == i, "child of another parent");
+    }
+    check(ast_bin_child(img, node, node->child_count) == 0, "child past the span");
+    for (k = 0; k < node->attr_count; k++) {
+      const struct AstBinAttr* attr = &img->attrs[node->attr_first + k];
+      const char* name = ast_bin_string(img, attr->name);
+      uint32_t n;
+      check(name && ast_bin_getattr(img, node, name) != 0, "attribute not found by its name");
+      for (n = 0; attr->type == AstBinAttr_AstList && n < attr->count; n++) {
+        check(ast_bin_list_elem(img, attr, n) != 0, "list element out of the image");
+      }
+      if (attr->type == AstBinAttr_String && attr->value != AST_BIN_NULL) {
+        check(ast_bin_string(img, (uint32_t)attr->value) != 0, "string out of the table");
+      }
+    }
+  }
+}
+
+int
+main(int arg_count, char* args[])
+{
+  struct AstBinImage img;
+  if (arg_count != 2) {
+    fprintf(stderr, "usage: ast_bin_test <image>\n");
+    return 2;
+  }
+  FILE* f = fopen(args[1], "rb");
+  if (!f) {
+    fprintf(stderr, "ast_bin_test: cannot open `%s`\n", args[1]);
+    return 2;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  /* malloc aligns for any type; the extra 8 bytes hold a misaligned copy. */
+  char* image = malloc(size + 8);
+  char* copy = malloc(size + 8);
+  if (fread(image, 1, size, f) != (size_t)size) {
+    fprintf(stderr, "ast_bin_test: cannot read `%s`\n", args[1]);
+    return 2;
+  }
+  fclose(f);
+
+  check(ast_bin_open(&img, image, size) == 0, "the image is rejected");
+  if (failures == 0) {
+    walk_image(&img);
+  }
+  check(ast_bin_open(&img, image, size / 2) != 0, "a truncated image is accepted");
+  memcpy(copy + 1, image, size);
+  check(ast_bin_open(&img, copy + 1, size) != 0, "an image at a misaligned address is accepted");
+  memcpy(copy, image, size);
+  ((struct AstBinHeader*)copy)->attr_offset += 4;
+  check(ast_bin_open(&img, copy, size) != 0, "a misaligned table offset is accepted");
+  memcpy(copy, image, size);
+  ((struct AstBinHeader*)copy)->child_count = 0xffffffffu;
+  check(ast_bin_open(&img, copy, size) != 0, "a table past the end is accepted");
+
+  if (failures == 0) {
+    printf("%s: %u nodes, %u attributes\n", args[1], ((struct AstBinHeader*)image)->node_count,
+           ((struct AstBinHeader*)image)->attr_count);
+  }
+  free(image);
+  free(copy);
+  return failures > 0;
+}
@@ -1,5 +1,7 @@
 #include "basic.h"
 
+jmp_buf* error_recovery = 0;
+
 void
 assert_(char* message, char* file, int line)
 {
@@ -8,6 +10,9 @@ assert_(char* message, char* file, int line)
     message = "";
   }
   printf("assert(%s)\n", message);
+  if (error_recovery) {
+    longjmp(*error_recovery, 2);
+  }
   exit(2);
 }
 
@@ -120,5 +125,8 @@ error_(char* file, int line, char* message, ...)
     va_end(args);
     printf("\n");
   }
+  if (error_recovery) {
+    longjmp(*error_recovery, 1);
+  }
   exit(1);
 }
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdlib.h>   // malloc & free
 #include <stdarg.h>   // va_list, va_start, va_end
+#include <setjmp.h>
 
 
 #define local static
@@ -15,6 +16,11 @@
 #define KILOBYTE 1024
 #define MEGABYTE 1024*KILOBYTE
 
+/* Tracing is compiled out unless the build asks for it with -DDEBUG_ENABLED=1. */
+#ifndef DEBUG_ENABLED
+#define DEBUG_ENABLED 0
+#endif
+
 #if DEBUG_ENABLED
 #define DEBUG(msg, ...) \
   printf((msg), ## __VA_ARGS__);
@@ -30,3 +36,6 @@
 #define assert(expr) \
   do { if(!(expr)) assert_(#expr, __FILE__, __LINE__); } while(0)
 #define error(msg, ...)   error_(__FILE__, __LINE__, (msg), ## __VA_ARGS__)
+
+/* When set, error() and a failed assert() jump here instead of exiting (see `--batch`). */
+external jmp_buf* error_recovery;
@@ -0,0 +1,202 @@
+#!/usr/bin/python3
+# Generates a synthetic, self-contained P4 program (ebpfFilter model) for scaling benchmarks.
+#
+#   gen_p4.py --lines 100000 -o big.p4
+#   gen_p4.py --headers 50 --states 50 --actions 200 --tables 40 --nesting 4 --expr-depth 6 -o custom.p4
+#
+# With --lines, every count is derived from the target size; explicit counts override it.
+# The output only depends on the parameters and --seed.
+
+import sys, argparse, random
+
+PRELUDE = """\
+error {
+    NoError,
+    PacketTooShort,
+    NoMatch,
+    StackOutOfBounds,
+    HeaderTooShort,
+    ParserTimeout,
+    ParserInvalidArgument
+}
+
+extern packet_in {
+    void extract<T>(out T hdr);
+    T lookahead<T>();
+    void advance(in bit<32> sizeInBits);
+    bit<32> length();
+}
+
+extern packet_out {
+    void emit<T>(in T hdr);
+}
+
+extern void verify(in bool check, in error toSignal);
+
+action NoAction() {}
+
+match_kind {
+    exact,
+    ternary,
+    lpm
+}
+
+extern hash_table {
+    hash_table(bit<32> size);
+}
+
+parser parse<H>(packet_in packet, out H headers);
+control filter<H>(inout H headers, out bool accept);
+
+package ebpfFilter<H>(parse<H> prs,
+                      filter<H> filt);
+"""
+
+FIELDS = [("bit<8>", "kind"), ("bit<16>", "len"), ("bit<32>", "addr"), ("bit<32>", "data"), ("bit<8>", "next")]
+BINOPS = ["+", "-", "&", "|", "^"]
+MATCH_KINDS = ["exact", "exact", "ternary", "lpm"]
+
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.rnd = random.Random(args.seed)
+        self.out = []
+
+    def emit(self, line=""):
+        self.out.append(line)
+
+    def field_ref(self):
+        h = self.rnd.randrange(self.args.headers)
+        ty, name = FIELDS[self.rnd.randrange(len(FIELDS))]
+        return "headers.h%d.%s" % (h, name)
+
+    def expression(self, depth):
+        if depth <= 0:
+            if self.rnd.random() < 0.3:
+                return "32w%d" % self.rnd.randrange(1 << 16)
+            return "(bit<32>)%s" % self.field_ref()
+        return "(%s %s %s)" % (self.expression(depth - 1), self.rnd.choice(BINOPS), self.expression(depth - 1 - self.rnd.randrange(2)))
+
+    def headers(self):
+        for i in range(self.args.headers):
+            self.emit("header h%d_t {" % i)
+            for ty, name in FIELDS:
+                self.emit("    %s %s;" % (ty, name))
+            self.emit("}")
+            self.emit()
+        self.emit("struct Headers_t {")
+        for i in range(self.args.headers):
+            self.emit("    h%d_t h%d;" % (i, i))
+        self.emit("}")
+        self.emit()
+
+    def parser(self):
+        states = max(1, self.args.states)
+        self.emit("parser prs(packet_in p, out Headers_t headers) {")
+        for i in range(states):
+            name = "start" if i == 0 else "s%d" % i
+            h = i % self.args.headers
+            self.emit("    state %s {" % name)
+            self.emit("        p.extract(headers.h%d);" % h)
+            if i + 1 < states:
+                self.emit("        transition select(headers.h%d.next, headers.h%d.kind) {" % (h, h))
+                self.emit("            (8w%d, 8w%d) : s%d;" % (i % 256, (i * 7) % 256, i + 1))
+                if i + 2 < states:
+                    self.emit("            (8w%d, _) : s%d;" % ((i + 1) % 256, i + 2))
+                self.emit("            default : accept;")
+                self.emit("        }")
+            else:
+                self.emit("        transition accept;")
+            self.emit("    }")
+        self.emit("}")
+        self.emit()
+
+    def block(self, depth, indent):
+        pad = " " * indent
+        self.emit("%sbit<32> v%d = %s;" % (pad, depth, self.expression(self.args.expr_depth)))
+        if depth > 0:
+            self.emit("%sif (v%d == %s) {" % (pad, depth, self.expression(1)))
+            self.block(depth - 1, indent + 4)
+            self.emit("%s} else {" % pad)
+            self.emit("%s    %s = (bit<32>)v%d;" % (pad, self.field_ref().replace(".kind", ".data").replace(".next", ".data").replace(".len", ".addr"), depth))
+            self.emit("%s}" % pad)
+        else:
+            self.emit("%spass = v%d != 32w0;" % (pad, depth))
+
+    def control(self):
+        self.emit("control pipe(inout Headers_t headers, out bool pass) {")
+        for i in range(self.args.actions):
+            self.emit("    action a%d(bit<32> arg) {" % i)
+            self.block(self.args.nesting, 8)
+            self.emit("        headers.h%d.data = arg;" % (i % self.args.headers))
+            self.emit("    }")
+            self.emit()
+        for i in range(self.args.tables):
+            self.emit("    table t%d {" % i)
+            self.emit("        key = {")
+            for k in range(1 + i % 3):
+                self.emit("            %s : %s;" % (self.field_ref(), self.rnd.choice(MATCH_KINDS)))
+            self.emit("        }")
+            self.emit("        actions = {")
+            for k in range(min(4, self.args.actions)):
+                self.emit("            a%d;" % ((i + k) % self.args.actions))
+            self.emit("            NoAction;")
+            self.emit("        }")
+            self.emit("        implementation = hash_table(%d);" % (64 << (i % 8)))
+            self.emit("        default_action = NoAction;")
+            self.emit("    }")
+            self.emit()
+        self.emit("    apply {")
+        self.emit("        pass = true;")
+        for i in range(self.args.tables):
+            h = i % self.args.headers
+            self.emit("        if (headers.h%d.isValid()) {" % h)
+            self.emit("            t%d.apply();" % i)
+            self.emit("        }")
+        self.emit("    }")
+        self.emit("}")
+        self.emit()
+
+    def program(self):
+        self.emit("// Generated by bench/gen_p4.py %s" % " ".join(sys.argv[1:]))
+        self.emit(PRELUDE)
+        self.headers()
+        self.parser()
+        self.control()
+        self.emit("ebpfFilter(prs(), pipe()) main;")
+        return "\n".join(self.out) + "\n"
+
+
+def derive_counts(args):
+    # Roughly: a header is 9 lines, a parser state 8, an action ~(6 + 6*nesting), a table 14.
+    unit = 9 + 8 + (6 + 6 * args.nesting) * 2 + 14
+    n = max(1, args.lines // unit)
+    for name, value in [("headers", n), ("states", n), ("actions", 2 * n), ("tables", n)]:
+        if getattr(args, name) is None:
+            setattr(args, name, value)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument("--lines", type=int, default=1000, help="approximate size of the program")
+    ap.add_argument("--headers", type=int)
+    ap.add_argument("--states", type=int)
+    ap.add_argument("--actions", type=int)
+    ap.add_argument("--tables", type=int)
+    ap.add_argument("--nesting", type=int, default=2, help="depth of nested if/else blocks in actions")
+    ap.add_argument("--expr-depth", type=int, default=3, help="depth of arithmetic expression trees")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("-o", "--output", help="output file (default: stdout)")
+    args = ap.parse_args()
+    derive_counts(args)
+    text = Generator(args).program()
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,292 @@
+/*
+ * Microbenchmarks for the primitives every compiler phase is built on:
+ * the arena, UnboundedArray, hash_string and the symbol table.
+ *
+ *   build/microbench [--csv=<file>] [--seed=<n>]
+ *
+ * Every benchmark uses a fixed seed, so two compiler versions can be compared
+ * by diffing their CSV output.  The columns are:
+ *
+ *   benchmark,size,ops,ns_per_op,cycles_per_op,max_chain,chi2
+ *
+ * `max_chain` and `chi2` are only filled in by the hash distribution rows;
+ * `chi2` is normalized so that a uniformly random hash scores about 1.0.
+ */
+#include "basic.h"
+#include "arena.h"
+#include "hash.h"
+#include "symtable.h"
+#include <memory.h>  // memset
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+struct BenchTimer {
+  uint64_t ns;
+  uint64_t cycles;
+};
+
+internal FILE* csv_stream = 0;
+internal uint64_t rng_state = 0;
+internal uint64_t sink = 0;  /* keeps the measured loops from being optimized away */
+
+
+internal uint64_t
+rng_next()
+{
+  /* xorshift64* */
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ull;
+}
+
+internal uint64_t
+read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+internal void
+timer_start(struct BenchTimer* timer)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  timer->ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  timer->cycles = read_cycles();
+}
+
+internal void
+timer_stop(struct BenchTimer* timer)
+{
+  timer->cycles = read_cycles() - timer->cycles;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  timer->ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec - timer->ns;
+}
+
+internal void
+report(char* name, int size, int op_count, struct BenchTimer* timer)
+{
+  fprintf(csv_stream, "%s,%d,%d,%.2f,%.2f,,\n", name, size, op_count,
+          timer->ns / (double)op_count, timer->cycles / (double)op_count);
+}
+
+internal void
+report_distribution(char* name, int size, int op_count, struct BenchTimer* timer, int max_chain, double chi2)
+{
+  fprintf(csv_stream, "%s,%d,%d,%.2f,%.2f,%d,%.3f\n", name, size, op_count,
+          timer->ns / (double)op_count, timer->cycles / (double)op_count, max_chain, chi2);
+}
+
+/* Identifier-like names: a few common prefixes followed by a random suffix. */
+internal char**
+make_names(struct Arena* storage, int count, char* tag)
+{
+  static char* prefixes[] = {"hdr", "meta", "ipv4_", "eth", "tbl_", "act", "s", "x"};
+  char** names = arena_push(storage, count * sizeof(*names));
+  int i;
+  for (i = 0; i < count; i++) {
+    char buf[64];
+    uint64_t r = rng_next();
+    int len = snprintf(buf, sizeof(buf), "%s%s%d_%x", tag, prefixes[r % sizeof_array(prefixes)], i,
+                       (uint32_t)(r >> 32) & 0xfff);
+    names[i] = arena_push(storage, len + 1);
+    cstr_copy(names[i], buf);
+    names[i][len] = '\0';
+  }
+  return names;
+}
+
+internal void
+bench_arena()
+{
+  static int sizes[] = {16, 64, 256, 4096};
+  int op_count = 200000;
+  int s;
+  for (s = 0; s < sizeof_array(sizes); s++) {
+    struct Arena arena = {};
+    struct BenchTimer timer;
+    int i;
+    timer_start(&timer);
+    for (i = 0; i < op_count; i++) {
+      uint8_t* p = arena_push(&arena, sizes[s]);
+      sink += (uint64_t)p;
+    }
+    timer_stop(&timer);
+    report("arena_push", sizes[s], op_count, &timer);
+
+    timer_start(&timer);
+    arena_delete(&arena);
+    timer_stop(&timer);
+    report("arena_delete", sizes[s], 1, &timer);
+  }
+}
+
+internal void
+bench_array()
+{
+  static int sizes[] = {1000, 100000, 1000000};
+  int s;
+  for (s = 0; s < sizeof_array(sizes); s++) {
+    struct Arena storage = {};
+    struct UnboundedArray array;
+    struct BenchTimer timer;
+    int n = sizes[s];
+    int i;
+    array_init(&array, sizeof(int), &storage);
+    timer_start(&timer);
+    for (i = 0; i < n; i++) {
+      array_append(&array, &i);
+    }
+    timer_stop(&timer);
+    report("array_append", n, n, &timer);
+
+    int* indices = arena_push(&storage, n * sizeof(*indices));
+    for (i = 0; i < n; i++) {
+      indices[i] = rng_next() % n;
+    }
+    timer_start(&timer);
+    for (i = 0; i < n; i++) {
+      sink += *(int*)array_get(&array, indices[i]);
+    }
+    timer_stop(&timer);
+    report("array_get_random", n, n, &timer);
+
+    timer_start(&timer);
+    for (i = 0; i < n; i++) {
+      sink += *(int*)array_get(&array, i);
+    }
+    timer_stop(&timer);
+    report("array_get_sequential", n, n, &timer);
+    arena_delete(&storage);
+  }
+}
+
+internal void
+bench_hash()
+{
+  static int table_log2[] = {8, 12, 16};
+  int s;
+  for (s = 0; s < sizeof_array(table_log2); s++) {
+    struct Arena storage = {};
+    struct BenchTimer timer;
+    int m = table_log2[s];
+    int bucket_count = (1 << m) - 1;
+    int name_count = bucket_count;  /* load factor 1, like the symbol table before it grows */
+    char** names = make_names(&storage, name_count, "");
+    int* buckets = arena_push(&storage, bucket_count * sizeof(*buckets));
+    memset(buckets, 0, bucket_count * sizeof(*buckets));
+    int i;
+    timer_start(&timer);
+    for (i = 0; i < name_count; i++) {
+      buckets[hash_string(names[i], m)] += 1;
+    }
+    timer_stop(&timer);
+
+    int max_chain = 0;
+    double expected = name_count / (double)bucket_count, chi2 = 0.;
+    for (i = 0; i < bucket_count; i++) {
+      if (buckets[i] > max_chain) {
+        max_chain = buckets[i];
+      }
+      chi2 += (buckets[i] - expected) * (buckets[i] - expected) / expected;
+    }
+    report_distribution("hash_string", m, name_count, &timer, max_chain, chi2 / bucket_count);
+    arena_delete(&storage);
+  }
+}
+
+internal void
+bench_symtable()
+{
+  static int sizes[] = {100, 10000, 100000};
+  int s;
+  for (s = 0; s < sizeof_array(sizes); s++) {
+    struct Arena names_storage = {};
+    struct Arena symtable_storage = {};
+    struct BenchTimer timer;
+    int n = sizes[s];
+    int i;
+    symtable_set_storage(&symtable_storage);
+    symtable_flush();
+    char** names = make_names(&names_storage, n, "");
+
+    /* A miss inserts the name, as it does in the compiler. */
+    timer_start(&timer);
+    for (i = 0; i < n; i++) {
+      sink += (uint64_t)get_symtable_entry(names[i]);
+    }
+    timer_stop(&timer);
+    report("get_symtable_entry_miss", n, n, &timer);
+
+    int* indices = arena_push(&names_storage, n * sizeof(*indices));
+    for (i = 0; i < n; i++) {
+      indices[i] = rng_next() % n;
+    }
+    timer_start(&timer);
+    for (i = 0; i < n; i++) {
+      sink += (uint64_t)get_symtable_entry(names[indices[i]]);
+    }
+    timer_stop(&timer);
+    report("get_symtable_entry_hit", n, n, &timer);
+
+    /* Declare the names globally, then open and close small scopes that shadow some of them. */
+    for (i = 0; i < n; i++) {
+      new_ident(names[i], 0, 0);
+    }
+    int scope_count = 10000, decls_per_scope = 4;
+    timer_start(&timer);
+    for (i = 0; i < scope_count; i++) {
+      push_scope();
+      int j;
+      for (j = 0; j < decls_per_scope; j++) {
+        new_ident(names[indices[(i * decls_per_scope + j) % n]], 0, 0);
+      }
+      pop_scope();
+    }
+    timer_stop(&timer);
+    report("push_pop_scope", n, scope_count, &timer);
+
+    arena_delete(&symtable_storage);
+    arena_delete(&names_storage);
+  }
+}
+
+int
+main(int arg_count, char* args[])
+{
+  init_memory(2048*(uint64_t)MEGABYTE);
+  csv_stream = stdout;
+  rng_state = 0x9e3779b97f4a7c15ull;
+  int i;
+  for (i = 1; i < arg_count; i++) {
+    if (cstr_start_with(args[i], "--csv=")) {
+      csv_stream = fopen(args[i] + 6, "w");
+      if (!csv_stream) {
+        error("could not open `%s` for writing.", args[i] + 6);
+      }
+    } else if (cstr_start_with(args[i], "--seed=")) {
+      rng_state = strtoull(args[i] + 7, 0, 0);
+      if (rng_state == 0) {
+        rng_state = 1;
+      }
+    } else error("unknown argument `%s`.", args[i]);
+  }
+
+  fprintf(csv_stream, "benchmark,size,ops,ns_per_op,cycles_per_op,max_chain,chi2\n");
+  bench_arena();
+  bench_array();
+  bench_hash();
+  bench_symtable();
+  if (csv_stream != stdout) {
+    fclose(csv_stream);
+  }
+  return 0;
+}
@@ -0,0 +1,157 @@
+#!/usr/bin/python3
+# Front-end scaling benchmark.
+#
+# Generates synthetic programs of increasing size with gen_p4.py, compiles each one with
+# `ashp4c --stats=<file>` and reports wall time and peak arena memory per phase.
+#
+#   bench/run_bench.py                       # 1k .. 1M lines, compare against bench/baseline.json
+#   bench/run_bench.py --sizes 1000,10000    # quick run
+#   bench/run_bench.py --update-baseline     # record the current numbers as the new baseline
+#
+# Two kinds of problems are reported, and either one makes the script exit with status 1:
+#   - regressions: a phase takes a larger share of the compile time (or uses more memory) than in the
+#     baseline, by more than --tolerance.  Shares rather than milliseconds, so that a baseline recorded
+#     on another machine still applies; a slowdown of every phase alike shows in the table only;
+#   - superlinear phases: the time of a phase grows faster than the size of the input
+#     (log-log slope between two consecutive sizes above --max-slope).
+# Phases that take less than --noise-floor milliseconds are not checked.
+
+import sys, os, json, math, argparse, subprocess
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+DEFAULT_SIZES = "1000,10000,100000,1000000"
+
+def stdout_print(text):
+    sys.stdout.write(text)
+    sys.stdout.flush()
+
+def run_once(compiler, source, stats_file):
+    subprocess.run([compiler, source, "--stats=%s" % stats_file], check=True, stdout=subprocess.DEVNULL)
+    with open(stats_file) as f:
+        return json.load(f)
+
+def measure(args, lines):
+    source = os.path.join(args.out_dir, "gen_%d.p4" % lines)
+    if not os.path.exists(source):
+        subprocess.run([sys.executable, os.path.join(BENCH_DIR, "gen_p4.py"), "--lines", str(lines),
+                        "--seed", str(args.seed), "-o", source], check=True)
+    stats_file = os.path.join(args.out_dir, "gen_%d.stats.json" % lines)
+    # Keep the fastest of the repeats; memory does not vary between runs.
+    best = None
+    for _ in range(args.repeat):
+        stats = run_once(args.compiler, source, stats_file)
+        if best is None:
+            best = stats
+        else:
+            for b, p in zip(best["phases"], stats["phases"]):
+                b["wall_ns"] = min(b["wall_ns"], p["wall_ns"])
+                b["cpu_ns"] = min(b["cpu_ns"], p["cpu_ns"])
+    result = {
+        "lines": lines,
+        "source_bytes": best["source_bytes"],
+        "token_count": best["token_count"],
+        "ast_node_count": best["ast_node_count"],
+        "peak_bytes": best["memory"]["peak_bytes"],
+        "maxrss_bytes": best["memory"]["maxrss_bytes"],
+        "phases": {},
+    }
+    for p in best["phases"]:
+        result["phases"][p["name"]] = {"wall_ms": p["wall_ns"] / 1e6, "peak_bytes": p["peak_bytes"]}
+    return result
+
+def print_table(results):
+    phases = list(results[0]["phases"].keys())
+    stdout_print("%-24s" % "phase" + "".join("%20s" % ("%d lines" % r["lines"]) for r in results) + "\n")
+    for name in phases:
+        stdout_print("%-24s" % name)
+        for r in results:
+            p = r["phases"].get(name)
+            stdout_print("%20s" % ("%.1f ms %5d MB" % (p["wall_ms"], p["peak_bytes"] >> 20) if p else "-"))
+        stdout_print("\n")
+    stdout_print("%-24s" % "maxrss")
+    for r in results:
+        stdout_print("%20s" % ("%d MB" % (r["maxrss_bytes"] >> 20)))
+    stdout_print("\n")
+
+def check_scaling(args, results):
+    problems = []
+    for prev, cur in zip(results, results[1:]):
+        size_ratio = math.log(cur["source_bytes"] / prev["source_bytes"])
+        for name, p in cur["phases"].items():
+            q = prev["phases"].get(name)
+            if not q or q["wall_ms"] < args.noise_floor or p["wall_ms"] < args.noise_floor:
+                continue
+            slope = math.log(p["wall_ms"] / q["wall_ms"]) / size_ratio
+            if slope > args.max_slope:
+                problems.append("superlinear: %s grows as n^%.2f between %d and %d lines (%.2f ms -> %.2f ms)"
+                                % (name, slope, prev["lines"], cur["lines"], q["wall_ms"], p["wall_ms"]))
+    return problems
+
+def time_shares(result, names):
+    # Share of each of the phases `names` in the time of them all.
+    total = sum(result["phases"][name]["wall_ms"] for name in names)
+    return dict((name, result["phases"][name]["wall_ms"] / total if total > 0 else 0.0) for name in names)
+
+def check_baseline(args, results, baseline):
+    problems = []
+    by_lines = dict((r["lines"], r) for r in baseline.get("results", []))
+    limit = 1.0 + args.tolerance
+    for r in results:
+        base = by_lines.get(r["lines"])
+        if not base:
+            continue
+        names = [name for name in r["phases"] if name in base["phases"]]
+        shares, base_shares = time_shares(r, names), time_shares(base, names)
+        for name in names:
+            p, b = r["phases"][name], base["phases"][name]
+            if p["wall_ms"] >= args.noise_floor and shares[name] > base_shares[name] * limit:
+                problems.append("regression: %s at %d lines took %.1f%% of the time of the phases (%.2f ms), "
+                                "baseline %.1f%% (%.2f ms)" % (name, r["lines"], 100 * shares[name], p["wall_ms"],
+                                                             100 * base_shares[name], b["wall_ms"]))
+            if p["peak_bytes"] > b["peak_bytes"] * limit and p["peak_bytes"] - b["peak_bytes"] > (1 << 20):
+                problems.append("regression: %s at %d lines peaked at %d KB, baseline %d KB"
+                                % (name, r["lines"], p["peak_bytes"] >> 10, b["peak_bytes"] >> 10))
+    return problems
+
+def main():
+    ap = argparse.ArgumentParser(description="ashp4c front-end scaling benchmark")
+    ap.add_argument("--compiler", default=os.path.join(REPO_DIR, "build", "ashp4c"))
+    ap.add_argument("--sizes", default=DEFAULT_SIZES, help="comma separated program sizes, in lines")
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--out-dir", default=os.path.join(BENCH_DIR, "out"))
+    ap.add_argument("--baseline", default=os.path.join(BENCH_DIR, "baseline.json"))
+    ap.add_argument("--update-baseline", action="store_true")
+    ap.add_argument("--tolerance", type=float, default=0.25,
+                    help="allowed growth of a phase's share of the time vs the baseline (0.25 = 25%%)")
+    ap.add_argument("--max-slope", type=float, default=1.25, help="largest acceptable log-log growth of a phase")
+    ap.add_argument("--noise-floor", type=float, default=2.0, help="ignore phases faster than this (ms)")
+    args = ap.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    results = []
+    for lines in [int(s) for s in args.sizes.split(",")]:
+        stdout_print("compiling %d lines ...\n" % lines)
+        results.append(measure(args, lines))
+    print_table(results)
+
+    with open(os.path.join(args.out_dir, "results.json"), "w") as f:
+        json.dump({"results": results}, f, indent=2)
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump({"seed": args.seed, "results": results}, f, indent=2)
+            f.write("\n")
+        stdout_print("baseline written to %s\n" % args.baseline)
+        return 0
+
+    problems = check_scaling(args, results)
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            problems += check_baseline(args, results, json.load(f))
+    for p in problems:
+        stdout_print(p + "\n")
+    return 1 if problems else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,139 @@
+#!/usr/bin/python3
+# Parser select benchmark for the XDP target.
+#
+# Generates parsers whose last state selects on a bit<16> tag among N cases, with the case values
+# either dense (0 .. N-1) or sparse (random), compiles each one with --target=xdp and every
+# --select lowering, builds the C with the host compiler against bench/xdp_host and reports the
+# ns/packet of the fastest round.  The linear chain of compares is the reference.
+#
+#   bench/select_bench.py                          # 4 .. 256 cases
+#   bench/select_bench.py --cases 8,64 --rounds 50
+#
+# The ns/packet only compare the lowerings with each other: the host runs the C, not the verified
+# BPF, and the array map behind --select=map is read directly like the kernel's inlined lookup.
+
+import sys, os, random, argparse, subprocess
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+INCLUDE_DIR = os.path.join(REPO_DIR, "testdata", "include")
+LOWERINGS = ["linear", "tree", "map", "auto"]
+STATE_COUNT = 8
+
+def stdout_print(text):
+    sys.stdout.write(text)
+    sys.stdout.flush()
+
+def prelude():
+    text = ""
+    for name in ["core.p4", "xdp_model.p4"]:
+        with open(os.path.join(INCLUDE_DIR, name)) as f:
+            text += "".join(l for l in f if not l.startswith("#include"))
+    return text
+
+def gen_program(values):
+    out = [prelude()]
+    out.append("header Ethernet_h { bit<48> dstAddr; bit<48> srcAddr; bit<16> etherType; }")
+    out.append("header Tag_h { bit<16> v; }")
+    out.append("header Byte_h { bit<8> v; }")
+    out.append("struct Headers { Ethernet_h ethernet; Tag_h tag; %s }"
+               % " ".join("Byte_h b%d;" % i for i in range(STATE_COUNT)))
+    out.append("parser Parser(packet_in packet, out Headers hd) {")
+    out.append("    state start {")
+    out.append("        packet.extract(hd.ethernet);")
+    out.append("        transition select(hd.ethernet.etherType) { 0x88b5 : parse_tag; default : accept; }")
+    out.append("    }")
+    out.append("    state parse_tag {")
+    out.append("        packet.extract(hd.tag);")
+    out.append("        transition select(hd.tag.v) {")
+    for i, v in enumerate(values):
+        out.append("            %d : parse_b%d;" % (v, i % STATE_COUNT))
+    out.append("            default : reject;")
+    out.append("        }")
+    out.append("    }")
+    for i in range(STATE_COUNT):
+        out.append("    state parse_b%d { packet.extract(hd.b%d); transition accept; }" % (i, i))
+    out.append("}")
+    out.append("control Ingress(inout Headers hdr, in xdp_input xin, out xdp_output xout) {")
+    out.append("    apply {")
+    out.append("        xout.output_action = xdp_action.XDP_PASS;")
+    for i in range(STATE_COUNT):
+        out.append("        if (hdr.b%d.isValid()) { xout.output_action = xdp_action.XDP_TX; }" % i)
+    out.append("    }")
+    out.append("}")
+    out.append("control Deparser(in Headers hdr, packet_out packet) {")
+    out.append("    apply {")
+    out.append("        packet.emit(hdr.ethernet);")
+    out.append("        packet.emit(hdr.tag);")
+    for i in range(STATE_COUNT):
+        out.append("        packet.emit(hdr.b%d);" % i)
+    out.append("    }")
+    out.append("}")
+    out.append("xdp(Parser(), Ingress(), Deparser()) main;")
+    return "\n".join(out) + "\n"
+
+def gen_packets(values, count, rng):
+    # One packet in ten misses every case.
+    data = bytearray()
+    for _ in range(count):
+        v = rng.choice(values) if rng.random() < 0.9 else rng.randrange(1 << 16)
+        packet = bytes(12) + b"\x88\xb5" + bytes([v >> 8, v & 255, rng.randrange(256)]) + bytes(47)
+        data += bytes([len(packet) & 255, len(packet) >> 8]) + packet
+    return bytes(data)
+
+def measure(args, name, lowering, packets):
+    source = os.path.join(args.out_dir, name + ".p4")
+    program = os.path.join(args.out_dir, "%s_%s.c" % (name, lowering))
+    binary = os.path.join(args.out_dir, "%s_%s" % (name, lowering))
+    command = [args.compiler, source, "--target=xdp", "--output=%s" % program]
+    if lowering != "auto":
+        command.append("--select=%s" % lowering)
+    subprocess.run(command, check=True, stdout=subprocess.DEVNULL)
+    # BPF has no indirect jumps: keep the host compiler from turning the compares into a jump table.
+    subprocess.run([args.cc, "-O2", "-w", "-fno-jump-tables", "-fno-bit-tests", "-fno-tree-switch-conversion",
+                    "-I", os.path.join(BENCH_DIR, "xdp_host"), "-DPROGRAM=\"%s\"" % program, os.path.join(BENCH_DIR, "xdp_host", "driver.c"), "-o", binary],
+                   check=True)
+    result = subprocess.run([binary, packets, str(args.rounds)], check=True, stdout=subprocess.PIPE)
+    line = result.stdout.decode()
+    return float(line.split()[0]), line.split("actions")[1].strip()
+
+def main():
+    ap = argparse.ArgumentParser(description="ashp4c parser select benchmark")
+    ap.add_argument("--compiler", default=os.path.join(REPO_DIR, "build", "ashp4c"))
+    ap.add_argument("--cc", default="cc")
+    ap.add_argument("--cases", default="4,16,64,256", help="comma separated numbers of select cases")
+    ap.add_argument("--packets", type=int, default=10000)
+    ap.add_argument("--rounds", type=int, default=20)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--out-dir", default=os.path.join(BENCH_DIR, "out"))
+    args = ap.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    stdout_print("%-20s" % "cases" + "".join("%12s" % l for l in LOWERINGS) + "\n")
+    status = 0
+    for n in [int(s) for s in args.cases.split(",")]:
+        for spread in ["dense", "sparse"]:
+            rng = random.Random(args.seed * 1000 + n)
+            values = list(range(n)) if spread == "dense" else rng.sample(range(1 << 16), n)
+            name = "select_%s_%d" % (spread, n)
+            with open(os.path.join(args.out_dir, name + ".p4"), "w") as f:
+                f.write(gen_program(values))
+            packets = os.path.join(args.out_dir, name + ".pkt")
+            with open(packets, "wb") as f:
+                f.write(gen_packets(values, args.packets, rng))
+            row, actions = [], set()
+            for lowering in LOWERINGS:
+                ns, counts = measure(args, name, lowering, packets)
+                row.append(ns)
+                actions.add(counts)
+            stdout_print("%-20s" % ("%d %s" % (n, spread)) + "".join("%12.2f" % ns for ns in row))
+            # Every lowering must take the same decisions.
+            if len(actions) != 1:
+                stdout_print("  MISMATCH: %s" % " / ".join(sorted(actions)))
+                status = 1
+            stdout_print("\n")
+    stdout_print("(ns/packet)\n")
+    return status
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,150 @@
+#!/usr/bin/python3
+# Header stack benchmark for the BPF and XDP targets.
+#
+# Generates MPLS programs whose stack of labels is N deep: the parser loops over the labels with
+# `next` until the bottom of the stack, and the control decrements the TTL of `last` and marks the
+# label at an index taken from the packet.  Each program is compiled with every --stacks lowering,
+# with --target=bpf for the size of the code and what the verifier is expected to walk of it, and
+# with --target=xdp, built with the host compiler against bench/xdp_host, for the ns/packet of the
+# fastest round.
+#
+#   bench/stack_bench.py                           # 2 .. 32 labels
+#   bench/stack_bench.py --depths 4,16 --rounds 50
+#
+# Unrolled stacks compare the index against each element and copy the access per element; indexed
+# ones compute the address of the element once.  --stacks=auto unrolls up to 4 elements.  The host
+# runs the C, not the verified BPF: the ns/packet only compare the lowerings with each other.
+
+import sys, os, random, argparse, subprocess
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+INCLUDE_DIR = os.path.join(REPO_DIR, "testdata", "include")
+LOWERINGS = ["unroll", "index", "auto"]
+
+def stdout_print(text):
+    sys.stdout.write(text)
+    sys.stdout.flush()
+
+def prelude():
+    text = ""
+    for name in ["core.p4", "xdp_model.p4"]:
+        with open(os.path.join(INCLUDE_DIR, name)) as f:
+            text += "".join(l for l in f if not l.startswith("#include"))
+    return text
+
+def gen_program(depth):
+    out = [prelude()]
+    out.append("header Ethernet_h { bit<48> dstAddr; bit<48> srcAddr; bit<16> etherType; }")
+    out.append("header Mpls_h { bit<20> label; bit<3> tc; bit<1> bos; bit<8> ttl; }")
+    out.append("header IPv4_h { bit<4> version; bit<4> ihl; bit<8> diffserv; bit<16> totalLen; bit<16> identification;")
+    out.append("    bit<3> flags; bit<13> fragOffset; bit<8> ttl; bit<8> protocol; bit<16> hdrChecksum;")
+    out.append("    bit<32> srcAddr; bit<32> dstAddr; }")
+    out.append("struct Headers { Ethernet_h ethernet; Mpls_h[%d] mpls; IPv4_h ipv4; }" % depth)
+    out.append("parser Parser(packet_in packet, out Headers hd) {")
+    out.append("    state start {")
+    out.append("        packet.extract(hd.ethernet);")
+    out.append("        transition select(hd.ethernet.etherType) { 0x8847 : parse_mpls; 0x0800 : parse_ipv4; default : accept; }")
+    out.append("    }")
+    out.append("    state parse_mpls {")
+    out.append("        packet.extract(hd.mpls.next);")
+    out.append("        transition select(hd.mpls.last.bos) { 1 : parse_ipv4; default : parse_mpls; }")
+    out.append("    }")
+    out.append("    state parse_ipv4 { packet.extract(hd.ipv4); transition accept; }")
+    out.append("}")
+    out.append("control Ingress(inout Headers hdr, in xdp_input xin, out xdp_output xout) {")
+    out.append("    apply {")
+    out.append("        xout.output_action = xdp_action.XDP_PASS;")
+    out.append("        if (hdr.mpls[0].isValid()) {")
+    out.append("            hdr.mpls.last.ttl = hdr.mpls.last.ttl - 1;")
+    out.append("            if (hdr.mpls.last.ttl == 0) { xout.output_action = xdp_action.XDP_DROP; }")
+    out.append("            bit<32> i = (bit<32>)hdr.ethernet.dstAddr[7:0];")
+    out.append("            if (hdr.mpls[i].isValid()) {")
+    out.append("                hdr.mpls[i].tc = 5;")
+    out.append("                xout.output_action = xdp_action.XDP_TX;")
+    out.append("            }")
+    out.append("        }")
+    out.append("    }")
+    out.append("}")
+    out.append("control Deparser(in Headers hdr, packet_out packet) {")
+    out.append("    apply { packet.emit(hdr.ethernet); packet.emit(hdr.mpls); packet.emit(hdr.ipv4); }")
+    out.append("}")
+    out.append("xdp(Parser(), Ingress(), Deparser()) main;")
+    return "\n".join(out) + "\n"
+
+def gen_packets(depth, count, rng):
+    # Labels from 1 to the depth of the stack, the index of the marked one anywhere within it.
+    data = bytearray()
+    for _ in range(count):
+        labels = rng.randint(1, depth)
+        mpls = bytearray()
+        for k in range(labels):
+            word = (rng.randrange(1 << 20) << 12) | ((k == labels - 1) << 8) | rng.randint(1, 3)
+            mpls += word.to_bytes(4, "big")
+        ipv4 = bytes([0x45, 0, 0, 20, 0, 0, 0, 0, 64, 17, 0, 0]) + bytes([10, 0, 0, 1, 10, 0, 0, 2])
+        packet = bytes(5) + bytes([rng.randrange(depth)]) + bytes(6) + b"\x88\x47" + bytes(mpls) + ipv4 + bytes(18)
+        data += bytes([len(packet) & 255, len(packet) >> 8]) + packet
+    return bytes(data)
+
+def complexity(args, name, lowering):
+    # The first stage: "stage 0: N instructions, ...; the verifier walks about W of M".
+    source = os.path.join(args.out_dir, name + ".p4")
+    result = subprocess.run([args.compiler, source, "--target=bpf", "--stacks=%s" % lowering, "--print-complexity",
+                             "--output=%s" % os.path.join(args.out_dir, "%s_%s.bpf.o" % (name, lowering))],
+                            check=True, stdout=subprocess.PIPE)
+    line = [l for l in result.stdout.decode().splitlines() if l.startswith("stage 0:")][0]
+    return int(line.split()[2]), int(line.split("about")[1].split()[0])
+
+def measure(args, name, lowering, packets):
+    source = os.path.join(args.out_dir, name + ".p4")
+    program = os.path.join(args.out_dir, "%s_%s.c" % (name, lowering))
+    binary = os.path.join(args.out_dir, "%s_%s" % (name, lowering))
+    subprocess.run([args.compiler, source, "--target=xdp", "--stacks=%s" % lowering, "--output=%s" % program],
+                   check=True, stdout=subprocess.DEVNULL)
+    # BPF has no indirect jumps: keep the host compiler from turning the compares into a jump table.
+    subprocess.run([args.cc, "-O2", "-w", "-fno-jump-tables", "-fno-bit-tests", "-fno-tree-switch-conversion",
+                    "-I", os.path.join(BENCH_DIR, "xdp_host"), "-DPROGRAM=\"%s\"" % program, os.path.join(BENCH_DIR, "xdp_host", "driver.c"), "-o", binary],
+                   check=True)
+    result = subprocess.run([binary, packets, str(args.rounds)], check=True, stdout=subprocess.PIPE)
+    line = result.stdout.decode()
+    return float(line.split()[0]), line.split("actions")[1].strip()
+
+def main():
+    ap = argparse.ArgumentParser(description="ashp4c header stack benchmark")
+    ap.add_argument("--compiler", default=os.path.join(REPO_DIR, "build", "ashp4c"))
+    ap.add_argument("--cc", default="cc")
+    ap.add_argument("--depths", default="2,4,8,16,32", help="comma separated depths of the stack")
+    ap.add_argument("--packets", type=int, default=10000)
+    ap.add_argument("--rounds", type=int, default=20)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--out-dir", default=os.path.join(BENCH_DIR, "out"))
+    args = ap.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    stdout_print("%-8s" % "depth" + "".join("%30s" % l for l in LOWERINGS) + "\n")
+    status = 0
+    for n in [int(s) for s in args.depths.split(",")]:
+        rng = random.Random(args.seed * 1000 + n)
+        name = "stack_%d" % n
+        with open(os.path.join(args.out_dir, name + ".p4"), "w") as f:
+            f.write(gen_program(n))
+        packets = os.path.join(args.out_dir, name + ".pkt")
+        with open(packets, "wb") as f:
+            f.write(gen_packets(n, args.packets, rng))
+        row, actions = [], set()
+        for lowering in LOWERINGS:
+            insns, walked = complexity(args, name, lowering)
+            ns, counts = measure(args, name, lowering, packets)
+            row.append("%d/%d/%.2f" % (insns, walked, ns))
+            actions.add(counts)
+        stdout_print("%-8d" % n + "".join("%30s" % r for r in row))
+        # Every lowering must take the same decisions.
+        if len(actions) != 1:
+            stdout_print("  MISMATCH: %s" % " / ".join(sorted(actions)))
+            status = 1
+        stdout_print("\n")
+    stdout_print("(BPF instructions / instructions the verifier walks / ns/packet)\n")
+    return status
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,149 @@
+#!/usr/bin/python3
+# Kernel benchmark for the BPF target.
+#
+# Compiles the eBPF programs of testdata with --target=bpf and runs each object in the kernel with
+# ebpf/build/test_run, which loads it through the verifier and times it with BPF_PROG_TEST_RUN over
+# the same generated packets on every run.  Reports the ns/packet the kernel measured and the
+# verdicts.  With --flags, each program is compiled a second time with those options and its
+# outputs are compared packet by packet with those of the first build.  The reference interpreter
+# (ashp4c --run) goes over the same packets in userspace: its ns/packet is the `ir` column, and its
+# outputs and verdicts must be those of the kernel.  So must those of the same program built with
+# --target=ubpf and run by ebpf/build/ubpf_run on one VM, whose ns/packet is the `ubpf` column.
+#
+#   sudo bench/test_run_bench.py
+#   sudo bench/test_run_bench.py --flags=--split=blocks --runs 10000
+#
+# Needs root, or CAP_BPF and CAP_PERFMON, to load the programs; nothing is attached to an interface.
+
+import sys, os, glob, argparse, subprocess
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+def stdout_print(text):
+    sys.stdout.write(text)
+    sys.stdout.flush()
+
+def compile_program(args, source, flags, output, target="bpf"):
+    result = subprocess.run([args.compiler, source, "--target=%s" % target, "--output=%s" % output] + flags,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    return result.returncode == 0
+
+def test_run(args, program, extra):
+    # The loader prints the kprobe events it does not find on stderr: only stdout is the report.
+    result = subprocess.run([args.test_run, "-r", str(args.runs), "-n", str(args.packets), "-s", str(args.seed)]
+                            + extra + [program], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    lines = result.stdout.decode().splitlines()
+    report = [l for l in lines if "ns/packet" in l]
+    if not report:
+        # Why the verifier rejected the program follows the instructions it walked, before its statistics.
+        reasons = [l for l in lines if l and not l[0].isdigit() and not l.startswith(("cur state", "old state", "processed"))]
+        return None, reasons[-1].strip() if reasons else "not loaded", result.returncode
+    verdicts = [l for l in lines if l.startswith("verdicts:")][0].split()[1:]
+    counts = " ".join("%s %s" % (verdicts[i], verdicts[i + 1]) for i in range(0, len(verdicts), 2) if verdicts[i + 1] != "0")
+    return float(report[0].split()[-2]), counts, result.returncode
+
+def ubpf_run(args, source, packets, expected):
+    program = os.path.join(args.out_dir, os.path.basename(source)[:-3] + ".ubpf.o")
+    if not compile_program(args, source, [], program, "ubpf"):
+        return None, None, 1
+    result = subprocess.run([args.ubpf_run, "-j", "1", "-r", str(args.runs), "-e", expected, program, packets],
+                            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    lines = result.stdout.decode().splitlines()
+    report = [l for l in lines if "ns/packet" in l]
+    if not report:
+        return None, None, 1
+    verdicts = [l for l in lines if l.startswith("verdicts:")][0].split()[1:]
+    counts = " ".join("%s %s" % (verdicts[i], verdicts[i + 1]) for i in range(0, len(verdicts), 2) if verdicts[i + 1] != "0")
+    return float(report[0].split()[-2]), counts, result.returncode
+
+def run_ir(args, source, packets, output):
+    result = subprocess.run([args.compiler, source, "--run=%s" % packets, "--run-output=%s" % output,
+                             "--run-repeat=%d" % args.ir_runs], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    lines = result.stdout.decode().splitlines()
+    report = [l for l in lines if "ns/packet" in l]
+    if result.returncode != 0 or not report:
+        return None, None
+    verdicts = [l for l in lines if l.startswith("verdicts:")][0].split()[1:]
+    counts = " ".join("%s %s" % (verdicts[i], verdicts[i + 1]) for i in range(0, len(verdicts), 2) if verdicts[i + 1] != "0")
+    return float(report[0].split()[-2]), counts
+
+def same_file(a, b):
+    with open(a, "rb") as fa, open(b, "rb") as fb:
+        return fa.read() == fb.read()
+
+def main():
+    ap = argparse.ArgumentParser(description="ashp4c kernel benchmark")
+    ap.add_argument("--compiler", default=os.path.join(REPO_DIR, "build", "ashp4c"))
+    ap.add_argument("--test-run", default=os.path.join(REPO_DIR, "ebpf", "build", "test_run"))
+    ap.add_argument("--ubpf-run", default=os.path.join(REPO_DIR, "ebpf", "build", "ubpf_run"))
+    ap.add_argument("--flags", default="", help="compiler options of a second build to compare the outputs of")
+    ap.add_argument("--packets", type=int, default=1000)
+    ap.add_argument("--runs", type=int, default=1000)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--ir-runs", type=int, default=10, help="runs of each packet by the interpreter")
+    ap.add_argument("--out-dir", default=os.path.join(BENCH_DIR, "out"))
+    ap.add_argument("programs", nargs="*")
+    args = ap.parse_args()
+
+    programs = args.programs or sorted(glob.glob(os.path.join(REPO_DIR, "testdata", "*ebpf.p4")))
+    flags = args.flags.split()
+    os.makedirs(args.out_dir, exist_ok=True)
+    stdout_print("%-24s%12s%12s%12s%12s  %s\n" % ("program", "ns/packet", "ns/packet'" if flags else "", "ir", "ubpf",
+                                                "verdicts"))
+    status = 0
+    for source in programs:
+        name = os.path.basename(source)[:-3]
+        program = os.path.join(args.out_dir, name + ".bpf.o")
+        outputs = os.path.join(args.out_dir, name + ".pcap")
+        packets = os.path.join(args.out_dir, name + ".in.pcap")
+        ir_outputs = os.path.join(args.out_dir, name + ".ir.pcap")
+        if not compile_program(args, source, [], program):
+            stdout_print("%-24s  does not compile\n" % name)
+            status = 1
+            continue
+        ns, counts, _ = test_run(args, program, ["-o", outputs, "-w", packets])
+        if ns is None:
+            stdout_print("%-24s  REJECTED: %s\n" % (name, counts))
+            status = 1
+            continue
+        other = ""
+        if flags:
+            program = os.path.join(args.out_dir, name + ".flags.bpf.o")
+            if not compile_program(args, source, flags, program):
+                other = "no build"
+                status = 1
+            else:
+                other_ns, other_counts, code = test_run(args, program, ["-e", outputs])
+                if other_ns is None:
+                    other = "REJECTED"
+                    counts += "  (%s)" % other_counts
+                    status = 1
+                else:
+                    other = "%.1f" % other_ns
+                    if code != 0 or other_counts != counts:
+                        counts += "  MISMATCH: %s" % other_counts
+                        status = 1
+        ir_ns, ir_counts = run_ir(args, source, packets, ir_outputs)
+        if ir_ns is None:
+            ir = "FAILED"
+            status = 1
+        else:
+            ir = "%.1f" % ir_ns
+            if ir_counts != counts.split("  ")[0] or not same_file(ir_outputs, outputs):
+                counts += "  IR MISMATCH: %s" % ir_counts
+                status = 1
+        ubpf_ns, ubpf_counts, code = ubpf_run(args, source, packets, outputs)
+        if ubpf_ns is None:
+            ubpf = "FAILED"
+            status = 1
+        else:
+            ubpf = "%.1f" % ubpf_ns
+            if code != 0 or ubpf_counts != counts.split("  ")[0]:
+                counts += "  UBPF MISMATCH: %s" % ubpf_counts
+                status = 1
+        stdout_print("%-24s%12.1f%12s%12s%12s  %s\n" % (name, ns, other, ir, ubpf, counts))
+    return status
+
+if __name__ == "__main__":
+    sys.exit(main())
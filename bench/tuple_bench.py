@@ -0,0 +1,165 @@
+#!/usr/bin/python3
+# Ternary table benchmark for the XDP target.
+#
+# Generates ACL programs whose one table matches protocol, source and destination address with
+# ternary keys and holds N const entries drawn from a few masks, compiles each one with --target=xdp
+# and every --ternary kind, builds the C with the host compiler against bench/xdp_host and reports
+# the millions of lookups per second of the fastest round, one lookup per packet.
+#
+#   bench/tuple_bench.py                           # 16 .. 4096 entries
+#   bench/tuple_bench.py --entries 64,1024 --masks 4 --rounds 50
+#
+# An inlined table is a chain of compares in the order of the entries, a scanned one an array of
+# entries tried in that order; a tuple space table probes a hash map once per mask, so its cost
+# follows the number of masks rather than the number of entries.  Scanned tables have at most 1024
+# entries.  The host runs the C, not the verified BPF: the numbers only compare the kinds with each
+# other.
+
+import sys, os, random, argparse, subprocess
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+INCLUDE_DIR = os.path.join(REPO_DIR, "testdata", "include")
+KINDS = ["inline", "scan", "tuple"]
+SCAN_MAX_ENTRIES = 1024
+
+def stdout_print(text):
+    sys.stdout.write(text)
+    sys.stdout.flush()
+
+def prelude():
+    text = ""
+    for name in ["core.p4", "xdp_model.p4"]:
+        with open(os.path.join(INCLUDE_DIR, name)) as f:
+            text += "".join(l for l in f if not l.startswith("#include"))
+    return text
+
+def gen_masks(count, rng):
+    # (protocol, source, destination): prefixes of the addresses, the protocol exact or not at all.
+    masks = set()
+    while len(masks) < count:
+        prefix = lambda: (0xffffffff << (32 - rng.choice([0, 8, 16, 24, 32]))) & 0xffffffff
+        masks.add((rng.choice([0, 0xff]), prefix(), prefix()))
+    return sorted(masks)
+
+def gen_entries(count, masks, rng):
+    entries, seen = [], set()
+    while len(entries) < count:
+        mask = rng.choice(masks)
+        key = (rng.choice([1, 6, 17]) & mask[0], rng.randrange(1 << 32) & mask[1], rng.randrange(1 << 32) & mask[2])
+        if (key, mask) not in seen:
+            seen.add((key, mask))
+            entries.append((key, mask))
+    return entries
+
+def gen_program(entries):
+    out = [prelude()]
+    out.append("header Ethernet_h { bit<48> dstAddr; bit<48> srcAddr; bit<16> etherType; }")
+    out.append("header IPv4_h { bit<4> version; bit<4> ihl; bit<8> diffserv; bit<16> totalLen; bit<16> identification;")
+    out.append("    bit<3> flags; bit<13> fragOffset; bit<8> ttl; bit<8> protocol; bit<16> hdrChecksum;")
+    out.append("    bit<32> srcAddr; bit<32> dstAddr; }")
+    out.append("struct Headers { Ethernet_h ethernet; IPv4_h ipv4; }")
+    out.append("parser Parser(packet_in packet, out Headers hd) {")
+    out.append("    state start {")
+    out.append("        packet.extract(hd.ethernet);")
+    out.append("        transition select(hd.ethernet.etherType) { 0x0800 : parse_ipv4; default : accept; }")
+    out.append("    }")
+    out.append("    state parse_ipv4 { packet.extract(hd.ipv4); transition accept; }")
+    out.append("}")
+    out.append("control Ingress(inout Headers hdr, in xdp_input xin, out xdp_output xout) {")
+    out.append("    action allow() { xout.output_action = xdp_action.XDP_TX; }")
+    out.append("    action deny() { xout.output_action = xdp_action.XDP_DROP; }")
+    out.append("    table acl {")
+    out.append("        key = { hdr.ipv4.protocol : ternary; hdr.ipv4.srcAddr : ternary; hdr.ipv4.dstAddr : ternary; }")
+    out.append("        actions = { allow; deny; }")
+    out.append("        const entries = {")
+    for i, (key, mask) in enumerate(entries):
+        out.append("            (0x%x &&& 0x%x, 0x%x &&& 0x%x, 0x%x &&& 0x%x) : %s();"
+                   % (key[0], mask[0], key[1], mask[1], key[2], mask[2], "deny" if i % 3 == 0 else "allow"))
+    out.append("        }")
+    out.append("        const default_action = allow();")
+    out.append("    }")
+    out.append("    apply {")
+    out.append("        xout.output_action = xdp_action.XDP_PASS;")
+    out.append("        if (hdr.ipv4.isValid()) { acl.apply(); }")
+    out.append("    }")
+    out.append("}")
+    out.append("control Deparser(in Headers hdr, packet_out packet) {")
+    out.append("    apply { packet.emit(hdr.ethernet); packet.emit(hdr.ipv4); }")
+    out.append("}")
+    out.append("xdp(Parser(), Ingress(), Deparser()) main;")
+    return "\n".join(out) + "\n"
+
+def gen_packets(entries, count, rng):
+    # Nine packets in ten match an entry, the others fall through to the default action.
+    data = bytearray()
+    for _ in range(count):
+        protocol, source, destination = rng.choice([1, 6, 17]), rng.randrange(1 << 32), rng.randrange(1 << 32)
+        if rng.random() < 0.9:
+            key, mask = rng.choice(entries)
+            protocol = key[0] | (protocol & ~mask[0] & 0xff)
+            source = key[1] | (source & ~mask[1] & 0xffffffff)
+            destination = key[2] | (destination & ~mask[2] & 0xffffffff)
+        ipv4 = bytes([0x45, 0, 0, 20, 0, 0, 0, 0, 64, protocol, 0, 0]) + source.to_bytes(4, "big") \
+               + destination.to_bytes(4, "big")
+        packet = bytes(12) + b"\x08\x00" + ipv4 + bytes(26)
+        data += bytes([len(packet) & 255, len(packet) >> 8]) + packet
+    return bytes(data)
+
+def measure(args, name, kind, packets):
+    source = os.path.join(args.out_dir, name + ".p4")
+    program = os.path.join(args.out_dir, "%s_%s.c" % (name, kind))
+    binary = os.path.join(args.out_dir, "%s_%s" % (name, kind))
+    subprocess.run([args.compiler, source, "--target=xdp", "--ternary=%s" % kind, "--output=%s" % program],
+                   check=True, stdout=subprocess.DEVNULL)
+    # BPF has no indirect jumps: keep the host compiler from turning the compares into a jump table.
+    subprocess.run([args.cc, "-O2", "-w", "-fno-jump-tables", "-fno-bit-tests", "-fno-tree-switch-conversion",
+                    "-I", os.path.join(BENCH_DIR, "xdp_host"), "-DPROGRAM=\"%s\"" % program, os.path.join(BENCH_DIR, "xdp_host", "driver.c"), "-o", binary],
+                   check=True)
+    result = subprocess.run([binary, packets, str(args.rounds)], check=True, stdout=subprocess.PIPE)
+    line = result.stdout.decode()
+    return 1000.0 / float(line.split()[0]), line.split("actions")[1].strip()
+
+def main():
+    ap = argparse.ArgumentParser(description="ashp4c ternary table benchmark")
+    ap.add_argument("--compiler", default=os.path.join(REPO_DIR, "build", "ashp4c"))
+    ap.add_argument("--cc", default="cc")
+    ap.add_argument("--entries", default="16,64,256,1024,4096", help="comma separated numbers of entries")
+    ap.add_argument("--masks", type=int, default=8, help="distinct masks among the entries, at most 16")
+    ap.add_argument("--packets", type=int, default=10000)
+    ap.add_argument("--rounds", type=int, default=20)
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--out-dir", default=os.path.join(BENCH_DIR, "out"))
+    args = ap.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    stdout_print("%-12s" % "entries" + "".join("%12s" % k for k in KINDS) + "\n")
+    status = 0
+    for n in [int(s) for s in args.entries.split(",")]:
+        rng = random.Random(args.seed * 1000 + n)
+        entries = gen_entries(n, gen_masks(min(args.masks, n), rng), rng)
+        name = "ternary_%d" % n
+        with open(os.path.join(args.out_dir, name + ".p4"), "w") as f:
+            f.write(gen_program(entries))
+        packets = os.path.join(args.out_dir, name + ".pkt")
+        with open(packets, "wb") as f:
+            f.write(gen_packets(entries, args.packets, rng))
+        row, actions = [], set()
+        for kind in KINDS:
+            if kind == "scan" and n > SCAN_MAX_ENTRIES:
+                row.append(None)
+                continue
+            rate, counts = measure(args, name, kind, packets)
+            row.append(rate)
+            actions.add(counts)
+        stdout_print("%-12d" % n + "".join("%12s" % "-" if r is None else "%12.1f" % r for r in row))
+        # Every kind must take the same decisions.
+        if len(actions) != 1:
+            stdout_print("  MISMATCH: %s" % " / ".join(sorted(actions)))
+            status = 1
+        stdout_print("\n")
+    stdout_print("(millions of lookups/s)\n")
+    return status
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,7 @@
+#pragma once
+#include <arpa/inet.h>
+
+#define bpf_ntohs(x)  ntohs(x)
+#define bpf_htons(x)  htons(x)
+#define bpf_ntohl(x)  ntohl(x)
+#define bpf_htonl(x)  htonl(x)
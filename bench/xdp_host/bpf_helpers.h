@@ -0,0 +1,174 @@
+/*
+ * Host stand-ins for the BPF helpers a program generated with --target=xdp
+ * calls, so that it can be built with the host compiler and timed.  Array
+ * maps are indexed directly, as the kernel does once the verifier has inlined
+ * the lookup, and hash maps are open-addressing tables; LPM tries are searched
+ * linearly and are only good enough to run the program, not to time it.
+ */
+#pragma once
+#include <string.h>
+#include <stdlib.h>
+
+#define SEC(NAME)
+
+struct bpf_map_def {
+  unsigned int type;
+  unsigned int key_size;
+  unsigned int value_size;
+  unsigned int max_entries;
+  unsigned int map_flags;
+  unsigned int count;
+  unsigned char* keys;
+  unsigned char* values;
+  unsigned int* slots;  /* hash maps: index + 1 of the element in each slot, or 0 */
+  unsigned int slot_mask;
+};
+
+static void
+host_map_init(struct bpf_map_def* map)
+{
+  if (map->values) {
+    return;
+  }
+  map->keys = calloc(map->max_entries, map->key_size);
+  map->values = calloc(map->max_entries, map->value_size);
+  if (map->type == BPF_MAP_TYPE_HASH) {
+    for (map->slot_mask = 1; map->slot_mask < 2 * map->max_entries; map->slot_mask *= 2);
+    map->slots = calloc(map->slot_mask, sizeof(unsigned int));
+    map->slot_mask -= 1;
+  }
+}
+
+/* The slot of `key` in a hash map, or the empty slot where it would go. */
+static unsigned int*
+host_hash_slot(struct bpf_map_def* map, unsigned char* key)
+{
+  unsigned int h = map->key_size, w, i;
+  for (i = 0; i < map->key_size; i += 4) {
+    w = 0;
+    if (i + 4 <= map->key_size) {
+      memcpy(&w, key + i, 4);
+    } else {
+      memcpy(&w, key + i, map->key_size - i);
+    }
+    h = (h ^ w) * 0x9e3779b1u;
+    h ^= h >> 15;
+  }
+  h = (h ^ (h >> 16)) * 0x85ebca6bu;
+  h = (h ^ (h >> 13)) * 0xc2b2ae35u;
+  h ^= h >> 16;
+  for (i = h & map->slot_mask; map->slots[i]; i = (i + 1) & map->slot_mask) {
+    if (!memcmp(map->keys + (map->slots[i] - 1) * map->key_size, key, map->key_size)) {
+      break;
+    }
+  }
+  return &map->slots[i];
+}
+
+static unsigned int
+host_prefix_bit(unsigned char* data, unsigned int i)
+{
+  return (data[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static void*
+bpf_map_lookup_elem(void* m, void* key)
+{
+  struct bpf_map_def* map = m;
+  unsigned int i, j, best = map->count, best_length = 0;
+  host_map_init(map);
+  if (map->type == BPF_MAP_TYPE_ARRAY || map->type == BPF_MAP_TYPE_PERCPU_ARRAY) {
+    i = *(unsigned int*)key;
+    return i < map->max_entries ? map->values + i * map->value_size : 0;
+  }
+  if (map->type == BPF_MAP_TYPE_HASH) {
+    i = *host_hash_slot(map, key);
+    return i ? map->values + (i - 1) * map->value_size : 0;
+  }
+  for (i = 0; i < map->count; i++) {
+    unsigned char* k = map->keys + i * map->key_size;
+    if (map->type == BPF_MAP_TYPE_LPM_TRIE) {
+      unsigned int length = *(unsigned int*)k;
+      for (j = 0; j < length && host_prefix_bit(k + 4, j) == host_prefix_bit((unsigned char*)key + 4, j); j++);
+      if (j == length && (best == map->count || length > best_length)) {
+        best = i;
+        best_length = length;
+      }
+    } else if (!memcmp(k, key, map->key_size)) {
+      return map->values + i * map->value_size;
+    }
+  }
+  return best < map->count ? map->values + best * map->value_size : 0;
+}
+
+static int
+bpf_map_update_elem(void* m, void* key, void* value, unsigned long long flags)
+{
+  struct bpf_map_def* map = m;
+  unsigned int i;
+  host_map_init(map);
+  if (map->type == BPF_MAP_TYPE_ARRAY || map->type == BPF_MAP_TYPE_PERCPU_ARRAY) {
+    i = *(unsigned int*)key;
+    if (i >= map->max_entries) {
+      return -1;
+    }
+    memcpy(map->values + i * map->value_size, value, map->value_size);
+    return 0;
+  }
+  if (map->type == BPF_MAP_TYPE_HASH) {
+    unsigned int* slot = host_hash_slot(map, key);
+    if (!*slot) {
+      if (map->count == map->max_entries) {
+        return -1;
+      }
+      *slot = ++map->count;
+    }
+    memcpy(map->keys + (*slot - 1) * map->key_size, key, map->key_size);
+    memcpy(map->values + (*slot - 1) * map->value_size, value, map->value_size);
+    return 0;
+  }
+  for (i = 0; i < map->count && memcmp(map->keys + i * map->key_size, key, map->key_size); i++);
+  if (i == map->count) {
+    if (map->count == map->max_entries) {
+      return -1;
+    }
+    map->count += 1;
+  }
+  memcpy(map->keys + i * map->key_size, key, map->key_size);
+  memcpy(map->values + i * map->value_size, value, map->value_size);
+  return 0;
+}
+
+static unsigned long long
+bpf_ktime_get_ns(void)
+{
+  return 0;
+}
+
+static int
+bpf_xdp_adjust_head(void* ctx, int delta)
+{
+  struct xdp_md* xdp = ctx;
+  xdp->data += delta;
+  return 0;
+}
+
+static int
+bpf_redirect(int ifindex, int flags)
+{
+  return XDP_REDIRECT;
+}
+
+/* The stages of a split program, called directly instead of through the program array. */
+int ashp4c_xdp_1(struct xdp_md* xdp) __attribute__((weak));
+int ashp4c_xdp_2(struct xdp_md* xdp) __attribute__((weak));
+
+static int
+host_tail_call(void* ctx, int index)
+{
+  int (*stage)(struct xdp_md*) = index == 1 ? ashp4c_xdp_1 : index == 2 ? ashp4c_xdp_2 : 0;
+  return stage ? stage(ctx) : XDP_ABORTED;
+}
+
+/* A tail call does not come back: the stage's verdict is the program's. */
+#define bpf_tail_call(ctx, map, index)  return host_tail_call(ctx, index)
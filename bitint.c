@@ -0,0 +1,545 @@
+#include "arena.h"
+#include "bitint.h"
+#include <memory.h>  // memset, memcpy
+
+
+internal struct Arena* bitint_storage;
+
+
+void
+bitint_set_storage(struct Arena* bitint_storage_)
+{
+  bitint_storage = bitint_storage_;
+}
+
+internal int
+words_for(int width)
+{
+  return (width + 63) / 64;
+}
+
+internal struct BitInt*
+new_bitint(int width, bool is_signed, bool is_sized)
+{
+  assert(width > 0);
+  if (width > BITINT_MAX_WIDTH) {
+    error("integer value needs %d bits, more than the %d supported.", width, BITINT_MAX_WIDTH);
+  }
+  struct BitInt* r = arena_push(bitint_storage, sizeof(*r));
+  memset(r, 0, sizeof(*r));
+  r->width = width;
+  r->is_signed = is_signed;
+  r->is_sized = is_sized;
+  r->word_count = words_for(width);
+  r->words = arena_push(bitint_storage, r->word_count * sizeof(uint64_t));
+  memset(r->words, 0, r->word_count * sizeof(uint64_t));
+  return r;
+}
+
+internal bool
+word_bit(uint64_t* w, int i)
+{
+  return (w[i / 64] >> (i % 64)) & 1;
+}
+
+/* Copies the value of `a` into `n` words, sign-extending signed values. */
+internal void
+load(struct BitInt* a, uint64_t* w, int n)
+{
+  int i;
+  bool negative = bitint_is_negative(a);
+  for (i = 0; i < n; i++) {
+    w[i] = i < a->word_count ? a->words[i] : 0;
+    if (negative) {
+      if (i == a->word_count - 1 && a->width % 64) {
+        w[i] |= ~0ull << (a->width % 64);
+      } else if (i >= a->word_count) {
+        w[i] = ~0ull;
+      }
+    }
+  }
+}
+
+/* Truncates the `n`-word value `w` to the width of `r`. */
+internal void
+store(struct BitInt* r, uint64_t* w, int n)
+{
+  int i;
+  for (i = 0; i < r->word_count; i++) {
+    r->words[i] = i < n ? w[i] : 0;
+  }
+  if (r->width % 64) {
+    r->words[r->word_count - 1] &= ~(~0ull << (r->width % 64));
+  }
+}
+
+internal uint64_t*
+scratch(int n)
+{
+  uint64_t* w = arena_push(bitint_storage, n * sizeof(uint64_t));
+  memset(w, 0, n * sizeof(uint64_t));
+  return w;
+}
+
+/* Unsized values are kept at the narrowest two's complement width that holds them. */
+internal struct BitInt*
+trim(struct BitInt* a)
+{
+  if (a->is_sized) {
+    return a;
+  }
+  int i;
+  bool sign = word_bit(a->words, a->width - 1);
+  for (i = a->width - 2; i >= 0; i--) {
+    if (word_bit(a->words, i) != sign) {
+      break;
+    }
+  }
+  int width = i + 2;
+  if (width == a->width) {
+    return a;
+  }
+  struct BitInt* r = new_bitint(width, true, false);
+  store(r, a->words, a->word_count);
+  return r;
+}
+
+internal void
+check_shapes(struct BitInt* a, struct BitInt* b)
+{
+  assert(a->is_sized == b->is_sized);
+  if (a->is_sized) {
+    assert(a->width == b->width && a->is_signed == b->is_signed);
+  }
+}
+
+/* The result of an operation; unsized operands widen to `unsized_width`. */
+internal struct BitInt*
+result_of(struct BitInt* a, int unsized_width)
+{
+  if (a->is_sized) {
+    return new_bitint(a->width, a->is_signed, true);
+  }
+  return new_bitint(unsized_width, true, false);
+}
+
+internal int
+max_width(struct BitInt* a, struct BitInt* b)
+{
+  return a->width > b->width ? a->width : b->width;
+}
+
+internal void
+words_add(uint64_t* r, uint64_t* a, uint64_t* b, int n, uint64_t carry)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    unsigned __int128 s = (unsigned __int128)a[i] + b[i] + carry;
+    r[i] = (uint64_t)s;
+    carry = (uint64_t)(s >> 64);
+  }
+}
+
+internal void
+words_not(uint64_t* r, uint64_t* a, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    r[i] = ~a[i];
+  }
+}
+
+internal bool
+words_is_zero(uint64_t* a, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    if (a[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Unsigned comparison of two `n`-word values. */
+internal int
+words_compare(uint64_t* a, uint64_t* b, int n)
+{
+  int i;
+  for (i = n - 1; i >= 0; i--) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+internal void
+words_negate(uint64_t* r, uint64_t* a, int n)
+{
+  uint64_t* zero = scratch(n);
+  words_not(r, a, n);
+  words_add(r, r, zero, n, 1);
+}
+
+/* Unsigned long division, one bit at a time; `q` and `m` receive quotient and remainder. */
+internal void
+words_divmod(uint64_t* q, uint64_t* m, uint64_t* a, uint64_t* b, int n)
+{
+  int i, j;
+  uint64_t* neg_b = scratch(n);
+  words_negate(neg_b, b, n);
+  memset(q, 0, n * sizeof(uint64_t));
+  memset(m, 0, n * sizeof(uint64_t));
+  for (i = n * 64 - 1; i >= 0; i--) {
+    for (j = n - 1; j > 0; j--) {
+      m[j] = (m[j] << 1) | (m[j - 1] >> 63);
+    }
+    m[0] = (m[0] << 1) | word_bit(a, i);
+    if (words_compare(m, b, n) >= 0) {
+      words_add(m, m, neg_b, n, 0);
+      q[i / 64] |= 1ull << (i % 64);
+    }
+  }
+}
+
+struct BitInt*
+bitint_parse(char* digits, int base)
+{
+  /* Every digit takes at most 4 bits, plus the sign bit. */
+  int width = 1;
+  char* c;
+  for (c = digits; *c; c++) {
+    width += (*c != '_') ? 4 : 0;
+  }
+  struct BitInt* r = new_bitint(width, true, false);
+  for (c = digits; *c; c++) {
+    if (*c == '_') {
+      continue;
+    }
+    uint64_t digit;
+    if (*c >= '0' && *c <= '9') {
+      digit = *c - '0';
+    } else if (*c >= 'a' && *c <= 'f') {
+      digit = *c - 'a' + 10;
+    } else if (*c >= 'A' && *c <= 'F') {
+      digit = *c - 'A' + 10;
+    } else assert(0);
+    assert(digit < (uint64_t)base);
+    int i;
+    uint64_t carry = digit;
+    for (i = 0; i < r->word_count; i++) {
+      unsigned __int128 p = (unsigned __int128)r->words[i] * base + carry;
+      r->words[i] = (uint64_t)p;
+      carry = (uint64_t)(p >> 64);
+    }
+  }
+  store(r, r->words, r->word_count);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_from_int64(int64_t value)
+{
+  struct BitInt* r = new_bitint(64, true, false);
+  r->words[0] = (uint64_t)value;
+  return trim(r);
+}
+
+struct BitInt*
+bitint_cast(struct BitInt* a, int width, bool is_signed, bool is_sized)
+{
+  if (!is_sized) {
+    /* Widening to unsized keeps the value: bit<W> gains a zero sign bit. */
+    width = a->is_signed ? a->width : a->width + 1;
+    is_signed = true;
+  }
+  struct BitInt* r = new_bitint(width, is_signed, is_sized);
+  int n = words_for(width);
+  uint64_t* w = scratch(n);
+  load(a, w, n);
+  store(r, w, n);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_add(struct BitInt* a, struct BitInt* b)
+{
+  check_shapes(a, b);
+  struct BitInt* r = result_of(a, max_width(a, b) + 1);
+  uint64_t* wa = scratch(r->word_count);
+  uint64_t* wb = scratch(r->word_count);
+  load(a, wa, r->word_count);
+  load(b, wb, r->word_count);
+  words_add(wa, wa, wb, r->word_count, 0);
+  store(r, wa, r->word_count);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_sub(struct BitInt* a, struct BitInt* b)
+{
+  check_shapes(a, b);
+  struct BitInt* r = result_of(a, max_width(a, b) + 1);
+  uint64_t* wa = scratch(r->word_count);
+  uint64_t* wb = scratch(r->word_count);
+  load(a, wa, r->word_count);
+  load(b, wb, r->word_count);
+  words_not(wb, wb, r->word_count);
+  words_add(wa, wa, wb, r->word_count, 1);
+  store(r, wa, r->word_count);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_mul(struct BitInt* a, struct BitInt* b)
+{
+  check_shapes(a, b);
+  struct BitInt* r = result_of(a, a->width + b->width);
+  int n = r->word_count;
+  uint64_t* wa = scratch(n);
+  uint64_t* wb = scratch(n);
+  uint64_t* wr = scratch(n);
+  load(a, wa, n);
+  load(b, wb, n);
+  int i, j;
+  for (i = 0; i < n; i++) {
+    uint64_t carry = 0;
+    for (j = 0; i + j < n; j++) {
+      unsigned __int128 p = (unsigned __int128)wa[i] * wb[j] + wr[i + j] + carry;
+      wr[i + j] = (uint64_t)p;
+      carry = (uint64_t)(p >> 64);
+    }
+  }
+  store(r, wr, n);
+  return trim(r);
+}
+
+/* Signed operands divide by magnitude and truncate toward zero. */
+struct BitInt*
+bitint_div(struct BitInt* a, struct BitInt* b)
+{
+  check_shapes(a, b);
+  if (bitint_is_zero(b)) {
+    return 0;
+  }
+  struct BitInt* r = result_of(a, max_width(a, b) + 1);
+  int n = r->word_count;
+  uint64_t* wa = scratch(n);
+  uint64_t* wb = scratch(n);
+  uint64_t* q = scratch(n);
+  uint64_t* m = scratch(n);
+  load(a, wa, n);
+  load(b, wb, n);
+  bool a_negative = bitint_is_negative(a);
+  bool b_negative = bitint_is_negative(b);
+  if (a_negative) {
+    words_negate(wa, wa, n);
+  }
+  if (b_negative) {
+    words_negate(wb, wb, n);
+  }
+  words_divmod(q, m, wa, wb, n);
+  if (a_negative != b_negative) {
+    words_negate(q, q, n);
+  }
+  store(r, q, n);
+  return trim(r);
+}
+
+enum BitwiseOp {
+  Bitwise_And,
+  Bitwise_Or,
+  Bitwise_Xor,
+};
+
+internal struct BitInt*
+bitwise(struct BitInt* a, struct BitInt* b, enum BitwiseOp op)
+{
+  check_shapes(a, b);
+  struct BitInt* r = result_of(a, max_width(a, b));
+  int n = r->word_count;
+  uint64_t* wa = scratch(n);
+  uint64_t* wb = scratch(n);
+  load(a, wa, n);
+  load(b, wb, n);
+  int i;
+  for (i = 0; i < n; i++) {
+    if (op == Bitwise_And) {
+      wa[i] &= wb[i];
+    } else if (op == Bitwise_Or) {
+      wa[i] |= wb[i];
+    } else {
+      wa[i] ^= wb[i];
+    }
+  }
+  store(r, wa, n);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_and(struct BitInt* a, struct BitInt* b)
+{
+  return bitwise(a, b, Bitwise_And);
+}
+
+struct BitInt*
+bitint_or(struct BitInt* a, struct BitInt* b)
+{
+  return bitwise(a, b, Bitwise_Or);
+}
+
+struct BitInt*
+bitint_xor(struct BitInt* a, struct BitInt* b)
+{
+  return bitwise(a, b, Bitwise_Xor);
+}
+
+int
+bitint_compare(struct BitInt* a, struct BitInt* b)
+{
+  check_shapes(a, b);
+  int n = words_for(max_width(a, b));
+  bool a_negative = bitint_is_negative(a);
+  bool b_negative = bitint_is_negative(b);
+  if (a_negative != b_negative) {
+    return a_negative ? -1 : 1;
+  }
+  uint64_t* wa = scratch(n);
+  uint64_t* wb = scratch(n);
+  load(a, wa, n);
+  load(b, wb, n);
+  return words_compare(wa, wb, n);
+}
+
+struct BitInt*
+bitint_neg(struct BitInt* a)
+{
+  struct BitInt* r = result_of(a, a->width + 1);
+  uint64_t* w = scratch(r->word_count);
+  load(a, w, r->word_count);
+  words_negate(w, w, r->word_count);
+  store(r, w, r->word_count);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_not(struct BitInt* a)
+{
+  struct BitInt* r = result_of(a, a->width);
+  uint64_t* w = scratch(r->word_count);
+  load(a, w, r->word_count);
+  words_not(w, w, r->word_count);
+  store(r, w, r->word_count);
+  return trim(r);
+}
+
+struct BitInt*
+bitint_shl(struct BitInt* a, int count)
+{
+  assert(count >= 0);
+  if (!a->is_sized && a->width + count > BITINT_MAX_WIDTH) {
+    error("shifting left by %d needs more than the %d bits supported.", count, BITINT_MAX_WIDTH);
+  }
+  struct BitInt* r = result_of(a, a->width + count);
+  int n = r->word_count;
+  uint64_t* wa = scratch(n);
+  uint64_t* w = scratch(n);
+  load(a, wa, n);
+  int i;
+  for (i = count; i < n * 64; i++) {
+    if (word_bit(wa, i - count)) {
+      w[i / 64] |= 1ull << (i % 64);
+    }
+  }
+  store(r, w, n);
+  return trim(r);
+}
+
+/* Arithmetic shift for signed values, logical for unsigned ones. */
+struct BitInt*
+bitint_shr(struct BitInt* a, int count)
+{
+  assert(count >= 0);
+  if (count > a->width) {
+    count = a->width;
+  }
+  struct BitInt* r = result_of(a, a->width);
+  int n = r->word_count;
+  uint64_t* wa = scratch(n);
+  uint64_t* w = scratch(n);
+  load(a, wa, n);
+  bool fill = bitint_is_negative(a);
+  int i;
+  for (i = 0; i < r->width; i++) {
+    bool bit = (i + count < r->width) ? word_bit(wa, i + count) : fill;
+    if (bit) {
+      w[i / 64] |= 1ull << (i % 64);
+    }
+  }
+  store(r, w, n);
+  return trim(r);
+}
+
+bool
+bitint_is_zero(struct BitInt* a)
+{
+  return words_is_zero(a->words, a->word_count);
+}
+
+bool
+bitint_is_negative(struct BitInt* a)
+{
+  return a->is_signed && word_bit(a->words, a->width - 1);
+}
+
+bool
+bitint_to_int64(struct BitInt* a, int64_t* value)
+{
+  int n = a->word_count + 1;
+  uint64_t* w = scratch(n);
+  load(a, w, n);
+  uint64_t extension = (w[0] >> 63) ? ~0ull : 0;
+  int i;
+  for (i = 1; i < n; i++) {
+    if (w[i] != extension) {
+      return false;
+    }
+  }
+  *value = (int64_t)w[0];
+  return true;
+}
+
+/* Decimal when the value fits in 64 bits, hexadecimal otherwise. Returns the length. */
+int
+bitint_to_string(char* buf, int size, struct BitInt* a)
+{
+  int64_t value;
+  if (bitint_to_int64(a, &value)) {
+    return snprintf(buf, size, "%ld", value);
+  }
+  if (!a->is_signed && a->word_count == 1) {
+    return snprintf(buf, size, "%lu", a->words[0]);
+  }
+  uint64_t* w = scratch(a->word_count);
+  memcpy(w, a->words, a->word_count * sizeof(uint64_t));
+  int length = 0;
+  if (bitint_is_negative(a)) {
+    uint64_t* full = scratch(a->word_count);
+    load(a, full, a->word_count);
+    words_negate(w, full, a->word_count);
+    if (a->width % 64) {
+      w[a->word_count - 1] &= ~(~0ull << (a->width % 64));
+    }
+    length += snprintf(buf, size, "-");
+  }
+  int i = a->word_count - 1;
+  while (i > 0 && w[i] == 0) {
+    i--;
+  }
+  length += snprintf(buf + length, size > length ? size - length : 0, "0x%lx", w[i]);
+  for (i--; i >= 0; i--) {
+    length += snprintf(buf + length, size > length ? size - length : 0, "%016lx", w[i]);
+  }
+  return length;
+}
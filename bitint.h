@@ -0,0 +1,46 @@
+#pragma once
+#include "arena.h"
+
+
+#define BITINT_MAX_WIDTH  8192  /* precision limit of unsized (`int`) values */
+
+/*
+ * Integers of any width, with the wrap-around semantics of P4's bit<W>
+ * (unsigned) and int<W> (two's complement).  Unsized values, the type of
+ * literals without a width, are signed and grow as needed.  Values are
+ * immutable: every operation pushes its result on the storage arena.
+ */
+struct BitInt {
+  int width;
+  bool is_signed;
+  bool is_sized;
+  int word_count;
+  uint64_t* words;  /* least significant first; the bits above `width` are zero */
+};
+
+
+void bitint_set_storage(struct Arena* bitint_storage_);
+
+struct BitInt* bitint_parse(char* digits, int base);
+struct BitInt* bitint_from_int64(int64_t value);
+struct BitInt* bitint_cast(struct BitInt* a, int width, bool is_signed, bool is_sized);
+
+/* Binary operations take operands of the same width and signedness, or two unsized ones. */
+struct BitInt* bitint_add(struct BitInt* a, struct BitInt* b);
+struct BitInt* bitint_sub(struct BitInt* a, struct BitInt* b);
+struct BitInt* bitint_mul(struct BitInt* a, struct BitInt* b);
+struct BitInt* bitint_div(struct BitInt* a, struct BitInt* b);  /* 0 when `b` is zero */
+struct BitInt* bitint_and(struct BitInt* a, struct BitInt* b);
+struct BitInt* bitint_or(struct BitInt* a, struct BitInt* b);
+struct BitInt* bitint_xor(struct BitInt* a, struct BitInt* b);
+int bitint_compare(struct BitInt* a, struct BitInt* b);
+
+struct BitInt* bitint_neg(struct BitInt* a);
+struct BitInt* bitint_not(struct BitInt* a);
+struct BitInt* bitint_shl(struct BitInt* a, int count);
+struct BitInt* bitint_shr(struct BitInt* a, int count);
+
+bool bitint_is_zero(struct BitInt* a);
+bool bitint_is_negative(struct BitInt* a);
+bool bitint_to_int64(struct BitInt* a, int64_t* value);
+int bitint_to_string(char* buf, int size, struct BitInt* a);
@@ -2,6 +2,9 @@
 
 C_FLAGS="-g -ggdb -std=gnu89 -Winline -Wno-write-strings -Wreturn-type -fms-extensions"
 L_FLAGS="-static -static-libgcc -static-libstdc++"
+if [ -n "$DEBUG" ]; then
+  C_FLAGS="$C_FLAGS -DDEBUG_ENABLED=1"  # symbol table tracing
+fi
 
 SRC=`pwd`
 mkdir -p build
@@ -15,7 +18,24 @@ gcc $C_FLAGS -I . -c $SRC/lex.c
 gcc $C_FLAGS -I . -c $SRC/ast.c
 gcc $C_FLAGS -I . -c $SRC/build_ast.c
 gcc $C_FLAGS -I . -c $SRC/print_ast.c 
+gcc $C_FLAGS -I . -c $SRC/ast_bin.c
+gcc $C_FLAGS -I . -c $SRC/ast_bin_read.c
 gcc $C_FLAGS -I . -c $SRC/build_symtable.c 
+gcc $C_FLAGS -I . -c $SRC/types.c
+gcc $C_FLAGS -I . -c $SRC/type_check.c
+gcc $C_FLAGS -I . -c $SRC/bitint.c
+gcc $C_FLAGS -I . -c $SRC/const_eval.c
+gcc $C_FLAGS -I . -c $SRC/build_ir.c
+gcc $C_FLAGS -I . -c $SRC/print_ir.c
+gcc $C_FLAGS -I . -c $SRC/ebpf.c
+gcc $C_FLAGS -I . -c $SRC/ebpf_parser.c
+gcc $C_FLAGS -I . -c $SRC/ebpf_checksum.c
+gcc $C_FLAGS -I . -c $SRC/emit_xdp.c
+gcc $C_FLAGS -I . -c $SRC/emit_bpf.c
+gcc $C_FLAGS -I . -c $SRC/run_ir.c
 gcc $C_FLAGS -I. -o ashp4c $SRC/ashp4c.c $L_FLAGS \
-  basic.o arena.o hash.o symtable.o lex.o ast.o build_ast.o print_ast.o build_symtable.o -lm
+  basic.o arena.o hash.o symtable.o lex.o ast.o build_ast.o print_ast.o ast_bin.o ast_bin_read.o build_symtable.o types.o type_check.o bitint.o const_eval.o build_ir.o print_ir.o ebpf.o ebpf_parser.o ebpf_checksum.o emit_xdp.o emit_bpf.o run_ir.o -lm
+gcc $C_FLAGS -I $SRC -o ast_bin_test $SRC/ast_bin_test.c ast_bin_read.o
+gcc $C_FLAGS -I $SRC -o microbench $SRC/bench/microbench.c $L_FLAGS \
+  basic.o arena.o hash.o symtable.o -lm
 popd
@@ -7,6 +7,10 @@
 #include "build_ast.h"
 #include <memory.h>  // memset
 
+/* The operand of a prefix operator or a cast binds tighter than any binary
+   operator: it only takes the postfix operators (member, index, call). */
+#define UNARY_OPERAND_PRIORITY  12
+
 
 internal struct Arena* ast_storage;
 
@@ -517,6 +521,31 @@ build_externDeclaration()
   return decl;
 }
 
+/*
+ * The digits of an integer literal as written, for values wider than 64 bits,
+ * and their base: the lexeme past the width and the base prefix.
+ */
+internal char*
+integer_digits(char* lexeme, enum AstIntegerFlags flags, int* base)
+{
+  char* digits = lexeme;
+  if (flags & AstInteger_HasWidth) {
+    while (*digits != 'w' && *digits != 's') {
+      digits++;
+    }
+    digits++;
+  }
+  *base = 10;
+  if (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+    *base = 16;
+  } else if (digits[0] == '0' && (digits[1] == 'o' || digits[1] == 'O')) {
+    *base = 8;
+  } else if (digits[0] == '0' && (digits[1] == 'b' || digits[1] == 'B')) {
+    *base = 2;
+  }
+  return *base == 10 ? digits : digits + 2;
+}
+
 internal struct Ast*
 build_integer()
 {
@@ -532,6 +561,9 @@ build_integer()
     int64_t* value = arena_push(ast_storage, sizeof(*value));
     *value = token->i.value;
     ast_setattr(int_node, "value", value, AstAttr_Integer);
+    int* base = arena_push(ast_storage, sizeof(*base));
+    ast_setattr(int_node, "digits", integer_digits(token->lexeme, token->i.flags, base), AstAttr_String);
+    ast_setattr(int_node, "base", base, AstAttr_Integer);
     next_token();
   }
   return int_node;
@@ -573,7 +605,8 @@ build_integerTypeSize()
   if (token->klass == Token_Integer) {
     ast_setattr(type_size, "size", build_integer(), AstAttr_Ast);
   } else if (token->klass == Token_ParenthOpen) {
-    ast_setattr(type_size, "size", build_expression(1), AstAttr_Ast);
+    /* Only the parenthesized expression: the `>` that follows closes the type. */
+    ast_setattr(type_size, "size", build_expression(UNARY_OPERAND_PRIORITY), AstAttr_Ast);
   } else error("at line %d: `(` was expected, got `%s`.", token->line_nr, token->lexeme);
   return type_size;
 }
@@ -1539,7 +1572,7 @@ build_tupleKeysetExpression()
     tuple_keyset = new_ast_node(Ast_TupleKeyset, token);
     next_token();
     struct AstList* exprs = arena_push(ast_storage, sizeof(*exprs));
-    memset(exprs, 0, sizeof(exprs));
+    memset(exprs, 0, sizeof(*exprs));
     ast_list_init(exprs);
     struct AstListLink* link = arena_push(ast_storage, sizeof(*link));
     memset(link, 0, sizeof(*link));
@@ -1960,6 +1993,7 @@ build_tableProperty()
     } else if (token_is_nonTableKwName(token)) {
       struct Ast* entry_prop = new_ast_node(Ast_TableProp_SingleEntry, token);
       ast_setattr(entry_prop, "name", build_name(false), AstAttr_Ast);
+      ast_setattr(entry_prop, "is_const", is_const, AstAttr_Integer);
       prop = entry_prop;
       if (token->klass == Token_Equal) {
         next_token();
@@ -2634,7 +2668,7 @@ build_expressionPrimary()
         primary = cast;
         if (token->klass == Token_ParenthClose) {
           next_token();
-          ast_setattr(cast, "expr", build_expression(1), AstAttr_Ast);
+          ast_setattr(cast, "expr", build_expression(UNARY_OPERAND_PRIORITY), AstAttr_Ast);
         } else error("at line %d: `)` was expected, got `%s`.", token->line_nr, token->lexeme);
       } else if (token_is_expression(token)) {
         primary = build_expression(1);
@@ -2648,7 +2682,7 @@ build_expressionPrimary()
       enum AstExprOperator* op = arena_push(ast_storage, sizeof(enum AstExprOperator));
       *op = AstExprOp_LogNot;
       ast_setattr(unary_expr, "op", op, AstAttr_ExprOperator);
-      ast_setattr(unary_expr, "expr", build_expression(1), AstAttr_Ast);
+      ast_setattr(unary_expr, "expr", build_expression(UNARY_OPERAND_PRIORITY), AstAttr_Ast);
       primary = unary_expr;
     } else if (token->klass == Token_Tilda) {
       next_token();
@@ -2656,7 +2690,7 @@ build_expressionPrimary()
       enum AstExprOperator* op = arena_push(ast_storage, sizeof(enum AstExprOperator));
       *op = AstExprOp_BitNot;
       ast_setattr(unary_expr, "op", op, AstAttr_ExprOperator);
-      ast_setattr(unary_expr, "expr", build_expression(1), AstAttr_Ast);
+      ast_setattr(unary_expr, "expr", build_expression(UNARY_OPERAND_PRIORITY), AstAttr_Ast);
       primary = unary_expr;
     } else if (token->klass == Token_UnaryMinus) {
       next_token();
@@ -2664,42 +2698,48 @@ build_expressionPrimary()
       enum AstExprOperator* op = arena_push(ast_storage, sizeof(enum AstExprOperator));
       *op = AstExprOp_Minus;
       ast_setattr(unary_expr, "op", op, AstAttr_ExprOperator);
-      ast_setattr(unary_expr, "expr", build_expression(1), AstAttr_Ast);
+      ast_setattr(unary_expr, "expr", build_expression(UNARY_OPERAND_PRIORITY), AstAttr_Ast);
       primary = unary_expr;
     } else if (token_is_typeName(token)) {
       primary = build_typeName();
     } else if (token->klass == Token_Error) {
-      next_token();
       struct Ast* name = new_ast_node(Ast_Name, token);
-      ast_setattr(name, "name", token->lexeme, AstAttr_Ast);
+      ast_setattr(name, "name", token->lexeme, AstAttr_String);
       primary = name;
+      next_token();
     } else assert(0);
   } else error("at line %d: an expression was expected, got `%s`.", token->line_nr, token->lexeme);
   return primary;
 }
 
+/* Binary operators, from the loosest to the tightest binding. */
 internal int
 get_operator_priority(struct Token* token)
 {
   int prio = 0;
-  if (token->klass == Token_TwoAmpersand || token->klass == Token_TwoPipe) {
+  if (token->klass == Token_ThreeAmpersand) {
     prio = 1;
-  } else if (token->klass == Token_TwoEqual || token->klass == Token_ExclamationEqual
-      || token->klass == Token_AngleOpen /* Less */ || token->klass == Token_AngleClose /* Greater */
-      || token->klass == Token_AngleOpenEqual /* LessEqual */ || token->klass == Token_AngleCloseEqual /* GreaterEqual */) {
+  } else if (token->klass == Token_TwoPipe) {
     prio = 2;
-  }
-  else if (token->klass == Token_Plus || token->klass == Token_Minus
-           || token->klass == Token_Ampersand || token->klass == Token_Pipe
-           || token->klass == Token_Circumflex || token->klass == Token_TwoAngleOpen /* BitshiftLeft */
-           || token->klass == Token_TwoAngleClose /* BitshiftRight */) {
+  } else if (token->klass == Token_TwoAmpersand) {
     prio = 3;
-  }
-  else if (token->klass == Token_Star || token->klass == Token_Slash) {
+  } else if (token->klass == Token_TwoEqual || token->klass == Token_ExclamationEqual) {
     prio = 4;
-  }
-  else if (token->klass == Token_ThreeAmpersand) {
+  } else if (token->klass == Token_AngleOpen /* Less */ || token->klass == Token_AngleClose /* Greater */
+      || token->klass == Token_AngleOpenEqual /* LessEqual */ || token->klass == Token_AngleCloseEqual /* GreaterEqual */) {
     prio = 5;
+  } else if (token->klass == Token_Pipe) {
+    prio = 6;
+  } else if (token->klass == Token_Circumflex) {
+    prio = 7;
+  } else if (token->klass == Token_Ampersand) {
+    prio = 8;
+  } else if (token->klass == Token_TwoAngleOpen /* BitshiftLeft */ || token->klass == Token_TwoAngleClose /* BitshiftRight */) {
+    prio = 9;
+  } else if (token->klass == Token_Plus || token->klass == Token_Minus) {
+    prio = 10;
+  } else if (token->klass == Token_Star || token->klass == Token_Slash) {
+    prio = 11;
   }
   else assert(0);
   return prio;
@@ -2828,9 +2868,15 @@ build_ast_program(struct Ast** p4program_, int* ast_node_count_, struct Unbounde
 
   ast_attr_set_storage(ast_storage);
 
+  node_id = 1;
+  node_count = 0;
+  prev_token_at = 0;
+  prev_token = 0;
   token_at = 0;
   token = array_get(tokens_array, token_at);
   next_token();
   struct Ast* p4program = build_p4program();
+  *p4program_ = p4program;
+  *ast_node_count_ = node_count;
   return p4program;
 }
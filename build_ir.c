@@ -0,0 +1,1571 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "type_check.h"
+#include "const_eval.h"
+#include "ir.h"
+#include <memory.h>  // memset, memcpy
+
+
+/*
+ * Lowering of the checked AST to the IR.  SSA form is built on the fly, after
+ * Braun et al., "Simple and Efficient Construction of Static Single Assignment
+ * Form": a block is sealed once all its predecessors are known, reads in a
+ * block that is not sealed yet leave an incomplete phi behind, and trivial
+ * phis are removed when the function is done.
+ */
+
+struct IrDef {
+  uint64_t key;  /* block << 32 | variable */
+  int value;
+};
+
+internal struct Arena* ir_storage;
+internal struct IrProgram* ir_program;
+internal struct IrFunction* function;  /* being built */
+internal int current_block;             /* 0 after `return` or `exit`: the statements that follow are dead */
+internal bool in_control_locals = false;
+internal int* var_index = 0;            /* SSA variable of a declaration, indexed by Ast.id; 0 if in memory */
+internal int* state_block = 0;          /* block of a parser state, indexed by Ast.id */
+internal int ast_index_count = 0;
+internal struct IrDef* defs = 0;
+internal int def_capacity = 0;
+internal int def_count = 0;
+internal int phi_count = 0;             /* of the function being built */
+internal struct Type* type_bit32 = 0;
+
+
+internal void lower_statement(struct Ast* stmt);
+internal int lower_expression(struct Ast* expr);
+internal int lower_call(struct Ast* callee_expr, struct AstList* args, struct Type* type, int line_nr);
+
+
+struct IrInsn*
+ir_insn(struct IrFunction* function, int id)
+{
+  return (struct IrInsn*)array_get(&function->insns, id);
+}
+
+struct IrBlock*
+ir_block(struct IrFunction* function, int id)
+{
+  return (struct IrBlock*)array_get(&function->blocks, id);
+}
+
+struct IrFunction*
+ir_function_of(struct IrProgram* program, struct Ast* decl)
+{
+  if (!decl || decl->id <= 0 || decl->id >= program->function_of_count) {
+    return 0;
+  }
+  return program->function_of[decl->id];
+}
+
+internal int
+list_count(struct AstList* list)
+{
+  return list ? list->link_count : 0;
+}
+
+internal char*
+decl_name(struct Ast* decl)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  return name ? (char*)ast_getattr(name, "name") : "?";
+}
+
+internal bool
+is_scalar_type(struct Type* type)
+{
+  if (!type) {
+    return false;
+  }
+  if (type->kind == Type_NewType && type->base) {
+    return is_scalar_type(type->base);
+  }
+  return type->kind == Type_Bool || type->kind == Type_Int || type->kind == Type_Bit || type->kind == Type_SignedInt
+    || type->kind == Type_Varbit || type->kind == Type_Enum || type->kind == Type_Error
+    || type->kind == Type_MatchKind || type->kind == Type_String;
+}
+
+/*
+ * Instructions and blocks.
+ */
+
+/* A new instruction of `f`, in no block yet, with `arg_count` zeroed arguments pushed on `storage`. */
+struct IrInsn*
+ir_new_insn(struct IrFunction* f, enum IrOpcode op, struct Type* type, int arg_count, int line_nr,
+            struct Arena* storage)
+{
+  struct IrInsn insn;
+  memset(&insn, 0, sizeof(insn));
+  insn.op = op;
+  insn.id = f->insns.elem_count;
+  insn.type = type;
+  insn.line_nr = line_nr;
+  insn.arg_count = arg_count;
+  if (arg_count > 0) {
+    insn.args = arena_push(storage, arg_count * sizeof(int));
+    memset(insn.args, 0, arg_count * sizeof(int));
+  }
+  array_append(&f->insns, &insn);
+  return ir_insn(f, insn.id);
+}
+
+internal void
+append_insn(int block_id, struct IrInsn* insn)
+{
+  struct IrBlock* block = ir_block(function, block_id);
+  insn->block = block_id;
+  if (block->last_insn) {
+    ir_insn(function, block->last_insn)->next_in_block = insn->id;
+  } else {
+    block->first_insn = insn->id;
+  }
+  block->last_insn = insn->id;
+}
+
+/* Phis, and the `undef` of a variable read before it is written, go to the start of the block. */
+internal void
+prepend_insn(int block_id, struct IrInsn* insn)
+{
+  struct IrBlock* block = ir_block(function, block_id);
+  insn->block = block_id;
+  insn->next_in_block = block->first_insn;
+  block->first_insn = insn->id;
+  if (!block->last_insn) {
+    block->last_insn = insn->id;
+  }
+}
+
+internal struct IrInsn*
+emit(enum IrOpcode op, struct Type* type, int arg_count, int line_nr)
+{
+  assert(current_block);
+  struct IrInsn* insn = ir_new_insn(function, op, type, arg_count, line_nr, ir_storage);
+  append_insn(current_block, insn);
+  return insn;
+}
+
+internal int
+emit1(enum IrOpcode op, struct Type* type, int arg, int line_nr)
+{
+  struct IrInsn* insn = emit(op, type, 1, line_nr);
+  insn->args[0] = arg;
+  return insn->id;
+}
+
+internal int
+emit2(enum IrOpcode op, struct Type* type, int arg0, int arg1, int line_nr)
+{
+  struct IrInsn* insn = emit(op, type, 2, line_nr);
+  insn->args[0] = arg0;
+  insn->args[1] = arg1;
+  return insn->id;
+}
+
+internal int
+emit_const(struct BitInt* value, struct Type* type, int line_nr)
+{
+  struct IrInsn* insn = emit(Ir_Const, type, 0, line_nr);
+  insn->value = value;
+  return insn->id;
+}
+
+internal int
+emit_var(struct Ast* decl, struct Type* type, int line_nr)
+{
+  struct IrInsn* insn = emit(Ir_Var, type, 0, line_nr);
+  insn->decl = decl;
+  insn->name = decl_name(decl);
+  return insn->id;
+}
+
+internal int
+new_block(char* label)
+{
+  struct IrBlock block;
+  memset(&block, 0, sizeof(block));
+  block.id = function->blocks.elem_count;
+  block.label = label;
+  array_append(&function->blocks, &block);
+  return block.id;
+}
+
+internal void
+add_pred(int block_id, int pred)
+{
+  struct IrBlock* block = ir_block(function, block_id);
+  if (block->pred_count == block->pred_capacity) {
+    int capacity = block->pred_capacity ? 2 * block->pred_capacity : 2;
+    int* preds = arena_push(ir_storage, capacity * sizeof(int));
+    memcpy(preds, block->preds, block->pred_count * sizeof(int));
+    block->preds = preds;
+    block->pred_capacity = capacity;
+  }
+  block->preds[block->pred_count++] = pred;
+}
+
+/* Ends `block_id` with `term`; its successors are set by the caller. */
+internal struct IrBlock*
+terminate_block(int block_id, enum IrTermKind term, int succ_count)
+{
+  struct IrBlock* block = ir_block(function, block_id);
+  assert(block->term == IrTerm_NONE_);
+  block->term = term;
+  block->succ_count = succ_count;
+  if (succ_count > 0) {
+    block->succs = arena_push(ir_storage, succ_count * sizeof(int));
+    memset(block->succs, 0, succ_count * sizeof(int));
+  }
+  return block;
+}
+
+internal struct IrBlock*
+terminate(enum IrTermKind term, int succ_count)
+{
+  struct IrBlock* block = terminate_block(current_block, term, succ_count);
+  current_block = 0;
+  return block;
+}
+
+internal void
+set_succ(struct IrBlock* block, int i, int succ)
+{
+  block->succs[i] = succ;
+  add_pred(succ, block->id);
+}
+
+internal void
+jump_to(int target)
+{
+  if (current_block) {
+    set_succ(terminate(IrTerm_Jump, 1), 0, target);
+  }
+}
+
+/*
+ * SSA variables.
+ */
+
+internal void
+reset_defs()
+{
+  def_capacity = 64;
+  def_count = 0;
+  phi_count = 0;
+  defs = arena_push(ir_storage, def_capacity * sizeof(*defs));
+  memset(defs, 0, def_capacity * sizeof(*defs));
+}
+
+internal struct IrDef*
+find_def(uint64_t key)
+{
+  uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+  int i = h & (def_capacity - 1);
+  while (defs[i].key && defs[i].key != key) {
+    i = (i + 1) & (def_capacity - 1);
+  }
+  return &defs[i];
+}
+
+internal void
+write_variable(int var, int block_id, int value)
+{
+  if ((def_count + 1) * 2 > def_capacity) {
+    struct IrDef* old_defs = defs;
+    int old_capacity = def_capacity;
+    def_capacity *= 2;
+    defs = arena_push(ir_storage, def_capacity * sizeof(*defs));
+    memset(defs, 0, def_capacity * sizeof(*defs));
+    int i;
+    for (i = 0; i < old_capacity; i++) {
+      if (old_defs[i].key) {
+        *find_def(old_defs[i].key) = old_defs[i];
+      }
+    }
+  }
+  uint64_t key = ((uint64_t)block_id << 32) | (uint32_t)var;
+  struct IrDef* def = find_def(key);
+  if (!def->key) {
+    def->key = key;
+    def_count += 1;
+  }
+  def->value = value;
+}
+
+internal struct Type*
+var_type(int var)
+{
+  return type_of_node(*(struct Ast**)array_get(&function->vars, var));
+}
+
+internal int
+declare_variable(struct Ast* decl)
+{
+  int var = function->vars.elem_count;
+  array_append(&function->vars, &decl);
+  var_index[decl->id] = var;
+  return var;
+}
+
+internal int
+variable_of(struct Ast* decl)
+{
+  if (!decl || decl->id <= 0 || decl->id >= ast_index_count) {
+    return 0;
+  }
+  return var_index[decl->id];
+}
+
+internal int read_variable(int var, int block_id);
+
+internal int
+new_phi(int block_id, int var)
+{
+  struct IrInsn* phi = ir_new_insn(function, Ir_Phi, var_type(var), 0, 0, ir_storage);
+  phi->var = var;
+  phi_count += 1;
+  prepend_insn(block_id, phi);
+  return phi->id;
+}
+
+internal void
+add_phi_operands(int phi_id)
+{
+  struct IrInsn* phi = ir_insn(function, phi_id);
+  struct IrBlock* block = ir_block(function, phi->block);
+  phi->arg_count = block->pred_count;
+  phi->args = arena_push(ir_storage, block->pred_count * sizeof(int));
+  int i;
+  for (i = 0; i < block->pred_count; i++) {
+    phi->args[i] = read_variable(phi->var, block->preds[i]);
+  }
+}
+
+internal int
+read_variable(int var, int block_id)
+{
+  uint64_t key = ((uint64_t)block_id << 32) | (uint32_t)var;
+  struct IrDef* def = find_def(key);
+  if (def->key) {
+    return def->value;
+  }
+  struct IrBlock* block = ir_block(function, block_id);
+  int value = 0;
+  if (!block->is_sealed) {
+    value = new_phi(block_id, var);
+    ir_insn(function, value)->next_incomplete_phi = block->first_incomplete_phi;
+    block->first_incomplete_phi = value;
+  } else if (block->pred_count == 1) {
+    value = read_variable(var, block->preds[0]);
+  } else if (block->pred_count == 0) {
+    struct IrInsn* undef = ir_new_insn(function, Ir_Undef, var_type(var), 0, 0, ir_storage);
+    prepend_insn(block_id, undef);
+    value = undef->id;
+  } else {
+    /* Breaks cycles through the loops of parser states. */
+    value = new_phi(block_id, var);
+    write_variable(var, block_id, value);
+    add_phi_operands(value);
+  }
+  write_variable(var, block_id, value);
+  return value;
+}
+
+internal void
+seal_block(int block_id)
+{
+  struct IrBlock* block = ir_block(function, block_id);
+  int phi = block->first_incomplete_phi;
+  while (phi) {
+    add_phi_operands(phi);
+    phi = ir_insn(function, phi)->next_incomplete_phi;
+  }
+  block->first_incomplete_phi = 0;
+  block->is_sealed = true;
+}
+
+internal int
+resolve_value(int id)
+{
+  while (id && ir_insn(function, id)->replaced_by) {
+    id = ir_insn(function, id)->replaced_by;
+  }
+  return id;
+}
+
+/* A phi whose operands are all the same value, or itself, is that value. */
+internal void
+remove_trivial_phis()
+{
+  int i, j;
+  if (phi_count == 0) {
+    return;
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (i = 1; i < function->insns.elem_count; i++) {
+      struct IrInsn* phi = ir_insn(function, i);
+      if (phi->op != Ir_Phi || phi->replaced_by) {
+        continue;
+      }
+      int same = 0;
+      bool is_trivial = true;
+      for (j = 0; j < phi->arg_count; j++) {
+        int arg = resolve_value(phi->args[j]);
+        if (arg == i || arg == same) {
+          continue;
+        }
+        if (same) {
+          is_trivial = false;
+          break;
+        }
+        same = arg;
+      }
+      if (!is_trivial) {
+        continue;
+      }
+      if (same) {
+        phi->replaced_by = same;
+      } else {
+        phi->op = Ir_Undef;
+        phi->arg_count = 0;
+      }
+      changed = true;
+    }
+  }
+  for (i = 1; i < function->insns.elem_count; i++) {
+    struct IrInsn* insn = ir_insn(function, i);
+    for (j = 0; j < insn->arg_count; j++) {
+      insn->args[j] = resolve_value(insn->args[j]);
+    }
+    insn->receiver = resolve_value(insn->receiver);
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    block->value = resolve_value(block->value);
+    for (j = 0; j < block->key_count; j++) {
+      block->keys[j] = resolve_value(block->keys[j]);
+    }
+    int id = block->first_insn;
+    block->first_insn = block->last_insn = 0;
+    while (id) {
+      struct IrInsn* insn = ir_insn(function, id);
+      int next = insn->next_in_block;
+      insn->next_in_block = 0;
+      if (!insn->replaced_by) {
+        append_insn(i, insn);
+      }
+      id = next;
+    }
+  }
+}
+
+/*
+ * Functions.
+ */
+
+internal struct IrFunction*
+new_function(enum IrFunctionKind kind, char* name, struct Ast* decl, struct AstList* params)
+{
+  struct IrFunction* f = arena_push(ir_storage, sizeof(*f));
+  memset(f, 0, sizeof(*f));
+  f->kind = kind;
+  f->name = name;
+  f->decl = decl;
+  f->params = params;
+  array_init(&f->insns, sizeof(struct IrInsn), ir_storage);
+  array_init(&f->blocks, sizeof(struct IrBlock), ir_storage);
+  array_init(&f->locals, sizeof(struct Ast*), ir_storage);
+  array_init(&f->tables, sizeof(struct Ast*), ir_storage);
+  array_init(&f->vars, sizeof(struct Ast*), ir_storage);
+  /* Number 0 of instructions, blocks and variables stands for none. */
+  struct IrInsn no_insn;
+  memset(&no_insn, 0, sizeof(no_insn));
+  array_append(&f->insns, &no_insn);
+  struct IrBlock no_block;
+  memset(&no_block, 0, sizeof(no_block));
+  array_append(&f->blocks, &no_block);
+  struct Ast* no_decl = 0;
+  array_append(&f->vars, &no_decl);
+  array_append(&ir_program->functions, &f);
+  ir_program->function_of[decl->id] = f;
+  return f;
+}
+
+internal void
+begin_function(struct IrFunction* f)
+{
+  function = f;
+  reset_defs();
+  f->entry_block = new_block("entry");
+  ir_block(f, f->entry_block)->is_sealed = true;
+  current_block = f->entry_block;
+}
+
+internal void
+end_function()
+{
+  if (current_block) {
+    terminate(IrTerm_Return, 0);
+  }
+  remove_trivial_phis();
+  ir_program->insn_count += function->insns.elem_count - 1;
+  ir_program->block_count += function->blocks.elem_count - 1;
+  function = 0;
+}
+
+/* Scalar `in` and directionless parameters are SSA values; the others are passed in memory. */
+internal void
+lower_parameters(struct AstList* params)
+{
+  int i = 0;
+  struct AstListLink* link = params ? ast_list_first_link(params) : 0;
+  while (link) {
+    struct Ast* param = link->ast;
+    enum AstParamDirection direction = *(enum AstParamDirection*)ast_getattr(param, "direction");
+    if ((direction == AstParamDir_NONE_ || direction == AstParamDir_In) && is_scalar_type(type_of_node(param))) {
+      struct IrInsn* insn = emit(Ir_Param, type_of_node(param), 0, param->line_nr);
+      insn->index = i;
+      insn->name = decl_name(param);
+      write_variable(declare_variable(param), current_block, insn->id);
+    }
+    i += 1;
+    link = link->next;
+  }
+}
+
+/*
+ * Expressions.
+ */
+
+/* An unsized constant operand takes the type of the operation. */
+internal int
+lower_operand(struct Ast* expr, struct Type* type)
+{
+  struct Type* expr_type = type_of_node(expr);
+  if (expr_type && expr_type->kind == Type_Int && type && type->kind != Type_Int) {
+    struct BitInt* value = const_value_as(expr, type);
+    if (value) {
+      return emit_const(value, type, expr->line_nr);
+    }
+  }
+  return lower_expression(expr);
+}
+
+internal int
+lower_ref(struct Ast* expr)
+{
+  struct Type* type = type_of_node(expr);
+  if (expr->kind == Ast_Name) {
+    struct Ast* decl = decl_of_node(expr);
+    int var = variable_of(decl);
+    if (var) {
+      return read_variable(var, current_block);
+    }
+    if (!decl) {
+      error("at line %d: `%s` does not name a value.", expr->line_nr, (char*)ast_getattr(expr, "name"));
+    }
+    return emit_var(decl, type, expr->line_nr);
+  } else if (expr->kind == Ast_MemberSelectExpr) {
+    struct Ast* operand = (struct Ast*)ast_getattr(expr, "expr");
+    struct Ast* member_name = (struct Ast*)ast_getattr(expr, "member_name");
+    int base = lower_ref(operand);
+    struct IrInsn* field = emit(Ir_Field, type, 1, expr->line_nr);
+    field->args[0] = base;
+    field->name = (char*)ast_getattr(member_name, "name");
+    return field->id;
+  } else if (expr->kind == Ast_IndexedArrayExpr) {
+    struct Ast* index_expr = (struct Ast*)ast_getattr(expr, "index_expr");
+    if (!ast_getattr(index_expr, "colon_index")) {
+      int base = lower_ref((struct Ast*)ast_getattr(expr, "expr"));
+      int index = lower_expression((struct Ast*)ast_getattr(index_expr, "index"));
+      return emit2(Ir_Index, type, base, index, expr->line_nr);
+    }
+  }
+  return lower_expression(expr);
+}
+
+internal int
+slice_bound(struct Ast* expr)
+{
+  struct BitInt* value = const_value_of(expr);
+  int64_t bound = 0;
+  if (!value || !bitint_to_int64(value, &bound) || bound < 0 || bound > INT32_MAX) {
+    error("at line %d: bit slice bounds must be compile-time constants.", expr->line_nr);
+  }
+  return (int)bound;
+}
+
+internal int
+lower_slice(int value, struct Ast* array_index, struct Type* type)
+{
+  struct IrInsn* slice = emit(Ir_Slice, type, 1, array_index->line_nr);
+  slice->args[0] = value;
+  slice->index = slice_bound((struct Ast*)ast_getattr(array_index, "index"));
+  slice->low = slice_bound((struct Ast*)ast_getattr(array_index, "colon_index"));
+  return slice->id;
+}
+
+internal int
+lower_slice_set(int value, int bits, struct Ast* array_index, struct Type* type)
+{
+  struct IrInsn* slice = emit(Ir_SliceSet, type, 2, array_index->line_nr);
+  slice->args[0] = value;
+  slice->args[1] = bits;
+  slice->index = slice_bound((struct Ast*)ast_getattr(array_index, "index"));
+  slice->low = slice_bound((struct Ast*)ast_getattr(array_index, "colon_index"));
+  return slice->id;
+}
+
+internal enum IrOpcode
+binary_opcode(enum AstExprOperator op)
+{
+  static enum IrOpcode opcodes[] = {
+    [AstExprOp_Add] = Ir_Add, [AstExprOp_Sub] = Ir_Sub, [AstExprOp_Mul] = Ir_Mul, [AstExprOp_Div] = Ir_Div,
+    [AstExprOp_And] = Ir_And, [AstExprOp_Or] = Ir_Or, [AstExprOp_Equal] = Ir_Equal,
+    [AstExprOp_NotEqual] = Ir_NotEqual, [AstExprOp_Less] = Ir_Less, [AstExprOp_Greater] = Ir_Greater,
+    [AstExprOp_LessEqual] = Ir_LessEqual, [AstExprOp_GreaterEqual] = Ir_GreaterEqual,
+    [AstExprOp_BitAnd] = Ir_BitAnd, [AstExprOp_BitOr] = Ir_BitOr, [AstExprOp_BitXor] = Ir_BitXor,
+    [AstExprOp_BitShiftLeft] = Ir_Shl, [AstExprOp_BitShiftRight] = Ir_Shr,
+  };
+  assert(op < sizeof_array(opcodes) && opcodes[op]);
+  return opcodes[op];
+}
+
+internal bool
+has_call(struct Ast* expr)
+{
+  if (!expr) {
+    return false;
+  }
+  if (expr->kind == Ast_FunctionCallExpr) {
+    return true;
+  } else if (expr->kind == Ast_BinaryExpr) {
+    return has_call((struct Ast*)ast_getattr(expr, "left_operand"))
+           || has_call((struct Ast*)ast_getattr(expr, "right_operand"));
+  } else if (expr->kind == Ast_UnaryExpr || expr->kind == Ast_CastExpr || expr->kind == Ast_MemberSelectExpr
+             || expr->kind == Ast_IndexedArrayExpr) {
+    return has_call((struct Ast*)ast_getattr(expr, "expr"));
+  }
+  return false;
+}
+
+/* `a && b` and `a || b` whose right operand has side effects: b is only evaluated when needed. */
+internal int
+lower_short_circuit(enum AstExprOperator op, struct Ast* left, struct Ast* right, int line_nr)
+{
+  int left_value = lower_expression(left);
+  struct IrBlock* branch = terminate(IrTerm_Branch, 2);
+  branch->value = left_value;
+  int right_block = new_block(0);
+  set_succ(branch, op == AstExprOp_And ? 0 : 1, right_block);
+  seal_block(right_block);
+  current_block = right_block;
+  int right_value = lower_expression(right);
+  int join = new_block(0);
+  jump_to(join);
+  set_succ(branch, op == AstExprOp_And ? 1 : 0, join);
+  seal_block(join);
+  current_block = join;
+  struct IrInsn* phi = ir_new_insn(function, Ir_Phi, type_of_node(left), 2, line_nr, ir_storage);
+  phi->args[0] = right_value;
+  phi->args[1] = left_value;
+  phi_count += 1;
+  prepend_insn(join, phi);
+  return phi->id;
+}
+
+internal int
+lower_binary_expression(struct Ast* expr)
+{
+  enum AstExprOperator op = *(enum AstExprOperator*)ast_getattr(expr, "op");
+  struct Ast* left = (struct Ast*)ast_getattr(expr, "left_operand");
+  struct Ast* right = (struct Ast*)ast_getattr(expr, "right_operand");
+  if (op == AstExprOp_Mask) {
+    error("at line %d: `&&&` is only allowed in keysets.", expr->line_nr);
+  }
+  if ((op == AstExprOp_And || op == AstExprOp_Or) && has_call(right)) {
+    return lower_short_circuit(op, left, right, expr->line_nr);
+  }
+  struct Type* operand_type = type_of_node(expr);
+  if (op == AstExprOp_Equal || op == AstExprOp_NotEqual || op == AstExprOp_Less || op == AstExprOp_Greater
+      || op == AstExprOp_LessEqual || op == AstExprOp_GreaterEqual) {
+    operand_type = type_of_node(left);
+    if (operand_type && operand_type->kind == Type_Int) {
+      operand_type = type_of_node(right);
+    }
+  }
+  int left_value = lower_operand(left, operand_type);
+  int right_value = (op == AstExprOp_BitShiftLeft || op == AstExprOp_BitShiftRight) ? lower_expression(right)
+                      : lower_operand(right, operand_type);
+  return emit2(binary_opcode(op), type_of_node(expr), left_value, right_value, expr->line_nr);
+}
+
+internal int
+lower_unary_expression(struct Ast* expr)
+{
+  enum AstExprOperator op = *(enum AstExprOperator*)ast_getattr(expr, "op");
+  int operand = lower_expression((struct Ast*)ast_getattr(expr, "expr"));
+  enum IrOpcode opcode = Ir_NONE_;
+  if (op == AstExprOp_LogNot) {
+    opcode = Ir_LogNot;
+  } else if (op == AstExprOp_BitNot) {
+    opcode = Ir_BitNot;
+  } else if (op == AstExprOp_Minus) {
+    opcode = Ir_Neg;
+  } else assert(0);
+  return emit1(opcode, type_of_node(expr), operand, expr->line_nr);
+}
+
+internal int
+lower_member_select(struct Ast* expr)
+{
+  struct Ast* operand = (struct Ast*)ast_getattr(expr, "expr");
+  struct Ast* member_name = (struct Ast*)ast_getattr(expr, "member_name");
+  char* strname = (char*)ast_getattr(member_name, "name");
+  struct Type* type = type_of_node(expr);
+  if (operand->kind == Ast_Name && !decl_of_node(operand)) {
+    /* `E.member` of an enum or of `error`, without a numeric value. */
+    struct Type* enum_type = type_of_node(operand);
+    struct IrInsn* insn = emit(Ir_EnumConst, type, 0, expr->line_nr);
+    insn->name = strname;
+    int i;
+    for (i = 0; enum_type && i < enum_type->member_count; i++) {
+      if (cstr_match(enum_type->members[i].name, strname)) {
+        insn->index = i;
+        break;
+      }
+    }
+    return insn->id;
+  }
+  struct Type* operand_type = type_of_node(operand);
+  if (operand_type && operand_type->kind == Type_ApplyResult) {
+    int result = lower_expression(operand);
+    if (cstr_match(strname, "hit")) {
+      return emit1(Ir_TableHit, type, result, expr->line_nr);
+    } else if (cstr_match(strname, "miss")) {
+      return emit1(Ir_LogNot, type, emit1(Ir_TableHit, type, result, expr->line_nr), expr->line_nr);
+    }
+    return emit1(Ir_ActionRun, type_bit32, result, expr->line_nr);
+  }
+  int ref = lower_ref(expr);
+  return is_scalar_type(type) ? emit1(Ir_Load, type, ref, expr->line_nr) : ref;
+}
+
+internal int
+lower_expression_list(struct AstList* expr_list, struct Type* type, int line_nr)
+{
+  struct IrInsn* tuple = emit(Ir_Tuple, type, list_count(expr_list), line_nr);
+  int i = 0;
+  struct AstListLink* link = expr_list ? ast_list_first_link(expr_list) : 0;
+  while (link) {
+    struct Ast* elem = link->ast;
+    if (elem->kind == Ast_KvPair) {
+      elem = (struct Ast*)ast_getattr(elem, "expr");
+    }
+    struct Type* elem_type = (type && type->kind == Type_Tuple && i < type->arg_count) ? type->args[i] : 0;
+    int value = lower_operand(elem, elem_type);
+    ir_insn(function, tuple->id)->args[i++] = value;
+    link = link->next;
+  }
+  return tuple->id;
+}
+
+internal int
+lower_expression(struct Ast* expr)
+{
+  struct Type* type = type_of_node(expr);
+  struct BitInt* value = const_value_of(expr);
+  if (value) {
+    return emit_const(value, type, expr->line_nr);
+  }
+  if (expr->kind == Ast_Name) {
+    struct Ast* decl = decl_of_node(expr);
+    int var = variable_of(decl);
+    if (var) {
+      return read_variable(var, current_block);
+    }
+    int ref = lower_ref(expr);
+    return is_scalar_type(type) ? emit1(Ir_Load, type, ref, expr->line_nr) : ref;
+  } else if (expr->kind == Ast_StringLiteral) {
+    struct IrInsn* insn = emit(Ir_String, type, 0, expr->line_nr);
+    insn->name = (char*)ast_getattr(expr, "value");
+    return insn->id;
+  } else if (expr->kind == Ast_Dontcare) {
+    return emit(Ir_Undef, type, 0, expr->line_nr)->id;
+  } else if (expr->kind == Ast_MemberSelectExpr) {
+    return lower_member_select(expr);
+  } else if (expr->kind == Ast_IndexedArrayExpr) {
+    struct Ast* index_expr = (struct Ast*)ast_getattr(expr, "index_expr");
+    if (ast_getattr(index_expr, "colon_index")) {
+      return lower_slice(lower_expression((struct Ast*)ast_getattr(expr, "expr")), index_expr, type);
+    }
+    int ref = lower_ref(expr);
+    return is_scalar_type(type) ? emit1(Ir_Load, type, ref, expr->line_nr) : ref;
+  } else if (expr->kind == Ast_CastExpr) {
+    return emit1(Ir_Cast, type, lower_expression((struct Ast*)ast_getattr(expr, "expr")), expr->line_nr);
+  } else if (expr->kind == Ast_UnaryExpr) {
+    return lower_unary_expression(expr);
+  } else if (expr->kind == Ast_BinaryExpr) {
+    return lower_binary_expression(expr);
+  } else if (expr->kind == Ast_ExpressionListExpr) {
+    return lower_expression_list((struct AstList*)ast_getattr(expr, "expr_list"), type, expr->line_nr);
+  } else if (expr->kind == Ast_FunctionCallExpr) {
+    return lower_call((struct Ast*)ast_getattr(expr, "expr"), (struct AstList*)ast_getattr(expr, "args"), type,
+                      expr->line_nr);
+  } else if (expr->kind == Ast_TypeArgsExpr) {
+    return lower_expression((struct Ast*)ast_getattr(expr, "expr"));
+  }
+  error("at line %d: expression cannot be lowered.", expr->line_nr);
+  return 0;
+}
+
+/*
+ * Calls.
+ */
+
+/* Reference to the first `elem_count` elements of the path of an lvalue. */
+internal int
+lower_lvalue_path(struct Ast* lvalue, int elem_count)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(lvalue, "name");
+  int ref = lower_ref(name);
+  struct AstList* path = (struct AstList*)ast_getattr(lvalue, "expr");
+  struct AstListLink* link = path ? ast_list_first_link(path) : 0;
+  int i;
+  for (i = 0; i < elem_count; i++) {
+    struct Ast* elem = link->ast;
+    if (elem->kind == Ast_Name) {
+      struct IrInsn* field = emit(Ir_Field, type_of_node(elem), 1, elem->line_nr);
+      field->args[0] = ref;
+      field->name = (char*)ast_getattr(elem, "name");
+      ref = field->id;
+    } else if (elem->kind == Ast_ArrayIndex) {
+      int index = lower_expression((struct Ast*)ast_getattr(elem, "index"));
+      ref = emit2(Ir_Index, type_of_node(elem), ref, index, elem->line_nr);
+    } else assert(0);
+    link = link->next;
+  }
+  return ref;
+}
+
+/* The first property of `table` of `kind`, and named `name` unless that is 0; or 0. */
+struct Ast*
+ir_table_property(struct Ast* table, enum AstKind kind, char* name)
+{
+  struct AstList* prop_list = (struct AstList*)ast_getattr(table, "prop_list");
+  struct AstListLink* link = prop_list ? ast_list_first_link(prop_list) : 0;
+  while (link) {
+    if (link->ast->kind == kind && (!name || cstr_match(decl_name(link->ast), name))) {
+      return link->ast;
+    }
+    link = link->next;
+  }
+  return 0;
+}
+
+internal struct AstList*
+table_actions(struct Ast* table)
+{
+  struct Ast* actions = ir_table_property(table, Ast_TableProp_Actions, 0);
+  return actions ? (struct AstList*)ast_getattr(actions, "action_list") : 0;
+}
+
+internal int
+param_index(struct AstList* params, char* name)
+{
+  int i = 0;
+  struct AstListLink* link = params ? ast_list_first_link(params) : 0;
+  while (link) {
+    if (cstr_match(decl_name(link->ast), name)) {
+      return i;
+    }
+    i += 1;
+    link = link->next;
+  }
+  return -1;
+}
+
+struct CopyOut {
+  int var;
+  int temp;
+  struct Type* type;
+};
+
+/*
+ * Emits a call of `name`.  Arguments of `out` and `inout` parameters are
+ * passed by reference; an SSA variable passed that way is copied in and out
+ * of a temporary, as in the copy-in/copy-out semantics of P4.
+ */
+internal int
+emit_call(char* name, struct Ast* decl, int receiver, struct AstList* args, struct Type* type, int line_nr)
+{
+  struct AstList* params = decl ? (struct AstList*)ast_getattr(decl, "params") : 0;
+  int param_count = list_count(params);
+  int arg_count = list_count(args);
+  /* An action run by a table gets the rest of its arguments from the matching entry. */
+  bool from_table = receiver && ir_insn(function, receiver)->op == Ir_TableApply;
+  int slot_count = (param_count > arg_count && !from_table) ? param_count : arg_count;
+  int* values = arena_push(ir_storage, (slot_count + 1) * sizeof(int));
+  memset(values, 0, (slot_count + 1) * sizeof(int));
+  struct CopyOut* copy_outs = arena_push(ir_storage, (slot_count + 1) * sizeof(*copy_outs));
+  int copy_out_count = 0;
+  int i = 0;
+  struct AstListLink* link = args ? ast_list_first_link(args) : 0;
+  while (link) {
+    struct Ast* arg = link->ast;
+    int slot = i;
+    if (arg->kind == Ast_Argument) {
+      slot = param_index(params, decl_name(arg));
+      if (slot < 0) {
+        error("at line %d: `%s` has no parameter `%s`.", arg->line_nr, name, decl_name(arg));
+      }
+      arg = (struct Ast*)ast_getattr(arg, "init_expr");
+    }
+    struct Ast* param = ast_list_nth(params, slot);
+    enum AstParamDirection direction = param ? *(enum AstParamDirection*)ast_getattr(param, "direction")
+                                             : AstParamDir_NONE_;
+    struct Type* arg_type = type_of_node(arg);
+    if (direction == AstParamDir_Out || direction == AstParamDir_InOut) {
+      int var = (arg->kind == Ast_Name) ? variable_of(decl_of_node(arg)) : 0;
+      if (var || arg->kind == Ast_Dontcare) {
+        int temp = emit(Ir_Temp, arg_type, 0, arg->line_nr)->id;
+        if (var && direction == AstParamDir_InOut) {
+          emit2(Ir_Store, 0, temp, read_variable(var, current_block), arg->line_nr);
+        }
+        if (var) {
+          copy_outs[copy_out_count].var = var;
+          copy_outs[copy_out_count].temp = temp;
+          copy_outs[copy_out_count].type = arg_type;
+          copy_out_count += 1;
+        }
+        values[slot] = temp;
+      } else if (arg->kind == Ast_IndexedArrayExpr
+                 && ast_getattr((struct Ast*)ast_getattr(arg, "index_expr"), "colon_index")) {
+        error("at line %d: a bit slice cannot be passed to an `out` parameter.", arg->line_nr);
+      } else {
+        values[slot] = lower_ref(arg);
+      }
+    } else {
+      values[slot] = lower_operand(arg, param ? type_of_node(param) : 0);
+    }
+    i += 1;
+    link = link->next;
+  }
+  /* Parameters left out take their default value. */
+  for (i = 0; i < slot_count; i++) {
+    if (!values[i]) {
+      struct Ast* param = ast_list_nth(params, i);
+      struct Ast* init_expr = (struct Ast*)ast_getattr(param, "init_expr");
+      values[i] = init_expr ? lower_operand(init_expr, type_of_node(param))
+                            : emit(Ir_Undef, type_of_node(param), 0, line_nr)->id;
+    }
+  }
+  struct IrInsn* call = emit(Ir_Call, type, slot_count, line_nr);
+  memcpy(call->args, values, slot_count * sizeof(int));
+  call->name = name;
+  call->decl = decl;
+  call->receiver = receiver;
+  for (i = 0; i < copy_out_count; i++) {
+    int value = emit1(Ir_Load, copy_outs[i].type, copy_outs[i].temp, line_nr);
+    write_variable(copy_outs[i].var, current_block, value);
+  }
+  return call->id;
+}
+
+/*
+ * `t.apply()` is a multi-way branch on the action the table chooses, to a
+ * block that calls that action with the data of the matching entry.
+ */
+internal int
+lower_table_apply(struct Ast* table, int line_nr)
+{
+  struct Ast* key = ir_table_property(table, Ast_TableProp_Key, 0);
+  struct AstList* keyelem_list = key ? (struct AstList*)ast_getattr(key, "keyelem_list") : 0;
+  int key_count = list_count(keyelem_list);
+  int* key_values = arena_push(ir_storage, (key_count + 1) * sizeof(int));
+  int i = 0;
+  struct AstListLink* link = keyelem_list ? ast_list_first_link(keyelem_list) : 0;
+  while (link) {
+    key_values[i++] = lower_expression((struct Ast*)ast_getattr(link->ast, "expr"));
+    link = link->next;
+  }
+  struct IrInsn* apply = emit(Ir_TableApply, 0, key_count, line_nr);
+  memcpy(apply->args, key_values, key_count * sizeof(int));
+  apply->decl = table;
+  apply->name = decl_name(table);
+  int apply_id = apply->id;
+  int action_run = emit1(Ir_ActionRun, type_bit32, apply_id, line_nr);
+  struct AstList* actions = table_actions(table);
+  int action_count = list_count(actions);
+  struct IrBlock* branch = terminate(IrTerm_Switch, action_count + 1);
+  branch->value = action_run;
+  branch->case_count = action_count;
+  branch->case_values = arena_push(ir_storage, (action_count + 1) * sizeof(struct BitInt*));
+  int join = new_block(0);
+  i = 0;
+  link = actions ? ast_list_first_link(actions) : 0;
+  while (link) {
+    struct Ast* action_ref = link->ast;
+    struct Ast* name = (struct Ast*)ast_getattr(action_ref, "name");
+    int block = new_block((char*)ast_getattr(name, "name"));
+    branch->case_values[i] = bitint_cast(bitint_from_int64(i), 32, false, true);
+    set_succ(branch, i, block);
+    seal_block(block);
+    current_block = block;
+    emit_call((char*)ast_getattr(name, "name"), decl_of_node(name), apply_id,
+              (struct AstList*)ast_getattr(action_ref, "args"), 0, action_ref->line_nr);
+    jump_to(join);
+    i += 1;
+    link = link->next;
+  }
+  set_succ(branch, action_count, join);
+  seal_block(join);
+  current_block = join;
+  return apply_id;
+}
+
+internal int
+lower_call(struct Ast* callee_expr, struct AstList* args, struct Type* type, int line_nr)
+{
+  if (callee_expr->kind == Ast_TypeArgsExpr) {
+    callee_expr = (struct Ast*)ast_getattr(callee_expr, "expr");
+  }
+  struct Ast* member_name = 0;
+  struct Type* receiver_type = 0;
+  struct Ast* receiver_expr = 0;
+  struct Ast* lvalue = 0;
+  int path_count = 0;
+  if (callee_expr->kind == Ast_MemberSelectExpr) {
+    member_name = (struct Ast*)ast_getattr(callee_expr, "member_name");
+    receiver_expr = (struct Ast*)ast_getattr(callee_expr, "expr");
+    receiver_type = type_of_node(receiver_expr);
+  } else if (callee_expr->kind == Ast_Lvalue) {
+    struct AstList* path = (struct AstList*)ast_getattr(callee_expr, "expr");
+    path_count = list_count(path);
+    if (path_count == 0) {
+      callee_expr = (struct Ast*)ast_getattr(callee_expr, "name");
+    } else {
+      lvalue = callee_expr;
+      struct AstListLink* link = ast_list_first_link(path);
+      struct Ast* receiver_elem = (struct Ast*)ast_getattr(lvalue, "name");
+      while (link->next) {
+        receiver_elem = link->ast;
+        link = link->next;
+      }
+      member_name = link->ast;
+      receiver_type = type_of_node(receiver_elem);
+    }
+  }
+  if (!member_name) {
+    if (callee_expr->kind != Ast_Name) {
+      error("at line %d: only functions, actions and methods can be called.", line_nr);
+    }
+    return emit_call((char*)ast_getattr(callee_expr, "name"), decl_of_node(callee_expr), 0, args, type, line_nr);
+  }
+  char* method = (char*)ast_getattr(member_name, "name");
+  if (receiver_type && receiver_type->kind == Type_Table) {
+    return lower_table_apply(receiver_type->decl, line_nr);
+  }
+  int receiver = lvalue ? lower_lvalue_path(lvalue, path_count - 1) : lower_ref(receiver_expr);
+  if (receiver_type && (receiver_type->kind == Type_Header || receiver_type->kind == Type_HeaderUnion)) {
+    if (cstr_match(method, "isValid")) {
+      return emit1(Ir_IsValid, type, receiver, line_nr);
+    } else if (cstr_match(method, "setValid")) {
+      return emit1(Ir_SetValid, 0, receiver, line_nr);
+    } else if (cstr_match(method, "setInvalid")) {
+      return emit1(Ir_SetInvalid, 0, receiver, line_nr);
+    }
+  }
+  return emit_call(method, decl_of_node(member_name), receiver, args, type, line_nr);
+}
+
+/*
+ * Statements.
+ */
+
+internal void
+lower_statement_list(struct AstList* stmt_list)
+{
+  struct AstListLink* link = stmt_list ? ast_list_first_link(stmt_list) : 0;
+  while (link) {
+    lower_statement(link->ast);
+    link = link->next;
+  }
+}
+
+internal void
+lower_assignment(struct Ast* stmt)
+{
+  struct Ast* lvalue = (struct Ast*)ast_getattr(stmt, "lvalue");
+  struct Ast* name = (struct Ast*)ast_getattr(lvalue, "name");
+  struct AstList* path = (struct AstList*)ast_getattr(lvalue, "expr");
+  int path_count = list_count(path);
+  struct Ast* last = lvalue;
+  struct AstListLink* link = path ? ast_list_first_link(path) : 0;
+  while (link) {
+    last = link->ast;
+    link = link->next;
+  }
+  bool is_slice = (last->kind == Ast_ArrayIndex && ast_getattr(last, "colon_index"));
+  int value = lower_operand((struct Ast*)ast_getattr(stmt, "expr"), type_of_node(last));
+  int var = variable_of(decl_of_node(name));
+  if (var) {
+    if (is_slice) {
+      assert(path_count == 1);
+      value = lower_slice_set(read_variable(var, current_block), value, last, var_type(var));
+    } else assert(path_count == 0);
+    write_variable(var, current_block, value);
+    return;
+  }
+  if (is_slice) {
+    int ref = lower_lvalue_path(lvalue, path_count - 1);
+    struct Type* type = path_count > 1 ? type_of_node(ast_list_nth(path, path_count - 2)) : type_of_node(name);
+    int old = emit1(Ir_Load, type, ref, stmt->line_nr);
+    emit2(Ir_Store, 0, ref, lower_slice_set(old, value, last, type), stmt->line_nr);
+  } else {
+    emit2(Ir_Store, 0, lower_lvalue_path(lvalue, path_count), value, stmt->line_nr);
+  }
+}
+
+/* Scalars declared in the body of a function are SSA variables; anything else is in memory. */
+internal void
+lower_variable_declaration(struct Ast* decl, char* init_attr)
+{
+  struct Type* type = type_of_node(decl);
+  struct Ast* init_expr = (struct Ast*)ast_getattr(decl, init_attr);
+  if (!in_control_locals && is_scalar_type(type)) {
+    int value = init_expr ? lower_operand(init_expr, type) : emit(Ir_Undef, type, 0, decl->line_nr)->id;
+    write_variable(declare_variable(decl), current_block, value);
+    return;
+  }
+  array_append(&function->locals, &decl);
+  if (init_expr) {
+    int value = lower_operand(init_expr, type);
+    emit2(Ir_Store, 0, emit_var(decl, type, decl->line_nr), value, decl->line_nr);
+  }
+}
+
+internal void
+lower_if_statement(struct Ast* stmt)
+{
+  int cond = lower_expression((struct Ast*)ast_getattr(stmt, "cond_expr"));
+  struct IrBlock* branch = terminate(IrTerm_Branch, 2);
+  branch->value = cond;
+
+  int then_block = new_block("then");
+  set_succ(branch, 0, then_block);
+  seal_block(then_block);
+  current_block = then_block;
+  lower_statement((struct Ast*)ast_getattr(stmt, "stmt"));
+  int then_end = current_block;
+
+  struct Ast* else_stmt = (struct Ast*)ast_getattr(stmt, "else_stmt");
+  int else_end = 0;
+  int else_block = 0;
+  if (else_stmt) {
+    else_block = new_block("else");
+    set_succ(branch, 1, else_block);
+    seal_block(else_block);
+    current_block = else_block;
+    lower_statement(else_stmt);
+    else_end = current_block;
+  }
+  if (else_stmt && !then_end && !else_end) {
+    current_block = 0;
+    return;
+  }
+  int join = new_block(0);
+  if (then_end) {
+    current_block = then_end;
+    jump_to(join);
+  }
+  if (else_end) {
+    current_block = else_end;
+    jump_to(join);
+  }
+  if (!else_stmt) {
+    set_succ(branch, 1, join);
+  }
+  seal_block(join);
+  current_block = join;
+}
+
+internal int
+action_index(struct Ast* table, char* name, int line_nr)
+{
+  int i = 0;
+  struct AstListLink* link = ast_list_first_link(table_actions(table));
+  while (link) {
+    struct Ast* action_name = (struct Ast*)ast_getattr(link->ast, "name");
+    if (cstr_match((char*)ast_getattr(action_name, "name"), name)) {
+      return i;
+    }
+    i += 1;
+    link = link->next;
+  }
+  error("at line %d: `%s` is not an action of table `%s`.", line_nr, name, decl_name(table));
+  return -1;
+}
+
+/* `switch (t.apply().action_run)`; labels without a statement share the next one. */
+internal void
+lower_switch_statement(struct Ast* stmt)
+{
+  int value = lower_expression((struct Ast*)ast_getattr(stmt, "expr"));
+  struct IrInsn* action_run = ir_insn(function, value);
+  if (action_run->op != Ir_ActionRun) {
+    error("at line %d: switch expects `action_run` of a table.", stmt->line_nr);
+  }
+  struct Ast* table = ir_insn(function, action_run->args[0])->decl;
+  struct AstList* switch_cases = (struct AstList*)ast_getattr(stmt, "switch_cases");
+  int label_count = 0;
+  struct AstListLink* link = switch_cases ? ast_list_first_link(switch_cases) : 0;
+  while (link) {
+    label_count += (((struct Ast*)ast_getattr(link->ast, "label"))->kind == Ast_SwitchLabel) ? 1 : 0;
+    link = link->next;
+  }
+  struct IrBlock* branch = terminate(IrTerm_Switch, label_count + 1);
+  branch->value = value;
+  branch->case_count = label_count;
+  branch->case_values = arena_push(ir_storage, (label_count + 1) * sizeof(struct BitInt*));
+  int join = new_block(0);
+  int* pending = arena_push(ir_storage, (label_count + 1) * sizeof(int));
+  int pending_count = 0;
+  bool default_pending = false;
+  int default_block = 0;
+  int i = 0;
+  link = switch_cases ? ast_list_first_link(switch_cases) : 0;
+  while (link) {
+    struct Ast* label = (struct Ast*)ast_getattr(link->ast, "label");
+    if (label->kind == Ast_SwitchLabel) {
+      struct Ast* name = (struct Ast*)ast_getattr(label, "name");
+      int index = action_index(table, (char*)ast_getattr(name, "name"), label->line_nr);
+      branch->case_values[i] = bitint_cast(bitint_from_int64(index), 32, false, true);
+      pending[pending_count++] = i++;
+    } else {
+      default_pending = true;
+    }
+    struct Ast* case_stmt = (struct Ast*)ast_getattr(link->ast, "stmt");
+    if (case_stmt) {
+      int block = new_block(0);
+      int j;
+      for (j = 0; j < pending_count; j++) {
+        set_succ(branch, pending[j], block);
+      }
+      if (default_pending) {
+        default_block = block;
+        add_pred(block, branch->id);
+      }
+      pending_count = 0;
+      default_pending = false;
+      seal_block(block);
+      current_block = block;
+      lower_statement(case_stmt);
+      jump_to(join);
+    }
+    link = link->next;
+  }
+  int j;
+  for (j = 0; j < pending_count; j++) {
+    set_succ(branch, pending[j], join);
+  }
+  if (default_block) {
+    branch->succs[label_count] = default_block;
+  } else {
+    set_succ(branch, label_count, join);
+  }
+  seal_block(join);
+  current_block = ir_block(function, join)->pred_count > 0 ? join : 0;
+}
+
+internal void
+lower_statement(struct Ast* stmt)
+{
+  if (!current_block) {
+    return;  // unreachable
+  }
+  if (stmt->kind == Ast_BlockStmt) {
+    lower_statement_list((struct AstList*)ast_getattr(stmt, "stmt_list"));
+  } else if (stmt->kind == Ast_VarDecl) {
+    lower_variable_declaration(stmt, "init_expr");
+  } else if (stmt->kind == Ast_ConstDecl) {
+    if (!const_value_of((struct Ast*)ast_getattr(stmt, "expr"))) {
+      lower_variable_declaration(stmt, "expr");
+    }
+  } else if (stmt->kind == Ast_Instantiation) {
+    array_append(&function->locals, &stmt);
+  } else if (stmt->kind == Ast_AssignmentStmt) {
+    lower_assignment(stmt);
+  } else if (stmt->kind == Ast_MethodCallStmt) {
+    lower_call((struct Ast*)ast_getattr(stmt, "lvalue"), (struct AstList*)ast_getattr(stmt, "args"), 0,
+               stmt->line_nr);
+  } else if (stmt->kind == Ast_DirectApplic) {
+    struct Ast* name = (struct Ast*)ast_getattr(stmt, "name");
+    struct Type* type = type_of_node(name);
+    if (type && type->kind == Type_Table) {
+      lower_table_apply(type->decl, stmt->line_nr);
+    } else {
+      emit_call("apply", type ? type->decl : 0, 0, (struct AstList*)ast_getattr(stmt, "args"), 0, stmt->line_nr);
+    }
+  } else if (stmt->kind == Ast_IfStmt) {
+    lower_if_statement(stmt);
+  } else if (stmt->kind == Ast_SwitchStmt) {
+    lower_switch_statement(stmt);
+  } else if (stmt->kind == Ast_ReturnStmt) {
+    struct Ast* expr = (struct Ast*)ast_getattr(stmt, "expr");
+    int value = expr ? lower_expression(expr) : 0;
+    terminate(IrTerm_Return, 0)->value = value;
+  } else if (stmt->kind == Ast_ExitStmt) {
+    terminate(IrTerm_Exit, 0);
+  } else if (stmt->kind == Ast_EmptyStmt) {
+    ;  // pass
+  } else assert(0);
+}
+
+/*
+ * Parsers, controls, actions and functions.
+ */
+
+internal struct IrKeysetElem
+lower_keyset_elem(struct Ast* expr, struct Type* key_type)
+{
+  struct IrKeysetElem elem;
+  memset(&elem, 0, sizeof(elem));
+  if (expr->kind == Ast_Default || expr->kind == Ast_Dontcare) {
+    return elem;
+  }
+  if (expr->kind == Ast_BinaryExpr && *(enum AstExprOperator*)ast_getattr(expr, "op") == AstExprOp_Mask) {
+    elem.value = const_value_as((struct Ast*)ast_getattr(expr, "left_operand"), key_type);
+    elem.mask = const_value_as((struct Ast*)ast_getattr(expr, "right_operand"), key_type);
+    if (!elem.value || !elem.mask) {
+      error("at line %d: keyset is not a compile-time constant.", expr->line_nr);
+    }
+    return elem;
+  }
+  elem.value = const_value_as(expr, key_type);
+  if (!elem.value) {
+    error("at line %d: keyset is not a compile-time constant.", expr->line_nr);
+  }
+  return elem;
+}
+
+internal int
+transition_target(struct Ast* name, int accept_block, int reject_block)
+{
+  char* strname = (char*)ast_getattr(name, "name");
+  if (cstr_match(strname, "accept")) {
+    return accept_block;
+  } else if (cstr_match(strname, "reject")) {
+    return reject_block;
+  }
+  struct Ast* state = decl_of_node(name);
+  assert(state && state->kind == Ast_ParserState);
+  return state_block[state->id];
+}
+
+internal void
+lower_select(struct Ast* select_expr, int accept_block, int reject_block)
+{
+  struct AstList* expr_list = (struct AstList*)ast_getattr(select_expr, "expr_list");
+  int key_count = list_count(expr_list);
+  int* keys = arena_push(ir_storage, (key_count + 1) * sizeof(int));
+  struct Type** key_types = arena_push(ir_storage, (key_count + 1) * sizeof(*key_types));
+  int i = 0;
+  struct AstListLink* link = ast_list_first_link(expr_list);
+  while (link) {
+    key_types[i] = type_of_node(link->ast);
+    keys[i++] = lower_expression(link->ast);
+    link = link->next;
+  }
+  struct AstList* case_list = (struct AstList*)ast_getattr(select_expr, "case_list");
+  int case_count = list_count(case_list);
+  struct IrBlock* select = terminate(IrTerm_Select, case_count + 1);
+  select->keys = keys;
+  select->key_count = key_count;
+  select->case_count = case_count;
+  select->select_cases = arena_push(ir_storage, (case_count + 1) * sizeof(struct IrSelectCase));
+  int c = 0;
+  link = case_list ? ast_list_first_link(case_list) : 0;
+  while (link) {
+    struct Ast* keyset = (struct Ast*)ast_getattr(link->ast, "keyset");
+    struct IrSelectCase* select_case = &select->select_cases[c];
+    select_case->line_nr = keyset->line_nr;
+    select_case->elems = arena_push(ir_storage, (key_count + 1) * sizeof(struct IrKeysetElem));
+    memset(select_case->elems, 0, (key_count + 1) * sizeof(struct IrKeysetElem));
+    if (keyset->kind == Ast_TupleKeyset) {
+      int k = 0;
+      struct AstListLink* elem_link = ast_list_first_link((struct AstList*)ast_getattr(keyset, "expr_list"));
+      while (elem_link && k < key_count) {
+        select_case->elems[k] = lower_keyset_elem(elem_link->ast, key_types[k]);
+        k += 1;
+        elem_link = elem_link->next;
+      }
+    } else if (keyset->kind != Ast_Default && keyset->kind != Ast_Dontcare) {
+      select_case->elems[0] = lower_keyset_elem(keyset, key_types[0]);
+    }
+    set_succ(select, c, transition_target((struct Ast*)ast_getattr(link->ast, "name"), accept_block, reject_block));
+    c += 1;
+    link = link->next;
+  }
+  /* No match rejects the packet. */
+  set_succ(select, case_count, reject_block);
+}
+
+internal void
+lower_parser(struct Ast* decl)
+{
+  struct Ast* type_decl = (struct Ast*)ast_getattr(decl, "type_decl");
+  struct AstList* params = (struct AstList*)ast_getattr(type_decl, "params");
+  struct IrFunction* f = new_function(IrFunction_Parser, decl_name(type_decl), type_decl, params);
+  begin_function(f);
+  lower_parameters(params);
+  lower_statement_list((struct AstList*)ast_getattr(decl, "local_elements"));
+
+  /* State blocks are sealed once all transitions are in: states may loop. */
+  struct AstList* states = (struct AstList*)ast_getattr(decl, "states");
+  int start_block = 0;
+  struct AstListLink* link = states ? ast_list_first_link(states) : 0;
+  while (link) {
+    char* strname = decl_name(link->ast);
+    state_block[link->ast->id] = new_block(strname);
+    if (cstr_match(strname, "start")) {
+      start_block = state_block[link->ast->id];
+    }
+    link = link->next;
+  }
+  if (!start_block) {
+    error("at line %d: parser `%s` has no `start` state.", decl->line_nr, f->name);
+  }
+  int accept_block = new_block("accept");
+  terminate_block(accept_block, IrTerm_Accept, 0);
+  int reject_block = new_block("reject");
+  terminate_block(reject_block, IrTerm_Reject, 0);
+  jump_to(start_block);
+
+  link = states ? ast_list_first_link(states) : 0;
+  while (link) {
+    struct Ast* state = link->ast;
+    current_block = state_block[state->id];
+    lower_statement_list((struct AstList*)ast_getattr(state, "stmt_list"));
+    struct Ast* trans_stmt = (struct Ast*)ast_getattr(state, "trans_stmt");
+    if (current_block && trans_stmt && trans_stmt->kind == Ast_Name) {
+      jump_to(transition_target(trans_stmt, accept_block, reject_block));
+    } else if (current_block && trans_stmt && trans_stmt->kind == Ast_SelectExpr) {
+      lower_select(trans_stmt, accept_block, reject_block);
+    } else if (current_block) {
+      jump_to(reject_block);
+    }
+    link = link->next;
+  }
+  link = states ? ast_list_first_link(states) : 0;
+  while (link) {
+    seal_block(state_block[link->ast->id]);
+    link = link->next;
+  }
+  seal_block(accept_block);
+  seal_block(reject_block);
+  current_block = 0;
+  end_function();
+}
+
+internal void
+lower_action(struct Ast* decl, struct IrFunction* parent)
+{
+  struct AstList* params = (struct AstList*)ast_getattr(decl, "params");
+  struct IrFunction* f = new_function(IrFunction_Action, decl_name(decl), decl, params);
+  f->parent = parent;
+  begin_function(f);
+  lower_parameters(params);
+  lower_statement((struct Ast*)ast_getattr(decl, "stmt"));
+  end_function();
+}
+
+internal void
+lower_function(struct Ast* decl)
+{
+  struct Ast* proto = (struct Ast*)ast_getattr(decl, "proto");
+  struct AstList* params = (struct AstList*)ast_getattr(proto, "params");
+  struct IrFunction* f = new_function(IrFunction_Function, decl_name(proto), proto, params);
+  begin_function(f);
+  lower_parameters(params);
+  lower_statement((struct Ast*)ast_getattr(decl, "stmt"));
+  end_function();
+}
+
+/* Parameters and local declarations of a control are in memory: its actions share them. */
+internal void
+lower_control(struct Ast* decl)
+{
+  struct Ast* type_decl = (struct Ast*)ast_getattr(decl, "type_decl");
+  struct AstList* params = (struct AstList*)ast_getattr(type_decl, "params");
+  struct IrFunction* f = new_function(IrFunction_Control, decl_name(type_decl), type_decl, params);
+  struct AstList* local_decls = (struct AstList*)ast_getattr(decl, "local_decls");
+  struct AstListLink* link = local_decls ? ast_list_first_link(local_decls) : 0;
+  while (link) {
+    if (link->ast->kind == Ast_ActionDecl) {
+      lower_action(link->ast, f);
+    }
+    link = link->next;
+  }
+  begin_function(f);
+  in_control_locals = true;
+  link = local_decls ? ast_list_first_link(local_decls) : 0;
+  while (link) {
+    struct Ast* local_decl = link->ast;
+    if (local_decl->kind == Ast_TableDecl) {
+      array_append(&f->tables, &local_decl);
+    } else if (local_decl->kind != Ast_ActionDecl) {
+      lower_statement(local_decl);
+    }
+    link = link->next;
+  }
+  in_control_locals = false;
+  struct Ast* apply_stmt = (struct Ast*)ast_getattr(decl, "apply_stmt");
+  if (apply_stmt) {
+    lower_statement(apply_stmt);
+  }
+  end_function();
+}
+
+struct IrProgram*
+build_ir_program(struct Ast* p4program, int ast_node_count, struct Arena* ir_storage_)
+{
+  assert(p4program->kind == Ast_P4Program);
+  ir_storage = ir_storage_;
+  ir_program = arena_push(ir_storage, sizeof(*ir_program));
+  memset(ir_program, 0, sizeof(*ir_program));
+  array_init(&ir_program->functions, sizeof(struct IrFunction*), ir_storage);
+  ast_index_count = ast_node_count + 1;
+  ir_program->function_of_count = ast_index_count;
+  ir_program->function_of = arena_push(ir_storage, ast_index_count * sizeof(struct IrFunction*));
+  memset(ir_program->function_of, 0, ast_index_count * sizeof(struct IrFunction*));
+  var_index = arena_push(ir_storage, ast_index_count * sizeof(int));
+  memset(var_index, 0, ast_index_count * sizeof(int));
+  state_block = arena_push(ir_storage, ast_index_count * sizeof(int));
+  memset(state_block, 0, ast_index_count * sizeof(int));
+  type_bit32 = type_sized(Type_Bit, 32);
+  function = 0;
+  current_block = 0;
+  in_control_locals = false;
+
+  struct AstList* decl_list = (struct AstList*)ast_getattr(p4program, "decl_list");
+  struct AstListLink* link = ast_list_first_link(decl_list);
+  while (link) {
+    struct Ast* decl = link->ast;
+    if (decl->kind == Ast_Parser && ast_getattr(decl, "states")) {
+      lower_parser(decl);
+    } else if (decl->kind == Ast_Control && ast_getattr(decl, "apply_stmt")) {
+      lower_control(decl);
+    } else if (decl->kind == Ast_ActionDecl) {
+      lower_action(decl, 0);
+    } else if (decl->kind == Ast_FunctionDecl) {
+      lower_function(decl);
+    }
+    link = link->next;
+  }
+  return ir_program;
+}
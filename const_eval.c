@@ -0,0 +1,379 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "type_check.h"
+#include "const_eval.h"
+#include <memory.h>  // memset
+
+
+/*
+ * Compile-time values of expressions, with the width and signedness of their
+ * type.  Evaluation is on demand and memoized, so the type checker can ask for
+ * the value of `bit<W>` sizes while it goes, and later phases read constants
+ * instead of emitting the arithmetic.
+ */
+
+internal struct Arena* const_storage;
+internal struct BitInt** node_values = 0;  /* indexed by Ast.id */
+internal bool* node_evaluated = 0;
+internal int node_value_count = 0;
+
+
+void
+const_eval_init(int ast_node_count, struct Arena* const_storage_)
+{
+  const_storage = const_storage_;
+  bitint_set_storage(const_storage);
+  node_value_count = ast_node_count + 1;
+  node_values = arena_push(const_storage, node_value_count * sizeof(*node_values));
+  memset(node_values, 0, node_value_count * sizeof(*node_values));
+  node_evaluated = arena_push(const_storage, node_value_count * sizeof(*node_evaluated));
+  memset(node_evaluated, 0, node_value_count * sizeof(*node_evaluated));
+}
+
+/* Representation of the values of `type`; false if they are not integers. */
+internal bool
+value_shape(struct Type* type, int* width, bool* is_signed, bool* is_sized)
+{
+  if (!type) {
+    return false;
+  }
+  if ((type->kind == Type_Enum || type->kind == Type_NewType) && type->base) {
+    type = type->base;
+  }
+  *is_sized = true;
+  if (type->kind == Type_Bool) {
+    *width = 1;
+    *is_signed = false;
+  } else if (type->kind == Type_Bit || type->kind == Type_SignedInt) {
+    *width = type->width;
+    *is_signed = (type->kind == Type_SignedInt);
+  } else if (type->kind == Type_Int) {
+    *width = 0;
+    *is_signed = true;
+    *is_sized = false;
+  } else {
+    return false;
+  }
+  return !*is_sized || *width > 0;
+}
+
+internal struct BitInt*
+convert(struct BitInt* value, struct Type* type)
+{
+  int width;
+  bool is_signed, is_sized;
+  if (!value || !value_shape(type, &width, &is_signed, &is_sized)) {
+    return 0;
+  }
+  return bitint_cast(value, width, is_signed, is_sized);
+}
+
+internal struct BitInt*
+bool_value(bool b)
+{
+  return bitint_cast(bitint_from_int64(b ? 1 : 0), 1, false, true);
+}
+
+/* Type both operands of a comparison are converted to: an unsized one takes the other's. */
+internal struct Type*
+comparison_type(struct Ast* left, struct Ast* right)
+{
+  struct Type* type = type_of_node(left);
+  if (type && type->kind == Type_Int) {
+    return type_of_node(right);
+  }
+  return type;
+}
+
+internal struct BitInt*
+eval_binary_expression(struct Ast* expr)
+{
+  enum AstExprOperator op = *(enum AstExprOperator*)ast_getattr(expr, "op");
+  struct Ast* left_operand = (struct Ast*)ast_getattr(expr, "left_operand");
+  struct Ast* right_operand = (struct Ast*)ast_getattr(expr, "right_operand");
+  struct BitInt* left = const_value_of(left_operand);
+  struct BitInt* right = const_value_of(right_operand);
+  if (!left || !right) {
+    return 0;
+  }
+  struct Type* type = type_of_node(expr);
+  if (op == AstExprOp_And) {
+    return bool_value(!bitint_is_zero(left) && !bitint_is_zero(right));
+  } else if (op == AstExprOp_Or) {
+    return bool_value(!bitint_is_zero(left) || !bitint_is_zero(right));
+  } else if (op == AstExprOp_Equal || op == AstExprOp_NotEqual || op == AstExprOp_Less || op == AstExprOp_Greater
+             || op == AstExprOp_LessEqual || op == AstExprOp_GreaterEqual) {
+    struct Type* operand_type = comparison_type(left_operand, right_operand);
+    left = convert(left, operand_type);
+    right = convert(right, operand_type);
+    if (!left || !right) {
+      return 0;
+    }
+    int c = bitint_compare(left, right);
+    if (op == AstExprOp_Equal) {
+      return bool_value(c == 0);
+    } else if (op == AstExprOp_NotEqual) {
+      return bool_value(c != 0);
+    } else if (op == AstExprOp_Less) {
+      return bool_value(c < 0);
+    } else if (op == AstExprOp_Greater) {
+      return bool_value(c > 0);
+    } else if (op == AstExprOp_LessEqual) {
+      return bool_value(c <= 0);
+    }
+    return bool_value(c >= 0);
+  } else if (op == AstExprOp_BitShiftLeft || op == AstExprOp_BitShiftRight) {
+    left = convert(left, type);
+    if (!left) {
+      return 0;
+    }
+    if (bitint_is_negative(right)) {
+      error("at line %d: negative shift count.", expr->line_nr);
+    }
+    int64_t count;
+    if (!bitint_to_int64(right, &count) || count > BITINT_MAX_WIDTH) {
+      count = BITINT_MAX_WIDTH + 1;
+    }
+    if (left->is_sized && count > left->width) {
+      count = left->width;
+    }
+    return (op == AstExprOp_BitShiftLeft) ? bitint_shl(left, count) : bitint_shr(left, count);
+  }
+  left = convert(left, type);
+  right = convert(right, type);
+  if (!left || !right) {
+    return 0;
+  }
+  if (op == AstExprOp_Add) {
+    return bitint_add(left, right);
+  } else if (op == AstExprOp_Sub) {
+    return bitint_sub(left, right);
+  } else if (op == AstExprOp_Mul) {
+    return bitint_mul(left, right);
+  } else if (op == AstExprOp_Div) {
+    if (left->is_sized && left->is_signed) {
+      error("at line %d: `/` is not defined on signed values.", expr->line_nr);
+    }
+    struct BitInt* result = bitint_div(left, right);
+    if (!result) {
+      error("at line %d: division by zero.", expr->line_nr);
+    }
+    return result;
+  } else if (op == AstExprOp_BitAnd) {
+    return bitint_and(left, right);
+  } else if (op == AstExprOp_BitOr) {
+    return bitint_or(left, right);
+  } else if (op == AstExprOp_BitXor) {
+    return bitint_xor(left, right);
+  } else if (op == AstExprOp_Mask) {
+    /* The value of `v &&& m` is its canonical key `v & m`; the operands keep their own values. */
+    return bitint_and(left, right);
+  } else assert(0);
+  return 0;
+}
+
+internal struct BitInt*
+eval_unary_expression(struct Ast* expr)
+{
+  enum AstExprOperator op = *(enum AstExprOperator*)ast_getattr(expr, "op");
+  struct BitInt* operand = convert(const_value_of((struct Ast*)ast_getattr(expr, "expr")), type_of_node(expr));
+  if (!operand) {
+    return 0;
+  }
+  if (op == AstExprOp_Minus) {
+    return bitint_neg(operand);
+  } else if (op == AstExprOp_BitNot) {
+    return bitint_not(operand);
+  } else if (op == AstExprOp_LogNot) {
+    return bool_value(bitint_is_zero(operand));
+  } else assert(0);
+  return 0;
+}
+
+/* Value of a constant or of an enum member with an explicit value. */
+internal struct BitInt*
+eval_declared_value(struct Ast* decl)
+{
+  if (!decl) {
+    return 0;
+  }
+  if (decl->kind == Ast_ConstDecl) {
+    return const_value_of((struct Ast*)ast_getattr(decl, "expr"));
+  } else if (decl->kind == Ast_SpecdId) {
+    struct Ast* init_expr = (struct Ast*)ast_getattr(decl, "init_expr");
+    return init_expr ? const_value_of(init_expr) : 0;
+  }
+  return 0;
+}
+
+/* Initializer of the field `name` within the initializer of a struct, header or tuple value. */
+internal struct Ast*
+field_of(struct Ast* aggregate, struct Type* type, char* name)
+{
+  if (!aggregate || !type || !type->members) {
+    return 0;
+  }
+  int i;
+  for (i = 0; i < type->member_count; i++) {
+    if (cstr_match(type->members[i].name, name)) {
+      break;
+    }
+  }
+  struct AstList* expr_list = (struct AstList*)ast_getattr(aggregate, "expr_list");
+  struct AstListLink* link = expr_list ? ast_list_first_link(expr_list) : 0;
+  int j = 0;
+  while (link) {
+    struct Ast* elem = link->ast;
+    if (elem->kind == Ast_KvPair) {
+      struct Ast* kv_name = (struct Ast*)ast_getattr(elem, "name");
+      if (cstr_match((char*)ast_getattr(kv_name, "name"), name)) {
+        return (struct Ast*)ast_getattr(elem, "expr");
+      }
+    } else if (j == i) {
+      return elem;
+    }
+    j += 1;
+    link = link->next;
+  }
+  return 0;
+}
+
+internal struct Ast*
+aggregate_of(struct Ast* expr)
+{
+  if (expr->kind == Ast_ExpressionListExpr) {
+    return expr;
+  } else if (expr->kind == Ast_Name) {
+    struct Ast* decl = decl_of_node(expr);
+    if (decl && decl->kind == Ast_ConstDecl) {
+      return aggregate_of((struct Ast*)ast_getattr(decl, "expr"));
+    }
+  } else if (expr->kind == Ast_MemberSelectExpr) {
+    struct Ast* operand = (struct Ast*)ast_getattr(expr, "expr");
+    struct Ast* member_name = (struct Ast*)ast_getattr(expr, "member_name");
+    struct Ast* field = field_of(aggregate_of(operand), type_of_node(operand),
+                                 (char*)ast_getattr(member_name, "name"));
+    return field ? aggregate_of(field) : 0;
+  }
+  return 0;
+}
+
+internal struct BitInt*
+eval_member_select(struct Ast* expr)
+{
+  struct Ast* operand = (struct Ast*)ast_getattr(expr, "expr");
+  struct Ast* member_name = (struct Ast*)ast_getattr(expr, "member_name");
+  struct Ast* decl = decl_of_node(member_name);
+  if (decl && decl->kind == Ast_SpecdId) {
+    return eval_declared_value(decl);
+  }
+  struct Ast* field = field_of(aggregate_of(operand), type_of_node(operand), (char*)ast_getattr(member_name, "name"));
+  return field ? const_value_of(field) : 0;
+}
+
+/* Bit slice `e[h:l]` of a constant; the type checker has set the width of the result. */
+internal struct BitInt*
+eval_slice(struct Ast* expr)
+{
+  struct Ast* index_expr = (struct Ast*)ast_getattr(expr, "index_expr");
+  struct Ast* colon_index = (struct Ast*)ast_getattr(index_expr, "colon_index");
+  struct BitInt* value = colon_index ? const_value_of((struct Ast*)ast_getattr(expr, "expr")) : 0;
+  struct BitInt* low = value ? const_value_of(colon_index) : 0;
+  int64_t shift = 0;
+  if (!low || !bitint_to_int64(low, &shift) || shift < 0 || (value->is_sized && shift > value->width)) {
+    return 0;
+  }
+  if (value->is_signed) {
+    value = bitint_cast(value, value->is_sized ? value->width : BITINT_MAX_WIDTH, false, true);
+  }
+  return bitint_shr(value, shift);
+}
+
+internal struct BitInt*
+eval_expression(struct Ast* expr)
+{
+  struct BitInt* value = 0;
+  if (expr->kind == Ast_Int) {
+    char* digits = (char*)ast_getattr(expr, "digits");
+    int* base = (int*)ast_getattr(expr, "base");
+    if (digits && base) {
+      value = bitint_parse(digits, *base);
+    } else {
+      value = bitint_from_int64(*(int64_t*)ast_getattr(expr, "value"));
+    }
+  } else if (expr->kind == Ast_Bool) {
+    value = bool_value(*(int*)ast_getattr(expr, "value"));
+  } else if (expr->kind == Ast_Name) {
+    value = eval_declared_value(decl_of_node(expr));
+  } else if (expr->kind == Ast_MemberSelectExpr) {
+    value = eval_member_select(expr);
+  } else if (expr->kind == Ast_CastExpr) {
+    value = const_value_of((struct Ast*)ast_getattr(expr, "expr"));
+  } else if (expr->kind == Ast_UnaryExpr) {
+    value = eval_unary_expression(expr);
+  } else if (expr->kind == Ast_BinaryExpr) {
+    value = eval_binary_expression(expr);
+  } else if (expr->kind == Ast_IndexedArrayExpr) {
+    value = eval_slice(expr);
+  }
+  return convert(value, type_of_node(expr));
+}
+
+/* Value of `expr` if it is a compile-time constant of integer or `bool` type, else 0. */
+struct BitInt*
+const_value_of(struct Ast* expr)
+{
+  if (!expr || expr->id <= 0 || expr->id >= node_value_count) {
+    return 0;
+  }
+  if (!node_evaluated[expr->id]) {
+    int width;
+    bool is_signed, is_sized;
+    if (value_shape(type_of_node(expr), &width, &is_signed, &is_sized)) {
+      node_values[expr->id] = eval_expression(expr);
+    }
+    node_evaluated[expr->id] = true;
+  }
+  return node_values[expr->id];
+}
+
+/* Value of `expr` converted to `type`, as when it is assigned or is the operand of a binary operator. */
+struct BitInt*
+const_value_as(struct Ast* expr, struct Type* type)
+{
+  return convert(const_value_of(expr), type);
+}
+
+internal int
+fold_constants(struct Ast* ast)
+{
+  int count = 0;
+  if (ast->kind == Ast_Int || ast->kind == Ast_Bool || ast->kind == Ast_Name || ast->kind == Ast_MemberSelectExpr
+      || ast->kind == Ast_CastExpr || ast->kind == Ast_UnaryExpr || ast->kind == Ast_BinaryExpr
+      || ast->kind == Ast_IndexedArrayExpr) {
+    count += const_value_of(ast) ? 1 : 0;
+  }
+  struct AstAttributeIterator attr_iter = {};
+  struct AstAttribute* attr;
+  for (attr = ast_attriter_init(&attr_iter, ast); attr; attr = ast_attriter_get_next(&attr_iter)) {
+    if (attr->type == AstAttr_Ast && attr->value) {
+      count += fold_constants(attr->value);
+    } else if (attr->type == AstAttr_AstList && attr->value) {
+      struct AstListLink* link = ast_list_first_link(attr->value);
+      while (link) {
+        count += fold_constants(link->ast);
+        link = link->next;
+      }
+    }
+  }
+  return count;
+}
+
+/* Evaluates every constant expression of the program; returns how many there are. */
+int
+const_eval_program(struct Ast* p4program)
+{
+  assert(p4program->kind == Ast_P4Program);
+  return fold_constants(p4program);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "arena.h"
+#include "ast.h"
+#include "bitint.h"
+#include "types.h"
+
+
+void const_eval_init(int ast_node_count, struct Arena* const_storage_);
+struct BitInt* const_value_of(struct Ast* expr);
+struct BitInt* const_value_as(struct Ast* expr, struct Type* type);
+int const_eval_program(struct Ast* p4program);
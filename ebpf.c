@@ -0,0 +1,1853 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "type_check.h"
+#include "const_eval.h"
+#include "ebpf.h"
+#include <memory.h>  // memset
+
+
+internal struct Arena* ebpf_storage;
+internal struct EbpfProgram* ebpf_program;
+internal enum EbpfTableKind ebpf_ternary_kind;  /* EbpfTable_Map: chosen from each table's size */
+
+#define EBPF_DEFAULT_TABLE_SIZE  1024
+#define EBPF_DENSE_KEY_WIDTH     8     /* exact keys this narrow always index an array */
+#define EBPF_DENSE_MAX_WIDTH     16    /* ... and up to this wide, if the declared size covers every key */
+#define EBPF_SCAN_TABLE_SIZE     64    /* entries of a ternary table without a declared size */
+#define EBPF_SCAN_MAX_SIZE       1024
+#define EBPF_TUPLE_MIN_SIZE      256   /* ternary tables declared larger are searched by mask, not scanned */
+#define EBPF_INLINE_MAX_ENTRIES  256   /* const entries compiled into compares rather than kept in a map */
+#define EBPF_SELECT_TREE_MIN     64    /* case values from which a select becomes a binary search */
+#define EBPF_SELECT_MAP_MIN      32    /* ... or an array map, if the values are dense enough */
+#define EBPF_SELECT_MAP_RANGE    4096
+#define EBPF_INSN_COST           3     /* BPF instructions per IR instruction, roughly */
+#define EBPF_FIELD_COST          8     /* ... per header field extracted or emitted */
+#define EBPF_WALK_FACTOR         16    /* instructions the verifier walks per instruction of a stage, at worst */
+#define EBPF_STACK_UNROLL_MAX    4     /* stacks this deep are reached by compares of the index ... */
+#define EBPF_STACK_UNROLL_FIELDS 32    /* ... if their elements have this many fields in all */
+#define EBPF_STACK_INDEX_COST    6     /* instructions that compute the address of an element */
+
+
+int
+ebpf_list_count(struct AstList* list)
+{
+  return list ? list->link_count : 0;
+}
+
+/* Position of `ast` in `list`, or -1. */
+int
+ebpf_list_index(struct AstList* list, struct Ast* ast)
+{
+  int i = 0;
+  struct AstListLink* link = list ? ast_list_first_link(list) : 0;
+  while (link) {
+    if (link->ast == ast) {
+      return i;
+    }
+    i += 1;
+    link = link->next;
+  }
+  return -1;
+}
+
+char*
+ebpf_decl_name(struct Ast* decl)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  return name ? (char*)ast_getattr(name, "name") : 0;
+}
+
+internal int
+align_to(int offset, int alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+internal char*
+qualified_name(char* prefix, char* name)
+{
+  int len = cstr_len(prefix);
+  char* qualified = arena_push(ebpf_storage, len + cstr_len(name) + 2);
+  cstr_copy(qualified, prefix);
+  qualified[len] = '_';
+  cstr_copy(qualified + len + 1, name);
+  qualified[len + 1 + cstr_len(name)] = '\0';
+  return qualified;
+}
+
+char*
+ebpf_map_type_to_string(enum EbpfMapType type)
+{
+  switch (type) {
+    case EbpfMap_Hash:
+      return "BPF_MAP_TYPE_HASH";
+    case EbpfMap_Array:
+      return "BPF_MAP_TYPE_ARRAY";
+    case EbpfMap_ProgArray:
+      return "BPF_MAP_TYPE_PROG_ARRAY";
+    case EbpfMap_PercpuHash:
+      return "BPF_MAP_TYPE_PERCPU_HASH";
+    case EbpfMap_PercpuArray:
+      return "BPF_MAP_TYPE_PERCPU_ARRAY";
+    case EbpfMap_LpmTrie:
+      return "BPF_MAP_TYPE_LPM_TRIE";
+  }
+  assert(0);
+  return 0;
+}
+
+/* A nominal type stands for its representation; a generic one for its declaration. */
+struct Type*
+ebpf_resolve_type(struct Type* type)
+{
+  while (type) {
+    if ((type->kind == Type_NewType || type->kind == Type_Enum) && type->base) {
+      type = type->base;
+    } else if (type->kind == Type_Specialized) {
+      type = type_generic_base(type);
+    } else {
+      break;
+    }
+  }
+  return type;
+}
+
+/* Values that live in memory rather than in registers. */
+bool
+ebpf_is_aggregate(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  return type && (type->kind == Type_Struct || type->kind == Type_Header || type->kind == Type_HeaderUnion
+                  || type->kind == Type_HeaderStack);
+}
+
+/* Width in bits of a value that fits a register, or -1. */
+int
+ebpf_scalar_width(struct Type* type)
+{
+  if (type->kind == Type_Bool) {
+    return 1;
+  } else if (type->kind == Type_Bit || type->kind == Type_SignedInt) {
+    return type->width;
+  } else if (type->kind == Type_Enum || type->kind == Type_NewType) {
+    return type->base ? ebpf_scalar_width(type->base) : 32;
+  } else if (type->kind == Type_Error || type->kind == Type_MatchKind) {
+    return 32;
+  }
+  return -1;
+}
+
+/* Bytes of the smallest C integer type that holds the value, or 0 if none does. */
+int
+ebpf_scalar_size(struct Type* type)
+{
+  int width = ebpf_scalar_width(type);
+  if (width < 0 || width > 64) {
+    return 0;
+  } else if (width > 32) {
+    return 8;
+  } else if (width > 16) {
+    return 4;
+  } else if (width > 8) {
+    return 2;
+  }
+  return 1;
+}
+
+/* Width in bits of a scalar as the backends compute it: an `int` is 64. */
+int
+ebpf_scalar_bits(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  return type->kind == Type_Int ? 64 : ebpf_scalar_width(type);
+}
+
+bool
+ebpf_is_signed(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  return type && (type->kind == Type_SignedInt || type->kind == Type_Int);
+}
+
+/* Instances that are not values: externs, and the parsers and controls a package takes. */
+bool
+ebpf_is_extern_object(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  return !type || type->kind == Type_Extern || type->kind == Type_Parser || type->kind == Type_Control
+         || type->kind == Type_Package;
+}
+
+uint64_t
+ebpf_width_mask(int width)
+{
+  return width >= 64 ? ~0ull : (1ull << width) - 1;
+}
+
+/* Bit offset of a field in the wire format of a header. */
+int
+ebpf_field_offset(struct Type* header, int member)
+{
+  int offset = 0;
+  int i;
+  for (i = 0; i < member; i++) {
+    offset += ebpf_scalar_width(header->members[i].type);
+  }
+  return offset;
+}
+
+int
+ebpf_header_size(struct Type* header)
+{
+  assert(header->kind == Type_Header);
+  int bits = 0;
+  int i;
+  for (i = 0; i < header->member_count; i++) {
+    struct TypeMember* member = &header->members[i];
+    int width = ebpf_scalar_width(member->type);
+    if (width < 0 || width > 64) {
+      error("at line %d: field `%s` of header `%s` must be at most 64 bits wide for the eBPF target.",
+            member->decl ? member->decl->line_nr : 0, member->name, header->name);
+    }
+    bits += width;
+  }
+  if (bits % 8 != 0) {
+    error("at line %d: header `%s` is %d bits long, not a whole number of bytes.",
+          header->decl ? header->decl->line_nr : 0, header->name, bits);
+  }
+  return bits / 8;
+}
+
+/* Lays out `field` after `*size` bytes, with natural alignment. */
+internal void
+layout_field(struct EbpfField* field, int* size, int* alignment)
+{
+  field->size = ebpf_scalar_size(field->type);
+  if (field->size == 0) {
+    error("the eBPF target does not support `%s` in a table key or action parameter.", type_to_string(field->type));
+  }
+  field->offset = align_to(*size, field->size);
+  *size = field->offset + field->size;
+  if (field->size > *alignment) {
+    *alignment = field->size;
+  }
+}
+
+internal int64_t
+constant_argument(struct AstList* args, int i, int line_nr)
+{
+  struct AstListLink* link = args ? ast_list_first_link(args) : 0;
+  while (link && i > 0) {
+    link = link->next;
+    i -= 1;
+  }
+  struct Ast* arg = link ? link->ast : 0;
+  if (arg && arg->kind == Ast_Argument) {
+    arg = (struct Ast*)ast_getattr(arg, "init_expr");
+  }
+  struct BitInt* value = arg ? const_value_of(arg) : 0;
+  int64_t result = 0;
+  if (!value || !bitint_to_int64(value, &result)) {
+    error("at line %d: a compile-time constant argument was expected.", line_nr);
+  }
+  return result;
+}
+
+internal struct Ast*
+argument_expr(struct Ast* arg)
+{
+  return arg->kind == Ast_Argument ? (struct Ast*)ast_getattr(arg, "init_expr") : arg;
+}
+
+internal int
+action_index(struct EbpfTable* table, struct Ast* name)
+{
+  struct Ast* decl = decl_of_node(name);
+  int i;
+  for (i = 0; i < table->action_count; i++) {
+    if (table->actions[i].decl == decl || cstr_match(table->actions[i].name, (char*)ast_getattr(name, "name"))) {
+      return i;
+    }
+  }
+  error("at line %d: `%s` is not an action of table `%s`.", name->line_nr, (char*)ast_getattr(name, "name"),
+        ebpf_decl_name(table->decl));
+  return -1;
+}
+
+/* Values of the parameters of `action` that the control plane supplies, from `args` of a call. */
+internal struct BitInt**
+action_data(struct EbpfAction* action, struct AstList* args, int line_nr)
+{
+  struct BitInt** values = arena_push(ebpf_storage, (action->param_count + 1) * sizeof(struct BitInt*));
+  memset(values, 0, (action->param_count + 1) * sizeof(struct BitInt*));
+  if (ebpf_list_count(args) != action->bound_count + action->param_count) {
+    error("at line %d: action `%s` expects %d arguments.", line_nr, action->name,
+          action->bound_count + action->param_count);
+  }
+  int i = 0;
+  struct AstListLink* link = args ? ast_list_first_link(args) : 0;
+  while (link) {
+    if (i >= action->bound_count) {
+      struct EbpfField* param = &action->params[i - action->bound_count];
+      values[i - action->bound_count] = const_value_as(argument_expr(link->ast), param->type);
+      if (!values[i - action->bound_count]) {
+        error("at line %d: argument `%s` of action `%s` must be a compile-time constant.", line_nr, param->name,
+              action->name);
+      }
+    }
+    i += 1;
+    link = link->next;
+  }
+  return values;
+}
+
+internal void
+analyze_keys(struct EbpfTable* table)
+{
+  struct Ast* key = ir_table_property(table->decl, Ast_TableProp_Key, 0);
+  struct AstList* keyelem_list = key ? (struct AstList*)ast_getattr(key, "keyelem_list") : 0;
+  table->key_count = ebpf_list_count(keyelem_list);
+  table->keys = arena_push(ebpf_storage, (table->key_count + 1) * sizeof(struct EbpfField));
+  memset(table->keys, 0, (table->key_count + 1) * sizeof(struct EbpfField));
+  bool has_ternary = false;
+  int i = 0;
+  struct AstListLink* link = keyelem_list ? ast_list_first_link(keyelem_list) : 0;
+  while (link) {
+    has_ternary |= cstr_match(ebpf_decl_name(link->ast), "ternary");
+    link = link->next;
+  }
+  link = keyelem_list ? ast_list_first_link(keyelem_list) : 0;
+  while (link) {
+    struct Ast* expr = (struct Ast*)ast_getattr(link->ast, "expr");
+    struct EbpfField* field = &table->keys[i];
+    field->name = expr->kind == Ast_MemberSelectExpr ?
+      (char*)ast_getattr((struct Ast*)ast_getattr(expr, "member_name"), "name") : "key";
+    field->type = type_of_node(expr);
+    field->width = ebpf_scalar_width(field->type);
+    char* match_kind = ebpf_decl_name(link->ast);
+    if (cstr_match(match_kind, "exact")) {
+      field->match_kind = EbpfMatch_Exact;
+    } else if (cstr_match(match_kind, "lpm")) {
+      field->match_kind = EbpfMatch_Lpm;
+      if (has_ternary) {
+        /* Scanned like a ternary key, its mask being the prefix. */
+      } else if (link->next) {
+        error("at line %d: the `lpm` key of table `%s` must be the last one.", expr->line_nr, table->name);
+      } else {
+        table->is_lpm = true;
+      }
+    } else if (cstr_match(match_kind, "ternary")) {
+      field->match_kind = EbpfMatch_Ternary;
+    } else {
+      error("at line %d: `%s` match is not supported by the eBPF target.", expr->line_nr, match_kind);
+    }
+    i += 1;
+    link = link->next;
+  }
+  int size = 0, alignment = 1;
+  if (table->is_lpm) {
+    /* struct bpf_lpm_trie_key: the prefix length, then the data compared from its first byte. */
+    size = 4;
+    alignment = 4;
+    for (i = 0; i < table->key_count; i++) {
+      struct EbpfField* field = &table->keys[i];
+      if (field->width % 8 != 0) {
+        error("at line %d: key `%s` of LPM table `%s` must be a whole number of bytes.",
+              table->decl->line_nr, field->name, table->name);
+      }
+      field->offset = size;
+      field->size = field->width / 8;
+      size += field->size;
+    }
+  } else {
+    for (i = 0; i < table->key_count; i++) {
+      layout_field(&table->keys[i], &size, &alignment);
+    }
+  }
+  table->key_size = align_to(size, alignment);
+}
+
+internal int
+key_alignment(struct EbpfTable* table)
+{
+  int alignment = table->is_lpm ? 4 : 1;
+  int i;
+  for (i = 0; i < table->key_count; i++) {
+    if (!table->is_lpm && table->keys[i].size > alignment) {
+      alignment = table->keys[i].size;
+    }
+  }
+  return alignment;
+}
+
+internal bool
+has_match_kind(struct EbpfTable* table, enum EbpfMatchKind match_kind)
+{
+  int i;
+  for (i = 0; i < table->key_count; i++) {
+    if (table->keys[i].match_kind == match_kind) {
+      return true;
+    }
+  }
+  return false;
+}
+
+internal void
+analyze_actions(struct EbpfTable* table)
+{
+  struct Ast* actions = ir_table_property(table->decl, Ast_TableProp_Actions, 0);
+  struct AstList* action_list = actions ? (struct AstList*)ast_getattr(actions, "action_list") : 0;
+  table->action_count = ebpf_list_count(action_list);
+  table->actions = arena_push(ebpf_storage, (table->action_count + 1) * sizeof(struct EbpfAction));
+  memset(table->actions, 0, (table->action_count + 1) * sizeof(struct EbpfAction));
+  int max_size = 0, max_alignment = 4;
+  int i = 0;
+  struct AstListLink* link = action_list ? ast_list_first_link(action_list) : 0;
+  while (link) {
+    struct Ast* name = (struct Ast*)ast_getattr(link->ast, "name");
+    struct EbpfAction* action = &table->actions[i];
+    action->decl = decl_of_node(name);
+    action->name = (char*)ast_getattr(name, "name");
+    action->function = ir_function_of(ebpf_program->ir, action->decl);
+    action->bound_count = ebpf_list_count((struct AstList*)ast_getattr(link->ast, "args"));
+    struct AstList* params = action->decl ? (struct AstList*)ast_getattr(action->decl, "params") : 0;
+    action->param_count = ebpf_list_count(params) - action->bound_count;
+    action->params = arena_push(ebpf_storage, (action->param_count + 1) * sizeof(struct EbpfField));
+    memset(action->params, 0, (action->param_count + 1) * sizeof(struct EbpfField));
+    int size = 0, alignment = 1;
+    int j = 0;
+    struct AstListLink* param_link = params ? ast_list_first_link(params) : 0;
+    while (param_link) {
+      if (j >= action->bound_count) {
+        struct EbpfField* param = &action->params[j - action->bound_count];
+        param->name = ebpf_decl_name(param_link->ast);
+        param->type = type_of_node(param_link->ast);
+        param->width = ebpf_scalar_width(param->type);
+        layout_field(param, &size, &alignment);
+      }
+      j += 1;
+      param_link = param_link->next;
+    }
+    action->size = align_to(size, alignment);
+    if (action->size > max_size) {
+      max_size = action->size;
+    }
+    if (alignment > max_alignment) {
+      max_alignment = alignment;
+    }
+    i += 1;
+    link = link->next;
+  }
+  /* struct { u32 action; [u32 valid; | u32 priority;] union { struct { params } action_name; ... } u; } */
+  if (table->kind == EbpfTable_Dense || table->kind == EbpfTable_Scan) {
+    table->valid_offset = 4;
+  } else if (table->kind == EbpfTable_Tuple) {
+    table->priority_offset = 4;
+  }
+  table->action_offset = align_to(table->valid_offset || table->priority_offset ? 8 : 4, max_alignment);
+  table->value_size = align_to(table->action_offset + max_size, max_alignment);
+  if (table->kind == EbpfTable_Scan) {
+    /* struct { value; key; mask; } */
+    int alignment = key_alignment(table);
+    table->entry_key_offset = align_to(table->value_size, alignment);
+    table->map.value_size = align_to(table->entry_key_offset + 2 * table->key_size,
+                                     alignment > max_alignment ? alignment : max_alignment);
+  } else if (table->map.type) {
+    table->map.value_size = table->value_size;
+  }
+}
+
+internal void
+analyze_default_action(struct EbpfTable* table)
+{
+  table->default_action = -1;
+  struct Ast* prop = ir_table_property(table->decl, Ast_TableProp_SingleEntry, "default_action");
+  if (prop) {
+    struct Ast* init_expr = (struct Ast*)ast_getattr(prop, "init_expr");
+    struct Ast* name = init_expr;
+    struct AstList* args = 0;
+    if (init_expr->kind == Ast_FunctionCallExpr) {
+      name = (struct Ast*)ast_getattr(init_expr, "expr");
+      args = (struct AstList*)ast_getattr(init_expr, "args");
+    }
+    if (name->kind != Ast_Name) {
+      error("at line %d: `default_action` must name an action.", init_expr->line_nr);
+    }
+    table->default_action = action_index(table, name);
+    struct EbpfAction* action = &table->actions[table->default_action];
+    if (args || action->param_count + action->bound_count > 0) {
+      table->default_args = action_data(action, args, init_expr->line_nr);
+    }
+    table->is_default_const = *(bool*)ast_getattr(prop, "is_const");
+  } else {
+    int i;
+    for (i = 0; i < table->action_count; i++) {
+      if (cstr_match(table->actions[i].name, "NoAction")) {
+        table->default_action = i;
+      }
+    }
+  }
+  if (!table->is_default_const && table->action_count > 0) {
+    table->default_map.name = qualified_name(table->name, "defaultAction");
+    table->default_map.type = EbpfMap_Array;
+    table->default_map.key_size = 4;
+    table->default_map.value_size = table->value_size;
+    table->default_map.max_entries = 1;
+  }
+}
+
+internal void
+analyze_entries(struct EbpfTable* table)
+{
+  struct Ast* prop = ir_table_property(table->decl, Ast_TableProp_Entries, 0);
+  struct AstList* entries = prop ? (struct AstList*)ast_getattr(prop, "entries") : 0;
+  table->entry_count = ebpf_list_count(entries);
+  table->entries = arena_push(ebpf_storage, (table->entry_count + 1) * sizeof(struct EbpfTableEntry));
+  memset(table->entries, 0, (table->entry_count + 1) * sizeof(struct EbpfTableEntry));
+  int i = 0;
+  struct AstListLink* link = entries ? ast_list_first_link(entries) : 0;
+  while (link) {
+    struct EbpfTableEntry* entry = &table->entries[i];
+    struct Ast* keyset = (struct Ast*)ast_getattr(link->ast, "keyset");
+    entry->line_nr = keyset->line_nr;
+    entry->keys = arena_push(ebpf_storage, (table->key_count + 1) * sizeof(struct BitInt*));
+    entry->masks = arena_push(ebpf_storage, (table->key_count + 1) * sizeof(struct BitInt*));
+    memset(entry->masks, 0, (table->key_count + 1) * sizeof(struct BitInt*));
+    struct AstList* elems = keyset->kind == Ast_TupleKeyset ? (struct AstList*)ast_getattr(keyset, "expr_list") : 0;
+    if (elems ? ebpf_list_count(elems) != table->key_count : table->key_count != 1) {
+      error("at line %d: entry of table `%s` must have %d keys.", entry->line_nr, table->name, table->key_count);
+    }
+    int k;
+    struct AstListLink* elem_link = elems ? ast_list_first_link(elems) : 0;
+    for (k = 0; k < table->key_count; k++) {
+      struct Ast* elem = elems ? elem_link->ast : keyset;
+      struct EbpfField* key = &table->keys[k];
+      if (elem->kind == Ast_BinaryExpr && *(enum AstExprOperator*)ast_getattr(elem, "op") == AstExprOp_Mask) {
+        entry->keys[k] = const_value_as((struct Ast*)ast_getattr(elem, "left_operand"), key->type);
+        entry->masks[k] = const_value_as((struct Ast*)ast_getattr(elem, "right_operand"), key->type);
+        if (key->match_kind == EbpfMatch_Exact) {
+          error("at line %d: masked entry of exact key `%s`.", elem->line_nr, key->name);
+        }
+      } else if (elem->kind == Ast_Default || elem->kind == Ast_Dontcare) {
+        if (key->match_kind == EbpfMatch_Exact) {
+          error("at line %d: key `%s` of table `%s` cannot be a wildcard.", elem->line_nr, key->name, table->name);
+        }
+        entry->keys[k] = bitint_cast(bitint_from_int64(0), key->width, false, true);
+        entry->masks[k] = entry->keys[k];
+      } else {
+        entry->keys[k] = const_value_as(elem, key->type);
+      }
+      if (!entry->keys[k]) {
+        error("at line %d: keys of `const entries` must be compile-time constants.", elem->line_nr);
+      }
+      elem_link = elem_link ? elem_link->next : 0;
+    }
+    struct Ast* action_ref = (struct Ast*)ast_getattr(link->ast, "action");
+    entry->action = action_index(table, (struct Ast*)ast_getattr(action_ref, "name"));
+    entry->args = action_data(&table->actions[entry->action], (struct AstList*)ast_getattr(action_ref, "args"),
+                              action_ref->line_nr);
+    i += 1;
+    link = link->next;
+  }
+  if (table->entry_count > 0) {
+    ebpf_program->has_const_entries = true;
+    /* The control plane cannot add entries. */
+    if (table->map.type != EbpfMap_Array || table->kind == EbpfTable_Scan) {
+      table->map.max_entries = table->entry_count;
+    }
+  }
+}
+
+/*
+ * The map of a table follows from its keys: an LPM trie for an `lpm` key, an
+ * array scanned in order for a small `ternary` table and a tuple space for a
+ * larger one, an array indexed by the key for one narrow exact key, a hash map
+ * otherwise.  `implementation = hash_table(N)`
+ * and `size = N` only give the number of entries; `array_table(N)` asks for an
+ * array whose every index is an entry.
+ */
+internal void
+analyze_map(struct EbpfTable* table)
+{
+  table->map.name = table->name;
+  table->map.key_size = table->key_size;
+  table->map.max_entries = EBPF_DEFAULT_TABLE_SIZE;
+  bool has_size = false;
+  struct Ast* size = ir_table_property(table->decl, Ast_TableProp_SingleEntry, "size");
+  if (size) {
+    struct Ast* init_expr = (struct Ast*)ast_getattr(size, "init_expr");
+    struct BitInt* value = const_value_of(init_expr);
+    int64_t max_entries = 0;
+    if (!value || !bitint_to_int64(value, &max_entries) || max_entries <= 0) {
+      error("at line %d: `size` must be a positive compile-time constant.", init_expr->line_nr);
+    }
+    table->map.max_entries = (int)max_entries;
+    has_size = true;
+  }
+  char* strname = "";
+  struct Ast* implementation = ir_table_property(table->decl, Ast_TableProp_SingleEntry, "implementation");
+  if (implementation) {
+    struct Ast* init_expr = (struct Ast*)ast_getattr(implementation, "init_expr");
+    struct Ast* callee = init_expr->kind == Ast_FunctionCallExpr ? (struct Ast*)ast_getattr(init_expr, "expr") : 0;
+    struct AstList* args = callee ? (struct AstList*)ast_getattr(init_expr, "args") : 0;
+    strname = callee && callee->kind == Ast_Name ? (char*)ast_getattr(callee, "name") : "";
+    if (!cstr_match(strname, "hash_table") && !cstr_match(strname, "array_table")) {
+      error("at line %d: table implementation must be `hash_table` or `array_table`.", init_expr->line_nr);
+    }
+    table->map.max_entries = (int)constant_argument(args, 0, init_expr->line_nr);
+    if (table->map.max_entries <= 0) {
+      error("at line %d: table size must be positive.", init_expr->line_nr);
+    }
+    if (cstr_match(strname, "array_table")
+        && (table->key_count > 1 || (table->key_count == 1 && table->keys[0].width > 32) || table->is_lpm
+            || has_match_kind(table, EbpfMatch_Ternary))) {
+      error("at line %d: `array_table` needs a single exact key of at most 32 bits.", init_expr->line_nr);
+    }
+    has_size = true;
+  }
+  int width = table->key_count == 1 ? table->keys[0].width : 0;
+  if (table->key_count == 0) {
+    /* Every lookup misses: only the default action runs. */
+    table->reason = "no key: every lookup misses";
+  } else if (cstr_match(strname, "array_table")) {
+    table->map.type = EbpfMap_Array;
+    table->reason = "declared `array_table`: every index is an entry";
+  } else if (has_match_kind(table, EbpfMatch_Ternary)
+             && (ebpf_ternary_kind == EbpfTable_Tuple
+                 || (ebpf_ternary_kind != EbpfTable_Scan && has_size && table->map.max_entries > EBPF_TUPLE_MIN_SIZE))) {
+    table->kind = EbpfTable_Tuple;
+    table->map.type = EbpfMap_Hash;
+    /* struct { u32 tuple; keys } */
+    int size = 4, alignment = 4, k;
+    for (k = 0; k < table->key_count; k++) {
+      layout_field(&table->keys[k], &size, &alignment);
+    }
+    table->key_size = table->map.key_size = align_to(size, alignment);
+    /* struct { u32 priority; u32 count; key mask; }, two arrays of them and the one in use */
+    table->mask_map.name = qualified_name(table->name, "masks");
+    table->mask_map.type = EbpfMap_Array;
+    table->mask_map.key_size = 4;
+    table->mask_map.value_size = align_to(8 + table->key_size, alignment);
+    table->mask_map.max_entries = 2 * EBPF_TUPLE_MAX_MASKS + 1;
+    table->reason = "ternary key: a hash map of the masked keys, probed once per mask by descending priority";
+  } else if (has_match_kind(table, EbpfMatch_Ternary)) {
+    table->kind = EbpfTable_Scan;
+    table->map.type = EbpfMap_Array;
+    if (!has_size) {
+      table->map.max_entries = EBPF_SCAN_TABLE_SIZE;
+    } else if (table->map.max_entries > EBPF_SCAN_MAX_SIZE) {
+      error("at line %d: ternary table `%s` can have at most %d entries.", table->decl->line_nr, table->name,
+            EBPF_SCAN_MAX_SIZE);
+    }
+    table->map.key_size = 4;
+    table->reason = "ternary key: an array of key, mask and value entries, scanned in order";
+  } else if (table->is_lpm) {
+    table->map.type = EbpfMap_LpmTrie;
+    table->map.flags = EBPF_F_NO_PREALLOC;
+    table->reason = "lpm key: a longest-prefix-match trie";
+  } else if (table->key_count == 1
+             && (width <= EBPF_DENSE_KEY_WIDTH
+                 || (width <= EBPF_DENSE_MAX_WIDTH && has_size && table->map.max_entries >= (1 << width)))) {
+    table->kind = EbpfTable_Dense;
+    table->map.type = EbpfMap_Array;
+    table->map.max_entries = 1 << width;
+    table->keys[0].size = 4;
+    table->key_size = table->map.key_size = 4;
+    table->reason = "one narrow exact key: an array indexed by the key, no hashing";
+  } else {
+    table->map.type = EbpfMap_Hash;
+    table->reason = "exact keys: a hash map";
+  }
+  if (table->map.type == EbpfMap_Array && table->kind == EbpfTable_Map && table->key_count == 1) {
+    table->keys[0].size = 4;
+    table->key_size = table->map.key_size = 4;
+  }
+}
+
+/* Bits of the key that `entry` matches: the leading ones of each mask, for ordering LPM entries. */
+int
+ebpf_prefix_length(struct EbpfTable* table, struct EbpfTableEntry* entry)
+{
+  int length = 0, k;
+  for (k = 0; k < table->key_count; k++) {
+    int bits = table->keys[k].width;
+    if (entry->masks[k]) {
+      uint64_t mask = entry->masks[k]->word_count > 0 ? entry->masks[k]->words[0] : 0;
+      bits = 0;
+      while (bits < table->keys[k].width && (mask >> (table->keys[k].width - 1 - bits)) & 1) {
+        bits += 1;
+      }
+    }
+    length += bits;
+  }
+  return length;
+}
+
+/* Bits of the whole key: the prefix length of an exact LPM lookup. */
+int
+ebpf_full_prefix_length(struct EbpfTable* table)
+{
+  int length = 0;
+  int k;
+  for (k = 0; k < table->key_count; k++) {
+    length += table->keys[k].width;
+  }
+  return length;
+}
+
+internal struct EbpfTable* sorted_table;
+
+internal uint64_t
+entry_key(struct EbpfTableEntry* entry)
+{
+  return entry->keys[0]->word_count > 0 ? entry->keys[0]->words[0] : 0;
+}
+
+/* By key, then by position; by descending prefix length, then by position. */
+internal int
+compare_entries(const void* a, const void* b)
+{
+  struct EbpfTableEntry* x = &sorted_table->entries[*(int*)a];
+  struct EbpfTableEntry* y = &sorted_table->entries[*(int*)b];
+  if (!sorted_table->is_lpm && entry_key(x) != entry_key(y)) {
+    return entry_key(x) < entry_key(y) ? -1 : 1;
+  }
+  if (sorted_table->is_lpm && ebpf_prefix_length(sorted_table, x) != ebpf_prefix_length(sorted_table, y)) {
+    return ebpf_prefix_length(sorted_table, y) - ebpf_prefix_length(sorted_table, x);
+  }
+  return *(int*)a - *(int*)b;
+}
+
+/*
+ * Const entries cannot change: up to EBPF_INLINE_MAX_ENTRIES of them become
+ * compares at each apply, which need neither a helper call nor a map.  One
+ * unsigned exact key is found by a binary search; LPM entries are tried
+ * longest prefix first, ternary ones in the order they are written.  Tables
+ * with a ternary key are inlined however many entries they have, or never,
+ * when --ternary asks for one kind.
+ */
+internal void
+analyze_inline(struct EbpfTable* table)
+{
+  int i;
+  if (table->entry_count == 0 || (table->kind == EbpfTable_Map && table->map.type == EbpfMap_Array)) {
+    return;
+  }
+  if (has_match_kind(table, EbpfMatch_Ternary) && ebpf_ternary_kind != EbpfTable_Map) {
+    if (ebpf_ternary_kind != EbpfTable_Inline) {
+      return;
+    }
+  } else if (table->entry_count > EBPF_INLINE_MAX_ENTRIES) {
+    return;
+  }
+  table->kind = EbpfTable_Inline;
+  table->map.type = 0;
+  table->entry_order = arena_push(ebpf_storage, (table->entry_count + 1) * sizeof(int));
+  for (i = 0; i < table->entry_count; i++) {
+    table->entry_order[i] = i;
+  }
+  struct Type* type = table->key_count == 1 ? ebpf_resolve_type(table->keys[0].type) : 0;
+  if (type && type->kind == Type_Bit && table->keys[0].match_kind == EbpfMatch_Exact && table->keys[0].width <= 64) {
+    sorted_table = table;
+    qsort(table->entry_order, table->entry_count, sizeof(int), compare_entries);
+    /* The first entry with a key wins. */
+    for (i = 0; i < table->entry_count; i++) {
+      if (table->search_count == 0 || entry_key(&table->entries[table->entry_order[i]])
+          != entry_key(&table->entries[table->entry_order[table->search_count - 1]])) {
+        table->entry_order[table->search_count++] = table->entry_order[i];
+      }
+    }
+    table->reason = "const entries of one exact key: a binary search over them, no map";
+  } else if (table->is_lpm) {
+    sorted_table = table;
+    qsort(table->entry_order, table->entry_count, sizeof(int), compare_entries);
+    table->reason = "const lpm entries: compared longest prefix first, no map";
+  } else {
+    table->reason = "const entries: compared in order, no map";
+  }
+}
+
+/* The mask of key `k` of `entry`, all ones where the key is matched exactly. */
+internal struct BitInt*
+entry_mask(struct EbpfTable* table, struct EbpfTableEntry* entry, int k)
+{
+  if (entry->masks[k]) {
+    return entry->masks[k];
+  }
+  return bitint_cast(bitint_from_int64(-1), table->keys[k].width, false, true);
+}
+
+/*
+ * The masks of the const entries of a tuple space table, in the order of their
+ * first entry: the earlier an entry, the higher its priority.
+ */
+internal void
+analyze_masks(struct EbpfTable* table)
+{
+  int* mask_entries = arena_push(ebpf_storage, (table->entry_count + 1) * sizeof(int));
+  int e, j, k;
+  table->entry_masks = arena_push(ebpf_storage, (table->entry_count + 1) * sizeof(int));
+  for (e = 0; e < table->entry_count; e++) {
+    for (j = 0; j < table->mask_count; j++) {
+      bool same_mask = true;
+      for (k = 0; k < table->key_count; k++) {
+        same_mask &= bitint_compare(entry_mask(table, &table->entries[e], k),
+                                    entry_mask(table, &table->entries[mask_entries[j]], k)) == 0;
+      }
+      if (same_mask) {
+        break;
+      }
+    }
+    if (j == table->mask_count) {
+      mask_entries[table->mask_count++] = e;
+    }
+    table->entry_masks[e] = j;
+  }
+  if (table->mask_count > EBPF_TUPLE_MAX_MASKS) {
+    error("at line %d: the entries of ternary table `%s` have more than %d masks.", table->decl->line_nr,
+          table->name, EBPF_TUPLE_MAX_MASKS);
+  }
+}
+
+internal void
+analyze_table(struct IrFunction* control, struct Ast* decl)
+{
+  struct EbpfTable table;
+  memset(&table, 0, sizeof(table));
+  table.decl = decl;
+  table.name = qualified_name(control->name, ebpf_decl_name(decl));
+  table.control = control;
+  analyze_keys(&table);
+  analyze_map(&table);
+  analyze_actions(&table);
+  analyze_default_action(&table);
+  analyze_entries(&table);
+  analyze_inline(&table);
+  if (table.kind == EbpfTable_Tuple) {
+    analyze_masks(&table);
+  }
+  array_append(&ebpf_program->tables, &table);
+}
+
+internal char*
+type_ref_name(struct Ast* type_ref)
+{
+  if (type_ref->kind == Ast_Name) {
+    return (char*)ast_getattr(type_ref, "name");
+  } else if (type_ref->kind == Ast_SpecdType) {
+    return ebpf_decl_name(type_ref);
+  }
+  return "";
+}
+
+/* Register<T, S>(size): an element of T per index, read as 0 and not written past the size. */
+internal void
+analyze_register(struct IrFunction* control, struct Ast* decl, struct AstList* args)
+{
+  struct Type* type = type_of_node(decl);
+  struct EbpfRegister reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.decl = decl;
+  reg.name = qualified_name(control->name, ebpf_decl_name(decl));
+  if (!type || type->kind != Type_Specialized || type->arg_count != 2) {
+    error("at line %d: register `%s` must be a Register<T, S>.", decl->line_nr, reg.name);
+  }
+  reg.type = ebpf_resolve_type(type->args[0]);
+  struct Type* index_type = ebpf_resolve_type(type->args[1]);
+  if (ebpf_scalar_width(reg.type) <= 0 || ebpf_scalar_width(reg.type) > 64) {
+    error("at line %d: register `%s` must hold bit<W>, int<W> or bool values.", decl->line_nr, reg.name);
+  }
+  if (ebpf_scalar_width(index_type) <= 0 || ebpf_scalar_width(index_type) > 32) {
+    error("at line %d: register `%s` must be indexed by at most 32 bits.", decl->line_nr, reg.name);
+  }
+  reg.map.name = reg.name;
+  reg.map.type = EbpfMap_Array;
+  reg.map.key_size = 4;
+  reg.map.value_size = ebpf_scalar_size(reg.type);
+  reg.map.max_entries = (int)constant_argument(args, 0, decl->line_nr);
+  if (reg.map.max_entries <= 0) {
+    error("at line %d: register `%s` must have a positive size.", decl->line_nr, reg.name);
+  }
+  array_append(&ebpf_program->registers, &reg);
+}
+
+internal void
+analyze_instance(struct IrFunction* control, struct Ast* decl)
+{
+  if (decl->kind != Ast_Instantiation) {
+    return;
+  }
+  struct Ast* type_ref = (struct Ast*)ast_getattr(decl, "type_ref");
+  struct AstList* args = (struct AstList*)ast_getattr(decl, "args");
+  if (cstr_match(type_ref_name(type_ref), "Register")) {
+    analyze_register(control, decl, args);
+    return;
+  } else if (!cstr_match(type_ref_name(type_ref), "CounterArray")) {
+    return;
+  }
+  struct EbpfCounter counter;
+  memset(&counter, 0, sizeof(counter));
+  counter.decl = decl;
+  counter.name = qualified_name(control->name, ebpf_decl_name(decl));
+  counter.map.name = counter.name;
+  counter.map.type = constant_argument(args, 1, decl->line_nr) ? EbpfMap_Hash : EbpfMap_Array;
+  counter.map.key_size = 4;
+  counter.map.value_size = 4;
+  counter.map.max_entries = (int)constant_argument(args, 0, decl->line_nr);
+  if (counter.map.max_entries <= 0) {
+    error("at line %d: counter array `%s` must have a positive size.", decl->line_nr, counter.name);
+  }
+  array_append(&ebpf_program->counters, &counter);
+}
+
+internal struct IrFunction*
+block_of_argument(struct Ast* arg, enum TypeKind kind, char* what)
+{
+  arg = argument_expr(arg);
+  struct Type* type = type_of_node(arg);
+  if (type && type->kind == Type_Specialized) {
+    type = type_generic_base(type);
+  }
+  struct IrFunction* function = (type && type->kind == kind) ? ir_function_of(ebpf_program->ir, type->decl) : 0;
+  if (!function) {
+    error("at line %d: %s was expected.", arg->line_nr, what);
+  }
+  return function;
+}
+
+struct SelectValue {
+  uint64_t value;
+  int select_case;
+};
+
+internal int
+compare_select_values(const void* a, const void* b)
+{
+  const struct SelectValue* x = a;
+  const struct SelectValue* y = b;
+  if (x->value != y->value) {
+    return x->value < y->value ? -1 : 1;
+  }
+  return x->select_case - y->select_case;
+}
+
+/*
+ * A binary search costs a compare per level where the chain of compares
+ * costs one per case; an array map lookup, which the verifier inlines for
+ * array maps, costs the same whatever the number of cases.  Short chains are
+ * still the fastest, their branches being well predicted: the thresholds
+ * come from bench/select_bench.py.
+ */
+internal void
+analyze_select(struct IrFunction* function, struct IrBlock* block, enum EbpfSelectKind select_kind)
+{
+  struct EbpfSelect empty;
+  memset(&empty, 0, sizeof(empty));
+  array_append(&ebpf_program->selects, &empty);
+  struct EbpfSelect* select = (struct EbpfSelect*)array_get(&ebpf_program->selects,
+                                                            ebpf_program->selects.elem_count - 1);
+  select->function = function;
+  select->block = block->id;
+  select->kind = EbpfSelect_Linear;
+  select->default_case = block->case_count;
+  if (block->key_count != 1) {
+    return;
+  }
+  struct Type* key_type = ebpf_resolve_type(ir_insn(function, block->keys[0])->type);
+  if (key_type->kind != Type_Bit || key_type->width > 64) {
+    return;
+  }
+  struct SelectValue* values = arena_push(ebpf_storage, (block->case_count + 1) * sizeof(struct SelectValue));
+  int count = 0, i;
+  for (i = 0; i < block->case_count; i++) {
+    struct IrKeysetElem* elem = &block->select_cases[i].elems[0];
+    if (!elem->value) {
+      select->default_case = i;
+      break;
+    }
+    if (elem->mask) {
+      return;
+    }
+    struct BitInt* value = bitint_cast(elem->value, key_type->width, false, true);
+    values[count].value = value->word_count > 0 ? value->words[0] : 0;
+    values[count].select_case = i;
+    count += 1;
+  }
+  qsort(values, count, sizeof(struct SelectValue), compare_select_values);
+  select->values = arena_push(ebpf_storage, (count + 1) * sizeof(uint64_t));
+  select->cases = arena_push(ebpf_storage, (count + 1) * sizeof(int));
+  for (i = 0; i < count; i++) {
+    /* The first case with a value wins. */
+    if (i > 0 && values[i].value == values[i - 1].value) {
+      continue;
+    }
+    /* Cases going to the same state share the first of them. */
+    int select_case = 0;
+    while (block->succs[select_case] != block->succs[values[i].select_case]) {
+      select_case += 1;
+    }
+    select->values[select->value_count] = values[i].value;
+    select->cases[select->value_count] = select_case;
+    select->value_count += 1;
+  }
+  int n = select->value_count;
+  uint64_t range = n > 0 ? select->values[n - 1] - select->values[0] : 0;
+  if (select_kind) {
+    select->kind = select_kind;
+  } else if (n >= EBPF_SELECT_MAP_MIN && range < EBPF_SELECT_MAP_RANGE && range < 8 * (uint64_t)n) {
+    select->kind = EbpfSelect_Map;
+  } else if (n >= EBPF_SELECT_TREE_MIN) {
+    select->kind = EbpfSelect_Tree;
+  }
+  if (select->kind == EbpfSelect_Map && (n == 0 || range >= EBPF_SELECT_MAP_RANGE)) {
+    select->kind = EbpfSelect_Tree;
+  }
+  if (select->kind == EbpfSelect_Map) {
+    select->base = select->values[0];
+    select->map.name = qualified_name(function->name,
+        qualified_name(block->label ? block->label : "state", "select"));
+    select->map.type = EbpfMap_Array;
+    select->map.key_size = 4;
+    select->map.value_size = 4;
+    select->map.max_entries = (int)range + 1;
+  }
+}
+
+/* The entry of header `type`, made the first time the type is seen. */
+internal struct EbpfHeader*
+header_entry(struct Type* type)
+{
+  struct EbpfHeader* header = ebpf_header_of(ebpf_program, type);
+  if (header) {
+    return header;
+  }
+  struct EbpfHeader entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.type = type;
+  entry.is_read = arena_push(ebpf_storage, (type->member_count + 1) * sizeof(bool));
+  memset(entry.is_read, 0, (type->member_count + 1) * sizeof(bool));
+  entry.is_written = arena_push(ebpf_storage, (type->member_count + 1) * sizeof(bool));
+  memset(entry.is_written, 0, (type->member_count + 1) * sizeof(bool));
+  array_append(&ebpf_program->headers, &entry);
+  return (struct EbpfHeader*)array_get(&ebpf_program->headers, ebpf_program->headers.elem_count - 1);
+}
+
+/* Notes the header types in `type`; with `is_whole`, every field of them is read and written. */
+internal void
+visit_headers(struct Type* type, bool is_whole)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  if (!type) {
+    return;
+  } else if (type->kind == Type_Header) {
+    struct EbpfHeader* header = header_entry(type);
+    for (i = 0; i < type->member_count && is_whole; i++) {
+      header->is_read[i] = header->is_written[i] = true;
+    }
+  } else if (type->kind == Type_HeaderStack) {
+    visit_headers(type->base, is_whole);
+  } else if (type->kind == Type_Struct || type->kind == Type_HeaderUnion) {
+    for (i = 0; i < type->member_count; i++) {
+      visit_headers(type->members[i].type, is_whole);
+    }
+  }
+}
+
+internal bool
+is_packet_call(struct IrFunction* function, struct IrInsn* insn)
+{
+  if (insn->op != Ir_Call || !insn->receiver) {
+    return false;
+  }
+  struct Type* receiver = ebpf_resolve_type(ir_insn(function, insn->receiver)->type);
+  return receiver && receiver->kind == Type_Extern
+         && ((cstr_match(receiver->name, "packet_in") && cstr_match(insn->name, "extract"))
+             || (cstr_match(receiver->name, "packet_out") && cstr_match(insn->name, "emit")));
+}
+
+/* How `insn` uses its argument `arg`, the reference `id`. */
+internal void
+use_argument(struct IrFunction* function, struct IrInsn* insn, int arg, int id)
+{
+  struct IrInsn* ref = ir_insn(function, id);
+  struct Type* base = ref->op == Ir_Field ? ebpf_resolve_type(ir_insn(function, ref->args[0])->type) : 0;
+  if (base && base->kind == Type_Header) {
+    struct EbpfHeader* header = header_entry(base);
+    int i;
+    for (i = 0; i < base->member_count && !cstr_match(base->members[i].name, ref->name); i++);
+    header->is_read[i] = true;
+    header->is_written[i] |= insn->op != Ir_Load;
+    return;
+  }
+  if (!ebpf_is_aggregate(ref->type)) {
+    return;
+  }
+  bool is_whole = !(insn->op == Ir_Field || insn->op == Ir_Index || insn->op == Ir_Store || insn->op == Ir_IsValid
+                    || insn->op == Ir_SetValid || insn->op == Ir_SetInvalid || is_packet_call(function, insn));
+  if (insn->op == Ir_Store) {
+    /* A copy keeps where the header came from; a list does not. */
+    enum IrOpcode source = ir_insn(function, insn->args[1])->op;
+    is_whole = source != Ir_Var && source != Ir_Field && source != Ir_Index && source != Ir_Temp;
+  }
+  visit_headers(ref->type, is_whole);
+}
+
+/* The header fields that the live instructions of `function` read and write. */
+internal void
+analyze_header_uses(struct IrFunction* function)
+{
+  int* use_count = arena_push(ebpf_storage, function->insns.elem_count * sizeof(int));
+  memset(use_count, 0, function->insns.elem_count * sizeof(int));
+  int i, j, id;
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    for (id = block->first_insn; id; id = ir_insn(function, id)->next_in_block) {
+      struct IrInsn* insn = ir_insn(function, id);
+      for (j = 0; j < insn->arg_count; j++) {
+        use_count[insn->args[j]] += 1;
+      }
+    }
+    use_count[block->value] += 1;
+    for (j = 0; j < block->key_count; j++) {
+      use_count[block->keys[j]] += 1;
+    }
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    if (i != function->entry_block && block->pred_count == 0) {
+      continue;
+    }
+    for (id = block->first_insn; id; id = ir_insn(function, id)->next_in_block) {
+      struct IrInsn* insn = ir_insn(function, id);
+      if (insn->op == Ir_Load && use_count[id] == 0) {
+        continue;
+      }
+      for (j = 0; j < insn->arg_count; j++) {
+        use_argument(function, insn, j, insn->args[j]);
+      }
+      if (insn->receiver) {
+        use_argument(function, insn, -1, insn->receiver);
+      }
+    }
+  }
+}
+
+internal void
+analyze_headers()
+{
+  int i, j;
+  for (i = 0; i < ebpf_program->ir->functions.elem_count; i++) {
+    analyze_header_uses(*(struct IrFunction**)array_get(&ebpf_program->ir->functions, i));
+  }
+  for (i = 0; i < ebpf_program->headers.elem_count; i++) {
+    struct EbpfHeader* header = (struct EbpfHeader*)array_get(&ebpf_program->headers, i);
+    for (j = 0; j < header->type->member_count; j++) {
+      header->is_partial |= !header->is_read[j];
+      header->is_view |= !header->is_written[j];
+    }
+  }
+}
+
+/* Whether `id` in the deparser is a reference to its headers parameter with constant stack indexes. */
+internal bool
+is_header_path(struct IrFunction* deparser, int id)
+{
+  struct IrInsn* insn = ir_insn(deparser, id);
+  struct Type* base;
+  if (insn->op == Ir_Var) {
+    return deparser->params && insn->decl == ast_list_first_link(deparser->params)->ast;
+  } else if (insn->op == Ir_Field) {
+    base = ebpf_resolve_type(ir_insn(deparser, insn->args[0])->type);
+    return base && base->kind != Type_HeaderStack && is_header_path(deparser, insn->args[0]);
+  } else if (insn->op == Ir_Index) {
+    return ir_insn(deparser, insn->args[1])->op == Ir_Const && is_header_path(deparser, insn->args[0]);
+  }
+  return false;
+}
+
+/*
+ * The headers a deparser made of one block of emits emits, in order.  Only
+ * needed when some header is partly loaded: the others are written whole.
+ */
+internal void
+analyze_deparser(struct IrFunction* deparser)
+{
+  struct IrBlock* entry = ir_block(deparser, deparser->entry_block);
+  int id, count = 0;
+  if (entry->term != IrTerm_Return || entry->value || !ebpf_has_partial_headers(ebpf_program)) {
+    return;
+  }
+  for (id = entry->first_insn; id; id = ir_insn(deparser, id)->next_in_block) {
+    struct IrInsn* insn = ir_insn(deparser, id);
+    if (is_packet_call(deparser, insn) && insn->arg_count == 1 && is_header_path(deparser, insn->args[0])) {
+      count += 1;
+    } else if (insn->op != Ir_Var && insn->op != Ir_Field && insn->op != Ir_Index && insn->op != Ir_Const) {
+      return;
+    }
+  }
+  ebpf_program->deparser_emits = arena_push(ebpf_storage, (count + 1) * sizeof(int));
+  for (id = entry->first_insn; id; id = ir_insn(deparser, id)->next_in_block) {
+    struct IrInsn* insn = ir_insn(deparser, id);
+    if (insn->op == Ir_Call) {
+      ebpf_program->deparser_emits[ebpf_program->deparser_emit_count++] = insn->args[0];
+    }
+  }
+}
+
+/*
+ * Header stacks.  Each stack indexed at run time is reached by compares of
+ * the index while that copies little: few elements, of few fields in all.
+ */
+
+internal int
+field_count(struct Type* type)
+{
+  int count = 0;
+  int i;
+  type = ebpf_resolve_type(type);
+  if (type->kind == Type_HeaderStack) {
+    return type->width * field_count(type->base);
+  } else if (type->kind != Type_Header && type->kind != Type_Struct) {
+    return 1;
+  }
+  for (i = 0; i < type->member_count; i++) {
+    count += type->kind == Type_Header ? 1 : field_count(type->members[i].type);
+  }
+  return count;
+}
+
+internal bool
+is_stack_access(struct IrFunction* function, struct IrInsn* insn)
+{
+  if (insn->op != Ir_Field && insn->op != Ir_Index) {
+    return false;
+  }
+  struct Type* base = ebpf_resolve_type(ir_insn(function, insn->args[0])->type);
+  if (!base || base->kind != Type_HeaderStack) {
+    return false;
+  } else if (insn->op == Ir_Index) {
+    return ir_insn(function, insn->args[1])->op != Ir_Const;
+  }
+  return cstr_match(insn->name, "next") || cstr_match(insn->name, "last");
+}
+
+internal void
+analyze_stacks(enum EbpfStackKind stack_kind)
+{
+  int i, id;
+  for (i = 0; i < ebpf_program->ir->functions.elem_count; i++) {
+    struct IrFunction* function = *(struct IrFunction**)array_get(&ebpf_program->ir->functions, i);
+    for (id = 1; id < function->insns.elem_count; id++) {
+      struct IrInsn* insn = ir_insn(function, id);
+      if (!is_stack_access(function, insn)) {
+        continue;
+      }
+      struct Type* type = ebpf_resolve_type(ir_insn(function, insn->args[0])->type);
+      struct EbpfStack* stack = ebpf_stack_of(ebpf_program, type);
+      if (!stack) {
+        struct EbpfStack entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = type;
+        array_append(&ebpf_program->stacks, &entry);
+        stack = (struct EbpfStack*)array_get(&ebpf_program->stacks, ebpf_program->stacks.elem_count - 1);
+      }
+      stack->access_count += 1;
+    }
+  }
+  for (i = 0; i < ebpf_program->stacks.elem_count; i++) {
+    struct EbpfStack* stack = (struct EbpfStack*)array_get(&ebpf_program->stacks, i);
+    int fields = field_count(stack->type);
+    if (stack_kind == EbpfStack_Unrolled) {
+      stack->kind = EbpfStack_Unrolled;
+      stack->reason = "as --stacks asks";
+    } else if (stack_kind == EbpfStack_Indexed) {
+      stack->kind = EbpfStack_Indexed;
+      stack->reason = "as --stacks asks";
+    } else if (stack->type->width > EBPF_STACK_UNROLL_MAX) {
+      stack->kind = EbpfStack_Indexed;
+      stack->reason = "too many elements to compare the index against each";
+    } else if (fields > EBPF_STACK_UNROLL_FIELDS) {
+      stack->kind = EbpfStack_Indexed;
+      stack->reason = "too many fields to copy each access per element";
+    } else {
+      stack->kind = EbpfStack_Unrolled;
+      stack->reason = "few elements of few fields";
+    }
+  }
+}
+
+/* How many copies of the code that uses `insn` the BPF target emits: one per element of an unrolled stack. */
+internal int
+access_copies(struct IrFunction* function, struct IrInsn* insn)
+{
+  if (!is_stack_access(function, insn)) {
+    return 1;
+  }
+  struct EbpfStack* stack = ebpf_stack_of(ebpf_program, ir_insn(function, insn->args[0])->type);
+  return stack->kind == EbpfStack_Unrolled ? stack->type->width : 1;
+}
+
+/*
+ * Stages.  The cost of a block is an estimate of its BPF instructions with
+ * everything it calls inlined: a few per IR instruction and per header field
+ * extracted or emitted, and for each table apply the compares of its inline entries, the entries a scan tries or the
+ * probes of a tuple space.  The verifier walks more than that where branches
+ * do not join, hence EBPF_WALK_FACTOR between a stage's estimated
+ * instructions and --max-insns.
+ */
+
+internal int
+table_cost(struct EbpfTable* table)
+{
+  int count = table->search_count > 0 ? table->search_count : table->entry_count;
+  if (table->kind == EbpfTable_Inline) {
+    return count * (2 * table->key_count + table->value_size / 4 + 3);
+  } else if (table->kind == EbpfTable_Scan) {
+    return table->map.max_entries * (6 * table->key_count + 8);
+  } else if (table->kind == EbpfTable_Tuple) {
+    return EBPF_TUPLE_MAX_MASKS * (5 * table->key_count + 16) + 8;
+  }
+  return 3 * table->key_count + 8;
+}
+
+/* The function that `insn` calls or applies, or 0 for an extern. */
+internal struct IrFunction*
+callee_of(struct IrFunction* function, struct IrInsn* insn)
+{
+  struct IrInsn* receiver = insn->receiver ? ir_insn(function, insn->receiver) : 0;
+  struct IrFunction* callee = 0;
+  if (receiver && receiver->op != Ir_TableApply) {
+    struct Type* type = ebpf_resolve_type(receiver->type);
+    if (type && (type->kind == Type_Parser || type->kind == Type_Control) && cstr_match(insn->name, "apply")) {
+      callee = ir_function_of(ebpf_program->ir, type->decl);
+    }
+    return callee;
+  }
+  callee = ir_function_of(ebpf_program->ir, insn->decl);
+  if (!callee && insn->decl && insn->decl->kind == Ast_FunctionDecl) {
+    callee = ir_function_of(ebpf_program->ir, (struct Ast*)ast_getattr(insn->decl, "proto"));
+  }
+  return callee;
+}
+
+/*
+ * The cost of `function` and all it calls, as walked: a parser's loops
+ * (ebpf_loop_trips) once per trip.  Its own goes to `owner`, or to the parser
+ * or control it is.
+ */
+internal int
+function_cost(struct IrFunction* function, struct EbpfComplexity* complexity, struct EbpfBlockComplexity* owner)
+{
+  int* trips = function->kind == IrFunction_Parser ? ebpf_loop_trips(function, ebpf_storage) : 0;
+  int64_t own_walk = 0;
+  int cost = 0, own_cost = 0;
+  int i;
+  if (function->kind == IrFunction_Parser || function->kind == IrFunction_Control) {
+    owner = ebpf_block_complexity(complexity, function);
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    own_cost += ir_block(function, i)->case_count + 2;
+    own_walk += (int64_t)(ir_block(function, i)->case_count + 2) * (trips ? trips[i] : 1);
+  }
+  for (i = 1; i < function->insns.elem_count; i++) {
+    struct IrInsn* insn = ir_insn(function, i);
+    struct IrFunction* callee;
+    int insn_cost = EBPF_INSN_COST;
+    if (insn->op == Ir_TableApply && ebpf_table_of(ebpf_program, insn->decl)) {
+      insn_cost += table_cost(ebpf_table_of(ebpf_program, insn->decl));
+    } else if (is_packet_call(function, insn)) {
+      struct IrInsn* header = ir_insn(function, insn->args[0]);
+      insn_cost += EBPF_FIELD_COST * field_count(header->type) * access_copies(function, header);
+    } else if (is_stack_access(function, insn)) {
+      int copies = access_copies(function, insn);
+      insn_cost += copies > 1 ? 2 * copies : EBPF_STACK_INDEX_COST;
+    } else if (insn->op == Ir_Call && (callee = callee_of(function, insn))) {
+      cost += function_cost(callee, complexity, owner);
+    }
+    own_cost += insn_cost;
+    own_walk += (int64_t)insn_cost * (trips ? trips[insn->block] : 1);
+  }
+  own_walk = own_walk < EBPF_MAX_INSNS ? own_walk : EBPF_MAX_INSNS;
+  owner->insn_count += own_cost;
+  owner->walked += own_walk * EBPF_WALK_FACTOR;
+  return cost + (int)own_walk;
+}
+
+/*
+ * Gives each block of the package its stage: with EbpfSplit_Auto, the one
+ * before while the estimates stay in the budget, and estimates what the
+ * verifier makes of each stage.
+ */
+internal void
+analyze_stages(enum EbpfSplitKind split_kind)
+{
+  struct IrFunction* blocks[EbpfBlock_COUNT_];
+  struct EbpfComplexity complexities[EbpfBlock_COUNT_];
+  int budget = ebpf_program->max_insns / EBPF_WALK_FACTOR;
+  int cost = 0;
+  int i;
+  blocks[EbpfBlock_Parser] = ebpf_program->parser;
+  blocks[EbpfBlock_Control] = ebpf_program->control;
+  blocks[EbpfBlock_Deparser] = ebpf_program->deparser;
+  ebpf_program->stage_count = 1;
+  for (i = 0; i < EbpfBlock_COUNT_ && blocks[i]; i++) {
+    memset(&complexities[i], 0, sizeof(complexities[i]));
+    array_init(&complexities[i].blocks, sizeof(struct EbpfBlockComplexity), ebpf_storage);
+    ebpf_program->block_costs[i] = function_cost(blocks[i], &complexities[i], 0);
+    bool is_over = cost + ebpf_program->block_costs[i] > budget;
+    if (i > 0 && (split_kind == EbpfSplit_Blocks || (split_kind == EbpfSplit_Auto && is_over))) {
+      ebpf_program->stage_count += 1;
+      cost = 0;
+    }
+    ebpf_program->stages[i] = ebpf_program->stage_count - 1;
+    cost += ebpf_program->block_costs[i];
+  }
+  ebpf_program->complexities = arena_push(ebpf_storage, ebpf_program->stage_count * sizeof(struct EbpfComplexity));
+  memset(ebpf_program->complexities, 0, ebpf_program->stage_count * sizeof(struct EbpfComplexity));
+  for (i = 0; i < ebpf_program->stage_count; i++) {
+    ebpf_program->complexities[i].is_estimate = true;
+    array_init(&ebpf_program->complexities[i].blocks, sizeof(struct EbpfBlockComplexity), ebpf_storage);
+  }
+  for (i = 0; i < EbpfBlock_COUNT_ && blocks[i]; i++) {
+    struct EbpfComplexity* complexity = &ebpf_program->complexities[ebpf_program->stages[i]];
+    int k;
+    for (k = 0; k < complexities[i].blocks.elem_count; k++) {
+      struct EbpfBlockComplexity* part = (struct EbpfBlockComplexity*)array_get(&complexities[i].blocks, k);
+      struct EbpfBlockComplexity* sum = ebpf_block_complexity(complexity, part->function);
+      sum->insn_count += part->insn_count;
+      sum->walked += part->walked;
+      complexity->insn_count += part->insn_count;
+      complexity->walked += part->walked;
+    }
+  }
+  if (ebpf_program->stage_count > 1) {
+    ebpf_program->stage_map.name = "ashp4c_stages";
+    ebpf_program->stage_map.type = EbpfMap_ProgArray;
+    ebpf_program->stage_map.key_size = 4;
+    ebpf_program->stage_map.value_size = 4;
+    ebpf_program->stage_map.max_entries = ebpf_program->stage_count;
+    ebpf_program->state_map.name = "ashp4c_state";
+    ebpf_program->state_map.type = EbpfMap_PercpuArray;
+    ebpf_program->state_map.key_size = 4;
+    ebpf_program->state_map.max_entries = 1;
+  }
+}
+
+struct EbpfProgram*
+ebpf_analyze_program(struct Ast* p4program, struct IrProgram* ir_program, enum EbpfSelectKind select_kind,
+                     enum EbpfTableKind ternary_kind, bool full_checksums, enum EbpfSplitKind split_kind,
+                     enum EbpfStackKind stack_kind, int max_insns, struct Arena* storage)
+{
+  ebpf_storage = storage;
+  ebpf_ternary_kind = ternary_kind;
+  ebpf_program = arena_push(ebpf_storage, sizeof(*ebpf_program));
+  memset(ebpf_program, 0, sizeof(*ebpf_program));
+  ebpf_program->max_insns = max_insns;
+  ebpf_program->ir = ir_program;
+  array_init(&ebpf_program->tables, sizeof(struct EbpfTable), ebpf_storage);
+  array_init(&ebpf_program->counters, sizeof(struct EbpfCounter), ebpf_storage);
+  array_init(&ebpf_program->registers, sizeof(struct EbpfRegister), ebpf_storage);
+  array_init(&ebpf_program->selects, sizeof(struct EbpfSelect), ebpf_storage);
+  array_init(&ebpf_program->checksums, sizeof(struct EbpfChecksum), ebpf_storage);
+  array_init(&ebpf_program->headers, sizeof(struct EbpfHeader), ebpf_storage);
+  array_init(&ebpf_program->stacks, sizeof(struct EbpfStack), ebpf_storage);
+
+  struct Ast* main_decl = 0;
+  struct AstList* decl_list = (struct AstList*)ast_getattr(p4program, "decl_list");
+  struct AstListLink* link = ast_list_first_link(decl_list);
+  while (link) {
+    if (link->ast->kind == Ast_Instantiation && cstr_match(ebpf_decl_name(link->ast), "main")) {
+      main_decl = link->ast;
+    }
+    link = link->next;
+  }
+  if (!main_decl) {
+    error("the program has no `main` package instance.");
+  }
+  char* package = type_ref_name((struct Ast*)ast_getattr(main_decl, "type_ref"));
+  struct AstList* args = (struct AstList*)ast_getattr(main_decl, "args");
+  struct AstListLink* arg = args ? ast_list_first_link(args) : 0;
+  if (cstr_match(package, "ebpfFilter") && ebpf_list_count(args) == 2) {
+    ebpf_program->model = EbpfModel_Filter;
+    ebpf_program->parser = block_of_argument(arg->ast, Type_Parser, "a parser");
+    ebpf_program->control = block_of_argument(arg->next->ast, Type_Control, "a control");
+  } else if (cstr_match(package, "xdp") && ebpf_list_count(args) == 3) {
+    ebpf_program->model = EbpfModel_Xdp;
+    ebpf_program->parser = block_of_argument(arg->ast, Type_Parser, "a parser");
+    ebpf_program->control = block_of_argument(arg->next->ast, Type_Control, "a control");
+    ebpf_program->deparser = block_of_argument(arg->next->next->ast, Type_Control, "a deparser");
+  } else if (cstr_match(package, "ubpf") && ebpf_list_count(args) == 3) {
+    ebpf_program->model = EbpfModel_Ubpf;
+    ebpf_program->parser = block_of_argument(arg->ast, Type_Parser, "a parser");
+    ebpf_program->control = block_of_argument(arg->next->ast, Type_Control, "a control");
+    ebpf_program->deparser = block_of_argument(arg->next->next->ast, Type_Control, "a deparser");
+  } else {
+    error("at line %d: the eBPF target expects `main` to be an `ebpfFilter`, `xdp` or `ubpf` package, not `%s`.",
+          main_decl->line_nr, package);
+  }
+
+  int i, j;
+  for (i = 0; i < ir_program->functions.elem_count; i++) {
+    struct IrFunction* function = *(struct IrFunction**)array_get(&ir_program->functions, i);
+    for (j = 0; j < function->tables.elem_count; j++) {
+      analyze_table(function, *(struct Ast**)array_get(&function->tables, j));
+    }
+    for (j = 0; j < function->locals.elem_count; j++) {
+      analyze_instance(function, *(struct Ast**)array_get(&function->locals, j));
+    }
+    if (function->kind == IrFunction_Parser) {
+      ebpf_optimize_parser(function);
+      for (j = 1; j < function->blocks.elem_count; j++) {
+        struct IrBlock* block = ir_block(function, j);
+        if (block->term == IrTerm_Select && (block->pred_count > 0 || j == function->entry_block)) {
+          analyze_select(function, block, select_kind);
+        }
+      }
+    }
+  }
+  if (!full_checksums) {
+    ebpf_lower_checksums(ebpf_program, ebpf_storage);
+  }
+  analyze_headers();
+  if (ebpf_program->deparser) {
+    analyze_deparser(ebpf_program->deparser);
+  }
+  analyze_stacks(stack_kind);
+  analyze_stages(split_kind);
+  return ebpf_program;
+}
+
+struct EbpfTable*
+ebpf_table_of(struct EbpfProgram* program, struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < program->tables.elem_count; i++) {
+    struct EbpfTable* table = (struct EbpfTable*)array_get(&program->tables, i);
+    if (table->decl == decl) {
+      return table;
+    }
+  }
+  return 0;
+}
+
+struct EbpfSelect*
+ebpf_select_of(struct EbpfProgram* program, struct IrFunction* function, int block)
+{
+  int i;
+  for (i = 0; i < program->selects.elem_count; i++) {
+    struct EbpfSelect* select = (struct EbpfSelect*)array_get(&program->selects, i);
+    if (select->function == function && select->block == block) {
+      return select;
+    }
+  }
+  return 0;
+}
+
+/* The part of `complexity` owed to `function`, added if it is not there yet. */
+struct EbpfBlockComplexity*
+ebpf_block_complexity(struct EbpfComplexity* complexity, struct IrFunction* function)
+{
+  struct EbpfBlockComplexity block;
+  int i;
+  for (i = 0; i < complexity->blocks.elem_count; i++) {
+    struct EbpfBlockComplexity* other = (struct EbpfBlockComplexity*)array_get(&complexity->blocks, i);
+    if (other->function == function) {
+      return other;
+    }
+  }
+  memset(&block, 0, sizeof(block));
+  block.function = function;
+  array_append(&complexity->blocks, &block);
+  return (struct EbpfBlockComplexity*)array_get(&complexity->blocks, complexity->blocks.elem_count - 1);
+}
+
+internal char*
+block_complexity_name(struct EbpfBlockComplexity* block)
+{
+  return block->function ? block->function->name : "the package";
+}
+
+/* Stops the compilation if the verifier would walk more of `stage` than --max-insns allows, naming what costs most. */
+void
+ebpf_check_complexity(struct EbpfProgram* program, int stage)
+{
+  struct EbpfComplexity* complexity = &program->complexities[stage];
+  char stage_name[32], parts[256];
+  int i, length = 0;
+  if (complexity->walked <= program->max_insns) {
+    return;
+  }
+  sprintf(stage_name, "stage %d", stage);
+  for (i = 0; i < complexity->blocks.elem_count && length < (int)sizeof(parts) - 64; i++) {
+    struct EbpfBlockComplexity* block = (struct EbpfBlockComplexity*)array_get(&complexity->blocks, i);
+    length += snprintf(parts + length, sizeof(parts) - length, "%s%.32s about %lld", i > 0 ? ", " : "",
+                       block_complexity_name(block), (long long)block->walked);
+  }
+  parts[length] = '\0';
+  error("%s is too complex for the verifier: it would walk about %lld instructions, more than the %d of "
+        "--max-insns (%s).", program->stage_count > 1 ? stage_name : "the program",
+        (long long)complexity->walked, program->max_insns, parts);
+}
+
+void
+ebpf_print_complexity(struct EbpfProgram* program, FILE* f_stream)
+{
+  int i, k;
+  for (i = 0; i < program->stage_count; i++) {
+    struct EbpfComplexity* complexity = &program->complexities[i];
+    char* about = complexity->is_estimate ? "about " : "";
+    fprintf(f_stream, "stage %d: %s%d instructions", i, about, complexity->insn_count);
+    if (!complexity->is_estimate) {
+      fprintf(f_stream, ", %d branches, longest path %d", complexity->branch_count, complexity->path_length);
+    }
+    fprintf(f_stream, "; the verifier walks about %lld of %d\n", (long long)complexity->walked,
+            program->max_insns);
+    for (k = 0; k < complexity->blocks.elem_count; k++) {
+      struct EbpfBlockComplexity* block = (struct EbpfBlockComplexity*)array_get(&complexity->blocks, k);
+      fprintf(f_stream, "  %s: %s%d instructions", block_complexity_name(block), about, block->insn_count);
+      if (!complexity->is_estimate) {
+        fprintf(f_stream, ", %d branches", block->branch_count);
+      }
+      fprintf(f_stream, ", about %lld walked\n", (long long)block->walked);
+    }
+  }
+}
+
+struct EbpfHeader*
+ebpf_header_of(struct EbpfProgram* program, struct Type* type)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  for (i = 0; i < program->headers.elem_count; i++) {
+    struct EbpfHeader* header = (struct EbpfHeader*)array_get(&program->headers, i);
+    if (header->type == type) {
+      return header;
+    }
+  }
+  return 0;
+}
+
+struct EbpfStack*
+ebpf_stack_of(struct EbpfProgram* program, struct Type* type)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  for (i = 0; i < program->stacks.elem_count; i++) {
+    struct EbpfStack* stack = (struct EbpfStack*)array_get(&program->stacks, i);
+    if (stack->type == type) {
+      return stack;
+    }
+  }
+  return 0;
+}
+
+bool
+ebpf_has_partial_headers(struct EbpfProgram* program)
+{
+  int i;
+  for (i = 0; i < program->headers.elem_count; i++) {
+    if (((struct EbpfHeader*)array_get(&program->headers, i))->is_partial) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct EbpfCounter*
+ebpf_counter_of(struct EbpfProgram* program, struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < program->counters.elem_count; i++) {
+    struct EbpfCounter* counter = (struct EbpfCounter*)array_get(&program->counters, i);
+    if (counter->decl == decl) {
+      return counter;
+    }
+  }
+  return 0;
+}
+
+struct EbpfRegister*
+ebpf_register_of(struct EbpfProgram* program, struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < program->registers.elem_count; i++) {
+    struct EbpfRegister* reg = (struct EbpfRegister*)array_get(&program->registers, i);
+    if (reg->decl == decl) {
+      return reg;
+    }
+  }
+  return 0;
+}
+
+/* The uses of `header` if it is a view of the packet, else 0. */
+struct EbpfHeader*
+ebpf_view_of(struct EbpfProgram* program, struct Type* header)
+{
+  header = ebpf_resolve_type(header);
+  struct EbpfHeader* view = header && header->kind == Type_Header ? ebpf_header_of(program, header) : 0;
+  return view && view->is_view ? view : 0;
+}
+
+struct EbpfAction*
+ebpf_table_action(struct EbpfTable* table, struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < table->action_count; i++) {
+    if (table->actions[i].decl == decl) {
+      return &table->actions[i];
+    }
+  }
+  return 0;
+}
+
+/* Whether the maps need entries set when the program is loaded: const entries, defaults, select maps. */
+bool
+ebpf_needs_init(struct EbpfProgram* program)
+{
+  int i;
+  for (i = 0; i < program->tables.elem_count; i++) {
+    struct EbpfTable* table = (struct EbpfTable*)array_get(&program->tables, i);
+    if (table->default_map.type || (table->entry_count > 0 && table->kind != EbpfTable_Inline)) {
+      return true;
+    }
+  }
+  for (i = 0; i < program->selects.elem_count; i++) {
+    struct EbpfSelect* select = (struct EbpfSelect*)array_get(&program->selects, i);
+    if (select->kind == EbpfSelect_Map) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+ebpf_is_block(struct IrFunction* f)
+{
+  return f->kind == IrFunction_Parser || f->kind == IrFunction_Control;
+}
+
+/* Parameters passed as values: directionless or `in`, and scalar. */
+bool
+ebpf_param_by_value(struct Ast* param)
+{
+  enum AstParamDirection direction = *(enum AstParamDirection*)ast_getattr(param, "direction");
+  return (direction == AstParamDir_NONE_ || direction == AstParamDir_In) && !ebpf_is_aggregate(type_of_node(param));
+}
+
+/* Type of the parameter at `index` of a block the `main` package takes. */
+struct Type*
+ebpf_param_type(struct IrFunction* f, int index)
+{
+  struct AstListLink* link = f->params ? ast_list_first_link(f->params) : 0;
+  while (link && index > 0) {
+    link = link->next;
+    index -= 1;
+  }
+  if (!link) {
+    error("`%s` has too few parameters for the `main` package.", f->name);
+  }
+  return type_of_node(link->ast);
+}
+
+/* Which of the fields of a header stack `name` is, or EbpfStackField_NONE_. */
+enum EbpfStackField
+ebpf_stack_field(char* name)
+{
+  if (cstr_match(name, "next")) {
+    return EbpfStackField_Next;
+  } else if (cstr_match(name, "last")) {
+    return EbpfStackField_Last;
+  } else if (cstr_match(name, "lastIndex")) {
+    return EbpfStackField_LastIndex;
+  } else if (cstr_match(name, "nextIndex")) {
+    return EbpfStackField_NextIndex;
+  } else if (cstr_match(name, "size")) {
+    return EbpfStackField_Size;
+  }
+  return EbpfStackField_NONE_;
+}
+
+internal char*
+match_kind_to_string(enum EbpfMatchKind match_kind)
+{
+  switch (match_kind) {
+    case EbpfMatch_Exact: return "exact";
+    case EbpfMatch_Lpm: return "lpm";
+    case EbpfMatch_Ternary: return "ternary";
+  }
+  return "?";
+}
+
+/* One paragraph per table: the map that keeps it, its keys, and why. */
+void
+ebpf_print_tables(struct EbpfProgram* program, FILE* f_stream)
+{
+  int i, k;
+  for (i = 0; i < program->tables.elem_count; i++) {
+    struct EbpfTable* table = (struct EbpfTable*)array_get(&program->tables, i);
+    fprintf(f_stream, "table %s:", table->name);
+    if (table->map.type) {
+      fprintf(f_stream, " %s, %d entries, key %d bytes, value %d bytes", ebpf_map_type_to_string(table->map.type),
+              table->map.max_entries, table->map.key_size, table->map.value_size);
+    } else {
+      fprintf(f_stream, " no map");
+    }
+    fprintf(f_stream, "\n  keys:");
+    for (k = 0; k < table->key_count; k++) {
+      fprintf(f_stream, " %s bit<%d> %s%s", table->keys[k].name, table->keys[k].width,
+              match_kind_to_string(table->keys[k].match_kind), k + 1 < table->key_count ? "," : "");
+    }
+    fprintf(f_stream, "%s\n  %s\n", table->key_count ? "" : " none", table->reason);
+    if (table->kind == EbpfTable_Tuple) {
+      fprintf(f_stream, "  at most %d masks, in %s\n", EBPF_TUPLE_MAX_MASKS, table->mask_map.name);
+    }
+    if (table->entry_count > 0 && table->kind == EbpfTable_Tuple) {
+      fprintf(f_stream, "  %d const entries with %d masks, written on the first run\n", table->entry_count,
+              table->mask_count);
+    } else if (table->entry_count > 0 && table->kind != EbpfTable_Inline) {
+      fprintf(f_stream, "  %d const entries, written on the first run\n", table->entry_count);
+    } else if (table->entry_count > 0) {
+      fprintf(f_stream, "  %d const entries\n", table->entry_count);
+    }
+    if (table->default_map.type) {
+      fprintf(f_stream, "  default action in %s\n", table->default_map.name);
+    }
+  }
+  for (i = 0; i < program->checksums.elem_count; i++) {
+    struct EbpfChecksum* checksum = (struct EbpfChecksum*)array_get(&program->checksums, i);
+    fprintf(f_stream, "checksum at line %d:", checksum->line_nr);
+    if (checksum->is_incremental) {
+      fprintf(f_stream, " updated by");
+      for (k = 0; k < checksum->field_count; k++) {
+        fprintf(f_stream, " %s%s", checksum->fields[k], k + 1 < checksum->field_count ? "," : "");
+      }
+      fprintf(f_stream, "%s\n", checksum->field_count ? "" : " no field");
+    } else {
+      fprintf(f_stream, " summed in full, %s\n", checksum->reason);
+    }
+  }
+  for (i = 0; i < program->headers.elem_count; i++) {
+    struct EbpfHeader* header = (struct EbpfHeader*)array_get(&program->headers, i);
+    int read_count = 0, written_count = 0;
+    for (k = 0; k < header->type->member_count; k++) {
+      read_count += header->is_read[k];
+      written_count += header->is_written[k];
+    }
+    if (header->is_view) {
+      fprintf(f_stream, "header %s: loads %d of %d fields, writes back %d\n", header->type->name, read_count,
+              header->type->member_count, written_count);
+    }
+  }
+  for (i = 0; i < program->stacks.elem_count; i++) {
+    struct EbpfStack* stack = (struct EbpfStack*)array_get(&program->stacks, i);
+    fprintf(f_stream, "stack %s: %d accesses at a run-time index, %s, %s\n", type_to_string(stack->type),
+            stack->access_count, stack->kind == EbpfStack_Unrolled ? "by compares" : "by address", stack->reason);
+  }
+  struct IrFunction* blocks[EbpfBlock_COUNT_] = {program->parser, program->control, program->deparser};
+  for (i = 0; i < EbpfBlock_COUNT_ && blocks[i] && program->stage_count > 1; i++) {
+    fprintf(f_stream, "stage %d: %s, about %d instructions\n", program->stages[i], blocks[i]->name,
+            program->block_costs[i]);
+  }
+}
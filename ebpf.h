@@ -0,0 +1,353 @@
+#pragma once
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "bitint.h"
+#include "ir.h"
+
+
+/*
+ * What the eBPF backends need to know about a program beyond its IR: the
+ * architecture it was written for, where each header field sits in the
+ * packet, and how tables and extern instances map to BPF maps.
+ */
+
+enum EbpfModel {
+  EbpfModel_NONE_,
+  EbpfModel_Filter,  /* ebpf_model.p4: ebpfFilter(parse, filter) */
+  EbpfModel_Xdp,     /* xdp_model.p4: xdp(xdp_parse, xdp_switch, xdp_deparse) */
+  EbpfModel_Ubpf,    /* ubpf_model.p4: ubpf(prs, p, dprs), for the userspace VM of ebpf/ubpf_run.c */
+};
+
+/* Values of enum bpf_map_type in linux/bpf.h. */
+enum EbpfMapType {
+  EbpfMap_Hash = 1,
+  EbpfMap_Array = 2,
+  EbpfMap_ProgArray = 3,
+  EbpfMap_PercpuHash = 5,
+  EbpfMap_PercpuArray = 6,
+  EbpfMap_LpmTrie = 11,
+};
+
+#define EBPF_F_NO_PREALLOC  1
+#define EBPF_MAX_INSNS      1000000  /* BPF_COMPLEXITY_LIMIT_INSNS: instructions the verifier walks at most */
+#define EBPF_TUPLE_MAX_MASKS 16      /* masks of a tuple space table: ASHP4C_TUPLE_MAX_MASKS of ebpf/ashp4c_tuple.h */
+#define EBPF_MAX_PACKET_OFFSET 0x3fff  /* the parser rejects a packet it would read past this offset in */
+
+enum EbpfMatchKind {
+  EbpfMatch_Exact,
+  EbpfMatch_Lpm,
+  EbpfMatch_Ternary,
+};
+
+/* A field of a map key or value; offsets and sizes are in bytes. */
+struct EbpfField {
+  char* name;
+  struct Type* type;
+  int width;                 /* bits */
+  int offset;
+  int size;
+  enum EbpfMatchKind match_kind;
+};
+
+struct EbpfAction {
+  struct Ast* decl;
+  char* name;
+  struct IrFunction* function;
+  int bound_count;           /* parameters bound by the action reference in `actions` */
+  struct EbpfField* params;  /* the others, supplied by the matching entry */
+  int param_count;
+  int size;
+};
+
+struct EbpfTableEntry {
+  struct BitInt** keys;
+  struct BitInt** masks;     /* null where the key is matched exactly */
+  int action;
+  struct BitInt** args;
+  int line_nr;
+};
+
+struct EbpfMap {
+  char* name;
+  enum EbpfMapType type;
+  int key_size;
+  int value_size;
+  int max_entries;
+  int flags;
+};
+
+/*
+ * How the entries of a table are kept.  Dense and scanned tables are array
+ * maps, whose elements all exist: the entries set by the control plane have
+ * their `valid` flag set.  A tuple space table keeps each entry under its key
+ * and mask, `key & mask` in a hash map and the mask in an array of the masks
+ * in use; the control plane keeps that array sorted by the highest priority of
+ * each mask's entries (ebpf/ashp4c_tuple.h).  The mask map holds two such
+ * arrays and, past them, the element whose `priority` says which one is in
+ * use, so that the control plane rewrites the other and then flips it.
+ */
+enum EbpfTableKind {
+  EbpfTable_Map,     /* looked up by the key: a hash map, an LPM trie, or a declared `array_table` */
+  EbpfTable_Dense,   /* an array map indexed by the one exact key */
+  EbpfTable_Scan,    /* an array map of key, mask and value entries, the first that matches wins */
+  EbpfTable_Inline,  /* const entries compiled into compares at each apply, no map */
+  EbpfTable_Tuple,   /* a hash map of the masked keys, probed once per mask in priority order */
+};
+
+struct EbpfTable {
+  struct Ast* decl;
+  char* name;                 /* unique in the program: control_table */
+  struct IrFunction* control;
+  enum EbpfTableKind kind;
+  char* reason;               /* why the table is kept the way it is */
+  struct EbpfMap map;
+  struct EbpfField* keys;
+  int key_count;
+  int key_size;               /* of struct control_table_key */
+  bool is_lpm;                /* the key is a struct bpf_lpm_trie_key: prefix length, then the fields in network order */
+  struct EbpfAction* actions;
+  int action_count;
+  int value_size;             /* of struct control_table_value */
+  int valid_offset;           /* of the `valid` flag in the value, or 0 */
+  int priority_offset;        /* EbpfTable_Tuple: of the entry's priority in the value, the highest wins */
+  int action_offset;          /* of the union of the action parameters in the value */
+  int entry_key_offset;       /* EbpfTable_Scan: of the key in an entry, the mask follows it */
+  int default_action;         /* -1: a miss runs no action */
+  struct BitInt** default_args;
+  bool is_default_const;
+  struct EbpfMap default_map; /* the default action, when the control plane may change it */
+  struct EbpfTableEntry* entries;
+  int entry_count;
+  int* entry_order;           /* EbpfTable_Inline: the entries in the order they are tried, or sorted by the key */
+  int search_count;           /* ... and the number of distinct keys, if a binary search finds them */
+  struct EbpfMap mask_map;    /* EbpfTable_Tuple: priority, entry count and mask of each mask in use */
+  int* entry_masks;           /* EbpfTable_Tuple: index of each const entry's mask in the mask map */
+  int mask_count;
+};
+
+struct EbpfCounter {
+  struct Ast* decl;
+  char* name;
+  struct EbpfMap map;
+};
+
+/* A Register<T, S> of ubpf_model.p4: an array map of T, shared by every VM. */
+struct EbpfRegister {
+  struct Ast* decl;
+  char* name;
+  struct Type* type;         /* T, a value that fits a register */
+  struct EbpfMap map;
+};
+
+enum EbpfSelectKind {
+  EbpfSelect_NONE_,
+  EbpfSelect_Linear,  /* compare the cases in order */
+  EbpfSelect_Tree,    /* binary search over the sorted case values */
+  EbpfSelect_Map,     /* an array map from `key - base` to the case + 1 */
+};
+
+/*
+ * How the select ending a parser state is lowered.  Only a select on one
+ * bit<W> key whose cases before the default are exact values can become a
+ * tree or a map.
+ */
+struct EbpfSelect {
+  struct IrFunction* function;
+  int block;
+  enum EbpfSelectKind kind;
+  uint64_t* values;           /* sorted, without the values an earlier case already matched */
+  int* cases;                 /* index in the block's succs of the case matching each value */
+  int value_count;
+  int default_case;
+  uint64_t base;              /* EbpfSelect_Map: the smallest value */
+  struct EbpfMap map;
+};
+
+/*
+ * How the program uses the fields of each header type.  The header structs
+ * of a view type are views of the packet: an extract loads only the fields
+ * that are read or written and records where the header was in the packet,
+ * and the deparser writes back only the written fields when it emits the
+ * header where it came from.  A header emitted anywhere else is written
+ * whole, its untouched fields first loaded from where it came from.  Types
+ * used other than by field, copy, validity, extract and emit are read and
+ * written whole, and are not views.
+ */
+struct EbpfHeader {
+  struct Type* type;
+  bool* is_read;              /* by member: read or written, so loaded by an extract */
+  bool* is_written;           /* by member */
+  bool is_view;               /* some field is not written */
+  bool is_partial;            /* some field is not read */
+};
+
+/*
+ * How a call of `ebpf_ipv4_checksum` in the control is lowered: as updates of
+ * the checksum the packet came with by the fields that change, or in full.
+ */
+struct EbpfChecksum {
+  struct IrFunction* function;
+  int line_nr;
+  bool is_incremental;
+  char* reason;               /* why the checksum is summed in full */
+  char** fields;              /* the summed fields that may change, in the order of the arguments */
+  int field_count;
+};
+
+/* The blocks of the package, in the order a packet goes through them. */
+enum EbpfBlock {
+  EbpfBlock_Parser,
+  EbpfBlock_Control,
+  EbpfBlock_Deparser,
+  EbpfBlock_COUNT_,
+};
+
+enum EbpfSplitKind {
+  EbpfSplit_Auto,    /* a new stage where the blocks so far would be too much for the verifier */
+  EbpfSplit_None,    /* one program */
+  EbpfSplit_Blocks,  /* one program per block */
+};
+
+/*
+ * How the elements of a header stack are reached at an index known only at
+ * run time (`next`, `last`, `stack[i]`): by one compare of the index per
+ * element, each followed by its own copy of the access, or by an address
+ * computed from the index and one access through it.  Compares cost nothing
+ * to set up and let each copy use a constant offset; the address keeps the
+ * code the same size however deep the stack.
+ */
+enum EbpfStackKind {
+  EbpfStack_NONE_,      /* --stacks=auto: by the size of the stack */
+  EbpfStack_Unrolled,
+  EbpfStack_Indexed,
+};
+
+struct EbpfStack {
+  struct Type* type;
+  enum EbpfStackKind kind;
+  int access_count;           /* accesses at a run-time index */
+  char* reason;
+};
+
+/* The fields of a header stack other than its elements. */
+enum EbpfStackField {
+  EbpfStackField_NONE_,
+  EbpfStackField_Next,
+  EbpfStackField_Last,
+  EbpfStackField_LastIndex,
+  EbpfStackField_NextIndex,
+  EbpfStackField_Size,
+};
+
+/* What the verifier is expected to make of the part of a stage owed to one parser or control. */
+struct EbpfBlockComplexity {
+  struct IrFunction* function;  /* null: the package itself, between the blocks */
+  int insn_count;
+  int branch_count;
+  int64_t walked;
+};
+
+/*
+ * What the verifier is expected to make of a stage: its instructions and
+ * conditional jumps, the instructions on its longest path, and how many it
+ * walks, each once per state that reaches it.  Measured on the code by the
+ * BPF target, estimated from the IR otherwise (`is_estimate`: no branches or
+ * path).  `blocks` holds each parser and control the instructions come from,
+ * the actions and functions they call included.
+ */
+struct EbpfComplexity {
+  bool is_estimate;
+  int insn_count;
+  int branch_count;
+  int path_length;
+  int64_t walked;
+  struct UnboundedArray blocks;  /* struct EbpfBlockComplexity */
+};
+
+/*
+ * The pipeline runs as one XDP program, or as one per stage: each block
+ * starts a stage or joins the one before.  A stage ends with a bpf_tail_call
+ * through `stage_map`, which ebpf/bpf_load.c fills from the sections
+ * "xdp/<stage>" (ebpf/ubpf_run.c from "ubpf/<stage>"), and leaves the packet
+ * offset, the headers and the metadata of the control to the next in the one
+ * element of `state_map`, a per-CPU array.  Its value size is up to the
+ * backend.
+ */
+struct EbpfProgram {
+  enum EbpfModel model;
+  struct IrProgram* ir;
+  struct IrFunction* parser;
+  struct IrFunction* control;
+  struct IrFunction* deparser;
+  struct UnboundedArray tables;    /* struct EbpfTable */
+  struct UnboundedArray counters;  /* struct EbpfCounter */
+  struct UnboundedArray registers; /* struct EbpfRegister */
+  struct UnboundedArray selects;   /* struct EbpfSelect */
+  struct UnboundedArray checksums; /* struct EbpfChecksum */
+  struct UnboundedArray headers;   /* struct EbpfHeader */
+  struct UnboundedArray stacks;    /* struct EbpfStack: the stacks indexed at run time */
+  int* deparser_emits;             /* if the deparser only emits and some header is partly loaded, its emits in order */
+  int deparser_emit_count;
+  bool has_const_entries;
+  int block_costs[EbpfBlock_COUNT_];  /* estimated instructions of each block, everything it calls inlined */
+  int stages[EbpfBlock_COUNT_];       /* the stage each block runs in, from 0 */
+  int stage_count;
+  struct EbpfMap stage_map;
+  struct EbpfMap state_map;
+  int max_insns;                      /* --max-insns: what the verifier may walk of a stage */
+  struct EbpfComplexity* complexities; /* by stage */
+};
+
+
+struct EbpfProgram* ebpf_analyze_program(struct Ast* p4program, struct IrProgram* ir_program,
+                                         enum EbpfSelectKind select_kind, enum EbpfTableKind ternary_kind,
+                                         bool full_checksums, enum EbpfSplitKind split_kind,
+                                         enum EbpfStackKind stack_kind, int max_insns, struct Arena* storage);
+struct EbpfTable* ebpf_table_of(struct EbpfProgram* program, struct Ast* decl);
+struct EbpfCounter* ebpf_counter_of(struct EbpfProgram* program, struct Ast* decl);
+struct EbpfRegister* ebpf_register_of(struct EbpfProgram* program, struct Ast* decl);
+struct EbpfSelect* ebpf_select_of(struct EbpfProgram* program, struct IrFunction* function, int block);
+struct EbpfHeader* ebpf_header_of(struct EbpfProgram* program, struct Type* type);
+struct EbpfStack* ebpf_stack_of(struct EbpfProgram* program, struct Type* type);
+bool ebpf_has_partial_headers(struct EbpfProgram* program);
+struct Type* ebpf_resolve_type(struct Type* type);
+bool ebpf_is_aggregate(struct Type* type);
+int ebpf_header_size(struct Type* header);
+int ebpf_field_offset(struct Type* header, int member);
+int ebpf_scalar_width(struct Type* type);
+int ebpf_scalar_size(struct Type* type);
+char* ebpf_map_type_to_string(enum EbpfMapType type);
+void ebpf_optimize_parser(struct IrFunction* parser);
+int ebpf_packet_bytes(struct IrFunction* function, struct IrInsn* insn);
+int* ebpf_loop_trips(struct IrFunction* parser, struct Arena* storage);
+void ebpf_lower_checksums(struct EbpfProgram* program, struct Arena* storage);
+void ebpf_print_tables(struct EbpfProgram* program, FILE* f_stream);
+struct EbpfBlockComplexity* ebpf_block_complexity(struct EbpfComplexity* complexity, struct IrFunction* function);
+void ebpf_check_complexity(struct EbpfProgram* program, int stage);
+void ebpf_print_complexity(struct EbpfProgram* program, FILE* f_stream);
+
+/* Helpers the backends and the interpreter share. */
+int ebpf_list_count(struct AstList* list);
+int ebpf_list_index(struct AstList* list, struct Ast* ast);
+char* ebpf_decl_name(struct Ast* decl);
+int ebpf_scalar_bits(struct Type* type);
+bool ebpf_is_signed(struct Type* type);
+bool ebpf_is_extern_object(struct Type* type);
+uint64_t ebpf_width_mask(int width);
+struct EbpfHeader* ebpf_view_of(struct EbpfProgram* program, struct Type* header);
+struct EbpfAction* ebpf_table_action(struct EbpfTable* table, struct Ast* decl);
+int ebpf_prefix_length(struct EbpfTable* table, struct EbpfTableEntry* entry);
+int ebpf_full_prefix_length(struct EbpfTable* table);
+bool ebpf_needs_init(struct EbpfProgram* program);
+bool ebpf_is_block(struct IrFunction* f);
+bool ebpf_param_by_value(struct Ast* param);
+struct Type* ebpf_param_type(struct IrFunction* f, int index);
+enum EbpfStackField ebpf_stack_field(char* name);
+
+void emit_xdp_program(struct EbpfProgram* program, int ast_node_count, FILE* f_stream, char* source_filename,
+                      struct Arena* storage);
+void emit_bpf_program(struct EbpfProgram* program, FILE* f_stream, struct Arena* storage);
+void emit_ubpf_program(struct EbpfProgram* program, FILE* f_stream, struct Arena* storage);
+void run_ir_program(struct EbpfProgram* program, char* packets_filename, char* out_filename, int batch_size,
+                    int repeat, struct Arena* storage);
@@ -0,0 +1,357 @@
+/*
+ * Control-plane side of the tuple space tables that ashp4c generates for
+ * ternary tables (declared with more than 256 entries, or with --ternary=tuple).
+ *
+ * Such a table `control_table` has two maps:
+ *
+ *   control_table        hash: struct control_table_key -> struct control_table_value
+ *   control_table_masks  array of struct control_table_mask
+ *
+ * The key starts with `__u32 tuple`, the id of its mask, and the value has the
+ * entry's priority at offset 4.  An entry is kept under `key & mask` and the
+ * id of its mask.  The mask array lists the masks in use by descending highest
+ * priority of their entries, and ends at the first one of priority 0.  For each
+ * mask in turn, the program looks up the packet's key ANDed with that mask;
+ * it stops as soon as a mask cannot beat the best match it has found.
+ *
+ * These functions keep the mask array in step with the entries.  Keys and
+ * masks are passed as struct control_table_key, zeroed before their fields are
+ * set; their `tuple` is ignored.  The mask map holds two mask arrays of
+ * ASHP4C_TUPLE_MAX_MASKS elements, then one whose `priority` is 1 if the
+ * program reads the second: a change writes the array not in use, then flips
+ * that element, so a packet sees the masks either before or after it.  The
+ * handle counts the priorities of each mask's entries, to know the highest
+ * without walking the map; ashp4c_tuple_free releases those counts.
+ *
+ *   struct ashp4c_tuple_table acl = {map_fd, masks_fd, sizeof(struct Ingress_acl_key),
+ *                                    sizeof(struct Ingress_acl_value)};
+ *   ashp4c_tuple_insert(&acl, &key, &mask, &value, 10);
+ *   ...
+ *   ashp4c_tuple_free(&acl);
+ */
+#pragma once
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/bpf.h>
+#include "bpf.h"
+
+#define ASHP4C_TUPLE_MAX_MASKS  16     /* elements of each mask array: EBPF_TUPLE_MAX_MASKS of ashp4c */
+#define ASHP4C_TUPLE_MAX_KEY    256    /* bytes */
+
+/* How many entries under a mask have a priority. */
+struct ashp4c_tuple_count {
+  __u32 priority;
+  __u32 count;
+};
+
+/* The priorities of the entries under a mask, ascending. */
+struct ashp4c_tuple_priorities {
+  struct ashp4c_tuple_count* counts;
+  unsigned int length;
+  unsigned int capacity;
+};
+
+struct ashp4c_tuple_table {
+  int map_fd;
+  int masks_fd;
+  unsigned int key_size;
+  unsigned int value_size;
+  /* Kept by these functions, zero to begin with. */
+  int is_loaded;  /* the priorities of the entries already in the map are counted */
+  struct ashp4c_tuple_priorities priorities[ASHP4C_TUPLE_MAX_MASKS];  /* by mask id */
+};
+
+/* struct control_table_mask */
+struct ashp4c_tuple_mask {
+  __u32 priority;  /* the highest of its entries, 0 past the last mask */
+  __u32 count;     /* of its entries */
+  unsigned char mask[ASHP4C_TUPLE_MAX_KEY];
+};
+
+/* Adds `delta`, 1 or -1, to the entries of `priority`; sets errno to ENOMEM if it cannot grow. */
+static inline int
+ashp4c_tuple_count(struct ashp4c_tuple_priorities* p, __u32 priority, int delta)
+{
+  unsigned int i = 0;
+  while (i < p->length && p->counts[i].priority < priority) {
+    i++;
+  }
+  if (i < p->length && p->counts[i].priority == priority) {
+    p->counts[i].count += delta;
+    if (p->counts[i].count == 0) {
+      memmove(&p->counts[i], &p->counts[i + 1], (p->length - i - 1) * sizeof(p->counts[0]));
+      p->length -= 1;
+    }
+    return 0;
+  } else if (delta < 0) {
+    return 0;
+  }
+  if (p->length == p->capacity) {
+    unsigned int capacity = p->capacity ? 2 * p->capacity : 4;
+    struct ashp4c_tuple_count* counts = realloc(p->counts, capacity * sizeof(counts[0]));
+    if (!counts) {
+      errno = ENOMEM;
+      return -1;
+    }
+    p->counts = counts;
+    p->capacity = capacity;
+  }
+  memmove(&p->counts[i + 1], &p->counts[i], (p->length - i) * sizeof(p->counts[0]));
+  p->counts[i].priority = priority;
+  p->counts[i].count = 1;
+  p->length += 1;
+  return 0;
+}
+
+/* The highest priority of the entries under the mask `id`. */
+static inline __u32
+ashp4c_tuple_max_priority(struct ashp4c_tuple_table* table, __u32 id)
+{
+  struct ashp4c_tuple_priorities* p = &table->priorities[id];
+  return p->length ? p->counts[p->length - 1].priority : 0;
+}
+
+static inline void
+ashp4c_tuple_free(struct ashp4c_tuple_table* table)
+{
+  int i;
+  for (i = 0; i < ASHP4C_TUPLE_MAX_MASKS; i++) {
+    free(table->priorities[i].counts);
+    memset(&table->priorities[i], 0, sizeof(table->priorities[i]));
+  }
+  table->is_loaded = 0;
+}
+
+/* Counts the priorities of the entries in the map, the const ones among them, once per handle. */
+static inline int
+ashp4c_tuple_load(struct ashp4c_tuple_table* table)
+{
+  unsigned char key[ASHP4C_TUPLE_MAX_KEY], next[ASHP4C_TUPLE_MAX_KEY], value[ASHP4C_TUPLE_MAX_KEY];
+  __u32 priority, tuple;
+  void* previous = 0;
+  if (table->is_loaded) {
+    return 0;
+  } else if (table->key_size > ASHP4C_TUPLE_MAX_KEY || table->value_size > ASHP4C_TUPLE_MAX_KEY) {
+    errno = EINVAL;
+    return -1;
+  }
+  while (bpf_map_get_next_key(table->map_fd, previous, next) == 0) {
+    memcpy(key, next, table->key_size);
+    previous = key;
+    memcpy(&tuple, key, 4);
+    if (tuple < ASHP4C_TUPLE_MAX_MASKS && bpf_map_lookup_elem(table->map_fd, key, value) == 0) {
+      memcpy(&priority, value + 4, 4);
+      if (ashp4c_tuple_count(&table->priorities[tuple], priority, 1) != 0) {
+        ashp4c_tuple_free(table);
+        return -1;
+      }
+    }
+  }
+  table->is_loaded = 1;
+  return 0;
+}
+
+/* The first element of the mask array in use: 0 or ASHP4C_TUPLE_MAX_MASKS. */
+static inline int
+ashp4c_tuple_in_use(struct ashp4c_tuple_table* table)
+{
+  unsigned char record[8 + ASHP4C_TUPLE_MAX_KEY];
+  __u32 i = 2 * ASHP4C_TUPLE_MAX_MASKS, half;
+  if (bpf_map_lookup_elem(table->masks_fd, &i, record) != 0) {
+    return -1;
+  }
+  memcpy(&half, record, 4);
+  return half ? ASHP4C_TUPLE_MAX_MASKS : 0;
+}
+
+static inline int
+ashp4c_tuple_read_masks(struct ashp4c_tuple_table* table, struct ashp4c_tuple_mask* masks)
+{
+  unsigned char record[8 + ASHP4C_TUPLE_MAX_KEY];
+  int first = ashp4c_tuple_in_use(table);
+  __u32 i, index;
+  if (first < 0) {
+    return -1;
+  }
+  for (i = 0; i < ASHP4C_TUPLE_MAX_MASKS; i++) {
+    index = first + i;
+    if (bpf_map_lookup_elem(table->masks_fd, &index, record) != 0) {
+      return -1;
+    }
+    memcpy(&masks[i].priority, record, 4);
+    memcpy(&masks[i].count, record + 4, 4);
+    memcpy(masks[i].mask, record + 8, table->key_size);
+    if (masks[i].priority == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+/*
+ * Writes `count` masks by descending priority, and the end of the array after
+ * them, to the mask array not in use; then makes the program read that one.
+ */
+static inline int
+ashp4c_tuple_write_masks(struct ashp4c_tuple_table* table, struct ashp4c_tuple_mask* masks, int count)
+{
+  unsigned char record[8 + ASHP4C_TUPLE_MAX_KEY];
+  struct ashp4c_tuple_mask m;
+  int first = ashp4c_tuple_in_use(table);
+  __u32 i, j, index, half;
+  if (first < 0) {
+    return -1;
+  }
+  for (i = 1; i < (__u32)count; i++) {
+    for (j = i; j > 0 && masks[j - 1].priority < masks[j].priority; j--) {
+      m = masks[j];
+      masks[j] = masks[j - 1];
+      masks[j - 1] = m;
+    }
+  }
+  for (i = 0; i < ASHP4C_TUPLE_MAX_MASKS && i <= (__u32)count; i++) {
+    memset(record, 0, sizeof(record));
+    if (i < (__u32)count) {
+      memcpy(record, &masks[i].priority, 4);
+      memcpy(record + 4, &masks[i].count, 4);
+      memcpy(record + 8, masks[i].mask, table->key_size);
+    }
+    index = ASHP4C_TUPLE_MAX_MASKS - first + i;
+    if (bpf_map_update_elem(table->masks_fd, &index, record, BPF_ANY) != 0) {
+      return -1;
+    }
+  }
+  memset(record, 0, sizeof(record));
+  half = first ? 0 : 1;
+  memcpy(record, &half, 4);
+  index = 2 * ASHP4C_TUPLE_MAX_MASKS;
+  return bpf_map_update_elem(table->masks_fd, &index, record, BPF_ANY);
+}
+
+/* Index in `masks` of the mask with the fields of `mask`, or -1. */
+static inline int
+ashp4c_tuple_find_mask(struct ashp4c_tuple_table* table, struct ashp4c_tuple_mask* masks, int count, const void* mask)
+{
+  int i;
+  for (i = 0; i < count; i++) {
+    if (!memcmp(masks[i].mask + 4, (const unsigned char*)mask + 4, table->key_size - 4)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static inline void
+ashp4c_tuple_masked_key(struct ashp4c_tuple_table* table, unsigned char* masked, const void* key, const void* mask,
+                        __u32 id)
+{
+  unsigned int i;
+  memcpy(masked, &id, 4);
+  for (i = 4; i < table->key_size; i++) {
+    masked[i] = ((const unsigned char*)key)[i] & ((const unsigned char*)mask)[i];
+  }
+}
+
+/*
+ * Adds or replaces the entry for `key` under `mask`.  Where several entries
+ * match a packet, the one with the highest `priority` wins; it must be at least
+ * 1, and two entries that can match the same packet should not share one.
+ * Sets errno to ENOSPC if the table already has ASHP4C_TUPLE_MAX_MASKS masks.
+ */
+static inline int
+ashp4c_tuple_insert(struct ashp4c_tuple_table* table, const void* key, const void* mask, void* value, __u32 priority)
+{
+  struct ashp4c_tuple_mask masks[ASHP4C_TUPLE_MAX_MASKS];
+  unsigned char masked[ASHP4C_TUPLE_MAX_KEY], old[ASHP4C_TUPLE_MAX_KEY];
+  __u32 id = 0;
+  int count, i, j;
+  if (priority == 0 || table->key_size > ASHP4C_TUPLE_MAX_KEY || table->value_size > ASHP4C_TUPLE_MAX_KEY) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ashp4c_tuple_load(table) != 0) {
+    return -1;
+  }
+  count = ashp4c_tuple_read_masks(table, masks);
+  if (count < 0) {
+    return -1;
+  }
+  i = ashp4c_tuple_find_mask(table, masks, count, mask);
+  if (i < 0) {
+    if (count == ASHP4C_TUPLE_MAX_MASKS) {
+      errno = ENOSPC;
+      return -1;
+    }
+    /* The smallest id no mask has. */
+    for (j = 0; j < count; j++) {
+      __u32 other;
+      memcpy(&other, masks[j].mask, 4);
+      if (other == id) {
+        id += 1;
+        j = -1;
+      }
+    }
+    i = count++;
+    memset(&masks[i], 0, sizeof(masks[i]));
+    memcpy(masks[i].mask, mask, table->key_size);
+    memcpy(masks[i].mask, &id, 4);
+  }
+  memcpy(&id, masks[i].mask, 4);
+  ashp4c_tuple_masked_key(table, masked, key, mask, id);
+  int replaced = bpf_map_lookup_elem(table->map_fd, masked, old) == 0;
+  memcpy((unsigned char*)value + 4, &priority, 4);
+  if (ashp4c_tuple_count(&table->priorities[id], priority, 1) != 0) {
+    return -1;
+  }
+  /* The entry is in the map before its mask can lead to it. */
+  if (bpf_map_update_elem(table->map_fd, masked, value, BPF_ANY) != 0) {
+    ashp4c_tuple_count(&table->priorities[id], priority, -1);
+    return -1;
+  }
+  if (replaced) {
+    __u32 old_priority;
+    memcpy(&old_priority, old + 4, 4);
+    ashp4c_tuple_count(&table->priorities[id], old_priority, -1);
+  } else {
+    masks[i].count += 1;
+  }
+  masks[i].priority = ashp4c_tuple_max_priority(table, id);
+  return ashp4c_tuple_write_masks(table, masks, count);
+}
+
+/* Removes the entry for `key` under `mask`; sets errno to ENOENT if there is none. */
+static inline int
+ashp4c_tuple_delete(struct ashp4c_tuple_table* table, const void* key, const void* mask)
+{
+  struct ashp4c_tuple_mask masks[ASHP4C_TUPLE_MAX_MASKS];
+  unsigned char masked[ASHP4C_TUPLE_MAX_KEY], old[ASHP4C_TUPLE_MAX_KEY];
+  __u32 id, priority;
+  int count, i;
+  if (ashp4c_tuple_load(table) != 0) {
+    return -1;
+  }
+  count = ashp4c_tuple_read_masks(table, masks);
+  if (count < 0) {
+    return -1;
+  }
+  i = ashp4c_tuple_find_mask(table, masks, count, mask);
+  if (i < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  memcpy(&id, masks[i].mask, 4);
+  ashp4c_tuple_masked_key(table, masked, key, mask, id);
+  if (bpf_map_lookup_elem(table->map_fd, masked, old) != 0 || bpf_map_delete_elem(table->map_fd, masked) != 0) {
+    return -1;
+  }
+  memcpy(&priority, old + 4, 4);
+  ashp4c_tuple_count(&table->priorities[id], priority, -1);
+  masks[i].count -= 1;
+  if (masks[i].count == 0) {
+    masks[i] = masks[--count];
+  } else {
+    masks[i].priority = ashp4c_tuple_max_priority(table, id);
+  }
+  return ashp4c_tuple_write_masks(table, masks, count);
+}
@@ -110,12 +110,15 @@ static int load_and_attach(const char *event, struct bpf_insn *prog, int size)
 
   prog_fd[prog_cnt++] = fd;
 
-  if (is_xdp || is_perf_event || is_cgroup_skb || is_cgroup_sk)
+  if (is_perf_event || is_cgroup_skb || is_cgroup_sk)
     return 0;
 
-  if (is_socket || is_sockops || is_sk_skb) {
+  /* "xdp/<n>" is the program tail-called through index n of the program array. */
+  if (is_socket || is_sockops || is_sk_skb || is_xdp) {
     if (is_socket)
       event += 6;
+    else if (is_xdp)
+      event += 3;
     else
       event += 7;
     if (*event != '/')
@@ -25,4 +25,11 @@ clang -g -ggdb -static $LINUX_INCLUDE -O0 -Wall $SRC/xdp_ip_fixup.c -o xdp_ip_fi
 
 clang $LINUX_INCLUDE -O2 -Wall -target bpf -c $SRC/count_packets_kern.c -o count_packets_kern.o
 clang -g -ggdb -static $LINUX_INCLUDE -O0 -Wall $SRC/count_packets.c -o count_packets -L $SRC bpf_load.o -lbpf -lelf -lz
+
+clang -g -ggdb -static $LINUX_INCLUDE -O0 -Wall $SRC/test_run.c -o test_run -L $SRC bpf_load.o -lbpf -lelf -lz
+clang -g -ggdb $LINUX_INCLUDE -O2 -Wall $SRC/ubpf_run.c -o ubpf_run -lpthread
+
+# The control plane of tuple space tables, on real maps: needs root.
+clang -g -ggdb -static $LINUX_INCLUDE -O0 -Wall $SRC/tuple_test.c -o tuple_test -L $SRC -lbpf -lelf -lz
+./tuple_test
 popd
@@ -0,0 +1,204 @@
+/*
+ * The packets test_run and ubpf_run go over: read from a pcap file of
+ * Ethernet frames, or generated from a seed, the same for the same seed; and
+ * the pcap files they write of them.
+ */
+#ifndef __TEST_PACKETS_H
+#define __TEST_PACKETS_H
+
+#include <linux/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_PACKET_SIZE   65536
+#define PCAP_MAGIC        0xa1b2c3d4
+#define PCAP_MAGIC_NSEC   0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+
+struct packet {
+  __u32 size;
+  unsigned char *data;
+};
+
+struct pcap_file_header {
+  __u32 magic;
+  __u16 version_major;
+  __u16 version_minor;
+  __s32 thiszone;
+  __u32 sigfigs;
+  __u32 snaplen;
+  __u32 linktype;
+};
+
+struct pcap_record_header {
+  __u32 ts_sec;
+  __u32 ts_usec;
+  __u32 caplen;
+  __u32 len;
+};
+
+static __u32 swap32(__u32 x)
+{
+  return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+/* The packets of `path`, or NULL; their number in `count`. */
+static struct packet *read_pcap(const char *path, int *count)
+{
+  struct pcap_file_header header;
+  struct pcap_record_header record;
+  struct packet *packets = NULL;
+  int capacity = 0;
+  bool is_swapped;
+  FILE *f = fopen(path, "rb");
+
+  *count = 0;
+  if (!f) {
+    printf("ERROR: cannot open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1) {
+    printf("ERROR: %s is not a pcap file\n", path);
+    fclose(f);
+    return NULL;
+  }
+  is_swapped = header.magic == swap32(PCAP_MAGIC) || header.magic == swap32(PCAP_MAGIC_NSEC);
+  if (!is_swapped && header.magic != PCAP_MAGIC && header.magic != PCAP_MAGIC_NSEC) {
+    printf("ERROR: %s is not a pcap file\n", path);
+    fclose(f);
+    return NULL;
+  }
+  if ((is_swapped ? swap32(header.linktype) : header.linktype) != LINKTYPE_ETHERNET) {
+    printf("ERROR: %s does not hold Ethernet frames\n", path);
+    fclose(f);
+    return NULL;
+  }
+  while (fread(&record, sizeof(record), 1, f) == 1) {
+    __u32 size = is_swapped ? swap32(record.caplen) : record.caplen;
+    if (size > MAX_PACKET_SIZE) {
+      printf("ERROR: %s: packet %d is %u bytes long\n", path, *count, size);
+      break;
+    }
+    if (*count == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      packets = realloc(packets, capacity * sizeof(*packets));
+      assert(packets);
+    }
+    packets[*count].size = size;
+    packets[*count].data = malloc(size ? size : 1);
+    assert(packets[*count].data);
+    if (fread(packets[*count].data, 1, size, f) != size) {
+      break;
+    }
+    *count += 1;
+  }
+  fclose(f);
+  return packets;
+}
+
+static int write_pcap(const char *path, struct packet *packets, int count)
+{
+  struct pcap_file_header header = {PCAP_MAGIC, 2, 4, 0, 0, MAX_PACKET_SIZE, LINKTYPE_ETHERNET};
+  struct pcap_record_header record = {0, 0, 0, 0};
+  FILE *f = fopen(path, "wb");
+  int i;
+
+  if (!f) {
+    printf("ERROR: cannot open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  for (i = 0; i < count; i++) {
+    record.ts_usec = i;
+    record.caplen = record.len = packets[i].size;
+    fwrite(&record, sizeof(record), 1, f);
+    fwrite(packets[i].data, 1, packets[i].size, f);
+  }
+  fclose(f);
+  return 0;
+}
+
+static __u32 random_state;
+
+static __u32 next_random(void)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+/* The ones' complement sum of the IPv4 header at `ip`, to go in its checksum field. */
+static __u16 ipv4_checksum(const unsigned char *ip)
+{
+  __u32 sum = 0;
+  int k;
+
+  for (k = 0; k < 20; k += 2)
+    sum += (ip[k] << 8) | ip[k + 1];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+/*
+ * Ethernet frames the testdata programs parse: IPv4 over UDP or TCP, some
+ * behind a VLAN tag, with addresses from small pools so that tables hit,
+ * and a few other ether types and truncated frames.  The IPv4 headers have
+ * valid checksums, so that updating one incrementally and recomputing it in
+ * full give the same packets.
+ */
+static struct packet *generate_packets(int count, __u32 seed)
+{
+  struct packet *packets = calloc(count, sizeof(*packets));
+  int i, k;
+
+  assert(packets);
+  random_state = seed ? seed : 1;
+  for (i = 0; i < count; i++) {
+    unsigned char *p = calloc(1, 128);
+    __u32 kind = next_random() % 16;
+    __u16 checksum;
+    int at = 12;
+
+    assert(p);
+    for (k = 0; k < 12; k++)
+      p[k] = k < 6 ? (k == 5 ? next_random() % 4 : 0) : next_random();
+    if (kind < 3) {
+      p[at++] = 0x81;
+      p[at++] = 0x00;
+      p[at++] = next_random() % 16;
+      p[at++] = next_random();
+    }
+    if (kind == 15) {
+      p[at++] = 0x08;
+      p[at++] = 0x06;
+    } else {
+      p[at++] = 0x08;
+      p[at++] = 0x00;
+    }
+    p[at] = 0x45;
+    p[at + 2] = 0;
+    p[at + 3] = 20 + 8 + 32;
+    p[at + 8] = 1 + next_random() % 64;
+    p[at + 9] = kind % 2 ? 6 : 17;
+    for (k = 0; k < 4; k++) {
+      p[at + 12 + k] = k == 0 ? 10 : (k == 3 ? next_random() % 8 : 0);
+      p[at + 16 + k] = k == 0 ? 10 : (k == 3 ? next_random() % 8 : 0);
+    }
+    checksum = ipv4_checksum(p + at);
+    p[at + 10] = checksum >> 8;
+    p[at + 11] = checksum;
+    for (k = 0; k < 4; k++)
+      p[at + 20 + k] = next_random();
+    packets[i].data = p;
+    packets[i].size = kind == 14 ? at + 10 : at + 60;
+  }
+  return packets;
+}
+
+#endif /* __TEST_PACKETS_H */
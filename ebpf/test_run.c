@@ -0,0 +1,200 @@
+/*
+ * Runs a compiled XDP object over packets with BPF_PROG_TEST_RUN: no
+ * interface is attached, so it only needs root.  The packets come from a
+ * pcap file, or from a generator seeded for the same packets on every run.
+ *
+ *   test_run prog.bpf.o                      # 1000 generated packets
+ *   test_run -r 10000 -o out.pcap prog.bpf.o in.pcap
+ *   test_run -e out.pcap prog.bpf.o in.pcap  # compare with the output of another run
+ *   test_run -w in.pcap -o out.pcap prog.bpf.o  # keep the generated packets, for `ashp4c --run`
+ *
+ * Reports the ns/packet the kernel measured over the repeats, how many
+ * packets got each verdict, and how many the program changed.
+ */
+#include <linux/bpf.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/syscall.h>
+
+#include "bpf_load.h"
+#include "bpf_util.h"
+#include "libbpf.h"
+#include "test_packets.h"
+
+static const char *verdict_names[] = {"ABORTED", "DROP", "PASS", "TX", "REDIRECT"};
+
+/*
+ * BPF_PROG_TEST_RUN, with the room in `data_out` given in `*size_out`.  The
+ * bpf_prog_test_run of this libbpf passes no size, and the kernel then copies
+ * out the whole packet, however much the program grew it; with one, a packet
+ * that does not fit fails with ENOSPC.
+ */
+static int prog_test_run(int prog_fd, int repeat, void *data, __u32 size, void *data_out, __u32 *size_out,
+                         __u32 *retval, __u32 *duration)
+{
+  union bpf_attr attr;
+  int err;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.test.prog_fd = prog_fd;
+  attr.test.repeat = repeat;
+  attr.test.data_in = (__u64)(unsigned long)data;
+  attr.test.data_size_in = size;
+  attr.test.data_out = (__u64)(unsigned long)data_out;
+  attr.test.data_size_out = *size_out;
+  err = syscall(__NR_bpf, BPF_PROG_TEST_RUN, &attr, sizeof(attr));
+  *size_out = attr.test.data_size_out;
+  *retval = attr.test.retval;
+  *duration = attr.test.duration;
+  return err;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "usage: %s [OPTS] PROGRAM.o [PACKETS.pcap]\n\n"
+    "OPTS:\n"
+    "    -r N       runs of each packet, default 1000\n"
+    "    -n N       packets to generate without a pcap file, default 1000\n"
+    "    -s SEED    seed of the generated packets, default 1\n"
+    "    -o FILE    write the packets the program outputs to a pcap file\n"
+    "    -e FILE    compare the outputs with a pcap file written by -o\n"
+    "    -w FILE    write the input packets to a pcap file\n"
+    "    -v         print each packet that differs\n",
+    prog);
+}
+
+int main(int argc, char **argv)
+{
+  const char *optstr = "r:n:s:o:e:w:v";
+  const char *out_path = NULL, *expect_path = NULL, *in_path = NULL;
+  struct packet *packets, *outputs, *expected = NULL;
+  unsigned char *out;
+  __u32 out_room;
+  int repeat = 1000, count = 1000, expected_count = 0;
+  int verdicts[5] = {0, 0, 0, 0, 0}, others = 0;
+  int changed = 0, resized = 0, mismatched = 0;
+  __u32 seed = 1;
+  bool is_verbose = false;
+  double total_ns = 0;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, optstr)) != -1) {
+    switch (opt) {
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'e':
+      expect_path = optarg;
+      break;
+    case 'w':
+      in_path = optarg;
+      break;
+    case 'v':
+      is_verbose = true;
+      break;
+    default:
+      usage(basename(argv[0]));
+      return 1;
+    }
+  }
+  if (optind == argc || repeat <= 0 || count <= 0) {
+    usage(basename(argv[0]));
+    return 1;
+  }
+
+  if (load_bpf_file(argv[optind])) {
+    printf("%s", bpf_log_buf);
+    return 1;
+  }
+  if (!prog_fd[0]) {
+    printf("ERROR: load_bpf_file: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (optind + 1 < argc) {
+    packets = read_pcap(argv[optind + 1], &count);
+    if (!packets)
+      return 1;
+  } else {
+    packets = generate_packets(count, seed);
+  }
+  if (in_path && write_pcap(in_path, packets, count))
+    return 1;
+  if (expect_path) {
+    expected = read_pcap(expect_path, &expected_count);
+    if (!expected)
+      return 1;
+  }
+
+  /* A packet the program moved the start of into the headroom is longer than it came. */
+  out_room = MAX_PACKET_SIZE + XDP_PACKET_HEADROOM;
+  out = malloc(out_room);
+  outputs = calloc(count, sizeof(*outputs));
+  assert(out && outputs);
+  for (i = 0; i < count; i++) {
+    __u32 size_out = out_room, retval = 0, duration = 0;
+    int diff_at = -1, k;
+
+    if (prog_test_run(prog_fd[0], repeat, packets[i].data, packets[i].size, out, &size_out, &retval, &duration)) {
+      printf("ERROR: BPF_PROG_TEST_RUN of packet %d: %s\n", i, strerror(errno));
+      return 1;
+    }
+    total_ns += duration;
+    if (retval < 5)
+      verdicts[retval] += 1;
+    else
+      others += 1;
+    outputs[i].size = size_out;
+    outputs[i].data = malloc(size_out ? size_out : 1);
+    assert(outputs[i].data);
+    memcpy(outputs[i].data, out, size_out);
+
+    resized += size_out != packets[i].size;
+    changed += size_out != packets[i].size || memcmp(out, packets[i].data, size_out) != 0;
+    if (expected && i < expected_count) {
+      for (k = 0; k < size_out && k < expected[i].size && out[k] == expected[i].data[k]; k++)
+        ;
+      if (k < size_out || k < expected[i].size)
+        diff_at = k;
+    } else if (expected) {
+      diff_at = 0;
+    }
+    if (diff_at >= 0) {
+      mismatched += 1;
+      if (is_verbose)
+        printf("packet %d: %s, %u -> %u bytes, differs from the expected output at byte %d\n", i,
+               retval < 5 ? verdict_names[retval] : "?", packets[i].size, size_out, diff_at);
+    }
+  }
+
+  printf("%d packets, %d runs each: %.1f ns/packet\n", count, repeat, total_ns / count);
+  printf("verdicts:");
+  for (i = 0; i < 5; i++)
+    printf(" %s %d", verdict_names[i], verdicts[i]);
+  if (others)
+    printf(" other %d", others);
+  printf("\noutputs: %d changed, %d resized\n", changed, resized);
+  if (expected)
+    printf("expected: %d of %d differ%s\n", mismatched, count,
+           expected_count != count ? " (not as many packets)" : "");
+  if (out_path && write_pcap(out_path, outputs, count))
+    return 1;
+  return mismatched ? 2 : 0;
+}
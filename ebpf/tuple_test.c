@@ -0,0 +1,209 @@
+/*
+ * Exercises ashp4c_tuple.h on real maps: random inserts, priority changes
+ * and deletes of ternary entries under a handful of masks, checked against
+ * a model of the table after each change.  Needs root, for the maps.
+ *
+ *   tuple_test [-n CHANGES] [-s SEED]
+ *
+ * After each change the mask array the program reads must list every mask
+ * in use, by descending highest priority, with the count of its entries; a
+ * lookup done the way the program does it must find the entry of highest
+ * priority that matches; and the element at 2 * ASHP4C_TUPLE_MAX_MASKS must
+ * select that array.  Halfway, the handle is freed, so that the rest runs on
+ * counts loaded from the map.
+ */
+#include <linux/bpf.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ashp4c_tuple.h"
+
+#define ENTRIES      200
+#define MASKS        6
+#define PRIORITIES   100000
+
+/* struct control_table_key and struct control_table_value of a table with two keys */
+struct key {
+  __u32 tuple;
+  __u32 a;
+  __u32 b;
+};
+
+struct value {
+  __u32 action;
+  __u32 priority;
+  __u32 arg;
+};
+
+struct entry {
+  struct key key;
+  struct key mask;
+  __u32 priority;
+  int is_live;
+};
+
+static struct entry model[ENTRIES];
+static struct key masks[MASKS];
+static char is_used[PRIORITIES];
+
+/* Which of the two mask arrays the program reads: the index of its first element. */
+static __u32 array_in_use(int masks_fd)
+{
+  __u32 index = 2 * ASHP4C_TUPLE_MAX_MASKS;
+  struct ashp4c_tuple_mask flip;
+  int err = bpf_map_lookup_elem(masks_fd, &index, &flip);
+
+  assert(err == 0);
+  return flip.priority ? ASHP4C_TUPLE_MAX_MASKS : 0;
+}
+
+/* The mask array the program reads, against the model. */
+static void check_masks(struct ashp4c_tuple_table *table)
+{
+  struct ashp4c_tuple_mask array[ASHP4C_TUPLE_MAX_MASKS];
+  int count = ashp4c_tuple_read_masks(table, array);
+  int expected = 0, i, j, e;
+
+  assert(count >= 0);
+  for (i = 1; i < count; i++)
+    assert(array[i - 1].priority >= array[i].priority);
+  for (i = 0; i < MASKS; i++) {
+    __u32 highest = 0, entries = 0;
+    int found = -1;
+
+    for (e = 0; e < ENTRIES; e++) {
+      if (model[e].is_live && !memcmp(&model[e].mask.a, &masks[i].a, 8)) {
+        entries++;
+        highest = model[e].priority > highest ? model[e].priority : highest;
+      }
+    }
+    for (j = 0; j < count; j++) {
+      if (!memcmp(array[j].mask + 4, &masks[i].a, 8))
+        found = j;
+    }
+    if (entries == 0) {
+      assert(found < 0);
+      continue;
+    }
+    expected++;
+    assert(found >= 0);
+    assert(array[found].count == entries);
+    assert(array[found].priority == highest);
+  }
+  assert(count == expected);
+
+  /* Lookups as the program does them: masks in order, until none can beat the best match. */
+  for (i = 0; i < 50; i++) {
+    struct key key = {0, rand() % 8, rand() % 8};
+    __u32 best = 0, want = 0;
+
+    for (e = 0; e < ENTRIES; e++) {
+      if (model[e].is_live && (key.a & model[e].mask.a) == model[e].key.a
+          && (key.b & model[e].mask.b) == model[e].key.b && model[e].priority > want)
+        want = model[e].priority;
+    }
+    for (j = 0; j < count && array[j].priority > best; j++) {
+      struct key masked;
+      struct value value;
+
+      memcpy(&masked, array[j].mask, sizeof(masked));
+      masked.a &= key.a;
+      masked.b &= key.b;
+      if (bpf_map_lookup_elem(table->map_fd, &masked, &value) == 0 && value.priority > best)
+        best = value.priority;
+    }
+    assert(best == want);
+  }
+}
+
+/* Gives entry `e` a new priority, and a new key and mask if it has none. */
+static int insert(struct ashp4c_tuple_table *table, int e)
+{
+  struct entry *entry = &model[e];
+  struct value value = {1, 0, e};
+  __u32 priority;
+  int i;
+
+  if (!entry->is_live) {
+    entry->mask = masks[rand() % MASKS];
+    entry->key.a = (rand() % 8) & entry->mask.a;
+    entry->key.b = (rand() % 8) & entry->mask.b;
+  }
+  for (i = 0; i < ENTRIES; i++) {
+    if (i != e && model[i].is_live && !memcmp(&model[i].key.a, &entry->key.a, 8)
+        && !memcmp(&model[i].mask.a, &entry->mask.a, 8))
+      return 0;  /* another entry has this key */
+  }
+  do {
+    priority = 1 + rand() % (PRIORITIES - 1);
+  } while (is_used[priority]);
+  if (entry->is_live)
+    is_used[entry->priority] = 0;
+  is_used[priority] = 1;
+  entry->priority = priority;
+  entry->is_live = 1;
+  assert(ashp4c_tuple_insert(table, &entry->key, &entry->mask, &value, priority) == 0);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int changes = 3000, flips = 0, opt, i, step;
+  unsigned int seed = 1;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      changes = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n CHANGES] [-s SEED]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  int map_fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct key), sizeof(struct value), 1024, 0);
+  int masks_fd = bpf_create_map(BPF_MAP_TYPE_ARRAY, 4, 8 + sizeof(struct key), 2 * ASHP4C_TUPLE_MAX_MASKS + 1, 0);
+  if (map_fd < 0 || masks_fd < 0) {
+    printf("ERROR: bpf_create_map: %s\n", strerror(errno));
+    return 1;
+  }
+  struct ashp4c_tuple_table table = {map_fd, masks_fd, sizeof(struct key), sizeof(struct value)};
+
+  for (i = 0; i < MASKS; i++) {
+    masks[i].a = (i & 1) ? 7 : (i & 2) ? 3 : 0;
+    masks[i].b = i < 2 ? 7 : i < 4 ? 1 : 6;
+  }
+  srand(seed);
+  for (step = 0; step < changes; step++) {
+    int e = rand() % ENTRIES;
+    __u32 before = array_in_use(masks_fd);
+
+    if (step == changes / 2)
+      ashp4c_tuple_free(&table);
+    if (!model[e].is_live || rand() % 3) {
+      if (!insert(&table, e))
+        continue;
+    } else {
+      assert(ashp4c_tuple_delete(&table, &model[e].key, &model[e].mask) == 0);
+      is_used[model[e].priority] = 0;
+      model[e].is_live = 0;
+    }
+    flips += array_in_use(masks_fd) != before;
+    check_masks(&table);
+  }
+
+  /* A mask no entry has. */
+  struct key key = {0, 1, 1}, mask = {0, 5, 5};
+  assert(ashp4c_tuple_delete(&table, &key, &mask) == -1);
+  ashp4c_tuple_free(&table);
+  printf("tuple_test: %d changes, %d flipped the mask array\n", changes, flips);
+  return 0;
+}
@@ -0,0 +1,1063 @@
+/*
+ * Runs an object compiled with --target=ubpf over packets in userspace: no
+ * verifier and no kernel, so it runs what the kernel would not load, and on
+ * as many cores as there are.  Each thread is a BPF VM of its own, with its
+ * stack and packet buffer, that takes batches of packets off a shared
+ * cursor; the maps are shared by every VM, the hash tables lock-free and
+ * the per-CPU maps with a copy of each value per VM.
+ *
+ *   ubpf_run prog.ubpf.o                       # 1000 generated packets, a VM per core
+ *   ubpf_run -j 4 -b 64 -r 1000 -o out.pcap prog.ubpf.o in.pcap
+ *   ubpf_run -j 1 -b 1 -e out.pcap prog.ubpf.o in.pcap  # in order, to compare with another run
+ *
+ * The program sees a struct ubpf_md: data and data_end as 64-bit pointers,
+ * then the ingress ifindex, which is 1 as for test_run.  Loads and stores
+ * out of the stack, the packet, the context or a map stop the run with the
+ * instruction that made them.  The helpers are the kernel ones the compiler
+ * calls, with their ids, and lookup3 over the bytes of the `hash` extern.
+ *
+ * Reports the ns/packet the VMs took over the repeats, the packets per
+ * second of all of them, how many packets got each verdict, and how many
+ * the program changed.
+ */
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <assert.h>
+#include <elf.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "test_packets.h"
+
+#define UBPF_STACK_SIZE        512
+#define UBPF_HEADROOM          256
+#define UBPF_MAX_TAIL_CALLS    33
+#define UBPF_MAX_BACK_JUMPS    (1 << 20)
+#define UBPF_MAX_PROGS         64
+#define UBPF_FUNC_hash_lookup3 256
+#define UBPF_INGRESS_IFINDEX   1
+
+/* What the compiler loads the packet from, at the offsets of emit_bpf.c. */
+struct ubpf_md {
+  __u64 data;
+  __u64 data_end;
+  __u32 ingress_ifindex;
+  __u32 cpu;
+};
+
+/* The definitions of the "maps" section, one per map symbol. */
+struct map_def {
+  __u32 type;
+  __u32 key_size;
+  __u32 value_size;
+  __u32 max_entries;
+  __u32 map_flags;
+  __u32 inner_map_idx;
+  __u32 numa_node;
+};
+
+struct prog {
+  char name[32];
+  struct bpf_insn *insns;
+  int insn_count;
+};
+
+/*
+ * A map, shared by every VM.  Arrays hold their values one after the other,
+ * the copies of a per-CPU array a whole array apart.  Hash tables, and the
+ * LPM tries that are a hash table per prefix length, hold slots of a state,
+ * the key and the copies of the value, probed linearly from the hash of the
+ * key: a slot goes from empty to busy by compare-and-swap, then to full
+ * once its key and value are written, and never back, so that a lookup
+ * needs no lock.
+ */
+struct map {
+  const char *name;
+  __u32 type;
+  __u32 key_size;
+  __u32 value_size;
+  __u32 max_entries;
+  __u32 value_stride;  /* value_size rounded up to 8 */
+  __u32 copies;        /* of each value: one per VM for per-CPU maps */
+  unsigned char *data;
+  size_t data_size;
+  __u32 slot_size;
+  __u32 slot_mask;
+  __u32 count;          /* of the slots taken, atomic */
+  __u64 *prefix_lens;   /* the prefix lengths an LPM trie holds, atomic bits */
+};
+
+enum {
+  SLOT_EMPTY = 0,
+  SLOT_BUSY = 1,  /* being written */
+  SLOT_FULL = 2,
+  SLOT_DEAD = 3,  /* taken past max_entries */
+};
+
+struct vm {
+  pthread_t thread;
+  __u32 cpu;
+  __u64 stack[UBPF_STACK_SIZE / 8];
+  unsigned char *buf;
+  size_t buf_size;
+  struct ubpf_md md;
+  struct prog *prog;       /* running */
+  struct prog *tail_call;  /* to run once the helper returns */
+  int tail_calls;
+  double ns;
+};
+
+static const char *verdict_names[] = {"ABORTED", "DROP", "PASS", "TX", "REDIRECT"};
+
+static struct map *maps;
+static int map_count;
+static struct prog progs[UBPF_MAX_PROGS];
+static int prog_count;
+
+static struct packet *packets, *outputs;
+static __u32 *results;
+static int count, repeat = 1000, batch_size = 64;
+static int next_batch;  /* atomic */
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "usage: %s [OPTS] PROGRAM.o [PACKETS.pcap]\n\n"
+    "OPTS:\n"
+    "    -j N       VMs to run, each on a thread of its own, default one per core\n"
+    "    -b N       packets each VM takes at a time, default 64\n"
+    "    -r N       runs of each packet, default 1000\n"
+    "    -n N       packets to generate without a pcap file, default 1000\n"
+    "    -s SEED    seed of the generated packets, default 1\n"
+    "    -o FILE    write the packets the program outputs to a pcap file\n"
+    "    -e FILE    compare the outputs with a pcap file written by -o\n"
+    "    -w FILE    write the input packets to a pcap file\n"
+    "    -m         print how many elements each map holds at the end\n"
+    "    -v         print each packet that differs\n",
+    prog);
+}
+
+#define LOOKUP3_ROT(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+/* Bob Jenkins' lookup3 hashlittle(), initial value 0, as `ashp4c --run` has it. */
+static __u32 lookup3(const unsigned char *k, __u32 length)
+{
+  __u32 a, b, c;
+
+  a = b = c = 0xdeadbeef + length;
+  while (length > 12) {
+    a += k[0] + ((__u32)k[1] << 8) + ((__u32)k[2] << 16) + ((__u32)k[3] << 24);
+    b += k[4] + ((__u32)k[5] << 8) + ((__u32)k[6] << 16) + ((__u32)k[7] << 24);
+    c += k[8] + ((__u32)k[9] << 8) + ((__u32)k[10] << 16) + ((__u32)k[11] << 24);
+    a -= c; a ^= LOOKUP3_ROT(c, 4);  c += b;
+    b -= a; b ^= LOOKUP3_ROT(a, 6);  a += c;
+    c -= b; c ^= LOOKUP3_ROT(b, 8);  b += a;
+    a -= c; a ^= LOOKUP3_ROT(c, 16); c += b;
+    b -= a; b ^= LOOKUP3_ROT(a, 19); a += c;
+    c -= b; c ^= LOOKUP3_ROT(b, 4);  b += a;
+    length -= 12;
+    k += 12;
+  }
+  switch (length) {
+  case 12: c += (__u32)k[11] << 24;
+  case 11: c += (__u32)k[10] << 16;
+  case 10: c += (__u32)k[9] << 8;
+  case 9:  c += k[8];
+  case 8:  b += (__u32)k[7] << 24;
+  case 7:  b += (__u32)k[6] << 16;
+  case 6:  b += (__u32)k[5] << 8;
+  case 5:  b += k[4];
+  case 4:  a += (__u32)k[3] << 24;
+  case 3:  a += (__u32)k[2] << 16;
+  case 2:  a += (__u32)k[1] << 8;
+  case 1:  a += k[0];
+    break;
+  case 0:
+    return c;
+  }
+  c ^= b; c -= LOOKUP3_ROT(b, 14);
+  a ^= c; a -= LOOKUP3_ROT(c, 11);
+  b ^= a; b -= LOOKUP3_ROT(a, 25);
+  c ^= b; c -= LOOKUP3_ROT(b, 16);
+  a ^= c; a -= LOOKUP3_ROT(c, 4);
+  b ^= a; b -= LOOKUP3_ROT(a, 14);
+  c ^= b; c -= LOOKUP3_ROT(b, 24);
+  return c;
+}
+
+static double now_ns(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Stops the run at `insn`: `what` it did, of `size` bytes at `addr`, or of `addr` when `size` is 0. */
+static void vm_fault(struct vm *vm, const struct bpf_insn *insn, const char *what, __u64 addr, int size)
+{
+  printf("ERROR: %s: instruction %d: %s", vm->prog->name, (int)(insn - vm->prog->insns), what);
+  if (size > 0)
+    printf(" of %d bytes at 0x%llx", size, (unsigned long long)addr);
+  else if (size == 0)
+    printf(" 0x%llx", (unsigned long long)addr);
+  printf("\n");
+  exit(1);
+}
+
+/* The memory at `addr` a load or store of `size` bytes reaches, or the end of the run. */
+static inline unsigned char *vm_mem(struct vm *vm, const struct bpf_insn *insn, __u64 addr, int size,
+                                    bool is_write)
+{
+  int i;
+
+  if (addr - (__u64)(uintptr_t)vm->stack <= UBPF_STACK_SIZE - size)
+    return (unsigned char *)(uintptr_t)addr;
+  if (addr >= vm->md.data && addr + size <= vm->md.data_end)
+    return (unsigned char *)(uintptr_t)addr;
+  if (!is_write && addr - (__u64)(uintptr_t)&vm->md <= sizeof(vm->md) - size)
+    return (unsigned char *)(uintptr_t)addr;
+  for (i = 0; i < map_count; i++) {
+    __u64 start = (__u64)(uintptr_t)maps[i].data;
+    if (addr >= start && addr + size <= start + maps[i].data_size && maps[i].type != BPF_MAP_TYPE_PROG_ARRAY)
+      return (unsigned char *)(uintptr_t)addr;
+  }
+  vm_fault(vm, insn, is_write ? "out of bounds store" : "out of bounds load", addr, size);
+  return NULL;
+}
+
+static struct map *vm_map(struct vm *vm, const struct bpf_insn *insn, __u64 addr)
+{
+  struct map *map = (struct map *)(uintptr_t)addr;
+
+  if (map < maps || map >= maps + map_count)
+    vm_fault(vm, insn, "helper call on no map at", addr, 0);
+  return map;
+}
+
+static void map_alloc(struct map *map, const char *name, const struct map_def *def, int vm_count)
+{
+  __u32 slots = 16;
+
+  map->name = name;
+  map->type = def->type;
+  map->key_size = def->key_size;
+  map->value_size = def->value_size;
+  map->max_entries = def->max_entries;
+  map->value_stride = (def->value_size + 7) & ~7;
+  map->copies = 1;
+  switch (map->type) {
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+    map->copies = vm_count;
+    /* fall through */
+  case BPF_MAP_TYPE_ARRAY:
+    map->data_size = (size_t)map->copies * map->max_entries * map->value_stride;
+    break;
+  case BPF_MAP_TYPE_PROG_ARRAY:
+    map->value_stride = sizeof(struct prog *);
+    map->data_size = (size_t)map->max_entries * map->value_stride;
+    break;
+  case BPF_MAP_TYPE_PERCPU_HASH:
+    map->copies = vm_count;
+    /* fall through */
+  case BPF_MAP_TYPE_HASH:
+  case BPF_MAP_TYPE_LPM_TRIE:
+    while (slots < 2 * map->max_entries)
+      slots *= 2;
+    map->slot_size = 8 + ((map->key_size + 7) & ~7) + map->copies * map->value_stride;
+    map->slot_mask = slots - 1;
+    map->data_size = (size_t)slots * map->slot_size;
+    if (map->type == BPF_MAP_TYPE_LPM_TRIE) {
+      map->prefix_lens = calloc((map->key_size - 4) * 8 / 64 + 1, sizeof(__u64));
+      assert(map->prefix_lens);
+    }
+    break;
+  default:
+    printf("ERROR: map %s: type %u is not supported\n", name, map->type);
+    exit(1);
+  }
+  map->data = calloc(1, map->data_size ? map->data_size : 1);
+  assert(map->data);
+}
+
+static inline __u32 *slot_state(struct map *map, __u32 i)
+{
+  return (__u32 *)(map->data + (size_t)i * map->slot_size);
+}
+
+static inline unsigned char *slot_key(struct map *map, __u32 i)
+{
+  return map->data + (size_t)i * map->slot_size + 8;
+}
+
+static inline unsigned char *slot_value(struct map *map, __u32 i, __u32 cpu)
+{
+  return slot_key(map, i) + ((map->key_size + 7) & ~7) + (map->copies > 1 ? cpu : 0) * map->value_stride;
+}
+
+/* The slot of `key`, or of the empty slot its probe ends at with `*is_found` false. */
+static __u32 hash_probe(struct map *map, const unsigned char *key, bool *is_found)
+{
+  __u32 i = lookup3(key, map->key_size) & map->slot_mask;
+  __u32 n;
+
+  for (n = 0; n <= map->slot_mask; n++, i = (i + 1) & map->slot_mask) {
+    __u32 state = __atomic_load_n(slot_state(map, i), __ATOMIC_ACQUIRE);
+    while (state == SLOT_BUSY)
+      state = __atomic_load_n(slot_state(map, i), __ATOMIC_ACQUIRE);
+    if (state == SLOT_EMPTY) {
+      *is_found = false;
+      return i;
+    }
+    if (state == SLOT_FULL && memcmp(slot_key(map, i), key, map->key_size) == 0) {
+      *is_found = true;
+      return i;
+    }
+  }
+  *is_found = false;
+  return map->slot_mask + 1;
+}
+
+static unsigned char *hash_lookup(struct map *map, const unsigned char *key, __u32 cpu)
+{
+  bool is_found;
+  __u32 i = hash_probe(map, key, &is_found);
+
+  return is_found ? slot_value(map, i, cpu) : NULL;
+}
+
+static int hash_update(struct map *map, const unsigned char *key, const unsigned char *value, __u64 flags,
+                       __u32 cpu)
+{
+  for (;;) {
+    bool is_found;
+    __u32 i = hash_probe(map, key, &is_found);
+    __u32 empty = SLOT_EMPTY;
+
+    if (is_found) {
+      if (flags == BPF_NOEXIST)
+        return -EEXIST;
+      memcpy(slot_value(map, i, cpu), value, map->value_size);
+      return 0;
+    }
+    if (flags == BPF_EXIST)
+      return -ENOENT;
+    if (i > map->slot_mask)
+      return -E2BIG;
+    /* Another VM may take the slot first, with this key or another: probe again. */
+    if (!__atomic_compare_exchange_n(slot_state(map, i), &empty, SLOT_BUSY, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+      continue;
+    if (__atomic_fetch_add(&map->count, 1, __ATOMIC_RELAXED) >= map->max_entries) {
+      __atomic_fetch_sub(&map->count, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(slot_state(map, i), SLOT_DEAD, __ATOMIC_RELEASE);
+      return -E2BIG;
+    }
+    memcpy(slot_key(map, i), key, map->key_size);
+    memcpy(slot_value(map, i, cpu), value, map->value_size);
+    __atomic_store_n(slot_state(map, i), SLOT_FULL, __ATOMIC_RELEASE);
+    return 0;
+  }
+}
+
+/* The key of an LPM trie with the bits of its data past `prefix_len` cleared. */
+static void lpm_key(struct map *map, const unsigned char *key, __u32 prefix_len, unsigned char *masked)
+{
+  __u32 k;
+
+  memcpy(masked, &prefix_len, 4);
+  for (k = 0; k < map->key_size - 4; k++) {
+    if (8 * k + 8 <= prefix_len)
+      masked[4 + k] = key[4 + k];
+    else if (8 * k < prefix_len)
+      masked[4 + k] = key[4 + k] & (0xff << (8 - (prefix_len - 8 * k)));
+    else
+      masked[4 + k] = 0;
+  }
+}
+
+/* The longest prefix of the key that the trie holds, from the prefix lengths it holds. */
+static unsigned char *lpm_lookup(struct map *map, const unsigned char *key)
+{
+  unsigned char masked[260];
+  __u32 max_len = (map->key_size - 4) * 8;
+  __s64 len;
+  __u32 prefix_len;
+
+  memcpy(&prefix_len, key, 4);
+  if (prefix_len > max_len)
+    prefix_len = max_len;
+  for (len = prefix_len; len >= 0; len--) {
+    unsigned char *value;
+    if (!(__atomic_load_n(&map->prefix_lens[len / 64], __ATOMIC_ACQUIRE) & (1ULL << (len % 64))))
+      continue;
+    lpm_key(map, key, len, masked);
+    value = hash_lookup(map, masked, 0);
+    if (value)
+      return value;
+  }
+  return NULL;
+}
+
+static int lpm_update(struct map *map, const unsigned char *key, const unsigned char *value, __u64 flags)
+{
+  unsigned char masked[260];
+  __u32 prefix_len;
+  int err;
+
+  memcpy(&prefix_len, key, 4);
+  if (prefix_len > (map->key_size - 4) * 8)
+    return -EINVAL;
+  lpm_key(map, key, prefix_len, masked);
+  err = hash_update(map, masked, value, flags, 0);
+  if (!err)
+    __atomic_fetch_or(&map->prefix_lens[prefix_len / 64], 1ULL << (prefix_len % 64), __ATOMIC_RELEASE);
+  return err;
+}
+
+static unsigned char *map_lookup(struct map *map, const unsigned char *key, __u32 cpu)
+{
+  __u32 index;
+
+  switch (map->type) {
+  case BPF_MAP_TYPE_ARRAY:
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+    memcpy(&index, key, 4);
+    if (index >= map->max_entries)
+      return NULL;
+    return map->data + ((size_t)(map->copies > 1 ? cpu : 0) * map->max_entries + index) * map->value_stride;
+  case BPF_MAP_TYPE_HASH:
+  case BPF_MAP_TYPE_PERCPU_HASH:
+    return hash_lookup(map, key, cpu);
+  case BPF_MAP_TYPE_LPM_TRIE:
+    return lpm_lookup(map, key);
+  default:
+    return NULL;
+  }
+}
+
+static int map_update(struct map *map, const unsigned char *key, const unsigned char *value, __u64 flags,
+                      __u32 cpu)
+{
+  unsigned char *at;
+
+  switch (map->type) {
+  case BPF_MAP_TYPE_ARRAY:
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+    if (flags == BPF_NOEXIST)
+      return -EEXIST;
+    at = map_lookup(map, key, cpu);
+    if (!at)
+      return -E2BIG;
+    memcpy(at, value, map->value_size);
+    return 0;
+  case BPF_MAP_TYPE_HASH:
+  case BPF_MAP_TYPE_PERCPU_HASH:
+    return hash_update(map, key, value, flags, cpu);
+  case BPF_MAP_TYPE_LPM_TRIE:
+    return lpm_update(map, key, value, flags);
+  default:
+    return -EINVAL;
+  }
+}
+
+/* Elements of an array that are not all zeros, in any copy; the keys of a hash table. */
+static int map_elements(struct map *map)
+{
+  int n = 0;
+  __u32 i, k, cpu;
+
+  if (map->type == BPF_MAP_TYPE_ARRAY || map->type == BPF_MAP_TYPE_PERCPU_ARRAY) {
+    for (i = 0; i < map->max_entries; i++) {
+      bool is_set = false;
+      for (cpu = 0; cpu < map->copies; cpu++) {
+        unsigned char *value = map->data + ((size_t)cpu * map->max_entries + i) * map->value_stride;
+        for (k = 0; k < map->value_size; k++)
+          is_set |= value[k] != 0;
+      }
+      n += is_set;
+    }
+    return n;
+  }
+  if (map->type == BPF_MAP_TYPE_PROG_ARRAY) {
+    for (i = 0; i < map->max_entries; i++)
+      n += ((struct prog **)map->data)[i] != NULL;
+    return n;
+  }
+  return map->count;
+}
+
+static __u64 vm_helper(struct vm *vm, const struct bpf_insn *insn, __u64 *reg)
+{
+  struct map *map;
+  struct prog *prog;
+  __s32 delta;
+
+  switch (insn->imm) {
+  case BPF_FUNC_map_lookup_elem:
+    map = vm_map(vm, insn, reg[1]);
+    vm_mem(vm, insn, reg[2], map->key_size, false);
+    return (__u64)(uintptr_t)map_lookup(map, (unsigned char *)(uintptr_t)reg[2], vm->cpu);
+  case BPF_FUNC_map_update_elem:
+    map = vm_map(vm, insn, reg[1]);
+    vm_mem(vm, insn, reg[2], map->key_size, false);
+    vm_mem(vm, insn, reg[3], map->value_size, false);
+    return (__u64)(__s64)map_update(map, (unsigned char *)(uintptr_t)reg[2], (unsigned char *)(uintptr_t)reg[3],
+                                    reg[4], vm->cpu);
+  case BPF_FUNC_ktime_get_ns:
+    return (__u64)now_ns();
+  case BPF_FUNC_tail_call:
+    map = vm_map(vm, insn, reg[2]);
+    if (map->type != BPF_MAP_TYPE_PROG_ARRAY || reg[3] >= map->max_entries ||
+        vm->tail_calls >= UBPF_MAX_TAIL_CALLS)
+      return (__u64)-EINVAL;
+    prog = ((struct prog **)map->data)[reg[3]];
+    if (!prog)
+      return (__u64)-ENOENT;
+    vm->tail_calls += 1;
+    vm->tail_call = prog;
+    return 0;
+  case BPF_FUNC_redirect:
+    return XDP_REDIRECT;
+  case BPF_FUNC_xdp_adjust_head:
+    delta = (__s32)reg[2];
+    if ((__s64)vm->md.data + delta < (__s64)(uintptr_t)vm->buf ||
+        (__s64)vm->md.data + delta > (__s64)vm->md.data_end - ETH_HLEN)
+      return (__u64)-EINVAL;
+    vm->md.data += delta;
+    return 0;
+  case BPF_FUNC_xdp_adjust_tail:
+    delta = (__s32)reg[2];
+    if ((__s64)vm->md.data_end + delta < (__s64)vm->md.data + ETH_HLEN ||
+        (__s64)vm->md.data_end + delta > (__s64)(uintptr_t)(vm->buf + vm->buf_size))
+      return (__u64)-EINVAL;
+    vm->md.data_end += delta;
+    return 0;
+  case UBPF_FUNC_hash_lookup3:
+    if (reg[2] > UBPF_STACK_SIZE)
+      vm_fault(vm, insn, "hash", reg[1], (int)reg[2]);
+    return lookup3(vm_mem(vm, insn, reg[1], (int)reg[2], false), (__u32)reg[2]);
+  default:
+    vm_fault(vm, insn, "call of the unknown helper", insn->imm, 0);
+    return 0;
+  }
+}
+
+static inline __u64 load(const unsigned char *p, int size)
+{
+  __u8 b;
+  __u16 h;
+  __u32 w;
+  __u64 d;
+
+  switch (size) {
+  case 1:
+    memcpy(&b, p, 1);
+    return b;
+  case 2:
+    memcpy(&h, p, 2);
+    return h;
+  case 4:
+    memcpy(&w, p, 4);
+    return w;
+  default:
+    memcpy(&d, p, 8);
+    return d;
+  }
+}
+
+static inline void store(unsigned char *p, int size, __u64 value)
+{
+  __u8 b = value;
+  __u16 h = value;
+  __u32 w = value;
+
+  switch (size) {
+  case 1:
+    memcpy(p, &b, 1);
+    break;
+  case 2:
+    memcpy(p, &h, 2);
+    break;
+  case 4:
+    memcpy(p, &w, 4);
+    break;
+  default:
+    memcpy(p, &value, 8);
+  }
+}
+
+#define DST reg[insn->dst_reg]
+#define SRC reg[insn->src_reg]
+
+/* The cases of an ALU operation, 64 and 32 bits wide, with `a` and `b` its operands. */
+#define ALU(op, expr) \
+  case BPF_ALU64 | (op) | BPF_K: { __u64 a = DST, b = (__s64)insn->imm; DST = (expr); break; } \
+  case BPF_ALU64 | (op) | BPF_X: { __u64 a = DST, b = SRC; DST = (expr); break; } \
+  case BPF_ALU | (op) | BPF_K: { __u32 a = DST, b = insn->imm; DST = (__u32)(expr); break; } \
+  case BPF_ALU | (op) | BPF_X: { __u32 a = DST, b = SRC; DST = (__u32)(expr); break; }
+
+/* The cases of a conditional jump, with `cond64` and `cond32` the condition on `a` and `b`. */
+#define JMP(op, cond64, cond32) \
+  case BPF_JMP | (op) | BPF_K: { __u64 a = DST, b = (__s64)insn->imm; if (cond64) goto jump; break; } \
+  case BPF_JMP | (op) | BPF_X: { __u64 a = DST, b = SRC; if (cond64) goto jump; break; } \
+  case BPF_JMP32 | (op) | BPF_K: { __u32 a = DST, b = insn->imm; if (cond32) goto jump; break; } \
+  case BPF_JMP32 | (op) | BPF_X: { __u32 a = DST, b = SRC; if (cond32) goto jump; break; }
+
+#define LDX(size, n) \
+  case BPF_LDX | BPF_MEM | (size): DST = load(vm_mem(vm, insn, SRC + insn->off, n, false), n); break;
+#define ST(size, n) \
+  case BPF_ST | BPF_MEM | (size): store(vm_mem(vm, insn, DST + insn->off, n, true), n, insn->imm); break;
+#define STX(size, n) \
+  case BPF_STX | BPF_MEM | (size): store(vm_mem(vm, insn, DST + insn->off, n, true), n, SRC); break;
+
+/* Runs `prog` and the programs it tail-calls on the packet of the VM: the verdict. */
+static __u64 vm_run(struct vm *vm, struct prog *prog)
+{
+  __u64 reg[11];
+  const struct bpf_insn *insn, *end;
+  int back_jumps = 0;
+
+  memset(reg, 0, sizeof(reg));
+  reg[1] = (__u64)(uintptr_t)&vm->md;
+  reg[10] = (__u64)(uintptr_t)vm->stack + UBPF_STACK_SIZE;
+  vm->prog = prog;
+  insn = prog->insns;
+  end = insn + prog->insn_count;
+  for (;; insn++) {
+    if (insn >= end || insn < vm->prog->insns)
+      vm_fault(vm, insn, "jump out of the program", 0, -1);
+    switch (insn->code) {
+    ALU(BPF_ADD, a + b)
+    ALU(BPF_SUB, a - b)
+    ALU(BPF_MUL, a * b)
+    ALU(BPF_DIV, b ? a / b : 0)
+    ALU(BPF_MOD, b ? a % b : a)
+    ALU(BPF_OR, a | b)
+    ALU(BPF_AND, a & b)
+    ALU(BPF_XOR, a ^ b)
+    ALU(BPF_LSH, a << (b & (8 * sizeof(a) - 1)))
+    ALU(BPF_RSH, a >> (b & (8 * sizeof(a) - 1)))
+    case BPF_ALU64 | BPF_MOV | BPF_K:
+      DST = (__s64)insn->imm;
+      break;
+    case BPF_ALU64 | BPF_MOV | BPF_X:
+      DST = SRC;
+      break;
+    case BPF_ALU | BPF_MOV | BPF_K:
+      DST = (__u32)insn->imm;
+      break;
+    case BPF_ALU | BPF_MOV | BPF_X:
+      DST = (__u32)SRC;
+      break;
+    case BPF_ALU64 | BPF_ARSH | BPF_K:
+      DST = (__s64)DST >> (insn->imm & 63);
+      break;
+    case BPF_ALU64 | BPF_ARSH | BPF_X:
+      DST = (__s64)DST >> (SRC & 63);
+      break;
+    case BPF_ALU | BPF_ARSH | BPF_K:
+      DST = (__u32)((__s32)DST >> (insn->imm & 31));
+      break;
+    case BPF_ALU | BPF_ARSH | BPF_X:
+      DST = (__u32)((__s32)DST >> (SRC & 31));
+      break;
+    case BPF_ALU64 | BPF_NEG:
+      DST = -DST;
+      break;
+    case BPF_ALU | BPF_NEG:
+      DST = (__u32)-DST;
+      break;
+    case BPF_ALU | BPF_END | BPF_TO_LE:
+      DST = insn->imm == 16 ? (__u16)DST : insn->imm == 32 ? (__u32)DST : DST;
+      break;
+    case BPF_ALU | BPF_END | BPF_TO_BE:
+      DST = insn->imm == 16 ? __builtin_bswap16(DST) : insn->imm == 32 ? __builtin_bswap32(DST)
+                                                                       : __builtin_bswap64(DST);
+      break;
+
+    case BPF_LD | BPF_IMM | BPF_DW:
+      if (insn + 1 >= end)
+        vm_fault(vm, insn, "jump out of the program", 0, -1);
+      if (insn->src_reg == BPF_PSEUDO_MAP_FD)
+        DST = (__u64)(uintptr_t)&maps[insn->imm];
+      else
+        DST = (__u32)insn->imm | (__u64)(__u32)insn[1].imm << 32;
+      insn++;
+      break;
+    LDX(BPF_B, 1)
+    LDX(BPF_H, 2)
+    LDX(BPF_W, 4)
+    LDX(BPF_DW, 8)
+    ST(BPF_B, 1)
+    ST(BPF_H, 2)
+    ST(BPF_W, 4)
+    ST(BPF_DW, 8)
+    STX(BPF_B, 1)
+    STX(BPF_H, 2)
+    STX(BPF_W, 4)
+    STX(BPF_DW, 8)
+    case BPF_STX | BPF_XADD | BPF_W:
+      if (insn->imm != BPF_ADD)
+        vm_fault(vm, insn, "unsupported atomic", DST + insn->off, 4);
+      __atomic_fetch_add((__u32 *)vm_mem(vm, insn, DST + insn->off, 4, true), (__u32)SRC, __ATOMIC_RELAXED);
+      break;
+    case BPF_STX | BPF_XADD | BPF_DW:
+      if (insn->imm != BPF_ADD)
+        vm_fault(vm, insn, "unsupported atomic", DST + insn->off, 8);
+      __atomic_fetch_add((__u64 *)vm_mem(vm, insn, DST + insn->off, 8, true), SRC, __ATOMIC_RELAXED);
+      break;
+
+    case BPF_JMP | BPF_JA:
+      goto jump;
+    JMP(BPF_JEQ, a == b, a == b)
+    JMP(BPF_JNE, a != b, a != b)
+    JMP(BPF_JGT, a > b, a > b)
+    JMP(BPF_JGE, a >= b, a >= b)
+    JMP(BPF_JLT, a < b, a < b)
+    JMP(BPF_JLE, a <= b, a <= b)
+    JMP(BPF_JSET, a & b, a & b)
+    JMP(BPF_JSGT, (__s64)a > (__s64)b, (__s32)a > (__s32)b)
+    JMP(BPF_JSGE, (__s64)a >= (__s64)b, (__s32)a >= (__s32)b)
+    JMP(BPF_JSLT, (__s64)a < (__s64)b, (__s32)a < (__s32)b)
+    JMP(BPF_JSLE, (__s64)a <= (__s64)b, (__s32)a <= (__s32)b)
+    case BPF_JMP | BPF_CALL:
+      if (insn->src_reg != 0)
+        vm_fault(vm, insn, "call of a BPF function", 0, -1);
+      reg[0] = vm_helper(vm, insn, reg);
+      if (vm->tail_call) {
+        vm->prog = vm->tail_call;
+        vm->tail_call = NULL;
+        insn = vm->prog->insns - 1;
+        end = vm->prog->insns + vm->prog->insn_count;
+      }
+      break;
+    case BPF_JMP | BPF_EXIT:
+      return reg[0];
+    default:
+      vm_fault(vm, insn, "unsupported instruction", insn->code, 0);
+    }
+    continue;
+  jump:
+    if (insn->off < 0 && ++back_jumps > UBPF_MAX_BACK_JUMPS)
+      vm_fault(vm, insn, "backward jumps past", UBPF_MAX_BACK_JUMPS, 0);
+    insn += insn->off;
+  }
+}
+
+static void vm_packet(struct vm *vm, int i)
+{
+  vm->md.data = (__u64)(uintptr_t)(vm->buf + UBPF_HEADROOM);
+  vm->md.data_end = vm->md.data + packets[i].size;
+  vm->md.ingress_ifindex = UBPF_INGRESS_IFINDEX;
+  vm->md.cpu = vm->cpu;
+  vm->tail_calls = 0;
+  memcpy(vm->buf + UBPF_HEADROOM, packets[i].data, packets[i].size);
+  results[i] = vm_run(vm, &progs[0]);
+}
+
+/*
+ * Takes batches of packets until there are none left, running each packet
+ * of a batch `repeat` times; the outputs are those of the last run, which
+ * is timed packet by packet so as to leave their copy out.
+ */
+static void *vm_thread(void *arg)
+{
+  struct vm *vm = arg;
+  int start, i, r;
+
+  while ((start = __atomic_fetch_add(&next_batch, 1, __ATOMIC_RELAXED) * batch_size) < count) {
+    int stop = start + batch_size < count ? start + batch_size : count;
+    double t = now_ns();
+    for (r = 1; r < repeat; r++)
+      for (i = start; i < stop; i++)
+        vm_packet(vm, i);
+    vm->ns += now_ns() - t;
+    for (i = start; i < stop; i++) {
+      t = now_ns();
+      vm_packet(vm, i);
+      vm->ns += now_ns() - t;
+      outputs[i].size = vm->md.data_end - vm->md.data;
+      outputs[i].data = malloc(outputs[i].size ? outputs[i].size : 1);
+      assert(outputs[i].data);
+      memcpy(outputs[i].data, (void *)(uintptr_t)vm->md.data, outputs[i].size);
+    }
+  }
+  return NULL;
+}
+
+static Elf64_Shdr *section_named(Elf64_Ehdr *ehdr, const char *name)
+{
+  Elf64_Shdr *shdrs = (Elf64_Shdr *)((char *)ehdr + ehdr->e_shoff);
+  const char *names = (char *)ehdr + shdrs[ehdr->e_shstrndx].sh_offset;
+  int i;
+
+  for (i = 1; i < ehdr->e_shnum; i++)
+    if (strcmp(names + shdrs[i].sh_name, name) == 0)
+      return &shdrs[i];
+  return NULL;
+}
+
+/*
+ * Reads the programs of the "ubpf" and "ubpf/N" sections of `path` and the
+ * maps of its "maps" section; points the map loads of the programs at the
+ * maps, and fills the program arrays with the stage of each index.
+ */
+static int load_object(const char *path, int vm_count)
+{
+  Elf64_Ehdr *ehdr;
+  Elf64_Shdr *shdrs, *maps_section, *symtab;
+  Elf64_Sym *syms;
+  const char *names, *strtab;
+  char *image;
+  long size;
+  int i, k;
+  FILE *f = fopen(path, "rb");
+
+  if (!f) {
+    printf("ERROR: cannot open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  image = malloc(size);
+  assert(image);
+  if (fread(image, 1, size, f) != size) {
+    printf("ERROR: cannot read %s\n", path);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+  ehdr = (Elf64_Ehdr *)image;
+  if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_BPF ||
+      ehdr->e_shoff + (long)ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+    printf("ERROR: %s is not a BPF object\n", path);
+    return 1;
+  }
+  shdrs = (Elf64_Shdr *)(image + ehdr->e_shoff);
+  names = image + shdrs[ehdr->e_shstrndx].sh_offset;
+  symtab = section_named(ehdr, ".symtab");
+  if (!symtab || !section_named(ehdr, ".strtab")) {
+    printf("ERROR: %s has no symbols\n", path);
+    return 1;
+  }
+  syms = (Elf64_Sym *)(image + symtab->sh_offset);
+  strtab = image + section_named(ehdr, ".strtab")->sh_offset;
+
+  maps_section = section_named(ehdr, "maps");
+  if (maps_section) {
+    map_count = maps_section->sh_size / sizeof(struct map_def);
+    maps = calloc(map_count ? map_count : 1, sizeof(*maps));
+    assert(maps);
+    for (i = 0; i < map_count; i++) {
+      const char *name = "?";
+      for (k = 1; k < symtab->sh_size / sizeof(Elf64_Sym); k++)
+        if (&shdrs[syms[k].st_shndx] == maps_section && syms[k].st_value == i * sizeof(struct map_def))
+          name = strtab + syms[k].st_name;
+      map_alloc(&maps[i], name,
+                (struct map_def *)(image + maps_section->sh_offset + i * sizeof(struct map_def)), vm_count);
+    }
+  }
+
+  for (i = 1; i < ehdr->e_shnum; i++) {
+    const char *name = names + shdrs[i].sh_name;
+    int index = 0;
+    struct prog *prog;
+    if (strcmp(name, "ubpf") != 0 && sscanf(name, "ubpf/%d", &index) != 1)
+      continue;
+    if (index < 0 || index >= UBPF_MAX_PROGS) {
+      printf("ERROR: %s: section %s\n", path, name);
+      return 1;
+    }
+    prog = &progs[index];
+    snprintf(prog->name, sizeof(prog->name), "%s", name);
+    prog->insns = (struct bpf_insn *)(image + shdrs[i].sh_offset);
+    prog->insn_count = shdrs[i].sh_size / sizeof(struct bpf_insn);
+    if (index >= prog_count)
+      prog_count = index + 1;
+    for (k = 1; k < ehdr->e_shnum; k++) {
+      Elf64_Rel *rels = (Elf64_Rel *)(image + shdrs[k].sh_offset);
+      int r;
+      if (shdrs[k].sh_type != SHT_REL || shdrs[k].sh_info != i)
+        continue;
+      for (r = 0; r < shdrs[k].sh_size / sizeof(Elf64_Rel); r++) {
+        Elf64_Sym *sym = &syms[ELF64_R_SYM(rels[r].r_info)];
+        struct bpf_insn *insn = &prog->insns[rels[r].r_offset / sizeof(struct bpf_insn)];
+        if (&shdrs[sym->st_shndx] != maps_section || insn->code != (BPF_LD | BPF_IMM | BPF_DW) ||
+            sym->st_value / sizeof(struct map_def) >= map_count) {
+          printf("ERROR: %s: relocation %d of %s is not a map load\n", path, r, name);
+          return 1;
+        }
+        insn->src_reg = BPF_PSEUDO_MAP_FD;
+        insn->imm = sym->st_value / sizeof(struct map_def);
+      }
+    }
+  }
+  if (!progs[0].insns) {
+    printf("ERROR: %s has no `ubpf` section: compile it with --target=ubpf\n", path);
+    return 1;
+  }
+
+  for (i = 0; i < map_count; i++) {
+    if (maps[i].type != BPF_MAP_TYPE_PROG_ARRAY)
+      continue;
+    for (k = 0; k < maps[i].max_entries && k < prog_count; k++)
+      ((struct prog **)maps[i].data)[k] = progs[k].insns ? &progs[k] : NULL;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *optstr = "j:b:r:n:s:o:e:w:mv";
+  const char *out_path = NULL, *expect_path = NULL, *in_path = NULL;
+  struct packet *expected = NULL;
+  struct vm *vms;
+  int vm_count = sysconf(_SC_NPROCESSORS_ONLN), expected_count = 0;
+  int verdicts[5] = {0, 0, 0, 0, 0}, others = 0;
+  int changed = 0, resized = 0, mismatched = 0;
+  __u32 seed = 1;
+  bool is_verbose = false, is_printing_maps = false;
+  double total_ns = 0, wall_ns;
+  int opt, i;
+
+  count = 1000;
+  while ((opt = getopt(argc, argv, optstr)) != -1) {
+    switch (opt) {
+    case 'j':
+      vm_count = atoi(optarg);
+      break;
+    case 'b':
+      batch_size = atoi(optarg);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'e':
+      expect_path = optarg;
+      break;
+    case 'w':
+      in_path = optarg;
+      break;
+    case 'm':
+      is_printing_maps = true;
+      break;
+    case 'v':
+      is_verbose = true;
+      break;
+    default:
+      usage(basename(argv[0]));
+      return 1;
+    }
+  }
+  if (optind == argc || repeat <= 0 || count <= 0 || vm_count <= 0 || batch_size <= 0) {
+    usage(basename(argv[0]));
+    return 1;
+  }
+
+  if (optind + 1 < argc) {
+    packets = read_pcap(argv[optind + 1], &count);
+    if (!packets)
+      return 1;
+  } else {
+    packets = generate_packets(count, seed);
+  }
+  if ((count + batch_size - 1) / batch_size < vm_count)
+    vm_count = (count + batch_size - 1) / batch_size;
+  if (vm_count == 0)
+    vm_count = 1;
+  if (load_object(argv[optind], vm_count))
+    return 1;
+  if (in_path && write_pcap(in_path, packets, count))
+    return 1;
+  if (expect_path) {
+    expected = read_pcap(expect_path, &expected_count);
+    if (!expected)
+      return 1;
+  }
+
+  outputs = calloc(count ? count : 1, sizeof(*outputs));
+  results = calloc(count ? count : 1, sizeof(*results));
+  vms = calloc(vm_count, sizeof(*vms));
+  assert(outputs && results && vms);
+  wall_ns = now_ns();
+  for (i = 0; i < vm_count; i++) {
+    vms[i].cpu = i;
+    vms[i].buf_size = UBPF_HEADROOM + MAX_PACKET_SIZE;
+    vms[i].buf = malloc(vms[i].buf_size);
+    assert(vms[i].buf);
+    if (pthread_create(&vms[i].thread, NULL, vm_thread, &vms[i])) {
+      printf("ERROR: pthread_create: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+  for (i = 0; i < vm_count; i++) {
+    pthread_join(vms[i].thread, NULL);
+    total_ns += vms[i].ns;
+  }
+  wall_ns = now_ns() - wall_ns;
+
+  for (i = 0; i < count; i++) {
+    __u32 retval = results[i];
+    int diff_at = -1, k;
+
+    if (retval < 5)
+      verdicts[retval] += 1;
+    else
+      others += 1;
+    resized += outputs[i].size != packets[i].size;
+    changed += outputs[i].size != packets[i].size || memcmp(outputs[i].data, packets[i].data, outputs[i].size) != 0;
+    if (expected && i < expected_count) {
+      for (k = 0; k < outputs[i].size && k < expected[i].size && outputs[i].data[k] == expected[i].data[k]; k++)
+        ;
+      if (k < outputs[i].size || k < expected[i].size)
+        diff_at = k;
+    } else if (expected) {
+      diff_at = 0;
+    }
+    if (diff_at >= 0) {
+      mismatched += 1;
+      if (is_verbose)
+        printf("packet %d: %s, %u -> %u bytes, differs from the expected output at byte %d\n", i,
+               retval < 5 ? verdict_names[retval] : "?", packets[i].size, outputs[i].size, diff_at);
+    }
+  }
+
+  printf("%d packets, %d runs each, %d VMs, batches of %d: %.1f ns/packet\n", count, repeat, vm_count,
+         batch_size, total_ns / ((double)count * repeat));
+  printf("throughput: %.2f Mpps\n", (double)count * repeat / wall_ns * 1e3);
+  printf("verdicts:");
+  for (i = 0; i < 5; i++)
+    printf(" %s %d", verdict_names[i], verdicts[i]);
+  if (others)
+    printf(" other %d", others);
+  printf("\noutputs: %d changed, %d resized\n", changed, resized);
+  if (expected)
+    printf("expected: %d of %d differ%s\n", mismatched, count,
+           expected_count != count ? " (not as many packets)" : "");
+  if (is_printing_maps)
+    for (i = 0; i < map_count; i++)
+      printf("map %s: %d elements\n", maps[i].name, map_elements(&maps[i]));
+  if (out_path && write_pcap(out_path, outputs, count))
+    return 1;
+  return mismatched ? 2 : 0;
+}
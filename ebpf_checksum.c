@@ -0,0 +1,445 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "ir.h"
+#include "ebpf.h"
+#include <memory.h>  // memset
+
+
+/*
+ * Incremental IPv4 checksums.  A call of `ebpf_ipv4_checksum` in the control
+ * whose arguments are the fields of one IPv4 header sums all of them again,
+ * though a router or a NAT changes one or two: the TTL, an address.  Where
+ * nothing but plain stores to its fields can change that header from the end
+ * of the parser to the call, the call becomes RFC 1624 updates of the
+ * checksum the packet came with, by the old and new value of each field that
+ * the control or its actions store to: `csum_replace2` and `csum_replace4`,
+ * which both targets lower to inline one's-complement arithmetic.  The
+ * values at the start of the control are loaded there.
+ *
+ * Unlike the full sum, the update keeps a wrong incoming checksum wrong, and
+ * covers the options of the header; the full sum covers 20 bytes.
+ */
+
+#define EBPF_CHECKSUM_MAX_FIELDS  3  /* more changed fields cost more to update than to sum again */
+#define EBPF_PATH_MAX             8
+
+/* The arguments of ebpf_ipv4_checksum, by offset and width in the header. */
+internal struct { int offset; int width; } ipv4_fields[] = {
+  {0, 4}, {4, 4}, {8, 8}, {16, 16}, {32, 16}, {48, 3}, {51, 13}, {64, 8}, {72, 8}, {96, 32}, {128, 32},
+};
+#define IPV4_FIELD_COUNT   11
+#define IPV4_CHECKSUM_AT   80
+
+/* A reference as the declaration it starts from and the field names on the way; "" stands for an index. */
+struct RefPath {
+  struct Ast* decl;
+  char* names[EBPF_PATH_MAX];
+  int length;
+};
+
+internal struct IrFunction* function;
+internal struct Arena* storage;
+
+/* False unless `id` is a reference made of var, field and index. */
+internal bool
+ref_path(struct IrFunction* f, int id, struct RefPath* path)
+{
+  struct IrInsn* insn = ir_insn(f, id);
+  if (insn->op == Ir_Var) {
+    path->decl = insn->decl;
+    path->length = 0;
+    return true;
+  } else if ((insn->op == Ir_Field || insn->op == Ir_Index) && ref_path(f, insn->args[0], path)) {
+    if (path->length == EBPF_PATH_MAX) {
+      return false;
+    }
+    path->names[path->length++] = insn->op == Ir_Field ? insn->name : "";
+    return true;
+  }
+  return false;
+}
+
+/* Whether the memory of the two references can overlap. */
+internal bool
+paths_overlap(struct RefPath* a, struct RefPath* b)
+{
+  int i;
+  if (a->decl != b->decl) {
+    return false;
+  }
+  for (i = 0; i < a->length && i < b->length; i++) {
+    if (*a->names[i] && *b->names[i] && !cstr_match(a->names[i], b->names[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+internal bool
+paths_equal(struct RefPath* a, struct RefPath* b)
+{
+  int i;
+  if (a->decl != b->decl || a->length != b->length) {
+    return false;
+  }
+  for (i = 0; i < a->length; i++) {
+    if (!*a->names[i] || !cstr_match(a->names[i], b->names[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+internal int
+member_of(struct Type* header, char* name)
+{
+  int i;
+  for (i = 0; i < header->member_count; i++) {
+    if (cstr_match(header->members[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * The header whose fields are the arguments of the call, in the order of an
+ * IPv4 header, with a 16-bit field after the protocol for its checksum.
+ */
+internal bool
+ipv4_header_of(struct IrInsn* call, struct RefPath* header, struct Type** header_type)
+{
+  int i;
+  if (call->arg_count != IPV4_FIELD_COUNT) {
+    return false;
+  }
+  for (i = 0; i < IPV4_FIELD_COUNT; i++) {
+    struct IrInsn* load = ir_insn(function, call->args[i]);
+    if (load->op != Ir_Load) {
+      return false;
+    }
+    struct IrInsn* field = ir_insn(function, load->args[0]);
+    struct RefPath path;
+    if (field->op != Ir_Field || !ref_path(function, field->args[0], &path)) {
+      return false;
+    }
+    if (i == 0) {
+      *header = path;
+      *header_type = ebpf_resolve_type(ir_insn(function, field->args[0])->type);
+      if (!*header_type || (*header_type)->kind != Type_Header) {
+        return false;
+      }
+    } else if (!paths_equal(&path, header)) {
+      return false;
+    }
+    int member = member_of(*header_type, field->name);
+    if (member < 0 || ebpf_field_offset(*header_type, member) != ipv4_fields[i].offset
+        || ebpf_scalar_width((*header_type)->members[member].type) != ipv4_fields[i].width) {
+      return false;
+    }
+  }
+  for (i = 0; i < (*header_type)->member_count; i++) {
+    if (ebpf_field_offset(*header_type, i) == IPV4_CHECKSUM_AT) {
+      return ebpf_scalar_width((*header_type)->members[i].type) == 16;
+    }
+  }
+  return false;
+}
+
+/*
+ * Sets `changed` of each field of `header` that `f` stores to.  The reason
+ * why the header can change otherwise, or 0.
+ */
+internal char*
+collect_stores(struct IrFunction* f, struct RefPath* header, struct Type* header_type, bool* changed)
+{
+  int i, j;
+  for (i = 1; i < f->insns.elem_count; i++) {
+    struct IrInsn* insn = ir_insn(f, i);
+    if (insn->op == Ir_Var || insn->op == Ir_Field || insn->op == Ir_Index || insn->op == Ir_Load
+        || insn->op == Ir_IsValid || insn->op == Ir_SetInvalid) {
+      continue;
+    }
+    for (j = 0; j < insn->arg_count; j++) {
+      struct RefPath path;
+      if (!ref_path(f, insn->args[j], &path) || !paths_overlap(&path, header)) {
+        continue;
+      }
+      if (insn->op == Ir_Store && j == 1) {
+        continue;  /* copied from */
+      }
+      if (insn->op == Ir_Store && path.length == header->length + 1 && *path.names[header->length]) {
+        changed[member_of(header_type, path.names[header->length])] = true;
+        continue;
+      }
+      if (f->kind == IrFunction_Parser && insn->op == Ir_Call && cstr_match(insn->name, "extract")) {
+        continue;
+      }
+      return "the header may change other than by a store to one of its fields";
+    }
+  }
+  return 0;
+}
+
+/* A copy of the reference `id`, made in front of the other instructions of the entry block. */
+internal int
+copy_ref(int id, int* last)
+{
+  struct IrInsn* ref = ir_insn(function, id);
+  int base = ref->op == Ir_Var ? 0 : copy_ref(ref->args[0], last);
+  ref = ir_insn(function, id);
+  struct IrInsn* copy = ir_new_insn(function, ref->op, ref->type, base ? 1 : 0, ref->line_nr, storage);
+  ref = ir_insn(function, id);
+  copy->decl = ref->decl;
+  copy->name = ref->name;
+  if (base) {
+    copy->args[0] = base;
+  }
+  struct IrBlock* entry = ir_block(function, function->entry_block);
+  copy->block = entry->id;
+  if (*last) {
+    copy->next_in_block = ir_insn(function, *last)->next_in_block;
+    ir_insn(function, *last)->next_in_block = copy->id;
+  } else {
+    copy->next_in_block = entry->first_insn;
+    entry->first_insn = copy->id;
+  }
+  if (entry->last_insn == *last) {
+    entry->last_insn = copy->id;
+  }
+  *last = copy->id;
+  return copy->id;
+}
+
+/* Loads field `name` of the header `ref` at the start of the control. */
+internal int
+load_at_entry(int ref, char* name, struct Type* type, int* last)
+{
+  int header = copy_ref(ref, last);
+  struct IrInsn* field = ir_new_insn(function, Ir_Field, type, 1, ir_insn(function, ref)->line_nr, storage);
+  field->name = name;
+  field->args[0] = header;
+  int field_id = field->id;
+  struct IrInsn* load = ir_new_insn(function, Ir_Load, type, 1, field->line_nr, storage);
+  field = ir_insn(function, field_id);
+  load->args[0] = field_id;
+  struct IrBlock* entry = ir_block(function, function->entry_block);
+  field->block = load->block = entry->id;
+  field->next_in_block = load->id;
+  load->next_in_block = ir_insn(function, *last)->next_in_block;
+  ir_insn(function, *last)->next_in_block = field->id;
+  if (entry->last_insn == *last) {
+    entry->last_insn = load->id;
+  }
+  *last = load->id;
+  return load->id;
+}
+
+/* The checksum call, and the instruction in front of it that the arithmetic goes after. */
+internal int before;
+internal int prev;
+
+internal int
+new_op(enum IrOpcode op, struct Type* type, int a, int b)
+{
+  int arg_count = a ? (b ? 2 : 1) : 0;
+  struct IrInsn* insn = ir_new_insn(function, op, type, arg_count, ir_insn(function, before)->line_nr, storage);
+  struct IrBlock* block = ir_block(function, ir_insn(function, before)->block);
+  insn->block = block->id;
+  insn->next_in_block = before;
+  if (prev) {
+    ir_insn(function, prev)->next_in_block = insn->id;
+  } else {
+    block->first_insn = insn->id;
+  }
+  prev = insn->id;
+  if (a) {
+    insn->args[0] = a;
+    if (b) {
+      insn->args[1] = b;
+    }
+  }
+  return insn->id;
+}
+
+internal int
+new_const(struct Type* type, int64_t value)
+{
+  int id = new_op(Ir_Const, type, 0, 0);
+  ir_insn(function, id)->value = bitint_from_int64(value);
+  return id;
+}
+
+/* `value`, a field at `offset` bits in the header, moved to where it sits in its 16-bit word. */
+internal int
+word_value(int value, int offset, int width)
+{
+  struct Type* word = type_sized(Type_Bit, 16);
+  int shift = 16 - (offset + width) % 16;
+  if (width != 16) {
+    value = new_op(Ir_Cast, word, value, 0);
+  }
+  if (shift % 16 != 0) {
+    value = new_op(Ir_Shl, word, value, new_const(word, shift));
+  }
+  return value;
+}
+
+/* `sum` + the 16-bit words of `value`, complemented if `negate`. */
+internal int
+add_words(int sum, int value, int width, bool negate)
+{
+  struct Type* type = type_sized(Type_Bit, width);
+  struct Type* sum_type = type_sized(Type_Bit, 32);
+  if (negate) {
+    value = new_op(Ir_BitNot, type, value, 0);
+  }
+  if (width == 32) {
+    int high = new_op(Ir_Shr, sum_type, value, new_const(sum_type, 16));
+    sum = new_op(Ir_Add, sum_type, sum, high);
+    value = new_op(Ir_BitAnd, sum_type, value, new_const(sum_type, 0xffff));
+  } else {
+    value = new_op(Ir_Cast, sum_type, value, 0);
+  }
+  return sum ? new_op(Ir_Add, sum_type, sum, value) : value;
+}
+
+internal void
+lower_checksum(struct EbpfProgram* program, int id)
+{
+  struct EbpfChecksum* checksum = arena_push(storage, sizeof(*checksum));
+  memset(checksum, 0, sizeof(*checksum));
+  struct IrInsn* call = ir_insn(function, id);
+  checksum->function = function;
+  checksum->line_nr = call->line_nr;
+  checksum->fields = arena_push(storage, IPV4_FIELD_COUNT * sizeof(char*));
+  array_append(&program->checksums, checksum);
+  checksum = (struct EbpfChecksum*)array_get(&program->checksums, program->checksums.elem_count - 1);
+
+  struct RefPath header;
+  struct Type* header_type;
+  if (!ipv4_header_of(call, &header, &header_type)) {
+    checksum->reason = "the arguments are not the fields of one IPv4 header, in order";
+    return;
+  }
+  /* Only the headers the parser fills hold the checksum of their fields at the start of the control. */
+  if (ebpf_list_index(function->params, header.decl) != 0) {
+    checksum->reason = "the header is not one of the parsed headers";
+    return;
+  }
+  bool* changed = arena_push(storage, header_type->member_count * sizeof(bool));
+  memset(changed, 0, header_type->member_count * sizeof(bool));
+  int i;
+  struct RefPath parsed = header;
+  parsed.decl = ast_list_nth(program->parser->params, 1);
+  checksum->reason = collect_stores(program->parser, &parsed, header_type, changed);
+  for (i = 0; i < header_type->member_count && !checksum->reason; i++) {
+    if (changed[i]) {
+      checksum->reason = "the parser stores to a field of the header";
+    }
+  }
+  if (!checksum->reason) {
+    checksum->reason = collect_stores(function, &header, header_type, changed);
+  }
+  for (i = 0; i < program->ir->functions.elem_count && !checksum->reason; i++) {
+    struct IrFunction* f = *(struct IrFunction**)array_get(&program->ir->functions, i);
+    if (f->parent == function) {
+      checksum->reason = collect_stores(f, &header, header_type, changed);
+    }
+  }
+  if (checksum->reason) {
+    return;
+  }
+  /* The summed fields that change, in the order of the arguments. */
+  int args[IPV4_FIELD_COUNT];
+  for (i = 0; i < IPV4_FIELD_COUNT; i++) {
+    struct IrInsn* field = ir_insn(function, ir_insn(function, call->args[i])->args[0]);
+    if (changed[member_of(header_type, field->name)]) {
+      args[checksum->field_count] = i;
+      checksum->fields[checksum->field_count++] = field->name;
+    }
+  }
+  if (checksum->field_count > EBPF_CHECKSUM_MAX_FIELDS) {
+    checksum->reason = "more of the summed fields change than updating is worth";
+    checksum->field_count = 0;
+    return;
+  }
+  checksum->is_incremental = true;
+
+  int last = 0;
+  int header_ref = ir_insn(function, ir_insn(function, call->args[0])->args[0])->args[0];
+  struct TypeMember* member = 0;
+  for (i = 0; i < header_type->member_count; i++) {
+    if (ebpf_field_offset(header_type, i) == IPV4_CHECKSUM_AT) {
+      member = &header_type->members[i];
+    }
+  }
+  int sum = load_at_entry(header_ref, member->name, member->type, &last);
+  int old_values[IPV4_FIELD_COUNT];
+  for (i = 0; i < checksum->field_count; i++) {
+    struct IrInsn* load = ir_insn(function, call->args[args[i]]);
+    old_values[i] = load_at_entry(header_ref, checksum->fields[i], load->type, &last);
+  }
+  if (checksum->field_count > 0) {
+    /* RFC 1624: HC' = ~(~HC + ~m + m'), over each field m that changes, folded once. */
+    before = id;
+    prev = 0;
+    int next = ir_block(function, ir_insn(function, id)->block)->first_insn;
+    while (next != id) {
+      prev = next;
+      next = ir_insn(function, next)->next_in_block;
+    }
+    sum = add_words(0, sum, 16, true);
+    for (i = 0; i < checksum->field_count; i++) {
+      int offset = ipv4_fields[args[i]].offset, width = ipv4_fields[args[i]].width;
+      int old_value = old_values[i];
+      int value = ir_insn(function, id)->args[args[i]];
+      if (width != 32) {
+        old_value = word_value(old_value, offset, width);
+        value = word_value(value, offset, width);
+        width = 16;
+      }
+      sum = add_words(sum, old_value, width, true);
+      sum = add_words(sum, value, width, false);
+    }
+    struct Type* sum_type = type_sized(Type_Bit, 32);
+    for (i = 0; i < 2; i++) {
+      int high = new_op(Ir_Shr, sum_type, sum, new_const(sum_type, 16));
+      sum = new_op(Ir_BitAnd, sum_type, sum, new_const(sum_type, 0xffff));
+      sum = new_op(Ir_Add, sum_type, sum, high);
+    }
+    sum = new_op(Ir_BitNot, sum_type, sum, 0);
+  }
+  /* The call becomes the truncation of the sum to the checksum. */
+  call = ir_insn(function, id);
+  call->op = Ir_Cast;
+  call->name = 0;
+  call->decl = 0;
+  call->arg_count = 1;
+  call->args[0] = sum;
+}
+
+void
+ebpf_lower_checksums(struct EbpfProgram* program, struct Arena* storage_)
+{
+  int i, id;
+  function = program->control;
+  storage = storage_;
+  if (!program->parser || !function) {
+    return;
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    if (i != function->entry_block && block->pred_count == 0) {
+      continue;
+    }
+    for (id = block->first_insn; id; id = ir_insn(function, id)->next_in_block) {
+      struct IrInsn* insn = ir_insn(function, id);
+      if (insn->op == Ir_Call && !insn->receiver && cstr_match(insn->name, "ebpf_ipv4_checksum")
+          && !ir_function_of(program->ir, insn->decl)) {
+        lower_checksum(program, id);
+      }
+    }
+  }
+}
@@ -0,0 +1,295 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "ir.h"
+#include "ebpf.h"
+#include <memory.h>  // memset
+
+
+/*
+ * Parser optimization for the eBPF targets.  Linear chains of states, where
+ * a state's only way in is the state before it, become one block.  Then the
+ * extracts of each straight stretch of a block share one `packet_check` of
+ * their total size in place of a bounds check each, so that the offset of
+ * every header in the stretch is fixed and the verifier sees one comparison
+ * against data_end.
+ *
+ * Failing the check rejects before the headers in front of the short one are
+ * extracted, which the eBPF targets cannot tell apart: a rejected packet is
+ * dropped.
+ */
+
+internal struct IrFunction* function;
+
+/* Bytes that a call of `packet_in` reads at the cursor and moves past, or -1. */
+int
+ebpf_packet_bytes(struct IrFunction* f, struct IrInsn* insn)
+{
+  if (insn->op != Ir_Call || !insn->receiver || insn->arg_count != 1) {
+    return -1;
+  }
+  struct Type* receiver = ebpf_resolve_type(ir_insn(f, insn->receiver)->type);
+  if (!receiver || receiver->kind != Type_Extern || !cstr_match(receiver->name, "packet_in")) {
+    return -1;
+  }
+  struct IrInsn* arg = ir_insn(f, insn->args[0]);
+  if (cstr_match(insn->name, "extract")) {
+    struct Type* header = ebpf_resolve_type(arg->type);
+    return header->kind == Type_Header ? ebpf_header_size(header) : -1;
+  } else if (cstr_match(insn->name, "advance") && arg->op == Ir_Const) {
+    int64_t bits;
+    if (bitint_to_int64(arg->value, &bits) && bits >= 0 && bits % 8 == 0 && bits / 8 <= EBPF_MAX_PACKET_OFFSET) {
+      return bits / 8;
+    }
+  }
+  return -1;
+}
+
+internal bool
+is_extract(struct IrInsn* insn)
+{
+  return cstr_match(insn->name, "extract");
+}
+
+/* Appends the only successor of `block` to it, if `block` is its only predecessor. */
+internal bool
+merge_successor(struct IrBlock* block)
+{
+  if (block->term == IrTerm_Select && block->case_count == 0) {
+    block->term = IrTerm_Jump;
+    block->keys = 0;
+    block->key_count = 0;
+    block->succ_count = 1;
+  }
+  if (block->term != IrTerm_Jump) {
+    return false;
+  }
+  struct IrBlock* succ = ir_block(function, block->succs[0]);
+  if (succ->id == block->id || succ->id == function->entry_block || succ->pred_count != 1) {
+    return false;
+  }
+  if (succ->first_insn && ir_insn(function, succ->first_insn)->op == Ir_Phi) {
+    return false;
+  }
+  int id = succ->first_insn;
+  while (id) {
+    struct IrInsn* insn = ir_insn(function, id);
+    insn->block = block->id;
+    id = insn->next_in_block;
+  }
+  if (succ->first_insn) {
+    if (block->last_insn) {
+      ir_insn(function, block->last_insn)->next_in_block = succ->first_insn;
+    } else {
+      block->first_insn = succ->first_insn;
+    }
+    block->last_insn = succ->last_insn;
+  }
+  if (!block->label) {
+    block->label = succ->label;
+  }
+  block->term = succ->term;
+  block->value = succ->value;
+  block->keys = succ->keys;
+  block->key_count = succ->key_count;
+  block->succs = succ->succs;
+  block->succ_count = succ->succ_count;
+  block->case_values = succ->case_values;
+  block->select_cases = succ->select_cases;
+  block->case_count = succ->case_count;
+  int i, j;
+  for (i = 0; i < block->succ_count; i++) {
+    struct IrBlock* next = ir_block(function, block->succs[i]);
+    for (j = 0; j < next->pred_count; j++) {
+      if (next->preds[j] == succ->id) {
+        next->preds[j] = block->id;
+      }
+    }
+  }
+  succ->first_insn = succ->last_insn = 0;
+  succ->pred_count = 0;
+  succ->term = IrTerm_NONE_;
+  succ->value = 0;
+  succ->key_count = 0;
+  succ->succ_count = 0;
+  return true;
+}
+
+/* Puts a packet_check in front of each stretch of two or more extracts in `block`. */
+internal void
+hoist_checks(struct IrBlock* block)
+{
+  int prev = 0, id = block->first_insn;
+  while (id) {
+    struct IrInsn* insn = ir_insn(function, id);
+    if (ebpf_packet_bytes(function, insn) < 0 || !is_extract(insn)) {
+      prev = id;
+      id = insn->next_in_block;
+      continue;
+    }
+    /* The stretch runs to the last extract before a call of anything else. */
+    int bytes = 0, covered = 0, extracts = 0;
+    int next = id;
+    while (next) {
+      struct IrInsn* other = ir_insn(function, next);
+      if (other->op == Ir_Call) {
+        int size = ebpf_packet_bytes(function, other);
+        if (size < 0) {
+          break;
+        }
+        bytes += size;
+        if (is_extract(other)) {
+          covered = bytes;
+          extracts += 1;
+        }
+      }
+      next = other->next_in_block;
+    }
+    if (extracts >= 2) {
+      struct IrInsn* check = ir_new_insn(function, Ir_PacketCheck, 0, 0, insn->line_nr, 0);
+      insn = ir_insn(function, id);
+      check->block = block->id;
+      check->index = covered;
+      check->next_in_block = id;
+      if (prev) {
+        ir_insn(function, prev)->next_in_block = check->id;
+      } else {
+        block->first_insn = check->id;
+      }
+    }
+    /* Resume after the stretch. */
+    while (id != next) {
+      prev = id;
+      id = ir_insn(function, id)->next_in_block;
+    }
+  }
+}
+
+void
+ebpf_optimize_parser(struct IrFunction* parser)
+{
+  int i;
+  function = parser;
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    if (i != function->entry_block && block->pred_count == 0) {
+      continue;
+    }
+    while (merge_successor(block));
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    hoist_checks(ir_block(function, i));
+  }
+}
+
+/*
+ * Loops.  Each trip round a parser loop moves the cursor past what it
+ * extracts, and the parser rejects past EBPF_MAX_PACKET_OFFSET: a block that
+ * every way back to it moves past `n` bytes or more runs at most
+ * EBPF_MAX_PACKET_OFFSET / n + 2 times, and one that every way back to it
+ * extracts the next element of a header stack, at most once more than the
+ * widest stack.  A way back that moves past nothing has no bound the verifier
+ * could find.
+ */
+
+/* Bytes that `block` moves the cursor past at least; `stack_width` gets the stack it extracts `next` of, or 0. */
+internal int
+block_bytes(struct IrBlock* block, int* stack_width)
+{
+  int bytes = 0, id = block->first_insn;
+  *stack_width = 0;
+  while (id) {
+    struct IrInsn* insn = ir_insn(function, id);
+    int size = ebpf_packet_bytes(function, insn);
+    if (size > 0) {
+      bytes += size;
+    }
+    if (size >= 0 && is_extract(insn)) {
+      struct IrInsn* header = ir_insn(function, insn->args[0]);
+      struct IrInsn* stack = header->op == Ir_Field ? ir_insn(function, header->args[0]) : 0;
+      struct Type* type = stack ? ebpf_resolve_type(stack->type) : 0;
+      if (type && type->kind == Type_HeaderStack && cstr_match(header->name, "next") && type->width > *stack_width) {
+        *stack_width = type->width;
+      }
+    }
+    id = insn->next_in_block;
+  }
+  return bytes;
+}
+
+/* The fewest bytes of a way from `head` back to it, or -1 if none; with `widths`, of the ways through no stack. */
+internal int
+shortest_loop(int head, int* bytes, int* widths, int* dist, bool* is_done)
+{
+  int n = function->blocks.elem_count;
+  int shortest = -1;
+  int i, k;
+  if (widths && widths[head]) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    dist[i] = -1;
+    is_done[i] = false;
+  }
+  dist[head] = bytes[head];
+  for (;;) {
+    int next = -1;
+    for (i = 1; i < n; i++) {
+      if (!is_done[i] && dist[i] >= 0 && (next < 0 || dist[i] < dist[next])) {
+        next = i;
+      }
+    }
+    if (next < 0) {
+      return shortest;
+    }
+    is_done[next] = true;
+    struct IrBlock* block = ir_block(function, next);
+    for (k = 0; k < block->succ_count; k++) {
+      int succ = block->succs[k];
+      if (succ == head) {
+        shortest = shortest < 0 || dist[next] < shortest ? dist[next] : shortest;
+      } else if (!(widths && widths[succ]) && (dist[succ] < 0 || dist[next] + bytes[succ] < dist[succ])) {
+        dist[succ] = dist[next] + bytes[succ];
+      }
+    }
+  }
+}
+
+/* How many times each block of `parser` runs at most, by block id. */
+int*
+ebpf_loop_trips(struct IrFunction* parser, struct Arena* storage)
+{
+  int n = parser->blocks.elem_count;
+  int* trips = arena_push(storage, n * sizeof(int));
+  int* bytes = arena_push(storage, n * sizeof(int));
+  int* widths = arena_push(storage, n * sizeof(int));
+  int* dist = arena_push(storage, n * sizeof(int));
+  bool* is_done = arena_push(storage, n * sizeof(bool));
+  int widest = 0;
+  int i;
+  function = parser;
+  memset(bytes, 0, n * sizeof(int));
+  memset(widths, 0, n * sizeof(int));
+  trips[0] = 1;
+  for (i = 1; i < n; i++) {
+    bytes[i] = block_bytes(ir_block(function, i), &widths[i]);
+    widest = widths[i] > widest ? widths[i] : widest;
+  }
+  for (i = 1; i < n; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    bool is_live = i == function->entry_block || block->pred_count > 0;
+    int shortest = is_live ? shortest_loop(i, bytes, 0, dist, is_done) : -1;
+    trips[i] = 1;
+    if (shortest == 0) {
+      error("at line %d: parser `%s` can come back to state `%s` without extracting anything, which the verifier "
+            "cannot bound.", block->first_insn ? ir_insn(function, block->first_insn)->line_nr : parser->decl->line_nr,
+            parser->name, block->label ? block->label : "entry");
+    } else if (shortest > 0) {
+      trips[i] = EBPF_MAX_PACKET_OFFSET / shortest + 2;
+      if (shortest_loop(i, bytes, widths, dist, is_done) < 0 && widest + 1 < trips[i]) {
+        trips[i] = widest + 1;
+      }
+    }
+  }
+  return trips;
+}
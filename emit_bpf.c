@@ -0,0 +1,4489 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "type_check.h"
+#include "ir.h"
+#include "ebpf.h"
+#include <memory.h>  // memset, memcpy
+#include <string.h>  // strlen
+
+
+/*
+ * eBPF object backend for XDP: the program of emit_xdp.c, compiled straight
+ * to BPF instructions and written as an ELF relocatable that ebpf/bpf_load.c
+ * loads, without a C compiler in between.
+ *
+ * Everything is inlined into one program.  Headers, locals and temporaries
+ * live at fixed offsets in the stack frame, so references resolve at compile
+ * time; a stack element picked at run time is reached through a chain of
+ * compares, since the verifier wants constant stack offsets.  IR values go to
+ * virtual registers, which a linear scan maps onto R1-R9 once the code is
+ * selected.  Frame slots are then packed by the stretch of code that reaches
+ * them; what does not fit in the 512 bytes of stack goes to a per-CPU scratch
+ * map, looked up into R9 when the program starts.  Maps are loaded by
+ * `ld_imm64` instructions with a relocation against their symbol in the
+ * "maps" section.
+ *
+ * With --target=ubpf the same code runs in the userspace VM of
+ * ebpf/ubpf_run.c: its context is a struct ubpf_md, whose packet pointers
+ * are 64 bits wide, and its sections are "ubpf" and "ubpf/<stage>".  The
+ * helpers keep their kernel numbers; lookup3 for `hash` is one of its own.
+ */
+
+/* Instruction classes, sizes, modes, operations: linux/bpf.h. */
+#define BPF_LD     0x00
+#define BPF_LDX    0x01
+#define BPF_ST     0x02
+#define BPF_STX    0x03
+#define BPF_ALU    0x04
+#define BPF_JMP    0x05
+#define BPF_ALU64  0x07
+#define BPF_W      0x00
+#define BPF_H      0x08
+#define BPF_B      0x10
+#define BPF_DW     0x18
+#define BPF_IMM    0x00
+#define BPF_MEM    0x60
+#define BPF_XADD   0xc0
+#define BPF_K      0x00
+#define BPF_X      0x08
+#define BPF_ADD    0x00
+#define BPF_SUB    0x10
+#define BPF_MUL    0x20
+#define BPF_DIV    0x30
+#define BPF_OR     0x40
+#define BPF_AND    0x50
+#define BPF_LSH    0x60
+#define BPF_RSH    0x70
+#define BPF_NEG    0x80
+#define BPF_XOR    0xa0
+#define BPF_MOV    0xb0
+#define BPF_ARSH   0xc0
+#define BPF_END    0xd0
+#define BPF_TO_BE  0x08
+#define BPF_JA     0x00
+#define BPF_JEQ    0x10
+#define BPF_JGT    0x20
+#define BPF_JGE    0x30
+#define BPF_JNE    0x50
+#define BPF_JSGT   0x60
+#define BPF_JSGE   0x70
+#define BPF_CALL   0x80
+#define BPF_EXIT   0x90
+#define BPF_JLT    0xa0
+#define BPF_JLE    0xb0
+#define BPF_JSLT   0xc0
+#define BPF_JSLE   0xd0
+#define BPF_PSEUDO_MAP_FD  1
+
+#define BPF_FUNC_map_lookup_elem  1
+#define BPF_FUNC_map_update_elem  2
+#define BPF_FUNC_ktime_get_ns     5
+#define BPF_FUNC_tail_call       12
+#define BPF_FUNC_redirect        23
+#define BPF_FUNC_xdp_adjust_head 44
+#define BPF_FUNC_xdp_adjust_tail 65
+#define UBPF_FUNC_hash_lookup3   256  /* ebpf/ubpf_run.c: lookup3(data, size) */
+
+#define BPF_ANY      0
+#define BPF_NOEXIST  1
+
+#define XDP_ABORTED   0
+#define XDP_DROP      1
+#define XDP_PASS      2
+#define XDP_REDIRECT  4
+#define UBPF_REDIRECT 3  /* REDIRECT of enum ubpf_action */
+
+#define BPF_REG_FP        10
+#define BPF_REG_SCRATCH   9    /* the scratch area, when the stack is not enough */
+#define BPF_VREG_BASE     16   /* registers below are the machine's */
+#define BPF_STACK_SIZE    512
+#define BPF_SCRATCH_SIZE  32768  /* the largest value of a per-CPU map */
+#define BPF_SLOT_SPAN     0x10000  /* of the virtual frame offsets of a slot */
+
+/* struct xdp_md */
+#define XDP_MD_DATA             0
+#define XDP_MD_DATA_END         4
+#define XDP_MD_INGRESS_IFINDEX  12
+
+/* struct ubpf_md of ebpf/ubpf_run.c */
+#define UBPF_MD_DATA             0
+#define UBPF_MD_DATA_END         8
+#define UBPF_MD_INGRESS_IFINDEX  16
+
+#define HASH_MAX_DATA  256
+
+#define EM_BPF       247
+#define R_BPF_64_64  1
+
+struct BpfInsn {
+  uint8_t code;
+  int dst;
+  int src;
+  int off;
+  int64_t imm;   /* 64 bits for `ld_imm64` */
+  int label;     /* jumps */
+  int map;       /* `ld_imm64` of a map: its index + 1 */
+  int frame_slot;  /* the two instructions of a frame address: its slot + 1 */
+  struct IrFunction* block;  /* the parser or control it is emitted for, or 0 */
+  int trips;                 /* how many times it runs at most, as a parser loop goes round */
+};
+
+/* A place in the stack frame, known at compile time but for a stack index. */
+struct BpfRef {
+  int offset;       /* from the frame pointer; of element 0 when indexed */
+  int index_vreg;   /* element chosen at run time, or 0 */
+  int stride;
+  int count;
+  int value_vreg;   /* a computed value that reads like memory (`lastIndex`, `size`), or 0 */
+  bool is_indexed;  /* the element is reached through its address, not by compares of the index */
+  bool is_extern;   /* packet_in, instances: nothing in memory */
+};
+
+/* One inlined parser, control, action or function. */
+/* What emitting a header does, in the passes of the deparser around the move of the packet start. */
+enum BpfPass {
+  BpfPass_Write,
+  BpfPass_Measure,  /* only add up the size of what would be emitted */
+  BpfPass_Fill,     /* only load the untouched fields of the headers that move */
+  BpfPass_Shift,    /* backwards from the end: move the headers that go further on */
+};
+
+struct BpfFrame {
+  struct IrFunction* function;
+  struct BpfFrame* owner;     /* actions: the frame of their control */
+  struct BpfRef* refs;        /* by insn id */
+  int* vregs;                 /* by insn id */
+  int* hits;                  /* table applies: whether the lookup hit, by insn id */
+  int* use_count;             /* by insn id */
+  bool* fused;                /* comparisons emitted as the branch of their block */
+  int* labels;                /* by block id */
+  struct BpfRef* params;      /* memory of the parameters, by index */
+  int* param_vregs;           /* values of the parameters passed by value */
+  struct BpfRef* locals;      /* by index in function->locals */
+  int return_label;
+  int result_vreg;
+  int exit_label;
+  int reject_label;
+  enum BpfPass pass;          /* deparsers */
+};
+
+struct BpfEdge {
+  int label;
+  int block;
+  int succ;
+};
+
+internal struct Arena* emit_storage;
+internal struct Arena stage_storage = {};  /* what the code of one stage is made of, rewound once it is encoded */
+internal struct EbpfProgram* program;
+internal struct UnboundedArray code;     /* struct BpfInsn */
+internal struct UnboundedArray labels;   /* int: position in `code` */
+internal struct UnboundedArray maps;     /* struct EbpfMap* */
+internal struct UnboundedArray pending;  /* struct BpfEdge: edges with phi moves, placed after their terminator */
+internal int vreg_count;
+internal struct UnboundedArray slots;    /* struct BpfSlot */
+internal int frame_slot_count;           /* the slots of the selected code, before those of spilled registers */
+internal struct EbpfMap scratch_map;
+internal int scratch_start;              /* the first instruction after the scratch lookup */
+internal bool is_userspace;              /* --target=ubpf */
+internal int ctx_vreg;                   /* struct xdp_md*, or struct ubpf_md* */
+internal int packet_offset;              /* frame offset of the __u32 packet offset */
+internal int packet_delta;               /* frame offset of the __s64 move of the packet start */
+internal int packet_last;                /* frame offset of the __u32 1 + where the last extracted header emitted was */
+internal int packet_reordered;           /* frame offset of the __u32: extracted headers are emitted out of order */
+internal int packet_ahead;               /* frame offset of the __s64 furthest on an extracted header goes */
+internal int zero_key;                   /* frame offset of a __u32 0 */
+internal int* table_areas;               /* frame offsets of the key and default value of each table, or 0 */
+internal struct EbpfMap init_map;
+internal int check_base;                 /* vreg pointing at the bytes of the current packet_check */
+internal int check_size;
+internal int check_offset;               /* of the next extract within them */
+internal struct IrFunction* emit_block;  /* the innermost parser or control being inlined, or 0 */
+internal int emit_trips = 1;             /* of the parser block being emitted: ebpf_loop_trips */
+internal struct BpfRef std_ref;          /* ubpf: the standard_metadata */
+internal int truncate_size;              /* ubpf: frame offset of the __u32 size `truncate` leaves of the packet */
+
+
+internal int
+align_to(int offset, int alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Types.  Memory is laid out as the C backend's structs would be.
+ */
+
+/* A constant as it sits in a register: zero-extended, or sign-extended if signed. */
+internal int64_t
+const_bits(struct BitInt* value)
+{
+  if (!value->is_sized) {
+    int64_t v = 0;
+    if (!bitint_to_int64(value, &v)) {
+      error("integer constant does not fit in 64 bits.");
+    }
+    return v;
+  }
+  uint64_t bits = value->word_count > 0 ? value->words[0] : 0;
+  if (value->is_signed && value->width < 64 && (bits >> (value->width - 1)) & 1) {
+    bits |= ~ebpf_width_mask(value->width);
+  }
+  return (int64_t)bits;
+}
+
+internal void mem_layout(struct Type* type, int* size, int* alignment);
+internal int view_offset(struct Type* header);
+
+/* Byte offset of member `index`; `member_count` is the validity byte of a header. */
+internal int
+member_offset(struct Type* type, int index)
+{
+  int offset = 0;
+  int size, alignment;
+  int i;
+  for (i = 0; i < index; i++) {
+    mem_layout(type->members[i].type, &size, &alignment);
+    offset = align_to(offset, alignment) + size;
+  }
+  if (index < type->member_count) {
+    mem_layout(type->members[index].type, &size, &alignment);
+    offset = align_to(offset, alignment);
+  }
+  return offset;
+}
+
+internal int
+member_index(struct Type* type, char* name, int line_nr)
+{
+  int i;
+  for (i = 0; i < type->member_count; i++) {
+    if (cstr_match(type->members[i].name, name)) {
+      return i;
+    }
+  }
+  error("at line %d: `%s` has no field `%s`.", line_nr, type->name, name);
+  return 0;
+}
+
+internal void
+mem_layout(struct Type* type, int* size, int* alignment)
+{
+  type = ebpf_resolve_type(type);
+  *size = 0;
+  *alignment = 1;
+  if (!type || ebpf_is_extern_object(type)) {
+    return;
+  } else if (type->kind == Type_Int) {
+    *size = *alignment = 8;
+  } else if (type->kind == Type_HeaderStack) {
+    int elem_size, elem_alignment;
+    mem_layout(type->base, &elem_size, &elem_alignment);
+    *alignment = 8;
+    *size = align_to(align_to(elem_size * type->width, 8) + 4, 8);
+  } else if (type->kind == Type_Struct || type->kind == Type_Header || type->kind == Type_HeaderUnion) {
+    int i, member_size, member_alignment;
+    for (i = 0; i < type->member_count; i++) {
+      mem_layout(type->members[i].type, &member_size, &member_alignment);
+      if (member_alignment > *alignment) {
+        *alignment = member_alignment;
+      }
+    }
+    *size = member_offset(type, type->member_count);
+    if (type->kind == Type_Header || type->member_count == 0) {
+      *size += 1;
+    }
+    if (view_offset(type)) {
+      *alignment = *alignment > 4 ? *alignment : 4;
+      *size = view_offset(type) + 4;
+    }
+    *size = align_to(*size, *alignment);
+  } else {
+    *size = *alignment = ebpf_scalar_size(type);
+    if (*size == 0) {
+      error("the BPF target does not support values of type `%s`.", type_to_string(type));
+    }
+  }
+}
+
+/* Offset of the __u32 1 + where a view was extracted, after its validity byte; 0 if not a view. */
+internal int
+view_offset(struct Type* header)
+{
+  return ebpf_view_of(program, header) ? align_to(member_offset(header, header->member_count) + 1, 4) : 0;
+}
+
+internal int
+mem_size(struct Type* type)
+{
+  int size, alignment;
+  mem_layout(type, &size, &alignment);
+  return size;
+}
+
+/*
+ * The __u32 next index of a stack starts an 8-byte word of the frame, as does
+ * the packet offset: the verifier only keeps track of what is spilled to the
+ * start of a word, and the parser loops end on them.
+ */
+internal int
+stack_next_offset(struct Type* stack)
+{
+  return align_to(mem_size(stack->base) * stack->width, 8);
+}
+
+/*
+ * Code.  Registers from BPF_VREG_BASE are virtual; jumps go to labels.
+ */
+
+internal int
+new_vreg()
+{
+  return vreg_count++;
+}
+
+internal int
+new_label()
+{
+  int position = -1;
+  array_append(&labels, &position);
+  return labels.elem_count - 1;
+}
+
+internal void
+place_label(int label)
+{
+  *(int*)array_get(&labels, label) = code.elem_count;
+}
+
+internal struct BpfInsn*
+op(uint8_t opcode, int dst, int src, int off, int64_t imm)
+{
+  struct BpfInsn insn;
+  memset(&insn, 0, sizeof(insn));
+  insn.code = opcode;
+  insn.dst = dst;
+  insn.src = src;
+  insn.off = off;
+  insn.imm = imm;
+  insn.label = -1;
+  insn.block = emit_block;
+  insn.trips = emit_trips;
+  array_append(&code, &insn);
+  return (struct BpfInsn*)array_get(&code, code.elem_count - 1);
+}
+
+internal bool
+fits_imm(int64_t value)
+{
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+internal uint8_t
+size_code(int size)
+{
+  switch (size) {
+    case 1: return BPF_B;
+    case 2: return BPF_H;
+    case 4: return BPF_W;
+    case 8: return BPF_DW;
+  }
+  assert(0);
+  return 0;
+}
+
+internal void
+op_mov(int dst, int src)
+{
+  op(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+}
+
+internal void
+op_mov_imm(int dst, int64_t value)
+{
+  if (fits_imm(value)) {
+    op(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, value);
+  } else {
+    op(BPF_LD | BPF_IMM | BPF_DW, dst, 0, 0, value);
+  }
+}
+
+internal void
+op_alu(uint8_t alu_op, int dst, int src)
+{
+  op(BPF_ALU64 | alu_op | BPF_X, dst, src, 0, 0);
+}
+
+/* `dst op= value`, through a scratch register if the value is too wide for an immediate. */
+internal void
+op_alu_imm(uint8_t alu_op, int dst, int64_t value)
+{
+  if (value == 0 && (alu_op == BPF_ADD || alu_op == BPF_SUB || alu_op == BPF_OR || alu_op == BPF_XOR
+                     || alu_op == BPF_LSH || alu_op == BPF_RSH || alu_op == BPF_ARSH)) {
+    return;
+  }
+  if (fits_imm(value)) {
+    op(BPF_ALU64 | alu_op | BPF_K, dst, 0, 0, value);
+  } else {
+    int reg = new_vreg();
+    op_mov_imm(reg, value);
+    op_alu(alu_op, dst, reg);
+  }
+}
+
+internal void
+op_load(int size, int dst, int base, int off)
+{
+  op(BPF_LDX | BPF_MEM | size_code(size), dst, base, off, 0);
+}
+
+internal void
+op_store(int size, int base, int off, int src)
+{
+  op(BPF_STX | BPF_MEM | size_code(size), base, src, off, 0);
+}
+
+internal void
+op_store_imm(int size, int base, int off, int32_t value)
+{
+  op(BPF_ST | BPF_MEM | size_code(size), base, 0, off, value);
+}
+
+internal void
+op_jump(int label)
+{
+  op(BPF_JMP | BPF_JA, 0, 0, 0, 0)->label = label;
+}
+
+internal void
+op_jump_imm(uint8_t jump_op, int dst, int64_t value, int label)
+{
+  if (fits_imm(value)) {
+    op(BPF_JMP | jump_op | BPF_K, dst, 0, 0, value)->label = label;
+  } else {
+    int reg = new_vreg();
+    op_mov_imm(reg, value);
+    op(BPF_JMP | jump_op | BPF_X, dst, reg, 0, 0)->label = label;
+  }
+}
+
+internal void
+op_jump_reg(uint8_t jump_op, int dst, int src, int label)
+{
+  op(BPF_JMP | jump_op | BPF_X, dst, src, 0, 0)->label = label;
+}
+
+internal void
+op_call(int helper)
+{
+  op(BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+}
+
+internal int
+map_index(struct EbpfMap* map)
+{
+  int i;
+  for (i = 0; i < maps.elem_count; i++) {
+    if (*(struct EbpfMap**)array_get(&maps, i) == map) {
+      return i;
+    }
+  }
+  array_append(&maps, &map);
+  return maps.elem_count - 1;
+}
+
+internal void
+op_load_map(int dst, struct EbpfMap* map)
+{
+  op(BPF_LD | BPF_IMM | BPF_DW, dst, BPF_PSEUDO_MAP_FD, 0, 0)->map = map_index(map) + 1;
+}
+
+internal int slot_index(int offset, int* byte);
+
+/* `dst` = fp + `offset`. */
+internal void
+op_frame_address(int dst, int offset)
+{
+  int byte;
+  int slot = slot_index(offset, &byte) + 1;
+  op(BPF_ALU64 | BPF_MOV | BPF_X, dst, BPF_REG_FP, 0, 0)->frame_slot = slot;
+  op(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, offset)->frame_slot = slot;
+}
+
+/* Reduces `reg` to the values of `type`: masked, or sign-extended from its width. */
+internal void
+op_wrap(int reg, struct Type* type)
+{
+  int width = ebpf_scalar_bits(type);
+  if (ebpf_resolve_type(type)->kind == Type_Bool || width >= 64) {
+    return;
+  } else if (ebpf_is_signed(type)) {
+    op_alu_imm(BPF_LSH, reg, 64 - width);
+    op_alu_imm(BPF_ARSH, reg, 64 - width);
+  } else if (width == 32) {
+    op(BPF_ALU | BPF_MOV | BPF_X, reg, reg, 0, 0);
+  } else if (width < 32) {
+    op_alu_imm(BPF_AND, reg, (int64_t)ebpf_width_mask(width));
+  } else {
+    op_alu_imm(BPF_LSH, reg, 64 - width);
+    op_alu_imm(BPF_RSH, reg, 64 - width);
+  }
+}
+
+/* `reg` &= `mask`, for any 64-bit mask. */
+internal void
+op_mask(int reg, uint64_t mask)
+{
+  if (mask == ~0ull) {
+    return;
+  } else if (mask <= INT32_MAX) {
+    op_alu_imm(BPF_AND, reg, (int64_t)mask);
+  } else {
+    int m = new_vreg();
+    op_mov_imm(m, (int64_t)mask);
+    op_alu(BPF_AND, reg, m);
+  }
+}
+
+/*
+ * The stack frame.  Each allocation is a slot of its own, at the virtual
+ * offset -(index + 1) * BPF_SLOT_SPAN from the frame pointer, until
+ * layout_frame() places the slots and place_frame() rewrites the offsets.
+ */
+
+struct BpfSlot {
+  int size;
+  int alignment;
+  int start;       /* the first and last instructions that reach it */
+  int end;
+  int at;          /* the stack bytes above it, or its offset in the scratch area */
+  bool is_spill;
+  bool is_stack;   /* reached before the scratch area is looked up */
+  bool is_placed;
+  bool is_scratch;
+};
+
+internal struct BpfSlot*
+slot_at(int index)
+{
+  return (struct BpfSlot*)array_get(&slots, index);
+}
+
+/* The slot of a virtual frame offset, and the offset within it. */
+internal int
+slot_index(int offset, int* byte)
+{
+  int index = (BPF_SLOT_SPAN - 1 - offset) / BPF_SLOT_SPAN - 1;
+  *byte = offset + (index + 1) * BPF_SLOT_SPAN;
+  return index;
+}
+
+internal int
+frame_alloc(int size, int alignment)
+{
+  struct BpfSlot slot;
+  memset(&slot, 0, sizeof(slot));
+  /* Accesses are as wide as their offset in the slot allows: it starts on a boundary as wide. */
+  slot.alignment = alignment > 8 ? 8 : alignment;
+  while (slot.alignment < 8 && slot.alignment < size) {
+    slot.alignment *= 2;
+  }
+  slot.size = align_to(size, slot.alignment);
+  if (slot.size > BPF_SCRATCH_SIZE) {
+    error("the program needs more than the %d bytes of scratch memory that BPF allows.", BPF_SCRATCH_SIZE);
+  }
+  array_append(&slots, &slot);
+  return -slots.elem_count * BPF_SLOT_SPAN;
+}
+
+internal struct BpfRef
+stack_ref(int offset)
+{
+  struct BpfRef ref;
+  memset(&ref, 0, sizeof(ref));
+  ref.offset = offset;
+  return ref;
+}
+
+internal struct BpfRef
+alloc_ref(struct Type* type)
+{
+  int size, alignment;
+  mem_layout(type, &size, &alignment);
+  return stack_ref(frame_alloc(size > 0 ? size : 1, alignment));
+}
+
+/* Widest stores of zeroes that the alignment of `offset` allows. */
+internal void
+op_zero(int offset, int size)
+{
+  int done = 0;
+  while (done < size) {
+    int chunk = 8;
+    while (chunk > 1 && ((offset + done) % chunk != 0 || done + chunk > size)) {
+      chunk /= 2;
+    }
+    op_store_imm(chunk, BPF_REG_FP, offset + done, 0);
+    done += chunk;
+  }
+}
+
+/* Copies `size` bytes from `src_base` + `src` to `dst_base` + `dst`, no access wider than `max_chunk`. */
+internal void
+op_copy(int dst_base, int dst, int src_base, int src, int size, int max_chunk)
+{
+  int done = 0;
+  int reg = new_vreg();
+  while (done < size) {
+    int chunk = max_chunk;
+    while (chunk > 1 && ((dst + done) % chunk != 0 || (src + done) % chunk != 0 || done + chunk > size)) {
+      chunk /= 2;
+    }
+    op_load(chunk, reg, src_base, src + done);
+    op_store(chunk, dst_base, dst + done, reg);
+    done += chunk;
+  }
+}
+
+/*
+ * A reference with a stack index is accessed once per element, behind
+ * compares of the index, or if `is_indexed` once, through the address of the
+ * element; either way an index past the end selects the last element.
+ *
+ *   chain_begin(&chain, &ref);
+ *   while (chain_next(&chain, &base, &offset)) { ... access at base + offset ... }
+ *
+ * The addresses are aligned to `chain.alignment`.
+ */
+
+struct BpfChain {
+  struct BpfRef* ref;
+  int k;
+  int next;
+  int join;
+  int alignment;
+};
+
+internal void
+chain_begin(struct BpfChain* chain, struct BpfRef* ref)
+{
+  chain->ref = ref;
+  chain->k = 0;
+  chain->next = -1;
+  chain->join = ref->index_vreg && !ref->is_indexed ? new_label() : -1;
+  chain->alignment = 8;
+}
+
+/* `dst` = the address of the element that `ref->index_vreg` selects. */
+internal void
+op_element_address(int dst, struct BpfRef* ref)
+{
+  int index = new_vreg();
+  int in_range = new_label();
+  op_mov(index, ref->index_vreg);
+  op_jump_imm(BPF_JLT, index, ref->count, in_range);
+  op_mov_imm(index, ref->count - 1);
+  place_label(in_range);
+  op_alu_imm(BPF_MUL, index, ref->stride);
+  op_frame_address(dst, ref->offset);
+  op_alu(BPF_ADD, dst, index);
+}
+
+internal bool
+chain_next(struct BpfChain* chain, int* base, int* offset)
+{
+  struct BpfRef* ref = chain->ref;
+  *base = BPF_REG_FP;
+  if (!ref->index_vreg) {
+    *offset = ref->offset;
+    return chain->k++ == 0;
+  } else if (ref->is_indexed) {
+    int byte;
+    if (chain->k++ > 0) {
+      return false;
+    }
+    chain->alignment = slot_at(slot_index(ref->offset, &byte))->alignment;
+    while ((byte | ref->stride) % chain->alignment != 0) {
+      chain->alignment /= 2;
+    }
+    *base = new_vreg();
+    *offset = 0;
+    op_element_address(*base, ref);
+    return true;
+  }
+  if (chain->k > 0) {
+    op_jump(chain->join);
+    place_label(chain->next);
+  }
+  if (chain->k == ref->count) {
+    place_label(chain->join);
+    return false;
+  }
+  chain->next = new_label();
+  if (chain->k < ref->count - 1) {
+    op_jump_imm(BPF_JNE, ref->index_vreg, chain->k, chain->next);
+  }
+  *offset = ref->offset + chain->k * ref->stride;
+  chain->k += 1;
+  return true;
+}
+
+internal struct BpfRef
+ref_plus(struct BpfRef ref, int offset)
+{
+  ref.offset += offset;
+  return ref;
+}
+
+/* Loads a scalar of `type` from `ref` into `dst`, sign-extending signed values. */
+internal void
+op_load_ref(int dst, struct BpfRef* ref, struct Type* type)
+{
+  if (ref->value_vreg) {
+    op_mov(dst, ref->value_vreg);
+    return;
+  }
+  int size = mem_size(type);
+  struct BpfChain chain;
+  int base, offset;
+  chain_begin(&chain, ref);
+  while (chain_next(&chain, &base, &offset)) {
+    op_load(size, dst, base, offset);
+  }
+  if (ebpf_is_signed(type) && size < 8) {
+    op_alu_imm(BPF_LSH, dst, 64 - 8 * size);
+    op_alu_imm(BPF_ARSH, dst, 64 - 8 * size);
+  }
+}
+
+internal void
+op_load_byte(int dst, struct BpfRef* ref)
+{
+  struct BpfChain chain;
+  int base, offset;
+  chain_begin(&chain, ref);
+  while (chain_next(&chain, &base, &offset)) {
+    op_load(1, dst, base, offset);
+  }
+}
+
+internal void
+op_store_ref(struct BpfRef* ref, int size, int src)
+{
+  struct BpfChain chain;
+  int base, offset;
+  chain_begin(&chain, ref);
+  while (chain_next(&chain, &base, &offset)) {
+    op_store(size, base, offset, src);
+  }
+}
+
+internal void
+op_store_imm_ref(struct BpfRef* ref, int size, int32_t value)
+{
+  struct BpfChain chain;
+  int base, offset;
+  chain_begin(&chain, ref);
+  while (chain_next(&chain, &base, &offset)) {
+    op_store_imm(size, base, offset, value);
+  }
+}
+
+internal void
+op_copy_ref(struct BpfRef* dst, struct BpfRef* src, int size)
+{
+  struct BpfChain dst_chain, src_chain;
+  int dst_base, dst_offset, src_base, src_offset;
+  chain_begin(&dst_chain, dst);
+  while (chain_next(&dst_chain, &dst_base, &dst_offset)) {
+    chain_begin(&src_chain, src);
+    while (chain_next(&src_chain, &src_base, &src_offset)) {
+      int max_chunk = dst_chain.alignment < src_chain.alignment ? dst_chain.alignment : src_chain.alignment;
+      op_copy(dst_base, dst_offset, src_base, src_offset, size, max_chunk);
+    }
+  }
+}
+
+/*
+ * Wire format of headers: fields numbered from the most significant bit of
+ * the first byte, loaded with the widest accesses that fit when aligned.
+ */
+
+internal void
+op_swap(int reg, int size)
+{
+  if (size > 1) {
+    op(BPF_ALU | BPF_END | BPF_TO_BE, reg, 0, 0, 8 * size);
+  }
+}
+
+internal void
+load_packet_bytes(int dst, int b, int byte, int count)
+{
+  if (count == 1 || count == 2 || count == 4 || count == 8) {
+    op_load(count, dst, b, byte);
+    op_swap(dst, count);
+    return;
+  }
+  int head = count > 4 ? 4 : count > 2 ? 2 : 1;
+  int tail = new_vreg();
+  load_packet_bytes(dst, b, byte, head);
+  op_alu_imm(BPF_LSH, dst, 8 * (count - head));
+  load_packet_bytes(tail, b, byte + head, count - head);
+  op_alu(BPF_OR, dst, tail);
+}
+
+internal void
+load_packet_bits(int dst, int b, int offset, int width)
+{
+  if (offset % 8 == 0 && width % 8 == 0) {
+    load_packet_bytes(dst, b, offset / 8, width / 8);
+    return;
+  }
+  int part = new_vreg();
+  int k;
+  op_mov_imm(dst, 0);
+  for (k = offset / 8; k <= (offset + width - 1) / 8; k++) {
+    int lo = offset > 8 * k ? offset : 8 * k;
+    int hi = offset + width < 8 * k + 8 ? offset + width : 8 * k + 8;
+    op_load(1, part, b, k);
+    op_alu_imm(BPF_RSH, part, 8 * k + 8 - hi);
+    op_alu_imm(BPF_AND, part, (int64_t)ebpf_width_mask(hi - lo));
+    op_alu_imm(BPF_LSH, part, offset + width - hi);
+    op_alu(BPF_OR, dst, part);
+  }
+}
+
+internal void
+store_packet_bytes(int b, int byte, int count, int src, int shift)
+{
+  if (count == 1 || count == 2 || count == 4 || count == 8) {
+    int reg = new_vreg();
+    op_mov(reg, src);
+    op_alu_imm(BPF_RSH, reg, shift);
+    op_swap(reg, count);
+    op_store(count, b, byte, reg);
+    return;
+  }
+  int head = count > 4 ? 4 : count > 2 ? 2 : 1;
+  store_packet_bytes(b, byte, head, src, shift + 8 * (count - head));
+  store_packet_bytes(b, byte + head, count - head, src, shift);
+}
+
+internal void
+store_packet_bits(int b, int offset, int width, int src)
+{
+  if (offset % 8 == 0 && width % 8 == 0) {
+    store_packet_bytes(b, offset / 8, width / 8, src, 0);
+    return;
+  }
+  int byte = new_vreg();
+  int part = new_vreg();
+  int k;
+  for (k = offset / 8; k <= (offset + width - 1) / 8; k++) {
+    int lo = offset > 8 * k ? offset : 8 * k;
+    int hi = offset + width < 8 * k + 8 ? offset + width : 8 * k + 8;
+    int shift = 8 * k + 8 - hi;
+    int mask = (int)ebpf_width_mask(hi - lo) << shift;
+    op_load(1, byte, b, k);
+    op_alu_imm(BPF_AND, byte, ~mask & 0xff);
+    op_mov(part, src);
+    op_alu_imm(BPF_RSH, part, offset + width - hi);
+    op_alu_imm(BPF_LSH, part, shift);
+    op_alu_imm(BPF_AND, part, mask);
+    op_alu(BPF_OR, byte, part);
+    op_store(1, b, k, byte);
+  }
+}
+
+/* `dst` = the field of the context at `xdp_offset` in struct xdp_md, or the same field of struct ubpf_md. */
+internal void
+op_load_ctx(int dst, int xdp_offset)
+{
+  if (!is_userspace) {
+    op_load(4, dst, ctx_vreg, xdp_offset);
+  } else if (xdp_offset == XDP_MD_INGRESS_IFINDEX) {
+    op_load(4, dst, ctx_vreg, UBPF_MD_INGRESS_IFINDEX);
+  } else {
+    op_load(8, dst, ctx_vreg, xdp_offset == XDP_MD_DATA ? UBPF_MD_DATA : UBPF_MD_DATA_END);
+  }
+}
+
+/* Register pointing at `size` bytes at the offset in register `offset`; to `fail` if the packet is shorter. */
+internal int
+op_cursor_at(int offset, int size, int fail)
+{
+  int b = new_vreg();
+  int end = new_vreg();
+  op_jump_imm(BPF_JGT, offset, EBPF_MAX_PACKET_OFFSET, fail);
+  op_load_ctx(b, XDP_MD_DATA);
+  op_load_ctx(end, XDP_MD_DATA_END);
+  op_alu(BPF_ADD, b, offset);
+  op_mov(offset, b);
+  op_alu_imm(BPF_ADD, offset, size);
+  op_jump_reg(BPF_JGT, offset, end, fail);
+  return b;
+}
+
+/* Register pointing at `size` bytes at the packet offset; to `fail` if the packet is shorter. */
+internal int
+op_cursor(int size, int fail)
+{
+  int offset = new_vreg();
+  op_load(4, offset, BPF_REG_FP, packet_offset);
+  return op_cursor_at(offset, size, fail);
+}
+
+internal void
+op_advance(int size)
+{
+  int offset = new_vreg();
+  op_load(4, offset, BPF_REG_FP, packet_offset);
+  op_alu_imm(BPF_ADD, offset, size);
+  op_store(4, BPF_REG_FP, packet_offset, offset);
+}
+
+/* Fills the header at `ref` from the packet at `b` + `byte`, and moves the packet offset past it. */
+internal void
+op_parse(struct BpfRef* ref, struct Type* header, int b, int byte)
+{
+  struct EbpfHeader* view = ebpf_view_of(program, header);
+  int size = ebpf_header_size(header);
+  int* fields = arena_push(emit_storage, (header->member_count + 1) * sizeof(int));
+  int origin = 0;
+  int i;
+  if (view) {
+    origin = new_vreg();
+    op_load(4, origin, BPF_REG_FP, packet_offset);
+    op_alu_imm(BPF_ADD, origin, 1);
+  }
+  if (!ref->index_vreg) {
+    for (i = 0; i < header->member_count; i++) {
+      struct TypeMember* member = &header->members[i];
+      if (view && !view->is_read[i]) {
+        continue;
+      }
+      int field = new_vreg();
+      load_packet_bits(field, b, 8 * byte + ebpf_field_offset(header, i), ebpf_scalar_width(member->type));
+      if (ebpf_is_signed(member->type)) {
+        op_wrap(field, member->type);
+      }
+      op_store(mem_size(member->type), BPF_REG_FP, ref->offset + member_offset(header, i), field);
+    }
+    op_store_imm(1, BPF_REG_FP, ref->offset + member_offset(header, header->member_count), 1);
+    if (view) {
+      op_store(4, BPF_REG_FP, ref->offset + view_offset(header), origin);
+    }
+    op_advance(size);
+    return;
+  }
+  for (i = 0; i < header->member_count; i++) {
+    struct TypeMember* member = &header->members[i];
+    if (view && !view->is_read[i]) {
+      continue;
+    }
+    fields[i] = new_vreg();
+    load_packet_bits(fields[i], b, 8 * byte + ebpf_field_offset(header, i), ebpf_scalar_width(member->type));
+    if (ebpf_is_signed(member->type)) {
+      op_wrap(fields[i], member->type);
+    }
+  }
+  struct BpfChain chain;
+  int base, offset;
+  chain_begin(&chain, ref);
+  while (chain_next(&chain, &base, &offset)) {
+    for (i = 0; i < header->member_count; i++) {
+      if (!view || view->is_read[i]) {
+        op_store(mem_size(header->members[i].type), base, offset + member_offset(header, i), fields[i]);
+      }
+    }
+    op_store_imm(1, base, offset + member_offset(header, header->member_count), 1);
+    if (view) {
+      op_store(4, base, offset + view_offset(header), origin);
+    }
+  }
+  op_advance(size);
+}
+
+internal void
+op_extract(struct BpfRef* ref, struct Type* header, int fail)
+{
+  op_parse(ref, header, op_cursor(ebpf_header_size(header), fail), 0);
+}
+
+/* Writes the fields of the header at `offset` in the frame that `is_stored` says, or all of them, at `b`. */
+internal void
+op_store_fields(int b, int offset, struct Type* header, bool* is_stored)
+{
+  int i;
+  for (i = 0; i < header->member_count; i++) {
+    struct TypeMember* member = &header->members[i];
+    if (is_stored && !is_stored[i]) {
+      continue;
+    }
+    int field = new_vreg();
+    op_load(mem_size(member->type), field, BPF_REG_FP, offset + member_offset(header, i));
+    store_packet_bits(b, ebpf_field_offset(header, i), ebpf_scalar_width(member->type), field);
+  }
+}
+
+/* Copies `size` bytes from `s` to `d` in the packet; from the last piece down when `d` is after `s`. */
+internal void
+op_move_bytes(int d, int s, int size, bool is_backward)
+{
+  int reg = new_vreg();
+  int i;
+  for (i = 0; i < size;) {
+    int piece = size - i >= 8 ? 8 : size - i >= 4 ? 4 : size - i >= 2 ? 2 : 1;
+    int at = is_backward ? size - i - piece : i;
+    op_load(piece, reg, s, at);
+    op_store(piece, d, at, reg);
+    i += piece;
+  }
+}
+
+/*
+ * The header at `offset` in the frame, if valid, in the deparser pass `pass`.
+ * A view emitted where it was extracted only writes its written fields.  One
+ * that goes elsewhere is moved within the packet: those going further on by
+ * the shifting pass before the packet start moves, the others by the writing
+ * pass.  When extracted headers are emitted out of order, or the deparser
+ * does more than emit, the filling pass loads their untouched fields instead
+ * and they are written whole.
+ */
+internal void
+op_emit_header(int offset, struct Type* header, enum BpfPass pass)
+{
+  struct EbpfHeader* view = ebpf_view_of(program, header);
+  int size = ebpf_header_size(header);
+  int skip = new_label();
+  int done = new_label();
+  int valid = new_vreg();
+  int i;
+  op_load(1, valid, BPF_REG_FP, offset + member_offset(header, header->member_count));
+  op_jump_imm(BPF_JEQ, valid, 0, skip);
+  if (pass == BpfPass_Shift) {
+    int position = new_vreg();
+    op_load(4, position, BPF_REG_FP, packet_offset);
+    op_alu_imm(BPF_SUB, position, size);
+    op_store(4, BPF_REG_FP, packet_offset, position);
+  }
+  /* Only the headers that can be copied are measured for it. */
+  if (!view || (pass == BpfPass_Measure && !program->deparser_emits)) {
+    if (pass == BpfPass_Write) {
+      op_store_fields(op_cursor(size, skip), offset, header, 0);
+    }
+    if (pass != BpfPass_Shift) {
+      op_advance(size);
+    }
+    place_label(skip);
+    return;
+  }
+  /* How much further on it goes than it was, in the packet as it will be. */
+  int origin = new_vreg();
+  int moved = new_vreg();
+  int delta = new_vreg();
+  int whole = new_label();
+  int b = pass == BpfPass_Write ? op_cursor(size, skip) : 0;
+  op_load(4, origin, BPF_REG_FP, offset + view_offset(header));
+  op_jump_imm(BPF_JEQ, origin, 0, pass == BpfPass_Write ? whole : pass == BpfPass_Shift ? skip : done);
+  op_load(4, moved, BPF_REG_FP, packet_offset);
+  if (pass != BpfPass_Measure) {
+    /* The measuring pass runs before the packet start moves. */
+    op_load(8, delta, BPF_REG_FP, packet_delta);
+    op_alu(BPF_ADD, moved, delta);
+  }
+  op_alu_imm(BPF_ADD, moved, 1);
+  op_alu(BPF_SUB, moved, origin);
+  if (pass == BpfPass_Measure) {
+    int last = new_vreg();
+    int in_order = new_label();
+    int behind = new_label();
+    op_load(4, last, BPF_REG_FP, packet_last);
+    op_jump_reg(BPF_JGT, origin, last, in_order);
+    op_store_imm(4, BPF_REG_FP, packet_reordered, 1);
+    place_label(in_order);
+    op_store(4, BPF_REG_FP, packet_last, origin);
+    op_load(8, last, BPF_REG_FP, packet_ahead);
+    op_jump_reg(BPF_JSGE, last, moved, behind);
+    op_store(8, BPF_REG_FP, packet_ahead, moved);
+    place_label(behind);
+  } else if (pass == BpfPass_Shift) {
+    op_jump_imm(BPF_JSLE, moved, 0, skip);
+    op_alu_imm(BPF_SUB, origin, 1);
+    int s = op_cursor_at(origin, size, skip);
+    int position = new_vreg();
+    op_load(4, position, BPF_REG_FP, packet_offset);
+    op_alu(BPF_ADD, position, delta);
+    op_move_bytes(op_cursor_at(position, size, skip), s, size, true);
+    place_label(skip);
+    return;
+  } else if (pass == BpfPass_Fill) {
+    op_jump_imm(BPF_JEQ, moved, 0, done);
+    op_alu_imm(BPF_SUB, origin, 1);
+    int from = op_cursor_at(origin, size, done);
+    for (i = 0; i < header->member_count; i++) {
+      struct TypeMember* member = &header->members[i];
+      if (view->is_read[i]) {
+        continue;
+      }
+      int field = new_vreg();
+      load_packet_bits(field, from, ebpf_field_offset(header, i), ebpf_scalar_width(member->type));
+      if (ebpf_is_signed(member->type)) {
+        op_wrap(field, member->type);
+      }
+      op_store(mem_size(member->type), BPF_REG_FP, offset + member_offset(header, i), field);
+    }
+  } else {
+    /* Where it came from, the packet still holds the fields that were not written. */
+    int written = new_label();
+    op_jump_imm(BPF_JEQ, moved, 0, written);
+    if (program->deparser_emits) {
+      int reordered = new_vreg();
+      op_load(4, reordered, BPF_REG_FP, packet_reordered);
+      op_jump_imm(BPF_JNE, reordered, 0, whole);
+      op_jump_imm(BPF_JSGT, moved, 0, written);
+      op_alu_imm(BPF_SUB, origin, 1);
+      op_alu(BPF_SUB, origin, delta);
+      op_move_bytes(b, op_cursor_at(origin, size, written), size, false);
+      op_jump(written);
+    } else {
+      op_jump(whole);
+    }
+    place_label(whole);
+    op_store_fields(b, offset, header, 0);
+    op_jump(done);
+    place_label(written);
+    op_store_fields(b, offset, header, view->is_written);
+  }
+  place_label(done);
+  op_advance(size);
+  place_label(skip);
+}
+
+/*
+ * Maps.
+ */
+
+internal int
+table_index(struct EbpfTable* table)
+{
+  int i;
+  for (i = 0; i < program->tables.elem_count; i++) {
+    if ((struct EbpfTable*)array_get(&program->tables, i) == table) {
+      return i;
+    }
+  }
+  assert(0);
+  return 0;
+}
+
+/* The key of a table's map is built at table_areas[2 * i], its default value at table_areas[2 * i + 1]. */
+internal int
+table_area(struct EbpfTable* table, int which)
+{
+  int* area = &table_areas[2 * table_index(table) + which];
+  if (*area == 0) {
+    *area = frame_alloc(which == 0 ? table->key_size : table->value_size, 8);
+  }
+  return *area;
+}
+
+internal void
+op_key(struct EbpfTable* table, int key, int* values, int prefix_length)
+{
+  int i, j;
+  op_zero(key, table->key_size);
+  if (!table->is_lpm) {
+    for (i = 0; i < table->key_count; i++) {
+      op_store(table->keys[i].size, BPF_REG_FP, key + table->keys[i].offset, values[i]);
+    }
+    return;
+  }
+  /* Stack accesses must be aligned: the data goes in a byte at a time. */
+  op_store_imm(4, BPF_REG_FP, key, prefix_length);
+  int byte = new_vreg();
+  for (i = 0; i < table->key_count; i++) {
+    struct EbpfField* field = &table->keys[i];
+    for (j = 0; j < field->size; j++) {
+      op_mov(byte, values[i]);
+      op_alu_imm(BPF_RSH, byte, 8 * (field->size - 1 - j));
+      op_store(1, BPF_REG_FP, key + field->offset + j, byte);
+    }
+  }
+}
+
+internal void
+op_value(struct EbpfTable* table, int value, int action, struct BitInt** args)
+{
+  int i;
+  op_zero(value, table->value_size);
+  op_store_imm(4, BPF_REG_FP, value, action < 0 ? -1 : action);
+  if (table->valid_offset) {
+    op_store_imm(4, BPF_REG_FP, value + table->valid_offset, 1);
+  }
+  if (action < 0) {
+    return;
+  }
+  struct EbpfAction* a = &table->actions[action];
+  for (i = 0; args && i < a->param_count; i++) {
+    int reg = new_vreg();
+    op_mov_imm(reg, const_bits(args[i]));
+    op_store(a->params[i].size, BPF_REG_FP, value + table->action_offset + a->params[i].offset, reg);
+  }
+}
+
+/* R0 = bpf_map_update_elem(map, fp + key, fp + value, flags) */
+internal void
+op_map_update(struct EbpfMap* map, int key, int value, int flags)
+{
+  op_load_map(1, map);
+  op_frame_address(2, key);
+  op_frame_address(3, value);
+  op_mov_imm(4, flags);
+  op_call(BPF_FUNC_map_update_elem);
+}
+
+/* Register with bpf_map_lookup_elem(map, fp + key). */
+internal int
+op_map_lookup(struct EbpfMap* map, int key)
+{
+  int result = new_vreg();
+  op_load_map(1, map);
+  op_frame_address(2, key);
+  op_call(BPF_FUNC_map_lookup_elem);
+  op_mov(result, 0);
+  return result;
+}
+
+/* The masks of a tuple space table, then its entries from the last, so that the first with a key and mask wins. */
+internal void
+op_tuple_entries(struct EbpfTable* table)
+{
+  int* values = arena_push(emit_storage, (table->key_count + 1) * sizeof(int));
+  int mask = frame_alloc(table->mask_map.value_size, 8);
+  int index = frame_alloc(4, 4);
+  int key = table_area(table, 0);
+  int value = table_area(table, 1);
+  int m, e, k;
+  for (m = 0; m < table->mask_count; m++) {
+    int first = -1, count = 0;
+    for (e = 0; e < table->entry_count; e++) {
+      if (table->entry_masks[e] == m) {
+        first = first < 0 ? e : first;
+        count += 1;
+      }
+    }
+    struct EbpfTableEntry* entry = &table->entries[first];
+    for (k = 0; k < table->key_count; k++) {
+      values[k] = new_vreg();
+      op_mov_imm(values[k],
+                 entry->masks[k] ? const_bits(entry->masks[k]) : (int64_t)ebpf_width_mask(table->keys[k].width));
+    }
+    op_key(table, mask + 8, values, 0);
+    op_store_imm(4, BPF_REG_FP, mask + 8, m);
+    op_store_imm(4, BPF_REG_FP, mask, table->entry_count - first);
+    op_store_imm(4, BPF_REG_FP, mask + 4, count);
+    op_store_imm(4, BPF_REG_FP, index, m);
+    op_map_update(&table->mask_map, index, mask, BPF_ANY);
+  }
+  for (e = table->entry_count - 1; e >= 0; e--) {
+    struct EbpfTableEntry* entry = &table->entries[e];
+    for (k = 0; k < table->key_count; k++) {
+      values[k] = new_vreg();
+      op_mov_imm(values[k], const_bits(entry->masks[k] ? bitint_and(entry->keys[k], entry->masks[k]) : entry->keys[k]));
+    }
+    op_key(table, key, values, 0);
+    op_store_imm(4, BPF_REG_FP, key, table->entry_masks[e]);
+    op_value(table, value, entry->action, entry->args);
+    op_store_imm(4, BPF_REG_FP, value + table->priority_offset, table->entry_count - e);
+    op_map_update(&table->map, key, value, BPF_ANY);
+  }
+}
+
+/* Const entries, and default actions the control plane may change, are written on the first run. */
+internal void
+op_init_tables()
+{
+  int scan_entry = 0, scan_index = 0;
+  int i, e, k;
+  init_map.name = "ashp4c_init";
+  init_map.type = EbpfMap_Array;
+  init_map.key_size = 4;
+  init_map.value_size = 4;
+  init_map.max_entries = 1;
+  int done = new_label();
+  int initialized = op_map_lookup(&init_map, zero_key);
+  int flag = new_vreg();
+  op_jump_imm(BPF_JEQ, initialized, 0, done);
+  op_load(4, flag, initialized, 0);
+  op_jump_imm(BPF_JNE, flag, 0, done);
+  op_store_imm(4, initialized, 0, 1);
+  for (i = 0; i < program->tables.elem_count; i++) {
+    struct EbpfTable* table = (struct EbpfTable*)array_get(&program->tables, i);
+    if (table->default_map.type) {
+      int value = table_area(table, 1);
+      op_value(table, value, table->default_action, table->default_args);
+      op_map_update(&table->default_map, zero_key, value, BPF_ANY);
+    }
+    if (table->kind == EbpfTable_Tuple) {
+      op_tuple_entries(table);
+      continue;
+    }
+    for (e = 0; e < table->entry_count && table->kind != EbpfTable_Inline; e++) {
+      struct EbpfTableEntry* entry = &table->entries[e];
+      int* values = arena_push(emit_storage, (table->key_count + 1) * sizeof(int));
+      int prefix_length = 0;
+      for (k = 0; k < table->key_count; k++) {
+        struct EbpfField* field = &table->keys[k];
+        values[k] = new_vreg();
+        op_mov_imm(values[k], const_bits(entry->keys[k]));
+        int bits = field->width;
+        if (entry->masks[k]) {
+          uint64_t mask = entry->masks[k]->word_count > 0 ? entry->masks[k]->words[0] : 0;
+          bits = 0;
+          while (bits < field->width && (mask >> (field->width - 1 - bits)) & 1) {
+            bits += 1;
+          }
+        }
+        prefix_length += bits;
+      }
+      if (table->kind == EbpfTable_Scan) {
+        int* masks = arena_push(emit_storage, (table->key_count + 1) * sizeof(int));
+        for (k = 0; k < table->key_count; k++) {
+          masks[k] = new_vreg();
+          op_mov_imm(masks[k],
+                     entry->masks[k] ? const_bits(entry->masks[k]) : (int64_t)ebpf_width_mask(table->keys[k].width));
+        }
+        if (!scan_entry) {
+          scan_entry = frame_alloc(table->map.value_size, 8);
+          scan_index = frame_alloc(4, 4);
+        }
+        op_value(table, scan_entry, entry->action, entry->args);
+        op_key(table, scan_entry + table->entry_key_offset, values, prefix_length);
+        op_key(table, scan_entry + table->entry_key_offset + table->key_size, masks, prefix_length);
+        op_store_imm(4, BPF_REG_FP, scan_index, e);
+        op_map_update(&table->map, scan_index, scan_entry, BPF_ANY);
+        continue;
+      }
+      int key = table_area(table, 0);
+      int value = table_area(table, 1);
+      op_key(table, key, values, prefix_length);
+      op_value(table, value, entry->action, entry->args);
+      op_map_update(&table->map, key, value, BPF_ANY);
+    }
+  }
+  for (i = 0; i < program->selects.elem_count; i++) {
+    struct EbpfSelect* select = (struct EbpfSelect*)array_get(&program->selects, i);
+    if (select->kind != EbpfSelect_Map) {
+      continue;
+    }
+    int index = frame_alloc(4, 4);
+    int value = frame_alloc(4, 4);
+    for (e = 0; e < select->value_count; e++) {
+      op_store_imm(4, BPF_REG_FP, index, (int32_t)(select->values[e] - select->base));
+      op_store_imm(4, BPF_REG_FP, value, select->cases[e] + 1);
+      op_map_update(&select->map, index, value, BPF_ANY);
+    }
+  }
+  place_label(done);
+}
+
+/*
+ * Functions, inlined where they are called.
+ */
+
+internal struct BpfFrame*
+new_frame(struct IrFunction* f, struct BpfFrame* caller)
+{
+  struct BpfFrame* frame = arena_push(emit_storage, sizeof(*frame));
+  memset(frame, 0, sizeof(*frame));
+  int insn_count = f->insns.elem_count + 1;
+  int block_count = f->blocks.elem_count + 1;
+  int param_count = ebpf_list_count(f->params) + 1;
+  int local_count = f->locals.elem_count + 1;
+  frame->function = f;
+  frame->refs = arena_push(emit_storage, insn_count * sizeof(struct BpfRef));
+  memset(frame->refs, 0, insn_count * sizeof(struct BpfRef));
+  frame->vregs = arena_push(emit_storage, insn_count * sizeof(int));
+  memset(frame->vregs, 0, insn_count * sizeof(int));
+  frame->hits = arena_push(emit_storage, insn_count * sizeof(int));
+  memset(frame->hits, 0, insn_count * sizeof(int));
+  frame->use_count = arena_push(emit_storage, insn_count * sizeof(int));
+  memset(frame->use_count, 0, insn_count * sizeof(int));
+  frame->fused = arena_push(emit_storage, insn_count * sizeof(bool));
+  memset(frame->fused, 0, insn_count * sizeof(bool));
+  frame->labels = arena_push(emit_storage, block_count * sizeof(int));
+  memset(frame->labels, 0, block_count * sizeof(int));
+  frame->params = arena_push(emit_storage, param_count * sizeof(struct BpfRef));
+  memset(frame->params, 0, param_count * sizeof(struct BpfRef));
+  frame->param_vregs = arena_push(emit_storage, param_count * sizeof(int));
+  memset(frame->param_vregs, 0, param_count * sizeof(int));
+  frame->locals = arena_push(emit_storage, local_count * sizeof(struct BpfRef));
+  memset(frame->locals, 0, local_count * sizeof(struct BpfRef));
+  frame->return_label = new_label();
+  if (caller) {
+    frame->exit_label = caller->exit_label;
+    frame->reject_label = caller->reject_label;
+    frame->pass = caller->pass;
+  }
+  return frame;
+}
+
+internal int
+vreg_of(struct BpfFrame* frame, int id)
+{
+  if (!frame->vregs[id]) {
+    frame->vregs[id] = new_vreg();
+  }
+  return frame->vregs[id];
+}
+
+/* Constant operands are materialized where they are used. */
+internal int
+value_reg(struct BpfFrame* frame, int id)
+{
+  struct IrInsn* insn = ir_insn(frame->function, id);
+  if (insn->op == Ir_Const || insn->op == Ir_EnumConst) {
+    int reg = new_vreg();
+    op_mov_imm(reg, insn->op == Ir_Const ? const_bits(insn->value) : insn->index);
+    return reg;
+  }
+  return vreg_of(frame, id);
+}
+
+internal bool
+value_imm(struct BpfFrame* frame, int id, int64_t* imm)
+{
+  struct IrInsn* insn = ir_insn(frame->function, id);
+  if (insn->op == Ir_Const) {
+    *imm = const_bits(insn->value);
+    return fits_imm(*imm);
+  } else if (insn->op == Ir_EnumConst) {
+    *imm = insn->index;
+    return true;
+  }
+  return false;
+}
+
+/* Memory of `decl`, seen from the frame. */
+internal struct BpfRef
+var_ref(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct BpfRef ref;
+  memset(&ref, 0, sizeof(ref));
+  if (ebpf_is_extern_object(insn->type)) {
+    ref.is_extern = true;
+    return ref;
+  }
+  struct BpfFrame* f = frame;
+  while (f) {
+    int index = ebpf_list_index(f->function->params, insn->decl);
+    if (index >= 0) {
+      return f->params[index];
+    }
+    int i;
+    for (i = 0; i < f->function->locals.elem_count; i++) {
+      if (*(struct Ast**)array_get(&f->function->locals, i) == insn->decl) {
+        return f->locals[i];
+      }
+    }
+    f = f->owner;
+  }
+  error("at line %d: `%s` is not visible in `%s` for the BPF target.", insn->line_nr, ebpf_decl_name(insn->decl),
+        frame->function->name);
+  return ref;
+}
+
+internal struct BpfRef
+field_ref(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct IrInsn* base = ir_insn(frame->function, insn->args[0]);
+  struct BpfRef ref = frame->refs[base->id];
+  struct Type* type = ebpf_resolve_type(base->type);
+  if (type->kind != Type_HeaderStack) {
+    return ref_plus(ref, member_offset(type, member_index(type, insn->name, insn->line_nr)));
+  }
+  enum EbpfStackField field = ebpf_stack_field(insn->name);
+  int next_offset = ref.offset + stack_next_offset(type);
+  if (field == EbpfStackField_NextIndex) {
+    return stack_ref(next_offset);
+  }
+  int next = new_vreg();
+  op_load(4, next, BPF_REG_FP, next_offset);
+  if (field == EbpfStackField_Next || field == EbpfStackField_Last) {
+    if (field == EbpfStackField_Last) {
+      op_alu_imm(BPF_SUB, next, 1);
+    }
+    ref.index_vreg = next;
+    ref.stride = mem_size(type->base);
+    ref.count = type->width;
+    ref.is_indexed = ebpf_stack_of(program, type)->kind == EbpfStack_Indexed;
+    return ref;
+  } else if (field == EbpfStackField_LastIndex) {
+    op_alu_imm(BPF_SUB, next, 1);
+    op_wrap(next, insn->type);
+    ref.value_vreg = next;
+    return ref;
+  } else if (field == EbpfStackField_Size) {
+    op_mov_imm(next, type->width);
+    ref.value_vreg = next;
+    return ref;
+  }
+  error("at line %d: stack field `%s` is not supported by the BPF target.", insn->line_nr, insn->name);
+  return ref;
+}
+
+internal struct BpfRef
+index_ref(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct IrInsn* base = ir_insn(frame->function, insn->args[0]);
+  struct BpfRef ref = frame->refs[base->id];
+  struct Type* type = ebpf_resolve_type(base->type);
+  int stride = mem_size(type->base);
+  struct IrInsn* index = ir_insn(frame->function, insn->args[1]);
+  if (index->op == Ir_Const) {
+    int64_t i = 0;
+    if (!bitint_to_int64(index->value, &i) || i < 0 || i >= type->width) {
+      error("at line %d: stack index out of bounds.", index->line_nr);
+    }
+    return ref_plus(ref, (int)i * stride);
+  }
+  ref.index_vreg = value_reg(frame, index->id);
+  ref.stride = stride;
+  ref.count = type->width;
+  ref.is_indexed = ebpf_stack_of(program, type)->kind == EbpfStack_Indexed;
+  return ref;
+}
+
+internal struct BpfRef
+temp_ref(struct Type* type)
+{
+  struct BpfRef ref = alloc_ref(type);
+  op_zero(ref.offset, mem_size(type));
+  return ref;
+}
+
+/* Phi moves of the edge from `block` to `succ`, then the jump. */
+internal void
+emit_edge(struct BpfFrame* frame, struct IrBlock* block, int succ_id)
+{
+  struct IrFunction* function = frame->function;
+  struct IrBlock* succ = ir_block(function, succ_id);
+  int pred = 0;
+  while (pred < succ->pred_count && succ->preds[pred] != block->id) {
+    pred += 1;
+  }
+  assert(pred < succ->pred_count);
+  int phi_count = 0;
+  int id = succ->first_insn;
+  while (id && ir_insn(function, id)->op == Ir_Phi) {
+    phi_count += 1;
+    id = ir_insn(function, id)->next_in_block;
+  }
+  /* Parallel copy: all phis read their operands before any is written. */
+  int* temps = arena_push(emit_storage, (phi_count + 1) * sizeof(int));
+  int i = 0;
+  id = succ->first_insn;
+  while (id && ir_insn(function, id)->op == Ir_Phi) {
+    struct IrInsn* phi = ir_insn(function, id);
+    int64_t imm;
+    temps[i] = phi_count > 1 ? new_vreg() : vreg_of(frame, id);
+    if (value_imm(frame, phi->args[pred], &imm)) {
+      op_mov_imm(temps[i], imm);
+    } else {
+      op_mov(temps[i], value_reg(frame, phi->args[pred]));
+    }
+    i += 1;
+    id = phi->next_in_block;
+  }
+  i = 0;
+  id = succ->first_insn;
+  while (phi_count > 1 && id && ir_insn(function, id)->op == Ir_Phi) {
+    op_mov(vreg_of(frame, id), temps[i]);
+    i += 1;
+    id = ir_insn(function, id)->next_in_block;
+  }
+  op_jump(frame->labels[succ_id]);
+}
+
+/* Label to jump to for the edge to `succ`; an edge with phi moves gets code of its own. */
+internal int
+edge_label(struct BpfFrame* frame, struct IrBlock* block, int succ_id)
+{
+  struct IrBlock* succ = ir_block(frame->function, succ_id);
+  if (!succ->first_insn || ir_insn(frame->function, succ->first_insn)->op != Ir_Phi) {
+    return frame->labels[succ_id];
+  }
+  struct BpfEdge edge;
+  edge.label = new_label();
+  edge.block = block->id;
+  edge.succ = succ_id;
+  array_append(&pending, &edge);
+  return edge.label;
+}
+
+internal void
+flush_edges(struct BpfFrame* frame, int first)
+{
+  int i;
+  for (i = first; i < pending.elem_count; i++) {
+    struct BpfEdge* edge = (struct BpfEdge*)array_get(&pending, i);
+    place_label(edge->label);
+    emit_edge(frame, ir_block(frame->function, edge->block), edge->succ);
+  }
+  pending.elem_count = first;
+}
+
+internal bool
+is_comparison(enum IrOpcode op)
+{
+  return op == Ir_Equal || op == Ir_NotEqual || op == Ir_Less || op == Ir_Greater || op == Ir_LessEqual
+         || op == Ir_GreaterEqual;
+}
+
+internal uint8_t
+jump_op(enum IrOpcode op, bool is_signed)
+{
+  switch (op) {
+    case Ir_Equal: return BPF_JEQ;
+    case Ir_NotEqual: return BPF_JNE;
+    case Ir_Less: return is_signed ? BPF_JSLT : BPF_JLT;
+    case Ir_Greater: return is_signed ? BPF_JSGT : BPF_JGT;
+    case Ir_LessEqual: return is_signed ? BPF_JSLE : BPF_JLE;
+    case Ir_GreaterEqual: return is_signed ? BPF_JSGE : BPF_JGE;
+    default: break;
+  }
+  assert(0);
+  return 0;
+}
+
+/* Jumps to `label` when the comparison `insn` holds. */
+internal void
+op_compare_jump(struct BpfFrame* frame, struct IrInsn* insn, int label)
+{
+  struct IrInsn* operand = ir_insn(frame->function, insn->args[0]);
+  if (ebpf_is_aggregate(operand->type)) {
+    error("at line %d: the BPF target cannot compare values of type `%s`.", insn->line_nr,
+          type_to_string(operand->type));
+  }
+  uint8_t jop = jump_op(insn->op, ebpf_is_signed(operand->type));
+  int a = value_reg(frame, operand->id);
+  int64_t imm;
+  if (value_imm(frame, insn->args[1], &imm)) {
+    op_jump_imm(jop, a, imm, label);
+  } else {
+    op_jump_reg(jop, a, value_reg(frame, insn->args[1]), label);
+  }
+}
+
+internal int
+case_label(struct BpfFrame* frame, struct IrBlock* block, int* case_labels, int select_case)
+{
+  if (!case_labels[select_case]) {
+    case_labels[select_case] = edge_label(frame, block, block->succs[select_case]);
+  }
+  return case_labels[select_case];
+}
+
+/* Binary search of `key` over values[low..high); jumps to `fallback` when no value matches. */
+internal void
+op_select_tree(struct BpfFrame* frame, struct IrBlock* block, struct EbpfSelect* select, int* case_labels,
+               int key, int low, int high, int fallback)
+{
+  int i;
+  if (high - low <= 3) {
+    for (i = low; i < high; i++) {
+      op_jump_imm(BPF_JEQ, key, (int64_t)select->values[i],
+                  case_label(frame, block, case_labels, select->cases[i]));
+    }
+    op_jump(fallback);
+    return;
+  }
+  int middle = low + (high - low) / 2;
+  int upper = new_label();
+  op_jump_imm(BPF_JGE, key, (int64_t)select->values[middle], upper);
+  op_select_tree(frame, block, select, case_labels, key, low, middle, fallback);
+  place_label(upper);
+  op_select_tree(frame, block, select, case_labels, key, middle, high, fallback);
+}
+
+/* The case + 1 is looked up at `key - base` in the select's array map; 0 where no case matches. */
+internal void
+op_select_map(struct BpfFrame* frame, struct IrBlock* block, struct EbpfSelect* select, int* case_labels,
+              int key, int fallback)
+{
+  int i;
+  int index = frame_alloc(4, 4);
+  int offset = new_vreg();
+  op_mov(offset, key);
+  op_alu_imm(BPF_SUB, offset, (int64_t)select->base);
+  op_jump_imm(BPF_JGE, offset, select->map.max_entries, fallback);
+  op_store(4, BPF_REG_FP, index, offset);
+  int found = op_map_lookup(&select->map, index);
+  op_jump_imm(BPF_JEQ, found, 0, fallback);
+  int c = new_vreg();
+  op_load(4, c, found, 0);
+  for (i = 0; i < select->value_count; i++) {
+    if (!case_labels[select->cases[i]]) {
+      op_jump_imm(BPF_JEQ, c, select->cases[i] + 1, case_label(frame, block, case_labels, select->cases[i]));
+    }
+  }
+  op_jump(fallback);
+}
+
+internal void
+emit_terminator(struct BpfFrame* frame, struct IrBlock* block)
+{
+  struct IrFunction* function = frame->function;
+  struct EbpfSelect* select;
+  int first_pending = pending.elem_count;
+  int i, k;
+  switch (block->term) {
+    case IrTerm_Jump:
+      emit_edge(frame, block, block->succs[0]);
+      break;
+    case IrTerm_Branch: {
+      int label = edge_label(frame, block, block->succs[0]);
+      if (frame->fused[block->value]) {
+        op_compare_jump(frame, ir_insn(function, block->value), label);
+      } else {
+        op_jump_imm(BPF_JNE, value_reg(frame, block->value), 0, label);
+      }
+      emit_edge(frame, block, block->succs[1]);
+      break;
+    }
+    case IrTerm_Switch: {
+      int v = value_reg(frame, block->value);
+      for (i = 0; i < block->case_count; i++) {
+        op_jump_imm(BPF_JEQ, v, const_bits(block->case_values[i]), edge_label(frame, block, block->succs[i]));
+      }
+      emit_edge(frame, block, block->succs[block->case_count]);
+      break;
+    }
+    case IrTerm_Select:
+      select = ebpf_select_of(program, function, block->id);
+      if (select && select->kind != EbpfSelect_Linear) {
+        int* case_labels = arena_push(emit_storage, (block->case_count + 1) * sizeof(int));
+        memset(case_labels, 0, (block->case_count + 1) * sizeof(int));
+        int fallback = new_label();
+        int key = value_reg(frame, block->keys[0]);
+        if (select->kind == EbpfSelect_Tree) {
+          op_select_tree(frame, block, select, case_labels, key, 0, select->value_count, fallback);
+        } else {
+          op_select_map(frame, block, select, case_labels, key, fallback);
+        }
+        place_label(fallback);
+        emit_edge(frame, block, block->succs[select->default_case]);
+        break;
+      }
+      for (i = 0; i < block->case_count; i++) {
+        struct IrSelectCase* select_case = &block->select_cases[i];
+        int next = new_label();
+        bool always = true;
+        for (k = 0; k < block->key_count; k++) {
+          struct IrKeysetElem* elem = &select_case->elems[k];
+          if (!elem->value) {
+            continue;
+          }
+          int key = value_reg(frame, block->keys[k]);
+          if (elem->mask) {
+            int masked = new_vreg();
+            op_mov(masked, key);
+            op_mask(masked, (uint64_t)const_bits(elem->mask));
+            op_jump_imm(BPF_JNE, masked, const_bits(bitint_and(elem->value, elem->mask)), next);
+          } else {
+            op_jump_imm(BPF_JNE, key, const_bits(elem->value), next);
+          }
+          always = false;
+        }
+        emit_edge(frame, block, block->succs[i]);
+        place_label(next);
+        if (always) {
+          break;
+        }
+      }
+      if (i == block->case_count) {
+        emit_edge(frame, block, block->succs[i]);
+      }
+      break;
+    case IrTerm_Return:
+      if (function->kind == IrFunction_Function && block->value && frame->result_vreg) {
+        op_mov(frame->result_vreg, value_reg(frame, block->value));
+      }
+      op_jump(frame->return_label);
+      break;
+    case IrTerm_Exit:
+      op_jump(frame->exit_label);
+      break;
+    case IrTerm_Accept:
+      op_jump(frame->return_label);
+      break;
+    case IrTerm_Reject:
+      op_jump(frame->reject_label);
+      break;
+    default:
+      assert(0);
+  }
+  flush_edges(frame, first_pending);
+}
+
+internal int
+emit_shift(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct Type* type = insn->type;
+  int width = ebpf_scalar_bits(type);
+  int d = vreg_of(frame, insn->id);
+  bool arithmetic = insn->op == Ir_Shr && ebpf_is_signed(type);
+  uint8_t alu_op = insn->op == Ir_Shl ? BPF_LSH : arithmetic ? BPF_ARSH : BPF_RSH;
+  int64_t n;
+  op_mov(d, value_reg(frame, insn->args[0]));
+  if (value_imm(frame, insn->args[1], &n) && n >= 0) {
+    if (n < width) {
+      op_alu_imm(alu_op, d, n);
+    } else {
+      op_alu_imm(arithmetic ? BPF_ARSH : BPF_AND, d, arithmetic ? 63 : 0);
+    }
+  } else {
+    /* A count past the width shifts everything out; BPF leaves that undefined. */
+    int count = value_reg(frame, insn->args[1]);
+    int overflow = new_label(), done = new_label();
+    op_jump_imm(BPF_JGE, count, width, overflow);
+    op_alu(alu_op, d, count);
+    op_jump(done);
+    place_label(overflow);
+    op_alu_imm(arithmetic ? BPF_ARSH : BPF_AND, d, arithmetic ? 63 : 0);
+    place_label(done);
+  }
+  if (insn->op == Ir_Shl) {
+    op_wrap(d, type);
+  }
+  return d;
+}
+
+internal void
+emit_binary(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  uint8_t alu_op = 0;
+  switch (insn->op) {
+    case Ir_Add: alu_op = BPF_ADD; break;
+    case Ir_Sub: alu_op = BPF_SUB; break;
+    case Ir_Mul: alu_op = BPF_MUL; break;
+    case Ir_Div: alu_op = BPF_DIV; break;
+    case Ir_BitAnd: case Ir_And: alu_op = BPF_AND; break;
+    case Ir_BitOr: case Ir_Or: alu_op = BPF_OR; break;
+    case Ir_BitXor: alu_op = BPF_XOR; break;
+    default: assert(0);
+  }
+  if (insn->op == Ir_Div && ebpf_is_signed(insn->type)) {
+    error("at line %d: the BPF target only divides unsigned values.", insn->line_nr);
+  }
+  int d = vreg_of(frame, insn->id);
+  int64_t imm;
+  op_mov(d, value_reg(frame, insn->args[0]));
+  if (value_imm(frame, insn->args[1], &imm)) {
+    if (alu_op == BPF_DIV && imm == 0) {
+      op_mov_imm(d, 0);  /* what BPF does at run time; the verifier rejects a constant 0 */
+    } else {
+      op_alu_imm(alu_op, d, imm);
+    }
+  } else {
+    op_alu(alu_op, d, value_reg(frame, insn->args[1]));
+  }
+  if (insn->op == Ir_Add || insn->op == Ir_Sub || insn->op == Ir_Mul) {
+    op_wrap(d, insn->type);
+  }
+}
+
+/* Scalar value of a pure instruction. */
+internal void
+emit_value(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct IrFunction* function = frame->function;
+  struct IrInsn* operand = insn->arg_count > 0 ? ir_insn(function, insn->args[0]) : 0;
+  int d = vreg_of(frame, insn->id);
+  switch (insn->op) {
+    case Ir_Undef:
+      op_mov_imm(d, 0);
+      return;
+    case Ir_Param:
+      if (!frame->param_vregs[insn->index]) {
+        error("at line %d: parameter `%s` of `%s` has no value for the BPF target.", insn->line_nr, insn->name,
+              function->name);
+      }
+      op_mov(d, frame->param_vregs[insn->index]);
+      return;
+    case Ir_Load:
+      op_load_ref(d, &frame->refs[operand->id], insn->type);
+      return;
+    case Ir_Add:
+    case Ir_Sub:
+    case Ir_Mul:
+    case Ir_Div:
+    case Ir_BitAnd:
+    case Ir_BitOr:
+    case Ir_BitXor:
+    case Ir_And:
+    case Ir_Or:
+      emit_binary(frame, insn);
+      return;
+    case Ir_Equal:
+    case Ir_NotEqual:
+    case Ir_Less:
+    case Ir_Greater:
+    case Ir_LessEqual:
+    case Ir_GreaterEqual: {
+      int done = new_label();
+      int result = new_vreg();
+      op_mov_imm(result, 1);
+      op_compare_jump(frame, insn, done);
+      op_mov_imm(result, 0);
+      place_label(done);
+      op_mov(d, result);
+      return;
+    }
+    case Ir_Shl:
+    case Ir_Shr:
+      emit_shift(frame, insn);
+      return;
+    case Ir_LogNot:
+      op_mov(d, value_reg(frame, operand->id));
+      op_alu_imm(BPF_XOR, d, 1);
+      return;
+    case Ir_BitNot:
+      op_mov(d, value_reg(frame, operand->id));
+      op_alu_imm(BPF_XOR, d, -1);
+      op_wrap(d, insn->type);
+      return;
+    case Ir_Neg:
+      op_mov(d, value_reg(frame, operand->id));
+      op(BPF_ALU64 | BPF_NEG, d, 0, 0, 0);
+      op_wrap(d, insn->type);
+      return;
+    case Ir_Cast:
+      op_mov(d, value_reg(frame, operand->id));
+      if (ebpf_resolve_type(insn->type)->kind == Type_Bool) {
+        int done = new_label();
+        op_jump_imm(BPF_JEQ, d, 0, done);
+        op_mov_imm(d, 1);
+        place_label(done);
+      } else {
+        op_wrap(d, insn->type);
+      }
+      return;
+    case Ir_Slice:
+      op_mov(d, value_reg(frame, operand->id));
+      op_alu_imm(BPF_RSH, d, insn->low);
+      op_mask(d, ebpf_width_mask(insn->index - insn->low + 1));
+      return;
+    case Ir_SliceSet: {
+      uint64_t mask = ebpf_width_mask(insn->index - insn->low + 1) << insn->low;
+      int part = new_vreg();
+      op_mov(d, value_reg(frame, operand->id));
+      op_mask(d, ~mask & ebpf_width_mask(ebpf_scalar_bits(insn->type)));
+      op_mov(part, value_reg(frame, insn->args[1]));
+      op_alu_imm(BPF_LSH, part, insn->low);
+      op_mask(part, mask);
+      op_alu(BPF_OR, d, part);
+      return;
+    }
+    case Ir_IsValid: {
+      struct Type* type = ebpf_resolve_type(operand->type);
+      struct BpfRef* ref = &frame->refs[operand->id];
+      if (type->kind == Type_HeaderUnion) {
+        int i;
+        int valid = new_vreg();
+        op_mov_imm(d, 0);
+        for (i = 0; i < type->member_count; i++) {
+          struct Type* member = ebpf_resolve_type(type->members[i].type);
+          struct BpfRef valid_ref = ref_plus(*ref, member_offset(type, i) + member_offset(member, member->member_count));
+          op_load_byte(valid, &valid_ref);
+          op_alu(BPF_OR, d, valid);
+        }
+        return;
+      }
+      struct BpfRef valid_ref = ref_plus(*ref, member_offset(type, type->member_count));
+      op_load_byte(d, &valid_ref);
+      return;
+    }
+    case Ir_TableHit:
+      op_mov(d, frame->hits[operand->id]);
+      return;
+    case Ir_ActionRun:
+      op_load(4, d, vreg_of(frame, operand->id), 0);
+      return;
+    default: break;
+  }
+  error("at line %d: `%s` is not supported by the BPF target.", insn->line_nr, ir_opcode_to_string(insn->op));
+}
+
+internal void
+emit_store(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct IrFunction* function = frame->function;
+  struct IrInsn* dst = ir_insn(function, insn->args[0]);
+  struct IrInsn* src = ir_insn(function, insn->args[1]);
+  struct BpfRef* ref = &frame->refs[dst->id];
+  struct Type* type = ebpf_resolve_type(dst->type);
+  if (src->op == Ir_Tuple && ebpf_is_aggregate(type)) {
+    int i;
+    if (type->kind != Type_Struct && type->kind != Type_Header) {
+      error("at line %d: the BPF target cannot initialize `%s` from a list.", insn->line_nr, type_to_string(type));
+    }
+    for (i = 0; i < src->arg_count && i < type->member_count; i++) {
+      struct BpfRef member = ref_plus(*ref, member_offset(type, i));
+      op_store_ref(&member, mem_size(type->members[i].type), value_reg(frame, src->args[i]));
+    }
+    if (type->kind == Type_Header) {
+      struct BpfRef valid = ref_plus(*ref, member_offset(type, type->member_count));
+      op_store_imm_ref(&valid, 1, 1);
+    }
+  } else if (ebpf_is_aggregate(type)) {
+    op_copy_ref(ref, &frame->refs[src->id], mem_size(type));
+  } else {
+    op_store_ref(ref, mem_size(type), value_reg(frame, src->id));
+  }
+}
+
+/* `v` = the value of the first valid entry of a scanned table matching the key at fp + `key`, or 0. */
+internal void
+op_scan_table(struct EbpfTable* table, int key, int v)
+{
+  int index = frame_alloc(4, 4);
+  int found = new_label();
+  int i, k;
+  for (i = 0; i < table->map.max_entries; i++) {
+    int next = new_label();
+    op_store_imm(4, BPF_REG_FP, index, i);
+    int entry = op_map_lookup(&table->map, index);
+    op_jump_imm(BPF_JEQ, entry, 0, next);
+    int valid = new_vreg();
+    op_load(4, valid, entry, table->valid_offset);
+    op_jump_imm(BPF_JEQ, valid, 0, next);
+    for (k = 0; k < table->key_count; k++) {
+      struct EbpfField* field = &table->keys[k];
+      int a = new_vreg(), b = new_vreg(), mask = new_vreg();
+      op_load(field->size, a, BPF_REG_FP, key + field->offset);
+      op_load(field->size, b, entry, table->entry_key_offset + field->offset);
+      op_load(field->size, mask, entry, table->entry_key_offset + table->key_size + field->offset);
+      op_alu(BPF_XOR, a, b);
+      op_alu(BPF_AND, a, mask);
+      op_jump_imm(BPF_JNE, a, 0, next);
+    }
+    op_mov(v, entry);
+    op_jump(found);
+    place_label(next);
+  }
+  op_mov_imm(v, 0);
+  place_label(found);
+}
+
+/*
+ * `v` = the highest priority entry of a tuple space table matching the key at
+ * fp + `key`, or 0.  The masks come by descending priority: the search stops
+ * at one whose entries cannot beat the match.  They are in the half of the
+ * mask map that the element past both halves names.
+ */
+internal void
+op_tuple_table(struct EbpfTable* table, int key, int v)
+{
+  int index = frame_alloc(4, 4);
+  int masked = frame_alloc(table->key_size, 8);
+  int best = new_vreg();
+  int half = new_vreg();
+  int first = new_label();
+  int done = new_label();
+  int i, k;
+  op_mov_imm(v, 0);
+  op_mov_imm(best, 0);
+  op_mov_imm(half, 0);
+  op_zero(masked, table->key_size);
+  op_store_imm(4, BPF_REG_FP, index, 2 * EBPF_TUPLE_MAX_MASKS);
+  int generation = op_map_lookup(&table->mask_map, index);
+  op_jump_imm(BPF_JEQ, generation, 0, first);
+  int in_use = new_vreg();
+  op_load(4, in_use, generation, 0);
+  op_jump_imm(BPF_JEQ, in_use, 0, first);
+  op_mov_imm(half, EBPF_TUPLE_MAX_MASKS);
+  place_label(first);
+  for (i = 0; i < EBPF_TUPLE_MAX_MASKS; i++) {
+    int next = new_label();
+    int at = new_vreg();
+    op_mov(at, half);
+    op_alu_imm(BPF_ADD, at, i);
+    op_store(4, BPF_REG_FP, index, at);
+    int mask = op_map_lookup(&table->mask_map, index);
+    op_jump_imm(BPF_JEQ, mask, 0, done);
+    int priority = new_vreg();
+    op_load(4, priority, mask, 0);
+    op_jump_reg(BPF_JLE, priority, best, done);
+    int tuple = new_vreg();
+    op_load(4, tuple, mask, 8);
+    op_store(4, BPF_REG_FP, masked, tuple);
+    for (k = 0; k < table->key_count; k++) {
+      struct EbpfField* field = &table->keys[k];
+      int a = new_vreg(), b = new_vreg();
+      op_load(field->size, a, BPF_REG_FP, key + field->offset);
+      op_load(field->size, b, mask, 8 + field->offset);
+      op_alu(BPF_AND, a, b);
+      op_store(field->size, BPF_REG_FP, masked + field->offset, a);
+    }
+    int entry = op_map_lookup(&table->map, masked);
+    op_jump_imm(BPF_JEQ, entry, 0, next);
+    int entry_priority = new_vreg();
+    op_load(4, entry_priority, entry, table->priority_offset);
+    op_jump_reg(BPF_JLE, entry_priority, best, next);
+    op_mov(v, entry);
+    op_mov(best, entry_priority);
+    place_label(next);
+  }
+  place_label(done);
+}
+
+/* Binary search of `key` over the sorted const entries [low, high) of `table`; jumps to `missed` if none has it. */
+internal void
+op_search_entries(struct EbpfTable* table, int* labels, int key, int low, int high, int missed)
+{
+  int i;
+  if (high - low <= 3) {
+    for (i = low; i < high; i++) {
+      op_jump_imm(BPF_JEQ, key, const_bits(table->entries[table->entry_order[i]].keys[0]), labels[i]);
+    }
+    op_jump(missed);
+    return;
+  }
+  int middle = low + (high - low) / 2;
+  int upper = new_label();
+  op_jump_imm(BPF_JGE, key, const_bits(table->entries[table->entry_order[middle]].keys[0]), upper);
+  op_search_entries(table, labels, key, low, middle, missed);
+  place_label(upper);
+  op_search_entries(table, labels, key, middle, high, missed);
+}
+
+/* `v` = the value of the const entry matching the key, built in the table's value area, or 0. */
+internal void
+op_inline_entries(struct BpfFrame* frame, struct EbpfTable* table, struct IrInsn* insn, int v)
+{
+  int value = table_area(table, 1);
+  int found = new_label();
+  int missed = new_label();
+  int count = table->search_count > 0 ? table->search_count : table->entry_count;
+  int* labels = arena_push(emit_storage, (count + 1) * sizeof(int));
+  int i, k;
+  if (table->search_count > 0) {
+    for (i = 0; i < count; i++) {
+      labels[i] = new_label();
+    }
+    op_search_entries(table, labels, value_reg(frame, insn->args[0]), 0, count, missed);
+  }
+  for (i = 0; i < count; i++) {
+    struct EbpfTableEntry* entry = &table->entries[table->entry_order[i]];
+    int next = new_label();
+    if (table->search_count > 0) {
+      place_label(labels[i]);
+    }
+    for (k = 0; k < table->key_count && table->search_count == 0; k++) {
+      int key = value_reg(frame, insn->args[k]);
+      if (!entry->masks[k]) {
+        op_jump_imm(BPF_JNE, key, const_bits(entry->keys[k]), next);
+      } else if (!bitint_is_zero(entry->masks[k])) {
+        int masked = new_vreg();
+        op_mov(masked, key);
+        op_mask(masked, (uint64_t)const_bits(entry->masks[k]));
+        op_jump_imm(BPF_JNE, masked, const_bits(bitint_and(entry->keys[k], entry->masks[k])), next);
+      }
+    }
+    op_value(table, value, entry->action, entry->args);
+    op_frame_address(v, value);
+    op_jump(found);
+    place_label(next);
+  }
+  place_label(missed);
+  op_mov_imm(v, 0);
+  place_label(found);
+}
+
+/* The value pointer of a table apply: the entry found, else the default action's. */
+internal void
+emit_table_apply(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct EbpfTable* table = ebpf_table_of(program, insn->decl);
+  int v = vreg_of(frame, insn->id);
+  int hit = new_vreg();
+  int found = new_label();
+  int i;
+  frame->hits[insn->id] = hit;
+  if (table->map.type) {
+    int* values = arena_push(emit_storage, (table->key_count + 1) * sizeof(int));
+    for (i = 0; i < table->key_count; i++) {
+      values[i] = value_reg(frame, insn->args[i]);
+    }
+    int key = table_area(table, 0);
+    op_key(table, key, values, ebpf_full_prefix_length(table));
+    if (table->kind == EbpfTable_Scan) {
+      op_scan_table(table, key, v);
+    } else if (table->kind == EbpfTable_Tuple) {
+      op_tuple_table(table, key, v);
+    } else {
+      op_mov(v, op_map_lookup(&table->map, key));
+    }
+    if (table->kind == EbpfTable_Dense) {
+      int valid = new_vreg();
+      int present = new_label();
+      op_jump_imm(BPF_JEQ, v, 0, present);
+      op_load(4, valid, v, table->valid_offset);
+      op_jump_imm(BPF_JNE, valid, 0, present);
+      op_mov_imm(v, 0);
+      place_label(present);
+    }
+  } else if (table->kind == EbpfTable_Inline) {
+    op_inline_entries(frame, table, insn, v);
+  } else {
+    op_mov_imm(v, 0);
+  }
+  int missed = new_label();
+  op_mov_imm(hit, 0);
+  op_jump_imm(BPF_JEQ, v, 0, missed);
+  op_mov_imm(hit, 1);
+  op_jump(found);
+  place_label(missed);
+  if (table->default_map.type) {
+    op_mov(v, op_map_lookup(&table->default_map, zero_key));
+    op_jump_imm(BPF_JNE, v, 0, found);
+  }
+  int value = table_area(table, 1);
+  op_value(table, value, table->default_action, table->default_args);
+  op_frame_address(v, value);
+  place_label(found);
+}
+
+internal void inline_function(struct BpfFrame* frame);
+internal struct IrFunction* callee_of(struct Ast* decl);
+
+/* Binds parameter `index` of `callee` to the argument `arg` of the caller. */
+internal void
+bind_argument(struct BpfFrame* callee, int index, struct BpfFrame* caller, int arg)
+{
+  struct Ast* param = ast_list_nth(callee->function->params, index);
+  struct IrInsn* insn = ir_insn(caller->function, arg);
+  if (ebpf_is_extern_object(type_of_node(param))) {
+    callee->params[index].is_extern = true;
+  } else if (ebpf_param_by_value(param)) {
+    int reg = new_vreg();
+    op_mov(reg, value_reg(caller, arg));
+    callee->param_vregs[index] = reg;
+    if (ebpf_is_block(callee->function)) {
+      /* Its actions reach it through memory. */
+      callee->params[index] = alloc_ref(insn->type);
+      op_store(mem_size(insn->type), BPF_REG_FP, callee->params[index].offset, reg);
+    }
+  } else {
+    callee->params[index] = caller->refs[arg];
+  }
+}
+
+internal void
+emit_function_call(struct BpfFrame* frame, struct IrInsn* insn, struct IrFunction* callee)
+{
+  struct IrInsn* receiver = insn->receiver ? ir_insn(frame->function, insn->receiver) : 0;
+  struct BpfFrame* inner = new_frame(callee, frame);
+  int i;
+  if (callee->kind == IrFunction_Action && callee->parent) {
+    inner->owner = frame;
+    while (inner->owner && inner->owner->function != callee->parent) {
+      inner->owner = inner->owner->owner;
+    }
+    if (!inner->owner) {
+      error("action `%s` of `%s` cannot be called from `%s`.", callee->name, callee->parent->name,
+            frame->function->name);
+    }
+  }
+  for (i = 0; i < insn->arg_count; i++) {
+    bind_argument(inner, i, frame, insn->args[i]);
+  }
+  if (receiver && receiver->op == Ir_TableApply) {
+    struct EbpfTable* table = ebpf_table_of(program, receiver->decl);
+    struct EbpfAction* action = ebpf_table_action(table, callee->decl);
+    int v = vreg_of(frame, receiver->id);
+    for (i = 0; action && i < action->param_count; i++) {
+      struct EbpfField* param = &action->params[i];
+      int reg = new_vreg();
+      op_load(param->size, reg, v, table->action_offset + param->offset);
+      if (ebpf_is_signed(param->type) && param->size < 8) {
+        op_alu_imm(BPF_LSH, reg, 64 - 8 * param->size);
+        op_alu_imm(BPF_ARSH, reg, 64 - 8 * param->size);
+      }
+      inner->param_vregs[insn->arg_count + i] = reg;
+    }
+  }
+  if (callee->kind == IrFunction_Function) {
+    if (insn->type && ebpf_is_aggregate(insn->type)) {
+      error("at line %d: the BPF target cannot return `%s` from a function.", insn->line_nr,
+            type_to_string(insn->type));
+    }
+    inner->result_vreg = vreg_of(frame, insn->id);
+    op_mov_imm(inner->result_vreg, 0);
+  }
+  inline_function(inner);
+}
+
+/* `apply` of a parser or control instance. */
+internal void
+emit_apply(struct BpfFrame* frame, struct IrInsn* insn, struct IrFunction* callee)
+{
+  struct BpfFrame* inner = new_frame(callee, frame);
+  int i;
+  for (i = 0; i < insn->arg_count && i < ebpf_list_count(callee->params); i++) {
+    bind_argument(inner, i, frame, insn->args[i]);
+  }
+  inline_function(inner);
+}
+
+/* From the bytes of the current packet_check if there is one, else with a check of its own. */
+internal void
+extract_header(struct BpfFrame* frame, struct BpfRef* ref, struct Type* type)
+{
+  if (check_offset < check_size) {
+    op_parse(ref, type, check_base, check_offset);
+    check_offset += ebpf_header_size(type);
+    return;
+  }
+  op_extract(ref, type, frame->reject_label);
+}
+
+internal void
+emit_extract(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  if (insn->arg_count != 1) {
+    error("at line %d: the BPF target does not support variable-size headers.", insn->line_nr);
+  }
+  struct IrFunction* function = frame->function;
+  struct IrInsn* header = ir_insn(function, insn->args[0]);
+  struct Type* type = ebpf_resolve_type(header->type);
+  if (type->kind != Type_Header) {
+    error("at line %d: only headers can be extracted.", insn->line_nr);
+  }
+  struct IrInsn* stack = header->op == Ir_Field ? ir_insn(function, header->args[0]) : 0;
+  if (stack && ebpf_resolve_type(stack->type)->kind == Type_HeaderStack && cstr_match(header->name, "next")) {
+    struct Type* stack_type = ebpf_resolve_type(stack->type);
+    struct BpfRef* ref = &frame->refs[header->id];
+    int next_offset = frame->refs[stack->id].offset + stack_next_offset(stack_type);
+    op_jump_imm(BPF_JGE, ref->index_vreg, stack_type->width, frame->reject_label);
+    extract_header(frame, ref, type);
+    op_alu_imm(BPF_ADD, ref->index_vreg, 1);
+    op_store(4, BPF_REG_FP, next_offset, ref->index_vreg);
+    return;
+  }
+  extract_header(frame, &frame->refs[header->id], type);
+}
+
+internal void
+emit_lookahead(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct Type* type = ebpf_resolve_type(insn->type);
+  if (type->kind == Type_Header) {
+    int saved = new_vreg();
+    frame->refs[insn->id] = temp_ref(type);
+    op_load(4, saved, BPF_REG_FP, packet_offset);
+    op_extract(&frame->refs[insn->id], type, frame->reject_label);
+    op_store(4, BPF_REG_FP, packet_offset, saved);
+    return;
+  }
+  int width = ebpf_scalar_width(type);
+  if (width <= 0 || width > 64 || type->kind == Type_Int) {
+    error("at line %d: the BPF target cannot look ahead for `%s`.", insn->line_nr, type_to_string(type));
+  }
+  int d = vreg_of(frame, insn->id);
+  int b = op_cursor((width + 7) / 8, frame->reject_label);
+  load_packet_bits(d, b, 0, width);
+  op_wrap(d, type);
+}
+
+/* Every header of `type` at `ref`, in order. */
+internal void
+emit_headers(struct BpfFrame* frame, struct BpfRef* ref, struct Type* type, int line_nr)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  if (type->kind == Type_Header) {
+    /* By compares of the index, whatever the stack: emitting a header reads and writes it at constant offsets. */
+    struct BpfRef elem = *ref;
+    struct BpfChain chain;
+    int base, offset;
+    elem.is_indexed = false;
+    chain_begin(&chain, &elem);
+    while (chain_next(&chain, &base, &offset)) {
+      op_emit_header(offset, type, frame->pass);
+    }
+  } else if (type->kind == Type_HeaderStack) {
+    int stride = mem_size(type->base);
+    for (i = 0; i < type->width; i++) {
+      struct BpfRef elem = ref_plus(*ref, i * stride);
+      emit_headers(frame, &elem, type->base, line_nr);
+    }
+  } else if (type->kind == Type_Struct || type->kind == Type_HeaderUnion) {
+    for (i = 0; i < type->member_count; i++) {
+      struct Type* member = ebpf_resolve_type(type->members[i].type);
+      if (member->kind != Type_Header) {
+        error("at line %d: the BPF target can only emit structs of headers.", line_nr);
+      }
+      struct BpfRef member_ref = ref_plus(*ref, member_offset(type, i));
+      emit_headers(frame, &member_ref, member, line_nr);
+    }
+  } else {
+    error("at line %d: the BPF target cannot emit `%s`.", line_nr, type_to_string(type));
+  }
+}
+
+internal void
+emit_counter(struct BpfFrame* frame, struct IrInsn* insn, struct EbpfCounter* counter, int value)
+{
+  int index = frame_alloc(4, 4);
+  int done = new_label();
+  op_store(4, BPF_REG_FP, index, value_reg(frame, insn->args[0]));
+  int count = op_map_lookup(&counter->map, index);
+  if (counter->map.type == EbpfMap_Hash) {
+    int missed = new_label();
+    op_jump_imm(BPF_JEQ, count, 0, missed);
+    op(BPF_STX | BPF_XADD | BPF_W, count, value, 0, 0);
+    op_jump(done);
+    place_label(missed);
+    int initial = frame_alloc(4, 4);
+    op_store(4, BPF_REG_FP, initial, value);
+    op_map_update(&counter->map, index, initial, BPF_NOEXIST);
+  } else {
+    op_jump_imm(BPF_JEQ, count, 0, done);
+    op(BPF_STX | BPF_XADD | BPF_W, count, value, 0, 0);
+  }
+  place_label(done);
+}
+
+/* Register.read and write: an element of the array map, 0 and nothing past its size. */
+internal void
+emit_register(struct BpfFrame* frame, struct IrInsn* insn, struct EbpfRegister* reg, bool is_write)
+{
+  int index = frame_alloc(4, 4);
+  int size = reg->map.value_size;
+  int done = new_label();
+  op_store(4, BPF_REG_FP, index, value_reg(frame, insn->args[0]));
+  int value = op_map_lookup(&reg->map, index);
+  if (is_write) {
+    op_jump_imm(BPF_JEQ, value, 0, done);
+    op_store(size, value, 0, value_reg(frame, insn->args[1]));
+  } else {
+    int d = vreg_of(frame, insn->id);
+    op_mov_imm(d, 0);
+    op_jump_imm(BPF_JEQ, value, 0, done);
+    op_load(size, d, value, 0);
+    if (ebpf_is_signed(reg->type) && size < 8) {
+      op_alu_imm(BPF_LSH, d, 64 - 8 * size);
+      op_alu_imm(BPF_ARSH, d, 64 - 8 * size);
+    }
+  }
+  place_label(done);
+}
+
+internal void
+emit_method_call(struct BpfFrame* frame, struct IrInsn* insn, struct IrInsn* receiver)
+{
+  struct Type* type = ebpf_resolve_type(receiver->type);
+  char* extern_name = type && type->kind == Type_Extern ? type->name : "";
+  if (cstr_match(extern_name, "packet_in")) {
+    if (cstr_match(insn->name, "extract")) {
+      emit_extract(frame, insn);
+      return;
+    } else if (cstr_match(insn->name, "lookahead")) {
+      emit_lookahead(frame, insn);
+      return;
+    } else if (cstr_match(insn->name, "advance")) {
+      if (check_offset < check_size) {
+        check_offset += ebpf_packet_bytes(frame->function, insn);
+      }
+      int offset = new_vreg();
+      int bits = new_vreg();
+      op_mov(bits, value_reg(frame, insn->args[0]));
+      op(BPF_ALU | BPF_RSH | BPF_K, bits, 0, 0, 3);
+      op_load(4, offset, BPF_REG_FP, packet_offset);
+      op_alu(BPF_ADD, offset, bits);
+      op_store(4, BPF_REG_FP, packet_offset, offset);
+      return;
+    }
+  } else if (cstr_match(extern_name, "packet_out") && cstr_match(insn->name, "emit")) {
+    struct IrInsn* header = ir_insn(frame->function, insn->args[0]);
+    emit_headers(frame, &frame->refs[header->id], header->type, insn->line_nr);
+    return;
+  } else if (cstr_match(extern_name, "CounterArray")) {
+    struct EbpfCounter* counter = ebpf_counter_of(program, receiver->decl);
+    if (!counter) {
+      error("at line %d: counter array `%s` must be declared in a control.", insn->line_nr, receiver->name);
+    }
+    if (cstr_match(insn->name, "increment")) {
+      int one = new_vreg();
+      op_mov_imm(one, 1);
+      emit_counter(frame, insn, counter, one);
+      return;
+    } else if (cstr_match(insn->name, "add")) {
+      emit_counter(frame, insn, counter, value_reg(frame, insn->args[1]));
+      return;
+    }
+  } else if (cstr_match(extern_name, "Register")) {
+    struct EbpfRegister* reg = ebpf_register_of(program, receiver->decl);
+    if (!reg) {
+      error("at line %d: register `%s` must be declared in a control.", insn->line_nr, receiver->name);
+    }
+    if (cstr_match(insn->name, "read") || cstr_match(insn->name, "write")) {
+      emit_register(frame, insn, reg, cstr_match(insn->name, "write"));
+      return;
+    }
+  } else if (type && (type->kind == Type_Parser || type->kind == Type_Control) && cstr_match(insn->name, "apply")) {
+    struct IrFunction* callee = ir_function_of(program->ir, type->decl);
+    if (callee) {
+      emit_apply(frame, insn, callee);
+      return;
+    }
+  }
+  error("at line %d: `%s.%s` is not supported by the BPF target.", insn->line_nr,
+        type ? type_to_string(receiver->type) : "?", insn->name);
+}
+
+/* ~sum folded to 16 bits, RFC 1071. */
+internal void
+op_csum_fold(int sum)
+{
+  int low = new_vreg();
+  int i;
+  for (i = 0; i < 2; i++) {
+    op_mov(low, sum);
+    op_alu_imm(BPF_AND, low, 0xffff);
+    op_alu_imm(BPF_RSH, sum, 16);
+    op_alu(BPF_ADD, sum, low);
+  }
+  op_alu_imm(BPF_XOR, sum, -1);
+  op_alu_imm(BPF_AND, sum, 0xffff);
+}
+
+/* `sum` += the 16-bit halves of `value`, each complemented if `negate`. */
+internal void
+op_csum_add(int sum, int value, int halves, bool negate)
+{
+  int part = new_vreg();
+  int i;
+  for (i = 0; i < halves; i++) {
+    op_mov(part, value);
+    if (i > 0) {
+      op_alu_imm(BPF_RSH, part, 16 * i);
+    }
+    if (negate) {
+      op_alu_imm(BPF_XOR, part, -1);
+    }
+    op_alu_imm(BPF_AND, part, 0xffff);
+    op_alu(BPF_ADD, sum, part);
+  }
+}
+
+/* Writes the data of a `hash` at fp + `buffer` + `*at`: each bit<W> value in ceil(W / 8) bytes, most significant first. */
+internal void
+op_hash_data(struct BpfFrame* frame, struct IrInsn* data, int buffer, int* at)
+{
+  int i;
+  if (data->op == Ir_Tuple) {
+    for (i = 0; i < data->arg_count; i++) {
+      op_hash_data(frame, ir_insn(frame->function, data->args[i]), buffer, at);
+    }
+    return;
+  }
+  int width = ebpf_scalar_width(ebpf_resolve_type(data->type));
+  if (width <= 0 || width > 64) {
+    error("at line %d: the data of `hash` must be a list of bit<W> values.", data->line_nr);
+  }
+  int size = (width + 7) / 8;
+  if (*at + size > HASH_MAX_DATA) {
+    error("at line %d: the data of `hash` is over %d bytes.", data->line_nr, HASH_MAX_DATA);
+  }
+  int value = value_reg(frame, data->id);
+  int byte = new_vreg();
+  for (i = 0; i < size; i++) {
+    op_mov(byte, value);
+    if (i < size - 1) {
+      op_alu_imm(BPF_RSH, byte, 8 * (size - 1 - i));
+    }
+    op_store(1, BPF_REG_FP, buffer + *at + i, byte);
+  }
+  *at += size;
+}
+
+/* hash(result, lookup3, data): the lookup3 helper of ebpf/ubpf_run.c over the bytes of the data. */
+internal void
+emit_hash(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct IrInsn* result = ir_insn(frame->function, insn->args[0]);
+  int buffer = frame_alloc(HASH_MAX_DATA, 8);
+  int size = 0;
+  int d = new_vreg();
+  op_hash_data(frame, ir_insn(frame->function, insn->args[2]), buffer, &size);
+  op_frame_address(1, buffer);
+  op_mov_imm(2, size);
+  op_call(UBPF_FUNC_hash_lookup3);
+  op_mov(d, 0);
+  op_store_ref(&frame->refs[result->id], mem_size(result->type), d);
+}
+
+/* Extern functions of ebpf_model.p4, xdp_model.p4, ubpf_model.p4 and core.p4. */
+internal void
+emit_extern_call(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  int* args = arena_push(emit_storage, (insn->arg_count + 1) * sizeof(int));
+  int i;
+  if (cstr_match(insn->name, "verify")) {
+    op_jump_imm(BPF_JEQ, value_reg(frame, insn->args[0]), 0, frame->reject_label);
+    return;
+  } else if (program->model == EbpfModel_Ubpf
+             && (cstr_match(insn->name, "mark_to_drop") || cstr_match(insn->name, "mark_to_pass"))) {
+    struct Type* std_type = ebpf_resolve_type(ebpf_param_type(program->parser, 3));
+    int output_action = member_index(std_type, "output_action", insn->line_nr);
+    struct BpfRef action = ref_plus(std_ref, member_offset(std_type, output_action));
+    op_store_imm_ref(&action, mem_size(std_type->members[output_action].type),
+                     cstr_match(insn->name, "mark_to_drop") ? XDP_DROP : XDP_PASS);
+    return;
+  } else if (program->model == EbpfModel_Ubpf && cstr_match(insn->name, "truncate")) {
+    op_store(4, BPF_REG_FP, truncate_size, value_reg(frame, insn->args[0]));
+    return;
+  } else if (is_userspace && cstr_match(insn->name, "hash") && insn->arg_count == 3) {
+    emit_hash(frame, insn);
+    return;
+  }
+  for (i = 0; i < insn->arg_count; i++) {
+    args[i] = value_reg(frame, insn->args[i]);
+  }
+  int d = vreg_of(frame, insn->id);
+  if (cstr_match(insn->name, "BPF_KTIME_GET_NS") || cstr_match(insn->name, "ubpf_time_get_ns")) {
+    op_call(BPF_FUNC_ktime_get_ns);
+    op_mov(d, 0);
+    op_wrap(d, insn->type);
+  } else if (cstr_match(insn->name, "csum_replace2") && insn->arg_count == 3) {
+    /* RFC 1624: HC' = ~(~HC + ~m + m') */
+    op_mov_imm(d, 0);
+    op_csum_add(d, args[0], 1, true);
+    op_csum_add(d, args[1], 1, true);
+    op_csum_add(d, args[2], 1, false);
+    op_csum_fold(d);
+  } else if (cstr_match(insn->name, "csum_replace4") && insn->arg_count == 3) {
+    op_mov_imm(d, 0);
+    op_csum_add(d, args[0], 1, true);
+    op_csum_add(d, args[1], 2, true);
+    op_csum_add(d, args[2], 2, false);
+    op_csum_fold(d);
+  } else if (cstr_match(insn->name, "ebpf_ipv4_checksum") && insn->arg_count == 11) {
+    /* version:4 ihl:4 diffserv:8, totalLen, identification, flags:3 fragOffset:13, ttl:8 protocol:8, addresses */
+    int word = new_vreg();
+    op_mov(d, args[0]);
+    op_alu_imm(BPF_LSH, d, 12);
+    op_mov(word, args[1]);
+    op_alu_imm(BPF_LSH, word, 8);
+    op_alu(BPF_OR, d, word);
+    op_alu(BPF_OR, d, args[2]);
+    op_alu(BPF_ADD, d, args[3]);
+    op_alu(BPF_ADD, d, args[4]);
+    op_mov(word, args[5]);
+    op_alu_imm(BPF_LSH, word, 13);
+    op_alu(BPF_OR, word, args[6]);
+    op_alu(BPF_ADD, d, word);
+    op_mov(word, args[7]);
+    op_alu_imm(BPF_LSH, word, 8);
+    op_alu(BPF_OR, word, args[8]);
+    op_alu(BPF_ADD, d, word);
+    op_csum_add(d, args[9], 2, false);
+    op_csum_add(d, args[10], 2, false);
+    op_csum_fold(d);
+  } else {
+    error("at line %d: extern `%s` is not supported by the BPF target.", insn->line_nr, insn->name);
+  }
+}
+
+internal struct IrFunction*
+callee_of(struct Ast* decl)
+{
+  struct IrFunction* callee = ir_function_of(program->ir, decl);
+  if (!callee && decl && decl->kind == Ast_FunctionDecl) {
+    callee = ir_function_of(program->ir, (struct Ast*)ast_getattr(decl, "proto"));
+  }
+  return callee;
+}
+
+internal void
+emit_call(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  struct IrInsn* receiver = insn->receiver ? ir_insn(frame->function, insn->receiver) : 0;
+  if (receiver && receiver->op != Ir_TableApply) {
+    emit_method_call(frame, insn, receiver);
+    return;
+  }
+  struct IrFunction* callee = callee_of(insn->decl);
+  if (callee) {
+    emit_function_call(frame, insn, callee);
+  } else {
+    emit_extern_call(frame, insn);
+  }
+}
+
+internal void
+emit_insn(struct BpfFrame* frame, struct IrInsn* insn)
+{
+  switch (insn->op) {
+    case Ir_Const:
+    case Ir_EnumConst:
+    case Ir_String:
+    case Ir_Tuple:
+    case Ir_Phi:
+      return;
+    case Ir_Var:
+      frame->refs[insn->id] = var_ref(frame, insn);
+      return;
+    case Ir_Temp:
+      frame->refs[insn->id] = temp_ref(insn->type);
+      return;
+    case Ir_Field:
+      frame->refs[insn->id] = field_ref(frame, insn);
+      return;
+    case Ir_Index:
+      frame->refs[insn->id] = index_ref(frame, insn);
+      return;
+    case Ir_Store:
+      emit_store(frame, insn);
+      return;
+    case Ir_SetValid:
+    case Ir_SetInvalid: {
+      struct IrInsn* header = ir_insn(frame->function, insn->args[0]);
+      struct Type* type = ebpf_resolve_type(header->type);
+      struct BpfRef valid = ref_plus(frame->refs[header->id], member_offset(type, type->member_count));
+      op_store_imm_ref(&valid, 1, insn->op == Ir_SetValid);
+      return;
+    }
+    case Ir_Call:
+      emit_call(frame, insn);
+      return;
+    case Ir_TableApply:
+      emit_table_apply(frame, insn);
+      return;
+    case Ir_PacketCheck:
+      check_base = op_cursor(insn->index, frame->reject_label);
+      check_size = insn->index;
+      check_offset = 0;
+      return;
+    default: break;
+  }
+  if (insn->op == Ir_Undef && ebpf_is_aggregate(insn->type)) {
+    frame->refs[insn->id] = temp_ref(insn->type);
+    return;
+  }
+  if (frame->use_count[insn->id] == 0 || frame->fused[insn->id]) {
+    return;
+  }
+  emit_value(frame, insn);
+}
+
+/* Counts uses, and picks the comparisons that only decide the branch of their own block. */
+internal void
+scan_uses(struct BpfFrame* frame)
+{
+  struct IrFunction* function = frame->function;
+  int i, j;
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    int id = block->first_insn;
+    while (id) {
+      struct IrInsn* insn = ir_insn(function, id);
+      for (j = 0; j < insn->arg_count; j++) {
+        frame->use_count[insn->args[j]] += 1;
+      }
+      frame->use_count[insn->receiver] += 1;
+      id = insn->next_in_block;
+    }
+    frame->use_count[block->value] += 1;
+    for (j = 0; j < block->key_count; j++) {
+      frame->use_count[block->keys[j]] += 1;
+    }
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    if (block->term == IrTerm_Branch) {
+      struct IrInsn* cond = ir_insn(function, block->value);
+      if (is_comparison(cond->op) && cond->block == block->id && frame->use_count[cond->id] == 1) {
+        frame->fused[cond->id] = true;
+      }
+    }
+  }
+}
+
+internal void
+inline_function(struct BpfFrame* frame)
+{
+  struct IrFunction* function = frame->function;
+  struct IrFunction* outer_block = emit_block;
+  int outer_trips = emit_trips;
+  int* trips = function->kind == IrFunction_Parser ? ebpf_loop_trips(function, emit_storage) : 0;
+  int i;
+  scan_uses(frame);
+  if (ebpf_is_block(function)) {
+    emit_block = function;
+  }
+  for (i = 0; i < function->locals.elem_count; i++) {
+    struct Ast* local_decl = *(struct Ast**)array_get(&function->locals, i);
+    struct Type* type = type_of_node(local_decl);
+    if (local_decl->kind == Ast_Instantiation || ebpf_is_extern_object(type)) {
+      frame->locals[i].is_extern = true;
+    } else {
+      frame->locals[i] = temp_ref(type);
+    }
+  }
+  if (ebpf_is_block(function) && function->kind == IrFunction_Control && !frame->exit_label) {
+    frame->exit_label = frame->return_label;
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    frame->labels[i] = new_label();
+  }
+  /* The entry block first, so that the code falls into it. */
+  for (i = 0; i < function->blocks.elem_count; i++) {
+    int id = i == 0 ? function->entry_block : i;
+    struct IrBlock* block = ir_block(function, id);
+    if (i > 0 && (id == function->entry_block || block->pred_count == 0)) {
+      continue;
+    }
+    emit_trips = trips ? trips[id] : emit_trips;
+    place_label(frame->labels[id]);
+    check_size = 0;
+    int insn_id = block->first_insn;
+    while (insn_id) {
+      struct IrInsn* insn = ir_insn(function, insn_id);
+      emit_insn(frame, insn);
+      insn_id = insn->next_in_block;
+    }
+    emit_terminator(frame, block);
+  }
+  place_label(frame->return_label);
+  emit_block = outer_block;
+  emit_trips = outer_trips;
+}
+
+/*
+ * The program.
+ */
+
+/* A frame for a block of the package, its parameters bound to `refs` (extern objects skipped). */
+internal struct BpfFrame*
+package_frame(struct IrFunction* f, struct BpfRef* refs, int ref_count, int reject_label)
+{
+  struct BpfFrame* frame = new_frame(f, 0);
+  int i;
+  frame->reject_label = reject_label;
+  for (i = 0; i < ebpf_list_count(f->params); i++) {
+    if (ebpf_is_extern_object(ebpf_param_type(f, i))) {
+      frame->params[i].is_extern = true;
+    } else if (i < ref_count && !refs[i].is_extern) {
+      frame->params[i] = refs[i];
+    } else {
+      error("`%s` has too many parameters for the `main` package.", f->name);
+    }
+  }
+  return frame;
+}
+
+internal void
+op_return(int action)
+{
+  op_mov_imm(0, action);
+  op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/* Offset from the headers of the deparser reference `id`, seen from emit_main. */
+internal int
+main_offset(struct IrFunction* deparser, int id)
+{
+  struct IrInsn* insn = ir_insn(deparser, id);
+  if (insn->op == Ir_Field) {
+    struct Type* type = ebpf_resolve_type(ir_insn(deparser, insn->args[0])->type);
+    return main_offset(deparser, insn->args[0]) + member_offset(type, member_index(type, insn->name, insn->line_nr));
+  } else if (insn->op == Ir_Index) {
+    struct Type* stack = ebpf_resolve_type(ir_insn(deparser, insn->args[0])->type);
+    int64_t index = 0;
+    bitint_to_int64(ir_insn(deparser, insn->args[1])->value, &index);
+    return main_offset(deparser, insn->args[0]) + (int)index * mem_size(stack->base);
+  }
+  return 0;
+}
+
+/* The headers of `type` at `ref` for the shifting pass: last first. */
+internal void
+shift_headers(struct BpfRef* ref, struct Type* type)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  if (type->kind == Type_Header) {
+    op_emit_header(ref->offset, type, BpfPass_Shift);
+  } else if (type->kind == Type_HeaderStack) {
+    for (i = type->width - 1; i >= 0; i--) {
+      struct BpfRef elem = ref_plus(*ref, i * mem_size(type->base));
+      shift_headers(&elem, type->base);
+    }
+  } else if (type->kind == Type_Struct || type->kind == Type_HeaderUnion) {
+    for (i = type->member_count - 1; i >= 0; i--) {
+      struct BpfRef member = ref_plus(*ref, member_offset(type, i));
+      shift_headers(&member, type->members[i].type);
+    }
+  }
+}
+
+/* The parser, into headers it zeroes first; for ubpf, with the metadata and the standard_metadata it sets up. */
+internal void
+emit_parser(struct BpfRef* state, int drop)
+{
+  struct BpfRef refs[4];
+  memset(refs, 0, sizeof(refs));
+  state[0] = temp_ref(ebpf_param_type(program->parser, 1));
+  refs[0].is_extern = true;
+  refs[1] = state[0];
+  if (program->model != EbpfModel_Ubpf) {
+    inline_function(package_frame(program->parser, refs, 2, drop));
+    return;
+  }
+  struct Type* std_type = ebpf_resolve_type(ebpf_param_type(program->parser, 3));
+  int input_port = member_index(std_type, "input_port", 0);
+  int packet_length = member_index(std_type, "packet_length", 0);
+  int output_action = member_index(std_type, "output_action", 0);
+  int port = new_vreg();
+  int length = new_vreg();
+  refs[2] = state[1] = temp_ref(ebpf_param_type(program->parser, 2));
+  refs[3] = state[2] = std_ref = temp_ref(std_type);
+  op_load_ctx(port, XDP_MD_INGRESS_IFINDEX);
+  op_store(mem_size(std_type->members[input_port].type), BPF_REG_FP,
+           std_ref.offset + member_offset(std_type, input_port), port);
+  op_load_ctx(length, XDP_MD_DATA_END);
+  op_load_ctx(port, XDP_MD_DATA);
+  op_alu(BPF_SUB, length, port);
+  op_store(mem_size(std_type->members[packet_length].type), BPF_REG_FP,
+           std_ref.offset + member_offset(std_type, packet_length), length);
+  op_store_imm(mem_size(std_type->members[output_action].type), BPF_REG_FP,
+               std_ref.offset + member_offset(std_type, output_action), XDP_PASS);
+  inline_function(package_frame(program->parser, refs, 4, drop));
+}
+
+/* The control, then the verdicts that end the packet's way here. */
+internal void
+emit_control(struct BpfRef* state, int drop, int aborted)
+{
+  struct IrFunction* control = program->control;
+  struct BpfRef refs[3];
+  memset(refs, 0, sizeof(refs));
+  refs[0] = state[0];
+  if (program->model == EbpfModel_Filter) {
+    int accept = new_vreg();
+    refs[1] = state[1] = temp_ref(ebpf_param_type(control, 1));
+    inline_function(package_frame(control, refs, 2, drop));
+    op_load(1, accept, BPF_REG_FP, refs[1].offset);
+    op_jump_imm(BPF_JEQ, accept, 0, drop);
+    op_return(XDP_PASS);
+    return;
+  }
+
+  struct Type* imd_type = ebpf_resolve_type(ebpf_param_type(control, 1));
+  struct Type* omd_type = ebpf_resolve_type(ebpf_param_type(control, 2));
+  int output_action = member_index(omd_type, "output_action", 0);
+  if (program->model == EbpfModel_Ubpf) {
+    refs[1] = state[1];
+    refs[2] = std_ref = state[2];
+  } else {
+    int input_port = member_index(imd_type, "input_port", 0);
+    int port = new_vreg();
+    refs[1] = state[1] = temp_ref(imd_type);
+    refs[2] = state[2] = temp_ref(omd_type);
+    op_load_ctx(port, XDP_MD_INGRESS_IFINDEX);
+    op_store(mem_size(imd_type->members[input_port].type), BPF_REG_FP,
+             refs[1].offset + member_offset(imd_type, input_port), port);
+  }
+  int action_offset = refs[2].offset + member_offset(omd_type, output_action);
+  int action_size = mem_size(omd_type->members[output_action].type);
+  if (program->model != EbpfModel_Ubpf) {
+    op_store_imm(action_size, BPF_REG_FP, action_offset, XDP_PASS);
+  }
+  inline_function(package_frame(control, refs, 3, drop));
+  int action = new_vreg();
+  op_load(action_size, action, BPF_REG_FP, action_offset);
+  op_jump_imm(BPF_JEQ, action, XDP_DROP, drop);
+  op_jump_imm(BPF_JEQ, action, XDP_ABORTED, aborted);
+}
+
+/*
+ * The emitted headers replace the parsed ones: size them, move the packet
+ * start, write them.  For ubpf, the packet is then cut to the size that
+ * `truncate` left, and its REDIRECT is that of XDP.
+ */
+internal void
+emit_deparser(struct BpfRef* state, int drop, int aborted)
+{
+  struct IrFunction* deparser = program->deparser;
+  int headers = ebpf_is_extern_object(ebpf_param_type(deparser, 0)) ? 1 : 0;
+  struct Type* omd_type = ebpf_resolve_type(ebpf_param_type(program->control, 2));
+  int output_action = member_index(omd_type, "output_action", 0);
+  int output_port = member_index(omd_type, "output_port", 0);
+  int action_offset = state[2].offset + member_offset(omd_type, output_action);
+  int action_size = mem_size(omd_type->members[output_action].type);
+  struct BpfRef refs[2];
+  memset(refs, 0, sizeof(refs));
+  int i;
+  int parsed = new_vreg();
+  int delta = new_vreg();
+  int moved = new_label();
+  int copied = new_label();
+  packet_delta = frame_alloc(8, 8);
+  op_store_imm(8, BPF_REG_FP, packet_delta, 0);
+  if (program->deparser_emits) {
+    packet_ahead = frame_alloc(8, 8);
+    packet_last = frame_alloc(4, 4);
+    packet_reordered = frame_alloc(4, 4);
+    op_store_imm(8, BPF_REG_FP, packet_ahead, -EBPF_MAX_PACKET_OFFSET - 1);
+    op_store_imm(4, BPF_REG_FP, packet_last, 0);
+    op_store_imm(4, BPF_REG_FP, packet_reordered, 0);
+  }
+  op_load(4, parsed, BPF_REG_FP, packet_offset);
+  op_store_imm(4, BPF_REG_FP, packet_offset, 0);
+  refs[headers] = state[0];
+  refs[1 - headers].is_extern = true;
+  struct BpfFrame* measure = package_frame(deparser, refs, 2, drop);
+  measure->pass = BpfPass_Measure;
+  inline_function(measure);
+  op_load(4, delta, BPF_REG_FP, packet_offset);
+  op_alu(BPF_SUB, parsed, delta);
+  op_mov(delta, parsed);
+  op_store(8, BPF_REG_FP, packet_delta, delta);
+  if (program->deparser_emits) {
+    /* Headers that go further on are moved from the last one back, before the packet start moves. */
+    int reordered = new_vreg();
+    int ahead = new_vreg();
+    int shifted = new_label();
+    op_load(4, reordered, BPF_REG_FP, packet_reordered);
+    op_jump_imm(BPF_JNE, reordered, 0, shifted);
+    op_load(8, ahead, BPF_REG_FP, packet_ahead);
+    op_alu(BPF_ADD, ahead, delta);
+    op_jump_imm(BPF_JSLE, ahead, 0, copied);
+    for (i = program->deparser_emit_count - 1; i >= 0; i--) {
+      int id = program->deparser_emits[i];
+      struct BpfRef ref = ref_plus(refs[0], main_offset(deparser, id));
+      shift_headers(&ref, ir_insn(deparser, id)->type);
+    }
+    op_jump(copied);
+    place_label(shifted);
+  }
+  if (ebpf_has_partial_headers(program)) {
+    op_store_imm(4, BPF_REG_FP, packet_offset, 0);
+    struct BpfFrame* fill = package_frame(deparser, refs, 2, drop);
+    fill->pass = BpfPass_Fill;
+    inline_function(fill);
+  }
+  place_label(copied);
+  op_load(8, delta, BPF_REG_FP, packet_delta);
+  op_jump_imm(BPF_JEQ, delta, 0, moved);
+  op_mov(1, ctx_vreg);
+  op(BPF_ALU | BPF_MOV | BPF_X, 2, delta, 0, 0);
+  op_call(BPF_FUNC_xdp_adjust_head);
+  op_jump_imm(BPF_JNE, 0, 0, aborted);
+  place_label(moved);
+  op_store_imm(4, BPF_REG_FP, packet_offset, 0);
+  inline_function(package_frame(deparser, refs, 2, drop));
+  if (program->model == EbpfModel_Ubpf) {
+    int size = new_vreg();
+    int end = new_vreg();
+    int whole = new_label();
+    op_load_ctx(end, XDP_MD_DATA_END);
+    op_load_ctx(size, XDP_MD_DATA);
+    op_alu(BPF_SUB, end, size);
+    op_load(4, size, BPF_REG_FP, truncate_size);
+    op_jump_reg(BPF_JGE, size, end, whole);
+    op_alu(BPF_SUB, size, end);
+    op_mov(1, ctx_vreg);
+    op(BPF_ALU | BPF_MOV | BPF_X, 2, size, 0, 0);
+    op_call(BPF_FUNC_xdp_adjust_tail);
+    op_jump_imm(BPF_JNE, 0, 0, aborted);
+    place_label(whole);
+  }
+
+  int not_redirected = new_label();
+  int action = new_vreg();
+  int port = new_vreg();
+  op_load(action_size, action, BPF_REG_FP, action_offset);
+  op_jump_imm(BPF_JNE, action, program->model == EbpfModel_Ubpf ? UBPF_REDIRECT : XDP_REDIRECT, not_redirected);
+  op_load(mem_size(omd_type->members[output_port].type), port, BPF_REG_FP,
+          state[2].offset + member_offset(omd_type, output_port));
+  op_mov(1, port);
+  op_mov_imm(2, 0);
+  op_call(BPF_FUNC_redirect);
+  op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  place_label(not_redirected);
+  op_mov(0, action);
+  op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/*
+ * Stages.  What a stage leaves to the next is the packet offset, and for
+ * ubpf the size `truncate` left, then the headers and the metadata of the
+ * control, each at a multiple of 8 in the value of the state map.  It is copied there from the stack before the tail
+ * call, and back onto the stack of the next stage.
+ */
+
+/* The types kept in the state, headers first; how many of them reach `block`. */
+internal int
+state_types(struct Type** types, enum EbpfBlock block)
+{
+  types[0] = ebpf_param_type(program->parser, 1);
+  types[1] = ebpf_param_type(program->control, 1);
+  if (program->model == EbpfModel_Filter) {
+    return block == EbpfBlock_Control ? 1 : 2;
+  }
+  types[2] = ebpf_param_type(program->control, 2);
+  return block == EbpfBlock_Control && program->model != EbpfModel_Ubpf ? 1 : 3;
+}
+
+internal int
+state_size()
+{
+  struct Type* types[3];
+  int count = state_types(types, EbpfBlock_COUNT_);
+  int size = 8;
+  int i;
+  for (i = 0; i < count; i++) {
+    size = align_to(size + mem_size(types[i]), 8);
+  }
+  return size;
+}
+
+/* Copies the state that reaches `block` from the stack at `state`, or with `is_restore`, onto it. */
+internal void
+op_copy_state(struct BpfRef* state, enum EbpfBlock block, bool is_restore, int aborted)
+{
+  struct Type* types[3];
+  int count = state_types(types, block);
+  int base = op_map_lookup(&program->state_map, zero_key);
+  int reg = new_vreg();
+  int at = 8;
+  int i;
+  op_jump_imm(BPF_JEQ, base, 0, aborted);
+  if (is_restore) {
+    op_load(4, reg, base, 0);
+    op_store(4, BPF_REG_FP, packet_offset, reg);
+  } else {
+    op_load(4, reg, BPF_REG_FP, packet_offset);
+    op_store(4, base, 0, reg);
+  }
+  if (program->model == EbpfModel_Ubpf && is_restore) {
+    op_load(4, reg, base, 4);
+    op_store(4, BPF_REG_FP, truncate_size, reg);
+  } else if (program->model == EbpfModel_Ubpf) {
+    op_load(4, reg, BPF_REG_FP, truncate_size);
+    op_store(4, base, 4, reg);
+  }
+  for (i = 0; i < count; i++) {
+    int size = mem_size(types[i]);
+    int done = 0;
+    if (is_restore) {
+      state[i] = alloc_ref(types[i]);
+    }
+    while (done < size) {
+      int chunk = 8;
+      while (chunk > 1 && ((state[i].offset + done) % chunk != 0 || done + chunk > size)) {
+        chunk /= 2;
+      }
+      if (is_restore) {
+        op_load(chunk, reg, base, at + done);
+        op_store(chunk, BPF_REG_FP, state[i].offset + done, reg);
+      } else {
+        op_load(chunk, reg, BPF_REG_FP, state[i].offset + done);
+        op_store(chunk, base, at + done, reg);
+      }
+      done += chunk;
+    }
+    at = align_to(at + size, 8);
+  }
+}
+
+/* Hands the packet to the program of `stage`: no return but XDP_ABORTED if it is not there. */
+internal void
+op_tail_call(int stage)
+{
+  op_mov(1, ctx_vreg);
+  op_load_map(2, &program->stage_map);
+  op_mov_imm(3, stage);
+  op_call(BPF_FUNC_tail_call);
+  op_return(XDP_ABORTED);
+}
+
+/* The program of `stage`: its blocks, between the state it takes over and the one it leaves. */
+internal void
+emit_main(int stage)
+{
+  struct BpfRef state[3];
+  memset(state, 0, sizeof(state));
+  int drop = new_label();
+  int aborted = new_label();
+  int block;
+  ctx_vreg = new_vreg();
+  op_mov(ctx_vreg, 1);
+  packet_offset = frame_alloc(8, 8);
+  op_store_imm(4, BPF_REG_FP, packet_offset, 0);
+  zero_key = frame_alloc(4, 4);
+  op_store_imm(4, BPF_REG_FP, zero_key, 0);
+  if (program->model == EbpfModel_Ubpf) {
+    truncate_size = frame_alloc(4, 4);
+    op_store_imm(4, BPF_REG_FP, truncate_size, -1);
+  }
+  if (stage == 0 && ebpf_needs_init(program)) {
+    op_init_tables();
+  }
+  int last = program->model == EbpfModel_Filter ? EbpfBlock_Control : EbpfBlock_Deparser;
+  for (block = 0; block <= last; block++) {
+    if (program->stages[block] != stage) {
+      continue;
+    } else if (block > 0 && program->stages[block - 1] != stage) {
+      op_copy_state(state, block, true, aborted);
+    }
+    if (block == EbpfBlock_Parser) {
+      emit_parser(state, drop);
+    } else if (block == EbpfBlock_Control) {
+      emit_control(state, drop, aborted);
+    } else {
+      emit_deparser(state, drop, aborted);
+    }
+    if (block < last && program->stages[block + 1] != stage) {
+      op_copy_state(state, block + 1, false, aborted);
+      op_tail_call(stage + 1);
+    }
+  }
+  place_label(drop);
+  op_return(XDP_DROP);
+  if (program->model != EbpfModel_Filter || program->stage_count > 1) {
+    place_label(aborted);
+    op_return(XDP_ABORTED);
+  }
+}
+
+/*
+ * Register allocation: liveness over the basic blocks of the selected code,
+ * one interval per virtual register, then a linear scan.  Values that live
+ * across a helper call get R6-R9, the others R1-R4 first.  R0 and R5 are
+ * the scratch registers that spilled values go through.
+ */
+
+struct BpfInterval {
+  int vreg;
+  int start;
+  int end;
+  int reg;       /* -1: spilled */
+  int slot;
+  bool crosses_call;
+};
+
+internal struct BpfInsn*
+code_at(int i)
+{
+  return (struct BpfInsn*)array_get(&code, i);
+}
+
+internal int
+label_position(int label)
+{
+  return *(int*)array_get(&labels, label);
+}
+
+/* Which of its register fields an instruction reads and writes. */
+internal void
+insn_regs(struct BpfInsn* insn, bool* reads_dst, bool* reads_src, bool* writes_dst)
+{
+  uint8_t cls = insn->code & 0x07;
+  uint8_t opcode = insn->code & 0xf0;
+  *reads_dst = *reads_src = *writes_dst = false;
+  if (cls == BPF_ALU || cls == BPF_ALU64) {
+    *writes_dst = true;
+    *reads_dst = opcode != BPF_MOV;
+    *reads_src = (insn->code & BPF_X) && opcode != BPF_END && opcode != BPF_NEG;
+  } else if (cls == BPF_LDX) {
+    *writes_dst = true;
+    *reads_src = true;
+  } else if (cls == BPF_LD) {
+    *writes_dst = true;
+  } else if (cls == BPF_ST) {
+    *reads_dst = true;
+  } else if (cls == BPF_STX) {
+    *reads_dst = *reads_src = true;
+  } else if (cls == BPF_JMP && opcode != BPF_JA && opcode != BPF_CALL && opcode != BPF_EXIT) {
+    *reads_dst = true;
+    *reads_src = (insn->code & BPF_X) != 0;
+  }
+}
+
+internal bool
+is_jump(struct BpfInsn* insn)
+{
+  uint8_t opcode = insn->code & 0xf0;
+  return (insn->code & 0x07) == BPF_JMP && opcode != BPF_CALL && opcode != BPF_EXIT;
+}
+
+internal bool
+is_clobber(struct BpfInsn* insn)
+{
+  bool reads_dst, reads_src, writes_dst;
+  if (insn->code == (BPF_JMP | BPF_CALL)) {
+    return true;
+  }
+  insn_regs(insn, &reads_dst, &reads_src, &writes_dst);
+  return writes_dst && insn->dst <= 5;
+}
+
+internal uint8_t
+inverse_jump(uint8_t jump_op)
+{
+  switch (jump_op) {
+    case BPF_JEQ: return BPF_JNE;
+    case BPF_JNE: return BPF_JEQ;
+    case BPF_JGT: return BPF_JLE;
+    case BPF_JLE: return BPF_JGT;
+    case BPF_JGE: return BPF_JLT;
+    case BPF_JLT: return BPF_JGE;
+    case BPF_JSGT: return BPF_JSLE;
+    case BPF_JSLE: return BPF_JSGT;
+    case BPF_JSGE: return BPF_JSLT;
+    case BPF_JSLT: return BPF_JSGE;
+  }
+  return 0;
+}
+
+/*
+ * Drops the code no path from the start reaches and jumps to the next
+ * instruction, and turns `if c goto L1; goto L2; L1:` into `if !c goto L2`.
+ * False when there was nothing to drop.  The verifier rejects a program with
+ * unreachable instructions.
+ */
+internal bool
+remove_dead_jumps()
+{
+  struct UnboundedArray kept;
+  int n = code.elem_count;
+  int* position = arena_push(emit_storage, (n + 1) * sizeof(int));
+  int* work = arena_push(emit_storage, (n + 1) * sizeof(int));
+  bool* is_reached = arena_push(emit_storage, (n + 1) * sizeof(bool));
+  bool* is_target = arena_push(emit_storage, (n + 1) * sizeof(bool));
+  int work_count = 0;
+  int i;
+  memset(is_reached, 0, (n + 1) * sizeof(bool));
+  memset(is_target, 0, (n + 1) * sizeof(bool));
+  is_reached[0] = true;
+  work[work_count++] = 0;
+  while (work_count > 0) {
+    i = work[--work_count];
+    struct BpfInsn* insn = code_at(i);
+    int succs[2], succ_count = 0;
+    if (insn->code != (BPF_JMP | BPF_JA) && insn->code != (BPF_JMP | BPF_EXIT) && i + 1 < n) {
+      succs[succ_count++] = i + 1;
+    }
+    if (is_jump(insn)) {
+      succs[succ_count++] = label_position(insn->label);
+      is_target[label_position(insn->label)] = true;
+    }
+    while (succ_count > 0) {
+      int succ = succs[--succ_count];
+      if (succ < n && !is_reached[succ]) {
+        is_reached[succ] = true;
+        work[work_count++] = succ;
+      }
+    }
+  }
+  array_init(&kept, sizeof(struct BpfInsn), emit_storage);
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    position[i] = kept.elem_count;
+    if (!is_reached[i]) {
+      continue;
+    }
+    if (insn->code == (BPF_JMP | BPF_JA) && label_position(insn->label) == i + 1) {
+      continue;
+    }
+    if (is_jump(insn) && label_position(insn->label) == i + 2 && !is_target[i + 1]
+        && code_at(i + 1)->code == (BPF_JMP | BPF_JA) && inverse_jump(insn->code & 0xf0)) {
+      struct BpfInsn inverted = *insn;
+      inverted.code = (insn->code & 0x0f) | inverse_jump(insn->code & 0xf0);
+      inverted.label = code_at(i + 1)->label;
+      array_append(&kept, &inverted);
+      position[++i] = kept.elem_count;
+      continue;
+    }
+    array_append(&kept, insn);
+  }
+  position[code.elem_count] = kept.elem_count;
+  for (i = 0; i < labels.elem_count; i++) {
+    int* label = (int*)array_get(&labels, i);
+    if (*label >= 0) {
+      *label = position[*label];
+    }
+  }
+  bool changed = kept.elem_count < code.elem_count;
+  code = kept;
+  return changed;
+}
+
+internal int
+compare_intervals(const void* a, const void* b)
+{
+  const struct BpfInterval* x = *(const struct BpfInterval**)a;
+  const struct BpfInterval* y = *(const struct BpfInterval**)b;
+  return x->start != y->start ? x->start - y->start : x->vreg - y->vreg;
+}
+
+internal struct BpfInterval*
+build_intervals()
+{
+  int n = code.elem_count;
+  int words = (vreg_count + 63) / 64;
+  int i, j, b;
+  bool* leader = arena_push(emit_storage, (n + 1) * sizeof(bool));
+  memset(leader, 0, (n + 1) * sizeof(bool));
+  leader[0] = true;
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    if (is_jump(insn)) {
+      leader[label_position(insn->label)] = true;
+    }
+    if (is_jump(insn) || insn->code == (BPF_JMP | BPF_EXIT)) {
+      leader[i + 1] = true;
+    }
+  }
+  int* block_of = arena_push(emit_storage, (n + 1) * sizeof(int));
+  int* block_start = arena_push(emit_storage, (n + 1) * sizeof(int));
+  int block_count = 0;
+  for (i = 0; i < n; i++) {
+    if (leader[i]) {
+      block_start[block_count++] = i;
+    }
+    block_of[i] = block_count - 1;
+  }
+  block_start[block_count] = n;
+
+  uint64_t* use = arena_push(emit_storage, block_count * words * sizeof(uint64_t));
+  uint64_t* def = arena_push(emit_storage, block_count * words * sizeof(uint64_t));
+  uint64_t* live_in = arena_push(emit_storage, block_count * words * sizeof(uint64_t));
+  uint64_t* live_out = arena_push(emit_storage, block_count * words * sizeof(uint64_t));
+  memset(use, 0, block_count * words * sizeof(uint64_t));
+  memset(def, 0, block_count * words * sizeof(uint64_t));
+  memset(live_in, 0, block_count * words * sizeof(uint64_t));
+  memset(live_out, 0, block_count * words * sizeof(uint64_t));
+#define BIT_SET(set, b, v)  ((set)[(b) * words + (v) / 64] |= 1ull << ((v) % 64))
+#define BIT_TEST(set, b, v)  (((set)[(b) * words + (v) / 64] >> ((v) % 64)) & 1)
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    bool reads_dst, reads_src, writes_dst;
+    b = block_of[i];
+    insn_regs(insn, &reads_dst, &reads_src, &writes_dst);
+    if (reads_src && insn->src >= BPF_VREG_BASE && !BIT_TEST(def, b, insn->src)) {
+      BIT_SET(use, b, insn->src);
+    }
+    if (reads_dst && insn->dst >= BPF_VREG_BASE && !BIT_TEST(def, b, insn->dst)) {
+      BIT_SET(use, b, insn->dst);
+    }
+    if (writes_dst && insn->dst >= BPF_VREG_BASE) {
+      BIT_SET(def, b, insn->dst);
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (b = block_count - 1; b >= 0; b--) {
+      struct BpfInsn* last = code_at(block_start[b + 1] - 1);
+      int succs[2], succ_count = 0;
+      if (is_jump(last)) {
+        succs[succ_count++] = block_of[label_position(last->label)];
+      }
+      if (last->code != (BPF_JMP | BPF_JA) && last->code != (BPF_JMP | BPF_EXIT) && b + 1 < block_count) {
+        succs[succ_count++] = b + 1;
+      }
+      for (j = 0; j < words; j++) {
+        uint64_t out = 0;
+        int s;
+        for (s = 0; s < succ_count; s++) {
+          out |= live_in[succs[s] * words + j];
+        }
+        uint64_t in = use[b * words + j] | (out & ~def[b * words + j]);
+        if (in != live_in[b * words + j] || out != live_out[b * words + j]) {
+          live_in[b * words + j] = in;
+          live_out[b * words + j] = out;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  struct BpfInterval* intervals = arena_push(emit_storage, (vreg_count + 1) * sizeof(struct BpfInterval));
+  int v;
+  for (v = 0; v < vreg_count; v++) {
+    intervals[v].vreg = v;
+    intervals[v].start = n;
+    intervals[v].end = -1;
+    intervals[v].reg = -1;
+    intervals[v].slot = 0;
+    intervals[v].crosses_call = false;
+  }
+#define EXTEND(v, i) do { \
+    if ((i) < intervals[v].start) intervals[v].start = (i); \
+    if ((i) > intervals[v].end) intervals[v].end = (i); \
+  } while (0)
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    bool reads_dst, reads_src, writes_dst;
+    insn_regs(insn, &reads_dst, &reads_src, &writes_dst);
+    if ((reads_dst || writes_dst) && insn->dst >= BPF_VREG_BASE) {
+      EXTEND(insn->dst, i);
+    }
+    if (reads_src && insn->src >= BPF_VREG_BASE) {
+      EXTEND(insn->src, i);
+    }
+  }
+  for (b = 0; b < block_count; b++) {
+    for (v = BPF_VREG_BASE; v < vreg_count; v++) {
+      if (BIT_TEST(live_in, b, v)) {
+        EXTEND(v, block_start[b]);
+      }
+      if (BIT_TEST(live_out, b, v)) {
+        EXTEND(v, block_start[b + 1] - 1);
+      }
+    }
+  }
+#undef EXTEND
+#undef BIT_SET
+#undef BIT_TEST
+  /* Clobbers, and the stretches where R1-R5 hold the arguments of a call. */
+  int* clobbers = arena_push(emit_storage, (n + 1) * sizeof(int));
+  int* arguments = arena_push(emit_storage, (n + 1) * sizeof(int));
+  bool in_arguments = false;
+  clobbers[0] = arguments[0] = 0;
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    bool is_call = insn->code == (BPF_JMP | BPF_CALL);
+    if (is_clobber(insn) && !is_call && insn->dst != 0) {
+      in_arguments = true;
+    }
+    clobbers[i + 1] = clobbers[i] + (is_clobber(insn) ? 1 : 0);
+    arguments[i + 1] = arguments[i] + (in_arguments ? 1 : 0);
+    if (is_call) {
+      in_arguments = false;
+    }
+  }
+  for (v = BPF_VREG_BASE; v < vreg_count; v++) {
+    if (intervals[v].end >= 0) {
+      intervals[v].crosses_call = clobbers[intervals[v].end] - clobbers[intervals[v].start] > 0
+                                  || arguments[intervals[v].end + 1] - arguments[intervals[v].start] > 0;
+    }
+  }
+  return intervals;
+}
+
+/* With `has_scratch`, R9 holds the scratch area throughout. */
+internal void
+linear_scan(struct BpfInterval* intervals, bool has_scratch)
+{
+  local int caller_saved[] = {1, 2, 3, 4, 6, 7, 8, 9};
+  local int callee_saved[] = {6, 7, 8, 9};
+  struct BpfInterval** sorted = arena_push(emit_storage, (vreg_count + 1) * sizeof(struct BpfInterval*));
+  struct BpfInterval* active[BPF_REG_FP];
+  int sorted_count = 0, active_count = 0;
+  int i, j, v;
+  for (v = BPF_VREG_BASE; v < vreg_count; v++) {
+    if (intervals[v].end >= 0) {
+      sorted[sorted_count++] = &intervals[v];
+    }
+  }
+  qsort(sorted, sorted_count, sizeof(struct BpfInterval*), compare_intervals);
+  for (i = 0; i < sorted_count; i++) {
+    struct BpfInterval* cur = sorted[i];
+    bool in_use[BPF_REG_FP];
+    memset(in_use, 0, sizeof(in_use));
+    for (j = 0; j < active_count; j++) {
+      if (active[j]->end < cur->start) {
+        active[j--] = active[--active_count];
+      } else {
+        in_use[active[j]->reg] = true;
+      }
+    }
+    int* allowed = cur->crosses_call ? callee_saved : caller_saved;
+    int allowed_count = cur->crosses_call ? sizeof_array(callee_saved) : sizeof_array(caller_saved);
+    if (has_scratch) {
+      allowed_count -= 1;  /* R9 comes last in both */
+    }
+    for (j = 0; j < allowed_count && in_use[allowed[j]]; j++);
+    if (j < allowed_count) {
+      cur->reg = allowed[j];
+      active[active_count++] = cur;
+      continue;
+    }
+    /* Spill whichever of the candidates lives longest. */
+    int victim = -1;
+    for (j = 0; j < active_count; j++) {
+      int k;
+      for (k = 0; k < allowed_count && allowed[k] != active[j]->reg; k++);
+      if (k < allowed_count && (victim < 0 || active[j]->end > active[victim]->end)) {
+        victim = j;
+      }
+    }
+    if (victim >= 0 && active[victim]->end > cur->end) {
+      cur->reg = active[victim]->reg;
+      active[victim]->reg = -1;
+      active[victim] = cur;
+    }
+  }
+  for (i = 0; i < sorted_count; i++) {
+    if (sorted[i]->reg < 0) {
+      sorted[i]->slot = frame_alloc(8, 8);
+      struct BpfSlot* slot = slot_at(slots.elem_count - 1);
+      slot->is_spill = true;
+      slot->start = sorted[i]->start;
+      slot->end = sorted[i]->end;
+    }
+  }
+}
+
+/* Replaces virtual registers with machine ones, reloading and storing the spilled ones through R0 and R5. */
+internal void
+rewrite_registers(struct BpfInterval* intervals)
+{
+  struct UnboundedArray rewritten;
+  int* position = arena_push(emit_storage, (code.elem_count + 1) * sizeof(int));
+  int i;
+  array_init(&rewritten, sizeof(struct BpfInsn), emit_storage);
+  for (i = 0; i < code.elem_count; i++) {
+    struct BpfInsn insn = *code_at(i);
+    bool reads_dst, reads_src, writes_dst;
+    int scratch[2], scratch_count = 0;
+    int spill_store = 0, spill_reg = 0;
+    position[i] = rewritten.elem_count;
+    insn_regs(&insn, &reads_dst, &reads_src, &writes_dst);
+    bool phys_r0 = ((reads_dst || writes_dst) && insn.dst == 0) || (reads_src && insn.src == 0)
+                   || insn.code == (BPF_JMP | BPF_EXIT);
+    bool phys_r5 = ((reads_dst || writes_dst) && insn.dst == 5) || (reads_src && insn.src == 5);
+    if (!phys_r0) {
+      scratch[scratch_count++] = 0;
+    }
+    if (!phys_r5) {
+      scratch[scratch_count++] = 5;
+    }
+    int dst_vreg = insn.dst;
+    struct BpfInsn reload;
+    memset(&reload, 0, sizeof(reload));
+    reload.code = BPF_LDX | BPF_MEM | BPF_DW;
+    reload.src = BPF_REG_FP;
+    reload.label = -1;
+    reload.block = insn.block;
+    reload.trips = insn.trips;
+    if ((reads_dst || writes_dst) && insn.dst >= BPF_VREG_BASE) {
+      struct BpfInterval* iv = &intervals[insn.dst];
+      if (iv->reg >= 0) {
+        insn.dst = iv->reg;
+      } else {
+        assert(scratch_count > 0);
+        insn.dst = scratch[--scratch_count];
+        if (reads_dst) {
+          reload.dst = insn.dst;
+          reload.off = iv->slot;
+          array_append(&rewritten, &reload);
+        }
+        if (writes_dst) {
+          spill_store = iv->slot;
+          spill_reg = insn.dst;
+        }
+      }
+    }
+    if (reads_src && insn.src >= BPF_VREG_BASE) {
+      struct BpfInterval* iv = &intervals[insn.src];
+      if (insn.src == dst_vreg) {
+        insn.src = insn.dst;
+      } else if (iv->reg >= 0) {
+        insn.src = iv->reg;
+      } else {
+        assert(scratch_count > 0);
+        insn.src = scratch[--scratch_count];
+        reload.dst = insn.src;
+        reload.off = iv->slot;
+        array_append(&rewritten, &reload);
+      }
+    }
+    if (!(insn.code == (BPF_ALU64 | BPF_MOV | BPF_X) && insn.dst == insn.src)) {
+      array_append(&rewritten, &insn);
+    }
+    if (spill_store) {
+      struct BpfInsn store;
+      memset(&store, 0, sizeof(store));
+      store.code = BPF_STX | BPF_MEM | BPF_DW;
+      store.dst = BPF_REG_FP;
+      store.src = spill_reg;
+      store.off = spill_store;
+      store.label = -1;
+      store.block = insn.block;
+      store.trips = insn.trips;
+      array_append(&rewritten, &store);
+    }
+  }
+  position[code.elem_count] = rewritten.elem_count;
+  for (i = 0; i < labels.elem_count; i++) {
+    int* label = (int*)array_get(&labels, i);
+    if (*label >= 0) {
+      *label = position[*label];
+    }
+  }
+  code = rewritten;
+}
+
+/*
+ * Frame layout.  A slot is reached from its first access to its last, over
+ * any loop around them; where its address is taken, up to the helper call
+ * the address is passed to, or throughout if the address is kept in a value.
+ * Slots reached at the same time get different bytes.
+ */
+
+internal void
+reach_slot(struct BpfSlot* slot, int i)
+{
+  slot->start = i < slot->start ? i : slot->start;
+  slot->end = i > slot->end ? i : slot->end;
+}
+
+/* The frame offset that `insn` accesses memory at, or 0. */
+internal int*
+frame_access(struct BpfInsn* insn)
+{
+  uint8_t cls = insn->code & 0x07;
+  if (cls == BPF_LDX && insn->src == BPF_REG_FP) {
+    return &insn->off;
+  } else if ((cls == BPF_ST || cls == BPF_STX) && insn->dst == BPF_REG_FP) {
+    return &insn->off;
+  }
+  return 0;
+}
+
+internal void
+find_slot_ranges()
+{
+  int n = code.elem_count;
+  int i, j, byte;
+  for (i = 0; i < frame_slot_count; i++) {
+    slot_at(i)->start = n;
+    slot_at(i)->end = -1;
+  }
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    int* offset = frame_access(insn);
+    if (offset) {
+      reach_slot(slot_at(slot_index(*offset, &byte)), i);
+    } else if (insn->frame_slot && insn->dst < BPF_VREG_BASE) {
+      for (j = i; j < n && code_at(j)->code != (BPF_JMP | BPF_CALL); j++);
+      reach_slot(slot_at(insn->frame_slot - 1), i);
+      reach_slot(slot_at(insn->frame_slot - 1), j);
+    } else if (insn->frame_slot) {
+      reach_slot(slot_at(insn->frame_slot - 1), 0);
+      reach_slot(slot_at(insn->frame_slot - 1), n - 1);
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (i = 0; i < n; i++) {
+      struct BpfInsn* insn = code_at(i);
+      int target = is_jump(insn) ? label_position(insn->label) : n;
+      if (target > i) {
+        continue;
+      }
+      for (j = 0; j < frame_slot_count; j++) {
+        struct BpfSlot* slot = slot_at(j);
+        if (slot->start <= i && slot->end >= target && (slot->start > target || slot->end < i)) {
+          reach_slot(slot, target);
+          reach_slot(slot, i);
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+/* The lowest offset in the stack or the scratch area where `slot` overlaps no placed slot reached with it. */
+internal int
+place_slot(struct BpfSlot* slot, bool is_scratch)
+{
+  int at = 0;
+  int i;
+  bool moved = true;
+  while (moved) {
+    moved = false;
+    for (i = 0; i < slots.elem_count; i++) {
+      struct BpfSlot* other = slot_at(i);
+      if (!other->is_placed || other->is_scratch != is_scratch || other->end < slot->start || other->start > slot->end) {
+        continue;
+      }
+      if (at < other->at + other->size && other->at < at + slot->size) {
+        at = align_to(other->at + other->size, slot->alignment);
+        moved = true;
+      }
+    }
+  }
+  return at;
+}
+
+internal int
+compare_slots(const void* a, const void* b)
+{
+  const struct BpfSlot* x = *(const struct BpfSlot**)a;
+  const struct BpfSlot* y = *(const struct BpfSlot**)b;
+  if (x->is_stack != y->is_stack) {
+    return x->is_stack ? -1 : 1;
+  }
+  if (x->is_spill != y->is_spill) {
+    return x->is_spill ? -1 : 1;
+  }
+  return x->size != y->size ? y->size - x->size : (x < y ? -1 : x > y);
+}
+
+/*
+ * Places the slots, those reached before the scratch lookup, spilled
+ * registers and then the largest first, on the stack or else, with
+ * `has_scratch`, in the scratch area, which grows to the most any stage puts
+ * there.  False if the stack is not enough and there is no scratch area.
+ */
+internal bool
+layout_frame(bool has_scratch)
+{
+  struct BpfSlot** sorted = arena_push(emit_storage, (slots.elem_count + 1) * sizeof(struct BpfSlot*));
+  int i;
+  find_slot_ranges();
+  for (i = 0; i < slots.elem_count; i++) {
+    sorted[i] = slot_at(i);
+    sorted[i]->is_stack = has_scratch && sorted[i]->start < scratch_start;
+    sorted[i]->is_placed = sorted[i]->is_scratch = false;
+  }
+  qsort(sorted, slots.elem_count, sizeof(struct BpfSlot*), compare_slots);
+  for (i = 0; i < slots.elem_count; i++) {
+    struct BpfSlot* slot = sorted[i];
+    if (slot->end < slot->start) {
+      continue;
+    }
+    slot->at = place_slot(slot, false);
+    if (slot->at + slot->size > BPF_STACK_SIZE) {
+      if (!has_scratch) {
+        return false;
+      } else if (slot->is_stack) {
+        error("the program needs more than the %d bytes of stack that BPF allows.", BPF_STACK_SIZE);
+      }
+      slot->is_scratch = true;
+      slot->at = place_slot(slot, true);
+      if (slot->at + slot->size > scratch_map.value_size) {
+        scratch_map.value_size = slot->at + slot->size;
+      }
+    }
+    slot->is_placed = true;
+  }
+  if (scratch_map.value_size > BPF_SCRATCH_SIZE) {
+    error("the program needs more than the %d bytes of scratch memory that BPF allows.", BPF_SCRATCH_SIZE);
+  }
+  return true;
+}
+
+/* Looks up the scratch area into R9 at the start, once the context is kept. */
+internal void
+add_scratch_prologue()
+{
+  struct UnboundedArray body = code;
+  int first_label = labels.elem_count;
+  int i;
+  scratch_map.name = "ashp4c_scratch";
+  scratch_map.type = EbpfMap_PercpuArray;
+  scratch_map.key_size = 4;
+  scratch_map.max_entries = 1;
+  array_init(&code, sizeof(struct BpfInsn), emit_storage);
+  array_append(&code, array_get(&body, 0));
+  int found = new_label();
+  op_store_imm(4, BPF_REG_FP, zero_key, 0);
+  op_mov(BPF_REG_SCRATCH, op_map_lookup(&scratch_map, zero_key));
+  op_jump_imm(BPF_JNE, BPF_REG_SCRATCH, 0, found);
+  op_return(XDP_ABORTED);
+  place_label(found);
+  int added = code.elem_count - 1;
+  scratch_start = code.elem_count;
+  for (i = 1; i < body.elem_count; i++) {
+    array_append(&code, array_get(&body, i));
+  }
+  for (i = 0; i < first_label; i++) {
+    int* label = (int*)array_get(&labels, i);
+    if (*label >= 1) {
+      *label += added;
+    }
+  }
+}
+
+/* Rewrites the virtual frame offsets to where layout_frame() put their slots. */
+internal void
+place_frame()
+{
+  int i, byte;
+  for (i = 0; i < code.elem_count; i++) {
+    struct BpfInsn* insn = code_at(i);
+    int* offset = frame_access(insn);
+    if (!offset && insn->frame_slot && (insn->code & 0xf0) == BPF_ADD) {
+      int64_t* imm = &insn->imm;
+      struct BpfSlot* slot = slot_at(slot_index((int)*imm, &byte));
+      *imm = slot->is_scratch ? slot->at + byte : byte - slot->at - slot->size;
+    } else if (!offset && insn->frame_slot) {
+      insn->src = slot_at(insn->frame_slot - 1)->is_scratch ? BPF_REG_SCRATCH : BPF_REG_FP;
+    }
+    if (!offset) {
+      continue;
+    }
+    struct BpfSlot* slot = slot_at(slot_index(*offset, &byte));
+    if (slot->is_scratch) {
+      *((insn->code & 0x07) == BPF_LDX ? &insn->src : &insn->dst) = BPF_REG_SCRATCH;
+      *offset = slot->at + byte;
+    } else {
+      *offset = byte - slot->at - slot->size;
+    }
+  }
+}
+
+/*
+ * Complexity.  The verifier walks each instruction once per state that
+ * reaches it, and keeps up to BPF_STATE_LIMIT states at a jump target to prune
+ * the paths that come later against.  The states at an instruction are taken
+ * to be its paths from the start, up to that limit: where branches join,
+ * their states are taken to differ.  A loop is walked once per trip; only a
+ * parser loops, and its instructions run at most `trips` times.  Each trip
+ * leaves the loop at another packet offset, a state that nothing prunes, so
+ * what comes after is walked again for each.
+ */
+
+#define BPF_STATE_LIMIT  64  /* BPF_COMPLEXITY_LIMIT_STATES */
+
+internal int
+insn_succs(int i, int* succs)
+{
+  struct BpfInsn* insn = code_at(i);
+  int count = 0;
+  if (insn->code != (BPF_JMP | BPF_EXIT) && insn->code != (BPF_JMP | BPF_JA)) {
+    succs[count++] = i + 1;
+  }
+  if (is_jump(insn)) {
+    succs[count++] = label_position(insn->label);
+  }
+  return count;
+}
+
+/*
+ * Measures the code of a stage into `complexity`, by the block each
+ * instruction is emitted for.  A depth-first search finds the edges that
+ * close loops; without them the code is walked in topological order.
+ */
+internal void
+measure_complexity(struct EbpfComplexity* complexity)
+{
+  int n = code.elem_count;
+  int64_t* states = arena_push(emit_storage, (n + 1) * sizeof(int64_t));
+  int64_t* trips = arena_push(emit_storage, (n + 1) * sizeof(int64_t));
+  int64_t* lengths = arena_push(emit_storage, (n + 1) * sizeof(int64_t));
+  int64_t* exits = arena_push(emit_storage, (n + 1) * sizeof(int64_t));   /* the trips of the loops left before it */
+  int* color = arena_push(emit_storage, (n + 1) * sizeof(int));   /* 1: on the search stack, 2: done */
+  int* next = arena_push(emit_storage, (n + 1) * sizeof(int));    /* the successor to search next, or preds filled */
+  int* stack = arena_push(emit_storage, (n + 1) * sizeof(int));
+  int* order = arena_push(emit_storage, (n + 1) * sizeof(int));   /* postorder */
+  bool* is_back = arena_push(emit_storage, (2 * n + 1) * sizeof(bool));
+  int* first_pred = arena_push(emit_storage, (n + 2) * sizeof(int));
+  int* preds = arena_push(emit_storage, (2 * n + 1) * sizeof(int));
+  int* loop = arena_push(emit_storage, (n + 1) * sizeof(int));    /* the last loop found to hold it, + 1 */
+  int succs[2], succ_count;
+  int i, k, top = 0, order_count = 0;
+  memset(states, 0, (n + 1) * sizeof(int64_t));
+  memset(lengths, 0, (n + 1) * sizeof(int64_t));
+  memset(color, 0, (n + 1) * sizeof(int));
+  memset(is_back, 0, (2 * n + 1) * sizeof(bool));
+  memset(first_pred, 0, (n + 2) * sizeof(int));
+  memset(loop, 0, (n + 1) * sizeof(int));
+  memset(next, 0, (n + 1) * sizeof(int));
+  for (i = 0; i < n; i++) {
+    trips[i] = 1;
+    exits[i] = 1;
+    succ_count = insn_succs(i, succs);
+    for (k = 0; k < succ_count; k++) {
+      first_pred[succs[k] + 1] += 1;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    first_pred[i + 1] += first_pred[i];
+  }
+  for (i = 0; i < n; i++) {
+    succ_count = insn_succs(i, succs);
+    for (k = 0; k < succ_count; k++) {
+      preds[first_pred[succs[k]] + next[succs[k]]++] = i;
+    }
+  }
+
+  stack[top++] = 0;
+  color[0] = 1;
+  next[0] = 0;
+  while (top > 0) {
+    i = stack[top - 1];
+    succ_count = insn_succs(i, succs);
+    if (next[i] < succ_count) {
+      k = next[i]++;
+      if (color[succs[k]] == 1) {
+        is_back[2 * i + k] = true;
+      } else if (color[succs[k]] == 0) {
+        color[succs[k]] = 1;
+        next[succs[k]] = 0;
+        stack[top++] = succs[k];
+      }
+    } else {
+      color[i] = 2;
+      order[order_count++] = i;
+      top -= 1;
+    }
+  }
+
+  /* The body of a loop: what reaches the jump back without going through the loop's head. */
+  for (i = 0; i < n; i++) {
+    succ_count = insn_succs(i, succs);
+    for (k = 0; k < succ_count; k++) {
+      int head = succs[k], count = 0, j;
+      if (!is_back[2 * i + k]) {
+        continue;
+      }
+      int64_t loop_trips = code_at(i)->trips < code_at(head)->trips ? code_at(i)->trips : code_at(head)->trips;
+      loop[head] = 2 * i + k + 1;
+      stack[count++] = head;
+      if (i != head) {
+        loop[i] = 2 * i + k + 1;
+        stack[count++] = i;
+      }
+      for (j = 1; j < count; j++) {
+        int p;
+        for (p = first_pred[stack[j]]; p < first_pred[stack[j] + 1]; p++) {
+          if (loop[preds[p]] != 2 * i + k + 1) {
+            loop[preds[p]] = 2 * i + k + 1;
+            stack[count++] = preds[p];
+          }
+        }
+      }
+      for (j = 0; j < count; j++) {
+        trips[stack[j]] = trips[stack[j]] * loop_trips > EBPF_MAX_INSNS ? EBPF_MAX_INSNS : trips[stack[j]] * loop_trips;
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    struct BpfInsn* insn = code_at(i);
+    struct EbpfBlockComplexity* block = ebpf_block_complexity(complexity, insn->block);
+    int size = insn->code == (BPF_LD | BPF_IMM | BPF_DW) ? 2 : 1;
+    bool is_branch = is_jump(insn) && (insn->code & 0xf0) != BPF_JA;
+    complexity->insn_count += size;
+    complexity->branch_count += is_branch;
+    block->insn_count += size;
+    block->branch_count += is_branch;
+  }
+  states[0] = 1;
+  while (order_count > 0) {
+    i = order[--order_count];
+    struct EbpfBlockComplexity* block = ebpf_block_complexity(complexity, code_at(i)->block);
+    int64_t reaching = states[i] < BPF_STATE_LIMIT ? states[i] : BPF_STATE_LIMIT;
+    int64_t length = lengths[i] + trips[i];
+    int64_t walks = trips[i] * exits[i] > EBPF_MAX_INSNS ? EBPF_MAX_INSNS : trips[i] * exits[i];
+    complexity->walked += reaching * walks;
+    block->walked += reaching * walks;
+    if (code_at(i)->code == (BPF_JMP | BPF_EXIT) && length > complexity->path_length) {
+      complexity->path_length = (int)length;
+    }
+    succ_count = insn_succs(i, succs);
+    for (k = 0; k < succ_count; k++) {
+      if (!is_back[2 * i + k]) {
+        int64_t left = trips[i] > trips[succs[k]] ? trips[i] / trips[succs[k]] : 1;
+        int64_t exit = exits[i] * left > EBPF_MAX_INSNS ? EBPF_MAX_INSNS : exits[i] * left;
+        states[succs[k]] += reaching;
+        lengths[succs[k]] = length > lengths[succs[k]] ? length : lengths[succs[k]];
+        exits[succs[k]] = exit > exits[succs[k]] ? exit : exits[succs[k]];
+      }
+    }
+  }
+}
+
+/*
+ * The object file.
+ */
+
+struct ElfSection {
+  char* name;
+  uint32_t type;
+  uint64_t flags;
+  uint8_t* data;
+  int size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t alignment;
+  uint64_t entry_size;
+  int name_offset;
+  int offset;
+};
+
+#define SHT_PROGBITS  1
+#define SHT_SYMTAB    2
+#define SHT_STRTAB    3
+#define SHT_REL       9
+#define SHF_WRITE      1
+#define SHF_ALLOC      2
+#define SHF_EXECINSTR  4
+#define STB_GLOBAL  1
+#define STT_OBJECT  1
+#define STT_FUNC    2
+
+internal void
+put_u16(uint8_t* p, uint16_t value)
+{
+  p[0] = value & 0xff;
+  p[1] = value >> 8;
+}
+
+internal void
+put_u32(uint8_t* p, uint32_t value)
+{
+  put_u16(p, value & 0xffff);
+  put_u16(p + 2, value >> 16);
+}
+
+internal void
+put_u64(uint8_t* p, uint64_t value)
+{
+  put_u32(p, value & 0xffffffff);
+  put_u32(p + 4, value >> 32);
+}
+
+/* Instructions in 8-byte slots, with the jumps resolved. */
+/* The code of a stage and its relocations, encoded. */
+struct BpfStage {
+  uint8_t* bytes;
+  int slot_count;
+  uint8_t* relocations;
+  int relocation_count;
+};
+
+internal uint8_t*
+encode_code(int* slot_count)
+{
+  int* slot = arena_push(emit_storage, (code.elem_count + 1) * sizeof(int));
+  int i;
+  slot[0] = 0;
+  for (i = 0; i < code.elem_count; i++) {
+    slot[i + 1] = slot[i] + (code_at(i)->code == (BPF_LD | BPF_IMM | BPF_DW) ? 2 : 1);
+  }
+  *slot_count = slot[code.elem_count];
+  uint8_t* bytes = arena_push(emit_storage, *slot_count * 8 + 1);
+  memset(bytes, 0, *slot_count * 8 + 1);
+  for (i = 0; i < code.elem_count; i++) {
+    struct BpfInsn* insn = code_at(i);
+    uint8_t* p = bytes + slot[i] * 8;
+    int off = insn->off;
+    if (is_jump(insn)) {
+      off = slot[label_position(insn->label)] - slot[i + 1];
+      if (off < INT16_MIN || off > INT16_MAX) {
+        error("the program is too large for the jumps of the BPF target.");
+      }
+    }
+    assert(insn->dst < BPF_VREG_BASE && insn->src < BPF_VREG_BASE);
+    p[0] = insn->code;
+    p[1] = (insn->dst & 0x0f) | (insn->src & 0x0f) << 4;
+    put_u16(p + 2, (uint16_t)off);
+    put_u32(p + 4, (uint32_t)insn->imm);
+    if (insn->code == (BPF_LD | BPF_IMM | BPF_DW)) {
+      put_u32(p + 12, (uint32_t)((uint64_t)insn->imm >> 32));
+    }
+  }
+  /* Relocations go where the loader will find them: the slots of the map loads. */
+  for (i = 0; i < code.elem_count; i++) {
+    code_at(i)->off = slot[i];
+  }
+  return bytes;
+}
+
+/* An Elf64_Rel for each map load, once encode_code() has put the slots in `off`. */
+internal uint8_t*
+encode_relocations(int* relocation_count)
+{
+  int i;
+  *relocation_count = 0;
+  for (i = 0; i < code.elem_count; i++) {
+    *relocation_count += code_at(i)->map ? 1 : 0;
+  }
+  uint8_t* bytes = arena_push(emit_storage, *relocation_count * 16 + 1);
+  uint8_t* rel = bytes;
+  for (i = 0; i < code.elem_count; i++) {
+    struct BpfInsn* insn = code_at(i);
+    if (insn->map) {
+      put_u64(rel, (uint64_t)insn->off * 8);
+      put_u64(rel + 8, (uint64_t)insn->map << 32 | R_BPF_64_64);
+      rel += 16;
+    }
+  }
+  return bytes;
+}
+
+internal int
+add_string(struct UnboundedArray* strings, char* s)
+{
+  int offset = strings->elem_count;
+  int len = strlen(s);
+  int i;
+  for (i = 0; i <= len; i++) {
+    array_append(strings, &s[i]);
+  }
+  return offset;
+}
+
+internal uint8_t*
+string_bytes(struct UnboundedArray* strings)
+{
+  uint8_t* bytes = arena_push(emit_storage, strings->elem_count + 1);
+  int i;
+  for (i = 0; i < strings->elem_count; i++) {
+    bytes[i] = *(uint8_t*)array_get(strings, i);
+  }
+  return bytes;
+}
+
+/* The code of the first stage comes first, that of the others after all the rest, each before its relocations. */
+internal int
+code_section(int stage)
+{
+  return stage == 0 ? 1 : 6 + 2 * stage;
+}
+
+internal void
+write_object(FILE* f_stream, struct BpfStage* stages, int stage_count)
+{
+  enum { S_NULL, S_CODE, S_REL, S_MAPS, S_LICENSE, S_SYMTAB, S_STRTAB, S_SHSTRTAB, S_STAGES };
+  int section_count = S_STAGES + 2 * (stage_count - 1);
+  struct ElfSection* sections = arena_push(emit_storage, section_count * sizeof(struct ElfSection));
+  struct UnboundedArray strtab, shstrtab;
+  int i;
+  memset(sections, 0, section_count * sizeof(struct ElfSection));
+  array_init(&strtab, sizeof(char), emit_storage);
+  array_init(&shstrtab, sizeof(char), emit_storage);
+  add_string(&strtab, "");
+  add_string(&shstrtab, "");
+
+  for (i = 0; i < stage_count; i++) {
+    struct ElfSection* section = &sections[code_section(i)];
+    char* name = arena_push(emit_storage, 16);
+    strcpy(name, is_userspace ? "ubpf" : "xdp");
+    if (i > 0) {
+      sprintf(name, is_userspace ? "ubpf/%d" : "xdp/%d", i);
+    }
+    section->name = name;
+    section->type = SHT_PROGBITS;
+    section->flags = SHF_ALLOC | SHF_EXECINSTR;
+    section->data = stages[i].bytes;
+    section->size = stages[i].slot_count * 8;
+    section->alignment = 8;
+  }
+
+  /* struct bpf_map_def, 7 x __u32, one per symbol at its st_value. */
+  int map_def_size = 28;
+  sections[S_MAPS].name = "maps";
+  sections[S_MAPS].type = SHT_PROGBITS;
+  sections[S_MAPS].flags = SHF_WRITE | SHF_ALLOC;
+  sections[S_MAPS].size = maps.elem_count * map_def_size;
+  sections[S_MAPS].data = arena_push(emit_storage, sections[S_MAPS].size + 1);
+  memset(sections[S_MAPS].data, 0, sections[S_MAPS].size + 1);
+  sections[S_MAPS].alignment = 4;
+
+  /* Symbols: null, the maps, the program of each stage, the license. */
+  int symbol_count = maps.elem_count + stage_count + 2;
+  sections[S_SYMTAB].name = ".symtab";
+  sections[S_SYMTAB].type = SHT_SYMTAB;
+  sections[S_SYMTAB].size = symbol_count * 24;
+  sections[S_SYMTAB].data = arena_push(emit_storage, sections[S_SYMTAB].size);
+  memset(sections[S_SYMTAB].data, 0, sections[S_SYMTAB].size);
+  sections[S_SYMTAB].link = S_STRTAB;
+  sections[S_SYMTAB].info = 1;  /* the first global */
+  sections[S_SYMTAB].alignment = 8;
+  sections[S_SYMTAB].entry_size = 24;
+  for (i = 0; i < maps.elem_count; i++) {
+    struct EbpfMap* map = *(struct EbpfMap**)array_get(&maps, i);
+    uint8_t* def = sections[S_MAPS].data + i * map_def_size;
+    put_u32(def, map->type);
+    put_u32(def + 4, map->key_size);
+    put_u32(def + 8, map->value_size);
+    put_u32(def + 12, map->max_entries);
+    put_u32(def + 16, map->flags);
+    uint8_t* sym = sections[S_SYMTAB].data + (i + 1) * 24;
+    put_u32(sym, add_string(&strtab, map->name));
+    sym[4] = STB_GLOBAL << 4 | STT_OBJECT;
+    put_u16(sym + 6, S_MAPS);
+    put_u64(sym + 8, i * map_def_size);
+    put_u64(sym + 16, map_def_size);
+  }
+  uint8_t* sym = sections[S_SYMTAB].data + (maps.elem_count + 1) * 24;
+  for (i = 0; i < stage_count; i++) {
+    char name[32];
+    strcpy(name, is_userspace ? "ashp4c_ubpf" : "ashp4c_xdp");
+    if (i > 0) {
+      sprintf(name, is_userspace ? "ashp4c_ubpf_%d" : "ashp4c_xdp_%d", i);
+    }
+    put_u32(sym, add_string(&strtab, name));
+    sym[4] = STB_GLOBAL << 4 | STT_FUNC;
+    put_u16(sym + 6, code_section(i));
+    put_u64(sym + 16, sections[code_section(i)].size);
+    sym += 24;
+  }
+  put_u32(sym, add_string(&strtab, "_license"));
+  sym[4] = STB_GLOBAL << 4 | STT_OBJECT;
+  put_u16(sym + 6, S_LICENSE);
+  put_u64(sym + 16, 4);
+
+  sections[S_LICENSE].name = "license";
+  sections[S_LICENSE].type = SHT_PROGBITS;
+  sections[S_LICENSE].flags = SHF_WRITE | SHF_ALLOC;
+  sections[S_LICENSE].data = (uint8_t*)"GPL";
+  sections[S_LICENSE].size = 4;
+  sections[S_LICENSE].alignment = 1;
+
+  for (i = 0; i < stage_count; i++) {
+    struct ElfSection* section = &sections[code_section(i) + 1];
+    char* name = arena_push(emit_storage, strlen(sections[code_section(i)].name) + 5);
+    sprintf(name, ".rel%s", sections[code_section(i)].name);
+    section->name = name;
+    section->type = SHT_REL;
+    section->size = stages[i].relocation_count * 16;
+    section->data = stages[i].relocations;
+    section->link = S_SYMTAB;
+    section->info = code_section(i);
+    section->alignment = 8;
+    section->entry_size = 16;
+  }
+
+  sections[S_STRTAB].name = ".strtab";
+  sections[S_STRTAB].type = SHT_STRTAB;
+  sections[S_STRTAB].data = string_bytes(&strtab);
+  sections[S_STRTAB].size = strtab.elem_count;
+  sections[S_STRTAB].alignment = 1;
+
+  sections[S_SHSTRTAB].name = ".shstrtab";
+  sections[S_SHSTRTAB].type = SHT_STRTAB;
+  sections[S_SHSTRTAB].alignment = 1;
+  for (i = 1; i < section_count; i++) {
+    sections[i].name_offset = add_string(&shstrtab, sections[i].name);
+  }
+  sections[S_SHSTRTAB].data = string_bytes(&shstrtab);
+  sections[S_SHSTRTAB].size = shstrtab.elem_count;
+
+  int offset = 64;
+  for (i = 1; i < section_count; i++) {
+    offset = align_to(offset, sections[i].alignment);
+    sections[i].offset = offset;
+    offset += sections[i].size;
+  }
+  int header_offset = align_to(offset, 8);
+  int file_size = header_offset + section_count * 64;
+  uint8_t* image = arena_push(emit_storage, file_size);
+  memset(image, 0, file_size);
+  memcpy(image, "\177ELF", 4);
+  image[4] = 2;  /* ELFCLASS64 */
+  image[5] = 1;  /* ELFDATA2LSB */
+  image[6] = 1;  /* EV_CURRENT */
+  put_u16(image + 16, 1);  /* ET_REL */
+  put_u16(image + 18, EM_BPF);
+  put_u32(image + 20, 1);
+  put_u64(image + 40, header_offset);
+  put_u16(image + 52, 64);
+  put_u16(image + 58, 64);
+  put_u16(image + 60, section_count);
+  put_u16(image + 62, S_SHSTRTAB);
+  for (i = 1; i < section_count; i++) {
+    struct ElfSection* section = &sections[i];
+    uint8_t* header = image + header_offset + i * 64;
+    memcpy(image + section->offset, section->data, section->size);
+    put_u32(header, section->name_offset);
+    put_u32(header + 4, section->type);
+    put_u64(header + 8, section->flags);
+    put_u64(header + 24, section->offset);
+    put_u64(header + 32, section->size);
+    put_u32(header + 40, section->link);
+    put_u32(header + 44, section->info);
+    put_u64(header + 48, section->alignment);
+    put_u64(header + 56, section->entry_size);
+  }
+  fwrite(image, 1, file_size, f_stream);
+}
+
+internal void
+emit_program(struct EbpfProgram* ebpf_program, FILE* f_stream, struct Arena* storage)
+{
+  program = ebpf_program;
+  array_init(&maps, sizeof(struct EbpfMap*), storage);
+  memset(&init_map, 0, sizeof(init_map));
+  memset(&scratch_map, 0, sizeof(scratch_map));
+  if (program->stage_count > 1) {
+    program->state_map.value_size = state_size();
+  }
+  struct BpfStage* stages = arena_push(storage, program->stage_count * sizeof(struct BpfStage));
+  int stage;
+  for (stage = 0; stage < program->stage_count; stage++) {
+    emit_storage = &stage_storage;
+    array_init(&code, sizeof(struct BpfInsn), emit_storage);
+    array_init(&labels, sizeof(int), emit_storage);
+    array_init(&pending, sizeof(struct BpfEdge), emit_storage);
+    new_label();  /* 0 is no label */
+    vreg_count = BPF_VREG_BASE;
+    array_init(&slots, sizeof(struct BpfSlot), emit_storage);
+    scratch_start = 0;
+    check_size = 0;
+    emit_block = 0;
+    table_areas = arena_push(emit_storage, (2 * program->tables.elem_count + 1) * sizeof(int));
+    memset(table_areas, 0, (2 * program->tables.elem_count + 1) * sizeof(int));
+
+    emit_main(stage);
+    while (remove_dead_jumps());
+    frame_slot_count = slots.elem_count;
+    struct BpfInterval* intervals = build_intervals();
+    linear_scan(intervals, false);
+    if (!layout_frame(false)) {
+      add_scratch_prologue();
+      slots.elem_count = frame_slot_count;
+      intervals = build_intervals();
+      linear_scan(intervals, true);
+      layout_frame(true);
+    }
+    rewrite_registers(intervals);
+    place_frame();
+    struct EbpfComplexity* complexity = &program->complexities[stage];
+    memset(complexity, 0, sizeof(*complexity));
+    array_init(&complexity->blocks, sizeof(struct EbpfBlockComplexity), storage);
+    measure_complexity(complexity);
+    emit_storage = storage;
+    stages[stage].bytes = encode_code(&stages[stage].slot_count);
+    stages[stage].relocations = encode_relocations(&stages[stage].relocation_count);
+    arena_rewind(&stage_storage);
+  }
+  arena_delete(&stage_storage);
+  write_object(f_stream, stages, program->stage_count);
+}
+
+void
+emit_bpf_program(struct EbpfProgram* ebpf_program, FILE* f_stream, struct Arena* storage)
+{
+  if (ebpf_program->model == EbpfModel_Ubpf) {
+    error("the BPF target does not run `ubpf` packages in the kernel, --target=ubpf compiles them.");
+  }
+  is_userspace = false;
+  emit_program(ebpf_program, f_stream, storage);
+}
+
+/* The program for ebpf/ubpf_run.c. */
+void
+emit_ubpf_program(struct EbpfProgram* ebpf_program, FILE* f_stream, struct Arena* storage)
+{
+  is_userspace = true;
+  emit_program(ebpf_program, f_stream, storage);
+}
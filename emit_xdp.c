@@ -0,0 +1,2279 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "type_check.h"
+#include "ir.h"
+#include "ebpf.h"
+#include <memory.h>  // memset
+#include <stdarg.h>
+
+
+/*
+ * C backend for XDP.  The output is a single file for `clang -target bpf`,
+ * in the style of the kernel samples in ebpf/: maps in the "maps" section,
+ * bounds-checked packet accesses, everything inlined into one program.
+ *
+ * Headers are parsed into host-order structs, as in p4c-ebpf.  Every parser
+ * and control becomes a function taking a context with its parameters and
+ * its locals; actions take the context of their control.  IR values become C
+ * variables `v<id>`, references become pointer expressions, blocks become
+ * labels, and phis are assigned on the edges that lead to them.
+ */
+
+#define XDP_NO_ACTION  "0xffffffff"
+
+internal struct Arena* emit_storage;
+internal struct EbpfProgram* program;
+internal FILE* out;
+internal bool* type_emitted;             /* by Type.id */
+internal int type_emitted_count;
+internal struct UnboundedArray headers;  /* struct Type*, in the order their structs were emitted */
+internal bool* function_reached;         /* by Ast.id of the declaration */
+internal struct IrFunction* function;    /* being emitted */
+internal char** refs;                    /* pointer expression of each reference, by insn id */
+internal int* use_count;                 /* by insn id */
+internal int check_id;                   /* packet_check that the next extracts read from, or 0 */
+internal int check_offset;               /* of the next extract within it */
+
+
+internal char*
+format(char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(0, 0, fmt, args);
+  va_end(args);
+  char* s = arena_push(emit_storage, len + 1);
+  va_start(args, fmt);
+  vsnprintf(s, len + 1, fmt, args);
+  va_end(args);
+  return s;
+}
+
+/*
+ * Types.
+ */
+
+internal char*
+uint_type(int size)
+{
+  if (size == 8) {
+    return "__u64";
+  } else if (size == 4) {
+    return "__u32";
+  } else if (size == 2) {
+    return "__u16";
+  }
+  return "__u8";
+}
+
+/* C type of a scalar, or 0. */
+internal char*
+scalar_ctype(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  if (!type) {
+    return 0;
+  } else if (type->kind == Type_Int) {
+    return "__s64";
+  }
+  int size = ebpf_scalar_size(type);
+  if (size == 0) {
+    return 0;
+  }
+  if (type->kind == Type_SignedInt) {
+    return size == 8 ? "__s64" : size == 4 ? "__s32" : size == 2 ? "__s16" : "__s8";
+  }
+  return uint_type(size);
+}
+
+internal char*
+ctype(struct Type* type, int line_nr)
+{
+  struct Type* resolved = ebpf_resolve_type(type);
+  char* scalar = scalar_ctype(resolved);
+  if (scalar) {
+    return scalar;
+  } else if (resolved && (resolved->kind == Type_Struct || resolved->kind == Type_Header
+                          || resolved->kind == Type_HeaderUnion)) {
+    return format("struct %s", resolved->name);
+  } else if (resolved && resolved->kind == Type_HeaderStack) {
+    return format("struct ashp4c_stack_%s_%d", ebpf_resolve_type(resolved->base)->name, resolved->width);
+  }
+  error("at line %d: the XDP target does not support values of type `%s`.", line_nr,
+        type ? type_to_string(type) : "?");
+  return 0;
+}
+
+/* `expr` reduced to the values of `type`: masked, or sign-extended from its width. */
+internal char*
+wrap(struct Type* type, char* expr)
+{
+  char* ct = scalar_ctype(type);
+  int width = ebpf_scalar_bits(type);
+  int size = ebpf_scalar_size(ebpf_resolve_type(type));
+  if (ebpf_resolve_type(type)->kind == Type_Bool) {
+    return format("(__u8)((%s) != 0)", expr);
+  } else if (ebpf_resolve_type(type)->kind == Type_Int || width == size * 8) {
+    return format("(%s)(%s)", ct, expr);
+  } else if (ebpf_is_signed(type)) {
+    return format("(%s)((__s64)((__u64)(%s) << %d) >> %d)", ct, expr, 64 - width, 64 - width);
+  }
+  return format("(%s)((%s) & 0x%llxULL)", ct, expr, ebpf_width_mask(width));
+}
+
+internal char*
+literal(struct BitInt* value, struct Type* type)
+{
+  char* ct = scalar_ctype(type);
+  if (!value->is_sized) {
+    int64_t v = 0;
+    if (!bitint_to_int64(value, &v)) {
+      error("integer constant does not fit in 64 bits.");
+    }
+    return format("(%s)%lldLL", ct, (long long)v);
+  }
+  uint64_t bits = value->word_count > 0 ? value->words[0] : 0;
+  if (value->is_signed && value->width < 64 && (bits >> (value->width - 1)) & 1) {
+    return format("(%s)%lldLL", ct, (long long)(bits | ~ebpf_width_mask(value->width)));
+  }
+  return format("(%s)0x%llxULL", ct, (unsigned long long)bits);
+}
+
+internal void
+emit_type(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  if (!ebpf_is_aggregate(type) || type->id >= type_emitted_count || type_emitted[type->id]) {
+    return;
+  }
+  type_emitted[type->id] = true;
+  int line_nr = type->decl ? type->decl->line_nr : 0;
+  int i;
+  if (type->kind == Type_HeaderStack) {
+    emit_type(type->base);
+    fprintf(out, "%s {\n", ctype(type, line_nr));
+    fprintf(out, "  %s elem[%d];\n", ctype(type->base, line_nr), type->width);
+    fprintf(out, "  __u32 next;\n");
+    fprintf(out, "};\n\n");
+    return;
+  }
+  for (i = 0; i < type->member_count; i++) {
+    emit_type(type->members[i].type);
+  }
+  if (type->kind == Type_Header) {
+    fprintf(out, "/* %d bytes on the wire */\n", ebpf_header_size(type));
+    array_append(&headers, &type);
+  }
+  fprintf(out, "struct %s {\n", type->name);
+  for (i = 0; i < type->member_count; i++) {
+    struct TypeMember* member = &type->members[i];
+    fprintf(out, "  %s %s;\n", ctype(member->type, member->decl ? member->decl->line_nr : line_nr), member->name);
+  }
+  if (type->kind == Type_Header) {
+    fprintf(out, "  __u8 ebpf_valid;\n");
+    if (ebpf_view_of(program, type)) {
+      fprintf(out, "  __u32 ebpf_offset;  /* 1 + where it was extracted, or 0 */\n");
+    }
+  } else if (type->member_count == 0) {
+    fprintf(out, "  __u8 ebpf_unused;\n");
+  }
+  fprintf(out, "};\n\n");
+}
+
+/*
+ * Wire format of headers.  Fields are numbered from the most significant bit
+ * of the first byte; byte-aligned fields are loaded with the widest accesses
+ * that fit, the others a byte at a time.
+ */
+
+internal char*
+load_bytes(char* base, int byte, int count)
+{
+  if (count == 1) {
+    return format("%s[%d]", base, byte);
+  } else if (count == 2) {
+    return format("bpf_ntohs(*(__u16*)(%s + %d))", base, byte);
+  } else if (count == 4) {
+    return format("bpf_ntohl(*(__u32*)(%s + %d))", base, byte);
+  } else if (count == 8) {
+    return format("ashp4c_ntohll(*(__u64*)(%s + %d))", base, byte);
+  }
+  int head = count > 4 ? 4 : count > 2 ? 2 : 1;
+  return format("((__u64)%s << %d | %s)", load_bytes(base, byte, head), 8 * (count - head),
+                load_bytes(base, byte + head, count - head));
+}
+
+internal char*
+load_bits(char* base, int offset, int width)
+{
+  if (offset % 8 == 0 && width % 8 == 0) {
+    return load_bytes(base, offset / 8, width / 8);
+  }
+  char* expr = 0;
+  int k;
+  for (k = offset / 8; k <= (offset + width - 1) / 8; k++) {
+    int lo = offset > 8 * k ? offset : 8 * k;
+    int hi = offset + width < 8 * k + 8 ? offset + width : 8 * k + 8;
+    char* part = format("((__u64)((%s[%d] >> %d) & 0x%x) << %d)", base, k, 8 * k + 8 - hi,
+                        (int)ebpf_width_mask(hi - lo), offset + width - hi);
+    expr = expr ? format("%s | %s", expr, part) : part;
+  }
+  return format("(%s)", expr);
+}
+
+internal void
+store_bytes(char* indent, char* base, int byte, int count, char* value, int shift)
+{
+  if (count == 1) {
+    fprintf(out, "%s%s[%d] = (__u8)(%s >> %d);\n", indent, base, byte, value, shift);
+  } else if (count == 2) {
+    fprintf(out, "%s*(__u16*)(%s + %d) = bpf_htons((__u16)(%s >> %d));\n", indent, base, byte, value, shift);
+  } else if (count == 4) {
+    fprintf(out, "%s*(__u32*)(%s + %d) = bpf_htonl((__u32)(%s >> %d));\n", indent, base, byte, value, shift);
+  } else if (count == 8) {
+    fprintf(out, "%s*(__u64*)(%s + %d) = ashp4c_htonll(%s);\n", indent, base, byte, value);
+  } else {
+    int head = count > 4 ? 4 : count > 2 ? 2 : 1;
+    store_bytes(indent, base, byte, head, value, shift + 8 * (count - head));
+    store_bytes(indent, base, byte + head, count - head, value, shift);
+  }
+}
+
+internal void
+store_bits(char* indent, char* base, int offset, int width, char* value)
+{
+  if (offset % 8 == 0 && width % 8 == 0) {
+    store_bytes(indent, base, offset / 8, width / 8, value, 0);
+    return;
+  }
+  int k;
+  for (k = offset / 8; k <= (offset + width - 1) / 8; k++) {
+    int lo = offset > 8 * k ? offset : 8 * k;
+    int hi = offset + width < 8 * k + 8 ? offset + width : 8 * k + 8;
+    int shift = 8 * k + 8 - hi;
+    int mask = (int)ebpf_width_mask(hi - lo) << shift;
+    fprintf(out, "%s%s[%d] = (%s[%d] & 0x%x) | ((__u8)(%s >> %d) << %d & 0x%x);\n", indent, base, k, base, k,
+            ~mask & 0xff, value, offset + width - hi, shift, mask);
+  }
+}
+
+/* Loads the fields of `header` at `b` that `is_loaded` says, or all of them. */
+internal void
+emit_field_loads(struct Type* header, bool* is_loaded, bool loaded, char* indent)
+{
+  int i;
+  for (i = 0; i < header->member_count; i++) {
+    struct TypeMember* member = &header->members[i];
+    if (is_loaded && is_loaded[i] != loaded) {
+      continue;
+    }
+    int offset = ebpf_field_offset(header, i);
+    int width = ebpf_scalar_width(member->type);
+    char* bits = load_bits("b", offset, width);
+    fprintf(out, "%sh->%s = %s;\n", indent, member->name,
+            ebpf_is_signed(member->type) || ebpf_resolve_type(member->type)->kind == Type_Bool
+              ? wrap(member->type, bits)
+              : format("(%s)%s", scalar_ctype(member->type), bits));
+  }
+}
+
+internal void
+emit_field_stores(struct Type* header, bool* is_stored, char* indent)
+{
+  int i;
+  for (i = 0; i < header->member_count; i++) {
+    struct TypeMember* member = &header->members[i];
+    if (!is_stored || is_stored[i]) {
+      store_bits(indent, "b", ebpf_field_offset(header, i), ebpf_scalar_width(member->type),
+                 format("(__u64)h->%s", member->name));
+    }
+  }
+}
+
+/*
+ * Copies `size` bytes from `s` to `d` in the widest pieces that fit; from the
+ * last piece down when `d` is after `s`, so that an overlap keeps its bytes.
+ */
+internal void
+emit_byte_copy(char* d, int size, bool is_backward)
+{
+  int i;
+  for (i = 0; i < size;) {
+    int piece = size - i >= 8 ? 8 : size - i >= 4 ? 4 : size - i >= 2 ? 2 : 1;
+    int at = is_backward ? size - i - piece : i;
+    fprintf(out, "        *(__u%d*)(%s + %d) = *(__u%d*)(s + %d);\n", 8 * piece, d, at, 8 * piece, at);
+    i += piece;
+  }
+}
+
+internal void
+emit_header_functions(struct Type* header)
+{
+  struct EbpfHeader* view = ebpf_view_of(program, header);
+  int size = ebpf_header_size(header);
+  fprintf(out, "static __always_inline void\n");
+  fprintf(out, "ashp4c_parse_%s(__u8* b, struct %s* h, __u32 offset)\n", header->name, header->name);
+  fprintf(out, "{\n");
+  emit_field_loads(header, view ? view->is_read : 0, true, "  ");
+  fprintf(out, "  h->ebpf_valid = 1;\n");
+  if (view) {
+    fprintf(out, "  h->ebpf_offset = offset + 1;\n");
+  }
+  fprintf(out, "}\n\n");
+
+  fprintf(out, "static __always_inline int\n");
+  fprintf(out, "ashp4c_extract_%s(struct ashp4c_packet* pkt, struct %s* h)\n", header->name, header->name);
+  fprintf(out, "{\n");
+  fprintf(out, "  __u8* b = ashp4c_cursor(pkt, %d);\n", size);
+  fprintf(out, "  if (!b) {\n");
+  fprintf(out, "    return 0;\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  ashp4c_parse_%s(b, h, pkt->offset);\n", header->name);
+  fprintf(out, "  pkt->offset += %d;\n", size);
+  fprintf(out, "  return 1;\n");
+  fprintf(out, "}\n\n");
+
+  fprintf(out, "static __always_inline void\n");
+  fprintf(out, "ashp4c_emit_%s(struct ashp4c_packet* pkt, struct %s* h)\n", header->name, header->name);
+  fprintf(out, "{\n");
+  fprintf(out, "  if (!h->ebpf_valid) {\n");
+  fprintf(out, "    return;\n");
+  fprintf(out, "  }\n");
+  if (program->deparser_emits) {
+    fprintf(out, "  if (pkt->shift) {\n");
+    fprintf(out, "    pkt->offset -= %d;\n", size);
+    if (!view) {
+      fprintf(out, "    return;\n");
+    }
+    fprintf(out, "  }\n");
+  }
+  if (view) {
+    /* How much further on it goes than it was, in the packet as it will be. */
+    fprintf(out, "  int moved = (int)pkt->offset + pkt->delta + 1 - (int)h->ebpf_offset;\n");
+  }
+  if (view && program->deparser_emits) {
+    fprintf(out, "  if (pkt->measure && h->ebpf_offset) {\n");
+    fprintf(out, "    pkt->reordered |= h->ebpf_offset <= pkt->last;\n");
+    fprintf(out, "    pkt->last = h->ebpf_offset;\n");
+    fprintf(out, "    pkt->ahead = moved > pkt->ahead ? moved : pkt->ahead;\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "  if (pkt->shift) {\n");
+    fprintf(out, "    if (h->ebpf_offset && moved > 0) {\n");
+    fprintf(out, "      __u8* s = ashp4c_cursor_at(pkt, h->ebpf_offset - 1, %d);\n", size);
+    fprintf(out, "      __u8* d = ashp4c_cursor_at(pkt, pkt->offset + pkt->delta, %d);\n", size);
+    fprintf(out, "      if (s && d) {\n");
+    emit_byte_copy("d", size, true);
+    fprintf(out, "      }\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return;\n");
+    fprintf(out, "  }\n");
+  }
+  if (view && view->is_partial) {
+    fprintf(out, "  if (pkt->fill && h->ebpf_offset && moved != 0) {\n");
+    fprintf(out, "    __u8* b = ashp4c_cursor_at(pkt, h->ebpf_offset - 1, %d);\n", size);
+    fprintf(out, "    if (b) {\n");
+    emit_field_loads(header, view->is_read, false, "      ");
+    fprintf(out, "    }\n");
+    fprintf(out, "  }\n");
+  }
+  fprintf(out, "  if (!pkt->measure && !pkt->fill) {\n");
+  fprintf(out, "    __u8* b = ashp4c_cursor(pkt, %d);\n", size);
+  fprintf(out, "    if (!b) {\n");
+  fprintf(out, "      return;\n");
+  fprintf(out, "    }\n");
+  if (view) {
+    /* Where it came from, the packet still holds the fields that were not written. */
+    fprintf(out, "    if (h->ebpf_offset && (moved == 0 || pkt->copy)) {\n");
+    fprintf(out, "      __u8* s = moved < 0 ? ashp4c_cursor_at(pkt, h->ebpf_offset - 1 - pkt->delta, %d) : 0;\n", size);
+    fprintf(out, "      if (s) {\n");
+    emit_byte_copy("b", size, false);
+    fprintf(out, "      }\n");
+    emit_field_stores(header, view->is_written, "      ");
+    fprintf(out, "    } else {\n");
+    emit_field_stores(header, 0, "      ");
+    fprintf(out, "    }\n");
+  } else {
+    emit_field_stores(header, 0, "    ");
+  }
+  fprintf(out, "  }\n");
+  fprintf(out, "  pkt->offset += %d;\n", size);
+  fprintf(out, "}\n\n");
+}
+
+/*
+ * Maps.
+ */
+
+internal char*
+key_field_name(struct EbpfTable* table, int i)
+{
+  int j;
+  for (j = 0; j < table->key_count; j++) {
+    if (j != i && cstr_match(table->keys[j].name, table->keys[i].name)) {
+      return format("%s_%d", table->keys[i].name, i);
+    }
+  }
+  return table->keys[i].name;
+}
+
+internal void
+emit_map_def(struct EbpfMap* map, char* key_type, char* value_type)
+{
+  fprintf(out, "struct bpf_map_def SEC(\"maps\") %s = {\n", map->name);
+  fprintf(out, "  .type = %s,\n", ebpf_map_type_to_string(map->type));
+  fprintf(out, "  .key_size = sizeof(%s),\n", key_type);
+  fprintf(out, "  .value_size = sizeof(%s),\n", value_type);
+  fprintf(out, "  .max_entries = %d,\n", map->max_entries);
+  if (map->flags) {
+    fprintf(out, "  .map_flags = %d,\n", map->flags);
+  }
+  fprintf(out, "};\n\n");
+}
+
+internal void
+emit_table_types(struct EbpfTable* table)
+{
+  int i, j;
+  if (table->key_count > 0) {
+    fprintf(out, "struct %s_key {\n", table->name);
+    if (table->kind == EbpfTable_Tuple) {
+      fprintf(out, "  __u32 tuple;  /* of the mask */\n");
+    }
+    if (table->is_lpm) {
+      fprintf(out, "  __u32 prefixlen;\n");
+      fprintf(out, "  __u8 data[%d];\n", table->key_size - 4);
+    } else {
+      for (i = 0; i < table->key_count; i++) {
+        fprintf(out, "  %s %s;\n", uint_type(table->keys[i].size), key_field_name(table, i));
+      }
+    }
+    fprintf(out, "};\n\n");
+  }
+  fprintf(out, "struct %s_value {\n", table->name);
+  fprintf(out, "  __u32 action;  /*");
+  for (i = 0; i < table->action_count; i++) {
+    fprintf(out, " %d: %s%s", i, table->actions[i].name, i + 1 < table->action_count ? "," : "");
+  }
+  fprintf(out, " */\n");
+  if (table->valid_offset) {
+    fprintf(out, "  __u32 valid;   /* set in the entries of the table */\n");
+  } else if (table->priority_offset) {
+    fprintf(out, "  __u32 priority;  /* of the entry, the highest that matches wins */\n");
+  }
+  bool has_data = false;
+  for (i = 0; i < table->action_count; i++) {
+    has_data |= (table->actions[i].param_count > 0);
+  }
+  if (has_data) {
+    fprintf(out, "  union {\n");
+    for (i = 0; i < table->action_count; i++) {
+      struct EbpfAction* action = &table->actions[i];
+      if (action->param_count == 0) {
+        continue;
+      }
+      fprintf(out, "    struct {\n");
+      for (j = 0; j < action->param_count; j++) {
+        fprintf(out, "      %s %s;\n", scalar_ctype(action->params[j].type), action->params[j].name);
+      }
+      fprintf(out, "    } %s;\n", action->name);
+    }
+    fprintf(out, "  } u;\n");
+  }
+  fprintf(out, "};\n\n");
+  if (table->kind == EbpfTable_Scan) {
+    fprintf(out, "struct %s_entry {\n", table->name);
+    fprintf(out, "  struct %s_value value;\n", table->name);
+    fprintf(out, "  struct %s_key key;\n", table->name);
+    fprintf(out, "  struct %s_key mask;\n", table->name);
+    fprintf(out, "};\n\n");
+    emit_map_def(&table->map, "__u32", format("struct %s_entry", table->name));
+  } else if (table->kind == EbpfTable_Tuple) {
+    fprintf(out, "struct %s_mask {\n", table->name);
+    fprintf(out, "  __u32 priority;  /* the highest of its entries, 0 past the last mask */\n");
+    fprintf(out, "  __u32 count;     /* of its entries */\n");
+    fprintf(out, "  struct %s_key mask;\n", table->name);
+    fprintf(out, "};\n\n");
+    emit_map_def(&table->map, format("struct %s_key", table->name), format("struct %s_value", table->name));
+    emit_map_def(&table->mask_map, "__u32", format("struct %s_mask", table->name));
+  } else if (table->map.type) {
+    emit_map_def(&table->map, format("struct %s_key", table->name), format("struct %s_value", table->name));
+  }
+  if (table->default_map.type) {
+    emit_map_def(&table->default_map, "__u32", format("struct %s_value", table->name));
+  }
+}
+
+/* Statements filling the map key `key` from the C expressions `values`. */
+internal void
+emit_key(struct EbpfTable* table, char* key, char** values, int prefix_length, char* indent)
+{
+  int i, j;
+  fprintf(out, "%s__builtin_memset(&%s, 0, sizeof(%s));\n", indent, key, key);
+  if (!table->is_lpm) {
+    for (i = 0; i < table->key_count; i++) {
+      fprintf(out, "%s%s.%s = (%s)%s;\n", indent, key, key_field_name(table, i), uint_type(table->keys[i].size),
+              values[i]);
+    }
+    return;
+  }
+  fprintf(out, "%s%s.prefixlen = %d;\n", indent, key, prefix_length);
+  for (i = 0; i < table->key_count; i++) {
+    struct EbpfField* field = &table->keys[i];
+    for (j = 0; j < field->size; j++) {
+      fprintf(out, "%s%s.data[%d] = (__u8)((__u64)%s >> %d);\n", indent, key, field->offset - 4 + j, values[i],
+              8 * (field->size - 1 - j));
+    }
+  }
+}
+
+/* Statements setting the map value `value` to `action` with the constant `args`. */
+internal void
+emit_value(struct EbpfTable* table, char* value, int action, struct BitInt** args, char* indent)
+{
+  int i;
+  fprintf(out, "%s__builtin_memset(&%s, 0, sizeof(%s));\n", indent, value, value);
+  if (table->valid_offset) {
+    fprintf(out, "%s%s.valid = 1;\n", indent, value);
+  }
+  if (action < 0) {
+    fprintf(out, "%s%s.action = %s;\n", indent, value, XDP_NO_ACTION);
+    return;
+  }
+  fprintf(out, "%s%s.action = %d;\n", indent, value, action);
+  struct EbpfAction* a = &table->actions[action];
+  for (i = 0; args && i < a->param_count; i++) {
+    fprintf(out, "%s%s.u.%s.%s = %s;\n", indent, value, a->name, a->params[i].name,
+            literal(args[i], a->params[i].type));
+  }
+}
+
+/* The mask of key `k` of `entry`, all ones where the key is matched exactly. */
+internal char*
+mask_literal(struct EbpfTable* table, struct EbpfTableEntry* entry, int k)
+{
+  struct EbpfField* field = &table->keys[k];
+  return entry->masks[k] ? literal(entry->masks[k], field->type)
+                         : format("(%s)0x%llxULL", scalar_ctype(field->type), ebpf_width_mask(field->width));
+}
+
+/*
+ * The masks of a tuple space table, each with the priority of its first entry,
+ * then the entries from the last: where two have a key and mask, the first
+ * one is written last and wins.
+ */
+internal void
+emit_tuple_entries(struct EbpfTable* table)
+{
+  char** values = arena_push(emit_storage, (table->key_count + 1) * sizeof(char*));
+  int m, e, k;
+  for (m = 0; m < table->mask_count; m++) {
+    int first = -1, count = 0;
+    for (e = 0; e < table->entry_count; e++) {
+      if (table->entry_masks[e] == m) {
+        first = first < 0 ? e : first;
+        count += 1;
+      }
+    }
+    for (k = 0; k < table->key_count; k++) {
+      values[k] = mask_literal(table, &table->entries[first], k);
+    }
+    fprintf(out, "  {\n");
+    fprintf(out, "    __u32 index = %d;\n", m);
+    fprintf(out, "    struct %s_mask mask;\n", table->name);
+    emit_key(table, "mask.mask", values, 0, "    ");
+    fprintf(out, "    mask.mask.tuple = %d;\n", m);
+    fprintf(out, "    mask.priority = %d;\n", table->entry_count - first);
+    fprintf(out, "    mask.count = %d;\n", count);
+    fprintf(out, "    bpf_map_update_elem(&%s, &index, &mask, BPF_ANY);\n", table->mask_map.name);
+    fprintf(out, "  }\n");
+  }
+  /* One key and value for all the entries: compilers slow down on thousands of address-taken locals. */
+  fprintf(out, "  {\n");
+  fprintf(out, "    struct %s_key key;\n", table->name);
+  fprintf(out, "    struct %s_value value;\n", table->name);
+  for (e = table->entry_count - 1; e >= 0; e--) {
+    struct EbpfTableEntry* entry = &table->entries[e];
+    for (k = 0; k < table->key_count; k++) {
+      values[k] = entry->masks[k] ? literal(bitint_and(entry->keys[k], entry->masks[k]), table->keys[k].type)
+                                  : literal(entry->keys[k], table->keys[k].type);
+    }
+    emit_key(table, "key", values, 0, "    ");
+    fprintf(out, "    key.tuple = %d;\n", table->entry_masks[e]);
+    emit_value(table, "value", entry->action, entry->args, "    ");
+    fprintf(out, "    value.priority = %d;\n", table->entry_count - e);
+    fprintf(out, "    bpf_map_update_elem(&%s, &key, &value, BPF_ANY);\n", table->name);
+  }
+  fprintf(out, "  }\n");
+}
+
+/*
+ * Const entries, and the initial default actions that the control plane may
+ * change later, are written by the program itself on its first run.
+ */
+internal void
+emit_init_function()
+{
+  int i, e, k;
+  fprintf(out, "struct bpf_map_def SEC(\"maps\") ashp4c_init = {\n");
+  fprintf(out, "  .type = BPF_MAP_TYPE_ARRAY,\n");
+  fprintf(out, "  .key_size = sizeof(__u32),\n");
+  fprintf(out, "  .value_size = sizeof(__u32),\n");
+  fprintf(out, "  .max_entries = 1,\n");
+  fprintf(out, "};\n\n");
+  fprintf(out, "static __always_inline void\n");
+  fprintf(out, "ashp4c_init_tables()\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  __u32 zero = 0;\n");
+  for (i = 0; i < program->tables.elem_count; i++) {
+    struct EbpfTable* table = (struct EbpfTable*)array_get(&program->tables, i);
+    if (table->default_map.type) {
+      fprintf(out, "  {\n");
+      fprintf(out, "    struct %s_value value;\n", table->name);
+      emit_value(table, "value", table->default_action, table->default_args, "    ");
+      fprintf(out, "    bpf_map_update_elem(&%s, &zero, &value, BPF_ANY);\n", table->default_map.name);
+      fprintf(out, "  }\n");
+    }
+    if (table->kind == EbpfTable_Tuple) {
+      emit_tuple_entries(table);
+      continue;
+    }
+    for (e = 0; e < table->entry_count && table->kind != EbpfTable_Inline; e++) {
+      struct EbpfTableEntry* entry = &table->entries[e];
+      char** values = arena_push(emit_storage, (table->key_count + 1) * sizeof(char*));
+      int prefix_length = 0;
+      for (k = 0; k < table->key_count; k++) {
+        struct EbpfField* field = &table->keys[k];
+        values[k] = literal(entry->keys[k], field->type);
+        int bits = field->width;
+        if (entry->masks[k]) {
+          uint64_t mask = entry->masks[k]->word_count > 0 ? entry->masks[k]->words[0] : 0;
+          bits = 0;
+          while (bits < field->width && (mask >> (field->width - 1 - bits)) & 1) {
+            bits += 1;
+          }
+        }
+        prefix_length += bits;
+      }
+      fprintf(out, "  {\n");
+      if (table->kind == EbpfTable_Scan) {
+        char** masks = arena_push(emit_storage, (table->key_count + 1) * sizeof(char*));
+        for (k = 0; k < table->key_count; k++) {
+          masks[k] = mask_literal(table, entry, k);
+        }
+        fprintf(out, "    __u32 index = %d;\n", e);
+        fprintf(out, "    struct %s_entry entry;\n", table->name);
+        emit_value(table, "entry.value", entry->action, entry->args, "    ");
+        emit_key(table, "entry.key", values, prefix_length, "    ");
+        emit_key(table, "entry.mask", masks, prefix_length, "    ");
+        fprintf(out, "    bpf_map_update_elem(&%s, &index, &entry, BPF_ANY);\n", table->name);
+        fprintf(out, "  }\n");
+        continue;
+      }
+      fprintf(out, "    struct %s_key key;\n", table->name);
+      fprintf(out, "    struct %s_value value;\n", table->name);
+      emit_key(table, "key", values, prefix_length, "    ");
+      emit_value(table, "value", entry->action, entry->args, "    ");
+      fprintf(out, "    bpf_map_update_elem(&%s, &key, &value, BPF_ANY);\n", table->name);
+      fprintf(out, "  }\n");
+    }
+  }
+  for (i = 0; i < program->selects.elem_count; i++) {
+    struct EbpfSelect* select = (struct EbpfSelect*)array_get(&program->selects, i);
+    if (select->kind != EbpfSelect_Map) {
+      continue;
+    }
+    for (e = 0; e < select->value_count; e++) {
+      fprintf(out, "  {\n");
+      fprintf(out, "    __u32 index = %llu;\n", (unsigned long long)(select->values[e] - select->base));
+      fprintf(out, "    __u32 value = %d;\n", select->cases[e] + 1);
+      fprintf(out, "    bpf_map_update_elem(&%s, &index, &value, BPF_ANY);\n", select->map.name);
+      fprintf(out, "  }\n");
+    }
+  }
+  fprintf(out, "}\n\n");
+}
+
+/*
+ * Functions.
+ */
+
+internal char*
+function_cname(struct IrFunction* f)
+{
+  return f->parent ? format("%s_%s", f->parent->name, f->name) : f->name;
+}
+
+internal bool
+has_local(struct IrFunction* f, struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < f->locals.elem_count; i++) {
+    if (*(struct Ast**)array_get(&f->locals, i) == decl) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Marks `f` and everything it calls. */
+internal void
+reach_function(struct IrFunction* f)
+{
+  if (!f || function_reached[f->decl->id]) {
+    return;
+  }
+  function_reached[f->decl->id] = true;
+  int i;
+  for (i = 1; i < f->insns.elem_count; i++) {
+    struct IrInsn* insn = ir_insn(f, i);
+    if (insn->op == Ir_Call) {
+      struct IrInsn* receiver = insn->receiver ? ir_insn(f, insn->receiver) : 0;
+      struct Type* type = receiver ? ebpf_resolve_type(receiver->type) : 0;
+      if (!receiver || receiver->op == Ir_TableApply) {
+        struct Ast* decl = insn->decl;
+        struct IrFunction* callee = ir_function_of(program->ir, decl);
+        if (!callee && decl && decl->kind == Ast_FunctionDecl) {
+          callee = ir_function_of(program->ir, (struct Ast*)ast_getattr(decl, "proto"));
+        }
+        reach_function(callee);
+      } else if (type && (type->kind == Type_Parser || type->kind == Type_Control)) {
+        reach_function(ir_function_of(program->ir, type->decl));
+      }
+    } else if (insn->op == Ir_TableApply) {
+      struct EbpfTable* table = ebpf_table_of(program, insn->decl);
+      int j;
+      for (j = 0; table && j < table->action_count; j++) {
+        reach_function(table->actions[j].function);
+      }
+    }
+  }
+}
+
+internal bool
+is_reached(struct IrFunction* f)
+{
+  return function_reached[f->decl->id];
+}
+
+internal void
+emit_context(struct IrFunction* f)
+{
+  int i;
+  fprintf(out, "struct %s_ctx {\n", f->name);
+  int field_count = 0;
+  struct AstListLink* link = f->params ? ast_list_first_link(f->params) : 0;
+  while (link) {
+    struct Type* type = type_of_node(link->ast);
+    if (!ebpf_is_extern_object(type)) {
+      fprintf(out, "  %s%s p_%s;\n", ctype(type, link->ast->line_nr), ebpf_param_by_value(link->ast) ? "" : "*",
+              ebpf_decl_name(link->ast));
+      field_count += 1;
+    }
+    link = link->next;
+  }
+  for (i = 0; i < f->locals.elem_count; i++) {
+    struct Ast* local_decl = *(struct Ast**)array_get(&f->locals, i);
+    struct Type* type = type_of_node(local_decl);
+    if (local_decl->kind != Ast_Instantiation && !ebpf_is_extern_object(type)) {
+      fprintf(out, "  %s l_%s;\n", ctype(type, local_decl->line_nr), ebpf_decl_name(local_decl));
+      field_count += 1;
+    }
+  }
+  if (field_count == 0) {
+    fprintf(out, "  __u8 ebpf_unused;\n");
+  }
+  fprintf(out, "};\n\n");
+}
+
+internal void
+emit_signature(struct IrFunction* f)
+{
+  fprintf(out, "static __always_inline %s\n", f->kind == IrFunction_Function ? "__u64" : "int");
+  fprintf(out, "%s(struct ashp4c_packet* pkt", function_cname(f));
+  if (ebpf_is_block(f)) {
+    fprintf(out, ", struct %s_ctx* ctx)", f->name);
+    return;
+  } else if (f->kind == IrFunction_Action) {
+    if (f->parent) {
+      fprintf(out, ", struct %s_ctx* ctx", f->parent->name);
+    } else {
+      fprintf(out, ", void* ctx");
+    }
+  }
+  struct AstListLink* link = f->params ? ast_list_first_link(f->params) : 0;
+  while (link) {
+    struct Type* type = type_of_node(link->ast);
+    if (!ebpf_is_extern_object(type)) {
+      fprintf(out, ", %s%s p_%s", ctype(type, link->ast->line_nr), ebpf_param_by_value(link->ast) ? "" : "*",
+              ebpf_decl_name(link->ast));
+    }
+    link = link->next;
+  }
+  fprintf(out, ")");
+}
+
+/* Constants are written where they are used. */
+internal char*
+value(int id)
+{
+  struct IrInsn* insn = ir_insn(function, id);
+  if (refs[id]) {
+    return refs[id];
+  } else if (insn->op == Ir_Const) {
+    return literal(insn->value, insn->type);
+  } else if (insn->op == Ir_EnumConst) {
+    return format("%d", insn->index);
+  }
+  return format("v%d", id);
+}
+
+/* Pointer to the memory of `decl`, seen from the function being emitted. */
+internal char*
+var_ref(struct IrInsn* insn)
+{
+  struct Ast* decl = insn->decl;
+  char* name = ebpf_decl_name(decl);
+  if (ebpf_is_extern_object(insn->type)) {
+    return "0";
+  }
+  struct IrFunction* f = function;
+  if (!ebpf_is_block(f)) {
+    int index = ebpf_list_index(f->params, decl);
+    if (index >= 0) {
+      return format("p_%s", name);
+    } else if (has_local(f, decl)) {
+      return format("&l_%s", name);
+    }
+    f = f->parent;
+  }
+  if (f) {
+    int index = ebpf_list_index(f->params, decl);
+    if (index >= 0) {
+      return ebpf_param_by_value(decl) ? format("&ctx->p_%s", name) : format("ctx->p_%s", name);
+    } else if (has_local(f, decl)) {
+      return format("&ctx->l_%s", name);
+    }
+  }
+  error("at line %d: `%s` is not visible in `%s` for the XDP target.", insn->line_nr, name, function->name);
+  return 0;
+}
+
+internal char*
+index_expr(int index_id, int size)
+{
+  struct IrInsn* index = ir_insn(function, index_id);
+  if (index->op == Ir_Const) {
+    int64_t i = 0;
+    if (!bitint_to_int64(index->value, &i) || i < 0 || i >= size) {
+      error("at line %d: stack index out of bounds.", index->line_nr);
+    }
+    return format("%d", (int)i);
+  }
+  return format("(%s < %d ? %s : %d)", value(index_id), size, value(index_id), size - 1);
+}
+
+/* Whether the elements of `stack` are reached by compares of the index, as the BPF target reaches them. */
+internal bool
+is_unrolled(struct Type* stack)
+{
+  struct EbpfStack* entry = ebpf_stack_of(program, stack);
+  return entry && entry->kind == EbpfStack_Unrolled;
+}
+
+/* The address of the element of `s` whose position plus `bias` is `index`, or else of element `fallback`. */
+internal char*
+unrolled_elem_ref(char* s, int size, char* index, int bias, int fallback)
+{
+  char* ref = format("&(%s)->elem[%d]", s, fallback);
+  int i;
+  for (i = size - 1; i >= 0; i--) {
+    if (i != fallback || i != size - 1) {
+      ref = format("(%s == %d ? &(%s)->elem[%d] : %s)", index, i + bias, s, i, ref);
+    }
+  }
+  return ref;
+}
+
+internal char*
+field_ref(struct IrInsn* insn)
+{
+  struct IrInsn* base = ir_insn(function, insn->args[0]);
+  char* base_ref = value(base->id);
+  struct Type* base_type = ebpf_resolve_type(base->type);
+  if (base_type && base_type->kind == Type_HeaderStack) {
+    int size = base_type->width;
+    char* next = format("(%s)->next", base_ref);
+    switch (ebpf_stack_field(insn->name)) {
+      case EbpfStackField_Next:
+        if (is_unrolled(base_type)) {
+          return unrolled_elem_ref(base_ref, size, next, 0, size - 1);
+        }
+        return format("&(%s)->elem[(%s)->next < %d ? (%s)->next : %d]", base_ref, base_ref, size, base_ref, size - 1);
+      case EbpfStackField_Last:
+        if (is_unrolled(base_type)) {
+          return unrolled_elem_ref(base_ref, size, next, 1, 0);
+        }
+        return format("&(%s)->elem[(%s)->next > 0 && (%s)->next <= %d ? (%s)->next - 1 : 0]", base_ref, base_ref,
+                      base_ref, size, base_ref);
+      case EbpfStackField_LastIndex:
+        return format("&(__u32){(%s)->next - 1}", base_ref);
+      case EbpfStackField_NextIndex:
+        return format("&(%s)->next", base_ref);
+      case EbpfStackField_Size:
+        return format("&(__u32){%d}", size);
+      case EbpfStackField_NONE_:
+        break;
+    }
+    error("at line %d: stack field `%s` is not supported by the XDP target.", insn->line_nr, insn->name);
+  }
+  return format("&(%s)->%s", base_ref, insn->name);
+}
+
+/* Assignments to the phis of `succ` for the edge from `block`, then the jump. */
+internal void
+emit_edge(struct IrBlock* block, int succ_id, char* indent)
+{
+  struct IrBlock* succ = ir_block(function, succ_id);
+  int pred = 0;
+  while (pred < succ->pred_count && succ->preds[pred] != block->id) {
+    pred += 1;
+  }
+  assert(pred < succ->pred_count);
+  int phi_count = 0;
+  int id = succ->first_insn;
+  while (id && ir_insn(function, id)->op == Ir_Phi) {
+    phi_count += 1;
+    id = ir_insn(function, id)->next_in_block;
+  }
+  /* Parallel copy: all phis read their operands before any is written. */
+  id = succ->first_insn;
+  while (id && ir_insn(function, id)->op == Ir_Phi) {
+    struct IrInsn* phi = ir_insn(function, id);
+    if (phi_count > 1) {
+      fprintf(out, "%s%s p%d = %s;\n", indent, scalar_ctype(phi->type), phi->id, value(phi->args[pred]));
+    } else {
+      fprintf(out, "%sv%d = %s;\n", indent, phi->id, value(phi->args[pred]));
+    }
+    id = phi->next_in_block;
+  }
+  id = succ->first_insn;
+  while (phi_count > 1 && id && ir_insn(function, id)->op == Ir_Phi) {
+    fprintf(out, "%sv%d = p%d;\n", indent, id, id);
+    id = ir_insn(function, id)->next_in_block;
+  }
+  fprintf(out, "%sgoto b%d;\n", indent, succ_id);
+}
+
+internal char*
+keyset_condition(struct IrBlock* block, struct IrSelectCase* select_case)
+{
+  char* cond = 0;
+  int k;
+  for (k = 0; k < block->key_count; k++) {
+    struct IrKeysetElem* elem = &select_case->elems[k];
+    if (!elem->value) {
+      continue;
+    }
+    struct Type* type = ir_insn(function, block->keys[k])->type;
+    char* key = value(block->keys[k]);
+    char* term = elem->mask ?
+      format("(%s & %s) == %s", key, literal(elem->mask, type), literal(bitint_and(elem->value, elem->mask), type))
+      : format("%s == %s", key, literal(elem->value, type));
+    cond = cond ? format("%s && %s", cond, term) : term;
+  }
+  return cond ? cond : "1";
+}
+
+/* Binary search over values[low..high); falls through when no value matches. */
+internal void
+emit_select_tree(struct IrBlock* block, struct EbpfSelect* select, int low, int high, char* indent)
+{
+  char* key = value(block->keys[0]);
+  int i;
+  if (high - low <= 3) {
+    for (i = low; i < high; i++) {
+      fprintf(out, "%sif ((__u64)%s == 0x%llxULL) {\n", indent, key, (unsigned long long)select->values[i]);
+      emit_edge(block, block->succs[select->cases[i]], format("%s  ", indent));
+      fprintf(out, "%s}\n", indent);
+    }
+    return;
+  }
+  int middle = low + (high - low) / 2;
+  fprintf(out, "%sif ((__u64)%s < 0x%llxULL) {\n", indent, key, (unsigned long long)select->values[middle]);
+  emit_select_tree(block, select, low, middle, format("%s  ", indent));
+  fprintf(out, "%s} else {\n", indent);
+  emit_select_tree(block, select, middle, high, format("%s  ", indent));
+  fprintf(out, "%s}\n", indent);
+}
+
+/* The map holds the case + 1 for each value - base; 0 where no case matches. */
+internal void
+emit_select_map(struct IrBlock* block, struct EbpfSelect* select)
+{
+  char* index = format("(__u64)%s - 0x%llxULL", value(block->keys[0]), (unsigned long long)select->base);
+  int i, j;
+  if (!select->base) {
+    index = format("(__u64)%s", value(block->keys[0]));
+  }
+  fprintf(out, "  if (%s < %d) {\n", index, select->map.max_entries);
+  fprintf(out, "    __u32 index = (__u32)(%s);\n", index);
+  fprintf(out, "    __u32* c = bpf_map_lookup_elem(&%s, &index);\n", select->map.name);
+  fprintf(out, "    if (c) {\n");
+  fprintf(out, "      switch (*c) {\n");
+  for (i = 0; i < select->value_count; i++) {
+    for (j = 0; j < i && select->cases[j] != select->cases[i]; j++);
+    if (j < i) {
+      continue;
+    }
+    fprintf(out, "        case %d:\n", select->cases[i] + 1);
+    emit_edge(block, block->succs[select->cases[i]], "          ");
+  }
+  fprintf(out, "      }\n");
+  fprintf(out, "    }\n");
+  fprintf(out, "  }\n");
+}
+
+internal void
+emit_terminator(struct IrBlock* block)
+{
+  struct EbpfSelect* select;
+  int i;
+  switch (block->term) {
+    case IrTerm_Jump:
+      emit_edge(block, block->succs[0], "  ");
+      break;
+    case IrTerm_Branch:
+      fprintf(out, "  if (%s) {\n", value(block->value));
+      emit_edge(block, block->succs[0], "    ");
+      fprintf(out, "  }\n");
+      emit_edge(block, block->succs[1], "  ");
+      break;
+    case IrTerm_Switch:
+      fprintf(out, "  switch (%s) {\n", value(block->value));
+      for (i = 0; i < block->case_count; i++) {
+        fprintf(out, "    case %s:\n", literal(block->case_values[i], ir_insn(function, block->value)->type));
+        emit_edge(block, block->succs[i], "      ");
+      }
+      fprintf(out, "  }\n");
+      emit_edge(block, block->succs[block->case_count], "  ");
+      break;
+    case IrTerm_Select:
+      select = ebpf_select_of(program, function, block->id);
+      if (select && select->kind == EbpfSelect_Tree) {
+        emit_select_tree(block, select, 0, select->value_count, "  ");
+        emit_edge(block, block->succs[select->default_case], "  ");
+        break;
+      } else if (select && select->kind == EbpfSelect_Map) {
+        emit_select_map(block, select);
+        emit_edge(block, block->succs[select->default_case], "  ");
+        break;
+      }
+      for (i = 0; i < block->case_count; i++) {
+        char* cond = keyset_condition(block, &block->select_cases[i]);
+        if (cstr_match(cond, "1")) {
+          break;
+        }
+        fprintf(out, "  if (%s) {\n", cond);
+        emit_edge(block, block->succs[i], "    ");
+        fprintf(out, "  }\n");
+      }
+      emit_edge(block, block->succs[i], "  ");
+      break;
+    case IrTerm_Return:
+      if (function->kind == IrFunction_Function && block->value) {
+        fprintf(out, "  return (__u64)%s;\n", value(block->value));
+      } else {
+        fprintf(out, "  return 0;\n");
+      }
+      break;
+    case IrTerm_Exit:
+    case IrTerm_Accept:
+      fprintf(out, "  return 1;\n");
+      break;
+    case IrTerm_Reject:
+      fprintf(out, "  return 0;\n");
+      break;
+    default:
+      assert(0);
+  }
+}
+
+internal char*
+binary_operator(enum IrOpcode op)
+{
+  switch (op) {
+    case Ir_Add: return "+";
+    case Ir_Sub: return "-";
+    case Ir_Mul: return "*";
+    case Ir_Div: return "/";
+    case Ir_BitAnd: return "&";
+    case Ir_BitOr: return "|";
+    case Ir_BitXor: return "^";
+    case Ir_Equal: return "==";
+    case Ir_NotEqual: return "!=";
+    case Ir_Less: return "<";
+    case Ir_Greater: return ">";
+    case Ir_LessEqual: return "<=";
+    case Ir_GreaterEqual: return ">=";
+    case Ir_And: return "&&";
+    case Ir_Or: return "||";
+    default: break;
+  }
+  assert(0);
+  return 0;
+}
+
+internal char*
+shift_expr(struct IrInsn* insn)
+{
+  struct Type* type = insn->type;
+  int width = ebpf_scalar_bits(type);
+  char* a = value(insn->args[0]);
+  struct IrInsn* count = ir_insn(function, insn->args[1]);
+  char* c = value(count->id);
+  char* shifted;
+  if (insn->op == Ir_Shl) {
+    shifted = wrap(type, format("(__u64)%s << %s", a, c));
+  } else if (ebpf_is_signed(type)) {
+    shifted = format("(%s)((__s64)%s >> %s)", scalar_ctype(type), a, c);
+  } else {
+    shifted = format("(%s)((__u64)%s >> %s)", scalar_ctype(type), a, c);
+  }
+  if (count->op == Ir_Const) {
+    int64_t n = 0;
+    if (bitint_to_int64(count->value, &n) && n < width) {
+      return shifted;
+    }
+  }
+  char* overflow = (insn->op == Ir_Shr && ebpf_is_signed(type)) ? format("(%s)((__s64)%s >> 63)", scalar_ctype(type), a)
+                                                            : "0";
+  return format("(%s >= %d ? %s : %s)", c, width, overflow, shifted);
+}
+
+internal char*
+cast_expr(struct IrInsn* insn)
+{
+  struct IrInsn* operand = ir_insn(function, insn->args[0]);
+  struct Type* to = ebpf_resolve_type(insn->type);
+  char* a = value(operand->id);
+  if (to->kind == Type_Bool) {
+    return format("(__u8)(%s != 0)", a);
+  }
+  return wrap(to, format("(__u64)%s", a));
+}
+
+/* Scalar value of a pure instruction. */
+internal char*
+value_expr(struct IrInsn* insn)
+{
+  char* a = insn->arg_count > 0 ? value(insn->args[0]) : 0;
+  char* b = insn->arg_count > 1 ? value(insn->args[1]) : 0;
+  struct IrInsn* operand = insn->arg_count > 0 ? ir_insn(function, insn->args[0]) : 0;
+  switch (insn->op) {
+    case Ir_Const:
+      return literal(insn->value, insn->type);
+    case Ir_EnumConst:
+      return format("%d", insn->index);
+    case Ir_Undef:
+      return "0";
+    case Ir_Param:
+      return ebpf_is_block(function) ? format("ctx->p_%s", insn->name) : format("p_%s", insn->name);
+    case Ir_Load:
+      return format("*(%s)", a);
+    case Ir_Add:
+    case Ir_Sub:
+    case Ir_Mul:
+      return wrap(insn->type, format("(__u64)%s %s (__u64)%s", a, binary_operator(insn->op), b));
+    case Ir_Div:
+      return format("(%s)(%s / %s)", scalar_ctype(insn->type), a, b);
+    case Ir_BitAnd:
+    case Ir_BitOr:
+    case Ir_BitXor:
+      return format("(%s)(%s %s %s)", scalar_ctype(insn->type), a, binary_operator(insn->op), b);
+    case Ir_Equal:
+    case Ir_NotEqual:
+    case Ir_Less:
+    case Ir_Greater:
+    case Ir_LessEqual:
+    case Ir_GreaterEqual:
+      if (ebpf_is_aggregate(operand->type)) {
+        error("at line %d: the XDP target cannot compare values of type `%s`.", insn->line_nr,
+              type_to_string(operand->type));
+      }
+      return format("(__u8)(%s %s %s)", a, binary_operator(insn->op), b);
+    case Ir_And:
+    case Ir_Or:
+      return format("(__u8)(%s %s %s)", a, binary_operator(insn->op), b);
+    case Ir_Shl:
+    case Ir_Shr:
+      return shift_expr(insn);
+    case Ir_LogNot:
+      return format("(__u8)!%s", a);
+    case Ir_BitNot:
+      return wrap(insn->type, format("~(__u64)%s", a));
+    case Ir_Neg:
+      return wrap(insn->type, format("-(__u64)%s", a));
+    case Ir_Cast:
+      return cast_expr(insn);
+    case Ir_Slice:
+      return format("(%s)(((__u64)%s >> %d) & 0x%llxULL)", scalar_ctype(insn->type), a, insn->low,
+                    ebpf_width_mask(insn->index - insn->low + 1));
+    case Ir_SliceSet: {
+      uint64_t mask = ebpf_width_mask(insn->index - insn->low + 1) << insn->low;
+      return format("(%s)(((__u64)%s & 0x%llxULL) | (((__u64)%s << %d) & 0x%llxULL))", scalar_ctype(insn->type),
+                    a, ~mask & ebpf_width_mask(ebpf_scalar_bits(insn->type)), b, insn->low, mask);
+    }
+    case Ir_IsValid: {
+      struct Type* type = ebpf_resolve_type(operand->type);
+      if (type->kind == Type_HeaderUnion) {
+        char* cond = "0";
+        int i;
+        for (i = 0; i < type->member_count; i++) {
+          cond = format("%s || (%s)->%s.ebpf_valid", cond, a, type->members[i].name);
+        }
+        return format("(__u8)(%s)", cond);
+      }
+      return format("(%s)->ebpf_valid", a);
+    }
+    case Ir_TableHit:
+      return format("h%d", insn->args[0]);
+    case Ir_ActionRun:
+      return format("v%d->action", insn->args[0]);
+    default: break;
+  }
+  error("at line %d: `%s` is not supported by the XDP target.", insn->line_nr, ir_opcode_to_string(insn->op));
+  return 0;
+}
+
+internal void
+emit_store(struct IrInsn* insn)
+{
+  struct IrInsn* dst = ir_insn(function, insn->args[0]);
+  struct IrInsn* src = ir_insn(function, insn->args[1]);
+  char* dst_ref = value(dst->id);
+  struct Type* type = ebpf_resolve_type(dst->type);
+  if (src->op == Ir_Tuple && ebpf_is_aggregate(type)) {
+    int i;
+    if (type->kind != Type_Struct && type->kind != Type_Header) {
+      error("at line %d: the XDP target cannot initialize `%s` from a list.", insn->line_nr, type_to_string(type));
+    }
+    for (i = 0; i < src->arg_count && i < type->member_count; i++) {
+      fprintf(out, "  (%s)->%s = %s;\n", dst_ref, type->members[i].name, value(src->args[i]));
+    }
+    if (type->kind == Type_Header) {
+      fprintf(out, "  (%s)->ebpf_valid = 1;\n", dst_ref);
+    }
+  } else if (ebpf_is_aggregate(type)) {
+    fprintf(out, "  *(%s) = *(%s);\n", dst_ref, value(src->id));
+  } else {
+    fprintf(out, "  *(%s) = %s;\n", dst_ref, value(src->id));
+  }
+}
+
+/* Const entries as compares: the value of the one that matches goes to d<id>. */
+internal void
+emit_inline_entries(struct EbpfTable* table, struct IrInsn* insn)
+{
+  int id = insn->id;
+  int i, k;
+  fprintf(out, "  v%d = 0;\n", id);
+  if (table->search_count > 0) {
+    struct EbpfField* field = &table->keys[0];
+    fprintf(out, "  switch ((__u64)%s) {\n", value(insn->args[0]));
+    for (i = 0; i < table->search_count; i++) {
+      struct EbpfTableEntry* entry = &table->entries[table->entry_order[i]];
+      fprintf(out, "    case %s:\n", literal(entry->keys[0], field->type));
+      emit_value(table, format("d%d", id), entry->action, entry->args, "      ");
+      fprintf(out, "      v%d = &d%d;\n", id, id);
+      fprintf(out, "      break;\n");
+    }
+    fprintf(out, "  }\n");
+    return;
+  }
+  for (i = 0; i < table->entry_count; i++) {
+    struct EbpfTableEntry* entry = &table->entries[table->entry_order[i]];
+    char* cond = 0;
+    for (k = 0; k < table->key_count; k++) {
+      struct Type* type = table->keys[k].type;
+      char* key = value(insn->args[k]);
+      char* term = entry->masks[k] ?
+        format("(%s & %s) == %s", key, literal(entry->masks[k], type),
+               literal(bitint_and(entry->keys[k], entry->masks[k]), type))
+        : format("%s == %s", key, literal(entry->keys[k], type));
+      if (entry->masks[k] && bitint_is_zero(entry->masks[k])) {
+        continue;
+      }
+      cond = cond ? format("%s && %s", cond, term) : term;
+    }
+    fprintf(out, "  %sif (%s) {\n", i > 0 ? "} else " : "", cond ? cond : "1");
+    emit_value(table, format("d%d", id), entry->action, entry->args, "    ");
+    fprintf(out, "    v%d = &d%d;\n", id, id);
+  }
+  fprintf(out, "  }\n");
+}
+
+internal void
+emit_table_apply(struct IrInsn* insn)
+{
+  struct EbpfTable* table = ebpf_table_of(program, insn->decl);
+  int id = insn->id;
+  int i;
+  if (table->map.type) {
+    char** values = arena_push(emit_storage, (table->key_count + 1) * sizeof(char*));
+    for (i = 0; i < table->key_count; i++) {
+      values[i] = value(insn->args[i]);
+    }
+    fprintf(out, "  {\n");
+    fprintf(out, "    struct %s_key key;\n", table->name);
+    emit_key(table, "key", values, ebpf_full_prefix_length(table), "    ");
+    if (table->kind == EbpfTable_Scan) {
+      fprintf(out, "    __u32 i;\n");
+      fprintf(out, "    v%d = 0;\n", id);
+      fprintf(out, "    for (i = 0; i < %d; i++) {\n", table->map.max_entries);
+      fprintf(out, "      struct %s_entry* e = bpf_map_lookup_elem(&%s, &i);\n", table->name, table->name);
+      fprintf(out, "      if (e && e->value.valid");
+      for (i = 0; i < table->key_count; i++) {
+        char* name = key_field_name(table, i);
+        fprintf(out, "\n          && ((key.%s ^ e->key.%s) & e->mask.%s) == 0", name, name, name);
+      }
+      fprintf(out, ") {\n");
+      fprintf(out, "        v%d = &e->value;\n", id);
+      fprintf(out, "        break;\n");
+      fprintf(out, "      }\n");
+      fprintf(out, "    }\n");
+    } else if (table->kind == EbpfTable_Tuple) {
+      /*
+       * The masks come by descending priority: the search stops at one whose
+       * entries cannot beat the match.  They are in the half of the mask map
+       * that the element past both halves names.
+       */
+      fprintf(out, "    __u32 i, best = 0, half = %d;\n", 2 * EBPF_TUPLE_MAX_MASKS);
+      fprintf(out, "    struct %s_mask* g = bpf_map_lookup_elem(&%s, &half);\n", table->name, table->mask_map.name);
+      fprintf(out, "    half = g && g->priority ? %d : 0;\n", EBPF_TUPLE_MAX_MASKS);
+      fprintf(out, "    v%d = 0;\n", id);
+      fprintf(out, "    for (i = 0; i < %d; i++) {\n", EBPF_TUPLE_MAX_MASKS);
+      fprintf(out, "      __u32 index = half + i;\n");
+      fprintf(out, "      struct %s_mask* m = bpf_map_lookup_elem(&%s, &index);\n", table->name,
+              table->mask_map.name);
+      fprintf(out, "      if (!m || m->priority <= best) {\n");
+      fprintf(out, "        break;\n");
+      fprintf(out, "      }\n");
+      fprintf(out, "      struct %s_key masked;\n", table->name);
+      fprintf(out, "      __builtin_memset(&masked, 0, sizeof(masked));\n");
+      fprintf(out, "      masked.tuple = m->mask.tuple;\n");
+      for (i = 0; i < table->key_count; i++) {
+        char* name = key_field_name(table, i);
+        fprintf(out, "      masked.%s = key.%s & m->mask.%s;\n", name, name, name);
+      }
+      fprintf(out, "      struct %s_value* e = bpf_map_lookup_elem(&%s, &masked);\n", table->name, table->name);
+      fprintf(out, "      if (e && e->priority > best) {\n");
+      fprintf(out, "        v%d = e;\n", id);
+      fprintf(out, "        best = e->priority;\n");
+      fprintf(out, "      }\n");
+      fprintf(out, "    }\n");
+    } else {
+      fprintf(out, "    v%d = bpf_map_lookup_elem(&%s, &key);\n", id, table->name);
+    }
+    if (table->kind == EbpfTable_Dense) {
+      fprintf(out, "    if (v%d && !v%d->valid) {\n", id, id);
+      fprintf(out, "      v%d = 0;\n", id);
+      fprintf(out, "    }\n");
+    }
+    fprintf(out, "  }\n");
+  } else if (table->kind == EbpfTable_Inline) {
+    emit_inline_entries(table, insn);
+  } else {
+    fprintf(out, "  v%d = 0;\n", id);
+  }
+  fprintf(out, "  h%d = v%d != 0;\n", id, id);
+  if (table->default_map.type) {
+    fprintf(out, "  if (!v%d) {\n", id);
+    fprintf(out, "    __u32 zero = 0;\n");
+    fprintf(out, "    v%d = bpf_map_lookup_elem(&%s, &zero);\n", id, table->default_map.name);
+    fprintf(out, "  }\n");
+  }
+  fprintf(out, "  if (!v%d) {\n", id);
+  emit_value(table, format("d%d", id), table->default_action, table->default_args, "    ");
+  fprintf(out, "    v%d = &d%d;\n", id, id);
+  fprintf(out, "  }\n");
+}
+
+/* What a callee that has a context gets from the function being emitted. */
+internal char*
+context_for(struct IrFunction* callee)
+{
+  if (callee->kind == IrFunction_Action && callee->parent) {
+    struct IrFunction* owner = ebpf_is_block(function) ? function : function->parent;
+    if (owner != callee->parent) {
+      error("action `%s` of `%s` cannot be called from `%s`.", callee->name, callee->parent->name, function->name);
+    }
+    return "ctx";
+  }
+  return "0";
+}
+
+internal void
+emit_function_call(struct IrInsn* insn, struct IrFunction* callee)
+{
+  struct IrInsn* receiver = insn->receiver ? ir_insn(function, insn->receiver) : 0;
+  char* args = "pkt";
+  if (callee->kind == IrFunction_Action) {
+    args = format("%s, %s", args, context_for(callee));
+  }
+  int i;
+  for (i = 0; i < insn->arg_count; i++) {
+    struct Type* type = ir_insn(function, insn->args[i])->type;
+    if (!ebpf_is_extern_object(type)) {
+      args = format("%s, %s", args, value(insn->args[i]));
+    }
+  }
+  if (receiver && receiver->op == Ir_TableApply) {
+    struct EbpfTable* table = ebpf_table_of(program, receiver->decl);
+    struct EbpfAction* action = ebpf_table_action(table, callee->decl);
+    for (i = 0; action && i < action->param_count; i++) {
+      args = format("%s, v%d->u.%s.%s", args, receiver->id, action->name, action->params[i].name);
+    }
+  }
+  if (callee->kind == IrFunction_Function) {
+    if (insn->type && scalar_ctype(insn->type) && use_count[insn->id] > 0) {
+      fprintf(out, "  v%d = (%s)%s(%s);\n", insn->id, scalar_ctype(insn->type), function_cname(callee), args);
+    } else {
+      fprintf(out, "  %s(%s);\n", function_cname(callee), args);
+    }
+  } else {
+    fprintf(out, "  if (%s(%s)) {\n", function_cname(callee), args);
+    fprintf(out, "    return 1;\n");
+    fprintf(out, "  }\n");
+  }
+}
+
+/* `apply` of a parser or control instance, through a context of its own. */
+internal void
+emit_apply(struct IrInsn* insn, struct IrFunction* callee)
+{
+  fprintf(out, "  __builtin_memset(&s%d, 0, sizeof(s%d));\n", insn->id, insn->id);
+  int i = 0;
+  struct AstListLink* link = callee->params ? ast_list_first_link(callee->params) : 0;
+  while (link) {
+    if (i < insn->arg_count && !ebpf_is_extern_object(type_of_node(link->ast))) {
+      fprintf(out, "  s%d.p_%s = %s;\n", insn->id, ebpf_decl_name(link->ast), value(insn->args[i]));
+    }
+    i += 1;
+    link = link->next;
+  }
+  if (callee->kind == IrFunction_Parser) {
+    fprintf(out, "  if (!%s(pkt, &s%d)) {\n", callee->name, insn->id);
+    fprintf(out, "    return 0;\n");
+  } else {
+    fprintf(out, "  if (%s(pkt, &s%d)) {\n", callee->name, insn->id);
+    fprintf(out, "    return 1;\n");
+  }
+  fprintf(out, "  }\n");
+}
+
+internal bool
+in_check()
+{
+  return check_id && check_offset < ir_insn(function, check_id)->index;
+}
+
+internal void
+emit_extract(struct IrInsn* insn)
+{
+  if (insn->arg_count != 1) {
+    error("at line %d: the XDP target does not support variable-size headers.", insn->line_nr);
+  }
+  struct IrInsn* header = ir_insn(function, insn->args[0]);
+  struct Type* type = ebpf_resolve_type(header->type);
+  if (type->kind != Type_Header) {
+    error("at line %d: only headers can be extracted.", insn->line_nr);
+  }
+  struct IrInsn* stack = header->op == Ir_Field ? ir_insn(function, header->args[0]) : 0;
+  bool is_next = stack && ebpf_resolve_type(stack->type)->kind == Type_HeaderStack && cstr_match(header->name, "next");
+  if (in_check()) {
+    /* Within a packet_check: the header is at a known offset from its pointer. */
+    char* h = value(header->id);
+    if (is_next) {
+      char* s = value(stack->id);
+      int size = ebpf_resolve_type(stack->type)->width;
+      fprintf(out, "  if ((%s)->next >= %d) {\n", s, size);
+      fprintf(out, "    return 0;\n");
+      fprintf(out, "  }\n");
+      if (is_unrolled(stack->type)) {
+        h = unrolled_elem_ref(s, size, format("(%s)->next", s), 0, 0);
+      } else {
+        h = format("&(%s)->elem[(%s)->next < %d ? (%s)->next : 0]", s, s, size, s);
+      }
+    }
+    fprintf(out, "  ashp4c_parse_%s(c%d + %d, %s, pkt->offset);\n", type->name, check_id, check_offset, h);
+    fprintf(out, "  pkt->offset += %d;\n", ebpf_header_size(type));
+    if (is_next) {
+      fprintf(out, "  (%s)->next += 1;\n", value(stack->id));
+    }
+    check_offset += ebpf_header_size(type);
+    return;
+  }
+  if (is_next) {
+    char* s = value(stack->id);
+    int size = ebpf_resolve_type(stack->type)->width;
+    char* h = format("&(%s)->elem[(%s)->next < %d ? (%s)->next : 0]", s, s, size, s);
+    if (is_unrolled(stack->type)) {
+      h = unrolled_elem_ref(s, size, format("(%s)->next", s), 0, 0);
+    }
+    fprintf(out, "  if ((%s)->next >= %d || !ashp4c_extract_%s(pkt, %s)) {\n", s, size, type->name, h);
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "  (%s)->next += 1;\n", s);
+    return;
+  }
+  fprintf(out, "  if (!ashp4c_extract_%s(pkt, %s)) {\n", type->name, value(header->id));
+  fprintf(out, "    return 0;\n");
+  fprintf(out, "  }\n");
+}
+
+internal void
+emit_lookahead(struct IrInsn* insn)
+{
+  struct Type* type = ebpf_resolve_type(insn->type);
+  if (type->kind == Type_Header) {
+    fprintf(out, "  {\n");
+    fprintf(out, "    __u32 offset = pkt->offset;\n");
+    fprintf(out, "    if (!ashp4c_extract_%s(pkt, &t%d)) {\n", type->name, insn->id);
+    fprintf(out, "      return 0;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    pkt->offset = offset;\n");
+    fprintf(out, "  }\n");
+    return;
+  }
+  char* ct = scalar_ctype(type);
+  if (!ct || type->kind == Type_Int) {
+    error("at line %d: the XDP target cannot look ahead for `%s`.", insn->line_nr, type_to_string(type));
+  }
+  int width = ebpf_scalar_width(type);
+  fprintf(out, "  {\n");
+  fprintf(out, "    __u8* b = ashp4c_cursor(pkt, %d);\n", (width + 7) / 8);
+  fprintf(out, "    if (!b) {\n");
+  fprintf(out, "      return 0;\n");
+  fprintf(out, "    }\n");
+  fprintf(out, "    v%d = %s;\n", insn->id, wrap(type, load_bits("b", 0, width)));
+  fprintf(out, "  }\n");
+}
+
+internal void
+emit_method_call(struct IrInsn* insn, struct IrInsn* receiver)
+{
+  struct Type* type = ebpf_resolve_type(receiver->type);
+  char* extern_name = type && type->kind == Type_Extern ? type->name : "";
+  char* a = insn->arg_count > 0 ? value(insn->args[0]) : 0;
+  if (cstr_match(extern_name, "packet_in")) {
+    if (cstr_match(insn->name, "extract")) {
+      emit_extract(insn);
+      return;
+    } else if (cstr_match(insn->name, "lookahead")) {
+      emit_lookahead(insn);
+      return;
+    } else if (cstr_match(insn->name, "advance")) {
+      if (in_check()) {
+        check_offset += ebpf_packet_bytes(function, insn);
+      }
+      fprintf(out, "  pkt->offset += (__u32)%s >> 3;\n", a);
+      return;
+    } else if (cstr_match(insn->name, "length")) {
+      fprintf(out, "  v%d = (__u32)(pkt->data_end - pkt->data);\n", insn->id);
+      return;
+    }
+  } else if (cstr_match(extern_name, "packet_out") && cstr_match(insn->name, "emit")) {
+    struct Type* header = ebpf_resolve_type(ir_insn(function, insn->args[0])->type);
+    int i;
+    if (header->kind == Type_Header) {
+      fprintf(out, "  ashp4c_emit_%s(pkt, %s);\n", header->name, a);
+      return;
+    } else if (header->kind == Type_HeaderStack) {
+      for (i = 0; i < header->width; i++) {
+        fprintf(out, "  ashp4c_emit_%s(pkt, &(%s)->elem[%d]);\n", ebpf_resolve_type(header->base)->name, a, i);
+      }
+      return;
+    } else if (header->kind == Type_Struct || header->kind == Type_HeaderUnion) {
+      for (i = 0; i < header->member_count; i++) {
+        struct Type* member = ebpf_resolve_type(header->members[i].type);
+        if (member->kind == Type_Header) {
+          fprintf(out, "  ashp4c_emit_%s(pkt, &(%s)->%s);\n", member->name, a, header->members[i].name);
+        } else {
+          error("at line %d: the XDP target can only emit structs of headers.", insn->line_nr);
+        }
+      }
+      return;
+    }
+  } else if (cstr_match(extern_name, "CounterArray")) {
+    struct EbpfCounter* counter = ebpf_counter_of(program, receiver->decl);
+    if (!counter) {
+      error("at line %d: counter array `%s` must be declared in a control.", insn->line_nr, receiver->name);
+    }
+    int sparse = counter->map.type == EbpfMap_Hash;
+    if (cstr_match(insn->name, "increment")) {
+      fprintf(out, "  ashp4c_counter_add(&%s, %s, 1, %d);\n", counter->name, a, sparse);
+      return;
+    } else if (cstr_match(insn->name, "add")) {
+      fprintf(out, "  ashp4c_counter_add(&%s, %s, %s, %d);\n", counter->name, a, value(insn->args[1]), sparse);
+      return;
+    }
+  } else if (type && (type->kind == Type_Parser || type->kind == Type_Control) && cstr_match(insn->name, "apply")) {
+    struct IrFunction* callee = ir_function_of(program->ir, type->decl);
+    if (callee) {
+      emit_apply(insn, callee);
+      return;
+    }
+  }
+  error("at line %d: `%s.%s` is not supported by the XDP target.", insn->line_nr,
+        type ? type_to_string(receiver->type) : "?", insn->name);
+}
+
+/* Extern functions of ebpf_model.p4, xdp_model.p4 and core.p4. */
+internal void
+emit_extern_call(struct IrInsn* insn)
+{
+  char* args = "";
+  int i;
+  for (i = 0; i < insn->arg_count; i++) {
+    args = format("%s%s%s", args, i > 0 ? ", " : "", value(insn->args[i]));
+  }
+  if (cstr_match(insn->name, "verify")) {
+    fprintf(out, "  if (!%s) {\n", value(insn->args[0]));
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "  }\n");
+    return;
+  }
+  char* helper = 0;
+  if (cstr_match(insn->name, "BPF_KTIME_GET_NS")) {
+    helper = "bpf_ktime_get_ns";
+  } else if (cstr_match(insn->name, "csum_replace2")) {
+    helper = "ashp4c_csum_replace2";
+  } else if (cstr_match(insn->name, "csum_replace4")) {
+    helper = "ashp4c_csum_replace4";
+  } else if (cstr_match(insn->name, "ebpf_ipv4_checksum")) {
+    helper = "ashp4c_ipv4_checksum";
+  } else {
+    error("at line %d: extern `%s` is not supported by the XDP target.", insn->line_nr, insn->name);
+  }
+  if (insn->type && scalar_ctype(insn->type)) {
+    fprintf(out, "  v%d = %s;\n", insn->id, wrap(insn->type, format("%s(%s)", helper, args)));
+  } else {
+    fprintf(out, "  %s(%s);\n", helper, args);
+  }
+}
+
+internal void
+emit_call(struct IrInsn* insn)
+{
+  struct IrInsn* receiver = insn->receiver ? ir_insn(function, insn->receiver) : 0;
+  if (receiver && receiver->op != Ir_TableApply) {
+    emit_method_call(insn, receiver);
+    return;
+  }
+  struct Ast* decl = insn->decl;
+  struct IrFunction* callee = ir_function_of(program->ir, decl);
+  if (!callee && decl && decl->kind == Ast_FunctionDecl) {
+    callee = ir_function_of(program->ir, (struct Ast*)ast_getattr(decl, "proto"));
+  }
+  if (callee) {
+    emit_function_call(insn, callee);
+  } else {
+    emit_extern_call(insn);
+  }
+}
+
+internal bool
+is_pure(enum IrOpcode op)
+{
+  return op != Ir_Store && op != Ir_Call && op != Ir_SetValid && op != Ir_SetInvalid && op != Ir_TableApply
+         && op != Ir_Phi;
+}
+
+internal void
+emit_insn(struct IrInsn* insn)
+{
+  switch (insn->op) {
+    case Ir_Const:
+    case Ir_EnumConst:
+    case Ir_String:
+    case Ir_Tuple:
+    case Ir_Phi:
+      return;
+    case Ir_Var:
+      refs[insn->id] = var_ref(insn);
+      return;
+    case Ir_Temp:
+      refs[insn->id] = format("&t%d", insn->id);
+      return;
+    case Ir_Field:
+      refs[insn->id] = field_ref(insn);
+      return;
+    case Ir_Index: {
+      struct IrInsn* base = ir_insn(function, insn->args[0]);
+      struct Type* stack = ebpf_resolve_type(base->type);
+      if (ir_insn(function, insn->args[1])->op != Ir_Const && is_unrolled(stack)) {
+        refs[insn->id] = unrolled_elem_ref(value(base->id), stack->width, value(insn->args[1]), 0, stack->width - 1);
+      } else {
+        refs[insn->id] = format("&(%s)->elem[%s]", value(base->id), index_expr(insn->args[1], stack->width));
+      }
+      return;
+    }
+    case Ir_Store:
+      emit_store(insn);
+      return;
+    case Ir_SetValid:
+    case Ir_SetInvalid:
+      fprintf(out, "  (%s)->ebpf_valid = %d;\n", value(insn->args[0]), insn->op == Ir_SetValid);
+      return;
+    case Ir_Call:
+      emit_call(insn);
+      return;
+    case Ir_TableApply:
+      emit_table_apply(insn);
+      return;
+    case Ir_PacketCheck:
+      fprintf(out, "  c%d = ashp4c_cursor(pkt, %d);\n", insn->id, insn->index);
+      fprintf(out, "  if (!c%d) {\n", insn->id);
+      fprintf(out, "    return 0;\n");
+      fprintf(out, "  }\n");
+      check_id = insn->id;
+      check_offset = 0;
+      return;
+    default: break;
+  }
+  if (insn->op == Ir_Undef && ebpf_is_aggregate(insn->type)) {
+    refs[insn->id] = format("&t%d", insn->id);
+    return;
+  }
+  if (use_count[insn->id] == 0) {
+    return;
+  }
+  fprintf(out, "  v%d = %s;\n", insn->id, value_expr(insn));
+}
+
+internal void
+count_uses()
+{
+  int i, j;
+  memset(use_count, 0, function->insns.elem_count * sizeof(int));
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    int id = block->first_insn;
+    while (id) {
+      struct IrInsn* insn = ir_insn(function, id);
+      for (j = 0; j < insn->arg_count; j++) {
+        use_count[insn->args[j]] += 1;
+      }
+      use_count[insn->receiver] += 1;
+      id = insn->next_in_block;
+    }
+    use_count[block->value] += 1;
+    for (j = 0; j < block->key_count; j++) {
+      use_count[block->keys[j]] += 1;
+    }
+  }
+}
+
+/* C variables: values, temporaries, tables applied, contexts of the blocks applied. */
+internal void
+emit_declarations()
+{
+  int i;
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    int id = ir_block(function, i)->first_insn;
+    while (id) {
+      struct IrInsn* insn = ir_insn(function, id);
+      id = insn->next_in_block;
+      if (insn->op == Ir_Temp || (insn->op == Ir_Undef && ebpf_is_aggregate(insn->type))
+          || (insn->op == Ir_Call && ebpf_is_aggregate(insn->type))) {
+        fprintf(out, "  %s t%d;\n", ctype(insn->type, insn->line_nr), insn->id);
+        fprintf(out, "  __builtin_memset(&t%d, 0, sizeof(t%d));\n", insn->id, insn->id);
+        if (insn->op == Ir_Call) {
+          refs[insn->id] = format("&t%d", insn->id);
+        }
+      } else if (insn->op == Ir_PacketCheck) {
+        fprintf(out, "  __u8* c%d = 0;\n", insn->id);
+      } else if (insn->op == Ir_TableApply) {
+        struct EbpfTable* table = ebpf_table_of(program, insn->decl);
+        fprintf(out, "  struct %s_value* v%d = 0;\n", table->name, insn->id);
+        fprintf(out, "  struct %s_value d%d;\n", table->name, insn->id);
+        fprintf(out, "  __u8 h%d = 0;\n", insn->id);
+      } else if (insn->op == Ir_Call && insn->receiver && insn->name && cstr_match(insn->name, "apply")) {
+        struct Type* type = ebpf_resolve_type(ir_insn(function, insn->receiver)->type);
+        if (type && (type->kind == Type_Parser || type->kind == Type_Control)) {
+          fprintf(out, "  struct %s_ctx s%d;\n", ir_function_of(program->ir, type->decl)->name, insn->id);
+        }
+      } else if (insn->type && (insn->op == Ir_Phi || (use_count[insn->id] > 0 && is_pure(insn->op))
+                                || insn->op == Ir_Call)) {
+        char* ct = scalar_ctype(insn->type);
+        if (ct && !(insn->op == Ir_Var || insn->op == Ir_Field || insn->op == Ir_Index || insn->op == Ir_Temp
+                    || insn->op == Ir_Const || insn->op == Ir_EnumConst)) {
+          fprintf(out, "  %s v%d = 0;\n", ct, insn->id);
+        }
+      }
+    }
+  }
+  for (i = 0; !ebpf_is_block(function) && i < function->locals.elem_count; i++) {
+    struct Ast* local_decl = *(struct Ast**)array_get(&function->locals, i);
+    struct Type* type = type_of_node(local_decl);
+    if (local_decl->kind != Ast_Instantiation && !ebpf_is_extern_object(type)) {
+      fprintf(out, "  %s l_%s;\n", ctype(type, local_decl->line_nr), ebpf_decl_name(local_decl));
+      fprintf(out, "  __builtin_memset(&l_%s, 0, sizeof(l_%s));\n", ebpf_decl_name(local_decl),
+              ebpf_decl_name(local_decl));
+    }
+  }
+}
+
+internal void
+emit_function(struct IrFunction* f)
+{
+  function = f;
+  refs = arena_push(emit_storage, f->insns.elem_count * sizeof(char*));
+  memset(refs, 0, f->insns.elem_count * sizeof(char*));
+  use_count = arena_push(emit_storage, f->insns.elem_count * sizeof(int));
+  count_uses();
+  emit_signature(f);
+  fprintf(out, "\n{\n");
+  emit_declarations();
+  int i;
+  for (i = 1; i < f->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(f, i);
+    if (i != f->entry_block && block->pred_count == 0) {
+      continue;
+    }
+    check_id = 0;
+    if (block->pred_count > 0) {
+      fprintf(out, "b%d:%s%s\n", i, block->label ? "  /* " : "", block->label ? format("%s */", block->label) : "");
+    }
+    int id = block->first_insn;
+    while (id) {
+      struct IrInsn* insn = ir_insn(f, id);
+      emit_insn(insn);
+      id = insn->next_in_block;
+    }
+    emit_terminator(block);
+  }
+  fprintf(out, "}\n\n");
+  function = 0;
+}
+
+/*
+ * The program.
+ */
+
+internal void
+emit_prelude(char* source_filename)
+{
+  fprintf(out, "/* Generated by ashp4c from %s.\n", source_filename);
+  fprintf(out, " *\n");
+  fprintf(out, " *   clang -O2 -target bpf -I ebpf -c <this file> -o <object>\n");
+  fprintf(out, " */\n");
+  fprintf(out, "#define KBUILD_MODNAME \"ashp4c\"\n");
+  fprintf(out, "#include <linux/bpf.h>\n");
+  fprintf(out, "#include \"bpf_helpers.h\"\n");
+  fprintf(out, "#include \"bpf_endian.h\"\n\n");
+  fprintf(out, "#ifndef __always_inline\n");
+  fprintf(out, "# define __always_inline  inline __attribute__((always_inline))\n");
+  fprintf(out, "#endif\n\n");
+  fprintf(out, "#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__\n");
+  fprintf(out, "# define ashp4c_ntohll(x)  __builtin_bswap64(x)\n");
+  fprintf(out, "#else\n");
+  fprintf(out, "# define ashp4c_ntohll(x)  (x)\n");
+  fprintf(out, "#endif\n");
+  fprintf(out, "#define ashp4c_htonll(x)  ashp4c_ntohll(x)\n\n");
+  fprintf(out, "/* Bounds the packet offset for the verifier. */\n");
+  fprintf(out, "#define ASHP4C_MAX_PACKET_OFFSET  %#x\n\n", EBPF_MAX_PACKET_OFFSET);
+  fprintf(out, "struct ashp4c_packet {\n");
+  fprintf(out, "  __u8* data;\n");
+  fprintf(out, "  __u8* data_end;\n");
+  fprintf(out, "  __u32 offset;\n");
+  fprintf(out, "  __u8 measure;  /* the deparser only adds up the size of what it would emit */\n");
+  fprintf(out, "  __u8 fill;     /* the deparser only loads the untouched fields of the headers that move */\n");
+  fprintf(out, "  __u8 shift;    /* the deparser runs backwards from the end and moves the headers that go further on */\n");
+  fprintf(out, "  __u8 copy;     /* headers that move are copied within the packet, not written whole */\n");
+  fprintf(out, "  __u8 reordered;  /* the deparser emits extracted headers out of their order in the packet */\n");
+  fprintf(out, "  __u32 last;    /* 1 + where the last extracted header emitted was */\n");
+  fprintf(out, "  int ahead;     /* the furthest on an extracted header goes, before the packet start moves */\n");
+  fprintf(out, "  int delta;     /* where the packet will start, from where it started */\n");
+  fprintf(out, "};\n\n");
+  fprintf(out, "/* Start of `size` bytes at `offset` in the packet, or 0 if the packet is shorter. */\n");
+  fprintf(out, "static __always_inline __u8*\n");
+  fprintf(out, "ashp4c_cursor_at(struct ashp4c_packet* pkt, __u32 offset, __u32 size)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  if (offset > ASHP4C_MAX_PACKET_OFFSET) {\n");
+  fprintf(out, "    return 0;\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  __u8* b = pkt->data + offset;\n");
+  fprintf(out, "  if (b + size > pkt->data_end) {\n");
+  fprintf(out, "    return 0;\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  return b;\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "/* Start of `size` bytes at the packet offset, or 0 if the packet is shorter. */\n");
+  fprintf(out, "static __always_inline __u8*\n");
+  fprintf(out, "ashp4c_cursor(struct ashp4c_packet* pkt, __u32 size)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  return ashp4c_cursor_at(pkt, pkt->offset, size);\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "static __always_inline void\n");
+  fprintf(out, "ashp4c_counter_add(void* map, __u32 index, __u32 value, int sparse)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  __u32* count = bpf_map_lookup_elem(map, &index);\n");
+  fprintf(out, "  if (count) {\n");
+  fprintf(out, "    __sync_fetch_and_add(count, value);\n");
+  fprintf(out, "  } else if (sparse) {\n");
+  fprintf(out, "    bpf_map_update_elem(map, &index, &value, BPF_NOEXIST);\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "static __always_inline __u16\n");
+  fprintf(out, "ashp4c_csum_fold(__u32 sum)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  sum = (sum & 0xffff) + (sum >> 16);\n");
+  fprintf(out, "  sum = (sum & 0xffff) + (sum >> 16);\n");
+  fprintf(out, "  return (__u16)~sum;\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "/* RFC 1624: HC' = ~(~HC + ~m + m') */\n");
+  fprintf(out, "static __always_inline __u16\n");
+  fprintf(out, "ashp4c_csum_replace2(__u16 csum, __u16 old, __u16 new)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  return ashp4c_csum_fold((__u16)~csum + (__u32)(__u16)~old + new);\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "static __always_inline __u16\n");
+  fprintf(out, "ashp4c_csum_replace4(__u16 csum, __u32 old, __u32 new)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  return ashp4c_csum_fold((__u16)~csum + (__u32)(__u16)~(old >> 16) + (__u16)~old\n");
+  fprintf(out, "                          + (new >> 16) + (new & 0xffff));\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "static __always_inline __u16\n");
+  fprintf(out, "ashp4c_ipv4_checksum(__u8 version, __u8 ihl, __u8 diffserv, __u16 totalLen, __u16 identification,\n");
+  fprintf(out, "                     __u8 flags, __u16 fragOffset, __u8 ttl, __u8 protocol, __u32 srcAddr, __u32 dstAddr)\n");
+  fprintf(out, "{\n");
+  fprintf(out, "  __u32 sum = ((__u32)version << 12 | (__u32)ihl << 8 | diffserv) + totalLen + identification\n");
+  fprintf(out, "              + ((__u32)flags << 13 | fragOffset) + ((__u32)ttl << 8 | protocol)\n");
+  fprintf(out, "              + (srcAddr >> 16) + (srcAddr & 0xffff) + (dstAddr >> 16) + (dstAddr & 0xffff);\n");
+  fprintf(out, "  return ashp4c_csum_fold(sum);\n");
+  fprintf(out, "}\n\n");
+}
+
+internal void
+collect_types(struct IrFunction* f)
+{
+  int i;
+  struct AstListLink* link = f->params ? ast_list_first_link(f->params) : 0;
+  while (link) {
+    emit_type(type_of_node(link->ast));
+    link = link->next;
+  }
+  for (i = 0; i < f->locals.elem_count; i++) {
+    emit_type(type_of_node(*(struct Ast**)array_get(&f->locals, i)));
+  }
+  for (i = 1; i < f->insns.elem_count; i++) {
+    emit_type(ir_insn(f, i)->type);
+  }
+}
+
+/* Points the field `p_<name>` of the context `ctx` of `f` at `storage`, or copies it in. */
+internal void
+bind_param(struct IrFunction* f, int index, char* ctx, char* storage)
+{
+  struct Ast* param = 0;
+  struct AstListLink* link = f->params ? ast_list_first_link(f->params) : 0;
+  while (link && index > 0) {
+    link = link->next;
+    index -= 1;
+  }
+  param = link ? link->ast : 0;
+  if (!param) {
+    error("`%s` has too few parameters for the `main` package.", f->name);
+  }
+  if (ebpf_param_by_value(param)) {
+    fprintf(out, "  %s.p_%s = %s;\n", ctx, ebpf_decl_name(param), storage);
+  } else {
+    fprintf(out, "  %s.p_%s = &%s;\n", ctx, ebpf_decl_name(param), storage);
+  }
+}
+
+/* The headers emitted by the deparser reference `id`, seen from emit_main, where the headers are `headers`. */
+internal char*
+main_path(struct IrFunction* deparser, int id, char* headers)
+{
+  struct IrInsn* insn = ir_insn(deparser, id);
+  if (insn->op == Ir_Field) {
+    return format("%s.%s", main_path(deparser, insn->args[0], headers), insn->name);
+  } else if (insn->op == Ir_Index) {
+    int64_t index = 0;
+    bitint_to_int64(ir_insn(deparser, insn->args[1])->value, &index);
+    return format("%s.elem[%d]", main_path(deparser, insn->args[0], headers), (int)index);
+  }
+  return headers;
+}
+
+/* The headers of `type` at `ref` for the backward pass: last first. */
+internal void
+emit_shifts(char* ref, struct Type* type)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  if (type->kind == Type_Header) {
+    fprintf(out, "    ashp4c_emit_%s(&pkt, &%s);\n", type->name, ref);
+  } else if (type->kind == Type_HeaderStack) {
+    for (i = type->width - 1; i >= 0; i--) {
+      emit_shifts(format("%s.elem[%d]", ref, i), type->base);
+    }
+  } else if (type->kind == Type_Struct || type->kind == Type_HeaderUnion) {
+    for (i = type->member_count - 1; i >= 0; i--) {
+      emit_shifts(format("%s.%s", ref, type->members[i].name), type->members[i].type);
+    }
+  }
+}
+
+/* What a stage leaves to the next: the headers and the control's metadata are kept there, not on the stack. */
+internal void
+emit_state()
+{
+  struct IrFunction* control = program->control;
+  fprintf(out, "struct ashp4c_state {\n");
+  fprintf(out, "  %s headers;\n", ctype(ebpf_param_type(program->parser, 1), 0));
+  if (program->model == EbpfModel_Filter) {
+    fprintf(out, "  __u8 accept;\n");
+  } else {
+    fprintf(out, "  %s imd;\n", ctype(ebpf_param_type(control, 1), 0));
+    fprintf(out, "  %s omd;\n", ctype(ebpf_param_type(control, 2), 0));
+  }
+  fprintf(out, "  __u32 offset;\n");
+  fprintf(out, "};\n\n");
+  emit_map_def(&program->state_map, "__u32", "struct ashp4c_state");
+  emit_map_def(&program->stage_map, "__u32", "__u32");
+}
+
+/* The program of `stage` up to its blocks: the packet, the tables on the first run, the state. */
+internal void
+emit_stage_begin(int stage)
+{
+  if (stage == 0) {
+    fprintf(out, "SEC(\"xdp\")\n");
+    fprintf(out, "int ashp4c_xdp(struct xdp_md* xdp)\n");
+  } else {
+    fprintf(out, "SEC(\"xdp/%d\")\n", stage);
+    fprintf(out, "int ashp4c_xdp_%d(struct xdp_md* xdp)\n", stage);
+  }
+  fprintf(out, "{\n");
+  fprintf(out, "  struct ashp4c_packet pkt;\n");
+  fprintf(out, "  __builtin_memset(&pkt, 0, sizeof(pkt));\n");
+  fprintf(out, "  pkt.data = (__u8*)(long)xdp->data;\n");
+  fprintf(out, "  pkt.data_end = (__u8*)(long)xdp->data_end;\n");
+  if ((stage == 0 && ebpf_needs_init(program)) || program->stage_count > 1) {
+    fprintf(out, "  __u32 zero = 0;\n");
+  }
+  if (stage == 0 && ebpf_needs_init(program)) {
+    fprintf(out, "  __u32* initialized = bpf_map_lookup_elem(&ashp4c_init, &zero);\n");
+    fprintf(out, "  if (initialized && !*initialized) {\n");
+    fprintf(out, "    *initialized = 1;\n");
+    fprintf(out, "    ashp4c_init_tables();\n");
+    fprintf(out, "  }\n");
+  }
+  if (program->stage_count > 1) {
+    fprintf(out, "  struct ashp4c_state* state = bpf_map_lookup_elem(&%s, &zero);\n", program->state_map.name);
+    fprintf(out, "  if (!state) {\n");
+    fprintf(out, "    return XDP_ABORTED;\n");
+    fprintf(out, "  }\n");
+  }
+  if (stage > 0) {
+    fprintf(out, "  pkt.offset = state->offset;\n");
+  }
+}
+
+/* Hands the packet to the program of the next stage, if `block` starts one. */
+internal void
+emit_stage_end(enum EbpfBlock block)
+{
+  int stage = program->stages[block];
+  if (stage == program->stages[block - 1]) {
+    return;
+  }
+  fprintf(out, "  state->offset = pkt.offset;\n");
+  fprintf(out, "  bpf_tail_call(xdp, &%s, %d);\n", program->stage_map.name, stage);
+  fprintf(out, "  return XDP_ABORTED;\n");
+  fprintf(out, "}\n\n");
+  emit_stage_begin(stage);
+}
+
+internal void
+emit_main()
+{
+  struct IrFunction* parser = program->parser;
+  struct IrFunction* control = program->control;
+  char* state = program->stage_count > 1 ? "state->" : "";
+  char* headers = format("%sheaders", state);
+  char* omd = format("%somd", state);
+  int i;
+  if (program->stage_count > 1) {
+    emit_state();
+  }
+  emit_stage_begin(0);
+  if (!*state) {
+    fprintf(out, "  %s headers;\n", ctype(ebpf_param_type(parser, 1), 0));
+  }
+  fprintf(out, "  __builtin_memset(&%s, 0, sizeof(%s));\n", headers, headers);
+  fprintf(out, "  struct %s_ctx parser_ctx;\n", parser->name);
+  fprintf(out, "  __builtin_memset(&parser_ctx, 0, sizeof(parser_ctx));\n");
+  bind_param(parser, 1, "parser_ctx", headers);
+  fprintf(out, "  if (!%s(&pkt, &parser_ctx)) {\n", parser->name);
+  fprintf(out, "    return XDP_DROP;\n");
+  fprintf(out, "  }\n");
+  emit_stage_end(EbpfBlock_Control);
+  fprintf(out, "  struct %s_ctx control_ctx;\n", control->name);
+  fprintf(out, "  __builtin_memset(&control_ctx, 0, sizeof(control_ctx));\n");
+  bind_param(control, 0, "control_ctx", headers);
+  if (program->model == EbpfModel_Filter) {
+    char* accept = format("%saccept", state);
+    fprintf(out, *state ? "  %s = 0;\n" : "  __u8 %s = 0;\n", accept);
+    bind_param(control, 1, "control_ctx", accept);
+    fprintf(out, "  %s(&pkt, &control_ctx);\n", control->name);
+    fprintf(out, "  return %s ? XDP_PASS : XDP_DROP;\n", accept);
+    fprintf(out, "}\n\n");
+    return;
+  }
+  struct IrFunction* deparser = program->deparser;
+  char* imd = format("%simd", state);
+  if (!*state) {
+    fprintf(out, "  %s imd;\n", ctype(ebpf_param_type(control, 1), 0));
+  }
+  fprintf(out, "  __builtin_memset(&%s, 0, sizeof(%s));\n", imd, imd);
+  fprintf(out, "  %s.input_port = xdp->ingress_ifindex;\n", imd);
+  if (!*state) {
+    fprintf(out, "  %s omd;\n", ctype(ebpf_param_type(control, 2), 0));
+  }
+  fprintf(out, "  __builtin_memset(&%s, 0, sizeof(%s));\n", omd, omd);
+  fprintf(out, "  %s.output_action = XDP_PASS;\n", omd);
+  bind_param(control, 1, "control_ctx", imd);
+  bind_param(control, 2, "control_ctx", omd);
+  fprintf(out, "  %s(&pkt, &control_ctx);\n", control->name);
+  fprintf(out, "  if (%s.output_action == XDP_ABORTED || %s.output_action == XDP_DROP) {\n", omd, omd);
+  fprintf(out, "    return %s.output_action;\n", omd);
+  fprintf(out, "  }\n");
+  emit_stage_end(EbpfBlock_Deparser);
+  fprintf(out, "  /* The emitted headers replace the parsed ones: size them, move the packet start, write them. */\n");
+  fprintf(out, "  __u32 parsed = pkt.offset;\n");
+  fprintf(out, "  struct %s_ctx deparser_ctx;\n", deparser->name);
+  fprintf(out, "  __builtin_memset(&deparser_ctx, 0, sizeof(deparser_ctx));\n");
+  bind_param(deparser, 0, "deparser_ctx", headers);
+  fprintf(out, "  pkt.offset = 0;\n");
+  fprintf(out, "  pkt.measure = 1;\n");
+  fprintf(out, "  pkt.ahead = -ASHP4C_MAX_PACKET_OFFSET - 1;\n");
+  fprintf(out, "  %s(&pkt, &deparser_ctx);\n", deparser->name);
+  fprintf(out, "  int delta = (int)parsed - (int)pkt.offset;\n");
+  fprintf(out, "  pkt.measure = 0;\n");
+  fprintf(out, "  pkt.delta = delta;\n");
+  char* indent = "  ";
+  if (program->deparser_emits) {
+    /* Headers that go further on are moved from the last one back, before the packet start moves. */
+    fprintf(out, "  pkt.copy = !pkt.reordered;\n");
+    fprintf(out, "  if (pkt.copy && pkt.ahead + delta > 0) {\n");
+    fprintf(out, "    pkt.shift = 1;\n");
+    for (i = program->deparser_emit_count - 1; i >= 0; i--) {
+      int id = program->deparser_emits[i];
+      emit_shifts(main_path(deparser, id, headers), ir_insn(deparser, id)->type);
+    }
+    fprintf(out, "    pkt.shift = 0;\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "  if (!pkt.copy) {\n");
+    indent = "    ";
+  }
+  if (ebpf_has_partial_headers(program)) {
+    fprintf(out, "%spkt.offset = 0;\n", indent);
+    fprintf(out, "%spkt.fill = 1;\n", indent);
+    fprintf(out, "%s%s(&pkt, &deparser_ctx);\n", indent, deparser->name);
+    fprintf(out, "%spkt.fill = 0;\n", indent);
+    if (program->deparser_emits) {
+      fprintf(out, "  }\n");
+    }
+  }
+  fprintf(out, "  if (delta != 0) {\n");
+  fprintf(out, "    if (bpf_xdp_adjust_head(xdp, delta)) {\n");
+  fprintf(out, "      return XDP_ABORTED;\n");
+  fprintf(out, "    }\n");
+  fprintf(out, "    pkt.data = (__u8*)(long)xdp->data;\n");
+  fprintf(out, "    pkt.data_end = (__u8*)(long)xdp->data_end;\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  pkt.offset = 0;\n");
+  fprintf(out, "  %s(&pkt, &deparser_ctx);\n", deparser->name);
+  fprintf(out, "  if (%s.output_action == XDP_REDIRECT) {\n", omd);
+  fprintf(out, "    return bpf_redirect(%s.output_port, 0);\n", omd);
+  fprintf(out, "  }\n");
+  fprintf(out, "  return %s.output_action;\n", omd);
+  fprintf(out, "}\n\n");
+}
+
+void
+emit_xdp_program(struct EbpfProgram* ebpf_program, int ast_node_count, FILE* f_stream, char* source_filename,
+                 struct Arena* storage)
+{
+  if (ebpf_program->model == EbpfModel_Ubpf) {
+    error("the XDP target does not run `ubpf` packages, --target=ubpf compiles them.");
+  }
+  program = ebpf_program;
+  out = f_stream;
+  emit_storage = storage;
+  type_emitted_count = types_count() + 1;
+  type_emitted = arena_push(emit_storage, type_emitted_count * sizeof(bool));
+  memset(type_emitted, 0, type_emitted_count * sizeof(bool));
+  array_init(&headers, sizeof(struct Type*), emit_storage);
+  function_reached = arena_push(emit_storage, (ast_node_count + 1) * sizeof(bool));
+  memset(function_reached, 0, (ast_node_count + 1) * sizeof(bool));
+  reach_function(program->parser);
+  reach_function(program->control);
+  reach_function(program->deparser);
+
+  emit_prelude(source_filename);
+  struct UnboundedArray* functions = &program->ir->functions;
+  int i;
+  for (i = 0; i < functions->elem_count; i++) {
+    struct IrFunction* f = *(struct IrFunction**)array_get(functions, i);
+    if (is_reached(f)) {
+      collect_types(f);
+    }
+  }
+  for (i = 0; i < headers.elem_count; i++) {
+    emit_header_functions(*(struct Type**)array_get(&headers, i));
+  }
+  for (i = 0; i < program->counters.elem_count; i++) {
+    struct EbpfCounter* counter = (struct EbpfCounter*)array_get(&program->counters, i);
+    emit_map_def(&counter->map, "__u32", "__u32");
+  }
+  for (i = 0; i < program->tables.elem_count; i++) {
+    emit_table_types((struct EbpfTable*)array_get(&program->tables, i));
+  }
+  for (i = 0; i < program->selects.elem_count; i++) {
+    struct EbpfSelect* select = (struct EbpfSelect*)array_get(&program->selects, i);
+    if (select->kind == EbpfSelect_Map) {
+      emit_map_def(&select->map, "__u32", "__u32");
+    }
+  }
+  if (ebpf_needs_init(program)) {
+    emit_init_function();
+  }
+  for (i = 0; i < functions->elem_count; i++) {
+    struct IrFunction* f = *(struct IrFunction**)array_get(functions, i);
+    if (is_reached(f) && ebpf_is_block(f)) {
+      emit_context(f);
+    }
+  }
+  for (i = 0; i < functions->elem_count; i++) {
+    struct IrFunction* f = *(struct IrFunction**)array_get(functions, i);
+    if (is_reached(f)) {
+      emit_signature(f);
+      fprintf(out, ";\n");
+    }
+  }
+  fprintf(out, "\n");
+  for (i = 0; i < functions->elem_count; i++) {
+    struct IrFunction* f = *(struct IrFunction**)array_get(functions, i);
+    if (is_reached(f)) {
+      emit_function(f);
+    }
+  }
+  emit_main();
+  fprintf(out, "char _license[] SEC(\"license\") = \"GPL\";\n");
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "bitint.h"
+
+
+/*
+ * Mid-level IR: one function per parser, control, action and function, made
+ * of basic blocks of instructions in SSA form.  Scalar variables local to a
+ * function are SSA values; everything else (parameters of controls, headers,
+ * structs, extern instances, tables) lives in memory and is reached through
+ * references: `var`, then `field` and `index` on the way to a `load` or `store`.
+ *
+ * Instructions and blocks are numbered from 1 within their function, so that
+ * 0 means "none".
+ */
+
+enum IrOpcode {
+  Ir_NONE_,
+  Ir_Const,         /* value */
+  Ir_EnumConst,     /* member `name` of an enum or `error` without a numeric value; index */
+  Ir_String,        /* name */
+  Ir_Undef,
+  Ir_Param,         /* index-th parameter, passed by value */
+  Ir_Phi,           /* args[i] comes from preds[i] */
+  Ir_Var,           /* reference to the memory of `decl` */
+  Ir_Temp,          /* reference to fresh memory, for copy-in/copy-out arguments */
+  Ir_Field,         /* reference to field `name` of args[0] */
+  Ir_Index,         /* reference to element args[1] of the stack args[0] */
+  Ir_Load,
+  Ir_Store,         /* args[0] = args[1]; an aggregate args[1] is a reference to copy from */
+  Ir_Tuple,
+  Ir_Add,
+  Ir_Sub,
+  Ir_Mul,
+  Ir_Div,
+  Ir_BitAnd,
+  Ir_BitOr,
+  Ir_BitXor,
+  Ir_Shl,
+  Ir_Shr,
+  Ir_Equal,
+  Ir_NotEqual,
+  Ir_Less,
+  Ir_Greater,
+  Ir_LessEqual,
+  Ir_GreaterEqual,
+  Ir_And,
+  Ir_Or,
+  Ir_LogNot,
+  Ir_BitNot,
+  Ir_Neg,
+  Ir_Cast,
+  Ir_Slice,         /* args[0][index:low] */
+  Ir_SliceSet,      /* args[0] with bits [index:low] replaced by args[1] */
+  Ir_IsValid,
+  Ir_SetValid,
+  Ir_SetInvalid,
+  Ir_Call,          /* `name` of `receiver`; an action run by the table apply `receiver` also takes the entry's data */
+  Ir_TableApply,    /* table `decl`, with the key values in args */
+  Ir_TableHit,
+  Ir_ActionRun,     /* index of the action chosen by the table apply args[0] */
+  Ir_PacketCheck,   /* reject unless `index` more bytes are in the packet; the extracts that follow in the block read them */
+};
+
+enum IrTermKind {
+  IrTerm_NONE_,
+  IrTerm_Jump,      /* succs[0] */
+  IrTerm_Branch,    /* value ? succs[0] : succs[1] */
+  IrTerm_Switch,    /* succs[i] when value == case_values[i], else succs[case_count] */
+  IrTerm_Select,    /* succs[i] of the first case matching `keys`, else succs[case_count] */
+  IrTerm_Return,    /* value, or 0 */
+  IrTerm_Exit,
+  IrTerm_Accept,
+  IrTerm_Reject,
+};
+
+struct IrInsn {
+  enum IrOpcode op;
+  int id;
+  int block;
+  int line_nr;
+  struct Type* type;
+  int* args;
+  int arg_count;
+  int receiver;
+  struct BitInt* value;
+  char* name;
+  struct Ast* decl;
+  int index;
+  int low;
+  int next_in_block;
+  int var;                  /* phis: the SSA variable */
+  int next_incomplete_phi;  /* phis of a block that is not sealed yet */
+  int replaced_by;          /* trivial phis, removed once the function is built */
+};
+
+/* One keyset element; a null `value` matches anything, a null `mask` matches exactly. */
+struct IrKeysetElem {
+  struct BitInt* value;
+  struct BitInt* mask;
+};
+
+struct IrSelectCase {
+  struct IrKeysetElem* elems;  /* one per key */
+  int line_nr;
+};
+
+struct IrBlock {
+  int id;
+  char* label;
+  int first_insn;
+  int last_insn;
+  int* preds;
+  int pred_count;
+  int pred_capacity;
+  bool is_sealed;
+  int first_incomplete_phi;
+  enum IrTermKind term;
+  int value;
+  int* keys;
+  int key_count;
+  int* succs;
+  int succ_count;
+  struct BitInt** case_values;        /* IrTerm_Switch */
+  struct IrSelectCase* select_cases;  /* IrTerm_Select */
+  int case_count;
+};
+
+enum IrFunctionKind {
+  IrFunction_Parser,
+  IrFunction_Control,
+  IrFunction_Action,
+  IrFunction_Function,
+};
+
+struct IrFunction {
+  enum IrFunctionKind kind;
+  char* name;
+  struct Ast* decl;             /* what calls and applications refer to */
+  struct AstList* params;
+  struct IrFunction* parent;    /* control of a local action */
+  struct UnboundedArray insns;  /* struct IrInsn, by id */
+  struct UnboundedArray blocks; /* struct IrBlock, by id */
+  struct UnboundedArray locals; /* struct Ast*: variables, constants and instances kept in memory */
+  struct UnboundedArray tables; /* struct Ast* */
+  struct UnboundedArray vars;   /* struct Ast*: declaration of each SSA variable, from 1 */
+  int entry_block;
+};
+
+struct IrProgram {
+  struct UnboundedArray functions;  /* struct IrFunction* */
+  struct IrFunction** function_of;  /* indexed by Ast.id of the declaration */
+  int function_of_count;
+  int insn_count;
+  int block_count;
+};
+
+
+struct IrProgram* build_ir_program(struct Ast* p4program, int ast_node_count, struct Arena* ir_storage_);
+struct IrFunction* ir_function_of(struct IrProgram* program, struct Ast* decl);
+struct IrInsn* ir_insn(struct IrFunction* function, int id);
+struct IrBlock* ir_block(struct IrFunction* function, int id);
+struct IrInsn* ir_new_insn(struct IrFunction* function, enum IrOpcode op, struct Type* type, int arg_count, int line_nr,
+                           struct Arena* storage);
+struct Ast* ir_table_property(struct Ast* table, enum AstKind kind, char* name);
+char* ir_opcode_to_string(enum IrOpcode op);
+void print_ir_program(struct IrProgram* program);
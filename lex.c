@@ -124,10 +124,11 @@ digit_to_integer(char c, int base)
   return digit_value;
 }
 
-internal int
+internal int64_t
 parse_integer(char* str, int base)
 {
-  int result = 0;
+  /* Wraps modulo 2^64; the exact value is recovered from the digits (see bitint.c). */
+  uint64_t result = 0;
   char c = *str++;
   assert(cstr_is_digit(c, base) || c == '_');
   if (c != '_') {
@@ -140,7 +141,7 @@ parse_integer(char* str, int base)
       continue;
     } else assert(0);
   }
-  return result;
+  return (int64_t)result;
 }
 
 internal void
@@ -788,6 +789,8 @@ lex_tokenize(char* text_, int text_size_, struct UnboundedArray* tokens_array_)
   text = text_;
   text_size = text_size_;
   tokens_array = tokens_array_;
+  line_nr = 1;
+  state = 0;
 
   lexeme->start = lexeme->end = text;
 
@@ -0,0 +1,299 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "ir.h"
+
+
+char*
+ir_opcode_to_string(enum IrOpcode op)
+{
+  switch (op) {
+    case Ir_Const:
+      return "const";
+    case Ir_EnumConst:
+      return "enum_const";
+    case Ir_String:
+      return "string";
+    case Ir_Undef:
+      return "undef";
+    case Ir_Param:
+      return "param";
+    case Ir_Phi:
+      return "phi";
+    case Ir_Var:
+      return "var";
+    case Ir_Temp:
+      return "temp";
+    case Ir_Field:
+      return "field";
+    case Ir_Index:
+      return "index";
+    case Ir_Load:
+      return "load";
+    case Ir_Store:
+      return "store";
+    case Ir_Tuple:
+      return "tuple";
+    case Ir_Add:
+      return "add";
+    case Ir_Sub:
+      return "sub";
+    case Ir_Mul:
+      return "mul";
+    case Ir_Div:
+      return "div";
+    case Ir_BitAnd:
+      return "bit_and";
+    case Ir_BitOr:
+      return "bit_or";
+    case Ir_BitXor:
+      return "bit_xor";
+    case Ir_Shl:
+      return "shl";
+    case Ir_Shr:
+      return "shr";
+    case Ir_Equal:
+      return "eq";
+    case Ir_NotEqual:
+      return "ne";
+    case Ir_Less:
+      return "lt";
+    case Ir_Greater:
+      return "gt";
+    case Ir_LessEqual:
+      return "le";
+    case Ir_GreaterEqual:
+      return "ge";
+    case Ir_And:
+      return "and";
+    case Ir_Or:
+      return "or";
+    case Ir_LogNot:
+      return "not";
+    case Ir_BitNot:
+      return "bit_not";
+    case Ir_Neg:
+      return "neg";
+    case Ir_Cast:
+      return "cast";
+    case Ir_Slice:
+      return "slice";
+    case Ir_SliceSet:
+      return "slice_set";
+    case Ir_IsValid:
+      return "is_valid";
+    case Ir_SetValid:
+      return "set_valid";
+    case Ir_SetInvalid:
+      return "set_invalid";
+    case Ir_Call:
+      return "call";
+    case Ir_TableApply:
+      return "table_apply";
+    case Ir_TableHit:
+      return "table_hit";
+    case Ir_ActionRun:
+      return "action_run";
+    case Ir_PacketCheck:
+      return "packet_check";
+    default: break;
+  }
+  assert(0);
+  return 0;
+}
+
+internal char*
+term_kind_to_string(enum IrTermKind term)
+{
+  switch (term) {
+    case IrTerm_Jump:
+      return "jump";
+    case IrTerm_Branch:
+      return "branch";
+    case IrTerm_Switch:
+      return "switch";
+    case IrTerm_Select:
+      return "select";
+    case IrTerm_Return:
+      return "return";
+    case IrTerm_Exit:
+      return "exit";
+    case IrTerm_Accept:
+      return "accept";
+    case IrTerm_Reject:
+      return "reject";
+    default: break;
+  }
+  assert(0);
+  return 0;
+}
+
+internal char*
+function_kind_to_string(enum IrFunctionKind kind)
+{
+  switch (kind) {
+    case IrFunction_Parser:
+      return "parser";
+    case IrFunction_Control:
+      return "control";
+    case IrFunction_Action:
+      return "action";
+    case IrFunction_Function:
+      return "function";
+  }
+  assert(0);
+  return 0;
+}
+
+internal void
+print_value(struct BitInt* value)
+{
+  char buf[64];
+  int length = bitint_to_string(buf, sizeof(buf), value);
+  if (length < sizeof(buf)) {
+    printf("%s", buf);
+  } else {
+    printf("<%d bits>", value->width);
+  }
+}
+
+internal void
+print_insn(struct IrFunction* function, struct IrInsn* insn)
+{
+  printf("    ");
+  if (insn->type) {
+    printf("%%%d = ", insn->id);
+  }
+  printf("%s", ir_opcode_to_string(insn->op));
+  if (insn->op == Ir_Const) {
+    printf(" ");
+    print_value(insn->value);
+  } else if (insn->op == Ir_Param || insn->op == Ir_EnumConst || insn->op == Ir_PacketCheck) {
+    printf(" %d", insn->index);
+  } else if (insn->op == Ir_String) {
+    printf(" \"%s\"", insn->name);
+  } else if (insn->op == Ir_Slice || insn->op == Ir_SliceSet) {
+    printf(" [%d:%d]", insn->index, insn->low);
+  }
+  if (insn->name && insn->op != Ir_String) {
+    printf(" `%s`", insn->name);
+  }
+  if (insn->receiver) {
+    printf(" %%%d.", insn->receiver);
+  }
+  int i;
+  for (i = 0; i < insn->arg_count; i++) {
+    if (insn->op == Ir_Phi) {
+      struct IrBlock* block = ir_block(function, insn->block);
+      printf("%s [%%%d, b%d]", i > 0 ? "," : "", insn->args[i], block->preds[i]);
+    } else {
+      printf("%s %%%d", i > 0 ? "," : "", insn->args[i]);
+    }
+  }
+  if (insn->type) {
+    printf(" : %s", type_to_string(insn->type));
+  }
+  printf("\n");
+}
+
+internal void
+print_terminator(struct IrBlock* block)
+{
+  int i, k;
+  printf("    %s", term_kind_to_string(block->term));
+  if (block->term == IrTerm_Jump) {
+    printf(" b%d", block->succs[0]);
+  } else if (block->term == IrTerm_Branch) {
+    printf(" %%%d, b%d, b%d", block->value, block->succs[0], block->succs[1]);
+  } else if (block->term == IrTerm_Switch) {
+    printf(" %%%d", block->value);
+    for (i = 0; i < block->case_count; i++) {
+      printf(", ");
+      print_value(block->case_values[i]);
+      printf(": b%d", block->succs[i]);
+    }
+    printf(", default: b%d", block->succs[block->case_count]);
+  } else if (block->term == IrTerm_Select) {
+    printf(" (");
+    for (k = 0; k < block->key_count; k++) {
+      printf("%s%%%d", k > 0 ? ", " : "", block->keys[k]);
+    }
+    printf(")");
+    for (i = 0; i < block->case_count; i++) {
+      printf(", (");
+      for (k = 0; k < block->key_count; k++) {
+        struct IrKeysetElem* elem = &block->select_cases[i].elems[k];
+        printf("%s", k > 0 ? ", " : "");
+        if (!elem->value) {
+          printf("_");
+          continue;
+        }
+        print_value(elem->value);
+        if (elem->mask) {
+          printf(" &&& ");
+          print_value(elem->mask);
+        }
+      }
+      printf("): b%d", block->succs[i]);
+    }
+    printf(", default: b%d", block->succs[block->case_count]);
+  } else if (block->term == IrTerm_Return && block->value) {
+    printf(" %%%d", block->value);
+  }
+  printf("\n");
+}
+
+internal void
+print_function(struct IrFunction* function)
+{
+  int i, j;
+  printf("%s %s", function_kind_to_string(function->kind), function->name);
+  if (function->parent) {
+    printf(" in %s", function->parent->name);
+  }
+  printf(" {\n");
+  for (i = 0; i < function->locals.elem_count; i++) {
+    struct Ast* local_decl = *(struct Ast**)array_get(&function->locals, i);
+    struct Ast* name = (struct Ast*)ast_getattr(local_decl, "name");
+    printf("  local %s\n", name ? (char*)ast_getattr(name, "name") : "?");
+  }
+  for (i = 0; i < function->tables.elem_count; i++) {
+    struct Ast* table = *(struct Ast**)array_get(&function->tables, i);
+    printf("  table %s\n", (char*)ast_getattr((struct Ast*)ast_getattr(table, "name"), "name"));
+  }
+  for (i = 1; i < function->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(function, i);
+    printf("  b%d", i);
+    if (block->label) {
+      printf(" (%s)", block->label);
+    }
+    printf(":");
+    if (block->pred_count > 0) {
+      printf("  ; preds");
+      for (j = 0; j < block->pred_count; j++) {
+        printf(" b%d", block->preds[j]);
+      }
+    }
+    printf("\n");
+    int id = block->first_insn;
+    while (id) {
+      struct IrInsn* insn = ir_insn(function, id);
+      print_insn(function, insn);
+      id = insn->next_in_block;
+    }
+    if (block->term) {
+      print_terminator(block);
+    }
+  }
+  printf("}\n");
+}
+
+void
+print_ir_program(struct IrProgram* program)
+{
+  int i;
+  for (i = 0; i < program->functions.elem_count; i++) {
+    struct IrFunction* function = *(struct IrFunction**)array_get(&program->functions, i);
+    print_function(function);
+  }
+}
@@ -0,0 +1,1970 @@
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+#include "type_check.h"
+#include "ir.h"
+#include "ebpf.h"
+#include <memory.h>  // memset, memcpy
+#include <time.h>
+
+
+/*
+ * Reference interpreter: runs the IR of a program, as the eBPF backends
+ * lower it, over the packets of a pcap file, in userspace and without a
+ * kernel.  Its verdicts and output packets are what the compiled programs
+ * must produce, and its ns/packet is the baseline they are measured against.
+ *
+ * Every value is a uint64_t, reduced to its type as the C of emit_xdp.c
+ * reduces it: masked to its width, or sign-extended from it.  Memory is
+ * made of such slots: a header is its fields then its valid flag, a stack
+ * its elements then `next`, a struct its members one after the other, and a
+ * reference points at the first slot.  Each call gets a frame on an arena
+ * that is rewound once the packet is through the pipeline; packets and their
+ * outputs are read and written a batch at a time, on an arena rewound after
+ * each batch.
+ *
+ * Tables hold their const entries and initial default action, as the
+ * programs write them on their first run; no control plane adds entries.
+ * The externs of ubpf_model.p4 are those of ebpf/ubpf_run.c: registers are
+ * shared arrays, `hash` is lookup3 over the values of its data in network
+ * order, and `truncate` cuts the packet the deparser leaves.
+ */
+
+#define RUN_MAX_PACKET_SIZE    65536
+#define RUN_MAX_PACKET_OFFSET  0x3fff      /* ASHP4C_MAX_PACKET_OFFSET of the backends */
+#define RUN_ETH_HLEN           14          /* what bpf_xdp_adjust_head leaves of a packet at least */
+#define RUN_INGRESS_IFINDEX    1           /* the loopback device BPF_PROG_TEST_RUN receives on */
+#define RUN_NO_ACTION          0xffffffff
+#define RUN_UBPF_REDIRECT      3           /* REDIRECT of enum ubpf_action */
+#define RUN_HASH_MAX_DATA      256
+#define PCAP_MAGIC             0xa1b2c3d4
+#define PCAP_MAGIC_NSEC        0xa1b23c4d
+#define LINKTYPE_ETHERNET      1
+
+/* enum xdp_action */
+enum RunVerdict {
+  RunVerdict_Aborted,
+  RunVerdict_Drop,
+  RunVerdict_Pass,
+  RunVerdict_Tx,
+  RunVerdict_Redirect,
+  RunVerdict_COUNT_,
+};
+
+internal char* verdict_names[] = {"ABORTED", "DROP", "PASS", "TX", "REDIRECT"};
+
+/* What an Ir_Call does, decided once per instruction. */
+enum RunCallKind {
+  RunCall_NONE_,
+  RunCall_Function,          /* an action or a function of the program */
+  RunCall_Apply,             /* of a parser or control instance */
+  RunCall_Extract,
+  RunCall_Lookahead,
+  RunCall_Advance,
+  RunCall_Length,
+  RunCall_Emit,
+  RunCall_CounterIncrement,
+  RunCall_CounterAdd,
+  RunCall_Verify,
+  RunCall_Ktime,
+  RunCall_CsumReplace2,
+  RunCall_CsumReplace4,
+  RunCall_Ipv4Checksum,
+  RunCall_RegisterRead,
+  RunCall_RegisterWrite,
+  RunCall_MarkToDrop,
+  RunCall_MarkToPass,
+  RunCall_Truncate,
+  RunCall_Hash,
+};
+
+/* Where an Ir_Var finds its memory. */
+enum RunVarKind {
+  RunVar_NONE_,              /* an extern object, which has none */
+  RunVar_Param,
+  RunVar_Local,
+  RunVar_ContextParam,       /* of the control the action belongs to */
+  RunVar_ContextLocal,
+};
+
+struct RunInsn {
+  enum RunVarKind var_kind;
+  enum RunCallKind call_kind;
+  enum EbpfStackField stack_field;
+  int index;                     /* Ir_Var: parameter or slot; Ir_Field: slot of the member; Ir_TableApply: its lookup */
+  int temp;                      /* slot of the memory of a temporary, or -1 */
+  int size;                      /* elements of the stack reached */
+  int elem_slots;                /* ... and slots of each */
+  int data_count;                /* an action run by a table: parameters that the entry supplies */
+  struct Type* type;             /* what a lookahead reads */
+  struct RunHeader* header;      /* what an extract or lookahead parses */
+  struct RunEmit* emits;         /* the headers an emit writes, in order */
+  int emit_count;
+  struct RunFunction* callee;
+  struct RunTable* table;
+  struct RunCounter* counter;
+  struct RunRegister* reg;
+};
+
+/* Where the fields of a header type are on the wire. */
+struct RunHeader {
+  struct Type* type;
+  struct Type** member_types;
+  int* offsets;                  /* bits */
+  int* widths;
+  int member_count;
+  int size;                      /* bytes */
+};
+
+/* A header of what is emitted, at `slot` of the emitted memory. */
+struct RunEmit {
+  struct RunHeader* header;
+  int slot;
+};
+
+/* Switch: the case values; select: the value and mask of each key of each case, 0 and 0 for a wildcard. */
+struct RunBlock {
+  uint64_t* values;
+  uint64_t* masks;
+};
+
+struct RunFunction {
+  struct IrFunction* ir;
+  struct IrInsn** ir_insns;      /* by id, so that running does not go through the segments of `ir->insns` */
+  struct IrBlock** ir_blocks;    /* by id */
+  struct RunInsn* insns;         /* by id */
+  struct RunBlock* blocks;       /* by id */
+  uint64_t* init_values;         /* by id: the constants, the rest 0 */
+  int param_count;
+  struct Type** param_types;
+  int* param_slots;              /* by parameter: slot of its value if passed by value, else -1 */
+  int* local_slots;              /* by local: slot of its memory, or -1 */
+  int slot_count;
+  int lookup_count;
+};
+
+struct RunFrame {
+  struct RunFunction* function;
+  struct RunFrame* context;      /* of the parser or control: itself, or the one an action belongs to */
+  uint64_t* memory;
+  uint64_t* values;              /* by id */
+  uint64_t** refs;               /* by id */
+  uint64_t** params;
+  struct RunLookup* lookups;
+};
+
+/* The entries of a table, keys and masks reduced to the bytes of the map key. */
+struct RunTable {
+  struct EbpfTable* table;
+  uint64_t* key_masks;           /* by key */
+  uint64_t* keys;                /* by entry, then key: already masked */
+  uint64_t* masks;
+  int* prefixes;                 /* LPM: bits of the key each entry matches */
+  uint64_t** args;               /* by entry */
+  uint64_t* default_args;
+  uint64_t* zero_args;           /* of an element of an array table that no entry sets */
+  bool is_array;                 /* a declared `array_table`: every index below its size is an entry */
+  uint64_t hit_count;
+  uint64_t miss_count;
+};
+
+struct RunLookup {
+  bool hit;
+  int action;
+  uint64_t* args;
+};
+
+/* An array map, or a hash map under open addressing for a sparse one. */
+struct RunCounter {
+  struct EbpfCounter* counter;
+  uint32_t* values;
+  uint32_t* indexes;
+  bool* is_used;
+  int capacity;
+  int count;
+};
+
+struct RunRegister {
+  struct EbpfRegister* reg;
+  uint64_t* values;
+};
+
+struct RunPacket {
+  uint8_t* data;
+  uint32_t size;
+  uint32_t offset;
+  uint8_t* out;                  /* what the deparser emits */
+  uint32_t out_size;
+};
+
+internal struct Arena* run_storage;
+internal struct Arena frame_storage = {};  /* frames of the packet being run, rewound after each run */
+internal struct Arena batch_storage = {};  /* packets of the batch and their outputs */
+internal struct EbpfProgram* program;
+internal struct UnboundedArray functions;  /* struct RunFunction*, as they are prepared */
+internal struct UnboundedArray headers;    /* struct RunHeader* */
+internal struct RunTable* tables;          /* as program->tables */
+internal struct RunCounter* counters;      /* as program->counters */
+internal struct RunRegister* registers;    /* as program->registers */
+internal uint64_t* output_action;          /* ubpf: in the standard_metadata of the packet */
+internal uint32_t truncate_size;           /* ubpf: what `truncate` leaves of the output */
+internal uint64_t* phi_values;
+internal int phi_capacity;
+internal struct RunPacket packet;
+internal uint8_t emit_buffer[RUN_MAX_PACKET_SIZE];
+internal bool is_counted;                  /* table lookups count: the first run of each packet */
+
+internal struct RunFunction* function_of(struct IrFunction* f);
+internal void prepare_insn(struct RunFunction* f, struct IrInsn* insn);
+
+internal uint64_t
+clock_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Values and memory.
+ */
+
+/* `value` reduced to the values of `type`: masked, or sign-extended from its width. */
+internal uint64_t
+wrap(struct Type* type, uint64_t value)
+{
+  type = ebpf_resolve_type(type);
+  if (!type || type->kind == Type_Int) {
+    return value;
+  } else if (type->kind == Type_Bool) {
+    return value != 0;
+  }
+  int width = ebpf_scalar_width(type);
+  if (width < 0 || width >= 64) {
+    return value;
+  } else if (type->kind == Type_SignedInt) {
+    return (uint64_t)((int64_t)(value << (64 - width)) >> (64 - width));
+  }
+  return value & ebpf_width_mask(width);
+}
+
+internal uint64_t
+const_value(struct BitInt* value, struct Type* type)
+{
+  uint64_t bits = 0;
+  if (!value->is_sized) {
+    int64_t v = 0;
+    if (!bitint_to_int64(value, &v)) {
+      error("integer constant does not fit in 64 bits.");
+    }
+    bits = (uint64_t)v;
+  } else {
+    bits = value->word_count > 0 ? value->words[0] : 0;
+    if (value->is_signed && value->width < 64 && (bits >> (value->width - 1)) & 1) {
+      bits |= ~ebpf_width_mask(value->width);
+    }
+  }
+  return wrap(type, bits);
+}
+
+internal int
+slot_count(struct Type* type)
+{
+  type = ebpf_resolve_type(type);
+  int count = 0;
+  int i;
+  if (ebpf_is_extern_object(type)) {
+    return 0;
+  } else if (type->kind == Type_HeaderStack) {
+    return type->width * slot_count(type->base) + 1;
+  } else if (type->kind != Type_Struct && type->kind != Type_Header && type->kind != Type_HeaderUnion) {
+    return 1;
+  }
+  for (i = 0; i < type->member_count; i++) {
+    count += slot_count(type->members[i].type);
+  }
+  return type->kind == Type_Header ? count + 1 : count;
+}
+
+internal int
+member_slot(struct Type* type, int member)
+{
+  int slot = 0;
+  int i;
+  for (i = 0; i < member; i++) {
+    slot += slot_count(type->members[i].type);
+  }
+  return slot;
+}
+
+internal int
+member_index(struct Type* type, char* name)
+{
+  int i;
+  for (i = 0; i < type->member_count; i++) {
+    if (cstr_match(type->members[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Wire format of headers, as emit_xdp.c loads and stores it: fields numbered
+ * from the most significant bit of the first byte.
+ */
+
+internal uint64_t
+load_bits(uint8_t* bytes, int offset, int width)
+{
+  uint64_t value = 0;
+  int k;
+  for (k = offset / 8; width > 0 && k <= (offset + width - 1) / 8; k++) {
+    int lo = offset > 8 * k ? offset : 8 * k;
+    int hi = offset + width < 8 * k + 8 ? offset + width : 8 * k + 8;
+    value |= (uint64_t)((bytes[k] >> (8 * k + 8 - hi)) & ebpf_width_mask(hi - lo)) << (offset + width - hi);
+  }
+  return value;
+}
+
+internal void
+store_bits(uint8_t* bytes, int offset, int width, uint64_t value)
+{
+  int k;
+  for (k = offset / 8; width > 0 && k <= (offset + width - 1) / 8; k++) {
+    int lo = offset > 8 * k ? offset : 8 * k;
+    int hi = offset + width < 8 * k + 8 ? offset + width : 8 * k + 8;
+    int shift = 8 * k + 8 - hi;
+    int mask = (int)ebpf_width_mask(hi - lo) << shift;
+    bytes[k] = (bytes[k] & ~mask) | ((uint8_t)(value >> (offset + width - hi)) << shift & mask);
+  }
+}
+
+/* Start of `size` bytes at the packet offset, or 0 if the packet is shorter. */
+internal uint8_t*
+cursor(uint32_t size)
+{
+  if (packet.offset > RUN_MAX_PACKET_OFFSET || packet.offset + size > packet.size) {
+    return 0;
+  }
+  return packet.data + packet.offset;
+}
+
+internal struct RunHeader*
+header_of(struct Type* type)
+{
+  int i;
+  type = ebpf_resolve_type(type);
+  for (i = 0; i < headers.elem_count; i++) {
+    struct RunHeader* header = *(struct RunHeader**)array_get(&headers, i);
+    if (header->type == type) {
+      return header;
+    }
+  }
+  struct RunHeader* header = arena_push(run_storage, sizeof(*header));
+  header->type = type;
+  header->member_count = type->member_count;
+  header->size = ebpf_header_size(type);
+  header->member_types = arena_push(run_storage, (type->member_count + 1) * sizeof(struct Type*));
+  header->offsets = arena_push(run_storage, (type->member_count + 1) * sizeof(int));
+  header->widths = arena_push(run_storage, (type->member_count + 1) * sizeof(int));
+  for (i = 0; i < type->member_count; i++) {
+    header->member_types[i] = type->members[i].type;
+    header->offsets[i] = ebpf_field_offset(type, i);
+    header->widths[i] = ebpf_scalar_width(type->members[i].type);
+  }
+  array_append(&headers, &header);
+  return header;
+}
+
+internal void
+parse_header(struct RunHeader* header, uint8_t* bytes, uint64_t* h)
+{
+  int i;
+  for (i = 0; i < header->member_count; i++) {
+    h[i] = wrap(header->member_types[i], load_bits(bytes, header->offsets[i], header->widths[i]));
+  }
+  h[header->member_count] = 1;
+}
+
+internal void
+emit_header(struct RunHeader* header, uint64_t* h)
+{
+  int i;
+  if (!h[header->member_count] || packet.out_size + header->size > RUN_MAX_PACKET_SIZE) {
+    return;
+  }
+  for (i = 0; i < header->member_count; i++) {
+    store_bits(packet.out + packet.out_size, header->offsets[i], header->widths[i], h[i]);
+  }
+  packet.out_size += header->size;
+}
+
+/*
+ * Tables and counters.
+ */
+
+internal uint64_t*
+action_args(struct RunTable* run, int action, struct BitInt** args)
+{
+  if (action < 0 || !args) {
+    return run->zero_args;
+  }
+  struct EbpfAction* a = &run->table->actions[action];
+  uint64_t* values = arena_push(run_storage, (a->param_count + 1) * sizeof(uint64_t));
+  int i;
+  for (i = 0; i < a->param_count; i++) {
+    values[i] = args[i] ? const_value(args[i], a->params[i].type) : 0;
+  }
+  return values;
+}
+
+internal void
+prepare_table(struct RunTable* run, struct EbpfTable* table)
+{
+  int key_count = table->key_count;
+  int e, k;
+  memset(run, 0, sizeof(*run));
+  run->table = table;
+  run->is_array = table->kind == EbpfTable_Map && table->map.type == EbpfMap_Array;
+  int data_count = 0;
+  for (k = 0; k < table->action_count; k++) {
+    if (table->actions[k].param_count > data_count) {
+      data_count = table->actions[k].param_count;
+    }
+  }
+  run->zero_args = arena_push(run_storage, (data_count + 1) * sizeof(uint64_t));
+  memset(run->zero_args, 0, (data_count + 1) * sizeof(uint64_t));
+  run->key_masks = arena_push(run_storage, (key_count + 1) * sizeof(uint64_t));
+  for (k = 0; k < key_count; k++) {
+    run->key_masks[k] = ebpf_width_mask(8 * table->keys[k].size);
+  }
+  run->keys = arena_push(run_storage, (table->entry_count * key_count + 1) * sizeof(uint64_t));
+  run->masks = arena_push(run_storage, (table->entry_count * key_count + 1) * sizeof(uint64_t));
+  run->prefixes = arena_push(run_storage, (table->entry_count + 1) * sizeof(int));
+  run->args = arena_push(run_storage, (table->entry_count + 1) * sizeof(uint64_t*));
+  for (e = 0; e < table->entry_count; e++) {
+    struct EbpfTableEntry* entry = &table->entries[e];
+    for (k = 0; k < key_count; k++) {
+      struct EbpfField* field = &table->keys[k];
+      uint64_t mask = entry->masks[k] ? const_value(entry->masks[k], field->type) : ~0ull;
+      mask &= run->key_masks[k];
+      run->masks[e * key_count + k] = mask;
+      run->keys[e * key_count + k] = const_value(entry->keys[k], field->type) & mask;
+    }
+    run->prefixes[e] = ebpf_prefix_length(table, entry);
+    run->args[e] = action_args(run, entry->action, entry->args);
+  }
+  run->default_args = action_args(run, table->default_action, table->default_args);
+}
+
+/*
+ * The first entry that matches wins; of LPM entries, the longest prefix.  A
+ * miss runs the default action.
+ */
+internal void
+lookup(struct RunTable* run, uint64_t* values, int* args, struct RunLookup* result)
+{
+  struct EbpfTable* table = run->table;
+  int key_count = table->key_count;
+  int best = -1;
+  int e, k;
+  bool is_missing = key_count == 0 || (run->is_array && (values[args[0]] & 0xffffffff) >= table->map.max_entries);
+  for (e = 0; e < table->entry_count && !is_missing; e++) {
+    for (k = 0; k < key_count; k++) {
+      if ((values[args[k]] & run->masks[e * key_count + k]) != run->keys[e * key_count + k]) {
+        break;
+      }
+    }
+    if (k == key_count && (best < 0 || (table->is_lpm && run->prefixes[e] > run->prefixes[best]))) {
+      best = e;
+      if (!table->is_lpm) {
+        break;
+      }
+    }
+  }
+  if (best >= 0) {
+    result->hit = true;
+    result->action = table->entries[best].action;
+    result->args = run->args[best];
+  } else if (run->is_array && !is_missing) {
+    /* The element is there, zeroed: the first action, with no data. */
+    result->hit = true;
+    result->action = 0;
+    result->args = run->zero_args;
+  } else {
+    result->hit = false;
+    result->action = table->default_action;
+    result->args = run->default_args;
+  }
+  if (is_counted && result->hit) {
+    run->hit_count += 1;
+  } else if (is_counted) {
+    run->miss_count += 1;
+  }
+}
+
+internal void
+prepare_counter(struct RunCounter* run, struct EbpfCounter* counter)
+{
+  memset(run, 0, sizeof(*run));
+  run->counter = counter;
+  run->capacity = counter->map.max_entries;
+  if (counter->map.type == EbpfMap_Hash) {
+    run->capacity = 1;
+    while (run->capacity < 2 * counter->map.max_entries) {
+      run->capacity *= 2;
+    }
+  }
+  run->values = arena_push(run_storage, run->capacity * sizeof(uint32_t));
+  memset(run->values, 0, run->capacity * sizeof(uint32_t));
+  run->indexes = arena_push(run_storage, run->capacity * sizeof(uint32_t));
+  run->is_used = arena_push(run_storage, run->capacity * sizeof(bool));
+  memset(run->is_used, 0, run->capacity * sizeof(bool));
+}
+
+/* ashp4c_counter_add: an array has every index below its size; a sparse counter adds one while it has room. */
+internal void
+counter_add(struct RunCounter* run, uint32_t index, uint32_t value)
+{
+  if (run->counter->map.type != EbpfMap_Hash) {
+    if (index < (uint32_t)run->capacity) {
+      run->values[index] += value;
+    }
+    return;
+  }
+  uint32_t i = (index * 2654435761u) & (run->capacity - 1);
+  while (run->is_used[i] && run->indexes[i] != index) {
+    i = (i + 1) & (run->capacity - 1);
+  }
+  if (run->is_used[i]) {
+    run->values[i] += value;
+  } else if (run->count < run->counter->map.max_entries) {
+    run->is_used[i] = true;
+    run->indexes[i] = index;
+    run->values[i] = value;
+    run->count += 1;
+  }
+}
+
+/*
+ * Preparation: what each instruction needs at run time, found once.
+ */
+
+internal struct RunTable*
+table_of(struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < program->tables.elem_count; i++) {
+    if (tables[i].table->decl == decl) {
+      return &tables[i];
+    }
+  }
+  assert(0);
+  return 0;
+}
+
+internal struct RunCounter*
+counter_of(struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < program->counters.elem_count; i++) {
+    if (counters[i].counter->decl == decl) {
+      return &counters[i];
+    }
+  }
+  return 0;
+}
+
+internal struct RunRegister*
+register_of(struct Ast* decl)
+{
+  int i;
+  for (i = 0; i < program->registers.elem_count; i++) {
+    if (registers[i].reg->decl == decl) {
+      return &registers[i];
+    }
+  }
+  return 0;
+}
+
+internal void
+prepare_var(struct RunFunction* f, struct IrInsn* insn, struct RunInsn* run)
+{
+  struct Ast* decl = insn->decl;
+  struct IrFunction* owner = f->ir;
+  bool is_context = false;
+  int i;
+  if (ebpf_is_extern_object(insn->type)) {
+    run->var_kind = RunVar_NONE_;
+    return;
+  }
+  if (!ebpf_is_block(owner)) {
+    if ((i = ebpf_list_index(owner->params, decl)) >= 0) {
+      run->var_kind = RunVar_Param;
+      run->index = i;
+      return;
+    }
+    for (i = 0; i < owner->locals.elem_count; i++) {
+      if (*(struct Ast**)array_get(&owner->locals, i) == decl) {
+        run->var_kind = RunVar_Local;
+        run->index = f->local_slots[i];
+        return;
+      }
+    }
+    owner = owner->parent;
+    is_context = true;
+  }
+  if (owner) {
+    if ((i = ebpf_list_index(owner->params, decl)) >= 0) {
+      run->var_kind = is_context ? RunVar_ContextParam : RunVar_Param;
+      run->index = i;
+      return;
+    }
+    for (i = 0; i < owner->locals.elem_count; i++) {
+      if (*(struct Ast**)array_get(&owner->locals, i) == decl) {
+        run->var_kind = is_context ? RunVar_ContextLocal : RunVar_Local;
+        run->index = function_of(owner)->local_slots[i];
+        return;
+      }
+    }
+  }
+  error("at line %d: `%s` is not visible in `%s` for the interpreter.", insn->line_nr, ebpf_decl_name(decl),
+        f->ir->name);
+}
+
+internal void
+prepare_field(struct RunFunction* f, struct IrInsn* insn, struct RunInsn* run)
+{
+  struct Type* base = ebpf_resolve_type(ir_insn(f->ir, insn->args[0])->type);
+  if (base && base->kind == Type_HeaderStack) {
+    run->size = base->width;
+    run->elem_slots = slot_count(base->base);
+    run->stack_field = ebpf_stack_field(insn->name);
+    if (run->stack_field == EbpfStackField_LastIndex || run->stack_field == EbpfStackField_Size) {
+      run->temp = f->slot_count++;
+    } else if (run->stack_field == EbpfStackField_NONE_) {
+      error("at line %d: stack field `%s` is not supported by the interpreter.", insn->line_nr, insn->name);
+    }
+    return;
+  }
+  int member = base ? member_index(base, insn->name) : -1;
+  if (member < 0) {
+    error("at line %d: `%s` has no field `%s`.", insn->line_nr, base ? type_to_string(base) : "?", insn->name);
+  }
+  run->index = member_slot(base, member);
+}
+
+internal void
+prepare_method_call(struct RunFunction* f, struct IrInsn* insn, struct IrInsn* receiver, struct RunInsn* run)
+{
+  struct Type* type = ebpf_resolve_type(receiver->type);
+  char* extern_name = type && type->kind == Type_Extern ? type->name : "";
+  struct IrInsn* arg = insn->arg_count > 0 ? ir_insn(f->ir, insn->args[0]) : 0;
+  if (cstr_match(extern_name, "packet_in")) {
+    if (cstr_match(insn->name, "extract")) {
+      if (insn->arg_count != 1) {
+        error("at line %d: the interpreter does not support variable-size headers.", insn->line_nr);
+      }
+      run->call_kind = RunCall_Extract;
+      if (ebpf_resolve_type(arg->type)->kind != Type_Header) {
+        error("at line %d: only headers can be extracted.", insn->line_nr);
+      }
+      run->header = header_of(arg->type);
+      struct IrInsn* stack = arg->op == Ir_Field ? ir_insn(f->ir, arg->args[0]) : 0;
+      if (stack && ebpf_resolve_type(stack->type)->kind == Type_HeaderStack && cstr_match(arg->name, "next")) {
+        run->index = stack->id;
+        run->size = ebpf_resolve_type(stack->type)->width;
+        run->elem_slots = slot_count(arg->type);
+      }
+      return;
+    } else if (cstr_match(insn->name, "lookahead")) {
+      run->call_kind = RunCall_Lookahead;
+      run->type = ebpf_resolve_type(insn->type);
+      if (run->type->kind != Type_Header && (!ebpf_scalar_size(run->type) || run->type->kind == Type_Int)) {
+        error("at line %d: the interpreter cannot look ahead for `%s`.", insn->line_nr, type_to_string(run->type));
+      }
+      if (run->type->kind == Type_Header) {
+        run->header = header_of(run->type);
+      }
+      return;
+    } else if (cstr_match(insn->name, "advance")) {
+      run->call_kind = RunCall_Advance;
+      return;
+    } else if (cstr_match(insn->name, "length")) {
+      run->call_kind = RunCall_Length;
+      return;
+    }
+  } else if (cstr_match(extern_name, "packet_out") && cstr_match(insn->name, "emit")) {
+    /* The headers in order: a stack's elements, a struct's or union's members. */
+    struct Type* type = ebpf_resolve_type(arg->type);
+    int i, slot = 0;
+    run->call_kind = RunCall_Emit;
+    if (type->kind == Type_Header) {
+      run->emit_count = 1;
+    } else if (type->kind == Type_HeaderStack) {
+      run->emit_count = type->width;
+    } else {
+      run->emit_count = type->member_count;
+    }
+    run->emits = arena_push(run_storage, (run->emit_count + 1) * sizeof(struct RunEmit));
+    for (i = 0; i < run->emit_count; i++) {
+      struct Type* header = type->kind == Type_Header ? type
+                            : type->kind == Type_HeaderStack ? type->base : type->members[i].type;
+      if (ebpf_resolve_type(header)->kind != Type_Header) {
+        error("at line %d: the interpreter can only emit structs of headers.", insn->line_nr);
+      }
+      run->emits[i].header = header_of(header);
+      run->emits[i].slot = slot;
+      slot += slot_count(header);
+    }
+    return;
+  } else if (cstr_match(extern_name, "CounterArray")) {
+    run->counter = counter_of(receiver->decl);
+    if (!run->counter) {
+      error("at line %d: counter array `%s` must be declared in a control.", insn->line_nr, receiver->name);
+    }
+    if (cstr_match(insn->name, "increment")) {
+      run->call_kind = RunCall_CounterIncrement;
+      return;
+    } else if (cstr_match(insn->name, "add")) {
+      run->call_kind = RunCall_CounterAdd;
+      return;
+    }
+  } else if (cstr_match(extern_name, "Register")) {
+    run->reg = register_of(receiver->decl);
+    if (!run->reg) {
+      error("at line %d: register `%s` must be declared in a control.", insn->line_nr, receiver->name);
+    }
+    if (cstr_match(insn->name, "read")) {
+      run->call_kind = RunCall_RegisterRead;
+      return;
+    } else if (cstr_match(insn->name, "write")) {
+      run->call_kind = RunCall_RegisterWrite;
+      return;
+    }
+  } else if (type && (type->kind == Type_Parser || type->kind == Type_Control) && cstr_match(insn->name, "apply")) {
+    struct IrFunction* callee = ir_function_of(program->ir, type->decl);
+    if (callee) {
+      run->call_kind = RunCall_Apply;
+      run->callee = function_of(callee);
+      return;
+    }
+  }
+  error("at line %d: `%s.%s` is not supported by the interpreter.", insn->line_nr,
+        type ? type_to_string(receiver->type) : "?", insn->name);
+}
+
+/* Bytes of the data of a `hash`: each bit<W> value in ceil(W / 8), lists flattened. */
+internal int
+hash_data_size(struct IrFunction* f, struct IrInsn* data)
+{
+  int size = 0, i;
+  if (data->op == Ir_Tuple) {
+    for (i = 0; i < data->arg_count; i++) {
+      size += hash_data_size(f, ir_insn(f, data->args[i]));
+    }
+  } else {
+    int width = ebpf_scalar_width(ebpf_resolve_type(data->type));
+    if (width <= 0 || width > 64) {
+      error("at line %d: the data of `hash` must be a list of bit<W> values.", data->line_nr);
+    }
+    size = (width + 7) / 8;
+  }
+  if (size > RUN_HASH_MAX_DATA) {
+    error("at line %d: the data of `hash` is over %d bytes.", data->line_nr, RUN_HASH_MAX_DATA);
+  }
+  return size;
+}
+
+/* Calls of the program's actions and functions, and of the extern functions of the eBPF models. */
+internal void
+prepare_call(struct RunFunction* f, struct IrInsn* insn, struct RunInsn* run)
+{
+  struct IrInsn* receiver = insn->receiver ? ir_insn(f->ir, insn->receiver) : 0;
+  if (receiver && receiver->op != Ir_TableApply) {
+    prepare_method_call(f, insn, receiver, run);
+    return;
+  }
+  struct Ast* decl = insn->decl;
+  struct IrFunction* callee = ir_function_of(program->ir, decl);
+  if (!callee && decl && decl->kind == Ast_FunctionDecl) {
+    callee = ir_function_of(program->ir, (struct Ast*)ast_getattr(decl, "proto"));
+  }
+  if (callee) {
+    run->call_kind = RunCall_Function;
+    run->callee = function_of(callee);
+    if (receiver) {
+      struct RunInsn* apply = &f->insns[receiver->id];
+      if (!apply->table) {
+        /* The apply is in a block numbered after the call's. */
+        prepare_insn(f, receiver);
+      }
+      struct EbpfAction* action = ebpf_table_action(apply->table->table, callee->decl);
+      run->table = apply->table;
+      run->index = apply->index;
+      run->data_count = action ? action->param_count : 0;
+    }
+    return;
+  }
+  if (cstr_match(insn->name, "verify")) {
+    run->call_kind = RunCall_Verify;
+  } else if (cstr_match(insn->name, "BPF_KTIME_GET_NS") || cstr_match(insn->name, "ubpf_time_get_ns")) {
+    run->call_kind = RunCall_Ktime;
+  } else if (cstr_match(insn->name, "mark_to_drop") && program->model == EbpfModel_Ubpf) {
+    run->call_kind = RunCall_MarkToDrop;
+  } else if (cstr_match(insn->name, "mark_to_pass") && program->model == EbpfModel_Ubpf) {
+    run->call_kind = RunCall_MarkToPass;
+  } else if (cstr_match(insn->name, "truncate") && program->model == EbpfModel_Ubpf) {
+    run->call_kind = RunCall_Truncate;
+  } else if (cstr_match(insn->name, "hash") && insn->arg_count == 3) {
+    run->call_kind = RunCall_Hash;
+    run->size = hash_data_size(f->ir, ir_insn(f->ir, insn->args[2]));
+  } else if (cstr_match(insn->name, "csum_replace2")) {
+    run->call_kind = RunCall_CsumReplace2;
+  } else if (cstr_match(insn->name, "csum_replace4")) {
+    run->call_kind = RunCall_CsumReplace4;
+  } else if (cstr_match(insn->name, "ebpf_ipv4_checksum")) {
+    run->call_kind = RunCall_Ipv4Checksum;
+  } else {
+    error("at line %d: extern `%s` is not supported by the interpreter.", insn->line_nr, insn->name);
+  }
+}
+
+internal void
+prepare_block(struct RunFunction* f, struct IrBlock* block)
+{
+  struct RunBlock* run = &f->blocks[block->id];
+  int phi_count = 0;
+  int id, i, k;
+  for (id = block->first_insn; id && ir_insn(f->ir, id)->op == Ir_Phi; id = ir_insn(f->ir, id)->next_in_block) {
+    phi_count += 1;
+  }
+  if (phi_count > phi_capacity) {
+    phi_capacity = phi_count;
+    phi_values = arena_push(run_storage, phi_capacity * sizeof(uint64_t));
+  }
+  if (block->term == IrTerm_Switch) {
+    struct Type* type = ir_insn(f->ir, block->value)->type;
+    run->values = arena_push(run_storage, (block->case_count + 1) * sizeof(uint64_t));
+    for (i = 0; i < block->case_count; i++) {
+      run->values[i] = const_value(block->case_values[i], type);
+    }
+  } else if (block->term == IrTerm_Select) {
+    int count = block->case_count * block->key_count;
+    run->values = arena_push(run_storage, (count + 1) * sizeof(uint64_t));
+    run->masks = arena_push(run_storage, (count + 1) * sizeof(uint64_t));
+    for (i = 0; i < block->case_count; i++) {
+      for (k = 0; k < block->key_count; k++) {
+        struct IrKeysetElem* elem = &block->select_cases[i].elems[k];
+        struct Type* type = ir_insn(f->ir, block->keys[k])->type;
+        uint64_t mask = !elem->value ? 0 : elem->mask ? const_value(elem->mask, type) : ~0ull;
+        run->masks[i * block->key_count + k] = mask;
+        run->values[i * block->key_count + k] = elem->value ? const_value(elem->value, type) & mask : 0;
+      }
+    }
+  }
+}
+
+internal void
+prepare_insn(struct RunFunction* f, struct IrInsn* insn)
+{
+  struct RunInsn* run = &f->insns[insn->id];
+  run->temp = -1;
+  switch (insn->op) {
+    case Ir_Const:
+      f->init_values[insn->id] = const_value(insn->value, insn->type);
+      break;
+    case Ir_EnumConst:
+      f->init_values[insn->id] = insn->index;
+      break;
+    case Ir_Var:
+      prepare_var(f, insn, run);
+      break;
+    case Ir_Temp:
+      run->temp = f->slot_count;
+      f->slot_count += slot_count(insn->type);
+      break;
+    case Ir_Undef:
+      if (ebpf_is_aggregate(insn->type)) {
+        run->temp = f->slot_count;
+        f->slot_count += slot_count(insn->type);
+      }
+      break;
+    case Ir_Field:
+      prepare_field(f, insn, run);
+      break;
+    case Ir_Index: {
+      struct Type* stack = ebpf_resolve_type(ir_insn(f->ir, insn->args[0])->type);
+      run->size = stack->width;
+      run->elem_slots = slot_count(stack->base);
+      break;
+    }
+    case Ir_TableApply: {
+      if (run->table) {
+        break;
+      }
+      run->table = table_of(insn->decl);
+      run->index = f->lookup_count++;
+      break;
+    }
+    case Ir_Call:
+      prepare_call(f, insn, run);
+      if (ebpf_is_aggregate(insn->type)) {
+        run->temp = f->slot_count;
+        f->slot_count += slot_count(insn->type);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* The prepared `f`, prepared now if it is not yet. */
+internal struct RunFunction*
+function_of(struct IrFunction* f)
+{
+  int i;
+  for (i = 0; i < functions.elem_count; i++) {
+    struct RunFunction* run = *(struct RunFunction**)array_get(&functions, i);
+    if (run->ir == f) {
+      return run;
+    }
+  }
+  struct RunFunction* run = arena_push(run_storage, sizeof(*run));
+  memset(run, 0, sizeof(*run));
+  run->ir = f;
+  array_append(&functions, &run);
+  run->param_count = ebpf_list_count(f->params);
+  run->param_types = arena_push(run_storage, (run->param_count + 1) * sizeof(struct Type*));
+  run->param_slots = arena_push(run_storage, (run->param_count + 1) * sizeof(int));
+  i = 0;
+  struct AstListLink* link = f->params ? ast_list_first_link(f->params) : 0;
+  while (link) {
+    run->param_types[i] = type_of_node(link->ast);
+    run->param_slots[i] = -1;
+    if (!ebpf_is_extern_object(run->param_types[i]) && ebpf_param_by_value(link->ast)) {
+      run->param_slots[i] = run->slot_count++;
+    }
+    i += 1;
+    link = link->next;
+  }
+  /* Locals first: the actions of a control reach them while the control is being prepared. */
+  run->local_slots = arena_push(run_storage, (f->locals.elem_count + 1) * sizeof(int));
+  for (i = 0; i < f->locals.elem_count; i++) {
+    struct Ast* local_decl = *(struct Ast**)array_get(&f->locals, i);
+    struct Type* type = type_of_node(local_decl);
+    run->local_slots[i] = -1;
+    if (local_decl->kind != Ast_Instantiation && !ebpf_is_extern_object(type)) {
+      run->local_slots[i] = run->slot_count;
+      run->slot_count += slot_count(type);
+    }
+  }
+  run->ir_insns = arena_push(run_storage, f->insns.elem_count * sizeof(struct IrInsn*));
+  for (i = 1; i < f->insns.elem_count; i++) {
+    run->ir_insns[i] = ir_insn(f, i);
+  }
+  run->ir_blocks = arena_push(run_storage, f->blocks.elem_count * sizeof(struct IrBlock*));
+  for (i = 1; i < f->blocks.elem_count; i++) {
+    run->ir_blocks[i] = ir_block(f, i);
+  }
+  run->insns = arena_push(run_storage, f->insns.elem_count * sizeof(struct RunInsn));
+  memset(run->insns, 0, f->insns.elem_count * sizeof(struct RunInsn));
+  run->init_values = arena_push(run_storage, f->insns.elem_count * sizeof(uint64_t));
+  memset(run->init_values, 0, f->insns.elem_count * sizeof(uint64_t));
+  run->blocks = arena_push(run_storage, f->blocks.elem_count * sizeof(struct RunBlock));
+  memset(run->blocks, 0, f->blocks.elem_count * sizeof(struct RunBlock));
+  for (i = 1; i < f->blocks.elem_count; i++) {
+    struct IrBlock* block = ir_block(f, i);
+    int id = block->first_insn;
+    while (id) {
+      prepare_insn(run, ir_insn(f, id));
+      id = ir_insn(f, id)->next_in_block;
+    }
+    prepare_block(run, block);
+  }
+  return run;
+}
+
+/*
+ * Running.
+ */
+
+internal struct RunFrame*
+new_frame(struct RunFunction* f)
+{
+  int insn_count = f->ir->insns.elem_count;
+  struct RunFrame* frame = arena_push(&frame_storage, sizeof(*frame));
+  int i;
+  frame->function = f;
+  frame->context = frame;
+  frame->memory = arena_push(&frame_storage, (f->slot_count + 1) * sizeof(uint64_t));
+  memset(frame->memory, 0, (f->slot_count + 1) * sizeof(uint64_t));
+  frame->values = arena_push(&frame_storage, insn_count * sizeof(uint64_t));
+  memcpy(frame->values, f->init_values, insn_count * sizeof(uint64_t));
+  frame->refs = arena_push(&frame_storage, insn_count * sizeof(uint64_t*));
+  frame->params = arena_push(&frame_storage, (f->param_count + 1) * sizeof(uint64_t*));
+  for (i = 0; i < f->param_count; i++) {
+    frame->params[i] = f->param_slots[i] >= 0 ? &frame->memory[f->param_slots[i]] : 0;
+  }
+  frame->lookups = arena_push(&frame_storage, (f->lookup_count + 1) * sizeof(struct RunLookup));
+  return frame;
+}
+
+/* Parameter `i` of `frame` bound to the value or the reference `arg` of `caller`. */
+internal void
+bind_param(struct RunFrame* frame, int i, struct RunFrame* caller, int arg)
+{
+  struct RunFunction* f = frame->function;
+  if (f->param_slots[i] >= 0) {
+    *frame->params[i] = wrap(f->param_types[i], caller->values[arg]);
+  } else {
+    frame->params[i] = caller->refs[arg];
+  }
+}
+
+/* Parameter `i` of `frame` bound to `memory`, or given its value. */
+internal void
+bind_memory(struct RunFrame* frame, int i, uint64_t* memory)
+{
+  if (frame->function->param_slots[i] >= 0) {
+    *frame->params[i] = *memory;
+  } else {
+    frame->params[i] = memory;
+  }
+}
+
+internal uint64_t* var_ref(struct RunFrame* frame, struct RunInsn* run)
+{
+  switch (run->var_kind) {
+    case RunVar_Param:
+      return frame->params[run->index];
+    case RunVar_Local:
+      return frame->memory + run->index;
+    case RunVar_ContextParam:
+      return frame->context->params[run->index];
+    case RunVar_ContextLocal:
+      return frame->context->memory + run->index;
+    default:
+      return 0;
+  }
+}
+
+internal uint64_t*
+field_ref(struct RunFrame* frame, struct IrInsn* insn, struct RunInsn* run)
+{
+  uint64_t* base = frame->refs[insn->args[0]];
+  uint64_t next = run->stack_field ? base[run->size * run->elem_slots] : 0;
+  uint64_t* temp = run->temp >= 0 ? frame->memory + run->temp : 0;
+  switch (run->stack_field) {
+    case EbpfStackField_Next:
+      return base + (next < run->size ? next : run->size - 1) * run->elem_slots;
+    case EbpfStackField_Last:
+      return base + (next > 0 && next <= run->size ? next - 1 : 0) * run->elem_slots;
+    case EbpfStackField_LastIndex:
+      *temp = (uint32_t)(next - 1);
+      return temp;
+    case EbpfStackField_NextIndex:
+      return base + run->size * run->elem_slots;
+    case EbpfStackField_Size:
+      *temp = run->size;
+      return temp;
+    default:
+      return base + run->index;
+  }
+}
+
+internal void
+store(struct RunFrame* frame, struct IrInsn* insn)
+{
+  struct IrInsn** insns = frame->function->ir_insns;
+  struct IrInsn* dst = insns[insn->args[0]];
+  struct IrInsn* src = insns[insn->args[1]];
+  struct Type* type = ebpf_resolve_type(dst->type);
+  uint64_t* d = frame->refs[dst->id];
+  int i;
+  if (src->op == Ir_Tuple && ebpf_is_aggregate(type)) {
+    if (type->kind != Type_Struct && type->kind != Type_Header) {
+      error("at line %d: the interpreter cannot initialize `%s` from a list.", insn->line_nr, type_to_string(type));
+    }
+    for (i = 0; i < src->arg_count && i < type->member_count; i++) {
+      struct Type* member = type->members[i].type;
+      if (ebpf_is_aggregate(member)) {
+        memmove(d, frame->refs[src->args[i]], slot_count(member) * sizeof(uint64_t));
+      } else {
+        *d = wrap(member, frame->values[src->args[i]]);
+      }
+      d += slot_count(member);
+    }
+    if (type->kind == Type_Header) {
+      frame->refs[dst->id][type->member_count] = 1;
+    }
+  } else if (ebpf_is_aggregate(type)) {
+    memmove(d, frame->refs[src->id], slot_count(type) * sizeof(uint64_t));
+  } else {
+    *d = wrap(type, frame->values[src->id]);
+  }
+}
+
+internal uint64_t
+csum_fold(uint32_t sum)
+{
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+/* Writes the data of a `hash` at `bytes` + `*at`, most significant byte first. */
+internal void
+hash_data(struct RunFrame* frame, struct IrInsn* data, uint8_t* bytes, int* at)
+{
+  int i;
+  if (data->op == Ir_Tuple) {
+    for (i = 0; i < data->arg_count; i++) {
+      hash_data(frame, frame->function->ir_insns[data->args[i]], bytes, at);
+    }
+    return;
+  }
+  int size = (ebpf_scalar_width(ebpf_resolve_type(data->type)) + 7) / 8;
+  uint64_t value = frame->values[data->id];
+  for (i = size - 1; i >= 0; i--) {
+    bytes[*at + i] = (uint8_t)value;
+    value >>= 8;
+  }
+  *at += size;
+}
+
+#define LOOKUP3_ROT(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+/* Bob Jenkins' lookup3 hashlittle(), initial value 0. */
+internal uint32_t
+lookup3(uint8_t* k, uint32_t length)
+{
+  uint32_t a, b, c;
+  a = b = c = 0xdeadbeef + length;
+  while (length > 12) {
+    a += k[0] + ((uint32_t)k[1] << 8) + ((uint32_t)k[2] << 16) + ((uint32_t)k[3] << 24);
+    b += k[4] + ((uint32_t)k[5] << 8) + ((uint32_t)k[6] << 16) + ((uint32_t)k[7] << 24);
+    c += k[8] + ((uint32_t)k[9] << 8) + ((uint32_t)k[10] << 16) + ((uint32_t)k[11] << 24);
+    a -= c; a ^= LOOKUP3_ROT(c, 4);  c += b;
+    b -= a; b ^= LOOKUP3_ROT(a, 6);  a += c;
+    c -= b; c ^= LOOKUP3_ROT(b, 8);  b += a;
+    a -= c; a ^= LOOKUP3_ROT(c, 16); c += b;
+    b -= a; b ^= LOOKUP3_ROT(a, 19); a += c;
+    c -= b; c ^= LOOKUP3_ROT(b, 4);  b += a;
+    length -= 12;
+    k += 12;
+  }
+  switch (length) {
+    case 12: c += (uint32_t)k[11] << 24;
+    case 11: c += (uint32_t)k[10] << 16;
+    case 10: c += (uint32_t)k[9] << 8;
+    case 9:  c += k[8];
+    case 8:  b += (uint32_t)k[7] << 24;
+    case 7:  b += (uint32_t)k[6] << 16;
+    case 6:  b += (uint32_t)k[5] << 8;
+    case 5:  b += k[4];
+    case 4:  a += (uint32_t)k[3] << 24;
+    case 3:  a += (uint32_t)k[2] << 16;
+    case 2:  a += (uint32_t)k[1] << 8;
+    case 1:  a += k[0];
+      break;
+    case 0:
+      return c;
+  }
+  c ^= b; c -= LOOKUP3_ROT(b, 14);
+  a ^= c; a -= LOOKUP3_ROT(c, 11);
+  b ^= a; b -= LOOKUP3_ROT(a, 25);
+  c ^= b; c -= LOOKUP3_ROT(b, 16);
+  a ^= c; a -= LOOKUP3_ROT(c, 4);
+  b ^= a; b -= LOOKUP3_ROT(a, 14);
+  c ^= b; c -= LOOKUP3_ROT(b, 24);
+  return c;
+}
+
+internal uint64_t run_function(struct RunFrame* frame);
+
+/* Runs the call `insn`; false when the function returns at it, with `*result`. */
+internal bool
+call(struct RunFrame* frame, struct IrInsn* insn, struct RunInsn* run, uint64_t* result)
+{
+  uint64_t* values = frame->values;
+  uint64_t* a = insn->arg_count > 0 ? &values[insn->args[0]] : 0;
+  uint64_t* h = insn->arg_count > 0 ? frame->refs[insn->args[0]] : 0;
+  struct RunFrame* callee;
+  uint8_t* bytes;
+  uint64_t r;
+  int i;
+  switch (run->call_kind) {
+    case RunCall_Function:
+      callee = new_frame(run->callee);
+      callee->context = frame->context;
+      for (i = 0; i < insn->arg_count && i < run->callee->param_count; i++) {
+        bind_param(callee, i, frame, insn->args[i]);
+      }
+      for (i = 0; run->table && i < run->data_count && insn->arg_count + i < run->callee->param_count; i++) {
+        if (run->callee->param_slots[insn->arg_count + i] >= 0) {
+          *callee->params[insn->arg_count + i] = frame->lookups[run->index].args[i];
+        }
+      }
+      r = run_function(callee);
+      if (run->callee->ir->kind == IrFunction_Function) {
+        values[insn->id] = insn->type ? wrap(insn->type, r) : r;
+      } else if (r) {
+        *result = 1;
+        return false;
+      }
+      return true;
+    case RunCall_Apply:
+      callee = new_frame(run->callee);
+      for (i = 0; i < insn->arg_count && i < run->callee->param_count; i++) {
+        bind_param(callee, i, frame, insn->args[i]);
+      }
+      r = run_function(callee);
+      if (run->callee->ir->kind == IrFunction_Parser ? !r : r != 0) {
+        *result = r != 0;
+        return false;
+      }
+      return true;
+    case RunCall_Extract:
+      if (run->size) {
+        uint64_t* next = frame->refs[run->index] + run->size * run->elem_slots;
+        if (*next >= run->size || !(bytes = cursor(run->header->size))) {
+          *result = 0;
+          return false;
+        }
+        parse_header(run->header, bytes, frame->refs[run->index] + *next * run->elem_slots);
+        packet.offset += run->header->size;
+        *next += 1;
+        return true;
+      }
+      if (!(bytes = cursor(run->header->size))) {
+        *result = 0;
+        return false;
+      }
+      parse_header(run->header, bytes, h);
+      packet.offset += run->header->size;
+      return true;
+    case RunCall_Lookahead:
+      if (run->header) {
+        bytes = cursor(run->header->size);
+        if (bytes) {
+          parse_header(run->header, bytes, frame->memory + run->temp);
+        }
+      } else if ((bytes = cursor((ebpf_scalar_width(run->type) + 7) / 8)) != 0) {
+        values[insn->id] = wrap(run->type, load_bits(bytes, 0, ebpf_scalar_width(run->type)));
+      }
+      if (!bytes) {
+        *result = 0;
+        return false;
+      }
+      return true;
+    case RunCall_Advance:
+      packet.offset += (uint32_t)*a >> 3;
+      return true;
+    case RunCall_Length:
+      values[insn->id] = packet.size;
+      return true;
+    case RunCall_Emit:
+      for (i = 0; i < run->emit_count; i++) {
+        emit_header(run->emits[i].header, h + run->emits[i].slot);
+      }
+      return true;
+    case RunCall_CounterIncrement:
+      counter_add(run->counter, (uint32_t)*a, 1);
+      return true;
+    case RunCall_CounterAdd:
+      counter_add(run->counter, (uint32_t)*a, (uint32_t)values[insn->args[1]]);
+      return true;
+    case RunCall_RegisterRead:
+      r = (uint32_t)*a < (uint32_t)run->reg->reg->map.max_entries ? run->reg->values[(uint32_t)*a] : 0;
+      break;
+    case RunCall_RegisterWrite:
+      if ((uint32_t)*a < (uint32_t)run->reg->reg->map.max_entries) {
+        run->reg->values[(uint32_t)*a] = wrap(run->reg->reg->type, values[insn->args[1]]);
+      }
+      return true;
+    case RunCall_MarkToDrop:
+      *output_action = RunVerdict_Drop;
+      return true;
+    case RunCall_MarkToPass:
+      *output_action = RunVerdict_Pass;
+      return true;
+    case RunCall_Truncate:
+      truncate_size = (uint32_t)*a;
+      return true;
+    case RunCall_Hash: {
+      uint8_t bytes[RUN_HASH_MAX_DATA];
+      int at = 0;
+      hash_data(frame, frame->function->ir_insns[insn->args[2]], bytes, &at);
+      *h = lookup3(bytes, run->size);
+      return true;
+    }
+    case RunCall_Verify:
+      if (!*a) {
+        *result = 0;
+        return false;
+      }
+      return true;
+    case RunCall_Ktime:
+      r = clock_ns();
+      break;
+    case RunCall_CsumReplace2:
+      r = csum_fold((uint16_t)~(uint16_t)a[0] + (uint32_t)(uint16_t)~(uint16_t)values[insn->args[1]]
+                    + (uint16_t)values[insn->args[2]]);
+      break;
+    case RunCall_CsumReplace4: {
+      uint32_t old = (uint32_t)values[insn->args[1]], new = (uint32_t)values[insn->args[2]];
+      r = csum_fold((uint16_t)~(uint16_t)*a + (uint32_t)(uint16_t)~(old >> 16) + (uint16_t)~old
+                    + (new >> 16) + (new & 0xffff));
+      break;
+    }
+    case RunCall_Ipv4Checksum: {
+      uint64_t v[11];
+      for (i = 0; i < 11; i++) {
+        v[i] = i < insn->arg_count ? values[insn->args[i]] : 0;
+      }
+      uint32_t src = (uint32_t)v[9], dst = (uint32_t)v[10];
+      r = csum_fold(((uint32_t)(uint8_t)v[0] << 12 | (uint32_t)(uint8_t)v[1] << 8 | (uint8_t)v[2])
+                    + (uint16_t)v[3] + (uint16_t)v[4] + ((uint32_t)(uint8_t)v[5] << 13 | (uint16_t)v[6])
+                    + ((uint32_t)(uint8_t)v[7] << 8 | (uint8_t)v[8])
+                    + (src >> 16) + (src & 0xffff) + (dst >> 16) + (dst & 0xffff));
+      break;
+    }
+    default:
+      assert(0);
+      return true;
+  }
+  values[insn->id] = insn->type ? wrap(insn->type, r) : r;
+  return true;
+}
+
+internal uint64_t
+shift(struct IrInsn* insn, uint64_t a, uint64_t count)
+{
+  struct Type* type = insn->type;
+  int width = ebpf_resolve_type(type)->kind == Type_Int ? 64 : ebpf_scalar_width(ebpf_resolve_type(type));
+  if (count >= (uint64_t)width) {
+    return insn->op == Ir_Shr && ebpf_is_signed(type) ? wrap(type, (uint64_t)((int64_t)a >> 63)) : 0;
+  } else if (insn->op == Ir_Shl) {
+    return wrap(type, a << count);
+  } else if (ebpf_is_signed(type)) {
+    return wrap(type, (uint64_t)((int64_t)a >> count));
+  }
+  return wrap(type, a >> count);
+}
+
+internal uint64_t
+compare(struct IrInsn* insn, struct IrInsn* left, uint64_t a, uint64_t b)
+{
+  bool is_signed_compare = ebpf_is_signed(left->type);
+  switch (insn->op) {
+    case Ir_Equal:
+      return a == b;
+    case Ir_NotEqual:
+      return a != b;
+    case Ir_Less:
+      return is_signed_compare ? (int64_t)a < (int64_t)b : a < b;
+    case Ir_Greater:
+      return is_signed_compare ? (int64_t)a > (int64_t)b : a > b;
+    case Ir_LessEqual:
+      return is_signed_compare ? (int64_t)a <= (int64_t)b : a <= b;
+    default:
+      return is_signed_compare ? (int64_t)a >= (int64_t)b : a >= b;
+  }
+}
+
+/* Runs `insn`; false when the function returns at it, with `*result`. */
+internal bool
+run_insn(struct RunFrame* frame, struct IrInsn* insn, uint64_t* result)
+{
+  struct RunFunction* f = frame->function;
+  struct RunInsn* run = &f->insns[insn->id];
+  uint64_t* values = frame->values;
+  uint64_t a = insn->arg_count > 0 ? values[insn->args[0]] : 0;
+  uint64_t b = insn->arg_count > 1 ? values[insn->args[1]] : 0;
+  struct IrInsn* operand = 0;
+  uint64_t mask;
+  switch (insn->op) {
+    case Ir_Const:
+    case Ir_EnumConst:
+    case Ir_String:
+    case Ir_Tuple:
+    case Ir_Phi:
+      return true;
+    case Ir_Undef:
+      if (run->temp >= 0) {
+        frame->refs[insn->id] = frame->memory + run->temp;
+      } else {
+        values[insn->id] = 0;
+      }
+      return true;
+    case Ir_Param:
+      values[insn->id] = *frame->params[insn->index];
+      return true;
+    case Ir_Var:
+      frame->refs[insn->id] = var_ref(frame, run);
+      return true;
+    case Ir_Temp:
+      frame->refs[insn->id] = frame->memory + run->temp;
+      return true;
+    case Ir_Field:
+      frame->refs[insn->id] = field_ref(frame, insn, run);
+      return true;
+    case Ir_Index:
+      frame->refs[insn->id] = frame->refs[insn->args[0]] + (b < run->size ? b : run->size - 1) * run->elem_slots;
+      return true;
+    case Ir_Load:
+      values[insn->id] = *frame->refs[insn->args[0]];
+      return true;
+    case Ir_Store:
+      store(frame, insn);
+      return true;
+    case Ir_Add:
+      values[insn->id] = wrap(insn->type, a + b);
+      return true;
+    case Ir_Sub:
+      values[insn->id] = wrap(insn->type, a - b);
+      return true;
+    case Ir_Mul:
+      values[insn->id] = wrap(insn->type, a * b);
+      return true;
+    case Ir_Div:
+      /* A division by zero gives 0, as in BPF. */
+      operand = f->ir_insns[insn->args[0]];
+      values[insn->id] = b == 0 ? 0
+                         : wrap(insn->type, ebpf_is_signed(operand->type) ? (uint64_t)((int64_t)a / (int64_t)b) : a / b);
+      return true;
+    case Ir_BitAnd:
+      values[insn->id] = wrap(insn->type, a & b);
+      return true;
+    case Ir_BitOr:
+      values[insn->id] = wrap(insn->type, a | b);
+      return true;
+    case Ir_BitXor:
+      values[insn->id] = wrap(insn->type, a ^ b);
+      return true;
+    case Ir_Shl:
+    case Ir_Shr:
+      values[insn->id] = shift(insn, a, b);
+      return true;
+    case Ir_Equal:
+    case Ir_NotEqual:
+    case Ir_Less:
+    case Ir_Greater:
+    case Ir_LessEqual:
+    case Ir_GreaterEqual:
+      operand = f->ir_insns[insn->args[0]];
+      if (ebpf_is_aggregate(operand->type)) {
+        error("at line %d: the interpreter cannot compare values of type `%s`.", insn->line_nr,
+              type_to_string(operand->type));
+      }
+      values[insn->id] = compare(insn, operand, a, b);
+      return true;
+    case Ir_And:
+      values[insn->id] = a && b;
+      return true;
+    case Ir_Or:
+      values[insn->id] = a || b;
+      return true;
+    case Ir_LogNot:
+      values[insn->id] = !a;
+      return true;
+    case Ir_BitNot:
+      values[insn->id] = wrap(insn->type, ~a);
+      return true;
+    case Ir_Neg:
+      values[insn->id] = wrap(insn->type, -a);
+      return true;
+    case Ir_Cast:
+      values[insn->id] = wrap(insn->type, a);
+      return true;
+    case Ir_Slice:
+      values[insn->id] = wrap(insn->type, (a >> insn->low) & ebpf_width_mask(insn->index - insn->low + 1));
+      return true;
+    case Ir_SliceSet:
+      mask = ebpf_width_mask(insn->index - insn->low + 1) << insn->low;
+      values[insn->id] = wrap(insn->type, (a & ~mask) | ((b << insn->low) & mask));
+      return true;
+    case Ir_IsValid: {
+      struct Type* type = ebpf_resolve_type(f->ir_insns[insn->args[0]]->type);
+      uint64_t* h = frame->refs[insn->args[0]];
+      int i;
+      if (type->kind == Type_HeaderUnion) {
+        values[insn->id] = 0;
+        for (i = 0; i < type->member_count; i++) {
+          struct Type* member = ebpf_resolve_type(type->members[i].type);
+          values[insn->id] |= h[member->member_count] != 0;
+          h += slot_count(member);
+        }
+      } else {
+        values[insn->id] = h[type->member_count];
+      }
+      return true;
+    }
+    case Ir_SetValid:
+    case Ir_SetInvalid: {
+      struct Type* type = ebpf_resolve_type(f->ir_insns[insn->args[0]]->type);
+      frame->refs[insn->args[0]][type->member_count] = insn->op == Ir_SetValid;
+      return true;
+    }
+    case Ir_Call:
+      if (run->temp >= 0) {
+        frame->refs[insn->id] = frame->memory + run->temp;
+      }
+      return call(frame, insn, run, result);
+    case Ir_TableApply:
+      lookup(run->table, values, insn->args, &frame->lookups[run->index]);
+      return true;
+    case Ir_TableHit:
+      values[insn->id] = frame->lookups[f->insns[insn->args[0]].index].hit;
+      return true;
+    case Ir_ActionRun: {
+      struct RunLookup* applied = &frame->lookups[f->insns[insn->args[0]].index];
+      values[insn->id] = applied->action < 0 ? RUN_NO_ACTION : applied->action;
+      return true;
+    }
+    case Ir_PacketCheck:
+      if (!cursor(insn->index)) {
+        *result = 0;
+        return false;
+      }
+      return true;
+    default:
+      break;
+  }
+  error("at line %d: `%s` is not supported by the interpreter.", insn->line_nr, ir_opcode_to_string(insn->op));
+  return false;
+}
+
+/* The phis of `succ` take their operands for the edge from `block`, all read before any is written. */
+internal void
+take_edge(struct RunFrame* frame, struct IrBlock* block, struct IrBlock* succ)
+{
+  struct IrInsn** insns = frame->function->ir_insns;
+  int pred = 0, count = 0, i, id;
+  if (!succ->first_insn || insns[succ->first_insn]->op != Ir_Phi) {
+    return;
+  }
+  while (succ->preds[pred] != block->id) {
+    pred += 1;
+  }
+  for (id = succ->first_insn; id && insns[id]->op == Ir_Phi; id = insns[id]->next_in_block) {
+    phi_values[count++] = frame->values[insns[id]->args[pred]];
+  }
+  for (i = 0, id = succ->first_insn; i < count; i++, id = insns[id]->next_in_block) {
+    frame->values[id] = phi_values[i];
+  }
+}
+
+/*
+ * Parsers, controls and actions return 1 at `accept` and `exit`, 0 at
+ * `reject` and at their end; functions return their value.
+ */
+internal uint64_t
+run_function(struct RunFrame* frame)
+{
+  struct RunFunction* run = frame->function;
+  struct IrFunction* f = run->ir;
+  struct IrBlock* block = run->ir_blocks[f->entry_block];
+  uint64_t result = 0;
+  int i, k;
+  for (;;) {
+    int id = block->first_insn;
+    while (id) {
+      struct IrInsn* insn = run->ir_insns[id];
+      if (!run_insn(frame, insn, &result)) {
+        return result;
+      }
+      id = insn->next_in_block;
+    }
+    int succ = 0;
+    struct RunBlock* cases = &run->blocks[block->id];
+    uint64_t value = block->value ? frame->values[block->value] : 0;
+    switch (block->term) {
+      case IrTerm_Jump:
+        succ = block->succs[0];
+        break;
+      case IrTerm_Branch:
+        succ = block->succs[value ? 0 : 1];
+        break;
+      case IrTerm_Switch:
+        for (i = 0; i < block->case_count && value != cases->values[i]; i++);
+        succ = block->succs[i];
+        break;
+      case IrTerm_Select:
+        for (i = 0; i < block->case_count; i++) {
+          for (k = 0; k < block->key_count; k++) {
+            int at = i * block->key_count + k;
+            if ((frame->values[block->keys[k]] & cases->masks[at]) != cases->values[at]) {
+              break;
+            }
+          }
+          if (k == block->key_count) {
+            break;
+          }
+        }
+        succ = block->succs[i];
+        break;
+      case IrTerm_Return:
+        return f->kind == IrFunction_Function ? value : 0;
+      case IrTerm_Exit:
+      case IrTerm_Accept:
+        return 1;
+      case IrTerm_Reject:
+        return 0;
+      default:
+        assert(0);
+    }
+    struct IrBlock* next = run->ir_blocks[succ];
+    take_edge(frame, block, next);
+    block = next;
+  }
+}
+
+/*
+ * The package, as emit_main in emit_xdp.c runs it: the parser, the control,
+ * and for XDP the deparser, whose headers replace the parsed ones.  The
+ * ubpf package is run as emit_bpf.c compiles it for ebpf/ubpf_run.c: its
+ * standard_metadata is set up before the parser, and a redirect, like the
+ * XDP one, goes out after the deparser.
+ */
+
+/* The blocks of the package and the memory they are given, found once. */
+struct RunPipeline {
+  struct RunFunction* parser;
+  struct RunFunction* control;
+  struct RunFunction* deparser;
+  struct Type* headers_type;
+  struct Type* imd_type;
+  struct Type* omd_type;
+  int input_port;                /* slot in the xdp_input, or the standard_metadata */
+  int output_action;             /* slot in the xdp_output, or the standard_metadata */
+  int packet_length;             /* ubpf: slot in the standard_metadata */
+  int deparser_headers;          /* the parameter of the deparser the headers go to: first but for ubpf */
+};
+
+internal struct RunPipeline pipeline;
+
+internal uint64_t*
+push_memory(struct Type* type)
+{
+  int count = slot_count(type) + 1;
+  uint64_t* memory = arena_push(&frame_storage, count * sizeof(uint64_t));
+  memset(memory, 0, count * sizeof(uint64_t));
+  return memory;
+}
+
+internal int
+member_slot_of(struct Type* type, char* name)
+{
+  type = ebpf_resolve_type(type);
+  int member = member_index(type, name);
+  if (member < 0) {
+    error("`%s` has no field `%s`.", type_to_string(type), name);
+  }
+  return member_slot(type, member);
+}
+
+internal void
+prepare_pipeline()
+{
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.parser = function_of(program->parser);
+  pipeline.control = function_of(program->control);
+  pipeline.headers_type = ebpf_param_type(program->parser, 1);
+  if (program->model == EbpfModel_Filter) {
+    return;
+  }
+  pipeline.deparser = function_of(program->deparser);
+  pipeline.deparser_headers = ebpf_is_extern_object(ebpf_param_type(program->deparser, 0)) ? 1 : 0;
+  if (program->model == EbpfModel_Ubpf) {
+    /* The metadata and the standard_metadata go in their place. */
+    pipeline.imd_type = ebpf_param_type(program->parser, 2);
+    pipeline.omd_type = ebpf_param_type(program->parser, 3);
+    pipeline.input_port = member_slot_of(pipeline.omd_type, "input_port");
+    pipeline.output_action = member_slot_of(pipeline.omd_type, "output_action");
+    pipeline.packet_length = member_slot_of(pipeline.omd_type, "packet_length");
+    return;
+  }
+  pipeline.imd_type = ebpf_param_type(program->control, 1);
+  pipeline.omd_type = ebpf_param_type(program->control, 2);
+  pipeline.input_port = member_slot_of(pipeline.imd_type, "input_port");
+  pipeline.output_action = member_slot_of(pipeline.omd_type, "output_action");
+}
+
+/* The verdict; the output packet in `packet.out` and `packet.out_size`. */
+internal int
+run_pipeline()
+{
+  uint64_t* headers = push_memory(pipeline.headers_type);
+  packet.offset = 0;
+  packet.out = packet.data;
+  packet.out_size = packet.size;
+  struct RunFrame* parser = new_frame(pipeline.parser);
+  bind_memory(parser, 1, headers);
+  uint64_t* imd = 0;
+  uint64_t* omd = 0;
+  if (program->model == EbpfModel_Ubpf) {
+    imd = push_memory(pipeline.imd_type);
+    omd = push_memory(pipeline.omd_type);
+    omd[pipeline.input_port] = RUN_INGRESS_IFINDEX;
+    omd[pipeline.packet_length] = packet.size;
+    omd[pipeline.output_action] = RunVerdict_Pass;
+    output_action = &omd[pipeline.output_action];
+    truncate_size = RUN_MAX_PACKET_SIZE;
+    bind_memory(parser, 2, imd);
+    bind_memory(parser, 3, omd);
+  }
+  if (!run_function(parser)) {
+    return RunVerdict_Drop;
+  }
+  struct RunFrame* control = new_frame(pipeline.control);
+  bind_memory(control, 0, headers);
+  if (program->model == EbpfModel_Filter) {
+    uint64_t accept = 0;
+    bind_memory(control, 1, &accept);
+    run_function(control);
+    return accept ? RunVerdict_Pass : RunVerdict_Drop;
+  }
+  if (program->model == EbpfModel_Xdp) {
+    imd = push_memory(pipeline.imd_type);
+    omd = push_memory(pipeline.omd_type);
+    imd[pipeline.input_port] = RUN_INGRESS_IFINDEX;
+    omd[pipeline.output_action] = RunVerdict_Pass;
+  }
+  bind_memory(control, 1, imd);
+  bind_memory(control, 2, omd);
+  run_function(control);
+  int verdict = (int)omd[pipeline.output_action];
+  if (verdict == RunVerdict_Aborted || verdict == RunVerdict_Drop) {
+    return verdict;
+  }
+  uint32_t parsed = packet.offset;
+  struct RunFrame* deparser = new_frame(pipeline.deparser);
+  bind_memory(deparser, pipeline.deparser_headers, headers);
+  packet.out = emit_buffer;
+  packet.out_size = 0;
+  run_function(deparser);
+  int64_t size = (int64_t)packet.out_size + packet.size - parsed;
+  if (size < RUN_ETH_HLEN) {
+    /* bpf_xdp_adjust_head fails. */
+    packet.out = packet.data;
+    packet.out_size = packet.size;
+    return RunVerdict_Aborted;
+  }
+  memcpy(emit_buffer + packet.out_size, packet.data + parsed, packet.size - parsed);
+  packet.out_size = (uint32_t)size;
+  if (program->model != EbpfModel_Ubpf) {
+    return verdict;
+  }
+  if (truncate_size < packet.out_size) {
+    if (truncate_size < RUN_ETH_HLEN) {
+      /* bpf_xdp_adjust_tail fails. */
+      return RunVerdict_Aborted;
+    }
+    packet.out_size = truncate_size;
+  }
+  return verdict == RUN_UBPF_REDIRECT ? RunVerdict_Redirect : verdict;
+}
+
+/*
+ * Packets.
+ */
+
+struct PcapFileHeader {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct PcapRecordHeader {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t caplen;
+  uint32_t len;
+};
+
+struct RunBatchPacket {
+  uint8_t* data;
+  uint32_t size;
+  uint8_t* out;
+  uint32_t out_size;
+  int verdict;
+};
+
+internal uint32_t
+swap32(uint32_t x)
+{
+  return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+/* Up to `count` packets of `f_stream` into `batch`; how many there were. */
+internal int
+read_batch(FILE* f_stream, bool is_swapped, struct RunBatchPacket* batch, int count, char* filename)
+{
+  struct PcapRecordHeader record;
+  int i;
+  for (i = 0; i < count && fread(&record, sizeof(record), 1, f_stream) == 1; i++) {
+    uint32_t size = is_swapped ? swap32(record.caplen) : record.caplen;
+    if (size > RUN_MAX_PACKET_SIZE) {
+      error("`%s`: packet of %u bytes.", filename, size);
+    }
+    batch[i].data = arena_push(&batch_storage, size + 1);
+    batch[i].size = size;
+    if (fread(batch[i].data, 1, size, f_stream) != size) {
+      break;
+    }
+  }
+  return i;
+}
+
+internal void
+write_packet(FILE* f_stream, uint8_t* data, uint32_t size, uint32_t index)
+{
+  struct PcapRecordHeader record = {0, index, size, size};
+  fwrite(&record, sizeof(record), 1, f_stream);
+  fwrite(data, 1, size, f_stream);
+}
+
+/*
+ * Runs the pipeline of `ebpf_program` over the packets of `packets_filename`,
+ * `batch_size` packets at a time, each batch `repeat` times over; writes the
+ * packets it outputs to `out_filename`, if any.  Prints the ns/packet, the
+ * verdicts, the hits and misses of each table and what the counters counted.
+ */
+void
+run_ir_program(struct EbpfProgram* ebpf_program, char* packets_filename, char* out_filename, int batch_size,
+               int repeat, struct Arena* storage)
+{
+  program = ebpf_program;
+  run_storage = storage;
+  array_init(&functions, sizeof(struct RunFunction*), run_storage);
+  array_init(&headers, sizeof(struct RunHeader*), run_storage);
+  phi_values = 0;
+  phi_capacity = 0;
+  int i;
+  tables = arena_push(run_storage, (program->tables.elem_count + 1) * sizeof(struct RunTable));
+  for (i = 0; i < program->tables.elem_count; i++) {
+    prepare_table(&tables[i], (struct EbpfTable*)array_get(&program->tables, i));
+  }
+  counters = arena_push(run_storage, (program->counters.elem_count + 1) * sizeof(struct RunCounter));
+  for (i = 0; i < program->counters.elem_count; i++) {
+    prepare_counter(&counters[i], (struct EbpfCounter*)array_get(&program->counters, i));
+  }
+  registers = arena_push(run_storage, (program->registers.elem_count + 1) * sizeof(struct RunRegister));
+  for (i = 0; i < program->registers.elem_count; i++) {
+    registers[i].reg = (struct EbpfRegister*)array_get(&program->registers, i);
+    registers[i].values = arena_push(run_storage, registers[i].reg->map.max_entries * sizeof(uint64_t));
+    memset(registers[i].values, 0, registers[i].reg->map.max_entries * sizeof(uint64_t));
+  }
+  prepare_pipeline();
+
+  FILE* in = fopen(packets_filename, "rb");
+  if (!in) {
+    error("could not open `%s`.", packets_filename);
+  }
+  struct PcapFileHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1) {
+    error("`%s` is not a pcap file.", packets_filename);
+  }
+  bool is_swapped = header.magic == swap32(PCAP_MAGIC) || header.magic == swap32(PCAP_MAGIC_NSEC);
+  if (!is_swapped && header.magic != PCAP_MAGIC && header.magic != PCAP_MAGIC_NSEC) {
+    error("`%s` is not a pcap file.", packets_filename);
+  }
+  if ((is_swapped ? swap32(header.linktype) : header.linktype) != LINKTYPE_ETHERNET) {
+    error("`%s` does not hold Ethernet frames.", packets_filename);
+  }
+  FILE* out = 0;
+  if (out_filename) {
+    struct PcapFileHeader out_header = {PCAP_MAGIC, 2, 4, 0, 0, RUN_MAX_PACKET_SIZE, LINKTYPE_ETHERNET};
+    out = fopen(out_filename, "wb");
+    if (!out) {
+      error("could not open `%s` for writing.", out_filename);
+    }
+    fwrite(&out_header, sizeof(out_header), 1, out);
+  }
+
+  struct RunBatchPacket* batch = arena_push(run_storage, batch_size * sizeof(struct RunBatchPacket));
+  int verdicts[RunVerdict_COUNT_] = {0};
+  int packet_count = 0, batch_count = 0, other_count = 0, changed_count = 0, resized_count = 0;
+  uint64_t total_ns = 0;
+  int count;
+  while ((count = read_batch(in, is_swapped, batch, batch_size, packets_filename)) > 0) {
+    int r;
+    uint64_t start_ns = clock_ns();
+    for (r = 0; r < repeat; r++) {
+      is_counted = (r == 0);
+      for (i = 0; i < count; i++) {
+        packet.data = batch[i].data;
+        packet.size = batch[i].size;
+        int verdict = run_pipeline();
+        if (r == 0) {
+          batch[i].verdict = verdict;
+          batch[i].out_size = packet.out_size;
+          batch[i].out = arena_push(&batch_storage, packet.out_size + 1);
+          memcpy(batch[i].out, packet.out, packet.out_size);
+        }
+        arena_rewind(&frame_storage);
+      }
+    }
+    total_ns += clock_ns() - start_ns;
+    for (i = 0; i < count; i++) {
+      if (batch[i].verdict >= 0 && batch[i].verdict < RunVerdict_COUNT_) {
+        verdicts[batch[i].verdict] += 1;
+      } else {
+        other_count += 1;
+      }
+      resized_count += batch[i].out_size != batch[i].size;
+      changed_count += batch[i].out_size != batch[i].size || memcmp(batch[i].out, batch[i].data, batch[i].size) != 0;
+      if (out) {
+        write_packet(out, batch[i].out, batch[i].out_size, packet_count + i);
+      }
+    }
+    packet_count += count;
+    batch_count += 1;
+    arena_rewind(&batch_storage);
+  }
+  fclose(in);
+  if (out) {
+    fclose(out);
+  }
+
+  printf("%d packets in %d batches, %d runs each: %.1f ns/packet\n", packet_count, batch_count, repeat,
+         packet_count ? (double)total_ns / ((double)packet_count * repeat) : 0.0);
+  printf("verdicts:");
+  for (i = 0; i < RunVerdict_COUNT_; i++) {
+    printf(" %s %d", verdict_names[i], verdicts[i]);
+  }
+  if (other_count) {
+    printf(" other %d", other_count);
+  }
+  printf("\noutputs: %d changed, %d resized\n", changed_count, resized_count);
+  for (i = 0; i < program->tables.elem_count; i++) {
+    printf("table %s: %llu hits, %llu misses\n", tables[i].table->name, (unsigned long long)tables[i].hit_count,
+           (unsigned long long)tables[i].miss_count);
+  }
+  for (i = 0; i < program->counters.elem_count; i++) {
+    struct RunCounter* counter = &counters[i];
+    uint64_t total = 0;
+    int used = 0, k;
+    for (k = 0; k < counter->capacity; k++) {
+      total += counter->values[k];
+      used += counter->values[k] != 0;
+    }
+    printf("counter %s: %llu in %d elements\n", counter->counter->name, (unsigned long long)total, used);
+  }
+  for (i = 0; i < program->registers.elem_count; i++) {
+    int used = 0, k;
+    for (k = 0; k < registers[i].reg->map.max_entries; k++) {
+      used += registers[i].values[k] != 0;
+    }
+    printf("register %s: %d elements set\n", registers[i].reg->name, used);
+  }
+  arena_delete(&frame_storage);
+  arena_delete(&batch_storage);
+}
@@ -9,3 +9,62 @@ for f in `find testdata -maxdepth 1 -type f`; do \
         echo "$f : FAILED"
     fi
 done
+
+# The AST image of each program, read back by a reader linked with nothing but ast_bin_read.c.
+for f in `find testdata -maxdepth 1 -name '*.p4'`; do \
+    echo;
+    ./build/ashp4c $f --emit-ast=bin --output=/tmp/ashp4c_test.astb && ./build/ast_bin_test /tmp/ashp4c_test.astb;
+    if [ $? -eq 0 ]; then
+        echo "--------";
+        echo "$f --emit-ast=bin : PASSED"
+    else
+        echo "$f --emit-ast=bin : FAILED"
+    fi
+done
+
+# eBPF and XDP programs on each target, with the checksums updated incrementally and recomputed in full.
+for f in `find testdata -maxdepth 1 \( -name '*_ebpf.p4' -o -name '*_xdp.p4' \)`; do \
+    for target in xdp bpf ubpf; do \
+        for checksum in incremental full; do \
+            echo;
+            ./build/ashp4c $f --target=$target --checksum=$checksum --output=/dev/null;
+            if [ $? -eq 0 ]; then
+                echo "--------";
+                echo "$f --target=$target --checksum=$checksum : PASSED"
+            else
+                echo "$f --target=$target --checksum=$checksum : FAILED"
+            fi
+        done
+    done
+done
+
+# ubpf_model programs, which only the ubpf target takes, with both checksum modes.
+for f in `grep -l '^package ubpf' testdata/*.p4`; do \
+    for checksum in incremental full; do \
+        echo;
+        ./build/ashp4c $f --target=ubpf --checksum=$checksum --output=/dev/null;
+        if [ $? -eq 0 ]; then
+            echo "--------";
+            echo "$f --target=ubpf --checksum=$checksum : PASSED"
+        else
+            echo "$f --target=ubpf --checksum=$checksum : FAILED"
+        fi
+    done
+done
+
+# Programs the compiler must reject, each with the error it must report on its first line: `// expect: <error>`,
+# and on the second the options to compile it with, if any: `// args: <options>`.
+for f in `find testdata/errors -maxdepth 1 -name '*.p4'`; do \
+    echo;
+    expected=`head -1 $f | sed 's|^// expect: ||'`;
+    args=`sed -n 's|^// args: ||p' $f | head -1`;
+    output=`./build/ashp4c $f $args 2>&1`;
+    status=$?;
+    echo "$output";
+    if [ $status -ne 0 ] && echo "$output" | grep -qxF "ERROR: $expected"; then
+        echo "--------";
+        echo "$f : PASSED"
+    else
+        echo "$f : FAILED, expected: $expected"
+    fi
+done
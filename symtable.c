@@ -1,5 +1,3 @@
-#define DEBUG_ENABLED 1
-
 #include "basic.h"
 #include "arena.h"
 #include "token.h"
@@ -8,49 +6,66 @@
 
 
 internal struct Arena* symtable_storage;
+internal struct Arena* entry_storage;
 internal struct UnboundedArray symtable = {};
 internal int capacity_log2 = 5;
 internal int capacity = 0;
 internal int entry_count = 0;
+internal int symbol_count = 0;
 internal int scope_level = 0;
 
+/* Every declaration is logged, so that pop_scope() only visits the symbols of
+   the scope being closed instead of sweeping the whole table. */
+struct ScopeDecl {
+  struct SymtableEntry* entry;
+  struct Symbol* symbol;
+};
+
+internal struct UnboundedArray scope_decls = {};
+internal struct UnboundedArray scope_starts = {};
+
+/* The keywords are entered once, on their own arena, so that symtable_flush()
+   drops the symbols of a source but only has to hash the keywords back in. */
+internal struct Arena keyword_storage = {};
+internal struct UnboundedArray keyword_entries = {};
+
 
 int
 push_scope()
 {
   int new_scope_level = ++scope_level;
+  array_append(&scope_starts, &scope_decls.elem_count);
   DEBUG("push scope %d\n", new_scope_level);
   return new_scope_level;
 }
 
-internal struct Symbol*
-scope_delete_symbol(struct Symbol* symbol)
+internal void
+scope_log_decl(struct SymtableEntry* entry, struct Symbol* symbol)
 {
-  struct Symbol* next_in_scope = 0;
-  if (symbol && symbol->scope_level > (scope_level - 1)) {
-    next_in_scope = symbol->next_in_scope;
-    if (next_in_scope) {
-      assert (next_in_scope->scope_level <= scope_level);
-    }
-    symbol->next_in_scope = 0;
-  }
-  return next_in_scope;
+  struct ScopeDecl decl = {entry, symbol};
+  array_append(&scope_decls, &decl);
 }
 
 void
 pop_scope()
 {
   assert (scope_level > 0);
+  int scope_start = *(int*)array_get(&scope_starts, scope_starts.elem_count - 1);
   int i;
-  for (i = 0; i < capacity; i++) {
-    struct SymtableEntry* symbol = *(struct SymtableEntry**)array_get(&symtable, i);
-    while (symbol) {
-      symbol->id_kw = scope_delete_symbol(symbol->id_kw);
-      symbol->id_type = scope_delete_symbol(symbol->id_type);
-      symbol->id_ident = scope_delete_symbol(symbol->id_ident);
-      symbol = symbol->next_entry;
-    }
+  for (i = scope_decls.elem_count - 1; i >= scope_start; i--) {
+    struct ScopeDecl* decl = array_get(&scope_decls, i);
+    struct Symbol** head = 0;
+    if (decl->symbol->ident_kind == Symbol_Type) {
+      head = &decl->entry->id_type;
+    } else if (decl->symbol->ident_kind == Symbol_Ident) {
+      head = &decl->entry->id_ident;
+    } else assert(0);
+    assert (*head == decl->symbol);
+    *head = decl->symbol->next_in_scope;
+    decl->symbol->next_in_scope = 0;
   }
+  scope_decls.elem_count = scope_start;
+  scope_starts.elem_count -= 1;
   DEBUG("pop scope %d\n", scope_level - 1);
   scope_level -= 1;
 }
@@ -68,7 +83,7 @@ get_symtable_entry(char* name)
   if (!entry) {
     if (entry_count >= capacity) {
       struct Arena temp_storage = {};
-      struct SymtableEntry** entries_array = arena_push(&temp_storage, capacity);
+      struct SymtableEntry** entries_array = arena_push(&temp_storage, capacity * sizeof(*entries_array));
       int i, j = 0;
       for (i = 0; i < capacity; i++) {
         struct SymtableEntry* entry = *(struct SymtableEntry**)array_get(&symtable, i);
@@ -97,7 +112,7 @@ get_symtable_entry(char* name)
       arena_delete(&temp_storage);
       h = hash_string(name, capacity_log2);
     }
-    entry = arena_push(symtable_storage, sizeof(*entry));
+    entry = arena_push(entry_storage, sizeof(*entry));
     memset(entry, 0, sizeof(*entry));
     entry->name = name;
     entry->next_entry = *(struct SymtableEntry**)array_get(&symtable, h);
@@ -136,6 +151,8 @@ new_type(char* name, struct Ast* ast, int line_nr)
   id_type->ident_kind = Symbol_Type;
   id_type->next_in_scope = symbol->id_type;
   symbol->id_type = (struct Symbol*)id_type;
+  scope_log_decl(symbol, id_type);
+  symbol_count += 1;
   DEBUG("new type `%s` at line %d.\n", id_type->name, line_nr);
   return id_type;
 }
@@ -152,6 +169,8 @@ new_ident(char* name, struct Ast* ast, int line_nr)
   id_ident->ident_kind = Symbol_Ident;
   id_ident->next_in_scope = symbol->id_ident;
   symbol->id_ident = (struct Symbol*)id_ident;
+  scope_log_decl(symbol, id_ident);
+  symbol_count += 1;
   DEBUG("new identifier `%s` at line %d.\n", id_ident->name, line_nr);
   return id_ident;
 }
@@ -161,13 +180,15 @@ add_keyword(char* name, enum TokenClass token_klass)
 {
   struct SymtableEntry* symbol = get_symtable_entry(name);
   assert (symbol->id_kw == 0);
-  struct Symbol_Keyword* id_kw = arena_push(symtable_storage, sizeof(*id_kw));
+  struct Symbol_Keyword* id_kw = arena_push(&keyword_storage, sizeof(*id_kw));
   memset(id_kw, 0, sizeof(*id_kw));
   id_kw->name = name;
   id_kw->scope_level = scope_level;
   id_kw->token_klass = token_klass;
   id_kw->ident_kind = Symbol_Keyword;
   symbol->id_kw = (struct Symbol*)id_kw;
+  array_append(&keyword_entries, &symbol);
+  symbol_count += 1;
   return id_kw;
 }
 
@@ -216,31 +237,88 @@ add_all_keywords()
   add_keyword("string", Token_String);
 }
 
-void
-symtable_init()
+internal void
+init_buckets()
 {
   struct SymtableEntry* null_entry = 0;
   array_init(&symtable, sizeof(null_entry), symtable_storage);
+  array_init(&scope_decls, sizeof(struct ScopeDecl), symtable_storage);
+  array_init(&scope_starts, sizeof(int), symtable_storage);
   capacity = (1 << capacity_log2) - 1;
   int i;
-  for (i = entry_count; i < capacity; i++) {
+  for (i = 0; i < capacity; i++) {
     array_append(&symtable, &null_entry);
   }
+}
+
+void
+symtable_init()
+{
+  init_buckets();
+  arena_delete(&keyword_storage);
+  array_init(&keyword_entries, sizeof(struct SymtableEntry*), &keyword_storage);
+  entry_storage = &keyword_storage;
   add_all_keywords();
+  entry_storage = symtable_storage;
 }
 
+/* Drops every symbol but the keywords, which are kept from symtable_init(). */
 void
 symtable_flush()
 {
-  arena_delete(symtable_storage);
+  arena_rewind(symtable_storage);
   entry_count = 0;
+  symbol_count = 0;
   scope_level = 0;
-  symtable_init();
+  if (keyword_entries.elem_count == 0) {
+    symtable_init();
+    return;
+  }
+  init_buckets();
+  int i;
+  for (i = 0; i < keyword_entries.elem_count; i++) {
+    struct SymtableEntry* entry = *(struct SymtableEntry**)array_get(&keyword_entries, i);
+    uint32_t h = hash_string(entry->name, capacity_log2);
+    entry->id_type = entry->id_ident = 0;
+    entry->next_entry = *(struct SymtableEntry**)array_get(&symtable, h);
+    array_set(&symtable, h, &entry);
+    entry_count += 1;
+    symbol_count += 1;
+  }
 }
 
 void
 symtable_set_storage(struct Arena* symtable_storage_)
 {
   symtable_storage = symtable_storage_;
+  entry_storage = symtable_storage_;
 }
 
+
+void
+symtable_get_stats(struct SymtableStats* stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->symbol_count = symbol_count;
+  stats->entry_count = entry_count;
+  stats->bucket_count = capacity;
+  int i;
+  for (i = 0; i < capacity; i++) {
+    struct SymtableEntry* entry = *(struct SymtableEntry**)array_get(&symtable, i);
+    int chain_len = 0;
+    while (entry) {
+      chain_len += 1;
+      entry = entry->next_entry;
+    }
+    if (chain_len > 0) {
+      stats->used_bucket_count += 1;
+    }
+    if (chain_len > stats->max_chain_len) {
+      stats->max_chain_len = chain_len;
+    }
+    if (chain_len >= SYMTABLE_CHAIN_HISTOGRAM_SIZE) {
+      chain_len = SYMTABLE_CHAIN_HISTOGRAM_SIZE - 1;
+    }
+    stats->chain_histogram[chain_len] += 1;
+  }
+}
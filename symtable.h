@@ -32,8 +32,20 @@ struct SymtableEntry {
   struct SymtableEntry* next_entry;
 };
 
+#define SYMTABLE_CHAIN_HISTOGRAM_SIZE  8
+
+struct SymtableStats {
+  int symbol_count;
+  int entry_count;
+  int bucket_count;
+  int used_bucket_count;
+  int max_chain_len;
+  int chain_histogram[SYMTABLE_CHAIN_HISTOGRAM_SIZE];  /* last slot counts the longer chains */
+};
+
 
 void symtable_init();
+void symtable_flush();
 void symtable_set_storage(struct Arena* symtable_storage_);
 struct SymtableEntry* get_symtable_entry(char* name);
 bool name_is_declared(char* name, enum SymbolKind kind);
@@ -42,3 +54,5 @@ struct Symbol* new_type(char* name, struct Ast* ast, int line_nr);
 
 int push_scope();
 void pop_scope();
+
+void symtable_get_stats(struct SymtableStats* stats);
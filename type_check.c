@@ -0,0 +1,1431 @@
+#include "arena.h"
+#include "ast.h"
+#include "symtable.h"
+#include "types.h"
+#include "type_check.h"
+#include "const_eval.h"
+#include <memory.h>  // memset
+
+
+internal struct Arena* type_storage;
+internal struct Type** node_types = 0;  /* indexed by Ast.id */
+internal struct Ast** node_decls = 0;   /* declaration a name refers to, indexed by Ast.id */
+internal int node_type_count = 0;
+internal struct Type* return_type = 0;  /* of the function or action being checked */
+internal bool in_table_property = false;
+internal struct TypeMember* error_members = 0;
+internal int error_member_count = 0;
+
+internal struct Type* type_unknown;
+internal struct Type* type_dontcare;
+internal struct Type* type_void;
+internal struct Type* type_bool;
+internal struct Type* type_string;
+internal struct Type* type_error;
+internal struct Type* type_match_kind;
+internal struct Type* type_int;
+internal struct Type* type_state;
+internal struct Type* type_apply_result;
+
+
+internal struct Type* check_expression(struct Ast* expr);
+internal void check_statement(struct Ast* stmt);
+internal struct Type* check_type_declaration(struct Ast* decl);
+
+
+internal struct Type*
+set_type(struct Ast* ast, struct Type* type)
+{
+  assert(ast->id > 0 && ast->id < node_type_count);
+  node_types[ast->id] = type;
+  return type;
+}
+
+struct Type*
+type_of_node(struct Ast* ast)
+{
+  if (ast->id <= 0 || ast->id >= node_type_count) {
+    return 0;
+  }
+  return node_types[ast->id];
+}
+
+internal void
+set_decl(struct Ast* ast, struct Ast* decl)
+{
+  assert(ast->id > 0 && ast->id < node_type_count);
+  node_decls[ast->id] = decl;
+}
+
+struct Ast*
+decl_of_node(struct Ast* ast)
+{
+  if (ast->id <= 0 || ast->id >= node_type_count) {
+    return 0;
+  }
+  return node_decls[ast->id];
+}
+
+internal int
+list_count(struct AstList* list)
+{
+  return list ? list->link_count : 0;
+}
+
+internal char*
+name_of(struct Ast* decl)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  return (char*)ast_getattr(name, "name");
+}
+
+internal struct Type*
+symbol_type(struct Symbol* symbol)
+{
+  struct Type* type = symbol->ast ? type_of_node(symbol->ast) : 0;
+  return type ? type : type_unknown;
+}
+
+internal void
+declare_ident(struct Ast* name, struct Ast* decl, struct Type* type)
+{
+  new_ident((char*)ast_getattr(name, "name"), decl, name->line_nr);
+  set_type(decl, type);
+}
+
+internal void
+declare_type(struct Ast* name, struct Ast* decl, struct Type* type)
+{
+  new_type((char*)ast_getattr(name, "name"), decl, name->line_nr);
+  set_type(decl, type);
+}
+
+internal bool
+is_permissive(struct Type* type)
+{
+  return type->kind == Type_Unknown || type->kind == Type_Dontcare || type->kind == Type_TypeVar;
+}
+
+internal void
+check_assignable(struct Type* to, struct Type* from, int line_nr, char* what)
+{
+  if (!type_is_assignable(to, from)) {
+    error("at line %d: %s: `%s` is not compatible with `%s`.", line_nr, what,
+          type_to_string(from), type_to_string(to));
+  }
+}
+
+/* Value of a checked expression if it is a constant that fits an `int`, else -1. */
+internal int
+constant_int(struct Ast* expr)
+{
+  struct BitInt* value = const_value_of(expr);
+  int64_t v = 0;
+  if (value && bitint_to_int64(value, &v) && v >= 0 && v <= INT32_MAX) {
+    return (int)v;
+  }
+  return -1;
+}
+
+/* Width of `bit<N>` and friends; a size that is not a constant stays unknown. */
+internal int
+check_type_size(struct Ast* type_size)
+{
+  struct Ast* size = (struct Ast*)ast_getattr(type_size, "size");
+  check_expression(size);
+  return constant_int(size);
+}
+
+internal struct Type*
+resolve_type_ref(struct Ast* ref);
+
+internal struct Type**
+resolve_type_list(struct AstList* list, int* count_)
+{
+  int count = list_count(list);
+  struct Type** types = 0;
+  if (count > 0) {
+    types = arena_push(type_storage, count * sizeof(*types));
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(list);
+    while (link) {
+      types[i++] = resolve_type_ref(link->ast);
+      link = link->next;
+    }
+  }
+  *count_ = count;
+  return types;
+}
+
+internal struct Type*
+resolve_type_name(struct Ast* name)
+{
+  char* strname = (char*)ast_getattr(name, "name");
+  if (cstr_match(strname, "void")) {
+    return type_void;
+  }
+  struct Symbol* symbol = get_symtable_entry(strname)->id_type;
+  if (!symbol) {
+    error("at line %d: unknown type `%s`.", name->line_nr, strname);
+  }
+  return symbol_type(symbol);
+}
+
+internal struct Type*
+resolve_type_ref(struct Ast* ref)
+{
+  struct Type* type = 0;
+  if (ref->kind == Ast_BaseType) {
+    enum AstBaseTypeKind base_type = *(enum AstBaseTypeKind*)ast_getattr(ref, "base_type");
+    struct Ast* type_size = (struct Ast*)ast_getattr(ref, "size");
+    if (base_type == AstBaseType_Bool) {
+      type = type_bool;
+    } else if (base_type == AstBaseType_Error) {
+      type = type_error;
+    } else if (base_type == AstBaseType_String) {
+      type = type_string;
+    } else if (base_type == AstBaseType_Int) {
+      type = type_size ? type_sized(Type_SignedInt, check_type_size(type_size)) : type_int;
+    } else if (base_type == AstBaseType_Bit) {
+      type = type_sized(Type_Bit, type_size ? check_type_size(type_size) : 1);
+    } else if (base_type == AstBaseType_Varbit) {
+      type = type_sized(Type_Varbit, type_size ? check_type_size(type_size) : -1);
+    } else assert(0);
+  } else if (ref->kind == Ast_Name) {
+    type = resolve_type_name(ref);
+  } else if (ref->kind == Ast_SpecdType) {
+    struct Type* base = resolve_type_ref((struct Ast*)ast_getattr(ref, "name"));
+    int arg_count = 0;
+    struct Type** args = resolve_type_list((struct AstList*)ast_getattr(ref, "type_args"), &arg_count);
+    type = type_specialized(base, args, arg_count);
+  } else if (ref->kind == Ast_HeaderStack) {
+    struct Type* elem = resolve_type_ref((struct Ast*)ast_getattr(ref, "name"));
+    struct Ast* stack_expr = (struct Ast*)ast_getattr(ref, "stack_expr");
+    check_expression(stack_expr);
+    type = type_stack(elem, constant_int(stack_expr));
+  } else if (ref->kind == Ast_Tuple) {
+    int elem_count = 0;
+    struct Type** elems = resolve_type_list((struct AstList*)ast_getattr(ref, "type_args"), &elem_count);
+    type = type_tuple(elems, elem_count);
+  } else if (ref->kind == Ast_Dontcare) {
+    type = type_dontcare;
+  } else if (ref->kind == Ast_StructDecl || ref->kind == Ast_HeaderDecl || ref->kind == Ast_HeaderUnionDecl
+             || ref->kind == Ast_EnumDecl) {
+    type = check_type_declaration(ref);
+  } else assert(0);
+  return set_type(ref, type);
+}
+
+internal void
+declare_type_params(struct AstList* type_params)
+{
+  if (!type_params) {
+    return;
+  }
+  struct AstListLink* link = ast_list_first_link(type_params);
+  while (link) {
+    struct Ast* name = link->ast;
+    declare_type(name, name, type_nominal(Type_TypeVar, (char*)ast_getattr(name, "name"), name));
+    link = link->next;
+  }
+}
+
+/* Declares the parameters in the current scope and returns their types. */
+internal struct Type**
+check_parameters(struct AstList* params, int* count_)
+{
+  int count = list_count(params);
+  struct Type** types = 0;
+  if (count > 0) {
+    types = arena_push(type_storage, count * sizeof(*types));
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(params);
+    while (link) {
+      struct Ast* param = link->ast;
+      struct Type* type = resolve_type_ref((struct Ast*)ast_getattr(param, "type"));
+      struct Ast* init_expr = (struct Ast*)ast_getattr(param, "init_expr");
+      if (init_expr) {
+        check_assignable(type, check_expression(init_expr), init_expr->line_nr, "default value");
+      }
+      declare_ident((struct Ast*)ast_getattr(param, "name"), param, type);
+      types[i++] = type;
+      link = link->next;
+    }
+  }
+  *count_ = count;
+  return types;
+}
+
+/* Parameters without a default value. */
+internal int
+required_param_count(struct Ast* decl)
+{
+  struct AstList* params = (struct AstList*)ast_getattr(decl, "params");
+  int count = 0;
+  if (params) {
+    struct AstListLink* link = ast_list_first_link(params);
+    while (link) {
+      if (!ast_getattr(link->ast, "init_expr")) {
+        count += 1;
+      }
+      link = link->next;
+    }
+  }
+  return count;
+}
+
+/* Type params and params of `proto` are declared in the current scope.  A prototype
+   without a return type is the constructor of `ctor_type`. */
+internal struct Type*
+check_function_proto(struct Ast* proto, struct Type* ctor_type)
+{
+  declare_type_params((struct AstList*)ast_getattr(proto, "type_params"));
+  struct Ast* return_type_ref = (struct Ast*)ast_getattr(proto, "return_type");
+  struct Type* ret_type = return_type_ref ? resolve_type_ref(return_type_ref) : ctor_type;
+  assert(ret_type);
+  int param_count = 0;
+  struct Type** params = check_parameters((struct AstList*)ast_getattr(proto, "params"), &param_count);
+  return set_type(proto, type_function(ret_type, params, param_count));
+}
+
+internal struct Type*
+check_struct_declaration(struct Ast* decl, enum TypeKind kind)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  struct Type* type = type_nominal(kind, (char*)ast_getattr(name, "name"), decl);
+  struct AstList* fields = (struct AstList*)ast_getattr(decl, "fields");
+  int member_count = list_count(fields);
+  struct TypeMember* members = 0;
+  if (member_count > 0) {
+    members = arena_push(type_storage, member_count * sizeof(*members));
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(fields);
+    while (link) {
+      struct Ast* field = link->ast;
+      struct TypeMember* member = &members[i++];
+      member->name = name_of(field);
+      member->type = set_type(field, resolve_type_ref((struct Ast*)ast_getattr(field, "type")));
+      member->decl = field;
+      link = link->next;
+    }
+  }
+  type_set_members(type, members, member_count);
+  declare_type(name, decl, type);
+  return type;
+}
+
+internal struct Type*
+check_enum_declaration(struct Ast* decl)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  struct Type* type = type_nominal(Type_Enum, (char*)ast_getattr(name, "name"), decl);
+  struct Ast* type_size = (struct Ast*)ast_getattr(decl, "type_size");
+  if (type_size) {
+    check_expression(type_size);
+    type->base = type_sized(Type_Bit, constant_int(type_size));
+  }
+  struct AstList* id_list = (struct AstList*)ast_getattr(decl, "id_list");
+  int member_count = list_count(id_list);
+  struct TypeMember* members = 0;
+  if (member_count > 0) {
+    members = arena_push(type_storage, member_count * sizeof(*members));
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(id_list);
+    while (link) {
+      struct Ast* id = link->ast;
+      struct Ast* init_expr = (struct Ast*)ast_getattr(id, "init_expr");
+      if (init_expr) {
+        struct Type* init_type = check_expression(init_expr);
+        if (type->base) {
+          check_assignable(type->base, init_type, init_expr->line_nr, "enum member");
+        } else error("at line %d: only an enum with an underlying type can give values to its members.",
+                     init_expr->line_nr);
+      }
+      struct TypeMember* member = &members[i++];
+      member->name = name_of(id);
+      member->type = set_type(id, type);
+      member->decl = id;
+      link = link->next;
+    }
+  }
+  type_set_members(type, members, member_count);
+  declare_type(name, decl, type);
+  return type;
+}
+
+internal struct Type*
+check_type_declaration(struct Ast* decl)
+{
+  struct Type* type = 0;
+  if (decl->kind == Ast_StructDecl) {
+    type = check_struct_declaration(decl, Type_Struct);
+  } else if (decl->kind == Ast_HeaderDecl) {
+    type = check_struct_declaration(decl, Type_Header);
+  } else if (decl->kind == Ast_HeaderUnionDecl) {
+    type = check_struct_declaration(decl, Type_HeaderUnion);
+  } else if (decl->kind == Ast_EnumDecl) {
+    type = check_enum_declaration(decl);
+  } else if (decl->kind == Ast_TypeDecl) {
+    struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+    struct Type* base = resolve_type_ref((struct Ast*)ast_getattr(decl, "type_ref"));
+    if (*(bool*)ast_getattr(decl, "is_typedef")) {
+      type = base;  /* an alias is the very same type object */
+    } else {
+      type = type_nominal(Type_NewType, (char*)ast_getattr(name, "name"), decl);
+      type->base = base;
+    }
+    declare_type(name, decl, type);
+  } else assert(0);
+  return type;
+}
+
+internal void
+check_error_declaration(struct Ast* decl)
+{
+  struct AstList* id_list = (struct AstList*)ast_getattr(decl, "id_list");
+  int new_count = list_count(id_list);
+  struct TypeMember* members = arena_push(type_storage, (error_member_count + new_count) * sizeof(*members));
+  memcpy(members, error_members, error_member_count * sizeof(*members));
+  struct AstListLink* link = id_list ? ast_list_first_link(id_list) : 0;
+  while (link) {
+    struct TypeMember* member = &members[error_member_count++];
+    member->name = (char*)ast_getattr(link->ast, "name");
+    member->type = set_type(link->ast, type_error);
+    member->decl = link->ast;
+    link = link->next;
+  }
+  error_members = members;
+  type_set_members(type_error, error_members, error_member_count);
+}
+
+internal void
+check_match_kind_declaration(struct Ast* decl)
+{
+  struct AstList* id_list = (struct AstList*)ast_getattr(decl, "id_list");
+  struct AstListLink* link = id_list ? ast_list_first_link(id_list) : 0;
+  while (link) {
+    declare_ident(link->ast, link->ast, type_match_kind);
+    link = link->next;
+  }
+}
+
+internal void
+check_extern_declaration(struct Ast* decl)
+{
+  if (decl->kind == Ast_FunctionProto) {
+    push_scope();
+    struct Type* function_type = check_function_proto(decl, 0);
+    pop_scope();
+    declare_ident((struct Ast*)ast_getattr(decl, "name"), decl, function_type);
+    return;
+  }
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  struct Type* type = type_nominal(Type_Extern, (char*)ast_getattr(name, "name"), decl);
+  declare_type(name, decl, type);
+  push_scope();
+  declare_type_params((struct AstList*)ast_getattr(decl, "type_params"));
+  struct AstList* method_protos = (struct AstList*)ast_getattr(decl, "method_protos");
+  int member_count = list_count(method_protos);
+  struct TypeMember* members = 0;
+  if (member_count > 0) {
+    members = arena_push(type_storage, member_count * sizeof(*members));
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(method_protos);
+    while (link) {
+      struct Ast* proto = link->ast;
+      struct TypeMember* member = &members[i++];
+      member->name = name_of(proto);
+      push_scope();
+      member->type = check_function_proto(proto, type);
+      pop_scope();
+      member->decl = proto;
+      link = link->next;
+    }
+  }
+  pop_scope();
+  type_set_members(type, members, member_count);
+}
+
+internal void
+check_function_declaration(struct Ast* decl)
+{
+  struct Ast* proto = (struct Ast*)ast_getattr(decl, "proto");
+  push_scope();
+  struct Type* function_type = check_function_proto(proto, 0);
+  struct Type* saved_return_type = return_type;
+  return_type = function_type->base;
+  check_statement((struct Ast*)ast_getattr(decl, "stmt"));
+  return_type = saved_return_type;
+  pop_scope();
+  declare_ident((struct Ast*)ast_getattr(proto, "name"), proto, function_type);
+}
+
+internal void
+check_action_declaration(struct Ast* decl)
+{
+  push_scope();
+  int param_count = 0;
+  struct Type** params = check_parameters((struct AstList*)ast_getattr(decl, "params"), &param_count);
+  struct Type* action_type = type_function(type_void, params, param_count);
+  struct Type* saved_return_type = return_type;
+  return_type = type_void;
+  check_statement((struct Ast*)ast_getattr(decl, "stmt"));
+  return_type = saved_return_type;
+  pop_scope();
+  declare_ident((struct Ast*)ast_getattr(decl, "name"), decl, action_type);
+}
+
+/*
+ * Members and calls.
+ */
+
+internal struct TypeMember*
+new_member(char* name, struct Type* type, struct Ast* decl)
+{
+  struct TypeMember* member = arena_push(type_storage, sizeof(*member));
+  member->name = name;
+  member->type = type;
+  member->decl = decl;
+  return member;
+}
+
+/* Built-in members of headers, header unions and header stacks. */
+internal struct Type*
+builtin_member_type(struct Type* type, char* name)
+{
+  if (type->kind == Type_Header || type->kind == Type_HeaderUnion) {
+    if (cstr_match(name, "isValid")) {
+      return type_function(type_bool, 0, 0);
+    } else if (type->kind == Type_Header && (cstr_match(name, "setValid") || cstr_match(name, "setInvalid"))) {
+      return type_function(type_void, 0, 0);
+    }
+  } else if (type->kind == Type_HeaderStack) {
+    if (cstr_match(name, "next") || cstr_match(name, "last")) {
+      return type->base;
+    } else if (cstr_match(name, "size") || cstr_match(name, "lastIndex") || cstr_match(name, "nextIndex")) {
+      return type_sized(Type_Bit, 32);
+    } else if (cstr_match(name, "push_front") || cstr_match(name, "pop_front")) {
+      return type_function(type_void, &type_int, 1);
+    }
+  }
+  return 0;
+}
+
+/* `T.member`, where `T` names an enum or `error`. */
+internal struct TypeMember*
+find_type_member(struct Type* type, char* name, int line_nr)
+{
+  struct TypeMember* member = 0;
+  if (type->kind == Type_Enum || type->kind == Type_Error) {
+    member = type_find_member(type, name, -1);
+  }
+  if (!member) {
+    error("at line %d: `%s` has no member `%s`.", line_nr, type_to_string(type), name);
+  }
+  return member;
+}
+
+internal struct TypeMember*
+find_value_member(struct Type* type, char* name, int arg_count, int line_nr)
+{
+  if (is_permissive(type)) {
+    return new_member(name, type_unknown, 0);
+  }
+  struct Type* builtin_type = builtin_member_type(type, name);
+  if (builtin_type) {
+    return new_member(name, builtin_type, 0);
+  }
+  struct Type* base = type_generic_base(type);
+  struct TypeMember* member = 0;
+  if (base->kind == Type_Struct || base->kind == Type_Header || base->kind == Type_HeaderUnion
+      || base->kind == Type_Extern || base->kind == Type_Parser || base->kind == Type_Control
+      || base->kind == Type_Table || base->kind == Type_ApplyResult) {
+    member = type_find_member(base, name, arg_count);
+  }
+  if (!member) {
+    error("at line %d: type `%s` has no member `%s`.", line_nr, type_to_string(type), name);
+  }
+  return member;
+}
+
+/* Returns the type named by `expr` if it names a type rather than a value. */
+internal struct Type*
+type_named_by(struct Ast* expr)
+{
+  if (expr->kind == Ast_Name) {
+    char* strname = (char*)ast_getattr(expr, "name");
+    if (cstr_match(strname, "error")) {
+      return set_type(expr, type_error);
+    }
+    struct SymtableEntry* entry = get_symtable_entry(strname);
+    if (!entry->id_ident && entry->id_type) {
+      return set_type(expr, symbol_type(entry->id_type));
+    }
+  } else if (expr->kind == Ast_SpecdType || expr->kind == Ast_HeaderStack || expr->kind == Ast_BaseType) {
+    return resolve_type_ref(expr);
+  }
+  return 0;
+}
+
+/* Index of `type_var` among the type parameters of `decl`, or -1. */
+internal int
+type_param_index(struct Ast* decl, struct Type* type_var)
+{
+  struct AstList* type_params = decl ? (struct AstList*)ast_getattr(decl, "type_params") : 0;
+  if (!type_params || type_var->kind != Type_TypeVar) {
+    return -1;
+  }
+  int i = 0;
+  struct AstListLink* link = ast_list_first_link(type_params);
+  while (link) {
+    if (link->ast == type_var->decl) {
+      return i;
+    }
+    i += 1;
+    link = link->next;
+  }
+  return -1;
+}
+
+internal void
+check_arguments(struct Type* function_type, struct Ast* decl, struct AstList* args, char* callee, int line_nr)
+{
+  int arg_count = list_count(args);
+  if (function_type && function_type->kind == Type_Function) {
+    if (arg_count > function_type->arg_count) {
+      error("at line %d: `%s` takes %d argument(s), %d given.", line_nr, callee, function_type->arg_count, arg_count);
+    }
+    if (decl && !in_table_property && arg_count < required_param_count(decl)) {
+      error("at line %d: `%s` takes %d argument(s), %d given.", line_nr, callee, required_param_count(decl),
+            arg_count);
+    }
+  }
+  if (!args) {
+    return;
+  }
+  int i = 0;
+  struct AstListLink* link = ast_list_first_link(args);
+  while (link) {
+    struct Ast* arg = link->ast;
+    if (arg->kind == Ast_Argument) {
+      check_expression((struct Ast*)ast_getattr(arg, "init_expr"));
+    } else if (arg->kind == Ast_Dontcare) {
+      set_type(arg, type_dontcare);
+    } else {
+      struct Type* arg_type = check_expression(arg);
+      if (function_type && function_type->kind == Type_Function && i < function_type->arg_count
+          && !type_is_assignable(function_type->args[i], arg_type)) {
+        error("at line %d: argument %d of `%s`: `%s` is not compatible with `%s`.", arg->line_nr, i + 1, callee,
+              type_to_string(arg_type), type_to_string(function_type->args[i]));
+      }
+    }
+    i += 1;
+    link = link->next;
+  }
+}
+
+struct Callee {
+  char* name;
+  struct Type* type;       /* function type, or the constructed type when `is_ctor` */
+  struct Ast* decl;        /* declaration with the `params` and `type_params` */
+  struct Type* receiver;   /* of a method */
+  bool is_ctor;
+};
+
+internal void
+resolve_name_callee(struct Callee* callee, struct Ast* name, int arg_count)
+{
+  char* strname = (char*)ast_getattr(name, "name");
+  callee->name = strname;
+  struct Type* ctor_type = type_named_by(name);
+  if (ctor_type) {
+    callee->is_ctor = true;
+    callee->type = ctor_type;
+    return;
+  }
+  struct Symbol* symbol = get_symtable_entry(strname)->id_ident;
+  if (!symbol) {
+    error("at line %d: unknown name `%s`.", name->line_nr, strname);
+  }
+  /* Overloads are declared one after another; prefer the one taking `arg_count` arguments. */
+  struct Symbol* overload = symbol;
+  while (overload && overload->scope_level == symbol->scope_level) {
+    struct Type* type = symbol_type(overload);
+    if (type->kind == Type_Function && type->arg_count >= arg_count
+        && (!overload->ast || required_param_count(overload->ast) <= arg_count)) {
+      symbol = overload;
+      break;
+    }
+    overload = overload->next_in_scope;
+  }
+  callee->type = set_type(name, symbol_type(symbol));
+  callee->decl = symbol->ast;
+  set_decl(name, symbol->ast);
+}
+
+internal void
+resolve_member_callee(struct Callee* callee, struct Type* receiver, struct Ast* member_name, int arg_count)
+{
+  callee->name = (char*)ast_getattr(member_name, "name");
+  callee->receiver = receiver;
+  struct TypeMember* member = find_value_member(receiver, callee->name, arg_count, member_name->line_nr);
+  callee->type = set_type(member_name, member->type);
+  callee->decl = member->decl;
+  set_decl(member_name, member->decl);
+}
+
+internal struct Type* check_lvalue_path(struct Ast* lvalue, int arg_count, struct Callee* callee);
+
+internal void
+resolve_callee(struct Callee* callee, struct Ast* expr, int arg_count)
+{
+  memset(callee, 0, sizeof(*callee));
+  if (expr->kind == Ast_Name) {
+    resolve_name_callee(callee, expr, arg_count);
+  } else if (expr->kind == Ast_MemberSelectExpr) {
+    struct Ast* member_name = (struct Ast*)ast_getattr(expr, "member_name");
+    struct Type* receiver = check_expression((struct Ast*)ast_getattr(expr, "expr"));
+    resolve_member_callee(callee, receiver, member_name, arg_count);
+    set_type(expr, callee->type);
+  } else if (expr->kind == Ast_Lvalue) {
+    check_lvalue_path(expr, arg_count, callee);
+  } else if (expr->kind == Ast_SpecdType) {
+    callee->is_ctor = true;
+    callee->type = resolve_type_ref(expr);
+    callee->name = type_to_string(callee->type);
+  } else {
+    callee->name = "expression";
+    callee->type = check_expression(expr);
+  }
+}
+
+/* Return type of a call, with type variables bound by explicit type arguments
+   or by the specialization of the receiver. */
+internal struct Type*
+call_return_type(struct Callee* callee, struct AstList* type_args)
+{
+  struct Type* type = callee->type;
+  if (type->kind != Type_Function) {
+    return type_unknown;
+  }
+  struct Type* ret_type = type->base;
+  if (ret_type->kind != Type_TypeVar) {
+    return ret_type;
+  }
+  int i = type_param_index(callee->decl, ret_type);
+  if (i >= 0 && i < list_count(type_args)) {
+    int arg_count = 0;
+    struct Type** args = resolve_type_list(type_args, &arg_count);
+    return args[i];
+  }
+  if (callee->receiver && callee->receiver->kind == Type_Specialized) {
+    i = type_param_index(type_generic_base(callee->receiver)->decl, ret_type);
+    if (i >= 0 && i < callee->receiver->arg_count) {
+      return callee->receiver->args[i];
+    }
+  }
+  return ret_type;
+}
+
+internal struct Type*
+check_call(struct Ast* callee_expr, struct AstList* type_args, struct AstList* args, int line_nr)
+{
+  struct Callee callee;
+  int arg_count = list_count(args);
+  if (callee_expr->kind == Ast_TypeArgsExpr) {
+    type_args = (struct AstList*)ast_getattr(callee_expr, "type_args");
+    callee_expr = (struct Ast*)ast_getattr(callee_expr, "expr");
+  }
+  resolve_callee(&callee, callee_expr, arg_count);
+  if (callee.is_ctor) {
+    struct Type* base = type_generic_base(callee.type);
+    struct TypeMember* ctor = base->name ? type_find_member(base, base->name, arg_count) : 0;
+    check_arguments(ctor ? ctor->type : 0, ctor ? ctor->decl : 0, args, callee.name, line_nr);
+    return callee.type;
+  }
+  if (callee.type->kind != Type_Function && !is_permissive(callee.type)) {
+    error("at line %d: `%s` is not a function.", line_nr, callee.name);
+  }
+  check_arguments(callee.type, callee.decl, args, callee.name, line_nr);
+  return call_return_type(&callee, type_args);
+}
+
+/*
+ * Expressions.
+ */
+
+internal struct Type*
+check_name_expression(struct Ast* name)
+{
+  char* strname = (char*)ast_getattr(name, "name");
+  struct SymtableEntry* entry = get_symtable_entry(strname);
+  if (entry->id_ident) {
+    set_decl(name, entry->id_ident->ast);
+    return symbol_type(entry->id_ident);
+  }
+  struct Type* type = type_named_by(name);
+  if (!type) {
+    error("at line %d: unknown name `%s`.", name->line_nr, strname);
+  }
+  return type;
+}
+
+internal struct Type*
+check_index(struct Type* type, struct Ast* array_index)
+{
+  struct Ast* index = (struct Ast*)ast_getattr(array_index, "index");
+  struct Ast* colon_index = (struct Ast*)ast_getattr(array_index, "colon_index");
+  check_expression(index);
+  struct Type* result = 0;
+  if (colon_index) {
+    check_expression(colon_index);
+    if (!is_permissive(type) && !type_is_integral(type)) {
+      error("at line %d: cannot take a bit slice of `%s`.", array_index->line_nr, type_to_string(type));
+    }
+    int high = constant_int(index), low = constant_int(colon_index);
+    if (high >= 0 && low >= 0) {
+      if (high < low) {
+        error("at line %d: bit slice [%d:%d] is empty.", array_index->line_nr, high, low);
+      }
+      result = type_sized(Type_Bit, high - low + 1);
+    } else {
+      result = type_sized(Type_Bit, -1);
+    }
+  } else if (type->kind == Type_HeaderStack) {
+    result = type->base;
+  } else if (type->kind == Type_Tuple) {
+    int i = constant_int(index);
+    result = (i >= 0 && i < type->arg_count) ? type->args[i] : type_unknown;
+  } else if (is_permissive(type)) {
+    result = type_unknown;
+  } else error("at line %d: `%s` cannot be indexed.", array_index->line_nr, type_to_string(type));
+  return set_type(array_index, result);
+}
+
+internal char*
+operator_string(enum AstExprOperator op)
+{
+  static char* strings[] = {
+    [AstExprOp_Add] = "+", [AstExprOp_Sub] = "-", [AstExprOp_Mul] = "*", [AstExprOp_Div] = "/",
+    [AstExprOp_And] = "&&", [AstExprOp_Or] = "||", [AstExprOp_Equal] = "==", [AstExprOp_NotEqual] = "!=",
+    [AstExprOp_Less] = "<", [AstExprOp_Greater] = ">", [AstExprOp_LessEqual] = "<=",
+    [AstExprOp_GreaterEqual] = ">=", [AstExprOp_BitAnd] = "&", [AstExprOp_BitOr] = "|",
+    [AstExprOp_BitXor] = "^", [AstExprOp_BitShiftLeft] = "<<", [AstExprOp_BitShiftRight] = ">>",
+    [AstExprOp_Mask] = "&&&", [AstExprOp_Minus] = "-", [AstExprOp_LogNot] = "!", [AstExprOp_BitNot] = "~",
+  };
+  return strings[op];
+}
+
+/* Common type of the operands of an arithmetic or bitwise operator. */
+internal struct Type*
+arithmetic_type(struct Type* left, struct Type* right, enum AstExprOperator op, int line_nr)
+{
+  if (left->kind == Type_Enum && left->base) {
+    left = left->base;
+  }
+  if (right->kind == Type_Enum && right->base) {
+    right = right->base;
+  }
+  if (left == right || right->kind == Type_Int || is_permissive(right)) {
+    return left;
+  }
+  if (left->kind == Type_Int || is_permissive(left)) {
+    return right;
+  }
+  if (left->kind == right->kind && (left->width < 0 || right->width < 0)) {
+    return left->width < 0 ? right : left;
+  }
+  error("at line %d: operands of `%s` have different types `%s` and `%s`.", line_nr, operator_string(op),
+        type_to_string(left), type_to_string(right));
+  return 0;
+}
+
+internal struct Type*
+check_binary_expression(struct Ast* expr)
+{
+  enum AstExprOperator op = *(enum AstExprOperator*)ast_getattr(expr, "op");
+  struct Type* left = check_expression((struct Ast*)ast_getattr(expr, "left_operand"));
+  struct Type* right = check_expression((struct Ast*)ast_getattr(expr, "right_operand"));
+  struct Type* type = 0;
+  if (op == AstExprOp_And || op == AstExprOp_Or) {
+    if (!type_is_assignable(type_bool, left) || !type_is_assignable(type_bool, right)) {
+      error("at line %d: operands of `%s` must be `bool`, got `%s` and `%s`.", expr->line_nr, operator_string(op),
+            type_to_string(left), type_to_string(right));
+    }
+    type = type_bool;
+  } else if (op == AstExprOp_Equal || op == AstExprOp_NotEqual || op == AstExprOp_Less || op == AstExprOp_Greater
+             || op == AstExprOp_LessEqual || op == AstExprOp_GreaterEqual) {
+    if (!type_is_assignable(left, right) && !type_is_assignable(right, left)) {
+      error("at line %d: cannot compare `%s` with `%s`.", expr->line_nr, type_to_string(left), type_to_string(right));
+    }
+    type = type_bool;
+  } else if (op == AstExprOp_BitShiftLeft || op == AstExprOp_BitShiftRight) {
+    type = left;
+  } else {
+    type = arithmetic_type(left, right, op, expr->line_nr);
+  }
+  return type;
+}
+
+internal struct Type*
+check_unary_expression(struct Ast* expr)
+{
+  enum AstExprOperator op = *(enum AstExprOperator*)ast_getattr(expr, "op");
+  struct Type* operand = check_expression((struct Ast*)ast_getattr(expr, "expr"));
+  if (op == AstExprOp_LogNot) {
+    if (!type_is_assignable(type_bool, operand)) {
+      error("at line %d: operand of `!` must be `bool`, got `%s`.", expr->line_nr, type_to_string(operand));
+    }
+    return type_bool;
+  }
+  return operand;
+}
+
+internal struct Type*
+check_member_select(struct Ast* expr)
+{
+  struct Ast* operand = (struct Ast*)ast_getattr(expr, "expr");
+  struct Ast* member_name = (struct Ast*)ast_getattr(expr, "member_name");
+  char* strname = (char*)ast_getattr(member_name, "name");
+  struct Type* type = type_named_by(operand);
+  struct TypeMember* member = 0;
+  if (type) {
+    member = find_type_member(type, strname, member_name->line_nr);
+  } else {
+    member = find_value_member(check_expression(operand), strname, -1, member_name->line_nr);
+  }
+  set_decl(member_name, member->decl);
+  return set_type(member_name, member->type);
+}
+
+internal struct Type*
+check_expression_list(struct AstList* expr_list)
+{
+  int elem_count = list_count(expr_list);
+  struct Type** elems = 0;
+  if (elem_count > 0) {
+    elems = arena_push(type_storage, elem_count * sizeof(*elems));
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(expr_list);
+    while (link) {
+      elems[i++] = check_expression(link->ast);
+      link = link->next;
+    }
+  }
+  return type_tuple(elems, elem_count);
+}
+
+internal struct Type*
+check_expression(struct Ast* expr)
+{
+  struct Type* type = 0;
+  if (expr->kind == Ast_Name) {
+    type = check_name_expression(expr);
+  } else if (expr->kind == Ast_Int) {
+    enum AstIntegerFlags flags = *(enum AstIntegerFlags*)ast_getattr(expr, "flags");
+    if (flags & AstInteger_HasWidth) {
+      int width = *(int*)ast_getattr(expr, "width");
+      type = type_sized((flags & AstInteger_IsSigned) ? Type_SignedInt : Type_Bit, width);
+    } else {
+      type = type_int;
+    }
+  } else if (expr->kind == Ast_Bool) {
+    type = type_bool;
+  } else if (expr->kind == Ast_StringLiteral) {
+    type = type_string;
+  } else if (expr->kind == Ast_Dontcare || expr->kind == Ast_Default) {
+    type = type_dontcare;
+  } else if (expr->kind == Ast_BaseType || expr->kind == Ast_SpecdType || expr->kind == Ast_HeaderStack
+             || expr->kind == Ast_Tuple) {
+    type = resolve_type_ref(expr);
+  } else if (expr->kind == Ast_ExpressionListExpr) {
+    type = check_expression_list((struct AstList*)ast_getattr(expr, "expr_list"));
+  } else if (expr->kind == Ast_KvPair) {
+    type = check_expression((struct Ast*)ast_getattr(expr, "expr"));
+  } else if (expr->kind == Ast_CastExpr) {
+    type = resolve_type_ref((struct Ast*)ast_getattr(expr, "to_type"));
+    check_expression((struct Ast*)ast_getattr(expr, "expr"));
+  } else if (expr->kind == Ast_UnaryExpr) {
+    type = check_unary_expression(expr);
+  } else if (expr->kind == Ast_BinaryExpr) {
+    type = check_binary_expression(expr);
+  } else if (expr->kind == Ast_MemberSelectExpr) {
+    type = check_member_select(expr);
+  } else if (expr->kind == Ast_IndexedArrayExpr) {
+    struct Type* array_type = check_expression((struct Ast*)ast_getattr(expr, "expr"));
+    type = check_index(array_type, (struct Ast*)ast_getattr(expr, "index_expr"));
+  } else if (expr->kind == Ast_FunctionCallExpr) {
+    type = check_call((struct Ast*)ast_getattr(expr, "expr"), 0, (struct AstList*)ast_getattr(expr, "args"),
+                      expr->line_nr);
+  } else if (expr->kind == Ast_TypeArgsExpr) {
+    type = check_expression((struct Ast*)ast_getattr(expr, "expr"));
+  } else assert(0);
+  return set_type(expr, type);
+}
+
+/*
+ * Statements.
+ */
+
+/* Type of an lvalue, or with `callee` set, the method it names. */
+internal struct Type*
+check_lvalue_path(struct Ast* lvalue, int arg_count, struct Callee* callee)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(lvalue, "name");
+  struct AstList* path = (struct AstList*)ast_getattr(lvalue, "expr");
+  if (!path && callee) {
+    resolve_name_callee(callee, name, arg_count);
+    return set_type(lvalue, callee->type);
+  }
+  struct Type* type = set_type(name, check_name_expression(name));
+  struct AstListLink* link = path ? ast_list_first_link(path) : 0;
+  while (link) {
+    struct Ast* elem = link->ast;
+    if (elem->kind == Ast_Name) {
+      if (!link->next && callee) {
+        resolve_member_callee(callee, type, elem, arg_count);
+        type = callee->type;
+      } else {
+        char* strname = (char*)ast_getattr(elem, "name");
+        type = set_type(elem, find_value_member(type, strname, -1, elem->line_nr)->type);
+      }
+    } else if (elem->kind == Ast_ArrayIndex) {
+      type = check_index(type, elem);
+    } else assert(0);
+    link = link->next;
+  }
+  if (callee && !callee->name) {
+    callee->name = (char*)ast_getattr(name, "name");
+    callee->type = type;
+  }
+  return set_type(lvalue, type);
+}
+
+internal void
+check_var_declaration(struct Ast* decl, char* type_attr, char* init_attr)
+{
+  struct Type* type = resolve_type_ref((struct Ast*)ast_getattr(decl, type_attr));
+  struct Ast* init_expr = (struct Ast*)ast_getattr(decl, init_attr);
+  if (init_expr) {
+    check_assignable(type, check_expression(init_expr), init_expr->line_nr, "initializer");
+  }
+  declare_ident((struct Ast*)ast_getattr(decl, "name"), decl, type);
+}
+
+/* Integer and `bool` constants must have a value at compile time. */
+internal void
+check_constant_initializer(struct Ast* decl)
+{
+  struct Type* type = type_of_node(decl);
+  if (type->kind == Type_Enum && type->base) {
+    type = type->base;
+  }
+  if (type->kind == Type_Int || type == type_bool || (type_is_integral(type) && type->width > 0)) {
+    struct Ast* expr = (struct Ast*)ast_getattr(decl, "expr");
+    if (!const_value_of(expr)) {
+      error("at line %d: the value of constant `%s` is not known at compile time.", expr->line_nr, name_of(decl));
+    }
+  }
+}
+
+internal void
+check_instantiation(struct Ast* inst)
+{
+  struct Type* type = resolve_type_ref((struct Ast*)ast_getattr(inst, "type_ref"));
+  struct Type* base = type_generic_base(type);
+  struct AstList* args = (struct AstList*)ast_getattr(inst, "args");
+  struct TypeMember* ctor = base->name ? type_find_member(base, base->name, list_count(args)) : 0;
+  check_arguments(ctor ? ctor->type : 0, ctor ? ctor->decl : 0, args, type_to_string(type), inst->line_nr);
+  declare_ident((struct Ast*)ast_getattr(inst, "name"), inst, type);
+}
+
+internal void
+check_statement_list(struct AstList* stmt_list)
+{
+  struct AstListLink* link = stmt_list ? ast_list_first_link(stmt_list) : 0;
+  while (link) {
+    check_statement(link->ast);
+    link = link->next;
+  }
+}
+
+internal void
+check_statement(struct Ast* stmt)
+{
+  if (stmt->kind == Ast_BlockStmt) {
+    push_scope();
+    check_statement_list((struct AstList*)ast_getattr(stmt, "stmt_list"));
+    pop_scope();
+  } else if (stmt->kind == Ast_VarDecl) {
+    check_var_declaration(stmt, "type", "init_expr");
+  } else if (stmt->kind == Ast_ConstDecl) {
+    check_var_declaration(stmt, "type_ref", "expr");
+    check_constant_initializer(stmt);
+  } else if (stmt->kind == Ast_Instantiation) {
+    check_instantiation(stmt);
+  } else if (stmt->kind == Ast_AssignmentStmt) {
+    struct Type* lvalue_type = check_lvalue_path((struct Ast*)ast_getattr(stmt, "lvalue"), -1, 0);
+    struct Type* expr_type = check_expression((struct Ast*)ast_getattr(stmt, "expr"));
+    check_assignable(lvalue_type, expr_type, stmt->line_nr, "assignment");
+  } else if (stmt->kind == Ast_MethodCallStmt) {
+    check_call((struct Ast*)ast_getattr(stmt, "lvalue"), (struct AstList*)ast_getattr(stmt, "type_args"),
+               (struct AstList*)ast_getattr(stmt, "args"), stmt->line_nr);
+  } else if (stmt->kind == Ast_DirectApplic) {
+    /* The parser takes `t.apply()` for a direct application when `t` was also seen as a type name. */
+    struct Ast* name = (struct Ast*)ast_getattr(stmt, "name");
+    struct Type* type = type_named_by(name);
+    if (!type) {
+      type = set_type(name, check_expression(name));
+    }
+    struct AstList* args = (struct AstList*)ast_getattr(stmt, "args");
+    struct TypeMember* apply = find_value_member(type, "apply", list_count(args), stmt->line_nr);
+    check_arguments(apply->type, apply->decl, args, "apply", stmt->line_nr);
+  } else if (stmt->kind == Ast_IfStmt) {
+    struct Ast* cond_expr = (struct Ast*)ast_getattr(stmt, "cond_expr");
+    struct Type* cond_type = check_expression(cond_expr);
+    if (!type_is_assignable(type_bool, cond_type)) {
+      error("at line %d: condition must be `bool`, got `%s`.", cond_expr->line_nr, type_to_string(cond_type));
+    }
+    check_statement((struct Ast*)ast_getattr(stmt, "stmt"));
+    struct Ast* else_stmt = (struct Ast*)ast_getattr(stmt, "else_stmt");
+    if (else_stmt) {
+      check_statement(else_stmt);
+    }
+  } else if (stmt->kind == Ast_SwitchStmt) {
+    check_expression((struct Ast*)ast_getattr(stmt, "expr"));
+    struct AstList* switch_cases = (struct AstList*)ast_getattr(stmt, "switch_cases");
+    struct AstListLink* link = switch_cases ? ast_list_first_link(switch_cases) : 0;
+    while (link) {
+      struct Ast* case_stmt = (struct Ast*)ast_getattr(link->ast, "stmt");
+      if (case_stmt) {
+        check_statement(case_stmt);
+      }
+      link = link->next;
+    }
+  } else if (stmt->kind == Ast_ReturnStmt) {
+    struct Ast* expr = (struct Ast*)ast_getattr(stmt, "expr");
+    if (expr) {
+      struct Type* expr_type = check_expression(expr);
+      if (!return_type || return_type == type_void) {
+        error("at line %d: a value is returned where none is expected.", stmt->line_nr);
+      }
+      check_assignable(return_type, expr_type, expr->line_nr, "return value");
+    } else if (return_type && return_type != type_void) {
+      error("at line %d: a value of type `%s` must be returned.", stmt->line_nr, type_to_string(return_type));
+    }
+  } else if (stmt->kind == Ast_ExitStmt || stmt->kind == Ast_EmptyStmt) {
+    ;  // pass
+  } else assert(0);
+}
+
+/*
+ * Parsers, controls and tables.
+ */
+
+/* `keyset` is matched against `key_count` values of the given types. */
+internal void
+check_keyset(struct Ast* keyset, struct Type** key_types, int key_count)
+{
+  if (keyset->kind == Ast_Default || keyset->kind == Ast_Dontcare) {
+    set_type(keyset, type_dontcare);
+    return;
+  }
+  if (keyset->kind == Ast_TupleKeyset) {
+    struct AstList* expr_list = (struct AstList*)ast_getattr(keyset, "expr_list");
+    if (list_count(expr_list) != key_count) {
+      error("at line %d: keyset has %d element(s), %d expected.", keyset->line_nr, list_count(expr_list), key_count);
+    }
+    int i = 0;
+    struct AstListLink* link = ast_list_first_link(expr_list);
+    while (link) {
+      check_keyset(link->ast, &key_types[i++], 1);
+      link = link->next;
+    }
+    return;
+  }
+  struct Type* type = check_expression(keyset);
+  if (key_count == 1) {
+    check_assignable(key_types[0], type, keyset->line_nr, "keyset");
+  } else if (type->kind != Type_Tuple && !is_permissive(type)) {
+    error("at line %d: keyset has 1 element, %d expected.", keyset->line_nr, key_count);
+  }
+}
+
+internal void
+check_transition_target(struct Ast* name)
+{
+  char* strname = (char*)ast_getattr(name, "name");
+  if (cstr_match(strname, "accept") || cstr_match(strname, "reject")) {
+    return;
+  }
+  struct Symbol* symbol = get_symtable_entry(strname)->id_ident;
+  if (!symbol || symbol_type(symbol) != type_state) {
+    error("at line %d: `%s` is not a parser state.", name->line_nr, strname);
+  }
+  set_decl(name, symbol->ast);
+}
+
+internal void
+check_parser_state(struct Ast* state)
+{
+  push_scope();
+  check_statement_list((struct AstList*)ast_getattr(state, "stmt_list"));
+  struct Ast* trans_stmt = (struct Ast*)ast_getattr(state, "trans_stmt");
+  if (trans_stmt && trans_stmt->kind == Ast_Name) {
+    check_transition_target(trans_stmt);
+  } else if (trans_stmt && trans_stmt->kind == Ast_SelectExpr) {
+    struct AstList* expr_list = (struct AstList*)ast_getattr(trans_stmt, "expr_list");
+    struct Type* select_type = check_expression_list(expr_list);
+    struct AstList* case_list = (struct AstList*)ast_getattr(trans_stmt, "case_list");
+    struct AstListLink* link = case_list ? ast_list_first_link(case_list) : 0;
+    while (link) {
+      struct Ast* select_case = link->ast;
+      check_keyset((struct Ast*)ast_getattr(select_case, "keyset"), select_type->args, select_type->arg_count);
+      check_transition_target((struct Ast*)ast_getattr(select_case, "name"));
+      link = link->next;
+    }
+  }
+  pop_scope();
+}
+
+/* Declares the parser or control type and its parameters, in a scope the caller opens. */
+internal struct Type*
+check_block_type(struct Ast* decl, enum TypeKind kind)
+{
+  struct Ast* type_decl = (struct Ast*)ast_getattr(decl, "type_decl");
+  struct Ast* name = (struct Ast*)ast_getattr(type_decl, "name");
+  char* strname = (char*)ast_getattr(name, "name");
+  struct Type* type = type_nominal(kind, strname, type_decl);
+  declare_type(name, type_decl, type);
+
+  push_scope();
+  declare_type_params((struct AstList*)ast_getattr(type_decl, "type_params"));
+  int param_count = 0;
+  struct Type** params = check_parameters((struct AstList*)ast_getattr(type_decl, "params"), &param_count);
+  int ctor_param_count = 0;
+  struct Type** ctor_params = check_parameters((struct AstList*)ast_getattr(decl, "ctor_params"), &ctor_param_count);
+  struct TypeMember* members = arena_push(type_storage, 2 * sizeof(*members));
+  members[0].name = "apply";
+  members[0].type = type_function(type_void, params, param_count);
+  members[0].decl = type_decl;
+  members[1].name = strname;
+  members[1].type = type_function(type, ctor_params, ctor_param_count);
+  members[1].decl = 0;
+  type_set_members(type, members, 2);
+  return type;
+}
+
+internal void
+check_parser(struct Ast* decl)
+{
+  check_block_type(decl, Type_Parser);
+  struct AstList* states = (struct AstList*)ast_getattr(decl, "states");
+  if (states) {
+    check_statement_list((struct AstList*)ast_getattr(decl, "local_elements"));
+    struct AstListLink* link = ast_list_first_link(states);
+    while (link) {
+      declare_ident((struct Ast*)ast_getattr(link->ast, "name"), link->ast, type_state);
+      link = link->next;
+    }
+    struct Type* saved_return_type = return_type;
+    return_type = 0;
+    link = ast_list_first_link(states);
+    while (link) {
+      check_parser_state(link->ast);
+      link = link->next;
+    }
+    return_type = saved_return_type;
+  }
+  pop_scope();
+}
+
+internal void
+check_action_ref(struct Ast* action_ref)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(action_ref, "name");
+  struct Callee callee;
+  memset(&callee, 0, sizeof(callee));
+  struct AstList* args = (struct AstList*)ast_getattr(action_ref, "args");
+  resolve_name_callee(&callee, name, list_count(args));
+  if (callee.is_ctor || (callee.type->kind != Type_Function && !is_permissive(callee.type))) {
+    error("at line %d: `%s` is not an action.", name->line_nr, callee.name);
+  }
+  check_arguments(callee.type, callee.decl, args, callee.name, action_ref->line_nr);
+}
+
+internal void
+check_table(struct Ast* decl)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  struct Type* type = type_nominal(Type_Table, (char*)ast_getattr(name, "name"), decl);
+  struct TypeMember* apply = new_member("apply", type_function(type_apply_result, 0, 0), 0);
+  type_set_members(type, apply, 1);
+
+  /* Control-plane arguments of the actions are not given in table properties. */
+  in_table_property = true;
+  struct Type** key_types = 0;
+  int key_count = 0;
+  struct AstList* prop_list = (struct AstList*)ast_getattr(decl, "prop_list");
+  struct AstListLink* link = prop_list ? ast_list_first_link(prop_list) : 0;
+  while (link) {
+    struct Ast* prop = link->ast;
+    if (prop->kind == Ast_TableProp_Key) {
+      struct AstList* keyelem_list = (struct AstList*)ast_getattr(prop, "keyelem_list");
+      key_count = list_count(keyelem_list);
+      key_types = arena_push(type_storage, (key_count + 1) * sizeof(*key_types));
+      int i = 0;
+      struct AstListLink* key_link = keyelem_list ? ast_list_first_link(keyelem_list) : 0;
+      while (key_link) {
+        struct Ast* key_elem = key_link->ast;
+        key_types[i++] = check_expression((struct Ast*)ast_getattr(key_elem, "expr"));
+        struct Ast* match_kind = (struct Ast*)ast_getattr(key_elem, "name");
+        struct Symbol* symbol = get_symtable_entry((char*)ast_getattr(match_kind, "name"))->id_ident;
+        if (!symbol || symbol_type(symbol) != type_match_kind) {
+          error("at line %d: `%s` is not a match kind.", match_kind->line_nr, (char*)ast_getattr(match_kind, "name"));
+        }
+        set_type(match_kind, type_match_kind);
+        key_link = key_link->next;
+      }
+    } else if (prop->kind == Ast_TableProp_Actions) {
+      struct AstList* action_list = (struct AstList*)ast_getattr(prop, "action_list");
+      struct AstListLink* action_link = action_list ? ast_list_first_link(action_list) : 0;
+      while (action_link) {
+        check_action_ref(action_link->ast);
+        action_link = action_link->next;
+      }
+    } else if (prop->kind == Ast_TableProp_Entries) {
+      struct AstList* entries = (struct AstList*)ast_getattr(prop, "entries");
+      struct AstListLink* entry_link = entries ? ast_list_first_link(entries) : 0;
+      while (entry_link) {
+        struct Ast* entry = entry_link->ast;
+        check_keyset((struct Ast*)ast_getattr(entry, "keyset"), key_types, key_count);
+        check_action_ref((struct Ast*)ast_getattr(entry, "action"));
+        entry_link = entry_link->next;
+      }
+    } else if (prop->kind == Ast_TableProp_SingleEntry) {
+      check_expression((struct Ast*)ast_getattr(prop, "init_expr"));
+    } else assert(0);
+    link = link->next;
+  }
+  in_table_property = false;
+  declare_ident(name, decl, type);
+}
+
+internal void
+check_control(struct Ast* decl)
+{
+  check_block_type(decl, Type_Control);
+  struct AstList* local_decls = (struct AstList*)ast_getattr(decl, "local_decls");
+  struct AstListLink* link = local_decls ? ast_list_first_link(local_decls) : 0;
+  while (link) {
+    struct Ast* local_decl = link->ast;
+    if (local_decl->kind == Ast_ActionDecl) {
+      check_action_declaration(local_decl);
+    } else if (local_decl->kind == Ast_TableDecl) {
+      check_table(local_decl);
+    } else {
+      check_statement(local_decl);
+    }
+    link = link->next;
+  }
+  struct Ast* apply_stmt = (struct Ast*)ast_getattr(decl, "apply_stmt");
+  if (apply_stmt) {
+    struct Type* saved_return_type = return_type;
+    return_type = type_void;
+    check_statement(apply_stmt);
+    return_type = saved_return_type;
+  }
+  pop_scope();
+}
+
+internal void
+check_package(struct Ast* decl)
+{
+  struct Ast* name = (struct Ast*)ast_getattr(decl, "name");
+  char* strname = (char*)ast_getattr(name, "name");
+  struct Type* type = type_nominal(Type_Package, strname, decl);
+  declare_type(name, decl, type);
+  push_scope();
+  declare_type_params((struct AstList*)ast_getattr(decl, "type_params"));
+  int param_count = 0;
+  struct Type** params = check_parameters((struct AstList*)ast_getattr(decl, "params"), &param_count);
+  pop_scope();
+  type_set_members(type, new_member(strname, type_function(type, params, param_count), decl), 1);
+}
+
+internal void
+init_builtin_types()
+{
+  type_unknown = type_basic(Type_Unknown);
+  type_dontcare = type_basic(Type_Dontcare);
+  type_void = type_basic(Type_Void);
+  type_bool = type_basic(Type_Bool);
+  type_string = type_basic(Type_String);
+  type_error = type_basic(Type_Error);
+  type_match_kind = type_basic(Type_MatchKind);
+  type_int = type_basic(Type_Int);
+  type_state = type_nominal(Type_State, "state", 0);
+  type_apply_result = type_basic(Type_ApplyResult);
+  struct TypeMember* members = arena_push(type_storage, 3 * sizeof(*members));
+  members[0].name = "hit";
+  members[0].type = type_bool;
+  members[0].decl = 0;
+  members[1].name = "miss";
+  members[1].type = type_bool;
+  members[1].decl = 0;
+  members[2].name = "action_run";
+  members[2].type = type_unknown;
+  members[2].decl = 0;
+  type_set_members(type_apply_result, members, 3);
+  error_members = 0;
+  error_member_count = 0;
+}
+
+void
+type_check_program(struct Ast* p4program, int ast_node_count, struct Arena* type_storage_)
+{
+  assert(p4program->kind == Ast_P4Program);
+  type_storage = type_storage_;
+  types_set_storage(type_storage);
+  types_init();
+  init_builtin_types();
+  node_type_count = ast_node_count + 1;
+  node_types = arena_push(type_storage, node_type_count * sizeof(*node_types));
+  memset(node_types, 0, node_type_count * sizeof(*node_types));
+  node_decls = arena_push(type_storage, node_type_count * sizeof(*node_decls));
+  memset(node_decls, 0, node_type_count * sizeof(*node_decls));
+  const_eval_init(ast_node_count, type_storage);
+  return_type = 0;
+  in_table_property = false;
+
+  push_scope();
+  struct AstList* decl_list = (struct AstList*)ast_getattr(p4program, "decl_list");
+  struct AstListLink* link = ast_list_first_link(decl_list);
+  while (link) {
+    struct Ast* decl = link->ast;
+    if (decl->kind == Ast_StructDecl || decl->kind == Ast_HeaderDecl || decl->kind == Ast_HeaderUnionDecl
+        || decl->kind == Ast_EnumDecl || decl->kind == Ast_TypeDecl) {
+      check_type_declaration(decl);
+    } else if (decl->kind == Ast_Error) {
+      check_error_declaration(decl);
+    } else if (decl->kind == Ast_MatchKind) {
+      check_match_kind_declaration(decl);
+    } else if (decl->kind == Ast_ExternDecl || decl->kind == Ast_FunctionProto) {
+      check_extern_declaration(decl);
+    } else if (decl->kind == Ast_FunctionDecl) {
+      check_function_declaration(decl);
+    } else if (decl->kind == Ast_ActionDecl) {
+      check_action_declaration(decl);
+    } else if (decl->kind == Ast_Parser) {
+      check_parser(decl);
+    } else if (decl->kind == Ast_Control) {
+      check_control(decl);
+    } else if (decl->kind == Ast_Package) {
+      check_package(decl);
+    } else if (decl->kind == Ast_ConstDecl || decl->kind == Ast_Instantiation) {
+      check_statement(decl);
+    } else assert(0);
+    link = link->next;
+  }
+  pop_scope();
+}
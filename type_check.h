@@ -0,0 +1,9 @@
+#pragma once
+#include "arena.h"
+#include "ast.h"
+#include "types.h"
+
+
+void type_check_program(struct Ast* p4program, int ast_node_count, struct Arena* type_storage_);
+struct Type* type_of_node(struct Ast* ast);
+struct Ast* decl_of_node(struct Ast* ast);
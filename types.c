@@ -0,0 +1,420 @@
+#include "arena.h"
+#include "types.h"
+#include <memory.h>  // memset
+
+
+internal struct Arena* type_storage;
+internal struct Type** type_table = 0;
+internal int table_capacity_log2 = 8;
+internal int table_capacity = 0;
+internal int type_count = 0;
+
+
+internal uint32_t
+mix_word(uint32_t h, uint64_t word)
+{
+  /* FNV-1a over the 8 bytes of `word`. */
+  int i;
+  for (i = 0; i < 8; i++) {
+    h ^= (uint8_t)(word >> (i * 8));
+    h *= 16777619u;
+  }
+  return h;
+}
+
+internal uint32_t
+type_hash(struct Type* type)
+{
+  uint32_t h = 2166136261u;
+  h = mix_word(h, type->kind);
+  if (type->kind >= Type_TypeVar) {
+    /* Nominal: the declaration is the identity, `base` is filled in later. */
+    return mix_word(h, (uint64_t)type->decl);
+  }
+  h = mix_word(h, (uint64_t)(int64_t)type->width);
+  h = mix_word(h, (uint64_t)type->decl);
+  h = mix_word(h, (uint64_t)type->base);
+  int i;
+  for (i = 0; i < type->arg_count; i++) {
+    h = mix_word(h, (uint64_t)type->args[i]);
+  }
+  return h;
+}
+
+internal bool
+type_key_match(struct Type* a, struct Type* b)
+{
+  if (a->kind >= Type_TypeVar || b->kind >= Type_TypeVar) {
+    return a->kind == b->kind && a->decl == b->decl;
+  }
+  if (a->kind != b->kind || a->width != b->width || a->decl != b->decl || a->base != b->base
+      || a->arg_count != b->arg_count) {
+    return false;
+  }
+  int i;
+  for (i = 0; i < a->arg_count; i++) {
+    if (a->args[i] != b->args[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+internal void
+grow_type_table()
+{
+  struct Type** old_table = type_table;
+  int old_capacity = table_capacity;
+  table_capacity = 1 << ++table_capacity_log2;
+  type_table = arena_push(type_storage, table_capacity * sizeof(*type_table));
+  memset(type_table, 0, table_capacity * sizeof(*type_table));
+  int i;
+  for (i = 0; i < old_capacity; i++) {
+    struct Type* type = old_table[i];
+    while (type) {
+      struct Type* next_type = type->next_in_bucket;
+      uint32_t h = type_hash(type) & (table_capacity - 1);
+      type->next_in_bucket = type_table[h];
+      type_table[h] = type;
+      type = next_type;
+    }
+  }
+}
+
+/* Returns the canonical object for the key fields of `proto`, creating it if needed. */
+internal struct Type*
+intern_type(struct Type* proto)
+{
+  uint32_t h = type_hash(proto) & (table_capacity - 1);
+  struct Type* type = type_table[h];
+  while (type) {
+    if (type_key_match(type, proto))
+      return type;
+    type = type->next_in_bucket;
+  }
+  if (type_count >= table_capacity) {
+    grow_type_table();
+    h = type_hash(proto) & (table_capacity - 1);
+  }
+  type = arena_push(type_storage, sizeof(*type));
+  *type = *proto;
+  if (proto->arg_count > 0) {
+    type->args = arena_push(type_storage, proto->arg_count * sizeof(*type->args));
+    memcpy(type->args, proto->args, proto->arg_count * sizeof(*type->args));
+  }
+  type->id = ++type_count;
+  type->next_in_bucket = type_table[h];
+  type_table[h] = type;
+  return type;
+}
+
+struct Type*
+type_basic(enum TypeKind kind)
+{
+  struct Type proto = {};
+  proto.kind = kind;
+  proto.width = -1;
+  return intern_type(&proto);
+}
+
+struct Type*
+type_sized(enum TypeKind kind, int width)
+{
+  assert(kind == Type_Bit || kind == Type_SignedInt || kind == Type_Varbit);
+  struct Type proto = {};
+  proto.kind = kind;
+  proto.width = width;
+  return intern_type(&proto);
+}
+
+struct Type*
+type_nominal(enum TypeKind kind, char* name, struct Ast* decl)
+{
+  assert(kind >= Type_TypeVar);
+  struct Type proto = {};
+  proto.kind = kind;
+  proto.width = -1;
+  proto.name = name;
+  proto.decl = decl;
+  return intern_type(&proto);
+}
+
+struct Type*
+type_tuple(struct Type** elems, int elem_count)
+{
+  struct Type proto = {};
+  proto.kind = Type_Tuple;
+  proto.width = -1;
+  proto.args = elems;
+  proto.arg_count = elem_count;
+  return intern_type(&proto);
+}
+
+struct Type*
+type_stack(struct Type* elem, int size)
+{
+  struct Type proto = {};
+  proto.kind = Type_HeaderStack;
+  proto.width = size;
+  proto.base = elem;
+  return intern_type(&proto);
+}
+
+struct Type*
+type_specialized(struct Type* base, struct Type** args, int arg_count)
+{
+  struct Type proto = {};
+  proto.kind = Type_Specialized;
+  proto.width = -1;
+  proto.base = base;
+  proto.args = args;
+  proto.arg_count = arg_count;
+  return intern_type(&proto);
+}
+
+struct Type*
+type_function(struct Type* return_type, struct Type** params, int param_count)
+{
+  struct Type proto = {};
+  proto.kind = Type_Function;
+  proto.width = -1;
+  proto.base = return_type;
+  proto.args = params;
+  proto.arg_count = param_count;
+  return intern_type(&proto);
+}
+
+internal uint32_t
+member_name_hash(char* name)
+{
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void
+type_set_members(struct Type* type, struct TypeMember* members, int member_count)
+{
+  assert(type->kind >= Type_TypeVar || type->kind == Type_ApplyResult || type->kind == Type_Error);
+  type->members = members;
+  type->member_count = member_count;
+  type->member_index = 0;
+  type->member_next = 0;
+  if (member_count < TYPE_MEMBER_INDEX_THRESHOLD) {
+    return;
+  }
+  int capacity = 16;
+  while (capacity < 2 * member_count) {
+    capacity *= 2;
+  }
+  type->member_index_mask = capacity - 1;
+  type->member_index = arena_push(type_storage, capacity * sizeof(*type->member_index));
+  type->member_next = arena_push(type_storage, member_count * sizeof(*type->member_next));
+  int i;
+  for (i = 0; i < capacity; i++) {
+    type->member_index[i] = -1;
+  }
+  /* Inserted back to front, so that overloads chain up in declaration order. */
+  for (i = member_count - 1; i >= 0; i--) {
+    uint32_t h = member_name_hash(members[i].name) & type->member_index_mask;
+    type->member_next[i] = -1;
+    while (type->member_index[h] >= 0) {
+      if (cstr_match(members[type->member_index[h]].name, members[i].name)) {
+        type->member_next[i] = type->member_index[h];
+        break;
+      }
+      h = (h + 1) & type->member_index_mask;
+    }
+    type->member_index[h] = i;
+  }
+}
+
+internal bool
+member_takes(struct TypeMember* member, int arg_count)
+{
+  return arg_count < 0 || (member->type->kind == Type_Function && member->type->arg_count == arg_count);
+}
+
+/* With `arg_count` >= 0, a method of that many parameters is preferred among overloads. */
+struct TypeMember*
+type_find_member(struct Type* type, char* name, int arg_count)
+{
+  type = type_generic_base(type);
+  struct TypeMember* found = 0;
+  int i;
+  if (type->member_index) {
+    uint32_t h = member_name_hash(name) & type->member_index_mask;
+    while ((i = type->member_index[h]) >= 0) {
+      if (cstr_match(type->members[i].name, name)) {
+        found = &type->members[i];
+        for (; i >= 0; i = type->member_next[i]) {
+          if (member_takes(&type->members[i], arg_count)) {
+            return &type->members[i];
+          }
+        }
+        break;
+      }
+      h = (h + 1) & type->member_index_mask;
+    }
+    return found;
+  }
+  for (i = 0; i < type->member_count; i++) {
+    struct TypeMember* member = &type->members[i];
+    if (cstr_match(member->name, name)) {
+      if (!found) {
+        found = member;
+      }
+      if (member_takes(member, arg_count)) {
+        found = member;
+        break;
+      }
+    }
+  }
+  return found;
+}
+
+struct Type*
+type_generic_base(struct Type* type)
+{
+  if (type->kind == Type_Specialized) {
+    return type->base;
+  }
+  return type;
+}
+
+bool
+type_is_integral(struct Type* type)
+{
+  return type->kind == Type_Int || type->kind == Type_Bit || type->kind == Type_SignedInt;
+}
+
+bool
+type_is_assignable(struct Type* to, struct Type* from)
+{
+  if (to == from) {
+    return true;
+  }
+  if (to->kind == Type_Unknown || from->kind == Type_Unknown || to->kind == Type_Dontcare || from->kind == Type_Dontcare
+      || to->kind == Type_TypeVar || from->kind == Type_TypeVar) {
+    return true;
+  }
+  if (from->kind == Type_Int) {
+    return type_is_integral(to) || to->kind == Type_Varbit;
+  }
+  if (to->kind == from->kind && (to->kind == Type_Bit || to->kind == Type_SignedInt || to->kind == Type_Varbit)) {
+    /* A width that is not a literal is only known after constant evaluation. */
+    return to->width < 0 || from->width < 0;
+  }
+  if (from->kind == Type_Enum && from->base) {
+    return type_is_assignable(to, from->base);
+  }
+  if (type_generic_base(to)->kind == type_generic_base(from)->kind
+      && (type_generic_base(to)->kind == Type_Parser || type_generic_base(to)->kind == Type_Control)) {
+    /* A parser or control matches the (generic) parser or control type of a package parameter. */
+    return true;
+  }
+  if (to->kind == Type_Specialized || from->kind == Type_Specialized) {
+    return type_generic_base(to) == type_generic_base(from);
+  }
+  if (from->kind == Type_Tuple) {
+    /* List expressions initialize tuples, structs and headers. */
+    if (to->kind == Type_Tuple) {
+      if (to->arg_count != from->arg_count) {
+        return false;
+      }
+      int i;
+      for (i = 0; i < to->arg_count; i++) {
+        if (!type_is_assignable(to->args[i], from->args[i]))
+          return false;
+      }
+      return true;
+    }
+    return to->kind == Type_Struct || to->kind == Type_Header || to->kind == Type_HeaderUnion;
+  }
+  if (to->kind == Type_HeaderStack && from->kind == Type_HeaderStack) {
+    return to->width == from->width && type_is_assignable(to->base, from->base);
+  }
+  return false;
+}
+
+internal int
+format_type(char* buf, int size, struct Type* type)
+{
+  static char* basic_names[] = {
+    [Type_Unknown] = "?", [Type_Dontcare] = "_", [Type_Void] = "void", [Type_Bool] = "bool",
+    [Type_String] = "string", [Type_Error] = "error", [Type_MatchKind] = "match_kind", [Type_Int] = "int",
+  };
+  int len = 0;
+  if (type->kind == Type_Bit || type->kind == Type_SignedInt || type->kind == Type_Varbit) {
+    char* prefix = type->kind == Type_Bit ? "bit" : type->kind == Type_SignedInt ? "int" : "varbit";
+    if (type->width >= 0) {
+      len = snprintf(buf, size, "%s<%d>", prefix, type->width);
+    } else {
+      len = snprintf(buf, size, "%s<?>", prefix);
+    }
+  } else if (type->kind >= Type_TypeVar) {
+    len = snprintf(buf, size, "%s", type->name ? type->name : "?");
+  } else if (type->kind == Type_HeaderStack) {
+    len = format_type(buf, size, type->base);
+    len += snprintf(buf + len, size > len ? size - len : 0, "[%d]", type->width);
+  } else if (type->kind == Type_Tuple || type->kind == Type_Specialized || type->kind == Type_Function) {
+    if (type->kind == Type_Tuple) {
+      len = snprintf(buf, size, "tuple<");
+    } else {
+      len = format_type(buf, size, type->base);
+      len += snprintf(buf + len, size > len ? size - len : 0, type->kind == Type_Function ? "(" : "<");
+    }
+    int i;
+    for (i = 0; i < type->arg_count; i++) {
+      if (i > 0) {
+        len += snprintf(buf + len, size > len ? size - len : 0, ", ");
+      }
+      len += format_type(buf + len, size > len ? size - len : 0, type->args[i]);
+    }
+    len += snprintf(buf + len, size > len ? size - len : 0, type->kind == Type_Function ? ")" : ">");
+  } else if (type->kind == Type_ApplyResult) {
+    len = snprintf(buf, size, "apply_result");
+  } else {
+    len = snprintf(buf, size, "%s", basic_names[type->kind]);
+  }
+  return len;
+}
+
+/* For diagnostics; the string lives in the type storage. */
+char*
+type_to_string(struct Type* type)
+{
+  char buf[256];
+  format_type(buf, sizeof(buf), type);
+  buf[sizeof(buf) - 1] = '\0';
+  int len = cstr_len(buf);
+  char* str = arena_push(type_storage, len + 1);
+  cstr_copy(str, buf);
+  str[len] = '\0';
+  return str;
+}
+
+int
+types_count()
+{
+  return type_count;
+}
+
+void
+types_init()
+{
+  table_capacity_log2 = 8;
+  table_capacity = 1 << table_capacity_log2;
+  type_table = arena_push(type_storage, table_capacity * sizeof(*type_table));
+  memset(type_table, 0, table_capacity * sizeof(*type_table));
+  type_count = 0;
+}
+
+void
+types_set_storage(struct Arena* type_storage_)
+{
+  type_storage = type_storage_;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "arena.h"
+#include "ast.h"
+
+
+enum TypeKind {
+  Type_NONE_,
+  Type_Unknown,     /* not inferred (yet); compatible with everything */
+  Type_Dontcare,
+  Type_Void,
+  Type_Bool,
+  Type_String,
+  Type_Error,
+  Type_MatchKind,
+  Type_Int,         /* arbitrary-precision integer, the type of unsized literals */
+  Type_Bit,         /* bit<N> */
+  Type_SignedInt,   /* int<N> */
+  Type_Varbit,      /* varbit<N> */
+  Type_Tuple,
+  Type_HeaderStack,
+  Type_Specialized,
+  Type_Function,
+  Type_ApplyResult,
+  /* Nominal types: one object per declaration. */
+  Type_TypeVar,
+  Type_Struct,
+  Type_Header,
+  Type_HeaderUnion,
+  Type_Enum,
+  Type_NewType,
+  Type_Extern,
+  Type_Parser,
+  Type_Control,
+  Type_Package,
+  Type_Table,
+  Type_State,
+};
+
+#define TYPE_MEMBER_INDEX_THRESHOLD  8
+
+struct TypeMember {
+  char* name;
+  struct Type* type;
+  struct Ast* decl;
+};
+
+/*
+ * Types are hash-consed: structurally equal types are the same object, and
+ * nominal types are unique per declaration.  Two types are equal iff their
+ * pointers are.
+ */
+struct Type {
+  enum TypeKind kind;
+  int id;
+  int width;                  /* bit/int/varbit width, header stack size; -1 if not known */
+  char* name;                 /* nominal types */
+  struct Ast* decl;           /* nominal types */
+  struct Type* base;          /* stack element, specialized generic, function return, newtype/enum representation */
+  struct Type** args;         /* tuple elements, type arguments, function parameters */
+  int arg_count;
+  struct TypeMember* members; /* fields, enum members, methods; set once the declaration is checked */
+  int member_count;
+  int* member_index;          /* hash index over `members`, for types with many of them */
+  int* member_next;           /* next member with the same name (overloads) */
+  int member_index_mask;
+  struct Type* next_in_bucket;
+};
+
+
+void types_set_storage(struct Arena* type_storage_);
+void types_init();
+int types_count();
+
+struct Type* type_basic(enum TypeKind kind);
+struct Type* type_sized(enum TypeKind kind, int width);
+struct Type* type_nominal(enum TypeKind kind, char* name, struct Ast* decl);
+struct Type* type_tuple(struct Type** elems, int elem_count);
+struct Type* type_stack(struct Type* elem, int size);
+struct Type* type_specialized(struct Type* base, struct Type** args, int arg_count);
+struct Type* type_function(struct Type* return_type, struct Type** params, int param_count);
+
+void type_set_members(struct Type* type, struct TypeMember* members, int member_count);
+struct TypeMember* type_find_member(struct Type* type, char* name, int arg_count);
+struct Type* type_generic_base(struct Type* type);
+bool type_is_integral(struct Type* type);
+bool type_is_assignable(struct Type* to, struct Type* from);
+char* type_to_string(struct Type* type);